@@ -6,8 +6,161 @@
 
 #define HVPP_MAX_CPU  256
 
+//
+// HVPP_MOCK is defined by the user-mode build of the core (hvpp-mock.vcxproj,
+// used by hvppbench) - privileged instructions are then mocked (see
+// ia32/mock/cpu.h) and OS-specific code is taken from lib/user.  Don't
+// define it here.
+//
+
+//
+// EPT layout used by VCPUs.  This is used to estimate the amount of
+// memory reserved for the hypervisor memory pool (see driver::common)
+// and selects the pages of the shared identity map.
+//   HVPP_EPT_MODE_SHARED - VCPUs use copy-on-write views of the single
+//                          shared identity map (see hypervisor::shared_ept())
+//   HVPP_EPT_MODE_2MB    - each VCPU has its own identity map (2MB pages)
+//   HVPP_EPT_MODE_1GB    - same as HVPP_EPT_MODE_SHARED, but the shared
+//                          identity map uses 1GB pages where the MTRRs
+//                          allow it (see ept_t::map_identity_1gb()) - 2MB
+//                          pages are used if the CPU doesn't support them
+//   HVPP_EPT_MODE_LAZY   - each VCPU has its own lazily populated identity map
+//
+
+#define HVPP_EPT_MODE_SHARED  0
+#define HVPP_EPT_MODE_2MB     1
+#define HVPP_EPT_MODE_1GB     2
+#define HVPP_EPT_MODE_LAZY    3
+
+#define HVPP_EPT_MODE         HVPP_EPT_MODE_SHARED
+
+//
+// Memory reserved for each CPU for VM-exit handlers (in addition to
+// the estimated EPT size).  If the hypervisor begins to run out of memory,
+// this is the right value to adjust.
+//
+
+#define HVPP_HANDLER_MEMORY_PER_CPU  (32 * 1024 * 1024)
+
+//
+// Size of the per-VCPU scratch arena (see vcpu_t::scratch()).  The arena
+// is allocated from the handler memory above and released at the end of
+// each VM-exit.
+//
+
+#define HVPP_VCPU_SCRATCH_SIZE       (64 * 1024)
+
+//
+// Size of the host (VMX-root mode) stack of each VCPU.  Must be power
+// of 2 - the VCPU is aligned to it (see vcpu_t::current()).  Unused
+// part of the stack still costs memory on every CPU, check the
+// high-water mark of the stacks (mm::statistics_t::host_stack_used)
+// before changing it.
+//
+
+#define HVPP_VCPU_STACK_SIZE         0x8000
+
+//
+// Uncomment this to measure latency of each VM-exit (TSC-based) and
+// collect it in per-CPU, per-exit-reason histograms (see
+// vcpu_t::exit_timing()).
+//
+// #define HVPP_ENABLE_EXIT_TIMING
+
+//
+// Uncomment this to compile in the self-benchmark of the allocator, EPT,
+// bitmap and MTRR primitives (see hvppdrv/self_benchmark.h).  Meant only
+// for benchmark builds - the IOCTL allocates and maps EPTs on request.
+//
+// #define HVPP_ENABLE_SELF_BENCHMARK
+
+//
+// Log messages below this level are removed at compile time, including
+// evaluation of their arguments (see hvpp_log in lib/log.h).
+//   0x01 - trace, 0x02 - debug, 0x04 - info, 0x08 - warn, 0x10 - error
+//
+
+#define HVPP_LOG_MIN_LEVEL  0x01
+
+//
+// Uncomment this to log in the binary form - hvpp_info() and friends
+// store only the ID of the (compile-time) format descriptor and raw
+// integer/pointer arguments into the per-CPU trace ring, formatting is
+// deferred to the drainer thread (see lib/log.h).  Note that all "%s"
+// arguments must be static strings then.
+//
+// #define HVPP_LOG_BINARY
+
+//
+// Uncomment this to keep VM-exit statistics (see vmexit_stats_handler)
+// in small per-CPU hash tables instead of dense arrays (~640kb per CPU).
+//
+// #define HVPP_VMEXIT_STATS_SPARSE
+
+//
+// Uncomment these to keep only selected categories of sub-reasons in the
+// dense storage of vmexit_stats_handler and vmexit_dbgbreak_handler
+// (comma-separated tags of hvpp::vmexit_storage_category, VM-exit reasons
+// are always kept).  Empty define keeps VM-exit reasons only, undefined
+// keeps all categories.  E.g. VM-exit reasons and CPUID leafs take ~400
+// bytes per CPU instead of ~640kb.
+//
+// #define HVPP_VMEXIT_STATS_CATEGORIES     hvpp::vmexit_storage_category::cpuid
+// #define HVPP_VMEXIT_DBGBREAK_CATEGORIES  hvpp::vmexit_storage_category::cpuid, \
+//                                          hvpp::vmexit_storage_category::io
+
+//
+// How the extended (x87/SSE/AVX) state of the interrupted code is
+// preserved across a VM-exit (see vcpu_t::entry_host()).
+//   HVPP_XSTATE_MODE_FXSAVE    - FXSAVE/FXRSTOR of the x87 and SSE state
+//   HVPP_XSTATE_MODE_XSAVEOPT  - XSAVEOPT/XRSTOR of all enabled state
+//                                components, which skips components that
+//                                are in their init state or weren't modified
+//                                since the last XRSTOR (falls back to
+//                                HVPP_XSTATE_MODE_FXSAVE if the CPU or the
+//                                OS doesn't support it)
+//   HVPP_XSTATE_MODE_NONE      - no save at all - use only if the hypervisor
+//                                is built so that no x87/SSE/AVX instruction
+//                                is ever executed in the VMX-root mode
+//
+
+#define HVPP_XSTATE_MODE_FXSAVE    0
+#define HVPP_XSTATE_MODE_XSAVEOPT  1
+#define HVPP_XSTATE_MODE_NONE      2
+
+#define HVPP_XSTATE_MODE           HVPP_XSTATE_MODE_FXSAVE
+
+//
+// Uncomment this if VCPUs should run in the address space owned by the
+// hypervisor (with the direct map of the physical memory - see
+// host_page_table) instead of the CR3 of the interrupted process.
+//
+// #define HVPP_HOST_PAGE_TABLES
+
+//
+// Uncomment this to use the enlightened VMCS when running nested under
+// Hyper-V (detected via CPUID - the hardware VMCS is used otherwise).
+// VMREAD/VMWRITE become memory accesses instead of traps to the L0
+// hypervisor, but the fast path (vcpu.asm), the VMCS template and
+// controls without enlightened VMCS fields (PML, #VE, VMFUNC, posted
+// interrupts, ...) aren't available (see ia32/vmx/evmcs.h).
+//
+// #define HVPP_ENLIGHTENED_VMCS
+
 //
 // Uncomment this if you plan to intercept I/O ports 0x5658/0x5659
 // in VMWare and you don't want the VMWare Tools to crash.
 //
+// The workaround is enabled at runtime, only if VMWare is detected
+// (via CPUID) - on other hosts, I/O of the backdoor ports takes the
+// regular path and #GPs aren't decoded.
+//
 #define HVPP_ENABLE_VMWARE_WORKAROUND
+
+//
+// The user-mode build has no backdoor ports to talk to - lib/vmware
+// (vmware.cpp, ioctx.asm) isn't part of hvpp-mock.vcxproj.
+//
+#ifdef HVPP_MOCK
+# undef HVPP_ENABLE_VMWARE_WORKAROUND
+#endif
@@ -0,0 +1,348 @@
+#include "cpuid_policy.h"
+#include "hypervisor.h"
+
+#include "ia32/asm.h"
+
+#include "lib/assert.h"
+
+#include <cstring>
+
+namespace hvpp {
+
+namespace detail
+{
+  static auto cpuid_range(uint32_t leaf) noexcept -> uint32_t
+  { return leaf >> 30; }
+
+  static auto cpuid_index(uint32_t leaf) noexcept -> uint32_t
+  { return leaf & 0x3fff'ffff; }
+}
+
+cpuid_policy::cpuid_policy() noexcept
+  : rule_{}
+  , rule_count_{ 0 }
+  , passthrough_{}
+{
+  //
+  // EBX of the leaf 0xD depends on the current XCR0 (and IA32_XSS).
+  //
+  passthrough_[0] |= 1u << 0xd;
+
+  const auto err = per_vcpu_.initialize();
+  hvpp_assert(!err);
+  (void)(err);
+}
+
+auto cpuid_policy::mask(uint32_t leaf, uint32_t subleaf,
+                        const registers_t& clear_mask, const registers_t& set_mask) noexcept -> error_code_t
+{
+  return add_rule(leaf, subleaf, clear_mask, set_mask);
+}
+
+auto cpuid_policy::set(uint32_t leaf, uint32_t subleaf, const registers_t& value) noexcept -> error_code_t
+{
+  static constexpr registers_t clear_all = { ~0u, ~0u, ~0u, ~0u };
+
+  return add_rule(leaf, subleaf, clear_all, value);
+}
+
+auto cpuid_policy::passthrough(uint32_t leaf) noexcept -> error_code_t
+{
+  hvpp_assert(!hypervisor::is_started());
+
+  const auto range = detail::cpuid_range(leaf);
+  const auto index = detail::cpuid_index(leaf);
+
+  if (range >= range_count || index >= leaf_count)
+  {
+    //
+    // Leaves outside of the table are never cached anyway.
+    //
+    return error_code_t{};
+  }
+
+  passthrough_[range] |= 1u << index;
+  return error_code_t{};
+}
+
+void cpuid_policy::setup(vcpu_t& vp) noexcept
+{
+  auto& table = per_vcpu_[vp.cpu_index()];
+  memset(&table, 0, sizeof(table));
+
+  //
+  // Note that this method is called on the CPU of the VCPU - CPUID
+  // returns values of this CPU (e.g. its APIC ID).
+  //
+  uint32_t cpu_info[4];
+
+  ia32_asm_cpuid(cpu_info, 0x0000'0000);
+  const auto max_basic_leaf = cpu_info[0];
+
+  for (uint32_t leaf = 0x0000'0000; leaf <= max_basic_leaf && leaf < 0x0000'0000 + leaf_count; ++leaf)
+  {
+    capture_leaf(table, leaf);
+  }
+
+  ia32_asm_cpuid(cpu_info, 0x8000'0000);
+  const auto max_extended_leaf = cpu_info[0];
+
+  for (uint32_t leaf = 0x8000'0000; leaf <= max_extended_leaf && leaf < 0x8000'0000 + leaf_count; ++leaf)
+  {
+    capture_leaf(table, leaf);
+  }
+
+  for (uint32_t rule_index = 0; rule_index < rule_count_; ++rule_index)
+  {
+    const auto& rule = rule_[rule_index];
+
+    if (passthrough_[detail::cpuid_range(rule.leaf)] & (1u << detail::cpuid_index(rule.leaf)))
+    {
+      continue;
+    }
+
+    auto& leaf = table.leaf[detail::cpuid_range(rule.leaf)][detail::cpuid_index(rule.leaf)];
+
+    if (!leaf.count)
+    {
+      create_leaf(table, rule.leaf, rule.subleaf != any_subleaf);
+    }
+
+    for (uint32_t subleaf = 0; subleaf < leaf.count; ++subleaf)
+    {
+      if (leaf.indexed && rule.subleaf != any_subleaf && rule.subleaf != subleaf)
+      {
+        continue;
+      }
+
+      auto& entry = table.entry[leaf.first + subleaf];
+
+      for (int i = 0; i < 4; ++i)
+      {
+        entry[i] = (entry[i] & ~rule.clear_mask[i]) | rule.set_mask[i];
+      }
+    }
+  }
+}
+
+bool cpuid_policy::dispatch(vcpu_t& vp) noexcept
+{
+  auto& context = vp.exit_context();
+
+  const auto leaf = context.eax;
+  const auto subleaf = context.ecx;
+  const auto entry = find(per_vcpu_[vp.cpu_index()], leaf, subleaf);
+
+  if (!entry)
+  {
+    return false;
+  }
+
+  auto ecx = (*entry)[2];
+
+  //
+  // CPUID.01H:ECX.OSXSAVE[bit 27] and CPUID.(EAX=07H,ECX=0H):ECX.OSPKE[bit 4]
+  // reflect CR4.OSXSAVE and CR4.PKE.
+  //
+  if (leaf == 0x0000'0001)
+  {
+    ecx = (ecx & ~(1u << 27)) | (uint32_t(vp.guest_cr4().os_xsave) << 27);
+  }
+  else if (leaf == 0x0000'0007 && subleaf == 0)
+  {
+    ecx = (ecx & ~(1u << 4)) | (uint32_t(vp.guest_cr4().protection_key_enable) << 4);
+  }
+
+  context.rax = (*entry)[0];
+  context.rbx = (*entry)[1];
+  context.rcx = ecx;
+  context.rdx = (*entry)[3];
+
+  return true;
+}
+
+auto cpuid_policy::add_rule(uint32_t leaf, uint32_t subleaf,
+                            const registers_t& clear_mask, const registers_t& set_mask) noexcept -> error_code_t
+{
+  hvpp_assert(!hypervisor::is_started());
+
+  if (detail::cpuid_range(leaf) >= range_count ||
+      detail::cpuid_index(leaf) >= leaf_count ||
+      (subleaf != any_subleaf && subleaf >= max_subleaf_count))
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  if (rule_count_ == max_rule_count)
+  {
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  auto& rule = rule_[rule_count_++];
+  rule.leaf = leaf;
+  rule.subleaf = subleaf;
+  memcpy(rule.clear_mask, clear_mask, sizeof(rule.clear_mask));
+  memcpy(rule.set_mask, set_mask, sizeof(rule.set_mask));
+
+  return error_code_t{};
+}
+
+bool cpuid_policy::is_indexed(uint32_t leaf) noexcept
+{
+  //
+  // Leaves whose output depends on the value in ECX.
+  // (ref: Vol2A[3.2(CPUID-CPU Identification)])
+  //
+  switch (leaf)
+  {
+    case 0x04: case 0x07: case 0x0b: case 0x0d:
+    case 0x0f: case 0x10: case 0x12: case 0x14:
+    case 0x17: case 0x18: case 0x1b: case 0x1d:
+    case 0x1e: case 0x1f:
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+void cpuid_policy::capture_leaf(table_t& table, uint32_t leaf) noexcept
+{
+  const auto range = detail::cpuid_range(leaf);
+  const auto index = detail::cpuid_index(leaf);
+
+  if (passthrough_[range] & (1u << index))
+  {
+    return;
+  }
+
+  const bool indexed = range == 0 && is_indexed(leaf);
+
+  //
+  // Number of cached subleaves.  Subleaves which aren't cached are left
+  // to the caller, therefore the count only affects how many VM-exits
+  // are served from the table.
+  //
+  uint32_t count = 1;
+
+  if (indexed)
+  {
+    uint32_t cpu_info[4];
+    ia32_asm_cpuid_ex(cpu_info, leaf, 0);
+
+    switch (leaf)
+    {
+      case 0x04:
+      case 0x0b:
+      case 0x1f:
+        //
+        // Enumerated until the first invalid subleaf (cache type 0 in
+        // EAX[4:0], or level type 0 in ECX[15:8]).
+        //
+        count = 0;
+        while (count < max_subleaf_count)
+        {
+          ia32_asm_cpuid_ex(cpu_info, leaf, count);
+          if ((leaf == 0x04 ? (cpu_info[0] & 0x1f) : (cpu_info[2] & 0xff00)) == 0)
+          {
+            break;
+          }
+
+          ++count;
+        }
+        break;
+
+      case 0x07: case 0x14: case 0x17:
+      case 0x18: case 0x1d:
+        //
+        // EAX of the subleaf 0 holds the maximum subleaf.
+        //
+        count = cpu_info[0] < max_subleaf_count
+          ? cpu_info[0] + 1
+          : max_subleaf_count;
+        break;
+
+      default:
+        count = 4;
+        break;
+    }
+
+    //
+    // Subleaves targeted by rules are always cached.
+    //
+    for (uint32_t rule_index = 0; rule_index < rule_count_; ++rule_index)
+    {
+      const auto& rule = rule_[rule_index];
+
+      if (rule.leaf == leaf && rule.subleaf != any_subleaf && rule.subleaf >= count)
+      {
+        count = rule.subleaf + 1;
+      }
+    }
+  }
+
+  if (count == 0 || table.entry_count + count > max_entry_count)
+  {
+    return;
+  }
+
+  auto& entry = table.leaf[range][index];
+  entry.first   = uint8_t(table.entry_count);
+  entry.count   = uint8_t(count);
+  entry.indexed = indexed;
+
+  for (uint32_t subleaf = 0; subleaf < count; ++subleaf)
+  {
+    ia32_asm_cpuid_ex(table.entry[table.entry_count++], leaf, subleaf);
+  }
+}
+
+void cpuid_policy::create_leaf(table_t& table, uint32_t leaf, bool indexed) noexcept
+{
+  //
+  // Leaf created by the rule - the processor doesn't report it (or it
+  // isn't cached), values are zero until the rules are applied.
+  //
+  const uint32_t count = indexed ? max_subleaf_count : 1;
+
+  if (table.entry_count + count > max_entry_count)
+  {
+    return;
+  }
+
+  auto& entry = table.leaf[detail::cpuid_range(leaf)][detail::cpuid_index(leaf)];
+  entry.first   = uint8_t(table.entry_count);
+  entry.count   = uint8_t(count);
+  entry.indexed = indexed;
+
+  table.entry_count += count;
+}
+
+auto cpuid_policy::find(table_t& table, uint32_t leaf, uint32_t subleaf) noexcept -> registers_t*
+{
+  const auto range = detail::cpuid_range(leaf);
+  const auto index = detail::cpuid_index(leaf);
+
+  if (range >= range_count || index >= leaf_count)
+  {
+    return nullptr;
+  }
+
+  const auto& entry = table.leaf[range][index];
+
+  if (!entry.count)
+  {
+    return nullptr;
+  }
+
+  if (!entry.indexed)
+  {
+    return &table.entry[entry.first];
+  }
+
+  return subleaf < entry.count
+    ? &table.entry[entry.first + subleaf]
+    : nullptr;
+}
+
+}
@@ -0,0 +1,140 @@
+#pragma once
+#include "vcpu.h"
+
+#include "lib/error.h"
+#include "lib/per_cpu.h"
+
+#include <cstdint>
+
+namespace hvpp {
+
+//
+// CPUID cache.
+//
+// CPUID always causes VM-exit and executing the real CPUID in the
+// handler adds another serializing instruction.  The policy captures
+// stable CPUID leaves (and their subleaves) of each CPU in setup() and
+// serves CPUID VM-exits of these leaves from the memory.  Leaves which
+// aren't cached (e.g. leaf 0xD, whose EBX depends on XCR0, or leaves
+// above the maximum leaf) are left to the caller.
+//
+// Values can be overridden or masked by rules, so that handlers can
+// present modified CPUID without their own CPUID handling.  Rules are
+// applied once, when the table is captured.  Rules can also create
+// leaves which aren't reported by the processor (e.g. in the hypervisor
+// range 0x4000'0000).
+//
+// Bits reflecting the current CR4 of the guest (OSXSAVE, OSPKE) are
+// updated on each VM-exit.
+//
+// Usage:
+//   cpuid_policy_.mask(1, cpuid_policy::any_subleaf,    // e.g. in the ctor
+//                      { 0, 0, 1u << 31, 0 }, { 0, 0, 0, 0 });
+//
+//   void my_handler::setup(vcpu_t& vp) noexcept
+//   {
+//     cpuid_policy_.setup(vp);
+//   }
+//
+//   void my_handler::handle_execute_cpuid(vcpu_t& vp) noexcept
+//   {
+//     if (!cpuid_policy_.dispatch(vp))
+//     {
+//       base_type::handle_execute_cpuid(vp);
+//     }
+//   }
+//
+
+class cpuid_policy
+{
+  public:
+    static constexpr uint32_t any_subleaf = ~0u;
+
+    //
+    // Leaves 0x0000'0000 - 0x0000'001F, 0x4000'0000 - 0x4000'001F
+    // and 0x8000'0000 - 0x8000'001F can be cached.
+    //
+    static constexpr uint32_t range_count = 3;
+    static constexpr uint32_t leaf_count = 32;
+    static constexpr uint32_t max_subleaf_count = 8;
+    static constexpr uint32_t max_entry_count = 128;
+    static constexpr uint32_t max_rule_count = 32;
+
+    using registers_t = uint32_t[4];            // EAX, EBX, ECX, EDX
+
+    cpuid_policy() noexcept;
+
+    cpuid_policy(const cpuid_policy& other) noexcept = delete;
+    cpuid_policy(cpuid_policy&& other) noexcept = delete;
+    cpuid_policy& operator=(const cpuid_policy& other) noexcept = delete;
+    cpuid_policy& operator=(cpuid_policy&& other) noexcept = delete;
+
+    //
+    // These methods must be called before the hypervisor is started.
+    //
+    // mask() clears bits of "clear_mask" and then sets bits of "set_mask" in
+    // the value reported by the processor, set() replaces the value.  Rules
+    // are applied in order.  passthrough() excludes the leaf from the
+    // cache - it's always executed by the caller.
+    //
+    auto mask(uint32_t leaf, uint32_t subleaf, const registers_t& clear_mask, const registers_t& set_mask) noexcept -> error_code_t;
+    auto set(uint32_t leaf, uint32_t subleaf, const registers_t& value) noexcept -> error_code_t;
+    auto passthrough(uint32_t leaf) noexcept -> error_code_t;
+
+    //
+    // Capture the CPUID table of the current CPU (called from
+    // vmexit_handler::attach()).
+    //
+    void setup(vcpu_t& vp) noexcept;
+
+    //
+    // Serve the CPUID VM-exit from the table.  Returns false if the
+    // leaf (or the subleaf) isn't cached.
+    //
+    bool dispatch(vcpu_t& vp) noexcept;
+
+  private:
+    struct rule_t
+    {
+      uint32_t    leaf;
+      uint32_t    subleaf;
+      registers_t clear_mask;
+      registers_t set_mask;
+    };
+
+    struct leaf_t
+    {
+      uint8_t first;                            // index into entry[]
+      uint8_t count;                            // 0 = not cached
+      bool    indexed;                          // has subleaves
+    };
+
+    struct table_t
+    {
+      leaf_t      leaf[range_count][leaf_count];
+      uint32_t    entry_count;
+      registers_t entry[max_entry_count];
+    };
+
+    static_assert(max_entry_count <= 256);
+
+    auto add_rule(uint32_t leaf, uint32_t subleaf, const registers_t& clear_mask, const registers_t& set_mask) noexcept -> error_code_t;
+
+    static bool is_indexed(uint32_t leaf) noexcept;
+
+    void capture_leaf(table_t& table, uint32_t leaf) noexcept;
+    void create_leaf(table_t& table, uint32_t leaf, bool indexed) noexcept;
+    static auto find(table_t& table, uint32_t leaf, uint32_t subleaf) noexcept -> registers_t*;
+
+    rule_t   rule_[max_rule_count];
+    uint32_t rule_count_;
+
+    //
+    // Bit N = leaf N of the range is never cached.
+    //
+    uint32_t passthrough_[range_count];
+
+    per_cpu<table_t> per_vcpu_;
+};
+
+}
@@ -0,0 +1,94 @@
+#include "cr3_policy.h"
+#include "hypervisor.h"
+
+#include "ia32/msr.h"
+
+#include "lib/assert.h"
+
+#include <algorithm>
+
+namespace hvpp {
+
+cr3_policy::cr3_policy() noexcept
+  : watch_pfn_{}
+  , watch_count_{ 0 }
+  , target_max_{ std::min<uint32_t>(4, msr::read<msr::vmx_misc_t>().cr3_target_count) }
+  , per_vcpu_{}
+{
+
+}
+
+auto cr3_policy::watch(cr3_t cr3) noexcept -> error_code_t
+{
+  hvpp_assert(!hypervisor::is_started());
+
+  if (watch_count_ == max_watch_count)
+  {
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  watch_pfn_[watch_count_++] = cr3.page_frame_number;
+  return error_code_t{};
+}
+
+void cr3_policy::setup(vcpu_t& vp) noexcept
+{
+  per_vcpu_[vp.cpu_index()] = per_vcpu_t{};
+
+  auto procbased_ctls = vp.processor_based_controls();
+  procbased_ctls.cr3_load_exiting = true;
+  vp.processor_based_controls(procbased_ctls);
+
+  vp.cr3_target_count(0);
+}
+
+bool cr3_policy::mov_to_cr3(vcpu_t& vp, cr3_t cr3) noexcept
+{
+  const auto watch_end = watch_pfn_ + watch_count_;
+
+  if (std::find(watch_pfn_, watch_end, cr3.page_frame_number) != watch_end)
+  {
+    return true;
+  }
+
+  if (target_max_ == 0)
+  {
+    return false;
+  }
+
+  //
+  // Count VM-exits caused by this value in a small direct-mapped table
+  // (page frame numbers of page directories are rather random, so the
+  // low bits are good enough as a hash).
+  //
+  auto& data = per_vcpu_[vp.cpu_index()];
+  auto& candidate = data.candidate[cr3.page_frame_number % candidate_count];
+
+  if (candidate.cr3 != cr3.flags)
+  {
+    candidate.cr3 = cr3.flags;
+    candidate.hits = 0;
+  }
+
+  if (++candidate.hits < promote_threshold)
+  {
+    return false;
+  }
+
+  //
+  // Move the value into the CR3-target list - replace the oldest
+  // target if the list is full.
+  //
+  vp.cr3_target_value(data.target_next, cr3);
+  data.target_next = (data.target_next + 1) % target_max_;
+
+  if (data.target_count < target_max_)
+  {
+    vp.cr3_target_count(++data.target_count);
+  }
+
+  candidate = candidate_t{};
+  return false;
+}
+
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include "vcpu.h"
+
+#include "lib/error.h"
+
+#include <cstdint>
+
+namespace hvpp {
+
+//
+// CR3-load interception policy.
+//
+// Handlers which care only about few address spaces still have to enable
+// "cr3_load_exiting" and then see every context switch.  This policy
+// keeps the list of watched address spaces (compared by the page frame
+// number, therefore regardless of the PCID) and moves CR3 values which
+// are loaded often but aren't watched into the CR3-target list of the
+// VCPU - loads of these values don't cause VM-exit anymore.
+//
+// Note that the software TLB (see vcpu_t::gva_tlb_enable()) doesn't see
+// CR3 loads which don't cause VM-exit - don't combine them.
+//
+// Usage:
+//   cr3_policy_.watch(interesting_cr3);              // e.g. in the ctor
+//
+//   void my_handler::setup(vcpu_t& vp) noexcept
+//   {
+//     cr3_policy_.setup(vp);
+//   }
+//
+//   void my_handler::handle_mov_cr(vcpu_t& vp) noexcept
+//   {
+//     auto exit_qualification = vp.exit_qualification().mov_cr;
+//     if (exit_qualification.access_type == vmx::exit_qualification_mov_cr_t::access_to_cr &&
+//         exit_qualification.cr_number == 3)
+//     {
+//       auto cr3 = cr3_t{ vp.exit_context().gp_register[exit_qualification.gp_register] };
+//       if (cr3_policy_.mov_to_cr3(vp, cr3))
+//       {
+//         // ... watched address space ...
+//       }
+//     }
+//
+//     base_type::handle_mov_cr(vp);
+//   }
+//
+
+class cr3_policy
+{
+  public:
+    //
+    // Maximum number of watched address spaces.
+    //
+    static constexpr size_t max_watch_count = 16;
+
+    //
+    // Number of VM-exits caused by loading the same (not watched) CR3
+    // before it's moved into the CR3-target list.
+    //
+    static constexpr uint32_t promote_threshold = 8;
+
+    cr3_policy() noexcept;
+
+    cr3_policy(const cr3_policy& other) noexcept = delete;
+    cr3_policy(cr3_policy&& other) noexcept = delete;
+    cr3_policy& operator=(const cr3_policy& other) noexcept = delete;
+    cr3_policy& operator=(cr3_policy&& other) noexcept = delete;
+
+    //
+    // Watch the address space.  Must be called before the hypervisor is
+    // started (e.g. in the VM-exit handler constructor).
+    //
+    auto watch(cr3_t cr3) noexcept -> error_code_t;
+
+    //
+    // Enable "cr3_load_exiting" and reset the CR3-target list of the VCPU
+    // (called from vmexit_handler::attach()).
+    //
+    void setup(vcpu_t& vp) noexcept;
+
+    //
+    // Account the MOV to CR3 VM-exit.  Returns true if the source operand
+    // belongs to a watched address space.
+    //
+    bool mov_to_cr3(vcpu_t& vp, cr3_t cr3) noexcept;
+
+  private:
+    static constexpr size_t candidate_count = 8;
+
+    struct candidate_t
+    {
+      uint64_t cr3;
+      uint32_t hits;
+    };
+
+    struct per_vcpu_t
+    {
+      candidate_t candidate[candidate_count];
+      uint32_t    target_count;
+      uint32_t    target_next;
+    };
+
+    uint64_t   watch_pfn_[max_watch_count];
+    uint32_t   watch_count_;
+
+    //
+    // Supported number of CR3-target values (see IA32_VMX_MISC).
+    //
+    uint32_t   target_max_;
+
+    per_vcpu_t per_vcpu_[HVPP_MAX_CPU];
+};
+
+}
@@ -1,15 +1,51 @@
 #include "ept.h"
 
+#include "ia32/vmx.h"
 #include "lib/assert.h"
 #include "lib/mm.h"
 
+#include <algorithm>
 #include <cstring>
+#include <iterator>
+#include <new>
 
 namespace hvpp {
 
+namespace detail {
+
+  //
+  // Paging structures are accounted to the EPT - unless they're
+  // allocated on behalf of another subsystem (e.g. pages split by
+  // hook_manager), which has already tagged its allocations.
+  //
+  static auto table_tag() noexcept -> mm::memory_tag
+  {
+    const auto tag = mm::allocation_tag();
+
+    return tag == mm::memory_tag::untagged || tag == mm::memory_tag::vcpu
+      ? mm::memory_tag::ept
+      : tag;
+  }
+
+}
+
 ept_t::ept_t() noexcept
   : epml4_{}
   , eptptr_{}
+  , base_{ nullptr }
+  , ref_count_{ 0 }
+  , lazy_{ false }
+  , lazy_access_{ epte_t::access_type::none }
+  , table_free_list_{ nullptr }
+  , table_free_count_{ 0 }
+  , table_chunk_{}
+  , table_chunk_count_{ 0 }
+  , table_overflow_count_{ 0 }
+  , entry_cache_{}
+  , generation_{ 0 }
+  , flush_pending_{ false }
+  , loaded_{ false }
+  , violation_pa_{ ~0ull }
 {
   //
   // Initialize EPT's PML4.  Each PML4 maps 512GB of memory.  We would be fine
@@ -19,6 +55,11 @@ ept_t::ept_t() noexcept
   //
   static_assert(sizeof(epte_t) * 512 == page_size);
 
+  for (auto& pml4e : epml4_)
+  {
+    pml4e.clear();
+  }
+
   //
   // Get physical address of EPT's PML4.
   //
@@ -33,9 +74,66 @@ ept_t::ept_t() noexcept
   eptptr_.page_frame_number = empl4_pa.pfn();
 }
 
+ept_t::ept_t(const ept_t& base) noexcept
+  : ept_t()
+{
+  //
+  // Create copy-on-write view of the base EPT.
+  //
+  // Only the PML4 is copied - all PDPTs (and everything below them)
+  // are shared with the base EPT.  Shared entries are marked with the
+  // "shared" flag.  When a shared paging structure is about to be
+  // modified, private copy of it is made first (see unshare_subtable()
+  // method).  This way, many instances of ept_t (e.g. one per each VCPU)
+  // can use single identity map, while paying only for paging structures
+  // they actually modify.
+  //
+  // Note that the base EPT must outlive all of its views and shouldn't
+  // be modified while there are any views referencing it.
+  //
+  memcpy(epml4_, base.epml4_, sizeof(epml4_));
+
+  for (auto& pml4e : epml4_)
+  {
+    if (pml4e.present())
+    {
+      pml4e.shared = true;
+    }
+  }
+
+  base_ = &base;
+  base_->ref_count_ += 1;
+}
+
 ept_t::~ept_t() noexcept
 {
-  unmap_table(epml4_);
+  //
+  // Base EPT cannot be destroyed while there are views referencing it.
+  //
+  hvpp_assert(ref_count_ == 0);
+
+  //
+  // Tables of the pool don't have to be returned to the free list one
+  // by one - the whole pool is released below.  The hierarchy has to be
+  // walked only to find tables allocated outside of the pool.
+  //
+  if (table_overflow_count_)
+  {
+    unmap_table(epml4_);
+  }
+
+  //
+  // Release the pool memory (whole chunks at once).
+  //
+  for (int i = 0; i < table_chunk_count_; ++i)
+  {
+    ::operator delete[](table_chunk_[i], std::align_val_t{ page_size });
+  }
+
+  if (base_)
+  {
+    base_->ref_count_ -= 1;
+  }
 }
 
 void ept_t::map_identity(epte_t::access_type access /* = epte_t::access_type::read_write_execute */) noexcept
@@ -73,10 +171,208 @@ void ept_t::map_identity(epte_t::access_type access /* = epte_t::access_type::re
                                             * 1024
                                             * 1024;
 
-  for (pa_t pa = 0; pa < _512gb; pa += ept_pd_t::size)
+  //
+  // Reserve 1 PDPT and 512 PDs up-front.
+  //
+  reserve(1 + 512);
+
+  if (epml4_[0].present())
+  {
+    //
+    // Something is already mapped - map the pages one by one, so that
+    // existing subtables are reused (and split pages are handled).
+    //
+    for (pa_t pa = 0; pa < _512gb; pa += ept_pd_t::size)
+    {
+      map_2mb(pa, pa, access);
+    }
+
+    return;
+  }
+
+  //
+  // The EPT is empty - fill the tables directly instead of walking
+  // the hierarchy for each of 256k pages.  The entries differ only in
+  // the physical address and the memory type, therefore each entry is
+  // one of 8 precomputed templates (one per memory type) plus the
+  // physical address.  Memory types are taken from the MTRR map in one
+  // linear pass (see mtrr::type_next()).  The result is identical to
+  // map_2mb() of each page.
+  //
+  uint64_t leaf_template[8];
+
+  for (uint64_t type = 0; type < std::size(leaf_template); ++type)
+  {
+    epte_t entry;
+    entry.clear();
+    entry.update(pa_t{ 0 }, static_cast<memory_type>(type), true, access);
+    leaf_template[type] = entry.flags;
+  }
+
+  const auto& mtrr = mm::mtrr();
+  const mtrr_range* mtrr_cursor = nullptr;
+
+  entry_cache_flush();
+  modified(modification::structure);
+
+  auto pdpt = allocate_table();
+  hvpp_assert(pdpt != nullptr);
+
+  for (uint64_t i = 0; i < ept_pdpt_t::count; ++i)
+  {
+    auto pd = allocate_table();
+    hvpp_assert(pd != nullptr);
+
+    const auto pd_pa = i * ept_pdpt_t::size;
+
+    for (uint64_t j = 0; j < ept_pd_t::count; ++j)
+    {
+      const auto pa = pd_pa + j * ept_pd_t::size;
+      const auto type = mtrr.type_next(pa_t{ pa }, mtrr_cursor);
+
+      pd[j].flags = leaf_template[static_cast<uint64_t>(type) & 7] + pa;
+    }
+
+    pdpt[i].clear();
+    pdpt[i].update(pa_t::from_va(pd));
+  }
+
+  epml4_[0].update(pa_t::from_va(pdpt));
+}
+
+void ept_t::map_identity_1gb(epte_t::access_type access /* = epte_t::access_type::read_write_execute */) noexcept
+{
+  //
+  // Same as map_identity(), but tries to use the largest possible pages.
+  //
+  // Each 1GB range whose memory type is described by the MTRRs uniformly
+  // is mapped by a single 1GB PDPT entry.  Only ranges which contain an
+  // MTRR boundary are broken into 2MB pages - and only those 2MB ranges
+  // which still contain the boundary are broken further into 4kb pages.
+  // This way the memory type of each EPT entry always exactly matches
+  // the memory type reported by the MTRRs, and on a typical machine the
+  // whole 512GB is covered by a single PDPT with just a handful of PDs
+  // and PTs around the MMIO holes below 4GB and the fixed-range MTRRs
+  // in the first 1MB.
+  //
+  // If the 2MB page passed to split_2mb_to_4kb() lies within 1GB page,
+  // the 1GB page is split into 2MB pages first (see split()).
+  //
+  // CPUs which don't support 1GB EPT pages get the regular 2MB map
+  // (1GB PDPT entry would cause EPT misconfiguration).
+  //
+  if (!msr::read<msr::vmx_ept_vpid_cap_t>().pdpte_1gb_pages)
+  {
+    map_identity(access);
+    return;
+  }
+
+  static constexpr uint64_t _512gb = 512ull * 1024
+                                            * 1024
+                                            * 1024;
+
+  const auto& mtrr = mm::mtrr();
+
+  for (pa_t pa_1gb = 0; pa_1gb < _512gb; pa_1gb += ept_pdpt_t::size)
+  {
+    if (mtrr.is_uniform(pa_1gb, ept_pdpt_t::size))
+    {
+      map_1gb(pa_1gb, pa_1gb, access);
+      continue;
+    }
+
+    for (pa_t pa_2mb = pa_1gb; pa_2mb < pa_1gb + ept_pdpt_t::size; pa_2mb += ept_pd_t::size)
+    {
+      if (mtrr.is_uniform(pa_2mb, ept_pd_t::size))
+      {
+        map_2mb(pa_2mb, pa_2mb, access);
+        continue;
+      }
+
+      for (pa_t pa_4kb = pa_2mb; pa_4kb < pa_2mb + ept_pd_t::size; pa_4kb += ept_pt_t::size)
+      {
+        map_4kb(pa_4kb, pa_4kb, access);
+      }
+    }
+  }
+}
+
+void ept_t::map_identity_lazy(epte_t::access_type access /* = epte_t::access_type::read_write_execute */) noexcept
+{
+  //
+  // Instead of mapping whole 512GB at once, leave the EPT empty and let
+  // the guest "fault-in" the memory it actually touches.  Each access to
+  // the not-yet-mapped guest physical address causes EPT violation, which
+  // is resolved by fault_in() method (called by vcpu_t before the VM-exit
+  // handler gets a chance to see it).
+  //
+  // The resulting mapping is identical to the one created by the
+  // map_identity() method (2MB pages), but it's built incrementally.
+  // This makes the hypervisor start faster and the EPT memory consumption
+  // proportional to the physical memory the guest actually uses.
+  //
+  lazy_ = true;
+  lazy_access_ = access;
+}
+
+bool ept_t::is_lazy() const noexcept
+{
+  return lazy_;
+}
+
+bool ept_t::fault_in(pa_t guest_pa) noexcept
+{
+  if (!lazy_)
+  {
+    return false;
+  }
+
+  //
+  // If the 2MB page is already mapped, this EPT violation has been caused
+  // by something else (e.g. insufficient access rights) - let the VM-exit
+  // handler deal with it.
+  //
+  auto entry = ept_entry_lookup(guest_pa, pml::pd);
+  if (entry && entry->present())
+  {
+    return false;
+  }
+
+  //
+  // By default, map just the 2MB page containing the guest physical
+  // address.  This is the case for addresses which are not backed
+  // by the physical memory (e.g. MMIO).
+  //
+  pa_t range_begin = guest_pa & ept_pd_t::mask;
+  pa_t range_end   = range_begin + ept_pd_t::size;
+
+  //
+  // If the guest physical address lies in the physical memory range,
+  // map all 2MB pages of that range which belong to the same PD table.
+  // This way the PD is filled at once instead of one VM-exit per
+  // each 2MB page.
+  //
+  ia32::physical_memory_range range;
+  if (mm::physical_memory_descriptor().find(guest_pa, range))
+  {
+    const pa_t pd_begin = guest_pa & ept_pdpt_t::mask;
+    const pa_t pd_end   = pd_begin + ept_pdpt_t::size;
+
+    range_begin = std::max(range.begin() & ept_pd_t::mask, pd_begin);
+    range_end   = std::min(pa_t((range.end().value() + ept_pd_t::size - 1) & ept_pd_t::mask), pd_end);
+  }
+
+  for (pa_t pa = range_begin; pa < range_end; pa += ept_pd_t::size)
   {
-    map_2mb(pa, pa, access);
+    entry = ept_entry_lookup(pa, pml::pd);
+
+    if (!entry || !entry->present())
+    {
+      map_2mb(pa, pa, lazy_access_);
+    }
   }
+
+  return true;
 }
 
 epte_t* ept_t::map(pa_t guest_pa, pa_t host_pa,
@@ -166,9 +462,24 @@ epte_t* ept_t::ept_entry(pa_t guest_pa, pml level /* = pml::pt */) noexcept
   // Start at PML4 and traverse down the paging hierarchy.
   // Returns nullptr for unmapped (non-present) physical addresses.
   //
+  // Because the caller is free to modify the returned entry, shared
+  // paging structures on the way are made private (see unshare_subtable()).
+  //
+  // PD entries (and their page-tables) resolved by previous calls
+  // are cached, so that repeated lookups of the same 2MB region
+  // (e.g. in EPT violation handler) don't have to walk the hierarchy.
+  //
+  if (level != pml::pdpt)
+  {
+    if (auto entry = entry_cache_lookup(guest_pa, level))
+    {
+      return entry;
+    }
+  }
+
   auto pml4e = &epml4_[guest_pa.index(pml::pml4)];
   auto pdpte = pml4e->present()
-    ? &pml4e->subtable()[guest_pa.index(pml::pdpt)]
+    ? &unshare_subtable(pml4e, pml::pml4)[guest_pa.index(pml::pdpt)]
     : nullptr;
 
   if (!pdpte || pdpte->large_page || level == pml::pdpt)
@@ -177,98 +488,493 @@ epte_t* ept_t::ept_entry(pa_t guest_pa, pml level /* = pml::pt */) noexcept
   }
 
   auto pde = pdpte->present()
-    ? &pdpte->subtable()[guest_pa.index(pml::pd)]
+    ? &unshare_subtable(pdpte, pml::pdpt)[guest_pa.index(pml::pd)]
     : nullptr;
 
   if (!pde || pde->large_page || level == pml::pd)
   {
+    if (pde && pde->present())
+    {
+      entry_cache_insert(guest_pa, pde);
+    }
+
     return pde;
   }
 
   auto pte = pde->present()
-    ? &pde->subtable()[guest_pa.index(pml::pt)]
+    ? &unshare_subtable(pde, pml::pd)[guest_pa.index(pml::pt)]
     : nullptr;
 
+  if (pte)
+  {
+    entry_cache_insert(guest_pa, pde);
+  }
+
   return pte;
 }
 
-ept_ptr_t ept_t::ept_pointer() const noexcept
+auto ept_t::ept_entry_lookup(pa_t guest_pa, pml level /* = pml::pt */) const noexcept -> const epte_t*
 {
-  return eptptr_;
+  //
+  // Walk the hierarchy the same way as ept_entry(), without touching
+  // the entry cache (it holds private tables only).
+  //
+  const epte_t* entry = &epml4_[guest_pa.index(pml::pml4)];
+
+  for (auto next_level : { pml::pdpt, pml::pd, pml::pt })
+  {
+    if (!entry->present())
+    {
+      return nullptr;
+    }
+
+    entry = &entry->subtable()[guest_pa.index(next_level)];
+
+    if (entry->large_page || level == next_level)
+    {
+      return entry;
+    }
+  }
+
+  return entry;
 }
 
-//
-// Private
-//
+epte_t* ept_t::ept_leaf(pa_t guest_pa, pml& level) noexcept
+{
+  auto pdpte = ept_entry(guest_pa, pml::pdpt);
 
-template <
-  typename ept_table_from_t,
-  typename ept_table_to_t
->
-void ept_t::split(pa_t guest_pa, pa_t host_pa, epte_t::access_type access) noexcept
+  if (!pdpte || pdpte->large_page)
+  {
+    level = pml::pdpt;
+    return pdpte;
+  }
+
+  auto pde = ept_entry(guest_pa, pml::pd);
+
+  if (!pde || pde->large_page)
+  {
+    level = pml::pd;
+    return pde;
+  }
+
+  level = pml::pt;
+  return ept_entry(guest_pa, pml::pt);
+}
+
+size_t ept_t::protect_range(pa_t guest_pa, size_t size, epte_t::access_type access) noexcept
 {
   //
-  // Sanity compile-time checks - allow to use only EPT descriptors.
-  // See ia32/ept.h.
+  // Change access rights of all mapped pages in the range
+  // [guest_pa, guest_pa + size).  The hierarchy is walked only once
+  // and runs of entries are updated in place.  Large pages which are
+  // fully covered by the range are updated as a whole, large pages
+  // which are covered only partially (at the edges of the range) are
+  // split.  Unmapped parts of the range are skipped.
   //
-  static_assert(std::is_base_of_v<ept_descriptor_tag,
-                         typename ept_table_from_t::descriptor_tag>,
-                "Wrong ept_table_from_t type");
+  // Returns number of EPT entries which have been updated.
+  // The invalidation is deferred (see flush_if_needed()).
+  //
+  hvpp_assert((guest_pa.value() & (page_size - 1)) == 0);
+  hvpp_assert((size & (page_size - 1)) == 0);
 
+  const auto end_pa = guest_pa + pa_t{ size };
+  auto pa = guest_pa;
 
-  static_assert(std::is_base_of_v<ept_descriptor_tag,
-                         typename ept_table_to_t::descriptor_tag>,
-                "Wrong ept_table_to_t type");
+  size_t result = 0;
+
+  while (pa < end_pa)
+  {
+    auto pdpte = ept_entry(pa, pml::pdpt);
+
+    //
+    // Note that large pages with no access rights are not "present",
+    // but they're still mapped.
+    //
+    if (!pdpte || (!pdpte->present() && !pdpte->large_page))
+    {
+      pa = pa_t{ (pa.value() & ept_pdpt_t::mask) + ept_pdpt_t::size };
+      continue;
+    }
+
+    if (pdpte->large_page)
+    {
+      if ((pa.value() & ~ept_pdpt_t::mask) == 0 &&
+          (end_pa - pa).value() >= ept_pdpt_t::size)
+      {
+        const auto before = *pdpte;
+        pdpte->update(access);
+        modified_entry(before, *pdpte, pa, ept_pdpt_t::size);
+        result += 1;
+
+        pa += pa_t{ ept_pdpt_t::size };
+        continue;
+      }
+    }
+
+    //
+    // Note that map_subtable() splits the large page (if needed)
+    // and makes private copy of the shared page directory.
+    //
+    auto pd = map_subtable(pdpte, pml::pdpt);
+
+    for (int i = pa.index(pml::pd); i < 512 && pa < end_pa; ++i)
+    {
+      auto pde = &pd[i];
+
+      if (!pde->present() && !pde->large_page)
+      {
+        pa = pa_t{ (pa.value() & ept_pd_t::mask) + ept_pd_t::size };
+        continue;
+      }
 
+      if (pde->large_page)
+      {
+        if ((pa.value() & ~ept_pd_t::mask) == 0 &&
+            (end_pa - pa).value() >= ept_pd_t::size)
+        {
+          const auto before = *pde;
+          pde->update(access);
+          modified_entry(before, *pde, pa, ept_pd_t::size);
+          result += 1;
+
+          pa += pa_t{ ept_pd_t::size };
+          continue;
+        }
+      }
+
+      auto pt = map_subtable(pde, pml::pd);
+
+      for (int j = pa.index(pml::pt); j < 512 && pa < end_pa; ++j)
+      {
+        auto pte = &pt[j];
+
+        //
+        // Page-table entries with no access rights are considered
+        // mapped if they have non-zero PFN.
+        //
+        if (pte->present() || pte->page_frame_number)
+        {
+          const auto before = *pte;
+          pte->update(access);
+          modified_entry(before, *pte, pa, ept_pt_t::size);
+          result += 1;
+        }
+
+        pa += pa_t{ ept_pt_t::size };
+      }
+
+      //
+      // The page-table might have become uniform again.
+      //
+      if (pde->split)
+      {
+        coalesce_table(pde);
+      }
+    }
+  }
+
+  return result;
+}
+
+void ept_t::unshare_range(pa_t guest_pa, size_t size) noexcept
+{
   //
-  // Splitting pages (breaking large page into smaller ones) is possible
-  // only down accross one level (i.e. PDPT -> PD, PD -> PT).  If you
-  // desire to split PDPT into PTs (2 levels apart), you have to split
-  // the PDPT first and then split resulting PDs again into PTs.
+  // ept_entry() unshares every paging structure on the way to the leaf
+  // - one lookup per 2MB region (or per 1GB page) is enough.
   //
-  static_assert(ept_table_from_t::level - 1 == ept_table_to_t::level,
-                "Cannot split page-tables accros multiple levels");
+  const auto end_pa = guest_pa + pa_t{ size };
+  auto pa = pa_t{ guest_pa.value() & ept_pd_t::mask };
 
+  while (pa < end_pa)
+  {
+    const auto pdpte = ept_entry(pa, pml::pdpt);
+
+    if (!pdpte || pdpte->large_page)
+    {
+      pa = pa_t{ (pa.value() & ept_pdpt_t::mask) + ept_pdpt_t::size };
+      continue;
+    }
+
+    ept_entry(pa, pml::pt);
+    pa = pa_t{ pa.value() + ept_pd_t::size };
+  }
+}
+
+bool ept_t::coalesce(pa_t guest_pa) noexcept
+{
   //
-  // PML4 is not splittable (doesn't have the "large_page" flag).
-  // Although this might change in the future CPUs.
+  // Try to join previously split 2MB page containing the guest
+  // physical address.  Returns true if the page has been joined.
   //
-  static_assert(ept_table_from_t::level != pml::pml4,
-                "Cannot split PML4 into PDPTs");
+  // Note that this is done automatically when a 4kb page of such
+  // region is mapped via map_4kb().  This method is meant for cases
+  // when the entries are modified directly (e.g. via ept_entry()).
+  //
+  auto pde = ept_entry(guest_pa, pml::pd);
+
+  if (!pde || !pde->present() || pde->large_page || !pde->split)
+  {
+    return false;
+  }
 
+  return coalesce_table(pde);
+}
+
+size_t ept_t::memory_type_update(const physical_memory_range& range) noexcept
+{
   //
-  // Fetch the EPT entry for the provided guest physical address.
-  // The returned EPT entry is fetched at the "ept_table_from_t::level",
-  // this means that if we're splitting from PD to PTs, we've fetched PD entry.
+  // Re-stamp memory types of all mapped pages in the range after
+  // the MTRRs have changed (see mm::mtrr_update()).  Only entries
+  // whose memory type no longer matches the MTRRs are touched:
+  // large pages which aren't uniform anymore are split, split pages
+  // which became uniform again are joined back.  Shared subtables are
+  // copied only if something below them actually changes.
   //
-  auto entry = ept_entry(guest_pa, ept_table_from_t::level);
+  // Returns number of EPT entries which have been updated.
+  // The invalidation is deferred (see flush_if_needed()).
+  //
+  return memory_type_update_table(epml4_, pml::pml4, 0, range, false);
+}
 
+void ept_t::ve_enable(pa_t guest_pa, bool enable /* = true */) noexcept
+{
   //
-  // Make sure that the fetched entry is indeed large.
-  // We can't split non-large pages - they already are splitted.
+  // Allow (or suppress) delivery of EPT violations caused by access
+  // to the guest physical address as #VE to the guest.  The setting
+  // is applied to the whole page (4kb, 2MB or 1GB) containing the address.
+  // Note that #VE must be also enabled on the VCPU (see vcpu_t::ve_enable())
+  // and that the invalidation is deferred (see flush_if_needed()).
+  // (ref: Vol3C[25.5.6.1(Convertible EPT Violations)])
   //
-  if (!entry->large_page)
+  //
+  // Make the structures private only if the entry actually changes.
+  //
+  const auto current = ept_entry_lookup(guest_pa);
+
+  if (current && current->suppress_ve != !enable)
   {
-    //hvpp_assert(0);
-    return;
+    auto entry = ept_entry(guest_pa);
+    entry->suppress_ve = !enable;
+    modified(modification::restrict);
   }
+}
 
+void ept_t::access_dirty_enable(bool enable /* = true */) noexcept
+{
   //
-  // Unmap the entry, i.e. make it non-present and reset the PFN.
+  // Enable accessed and dirty flags for this EPT.  The processor then
+  // sets these flags in EPT entries - this is required e.g. by PML.
+  // The new EPT pointer must be reloaded to the VMCS.
+  // (ref: Vol3C[28.2.4(Accessed and Dirty Flags for EPT)])
   //
-  unmap_entry(entry, ept_table_from_t::level);
+  eptptr_.enable_access_and_dirty_flags = enable;
+}
 
+auto ept_t::access_harvest(bitmap& accessed) noexcept -> size_t
+{
   //
-  // Map the unmapped physical memory range again, this time with smaller
-  // EPT entries.
+  // Collect accessed flags of all leaf entries into the bitmap (one bit
+  // per 4kb page) and clear them - both in leaf and non-leaf entries.
+  // Returns number of accessed leaf entries.  Pages above the bitmap are
+  // ignored (but their flags are cleared as well).
   //
-  // If we're splitting 2MB page into 4kb pages, we're mapping range
-  // [ guest_pa, guest_pa + 2MB ].
+  // The processor sets the accessed flag in each entry it uses for the
+  // translation, therefore subtables whose entry isn't accessed are
+  // skipped - a pass over mostly idle memory touches only a few tables.
+  // This holds also for subtables shared with the base EPT, as long as
+  // all EPTs in use are harvested: whoever clears the flag of a shared
+  // entry harvests the whole subtree.
   //
-  // Note: Each paging structure on Intel architectures always contain 512
-  //       entries (one PDPT can contain 512 PDs, one PD can contain 512 PTs,
-  //       one PT can contain 512 pages).  This is convenient because at the
-  //       same time, each EPT structure has 8 bytes - therefore those 512
+  // Flags are cleared atomically (the processor might set the dirty
+  // flag of the same entry concurrently).  The processor might keep
+  // using cached translations of the harvested pages without setting the
+  // accessed flag again - therefore the harvest is recorded as
+  // restricting modification (see flush_if_needed()).
+  // Requires accessed and dirty flags enabled (see access_dirty_enable()).
+  //
+  hvpp_assert(eptptr_.enable_access_and_dirty_flags);
+
+  const auto result = access_harvest_table(epml4_, pml::pml4, 0, accessed);
+
+  if (result)
+  {
+    modified(modification::restrict);
+  }
+
+  return result;
+}
+
+ept_ptr_t ept_t::ept_pointer() const noexcept
+{
+  return eptptr_;
+}
+
+void ept_t::modified(modification kind) noexcept
+{
+  generation_ += 1;
+
+  if (kind != modification::relax)
+  {
+    flush_pending_ = true;
+  }
+}
+
+bool ept_t::flush_pending() const noexcept
+{
+  return flush_pending_;
+}
+
+bool ept_t::flush_if_needed() noexcept
+{
+  //
+  // Returns true if the INVEPT has been issued.
+  //
+  if (!flush_pending_)
+  {
+    return false;
+  }
+
+  flush_pending_ = false;
+
+  //
+  // EPT which has never been used by any VCPU can't have any
+  // cached translations.
+  //
+  if (!loaded_)
+  {
+    return false;
+  }
+
+  vmx::invept_single_context(eptptr_);
+  return true;
+}
+
+auto ept_t::generation() const noexcept -> uint32_t
+{
+  return generation_;
+}
+
+void ept_t::loaded() noexcept
+{
+  //
+  // Called by the VCPU when the EPT pointer is written into the VMCS
+  // (or into the EPTP list).
+  //
+  loaded_ = true;
+}
+
+void ept_t::violation(pa_t guest_pa) noexcept
+{
+  violation_pa_ = guest_pa.value();
+}
+
+void ept_t::violation_end() noexcept
+{
+  violation_pa_ = ~0ull;
+}
+
+void ept_t::reserve(int table_count) noexcept
+{
+  //
+  // Make sure that at least "table_count" EPT tables can be allocated
+  // without calling the memory allocator.
+  //
+  while (table_free_count_ < table_count)
+  {
+    if (!allocate_table_chunk())
+    {
+      break;
+    }
+  }
+}
+
+//
+// Private
+//
+
+template <
+  typename ept_table_from_t,
+  typename ept_table_to_t
+>
+void ept_t::split(pa_t guest_pa, pa_t host_pa, epte_t::access_type access) noexcept
+{
+  //
+  // Sanity compile-time checks - allow to use only EPT descriptors.
+  // See ia32/ept.h.
+  //
+  static_assert(std::is_base_of_v<ept_descriptor_tag,
+                         typename ept_table_from_t::descriptor_tag>,
+                "Wrong ept_table_from_t type");
+
+
+  static_assert(std::is_base_of_v<ept_descriptor_tag,
+                         typename ept_table_to_t::descriptor_tag>,
+                "Wrong ept_table_to_t type");
+
+  //
+  // Splitting pages (breaking large page into smaller ones) is possible
+  // only down accross one level (i.e. PDPT -> PD, PD -> PT).  If you
+  // desire to split PDPT into PTs (2 levels apart), you have to split
+  // the PDPT first and then split resulting PDs again into PTs.
+  //
+  static_assert(ept_table_from_t::level - 1 == ept_table_to_t::level,
+                "Cannot split page-tables accros multiple levels");
+
+  //
+  // PML4 is not splittable (doesn't have the "large_page" flag).
+  // Although this might change in the future CPUs.
+  //
+  static_assert(ept_table_from_t::level != pml::pml4,
+                "Cannot split PML4 into PDPTs");
+
+  //
+  // If the 2MB page lies within 1GB page (see map_identity_1gb()),
+  // split the 1GB page into 2MB pages first - map_subtable() keeps
+  // the memory type and access rights of the 1GB page.
+  //
+  if constexpr (ept_table_from_t::level == pml::pd)
+  {
+    auto pdpte = ept_entry(guest_pa, pml::pdpt);
+
+    if (pdpte && pdpte->large_page)
+    {
+      map_subtable(pdpte, pml::pdpt);
+    }
+  }
+
+  //
+  // Fetch the EPT entry for the provided guest physical address.
+  // The returned EPT entry is fetched at the "ept_table_from_t::level",
+  // this means that if we're splitting from PD to PTs, we've fetched PD entry.
+  //
+  auto entry = ept_entry(guest_pa, ept_table_from_t::level);
+
+  //
+  // Make sure that the fetched entry is indeed large.
+  // We can't split non-large pages - they already are splitted.
+  //
+  if (!entry->large_page)
+  {
+    //hvpp_assert(0);
+    return;
+  }
+
+  //
+  // Unmap the entry, i.e. make it non-present and reset the PFN.
+  //
+  unmap_entry(entry, ept_table_from_t::level);
+
+  //
+  // Map the unmapped physical memory range again, this time with smaller
+  // EPT entries.
+  //
+  // If we're splitting 2MB page into 4kb pages, we're mapping range
+  // [ guest_pa, guest_pa + 2MB ].
+  //
+  // Note: Each paging structure on Intel architectures always contain 512
+  //       entries (one PDPT can contain 512 PDs, one PD can contain 512 PTs,
+  //       one PT can contain 512 pages).  This is convenient because at the
+  //       same time, each EPT structure has 8 bytes - therefore those 512
   //       entries can always fit into single 4kb page.
   //
   //       This means that this for-loop always exetues 512-times, no matter
@@ -280,6 +986,13 @@ void ept_t::split(pa_t guest_pa, pa_t host_pa, epte_t::access_type access) noexc
         host_pa  + (i * ept_table_to_t::size), // offset = iteration * page_size
         access, ept_table_to_t::level);
   }
+
+  //
+  // Remember that this table has been split - this allows to join
+  // it back automatically once all its entries become uniform again
+  // (see coalesce_table()).
+  //
+  entry->split = true;
 }
 
 template <
@@ -358,31 +1071,166 @@ void ept_t::join(pa_t guest_pa, pa_t host_pa, epte_t::access_type access) noexce
   map(guest_pa, host_pa, access, ept_table_to_t::level);
 }
 
-epte_t* ept_t::map_subtable(epte_t* table) noexcept
+epte_t* ept_t::unshare_subtable(epte_t* entry, pml level) noexcept
+{
+  //
+  // Get subtable of the entry.  If the subtable is shared with
+  // the base EPT, make private copy of it first.
+  //
+  if (!entry->present() || !entry->shared)
+  {
+    return entry->subtable();
+  }
+
+  entry_cache_flush();
+
+  auto shared_subtable = entry->subtable();
+  auto private_subtable = allocate_table();
+  hvpp_assert(private_subtable != nullptr);
+  memcpy(private_subtable, shared_subtable, sizeof(epte_t) * 512);
+
+  //
+  // Everything below the copied subtable still belongs to the
+  // base EPT.  PT entries point directly to the physical memory,
+  // therefore they have nothing to share.
+  //
+  if (level - 1 != pml::pt)
+  {
+    for (int i = 0; i < 512; ++i)
+    {
+      auto child = &private_subtable[i];
+
+      if (child->present() && !child->large_page)
+      {
+        child->shared = true;
+      }
+    }
+  }
+
+  entry->page_frame_number = pa_t::from_va(private_subtable).pfn();
+  entry->shared = false;
+  return private_subtable;
+}
+
+epte_t* ept_t::map_subtable(epte_t* entry, pml level) noexcept
 {
   //
   // Get or create next level of EPT table hierarchy.
   // PML4 -> PDPT -> PD -> PT
   //
-  if (table->present())
+  if (entry->large_page)
+  {
+    //
+    // Smaller page is being mapped inside of the large page (note that
+    // the large page might be mapped with no access rights).  Split
+    // the large page first, so that the rest of its range keeps its
+    // mapping.
+    //
+    entry_cache_flush();
+    modified(modification::structure);
+
+    const auto large_entry = *entry;
+    const auto child_size  = level == pml::pdpt
+      ? ept_pd_t::size
+      : ept_pt_t::size;
+
+    auto split_subtable = allocate_table();
+    hvpp_assert(split_subtable != nullptr);
+
+    for (uint64_t i = 0; i < ept_pt_t::count; ++i)
+    {
+      split_subtable[i].clear();
+      split_subtable[i].update(pa_t::from_pfn(large_entry.page_frame_number) + pa_t{ i * child_size },
+                               static_cast<memory_type>(large_entry.memory_type),
+                               level != pml::pd,
+                               static_cast<epte_t::access_type>(large_entry.access));
+      split_subtable[i].suppress_ve = large_entry.suppress_ve;
+    }
+
+    entry->clear();
+    entry->update(pa_t::from_va(split_subtable));
+    entry->split = true;
+    return split_subtable;
+  }
+
+  if (entry->present())
   {
-    return table->subtable();
+    return unshare_subtable(entry, level);
   }
 
-  auto subtable = new epte_t[512];
-  hvpp_assert(subtable != nullptr);
-  memset(subtable, 0, sizeof(epte_t) * 512);
+  auto new_subtable = allocate_table();
+  hvpp_assert(new_subtable != nullptr);
   static_assert(sizeof(epte_t) * 512 == page_size);
 
-  table->update(pa_t::from_va(subtable));
-  return subtable;
+  for (int i = 0; i < 512; ++i)
+  {
+    new_subtable[i].clear();
+  }
+
+  entry->update(pa_t::from_va(new_subtable));
+  return new_subtable;
+}
+
+bool ept_t::coalesce_table(epte_t* entry, pml level /* = pml::pd */) noexcept
+{
+  //
+  // Join the page-table back into the 2MB page (or the page directory
+  // of 2MB pages into the 1GB page) if all of its 512 entries map
+  // contiguous aligned host physical memory with the same access rights
+  // and memory type.  Accessed and dirty flags are ignored.
+  //
+  hvpp_assert(entry->present() && !entry->large_page);
+  hvpp_assert(level == pml::pd || level == pml::pdpt);
+
+  if (entry->shared)
+  {
+    return false;
+  }
+
+  static constexpr uint64_t ignored_flags = (1ull << 8)   // accessed
+                                          | (1ull << 9);  // dirty
+
+  const auto child_shift = level == pml::pdpt
+    ? page_shift + 9
+    : page_shift;
+
+  auto subtable = entry->subtable();
+  const auto first = subtable[0];
+
+  if (!first.present() ||
+      (level == pml::pdpt && !first.large_page) ||
+      (first.page_frame_number & ((1ull << (child_shift + 9 - page_shift)) - 1)) != 0)
+  {
+    return false;
+  }
+
+  for (uint64_t i = 0; i < ept_pt_t::count; ++i)
+  {
+    if ((subtable[i].flags & ~ignored_flags) != ((first.flags & ~ignored_flags) + (i << child_shift)))
+    {
+      return false;
+    }
+  }
+
+  entry_cache_flush();
+  modified(modification::structure);
+
+  entry->clear();
+  free_table(subtable);
+
+  entry->update(pa_t::from_pfn(first.page_frame_number),
+                static_cast<memory_type>(first.memory_type),
+                true,
+                static_cast<epte_t::access_type>(first.access));
+
+  return true;
 }
 
 epte_t* ept_t::map_pml4(pa_t guest_pa, pa_t host_pa, epte_t* pml4,
                         epte_t::access_type access, pml large) noexcept
 {
   auto pml4e = &pml4[guest_pa.index(pml::pml4)];
-  auto pdpt = map_subtable(pml4e);
+  auto pdpt = map_subtable(pml4e, pml::pml4);
 
   return map_pdpt(guest_pa, host_pa, pdpt, access, large);
 }
@@ -394,11 +1242,18 @@ epte_t* ept_t::map_pdpt(pa_t guest_pa, pa_t host_pa, epte_t* pdpt,
 
   if (large == pml::pdpt)
   {
+    if (pdpte->present() && !pdpte->large_page)
+    {
+      entry_cache_flush();
+    }
+
+    const auto before = *pdpte;
     pdpte->update(host_pa, mm::mtrr().type(guest_pa), true, access);
+    modified_entry(before, *pdpte, guest_pa, ept_pdpt_t::size);
     return pdpte;
   }
 
-  auto pd = map_subtable(pdpte);
+  auto pd = map_subtable(pdpte, pml::pdpt);
   return map_pd(guest_pa, host_pa, pd, access, large);
 }
 
@@ -409,12 +1264,31 @@ epte_t* ept_t::map_pd(pa_t guest_pa, pa_t host_pa, epte_t* pd,
 
   if (large == pml::pd)
   {
+    if (pde->present() && !pde->large_page)
+    {
+      entry_cache_flush();
+    }
+
+    const auto before = *pde;
     pde->update(host_pa, mm::mtrr().type(guest_pa), true, access);
+    modified_entry(before, *pde, guest_pa, ept_pd_t::size);
+    return pde;
+  }
+
+  auto pt = map_subtable(pde, pml::pd);
+  auto pte = map_pt(guest_pa, host_pa, pt, access, large);
+
+  //
+  // If this page-table has been created by splitting 2MB page, try to
+  // join it back.  Note that the returned entry is the 2MB PD entry
+  // in such case.
+  //
+  if (pde->split && coalesce_table(pde))
+  {
     return pde;
   }
 
-  auto pt = map_subtable(pde);
-  return map_pt(guest_pa, host_pa, pt, access, large);
+  return pte;
 }
 
 epte_t* ept_t::map_pt(pa_t guest_pa, pa_t host_pa, epte_t* pt,
@@ -425,11 +1299,340 @@ epte_t* ept_t::map_pt(pa_t guest_pa, pa_t host_pa, epte_t* pt,
   (void)(large);
   hvpp_assert(large == pml::pt);
   {
+    const auto before = *pte;
     pte->update(host_pa, mm::mtrr().type(guest_pa), access);
+    modified_entry(before, *pte, guest_pa, ept_pt_t::size);
     return pte;
   }
 }
 
+void ept_t::modified_entry(const epte_t& before, const epte_t& after,
+                           pa_t guest_pa, uint64_t size) noexcept
+{
+  //
+  // Classify modification of the leaf entry which maps "size" bytes
+  // at "guest_pa".  Non-present entries are never cached, therefore
+  // mapping them (or extending access rights) needs no invalidation.
+  //
+  auto kind = modification::relax;
+
+  if (before.large_page != after.large_page)
+  {
+    kind = modification::structure;
+  }
+  else if (before.present() &&
+           (before.page_frame_number != after.page_frame_number ||
+            before.memory_type       != after.memory_type       ||
+            before.suppress_ve       != after.suppress_ve       ||
+            (before.access & ~after.access) != 0))
+  {
+    kind = modification::restrict;
+
+    //
+    // The EPT violation being handled has already invalidated the
+    // translations of its guest physical address (see violation()).
+    //
+    if (((violation_pa_ ^ guest_pa.value()) & ~(size - 1)) == 0)
+    {
+      kind = modification::relax;
+    }
+  }
+
+  modified(kind);
+}
+
+epte_t* ept_t::entry_cache_lookup(pa_t guest_pa, pml level) noexcept
+{
+  //
+  // Returns nullptr on cache miss.
+  //
+  const auto tag = guest_pa.value() >> ept_pd_t::shift;
+  const auto& cache_entry = entry_cache_[tag % entry_cache_size];
+
+  if (!cache_entry.pde || cache_entry.tag != tag)
+  {
+    return nullptr;
+  }
+
+  //
+  // The entry could have been modified directly by the caller
+  // of ept_entry() - treat such entry as a miss.
+  //
+  if (!cache_entry.pde->present() ||
+      cache_entry.pde->large_page != (cache_entry.pt == nullptr))
+  {
+    return nullptr;
+  }
+
+  if (level == pml::pd || !cache_entry.pt)
+  {
+    return cache_entry.pde;
+  }
+
+  return &cache_entry.pt[guest_pa.index(pml::pt)];
+}
+
+void ept_t::entry_cache_insert(pa_t guest_pa, epte_t* pde) noexcept
+{
+  //
+  // Only private (non-shared) paging structures can be cached - shared
+  // ones would be replaced by their private copy on the first write.
+  //
+  hvpp_assert(pde->present() && !pde->shared);
+
+  const auto tag = guest_pa.value() >> ept_pd_t::shift;
+  auto& cache_entry = entry_cache_[tag % entry_cache_size];
+
+  cache_entry.tag = tag;
+  cache_entry.pde = pde;
+  cache_entry.pt  = pde->large_page
+    ? nullptr
+    : pde->subtable();
+}
+
+void ept_t::entry_cache_flush() noexcept
+{
+  //
+  // Called whenever a paging structure is freed or replaced
+  // (split, join, unmap, unshare or coalesce).
+  //
+  for (auto& cache_entry : entry_cache_)
+  {
+    cache_entry.pde = nullptr;
+  }
+}
+
+epte_t* ept_t::allocate_table() noexcept
+{
+  //
+  // Take the table from the free list.  If the free list is empty,
+  // refill it with a new chunk.  If even that fails (maximum number
+  // of chunks has been reached), fall back to the memory allocator.
+  //
+  if (!table_free_list_ && !allocate_table_chunk())
+  {
+    mm::tag_guard _{ detail::table_tag() };
+
+    auto table = new (std::align_val_t{ page_size }) epte_t[512];
+
+    if (table)
+    {
+      table_overflow_count_ += 1;
+    }
+
+    return table;
+  }
+
+  auto table = table_free_list_;
+  table_free_list_ = table->next;
+  table_free_count_ -= 1;
+
+  return reinterpret_cast<epte_t*>(table);
+}
+
+void ept_t::free_table(epte_t* table) noexcept
+{
+  //
+  // Return the table to the free list if it belongs to the pool.
+  //
+  for (int i = 0; i < table_chunk_count_; ++i)
+  {
+    if (table >= table_chunk_[i] &&
+        table <  table_chunk_[i] + 512 * table_chunk_size)
+    {
+      auto free_item = reinterpret_cast<free_table_t*>(table);
+      free_item->next = table_free_list_;
+      table_free_list_ = free_item;
+      table_free_count_ += 1;
+      return;
+    }
+  }
+
+  table_overflow_count_ -= 1;
+  ::operator delete[](table, std::align_val_t{ page_size });
+}
+
+bool ept_t::allocate_table_chunk() noexcept
+{
+  if (table_chunk_count_ == table_chunk_max_count)
+  {
+    return false;
+  }
+
+  //
+  // Tables must be page-aligned (see mm::allocate_aligned()).
+  //
+  mm::tag_guard _{ detail::table_tag() };
+
+  auto chunk = new (std::align_val_t{ page_size }) epte_t[512 * table_chunk_size];
+  if (!chunk)
+  {
+    return false;
+  }
+
+  table_chunk_[table_chunk_count_++] = chunk;
+
+  //
+  // Push pages in reverse order, so that they're taken from the free
+  // list in ascending order.
+  //
+  for (int i = table_chunk_size - 1; i >= 0; --i)
+  {
+    auto free_item = reinterpret_cast<free_table_t*>(chunk + 512 * i);
+    free_item->next = table_free_list_;
+    table_free_list_ = free_item;
+  }
+
+  table_free_count_ += table_chunk_size;
+  return true;
+}
+
+auto ept_t::memory_type_update_table(epte_t* table, pml level, uint64_t table_pa,
+                                     const physical_memory_range& range, bool dry_run) noexcept -> size_t
+{
+  //
+  // Number of bytes covered by single entry of the table.
+  //
+  const uint64_t entry_size = ept_pt_t::size << (9 * static_cast<int>(level));
+  const auto& mtrr = mm::mtrr();
+
+  size_t result = 0;
+
+  for (uint64_t i = 0; i < 512; ++i)
+  {
+    const auto entry_pa = table_pa + i * entry_size;
+
+    if (entry_pa + entry_size <= range.begin().value() ||
+        entry_pa >= range.end().value())
+    {
+      continue;
+    }
+
+    auto entry = &table[i];
+
+    if (level != pml::pt && (level == pml::pml4 || !entry->large_page))
+    {
+      if (!entry->present())
+      {
+        continue;
+      }
+
+      //
+      // Dry run tells whether anything below the shared subtable is
+      // stale - the private copy is made only in such case.
+      //
+      if (entry->shared && !dry_run &&
+          !memory_type_update_table(entry->subtable(), level - 1, entry_pa, range, true))
+      {
+        continue;
+      }
+
+      auto subtable = dry_run
+        ? entry->subtable()
+        : unshare_subtable(entry, level);
+
+      result += memory_type_update_table(subtable, level - 1, entry_pa, range, dry_run);
+
+      if (!dry_run && level != pml::pml4 && entry->split)
+      {
+        coalesce_table(entry, level);
+      }
+
+      continue;
+    }
+
+    //
+    // Mapped leaf entry (see protect_range()).
+    //
+    if (!entry->present() && !entry->large_page && !entry->page_frame_number)
+    {
+      continue;
+    }
+
+    const auto type = mtrr.type(pa_t{ entry_pa }, entry_size);
+
+    if (type == memory_type::invalid)
+    {
+      //
+      // The large page isn't uniform anymore - split it (the new
+      // entries inherit its memory type) and re-stamp the new entries.
+      //
+      if (dry_run)
+      {
+        result += 1;
+        continue;
+      }
+
+      auto subtable = map_subtable(entry, level);
+      result += memory_type_update_table(subtable, level - 1, entry_pa, range, dry_run);
+      continue;
+    }
+
+    if (entry->memory_type == static_cast<uint64_t>(type))
+    {
+      continue;
+    }
+
+    result += 1;
+
+    if (!dry_run)
+    {
+      const auto before = *entry;
+      entry->memory_type = static_cast<uint64_t>(type);
+      modified_entry(before, *entry, pa_t{ entry_pa }, entry_size);
+    }
+  }
+
+  return result;
+}
+
+auto ept_t::access_harvest_table(epte_t* table, pml level, uint64_t first_pfn, bitmap& accessed) noexcept -> size_t
+{
+  //
+  // Number of 4kb pages covered by single entry of the table.
+  //
+  const uint64_t entry_page_count = 1ull << (9 * static_cast<int>(level));
+  const auto bit_count = static_cast<uint64_t>(accessed.size_in_bits());
+
+  size_t result = 0;
+
+  for (int i = 0; i < 512; ++i)
+  {
+    auto entry = &table[i];
+
+    //
+    // Check the flag first without the locked instruction - most entries
+    // are expected to be clear.
+    //
+    if (!entry->present() || !entry->accessed)
+    {
+      continue;
+    }
+
+    constexpr uint64_t accessed_bit = 8;
+    ia32_asm_interlocked_btr(&entry->flags, accessed_bit);
+
+    const auto pfn = first_pfn + i * entry_page_count;
+
+    if (level == pml::pt || (level != pml::pml4 && entry->large_page))
+    {
+      if (pfn < bit_count)
+      {
+        const auto count = std::min(entry_page_count, bit_count - pfn);
+        accessed.set(static_cast<int>(pfn), static_cast<int>(count));
+      }
+
+      result += 1;
+    }
+    else
+    {
+      result += access_harvest_table(entry->subtable(), level - 1, pfn, accessed);
+    }
+  }
+
+  return result;
+}
+
 void ept_t::unmap_table(epte_t* table, pml level /* = pml::pml4 */) noexcept
 {
   //
@@ -459,6 +1662,22 @@ void ept_t::unmap_entry(epte_t* entry, pml level) noexcept
     return;
   }
 
+  //
+  // Paging structures are about to be released - drop cached
+  // pointers to them.
+  //
+  entry_cache_flush();
+  modified(modification::structure);
+
+  if (entry->shared)
+  {
+    //
+    // Subtable is owned by the base EPT - just forget about it.
+    //
+    entry->clear();
+    return;
+  }
+
   //
   // PFN cannot be 0 unless the page is large.
   //
@@ -483,11 +1702,11 @@ void ept_t::unmap_entry(epte_t* entry, pml level) noexcept
       case pml::pml4:
       case pml::pdpt:
         unmap_table(subtable, level - 1);
-        delete[] subtable;
+        free_table(subtable);
         break;
 
       case pml::pd:
-        delete[] subtable;
+        free_table(subtable);
         break;
 
       case pml::pt:
@@ -503,4 +1722,212 @@ void ept_t::unmap_entry(epte_t* entry, pml level) noexcept
   entry->clear();
 }
 
+//////////////////////////////////////////////////////////////////////////
+// ept_t::transaction
+//////////////////////////////////////////////////////////////////////////
+
+ept_t::transaction::transaction(ept_t& ept) noexcept
+  : ept_{ ept }
+  , operation_count_{ 0 }
+{
+
+}
+
+ept_t::transaction::~transaction() noexcept
+{
+  commit();
+}
+
+void ept_t::transaction::map_4kb(pa_t guest_pa, pa_t host_pa,
+                                 epte_t::access_type access /* = epte_t::access_type::read_write_execute */) noexcept
+{
+  enqueue(operation_type::map, guest_pa, host_pa, access, pml::pt);
+}
+
+void ept_t::transaction::map_2mb(pa_t guest_pa, pa_t host_pa,
+                                 epte_t::access_type access /* = epte_t::access_type::read_write_execute */) noexcept
+{
+  enqueue(operation_type::map, guest_pa, host_pa, access, pml::pd);
+}
+
+void ept_t::transaction::map_1gb(pa_t guest_pa, pa_t host_pa,
+                                 epte_t::access_type access /* = epte_t::access_type::read_write_execute */) noexcept
+{
+  enqueue(operation_type::map, guest_pa, host_pa, access, pml::pdpt);
+}
+
+void ept_t::transaction::split_1gb_to_2mb(pa_t guest_pa, pa_t host_pa,
+                                          epte_t::access_type access /* = epte_t::access_type::read_write_execute */) noexcept
+{
+  enqueue(operation_type::split_1gb_to_2mb, guest_pa, host_pa, access);
+}
+
+void ept_t::transaction::split_2mb_to_4kb(pa_t guest_pa, pa_t host_pa,
+                                          epte_t::access_type access /* = epte_t::access_type::read_write_execute */) noexcept
+{
+  enqueue(operation_type::split_2mb_to_4kb, guest_pa, host_pa, access);
+}
+
+void ept_t::transaction::join_2mb_to_1gb(pa_t guest_pa, pa_t host_pa,
+                                         epte_t::access_type access /* = epte_t::access_type::read_write_execute */) noexcept
+{
+  enqueue(operation_type::join_2mb_to_1gb, guest_pa, host_pa, access);
+}
+
+void ept_t::transaction::join_4kb_to_2mb(pa_t guest_pa, pa_t host_pa,
+                                         epte_t::access_type access /* = epte_t::access_type::read_write_execute */) noexcept
+{
+  enqueue(operation_type::join_4kb_to_2mb, guest_pa, host_pa, access);
+}
+
+void ept_t::transaction::change_access(pa_t guest_pa, epte_t::access_type access) noexcept
+{
+  //
+  // Change access rights of the (already mapped) entry which
+  // translates the guest physical address, regardless of its size.
+  //
+  enqueue(operation_type::change_access, guest_pa, pa_t{ 0 }, access);
+}
+
+void ept_t::transaction::commit() noexcept
+{
+  apply();
+
+  //
+  // Mappings derived from EPT need to be invalidated only if some of
+  // the changes restricted them.  Note that single INVEPT covers all
+  // changes made by this transaction.
+  //
+  ept_.flush_if_needed();
+}
+
+void ept_t::transaction::enqueue(operation_type type, pa_t guest_pa, pa_t host_pa,
+                                 epte_t::access_type access, pml level /* = pml::pt */) noexcept
+{
+  //
+  // Try to coalesce 4kb mapping with the previous one.
+  //
+  if (type == operation_type::map && level == pml::pt && operation_count_ > 0)
+  {
+    auto& last = operation_[operation_count_ - 1];
+
+    if (last.type   == operation_type::map &&
+        last.level  == pml::pt &&
+        last.access == access &&
+        last.guest_pa + pa_t{ last.count * ept_pt_t::size } == guest_pa &&
+        last.host_pa  + pa_t{ last.count * ept_pt_t::size } == host_pa)
+    {
+      last.count += 1;
+      return;
+    }
+  }
+
+  //
+  // Apply queued operations if the queue is full.
+  // The invalidation is still deferred until commit().
+  //
+  if (operation_count_ == max_operation_count)
+  {
+    apply();
+  }
+
+  operation_[operation_count_++] = operation_t{ type, level, access, 1, guest_pa, host_pa };
+}
+
+void ept_t::transaction::apply() noexcept
+{
+  for (int i = 0; i < operation_count_; ++i)
+  {
+    const auto& operation = operation_[i];
+
+    switch (operation.type)
+    {
+      case operation_type::map:
+        if (operation.level == pml::pt)
+        {
+          //
+          // Walk the EPT hierarchy only once per page-table.  Following
+          // entries of the same page-table are updated in place.
+          //
+          epte_t* pte = nullptr;
+
+          for (uint32_t page = 0; page < operation.count; ++page)
+          {
+            const pa_t guest_pa = operation.guest_pa + pa_t{ page * ept_pt_t::size };
+            const pa_t host_pa  = operation.host_pa  + pa_t{ page * ept_pt_t::size };
+
+            if (!pte || guest_pa.index(pml::pt) == 0)
+            {
+              pte = ept_.map_4kb(guest_pa, host_pa, operation.access);
+
+              //
+              // The page-table has been joined back into 2MB page
+              // (see ept_t::coalesce_table()) - walk again for the
+              // next page.
+              //
+              if (pte->large_page)
+              {
+                pte = nullptr;
+              }
+            }
+            else
+            {
+              pte += 1;
+
+              const auto before = *pte;
+              pte->update(host_pa, mm::mtrr().type(guest_pa), operation.access);
+              ept_.modified_entry(before, *pte, guest_pa, ept_pt_t::size);
+
+              //
+              // Entries updated in place bypass the automatic join -
+              // check the page-table when we're done with it.
+              //
+              if (guest_pa.index(pml::pt) == ept_pt_t::count - 1 || page + 1 == operation.count)
+              {
+                ept_.coalesce(guest_pa);
+                pte = nullptr;
+              }
+            }
+          }
+        }
+        else
+        {
+          ept_.map(operation.guest_pa, operation.host_pa, operation.access, operation.level);
+        }
+        break;
+
+      case operation_type::split_1gb_to_2mb:
+        ept_.split_1gb_to_2mb(operation.guest_pa, operation.host_pa, operation.access);
+        break;
+
+      case operation_type::split_2mb_to_4kb:
+        ept_.split_2mb_to_4kb(operation.guest_pa, operation.host_pa, operation.access);
+        break;
+
+      case operation_type::join_2mb_to_1gb:
+        ept_.join_2mb_to_1gb(operation.guest_pa, operation.host_pa, operation.access);
+        break;
+
+      case operation_type::join_4kb_to_2mb:
+        ept_.join_4kb_to_2mb(operation.guest_pa, operation.host_pa, operation.access);
+        break;
+
+      case operation_type::change_access:
+        if (auto entry = ept_.ept_entry(operation.guest_pa))
+        {
+          const auto before = *entry;
+          entry->update(operation.access);
+          ept_.modified_entry(before, *entry, operation.guest_pa, ept_pt_t::size);
+        }
+        break;
+
+      default:
+        hvpp_assert(0);
+        break;
+    }
+  }
+
+  operation_count_ = 0;
+}
+
 }
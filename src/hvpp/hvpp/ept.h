@@ -2,8 +2,11 @@
 #include "ia32/ept.h"
 #include "ia32/memory.h"
 
+#include "lib/bitmap.h"
 #include "lib/error.h"
 
+#include <atomic>
+
 namespace hvpp {
 
 using namespace ia32;
@@ -11,10 +14,48 @@ using namespace ia32;
 class ept_t final
 {
   public:
+    class transaction;
+
+    //
+    // Kind of the EPT modification (see modified()).
+    //
+    enum class modification
+    {
+      //
+      // Access rights have been extended or a non-present entry has
+      // been mapped.  No invalidation is needed - a stale (more
+      // restrictive) translation causes EPT violation, which itself
+      // invalidates it.
+      // (ref: Vol3C[28.3.3.1(Operations that Invalidate Cached Mappings)])
+      //
+      relax,
+
+      //
+      // Access rights have been reduced, or the entry now maps another
+      // host physical address (or memory type).
+      //
+      restrict,
+
+      //
+      // Paging structures have been changed (split, join, unmap).
+      //
+      structure,
+    };
+
     ept_t() noexcept;
+    ept_t(const ept_t& base) noexcept;
+    ept_t(ept_t&& other) noexcept = delete;
     ~ept_t() noexcept;
 
+    ept_t& operator=(const ept_t& other) noexcept = delete;
+    ept_t& operator=(ept_t&& other) noexcept = delete;
+
     void map_identity(epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
+    void map_identity_1gb(epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
+    void map_identity_lazy(epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
+
+    bool is_lazy() const noexcept;
+    bool fault_in(pa_t guest_pa) noexcept;
 
     epte_t* map    (pa_t guest_pa, pa_t host_pa,
                     epte_t::access_type access = epte_t::access_type::read_write_execute,
@@ -39,9 +80,65 @@ class ept_t final
     void join_4kb_to_2mb(pa_t guest_pa, pa_t host_pa,
                          epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
 
+    size_t protect_range(pa_t guest_pa, size_t size, epte_t::access_type access) noexcept;
+
+    //
+    // Make all paging structures which translate [guest_pa, guest_pa + size)
+    // private (see unshare_subtable()) - e.g. so that accessed and dirty
+    // flags of their entries aren't shared with other EPTs.
+    //
+    void unshare_range(pa_t guest_pa, size_t size) noexcept;
+
+    bool coalesce(pa_t guest_pa) noexcept;
+
+    size_t memory_type_update(const physical_memory_range& range) noexcept;
+
+    void ve_enable(pa_t guest_pa, bool enable = true) noexcept;
+    void access_dirty_enable(bool enable = true) noexcept;
+    auto access_harvest(bitmap& accessed) noexcept -> size_t;
+
     epte_t*   ept_entry(pa_t guest_pa, pml level = pml::pt) noexcept;
+
+    //
+    // Same as ept_entry(), but shared paging structures on the way
+    // aren't made private - the entry might belong to the base EPT,
+    // therefore it must not be modified.
+    //
+    auto      ept_entry_lookup(pa_t guest_pa, pml level = pml::pt) const noexcept -> const epte_t*;
+
+    //
+    // Get the leaf entry (4kb, 2MB or 1GB page) which translates the
+    // guest physical address, and its level.
+    //
+    epte_t*   ept_leaf(pa_t guest_pa, pml& level) noexcept;
     ept_ptr_t ept_pointer() const noexcept;
 
+    //
+    // Invalidation tracking.  Modifications made by methods of this
+    // class are recorded automatically, entries modified directly
+    // (via ept_entry()) have to be reported by modified().
+    // flush_if_needed() issues single-context INVEPT only if some
+    // recorded modification since the last flush requires it - and
+    // only if the EPT pointer has ever been loaded into the VMCS
+    // (see loaded()).  The VCPU calls it for its EPTs at the end of
+    // each VM-exit, therefore all changes made during single VM-exit
+    // are covered by (at most) one INVEPT.
+    //
+    // Modifications of leaf entries which translate the guest physical
+    // address of the EPT violation being handled (see violation())
+    // don't require invalidation either.
+    //
+    void modified(modification kind) noexcept;
+    bool flush_pending() const noexcept;
+    bool flush_if_needed() noexcept;
+    auto generation() const noexcept -> uint32_t;
+
+    void loaded() noexcept;
+    void violation(pa_t guest_pa) noexcept;
+    void violation_end() noexcept;
+
+    void reserve(int table_count) noexcept;
+
   private:
     template <
       typename ept_table_from_t,
@@ -55,7 +152,12 @@ class ept_t final
     >
     void join(pa_t guest_pa, pa_t host_pa, epte_t::access_type access) noexcept;
 
-    epte_t* map_subtable(epte_t* table) noexcept;
+    epte_t* unshare_subtable(epte_t* entry, pml level) noexcept;
+    epte_t* map_subtable(epte_t* entry, pml level) noexcept;
+    bool    coalesce_table(epte_t* entry, pml level = pml::pd) noexcept;
+    auto    memory_type_update_table(epte_t* table, pml level, uint64_t table_pa,
+                                     const physical_memory_range& range, bool dry_run) noexcept -> size_t;
+    auto    access_harvest_table(epte_t* table, pml level, uint64_t first_pfn, bitmap& accessed) noexcept -> size_t;
 
     epte_t* map_pml4(pa_t guest_pa, pa_t host_pa, epte_t* pml4,
                      epte_t::access_type access, pml large) noexcept;
@@ -69,9 +171,165 @@ class ept_t final
     void unmap_table(epte_t* table, pml level = pml::pml4) noexcept;
     void unmap_entry(epte_t* entry, pml level) noexcept;
 
+    void    modified_entry(const epte_t& before, const epte_t& after,
+                           pa_t guest_pa, uint64_t size) noexcept;
+
+    epte_t* entry_cache_lookup(pa_t guest_pa, pml level) noexcept;
+    void    entry_cache_insert(pa_t guest_pa, epte_t* pde) noexcept;
+    void    entry_cache_flush() noexcept;
+
+    epte_t* allocate_table() noexcept;
+    void    free_table(epte_t* table) noexcept;
+    bool    allocate_table_chunk() noexcept;
+
     alignas(page_size)
     epte_t epml4_[512];
     ept_ptr_t eptptr_;
+
+    //
+    // EPT this instance shares its paging structures with (if any)
+    // and number of instances which share paging structures of this
+    // instance.
+    //
+    const ept_t* base_;
+    mutable std::atomic_uint32_t ref_count_;
+
+    //
+    // Lazy (on-demand) identity mapping - see map_identity_lazy().
+    //
+    bool lazy_;
+    epte_t::access_type lazy_access_;
+
+    //
+    // Pool of pages for EPT tables (PDPTs, PDs and PTs).
+    // Pages are allocated in chunks and kept in the free list, so that
+    // allocation of the table (e.g. during split in VM-exit) doesn't
+    // have to go through the global memory allocator.
+    //
+    static constexpr int table_chunk_size      = 64;    // pages per chunk
+    static constexpr int table_chunk_max_count = 64;
+
+    struct free_table_t
+    {
+      free_table_t* next;
+    };
+
+    free_table_t* table_free_list_;
+    int           table_free_count_;
+    epte_t*       table_chunk_[table_chunk_max_count];
+    int           table_chunk_count_;
+
+    //
+    // Number of tables allocated outside of the pool (after all chunks
+    // have been used up).  If there are none, the destructor releases
+    // whole chunks without walking the hierarchy.
+    //
+    int           table_overflow_count_;
+
+    //
+    // Direct-mapped cache of recently resolved PD entries (indexed by
+    // 2MB guest physical region) and page-tables they point to.
+    // Used by ept_entry() to avoid full walk of the hierarchy.
+    //
+    static constexpr int entry_cache_size = 16;
+
+    struct entry_cache_t
+    {
+      uint64_t tag;
+      epte_t*  pde;
+      epte_t*  pt;
+    };
+
+    entry_cache_t entry_cache_[entry_cache_size];
+
+    //
+    // Invalidation tracking (see flush_if_needed()).  "generation_" is
+    // incremented on each recorded modification.  "violation_pa_" is
+    // the guest physical address of the EPT violation being handled
+    // (~0 if none).
+    //
+    uint32_t generation_;
+    bool     flush_pending_;
+    bool     loaded_;
+    uint64_t violation_pa_;
+};
+
+//
+// Batch of EPT modifications which are followed by single INVEPT.
+//
+// Operations are queued and applied either when the queue is full or
+// when the transaction is committed.  Consecutive 4kb mappings with
+// contiguous guest and host physical addresses are coalesced into
+// single operation, which is then applied without re-walking the EPT
+// hierarchy for each page.  The commit (explicit or in the destructor)
+// invalidates the EPT only if some of the changes requires it (see
+// ept_t::flush_if_needed()).
+//
+
+class ept_t::transaction final
+{
+  public:
+    static constexpr int max_operation_count = 32;
+
+    transaction(ept_t& ept) noexcept;
+    transaction(const transaction& other) noexcept = delete;
+    transaction(transaction&& other) noexcept = delete;
+    ~transaction() noexcept;
+
+    transaction& operator=(const transaction& other) noexcept = delete;
+    transaction& operator=(transaction&& other) noexcept = delete;
+
+    void map_4kb(pa_t guest_pa, pa_t host_pa,
+                 epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
+
+    void map_2mb(pa_t guest_pa, pa_t host_pa,
+                 epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
+
+    void map_1gb(pa_t guest_pa, pa_t host_pa,
+                 epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
+
+    void split_1gb_to_2mb(pa_t guest_pa, pa_t host_pa,
+                          epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
+    void split_2mb_to_4kb(pa_t guest_pa, pa_t host_pa,
+                          epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
+
+    void join_2mb_to_1gb(pa_t guest_pa, pa_t host_pa,
+                         epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
+    void join_4kb_to_2mb(pa_t guest_pa, pa_t host_pa,
+                         epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
+
+    void change_access(pa_t guest_pa, epte_t::access_type access) noexcept;
+
+    void commit() noexcept;
+
+  private:
+    enum class operation_type : uint8_t
+    {
+      map,
+      split_1gb_to_2mb,
+      split_2mb_to_4kb,
+      join_2mb_to_1gb,
+      join_4kb_to_2mb,
+      change_access,
+    };
+
+    struct operation_t
+    {
+      operation_type      type;
+      pml                 level;
+      epte_t::access_type access;
+      uint32_t            count;
+      pa_t                guest_pa;
+      pa_t                host_pa;
+    };
+
+    void enqueue(operation_type type, pa_t guest_pa, pa_t host_pa,
+                 epte_t::access_type access, pml level = pml::pt) noexcept;
+    void apply() noexcept;
+
+    ept_t&      ept_;
+    operation_t operation_[max_operation_count];
+    int         operation_count_;
 };
 
 }
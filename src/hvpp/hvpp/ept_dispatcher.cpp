@@ -0,0 +1,269 @@
+#include "ept_dispatcher.h"
+
+#include "lib/assert.h"
+
+#include <mutex>
+
+namespace hvpp {
+
+ept_dispatcher::ept_dispatcher() noexcept
+  : lock_{}
+  , epoch_{}
+  , page_count_{ 0 }
+  , slot_count_{ 0 }
+  , handler_{}
+  , slot_{}
+{
+
+}
+
+auto ept_dispatcher::add(pa_t pa, size_t size, callback_t callback, void* context) noexcept -> error_code_t
+{
+  if (!size || !callback)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  const auto first_pfn = pa.pfn();
+  const auto last_pfn  = pa_t{ pa.value() + size - 1 }.pfn();
+
+  std::lock_guard _{ lock_ };
+
+  //
+  // Check the whole range first, so that it's either added as a whole
+  // or not at all.
+  //
+  size_t new_slot_count = 0;
+
+  for (auto pfn = first_pfn; pfn <= last_pfn; ++pfn)
+  {
+    const auto slot = find(pfn);
+
+    if (!slot)
+    {
+      new_slot_count += 1;
+    }
+    else if (slot->handler.load(std::memory_order_relaxed))
+    {
+      return make_error_code_t(std::errc::file_exists);
+    }
+  }
+
+  if (slot_count_ + new_slot_count > max_page_count)
+  {
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  uint32_t handler_index = 1;
+
+  while (handler_index <= max_handler_count && handler_[handler_index].page_count)
+  {
+    handler_index += 1;
+  }
+
+  if (handler_index > max_handler_count)
+  {
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  auto& handler = handler_[handler_index];
+  handler.callback   = callback;
+  handler.context    = context;
+  handler.page_count = static_cast<size_t>(last_pfn - first_pfn + 1);
+
+  for (auto pfn = first_pfn; pfn <= last_pfn; ++pfn)
+  {
+    auto slot = insert(pfn);
+    hvpp_assert(slot != nullptr);
+
+    //
+    // Publish the page - the handler has been written above.
+    //
+    slot->handler.store(handler_index, std::memory_order_release);
+  }
+
+  page_count_.fetch_add(handler.page_count, std::memory_order_relaxed);
+  return error_code_t{};
+}
+
+auto ept_dispatcher::remove(pa_t pa, size_t size) noexcept -> size_t
+{
+  if (!size)
+  {
+    return 0;
+  }
+
+  const auto first_pfn = pa.pfn();
+  const auto last_pfn  = pa_t{ pa.value() + size - 1 }.pfn();
+
+  std::lock_guard _{ lock_ };
+
+  size_t result = 0;
+
+  for (auto pfn = first_pfn; pfn <= last_pfn; ++pfn)
+  {
+    auto slot = const_cast<slot_t*>(find(pfn));
+
+    if (!slot)
+    {
+      continue;
+    }
+
+    const auto handler_index = slot->handler.exchange(0, std::memory_order_relaxed);
+
+    if (!handler_index)
+    {
+      continue;
+    }
+
+    //
+    // Handler without any page is free - it's reused by the next add(),
+    // which can't happen before the synchronize() below.
+    //
+    handler_[handler_index].page_count -= 1;
+    result += 1;
+  }
+
+  if (result)
+  {
+    page_count_.fetch_sub(result, std::memory_order_relaxed);
+
+    //
+    // Wait for dispatch() calls which might still use the callbacks
+    // of removed pages.
+    //
+    epoch_.synchronize();
+  }
+
+  return result;
+}
+
+bool ept_dispatcher::ept_violation(vcpu_t& vp) noexcept
+{
+  if (!page_count_.load(std::memory_order_relaxed))
+  {
+    return false;
+  }
+
+  const auto exit_qualification = vp.exit_qualification().ept_violation;
+
+  fault_t fault;
+  fault.guest_pa             = vp.exit_guest_physical_address();
+  fault.guest_la             = exit_qualification.valid_guest_linear_address
+                                 ? vp.exit_guest_linear_address()
+                                 : va_t{ 0ull };
+  fault.access               = static_cast<epte_t::access_type>(exit_qualification.flags & 0b111);
+  fault.allowed              = static_cast<epte_t::access_type>((exit_qualification.flags >> 3) & 0b111);
+  fault.linear_address_valid = exit_qualification.valid_guest_linear_address;
+  fault.misconfiguration     = false;
+
+  return dispatch(vp, fault);
+}
+
+bool ept_dispatcher::ept_misconfiguration(vcpu_t& vp) noexcept
+{
+  if (!page_count_.load(std::memory_order_relaxed))
+  {
+    return false;
+  }
+
+  //
+  // Exit qualification is undefined for EPT misconfiguration - only
+  // the guest-physical address is provided.
+  // (ref: Vol3C[27.2.1(Basic VM-Exit Information)])
+  //
+  fault_t fault;
+  fault.guest_pa             = vp.exit_guest_physical_address();
+  fault.guest_la             = va_t{ 0ull };
+  fault.access               = epte_t::access_type::none;
+  fault.allowed              = epte_t::access_type::none;
+  fault.linear_address_valid = false;
+  fault.misconfiguration     = true;
+
+  return dispatch(vp, fault);
+}
+
+bool ept_dispatcher::dispatch(vcpu_t& vp, const fault_t& fault) noexcept
+{
+  //
+  // The write might modify decoded instructions (see
+  // vcpu_t::decode_cache_lookup()).
+  //
+  if ((fault.access & epte_t::access_type::write) != epte_t::access_type::none)
+  {
+    vcpu_t::decode_cache_invalidate(fault.guest_pa);
+  }
+
+  epoch_domain::read_guard _{ epoch_ };
+
+  const auto slot = find(fault.guest_pa.pfn());
+
+  if (!slot)
+  {
+    return false;
+  }
+
+  const auto handler_index = slot->handler.load(std::memory_order_acquire);
+
+  if (!handler_index)
+  {
+    return false;
+  }
+
+  const auto& handler = handler_[handler_index];
+  return handler.callback(vp, fault, handler.context);
+}
+
+auto ept_dispatcher::find(uint64_t pfn) const noexcept -> const slot_t*
+{
+  const auto key = pfn + 1;
+
+  for (size_t i = 0, index = hash(pfn); i < capacity; ++i, index = (index + 1) & (capacity - 1))
+  {
+    const auto slot_key = slot_[index].key.load(std::memory_order_acquire);
+
+    if (slot_key == key)
+    {
+      return &slot_[index];
+    }
+
+    if (slot_key == 0)
+    {
+      break;
+    }
+  }
+
+  return nullptr;
+}
+
+auto ept_dispatcher::insert(uint64_t pfn) noexcept -> slot_t*
+{
+  if (auto slot = find(pfn))
+  {
+    return const_cast<slot_t*>(slot);
+  }
+
+  if (slot_count_ == max_page_count)
+  {
+    return nullptr;
+  }
+
+  for (size_t index = hash(pfn); ; index = (index + 1) & (capacity - 1))
+  {
+    auto& slot = slot_[index];
+
+    if (slot.key.load(std::memory_order_relaxed) == 0)
+    {
+      slot.handler.store(0, std::memory_order_relaxed);
+
+      //
+      // Publish the slot - the lock-free find() can see it from now on.
+      //
+      slot.key.store(pfn + 1, std::memory_order_release);
+      slot_count_ += 1;
+      return &slot;
+    }
+  }
+}
+
+}
@@ -0,0 +1,139 @@
+#pragma once
+#include "vcpu.h"
+
+#include "lib/epoch.h"
+#include "lib/error.h"
+#include "lib/spinlock.h"
+
+#include <atomic>
+#include <cstdint>
+
+namespace hvpp {
+
+//
+// Dispatcher of EPT violations and misconfigurations.
+//
+// Monitored pages are kept in a global open-addressed hash table keyed
+// by the guest page frame number, each page references its callback.
+// The VM-exit handler finds the callback of the faulting page with single
+// lookup - regardless of how many regions are monitored - and the callback
+// receives already decoded fault (see fault_t).  Lookups are lock-free
+// (callbacks are protected by the epoch domain), modifications are
+// serialized.
+//
+// The dispatcher only routes the VM-exit - the callback is responsible
+// for changing the EPT (and for suppressing the RIP adjustment, if the
+// instruction should be retried).  If the dispatcher doesn't monitor any
+// page, dispatching costs single load.
+//
+// Note that slots of removed pages are reused only by the same page
+// (see hook_manager), therefore at most "capacity" distinct pages can be
+// monitored during the lifetime of the dispatcher.
+//
+// Usage:
+//   ept_dispatcher_.add(pa, size, &my_callback, this);
+//
+//   void my_handler::handle_ept_violation(vcpu_t& vp) noexcept
+//   {
+//     if (!ept_dispatcher_.ept_violation(vp))
+//     {
+//       base_type::handle_ept_violation(vp);
+//     }
+//   }
+//
+
+class ept_dispatcher
+{
+  public:
+    //
+    // Number of slots of the hash table (power of 2).
+    //
+    static constexpr size_t capacity = 8192;
+    static constexpr size_t max_page_count = capacity * 3 / 4;
+
+    //
+    // Maximum number of distinct registrations (callback + context).
+    //
+    static constexpr size_t max_handler_count = 255;
+
+    struct fault_t
+    {
+      pa_t               guest_pa;
+      va_t               guest_la;      // valid only if "linear_address_valid"
+      epte_t::access_type access;       // attempted access (none for misconfiguration)
+      epte_t::access_type allowed;      // access allowed by the EPT entry
+      bool               linear_address_valid;
+      bool               misconfiguration;
+    };
+
+    //
+    // Returns false if the VM-exit is left to the caller.  Callbacks are
+    // called in the VMX-root mode and must not call add()/remove().
+    //
+    using callback_t = bool(*)(vcpu_t& vp, const fault_t& fault, void* context) noexcept;
+
+    ept_dispatcher() noexcept;
+
+    ept_dispatcher(const ept_dispatcher& other) noexcept = delete;
+    ept_dispatcher(ept_dispatcher&& other) noexcept = delete;
+    ept_dispatcher& operator=(const ept_dispatcher& other) noexcept = delete;
+    ept_dispatcher& operator=(ept_dispatcher&& other) noexcept = delete;
+
+    //
+    // Route faults of all pages of [pa, pa + size) to the callback.  Fails
+    // if any of these pages is already monitored.
+    //
+    // remove() stops routing faults of the pages and returns after no VCPU
+    // can call their callback anymore - after that, the context can be
+    // freed.  These methods must be called at IRQL <= DISPATCH_LEVEL
+    // (outside of the VMX-root mode).
+    //
+    auto add(pa_t pa, size_t size, callback_t callback, void* context) noexcept -> error_code_t;
+    auto remove(pa_t pa, size_t size) noexcept -> size_t;
+
+    auto page_count() const noexcept -> size_t
+    { return page_count_.load(std::memory_order_relaxed); }
+
+    //
+    // Handle the EPT violation / misconfiguration VM-exit.  Returns false
+    // if the faulting page isn't monitored (or its callback returned false).
+    //
+    bool ept_violation(vcpu_t& vp) noexcept;
+    bool ept_misconfiguration(vcpu_t& vp) noexcept;
+
+  private:
+    struct slot_t
+    {
+      std::atomic_uint64_t key;         // PFN + 1, 0 = empty
+      std::atomic_uint32_t handler;     // index into handler_, 0 = none
+    };
+
+    struct handler_t
+    {
+      callback_t callback;
+      void*      context;
+      size_t     page_count;            // 0 = free
+    };
+
+    bool dispatch(vcpu_t& vp, const fault_t& fault) noexcept;
+
+    auto find(uint64_t pfn) const noexcept -> const slot_t*;
+    auto insert(uint64_t pfn) noexcept -> slot_t*;
+
+    static size_t hash(uint64_t pfn) noexcept
+    { return static_cast<size_t>((pfn * 0x9e3779b97f4a7c15) >> 32) & (capacity - 1); }
+
+    spinlock             lock_;
+    epoch_domain         epoch_;
+    std::atomic<size_t>  page_count_;
+    size_t               slot_count_;
+
+    //
+    // Handler 0 is never used.
+    //
+    handler_t            handler_[max_handler_count + 1];
+
+    slot_t               slot_[capacity];
+};
+
+}
@@ -0,0 +1,112 @@
+#include "ept_view_policy.h"
+#include "hypervisor.h"
+
+#include "lib/assert.h"
+
+namespace hvpp {
+
+ept_view_policy::ept_view_policy() noexcept
+  : map_{}
+  , map_count_{ 0 }
+  , per_vcpu_{}
+{
+  const auto err = per_vcpu_.initialize();
+  hvpp_assert(!err);
+  (void)(err);
+}
+
+auto ept_view_policy::map(cr3_t cr3, uint16_t ept_index) noexcept -> error_code_t
+{
+  hvpp_assert(!hypervisor::is_started());
+
+  if (ept_index == 0)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  for (uint32_t i = 0; i < map_count_; ++i)
+  {
+    if (map_[i].pfn == cr3.page_frame_number)
+    {
+      map_[i].ept_index = ept_index;
+      return error_code_t{};
+    }
+  }
+
+  if (map_count_ == max_map_count)
+  {
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  map_[map_count_++] = map_entry_t{ cr3.page_frame_number, ept_index };
+  return error_code_t{};
+}
+
+void ept_view_policy::setup(vcpu_t& vp) noexcept
+{
+  per_vcpu_[vp.cpu_index()] = per_vcpu_t{};
+
+  auto procbased_ctls = vp.processor_based_controls();
+  procbased_ctls.cr3_load_exiting = true;
+  vp.processor_based_controls(procbased_ctls);
+
+  select(vp, ept_index(vp.guest_cr3()));
+}
+
+auto ept_view_policy::mov_to_cr3(vcpu_t& vp, cr3_t cr3) noexcept -> uint16_t
+{
+  const auto index = ept_index(cr3);
+
+  if (vp.ept_index() != index)
+  {
+    select(vp, index);
+  }
+
+  return index;
+}
+
+auto ept_view_policy::ept_index(cr3_t cr3) const noexcept -> uint16_t
+{
+  for (uint32_t i = 0; i < map_count_; ++i)
+  {
+    if (map_[i].pfn == cr3.page_frame_number)
+    {
+      return map_[i].ept_index;
+    }
+  }
+
+  return 0;
+}
+
+void ept_view_policy::select(vcpu_t& vp, uint16_t ept_index) noexcept
+{
+  //
+  // Views which weren't enabled by the handler fall back to the
+  // default one.
+  //
+  if (ept_index >= vp.ept_count())
+  {
+    ept_index = 0;
+  }
+
+  auto& data = per_vcpu_[vp.cpu_index()];
+  const auto previous_index = vp.ept_index();
+
+  if (previous_index == 0 && ept_index != 0)
+  {
+    //
+    // Entering the monitored view - make sure that leaving it causes
+    // VM-exit, even if the next CR3 is in the CR3-target list.
+    //
+    data.saved_target_count = vp.cr3_target_count();
+    vp.cr3_target_count(0);
+  }
+  else if (previous_index != 0 && ept_index == 0)
+  {
+    vp.cr3_target_count(data.saved_target_count);
+  }
+
+  vp.ept_index(ept_index);
+}
+
+}
@@ -0,0 +1,119 @@
+#pragma once
+#include "vcpu.h"
+
+#include "lib/error.h"
+#include "lib/per_cpu.h"
+
+#include <cstdint>
+
+namespace hvpp {
+
+//
+// Per-process EPT views.
+//
+// Maps address spaces (compared by the page frame number of CR3,
+// therefore regardless of the PCID) to EPT views of the VCPU (see
+// vcpu_t::ept_enable(count)).  On each MOV to CR3 VM-exit, the VCPU
+// switches to the view of the new address space, or to the default
+// view (0, usually the unrestricted identity map) if the address space
+// isn't mapped - monitoring views (e.g. with hooked pages) apply only
+// while the monitored processes run, other processes don't cause any
+// hook-induced EPT violations.  Switching the view is a single EPTP
+// write - combined mappings are tagged by the EPTP, no invalidation
+// is needed.
+//
+// The policy can be combined with cr3_policy: while a monitored view is
+// active, the CR3-target list of the VCPU is emptied, so that leaving
+// the monitored address space always causes VM-exit; the list is
+// restored on the switch back to the default view.  Each mapped CR3
+// must be watched by the cr3_policy as well (otherwise it might be
+// moved into the CR3-target list) and ept_view_policy::mov_to_cr3() must
+// be called before cr3_policy::mov_to_cr3().
+//
+// Usage:
+//   ept_view_policy_.map(interesting_cr3, 1);        // e.g. in the ctor
+//   cr3_policy_.watch(interesting_cr3);
+//
+//   void my_handler::setup(vcpu_t& vp) noexcept
+//   {
+//     vp.ept_enable(2);
+//     // ... hook pages in vp.ept(1) ...
+//
+//     ept_view_policy_.setup(vp);
+//     cr3_policy_.setup(vp);
+//   }
+//
+//   void my_handler::handle_mov_cr(vcpu_t& vp) noexcept
+//   {
+//     // ... MOV to CR3 ...
+//     auto cr3 = cr3_t{ vp.exit_context().gp_register[exit_qualification.gp_register] };
+//     ept_view_policy_.mov_to_cr3(vp, cr3);
+//     cr3_policy_.mov_to_cr3(vp, cr3);
+//
+//     base_type::handle_mov_cr(vp);
+//   }
+//
+
+class ept_view_policy
+{
+  public:
+    //
+    // Maximum number of mapped address spaces.
+    //
+    static constexpr size_t max_map_count = 16;
+
+    ept_view_policy() noexcept;
+
+    ept_view_policy(const ept_view_policy& other) noexcept = delete;
+    ept_view_policy(ept_view_policy&& other) noexcept = delete;
+    ept_view_policy& operator=(const ept_view_policy& other) noexcept = delete;
+    ept_view_policy& operator=(ept_view_policy&& other) noexcept = delete;
+
+    //
+    // Run the address space on the EPT view "ept_index".  Must be called
+    // before the hypervisor is started (e.g. in the VM-exit handler
+    // constructor).
+    //
+    auto map(cr3_t cr3, uint16_t ept_index) noexcept -> error_code_t;
+
+    //
+    // Enable "cr3_load_exiting" and select the view of the current guest
+    // CR3 (called from vmexit_handler::attach(), after ept_enable()).
+    //
+    void setup(vcpu_t& vp) noexcept;
+
+    //
+    // Account the MOV to CR3 VM-exit - switch to the view of the source
+    // operand.  Returns the EPT index of the view.
+    //
+    auto mov_to_cr3(vcpu_t& vp, cr3_t cr3) noexcept -> uint16_t;
+
+    //
+    // EPT index of the address space (0 if it isn't mapped).
+    //
+    auto ept_index(cr3_t cr3) const noexcept -> uint16_t;
+
+  private:
+    struct map_entry_t
+    {
+      uint64_t pfn;
+      uint16_t ept_index;
+    };
+
+    struct per_vcpu_t
+    {
+      //
+      // CR3-target count saved while a monitored view is active.
+      //
+      uint32_t saved_target_count;
+    };
+
+    void select(vcpu_t& vp, uint16_t ept_index) noexcept;
+
+    map_entry_t map_[max_map_count];
+    uint32_t    map_count_;
+
+    per_cpu<per_vcpu_t> per_vcpu_;
+};
+
+}
@@ -0,0 +1,137 @@
+#include "exception_policy.h"
+
+#include "lib/assert.h"
+
+namespace hvpp {
+
+namespace detail
+{
+  static void compile_bit(exception_policy::bit_t bit, uint32_t flag,
+                          uint32_t& mask, uint32_t& match) noexcept
+  {
+    switch (bit)
+    {
+      case exception_policy::bit_t::set:
+        mask  |= flag;
+        match |= flag;
+        break;
+
+      case exception_policy::bit_t::clear:
+        mask  |= flag;
+        break;
+
+      default:
+        break;
+    }
+  }
+}
+
+exception_policy::exception_policy() noexcept
+  : bitmap_{}
+  , pagefault_mask_{}
+  , pagefault_match_{}
+  , pagefault_filtered_{ false }
+  , rule_{}
+{
+
+}
+
+void exception_policy::intercept(exception_vector vector,
+                                 callback_t callback /* = nullptr */, void* context /* = nullptr */) noexcept
+{
+  const auto index = static_cast<uint32_t>(vector);
+  hvpp_assert(index < vector_count);
+
+  bitmap_.flags |= 1u << index;
+  rule_[index] = rule_t{ callback, context };
+}
+
+void exception_policy::intercept_pagefault(const pagefault_filter_t& filter,
+                                           callback_t callback /* = nullptr */, void* context /* = nullptr */) noexcept
+{
+  uint32_t mask  = 0;
+  uint32_t match = 0;
+
+  pagefault_error_code_t flag;
+
+  flag.flags = 0; flag.present = true;
+  detail::compile_bit(filter.present, flag.flags, mask, match);
+
+  flag.flags = 0; flag.write = true;
+  detail::compile_bit(filter.write, flag.flags, mask, match);
+
+  flag.flags = 0; flag.user_mode_access = true;
+  detail::compile_bit(filter.user_mode_access, flag.flags, mask, match);
+
+  flag.flags = 0; flag.reserved_bit_violation = true;
+  detail::compile_bit(filter.reserved_bit_violation, flag.flags, mask, match);
+
+  flag.flags = 0; flag.execute = true;
+  detail::compile_bit(filter.execute, flag.flags, mask, match);
+
+  flag.flags = 0; flag.protection_key_violation = true;
+  detail::compile_bit(filter.protection_key_violation, flag.flags, mask, match);
+
+  pagefault_mask_.flags  = mask;
+  pagefault_match_.flags = match;
+  pagefault_filtered_    = true;
+
+  //
+  // Inverted filter is expressed by the cleared #PF bit.  Note that
+  // inverted filter with all bits "any" never causes VM-exit.
+  //
+  const auto index = static_cast<uint32_t>(exception_vector::page_fault);
+
+  if (filter.inverted)
+  {
+    bitmap_.flags &= ~(1u << index);
+  }
+  else
+  {
+    bitmap_.flags |= 1u << index;
+  }
+
+  rule_[index] = rule_t{ callback, context };
+}
+
+void exception_policy::setup(vcpu_t& vp) noexcept
+{
+  auto exception_bitmap = vp.exception_bitmap();
+  exception_bitmap.flags |= bitmap_.flags;
+
+  if (pagefault_filtered_)
+  {
+    //
+    // The #PF bit is fully controlled by the filter.
+    //
+    exception_bitmap.page_fault = bitmap_.page_fault;
+
+    vp.pagefault_error_code_mask(pagefault_mask_);
+    vp.pagefault_error_code_match(pagefault_match_);
+  }
+
+  vp.exception_bitmap(exception_bitmap);
+}
+
+bool exception_policy::dispatch(vcpu_t& vp) noexcept
+{
+  const auto interrupt = vp.interrupt_info();
+
+  if (interrupt.type() != vmx::interrupt_type::hardware_exception &&
+      interrupt.type() != vmx::interrupt_type::software_exception)
+  {
+    return false;
+  }
+
+  const auto index = static_cast<uint32_t>(interrupt.vector());
+
+  if (index >= vector_count)
+  {
+    return false;
+  }
+
+  const auto& rule = rule_[index];
+  return rule.callback && rule.callback(vp, interrupt, rule.context);
+}
+
+}
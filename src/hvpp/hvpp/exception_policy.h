@@ -0,0 +1,112 @@
+#pragma once
+#include "vcpu.h"
+
+#include "ia32/exception.h"
+#include "ia32/vmx/exception_bitmap.h"
+
+#include <cstdint>
+
+namespace hvpp {
+
+//
+// Exception interception policy.
+//
+// Intercepted exception vectors are compiled into the exception bitmap.
+// Page faults can be further filtered by their error code - the filter
+// is compiled into the page-fault error-code mask/match pair, so that
+// the processor itself decides whether the #PF causes VM-exit:
+//   - #PF bit set:   VM-exit if (error_code & mask) == match
+//   - #PF bit clear: VM-exit if (error_code & mask) != match
+// (ref: Vol3C[25.2(Other Causes of VM Exits)])
+//
+// Usage:
+//   exception_policy::pagefault_filter_t filter{};   // e.g. in the ctor
+//   filter.write = exception_policy::bit_t::set;
+//   filter.user_mode_access = exception_policy::bit_t::set;
+//   exception_policy_.intercept_pagefault(filter, &on_user_write_fault, this);
+//
+//   void my_handler::setup(vcpu_t& vp) noexcept
+//   {
+//     exception_policy_.setup(vp);
+//   }
+//
+//   void my_handler::handle_exception_or_nmi(vcpu_t& vp) noexcept
+//   {
+//     if (!exception_policy_.dispatch(vp))
+//     {
+//       base_type::handle_exception_or_nmi(vp);
+//     }
+//   }
+//
+
+class exception_policy
+{
+  public:
+    //
+    // Called for the intercepted exception.  Returns false if the
+    // exception is left to the caller (which usually reinjects it).
+    //
+    using callback_t = bool(*)(vcpu_t& vp, interrupt_t interrupt, void* context) noexcept;
+
+    enum class bit_t : uint8_t
+    {
+      any,
+      set,
+      clear,
+    };
+
+    //
+    // Page fault error-code filter - the page fault causes VM-exit only
+    // if all bits which aren't "any" match (or, if "inverted", if any of
+    // them doesn't match).
+    //
+    struct pagefault_filter_t
+    {
+      bit_t present;
+      bit_t write;
+      bit_t user_mode_access;
+      bit_t reserved_bit_violation;
+      bit_t execute;
+      bit_t protection_key_violation;
+      bool  inverted;
+    };
+
+    exception_policy() noexcept;
+
+    //
+    // These methods must be called before setup().
+    //
+    void intercept(exception_vector vector, callback_t callback = nullptr, void* context = nullptr) noexcept;
+    void intercept_pagefault(const pagefault_filter_t& filter, callback_t callback = nullptr, void* context = nullptr) noexcept;
+
+    //
+    // Add intercepted vectors to the exception bitmap of the VCPU and set
+    // the page-fault error-code mask/match (called from
+    // vmexit_handler::attach()).
+    //
+    void setup(vcpu_t& vp) noexcept;
+
+    //
+    // Call the callback of the exception which caused this VM-exit.
+    // Returns false if there's no callback (or if it returned false).
+    //
+    bool dispatch(vcpu_t& vp) noexcept;
+
+  private:
+    static constexpr size_t vector_count = 32;
+
+    struct rule_t
+    {
+      callback_t callback;
+      void*      context;
+    };
+
+    vmx::exception_bitmap_t bitmap_;
+    pagefault_error_code_t  pagefault_mask_;
+    pagefault_error_code_t  pagefault_match_;
+    bool                    pagefault_filtered_;
+
+    rule_t                  rule_[vector_count];
+};
+
+}
@@ -0,0 +1,271 @@
+#include "hook_manager.h"
+
+#include "lib/assert.h"
+#include "lib/mm.h"
+
+namespace hvpp {
+
+hook_manager::hook_manager() noexcept
+  : lock_{}
+  , generation_{ 0 }
+  , hook_count_{ 0 }
+  , slot_count_{ 0 }
+  , per_vcpu_{}
+  , mtf_stepper_{}
+  , slot_{}
+{
+  const auto err = per_vcpu_.initialize();
+  hvpp_assert(!err);
+  (void)(err);
+}
+
+auto hook_manager::install(const hook_t* hooks, size_t count) noexcept -> size_t
+{
+  spinlock::guard _{ lock_ };
+
+  const auto generation = generation_.load(std::memory_order_relaxed) + 1;
+  size_t result = 0;
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    auto slot = insert(hooks[i].exec_pa.pfn());
+
+    if (!slot)
+    {
+      break;
+    }
+
+    slot->read_pfn.store(hooks[i].read_pa.pfn(), std::memory_order_relaxed);
+    slot->generation.store(generation, std::memory_order_relaxed);
+
+    if (!slot->active.exchange(true, std::memory_order_release))
+    {
+      hook_count_ += 1;
+    }
+
+    result += 1;
+  }
+
+  //
+  // Publish the modifications to sync().
+  //
+  if (result)
+  {
+    generation_.store(generation, std::memory_order_release);
+  }
+
+  return result;
+}
+
+auto hook_manager::remove(const pa_t* exec_pa, size_t count) noexcept -> size_t
+{
+  spinlock::guard _{ lock_ };
+
+  const auto generation = generation_.load(std::memory_order_relaxed) + 1;
+  size_t result = 0;
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    auto slot = const_cast<slot_t*>(find(exec_pa[i].pfn()));
+
+    if (!slot || !slot->active.load(std::memory_order_relaxed))
+    {
+      continue;
+    }
+
+    slot->generation.store(generation, std::memory_order_relaxed);
+    slot->active.store(false, std::memory_order_release);
+
+    hook_count_ -= 1;
+    result += 1;
+  }
+
+  if (result)
+  {
+    generation_.store(generation, std::memory_order_release);
+  }
+
+  return result;
+}
+
+void hook_manager::remove_all() noexcept
+{
+  spinlock::guard _{ lock_ };
+
+  const auto generation = generation_.load(std::memory_order_relaxed) + 1;
+
+  for (auto& slot : slot_)
+  {
+    if (slot.active.load(std::memory_order_relaxed))
+    {
+      slot.generation.store(generation, std::memory_order_relaxed);
+      slot.active.store(false, std::memory_order_release);
+    }
+  }
+
+  hook_count_ = 0;
+  generation_.store(generation, std::memory_order_release);
+}
+
+void hook_manager::sync(vcpu_t& vp) noexcept
+{
+  auto& data = per_vcpu_[vp.cpu_index()];
+
+  const auto generation = generation_.load(std::memory_order_acquire);
+
+  if (generation == data.generation)
+  {
+    return;
+  }
+
+  //
+  // Paging structures created by splitting the hooked pages are
+  // accounted to the hooks (see mm::memory_tag).
+  //
+  mm::tag_guard _{ mm::memory_tag::hook };
+
+  for (uint16_t view = 0; view < vp.ept_count(); ++view)
+  {
+    //
+    // Note that the transaction invalidates EPT (INVEPT) only once,
+    // when it's committed (at the end of this scope).
+    //
+    ept_t::transaction transaction{ vp.ept(view) };
+
+    for (auto& slot : slot_)
+    {
+      const auto key = slot.key.load(std::memory_order_acquire);
+
+      if (key == 0 || slot.generation.load(std::memory_order_relaxed) <= data.generation)
+      {
+        continue;
+      }
+
+      const auto exec_pa = pa_t::from_pfn(key - 1);
+
+      //
+      // Split the large pages where the hooked page resides (splitting
+      // of already split page does nothing).
+      //
+      transaction.split_1gb_to_2mb(exec_pa & ept_pdpt_t::mask, exec_pa & ept_pdpt_t::mask);
+      transaction.split_2mb_to_4kb(exec_pa & ept_pd_t::mask, exec_pa & ept_pd_t::mask);
+
+      transaction.map_4kb(exec_pa, exec_pa, slot.active.load(std::memory_order_acquire)
+                                              ? epte_t::access_type::execute
+                                              : epte_t::access_type::read_write_execute);
+    }
+  }
+
+  data.generation = generation;
+}
+
+bool hook_manager::ept_violation(vcpu_t& vp) noexcept
+{
+  const auto guest_pa = vp.exit_guest_physical_address();
+  const auto slot = find(guest_pa.pfn());
+
+  if (!slot || !slot->active.load(std::memory_order_acquire))
+  {
+    return false;
+  }
+
+  const auto exec_pa = pa_t::from_pfn(guest_pa.pfn());
+  const auto read_pa = pa_t::from_pfn(slot->read_pfn.load(std::memory_order_relaxed));
+  const auto exit_qualification = vp.exit_qualification().ept_violation;
+
+  if (exit_qualification.data_read || exit_qualification.data_write)
+  {
+    //
+    // Data access - let the instruction see the "read" page.
+    //
+    mtf_stepper_.step(vp, exec_pa,
+                      read_pa, epte_t::access_type::read_write,
+                      exec_pa, epte_t::access_type::execute);
+  }
+  else if (mtf_stepper_.is_stepping(vp))
+  {
+    //
+    // Instruction fetch from the page mapped by the step above - the
+    // instruction accesses its own page, let it run from the "read"
+    // page.
+    //
+    mtf_stepper_.step(vp, exec_pa,
+                      read_pa, epte_t::access_type::read_write_execute,
+                      exec_pa, epte_t::access_type::execute);
+  }
+  else
+  {
+    //
+    // Restore execute-only access (e.g. after the hook has been
+    // installed again in the middle of the step).
+    //
+    vp.ept(vp.ept_index()).map_4kb(exec_pa, exec_pa, epte_t::access_type::execute);
+  }
+
+  //
+  // No INVEPT is needed - see vmexit_custom_handler::handle_ept_violation().
+  //
+  vp.suppress_rip_adjust();
+  return true;
+}
+
+bool hook_manager::monitor_trap_flag(vcpu_t& vp) noexcept
+{
+  return mtf_stepper_.monitor_trap_flag(vp);
+}
+
+auto hook_manager::find(uint64_t exec_pfn) const noexcept -> const slot_t*
+{
+  const auto key = exec_pfn + 1;
+
+  for (size_t i = 0, index = hash(exec_pfn); i < capacity; ++i, index = (index + 1) & (capacity - 1))
+  {
+    const auto slot_key = slot_[index].key.load(std::memory_order_acquire);
+
+    if (slot_key == key)
+    {
+      return &slot_[index];
+    }
+
+    if (slot_key == 0)
+    {
+      break;
+    }
+  }
+
+  return nullptr;
+}
+
+auto hook_manager::insert(uint64_t exec_pfn) noexcept -> slot_t*
+{
+  if (auto slot = find(exec_pfn))
+  {
+    return const_cast<slot_t*>(slot);
+  }
+
+  if (slot_count_ == max_hook_count)
+  {
+    return nullptr;
+  }
+
+  for (size_t index = hash(exec_pfn); ; index = (index + 1) & (capacity - 1))
+  {
+    auto& slot = slot_[index];
+
+    if (slot.key.load(std::memory_order_relaxed) == 0)
+    {
+      slot.read_pfn.store(0, std::memory_order_relaxed);
+      slot.generation.store(0, std::memory_order_relaxed);
+      slot.active.store(false, std::memory_order_relaxed);
+
+      //
+      // Publish the slot - the lock-free find() can see it from now on.
+      //
+      slot.key.store(exec_pfn + 1, std::memory_order_release);
+      slot_count_ += 1;
+      return &slot;
+    }
+  }
+}
+
+}
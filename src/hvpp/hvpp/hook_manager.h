@@ -0,0 +1,136 @@
+#pragma once
+#include "vcpu.h"
+#include "mtf_stepper.h"
+
+#include "lib/error.h"
+#include "lib/per_cpu.h"
+#include "lib/spinlock.h"
+
+#include <atomic>
+#include <cstdint>
+
+namespace hvpp {
+
+//
+// Manager of invisible (EPT split) code hooks.
+//
+// Hooked page is mapped execute-only in all EPT views of all VCPUs -
+// data accesses are redirected (for single instruction, see mtf_stepper)
+// to the "read" page, which holds the original content and which is
+// shared by all VCPUs.  Hooks are kept in a global open-addressed hash
+// table keyed by the guest page frame number - lookups (in the EPT
+// violation handler) are lock-free, modifications are serialized.
+//
+// Modifications are applied to the EPT views of the VCPU lazily, by
+// sync() - which must be called on each VCPU (e.g. by VMCALL executed
+// on each CPU after the hooks are installed).  It costs single INVEPT
+// per EPT view, regardless of the number of modified hooks.
+//
+// Note that slots of removed hooks are reused only by the same page
+// (so that sync() can still unmap them), therefore at most "capacity"
+// distinct pages can be hooked during the lifetime of the manager.
+//
+// Usage:
+//   void my_handler::handle_execute_vmcall(vcpu_t& vp) noexcept
+//   {
+//     hook_manager_.install(hooks, hook_count);
+//     hook_manager_.sync(vp);
+//   }
+//
+//   void my_handler::handle_ept_violation(vcpu_t& vp) noexcept
+//   {
+//     if (!hook_manager_.ept_violation(vp))
+//     {
+//       base_type::handle_ept_violation(vp);
+//     }
+//   }
+//
+//   void my_handler::handle_monitor_trap_flag(vcpu_t& vp) noexcept
+//   {
+//     if (!hook_manager_.monitor_trap_flag(vp))
+//     {
+//       base_type::handle_monitor_trap_flag(vp);
+//     }
+//   }
+//
+
+class hook_manager
+{
+  public:
+    //
+    // Number of slots of the hash table (power of 2).
+    //
+    static constexpr size_t capacity = 8192;
+    static constexpr size_t max_hook_count = capacity * 3 / 4;
+
+    struct hook_t
+    {
+      pa_t exec_pa;                 // hooked page (execute-only)
+      pa_t read_pa;                 // page seen on read/write access
+    };
+
+    hook_manager() noexcept;
+
+    hook_manager(const hook_manager& other) noexcept = delete;
+    hook_manager(hook_manager&& other) noexcept = delete;
+    hook_manager& operator=(const hook_manager& other) noexcept = delete;
+    hook_manager& operator=(hook_manager&& other) noexcept = delete;
+
+    //
+    // These methods can be called from any CPU (and from the VMX-root
+    // mode as well).  Installing already installed page just updates
+    // its "read" page.  Returns number of installed/removed hooks.
+    //
+    auto install(const hook_t* hooks, size_t count) noexcept -> size_t;
+    auto remove(const pa_t* exec_pa, size_t count) noexcept -> size_t;
+    void remove_all() noexcept;
+
+    auto hook_count() const noexcept -> size_t
+    { return hook_count_; }
+
+    //
+    // Apply modifications made since the last sync() of this VCPU to all
+    // its EPT views.
+    //
+    void sync(vcpu_t& vp) noexcept;
+
+    //
+    // Handle the EPT violation / MTF VM-exit.  Returns false if it wasn't
+    // caused by any hook.
+    //
+    bool ept_violation(vcpu_t& vp) noexcept;
+    bool monitor_trap_flag(vcpu_t& vp) noexcept;
+
+  private:
+    struct slot_t
+    {
+      std::atomic_uint64_t key;     // PFN + 1, 0 = empty
+      std::atomic_uint64_t read_pfn;
+      std::atomic_uint64_t generation;
+      std::atomic_bool     active;
+    };
+
+    auto find(uint64_t exec_pfn) const noexcept -> const slot_t*;
+    auto insert(uint64_t exec_pfn) noexcept -> slot_t*;
+
+    static size_t hash(uint64_t pfn) noexcept
+    { return static_cast<size_t>((pfn * 0x9e3779b97f4a7c15) >> 32) & (capacity - 1); }
+
+    spinlock             lock_;
+    std::atomic_uint64_t generation_;
+    size_t               hook_count_;
+    size_t               slot_count_;
+
+    struct per_vcpu_t
+    {
+      uint64_t generation;
+    };
+
+    per_cpu<per_vcpu_t>  per_vcpu_;
+
+    mtf_stepper          mtf_stepper_;
+
+    slot_t               slot_[capacity];
+};
+
+}
@@ -0,0 +1,214 @@
+#include "host_page_table.h"
+
+#include "ia32/asm.h"
+#include "ia32/mtrr.h"
+
+#include "lib/assert.h"
+#include "lib/mm.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+namespace hvpp {
+
+host_page_table::host_page_table() noexcept
+  : pml4_{ nullptr }
+  , table_{}
+  , table_count_{ 0 }
+  , direct_map_base_{ nullptr }
+  , direct_map_size_{ 0 }
+  , global_pages_{ false }
+  , cr3_{}
+{
+
+}
+
+host_page_table::~host_page_table() noexcept
+{
+  destroy();
+}
+
+auto host_page_table::initialize(bool global_pages) noexcept -> error_code_t
+{
+  hvpp_assert(pml4_ == nullptr);
+
+  global_pages_ = global_pages;
+
+  pml4_ = allocate_table();
+  if (!pml4_)
+  {
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  //
+  // Share the kernel half of the current address space.  The kernel
+  // address space is the same in all processes (except the session
+  // space, which the hypervisor never touches).
+  //
+  const auto os_pml4 = reinterpret_cast<const pe_t*>(
+    pa_t::from_pfn(read<cr3_t>().page_frame_number).va());
+
+  std::copy(os_pml4 + pml4_t::count / 2, os_pml4 + pml4_t::count, pml4_ + pml4_t::count / 2);
+
+  //
+  // Find an unused kernel PML4 entry for the direct map.
+  //
+  auto slot = pml4_t::count / 2;
+
+  while (slot < pml4_t::count && pml4_[slot].present)
+  {
+    slot += 1;
+  }
+
+  if (slot == pml4_t::count)
+  {
+    destroy();
+    return make_error_code_t(std::errc::not_supported);
+  }
+
+  //
+  // Cover the physical memory, rounded up to 1GB.
+  //
+  const auto& descriptor = mm::physical_memory_descriptor();
+  const auto highest_pa = descriptor.size()
+    ? (descriptor.end() - 1)->end().value()
+    : 0;
+
+  const auto direct_map_size = std::min(page_align_up(highest_pa, pdpt_t{}), max_direct_map_size);
+
+  //
+  // 1GB pages are supported if CPUID.80000001H:EDX.Page1GB[26] is set.
+  //
+  uint32_t cpu_info[4];
+  ia32_asm_cpuid(cpu_info, 0x80000001);
+  const bool gb_pages = (cpu_info[3] & (1 << 26)) != 0;
+
+  auto pdpt = allocate_table();
+  if (!pdpt)
+  {
+    destroy();
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  map_table(pml4_[slot], pdpt);
+
+  for (uint64_t pdpt_pa = 0; pdpt_pa < direct_map_size; pdpt_pa += pdpt_t::size)
+  {
+    auto& pdpte = pdpt[pa_t{ pdpt_pa }.index(pml::pdpt)];
+
+    //
+    // Large page must not span more MTRR memory types - its effective
+    // memory type would be undefined.
+    //
+    if (gb_pages && mm::mtrr().is_uniform(pdpt_pa, pdpt_t::size))
+    {
+      map_page(pdpte, pdpt_pa, true);
+      continue;
+    }
+
+    auto pd = allocate_table();
+    if (!pd)
+    {
+      destroy();
+      return make_error_code_t(std::errc::not_enough_memory);
+    }
+
+    map_table(pdpte, pd);
+
+    for (uint64_t pd_pa = pdpt_pa; pd_pa < pdpt_pa + pdpt_t::size; pd_pa += pd_t::size)
+    {
+      auto& pde = pd[pa_t{ pd_pa }.index(pml::pd)];
+
+      if (mm::mtrr().is_uniform(pd_pa, pd_t::size))
+      {
+        map_page(pde, pd_pa, true);
+        continue;
+      }
+
+      auto pt = allocate_table();
+      if (!pt)
+      {
+        destroy();
+        return make_error_code_t(std::errc::not_enough_memory);
+      }
+
+      map_table(pde, pt);
+
+      for (uint64_t pt_pa = pd_pa; pt_pa < pd_pa + pd_t::size; pt_pa += pt_t::size)
+      {
+        map_page(pt[pa_t{ pt_pa }.index(pml::pt)], pt_pa, false);
+      }
+    }
+  }
+
+  //
+  // Canonical address of the PML4 entry (sign-extended bit 47).
+  //
+  direct_map_base_ = reinterpret_cast<uint8_t*>(~(pml4_t::size * pml4_t::count - 1) | (slot << pml4_t::shift));
+  direct_map_size_ = direct_map_size;
+
+  cr3_ = cr3_t{};
+  cr3_.page_frame_number = pa_t::from_va(pml4_).pfn();
+
+  return error_code_t{};
+}
+
+void host_page_table::destroy() noexcept
+{
+  std::for_each_n(table_, table_count_, [](pe_t* table) {
+    ::operator delete[](table, std::align_val_t{ page_size });
+  });
+
+  pml4_ = nullptr;
+  table_count_ = 0;
+  direct_map_base_ = nullptr;
+  direct_map_size_ = 0;
+  cr3_ = cr3_t{};
+}
+
+auto host_page_table::allocate_table() noexcept -> pe_t*
+{
+  if (table_count_ == max_table_count)
+  {
+    return nullptr;
+  }
+
+  //
+  // Tables must be page-aligned (see mm::allocate_aligned()).
+  //
+  auto table = new (std::align_val_t{ page_size }) pe_t[pml4_t::count];
+  if (!table)
+  {
+    return nullptr;
+  }
+
+  memset(table, 0, sizeof(pe_t) * pml4_t::count);
+  table_[table_count_++] = table;
+  return table;
+}
+
+void host_page_table::map_page(pe_t& entry, pa_t pa, bool large_page) noexcept
+{
+  //
+  // Memory type of the direct map is determined by MTRRs only (PAT
+  // entry 0 - write-back).  The direct map is never executed.
+  //
+  entry.flags = 0;
+  entry.present = true;
+  entry.write = true;
+  entry.large_page = large_page;
+  entry.global = global_pages_;
+  entry.execute_disable = true;
+  entry.page_frame_number = pa.pfn();
+}
+
+void host_page_table::map_table(pe_t& entry, const pe_t* table) noexcept
+{
+  entry.flags = 0;
+  entry.present = true;
+  entry.write = true;
+  entry.page_frame_number = pa_t::from_va(table).pfn();
+}
+
+}
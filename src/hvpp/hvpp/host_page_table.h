@@ -0,0 +1,102 @@
+#pragma once
+#include "ia32/arch.h"
+#include "ia32/memory.h"
+#include "ia32/paging.h"
+
+#include "lib/error.h"
+
+#include <cstdint>
+
+namespace hvpp {
+
+using namespace ia32;
+
+//
+// Page tables of the VMX-root mode.
+//
+// By default, VCPUs keep the CR3 of the process the launch IPI happened
+// to interrupt - the host then runs on page tables (and TLB entries) of
+// a random process.  These page tables are owned by the hypervisor:
+//   - the kernel half of the address space (hypervisor image, the mm
+//     pool, VCPU stacks, ...) is shared with the kernel address space
+//     at the time of initialize(),
+//   - one unused kernel PML4 entry holds a direct map of the physical
+//     memory, mapped by 1GB pages (if supported) or 2MB pages - only
+//     ranges which aren't covered by uniform MTRR memory type are split
+//     down to 4kb pages.
+// The user half is empty.
+//
+// Physical memory can then be accessed in the VMX-root mode simply by
+// va() - without remapping a mapping_t window.
+//
+// If "global_pages" is set, the direct map is mapped by global pages.
+// This should be set only if VCPUs use VPIDs - otherwise translations
+// of the direct map would survive VM-entries and could be used by the
+// guest.
+//
+// Note that kernel PML4 entries created by the OS after initialize()
+// aren't visible in the host address space.
+//
+// Usage:
+//   host_page_table_.initialize(true);
+//   vp.host_address_space(host_page_table_.cr3());   // before vp.launch()
+//
+//   auto guest_page = reinterpret_cast<uint8_t*>(host_page_table_.va(guest_pa));
+//
+
+class host_page_table
+{
+  public:
+    static constexpr uint64_t max_direct_map_size = pml4_t::size;
+
+    host_page_table() noexcept;
+    ~host_page_table() noexcept;
+
+    host_page_table(const host_page_table& other) noexcept = delete;
+    host_page_table(host_page_table&& other) noexcept = delete;
+    host_page_table& operator=(const host_page_table& other) noexcept = delete;
+    host_page_table& operator=(host_page_table&& other) noexcept = delete;
+
+    //
+    // Must be called at IRQL = PASSIVE_LEVEL.
+    //
+    auto initialize(bool global_pages) noexcept -> error_code_t;
+    void destroy() noexcept;
+
+    auto cr3() const noexcept -> cr3_t
+    { return cr3_; }
+
+    //
+    // Virtual address of the physical address in the direct map, or
+    // nullptr if the address isn't mapped.  The address is valid only
+    // while these page tables are loaded (i.e. in the VMX-root mode).
+    //
+    auto va(pa_t pa) const noexcept -> void*
+    {
+      return pa.value() < direct_map_size_
+        ? direct_map_base_ + pa.value()
+        : nullptr;
+    }
+
+    auto direct_map_size() const noexcept -> uint64_t
+    { return direct_map_size_; }
+
+  private:
+    static constexpr size_t max_table_count = 1 + 1 + 512 + 64;
+
+    auto allocate_table() noexcept -> pe_t*;
+
+    void map_page(pe_t& entry, pa_t pa, bool large_page) noexcept;
+    void map_table(pe_t& entry, const pe_t* table) noexcept;
+
+    pe_t*    pml4_;
+    pe_t*    table_[max_table_count];
+    size_t   table_count_;
+
+    uint8_t* direct_map_base_;
+    uint64_t direct_map_size_;
+    bool     global_pages_;
+    cr3_t    cr3_;
+};
+
+}
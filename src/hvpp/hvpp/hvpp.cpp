@@ -9,6 +9,7 @@
 #include "lib/mm.h"
 #include "vmexit/vmexit_c_wrapper.h"
 
+#include <new>
 #include <stdarg.h>
 
 using namespace ia32;
@@ -16,6 +17,23 @@ using namespace hvpp;
 
 #define vcpu_                                                 ((vcpu_t*)Vcpu)
 #define ept_                                                  ((ept_t*)Ept)
+#define transaction_                                          ((ept_t::transaction*)Transaction)
+
+static_assert(sizeof(EPT_TRANSACTION) >= sizeof(ept_t::transaction));
+static_assert(alignof(EPT_TRANSACTION) >= alignof(ept_t::transaction));
+
+static_assert(EPT_MODIFICATION_RELAX     == int(ept_t::modification::relax));
+static_assert(EPT_MODIFICATION_RESTRICT  == int(ept_t::modification::restrict));
+static_assert(EPT_MODIFICATION_STRUCTURE == int(ept_t::modification::structure));
+
+//
+// See vmexit_c_wrapper_handler::exit_snapshot.
+//
+static_assert(sizeof(VMEXIT_SNAPSHOT) == sizeof(vmexit_c_wrapper_handler::exit_snapshot));
+static_assert(FIELD_OFFSET(VMEXIT_SNAPSHOT, Reason)               == offsetof(vmexit_c_wrapper_handler::exit_snapshot, exit_reason));
+static_assert(FIELD_OFFSET(VMEXIT_SNAPSHOT, Qualification)        == offsetof(vmexit_c_wrapper_handler::exit_snapshot, exit_qualification));
+static_assert(FIELD_OFFSET(VMEXIT_SNAPSHOT, GuestPhysicalAddress) == offsetof(vmexit_c_wrapper_handler::exit_snapshot, exit_guest_physical_address));
+static_assert(FIELD_OFFSET(VMEXIT_SNAPSHOT, GuestLinearAddress)   == offsetof(vmexit_c_wrapper_handler::exit_snapshot, exit_guest_linear_address));
 
 extern "C" {
 
@@ -192,6 +210,238 @@ HvppEptGetEptPointer(
   return EPT_PTR { ept_->ept_pointer().flags };
 }
 
+PEPT
+NTAPI
+HvppEptCreate(
+  VOID
+  )
+{
+  return (PEPT)new ept_t();
+}
+
+PEPT
+NTAPI
+HvppEptCreateView(
+  _In_ PEPT BaseEpt
+  )
+{
+  return (PEPT)new ept_t(*((ept_t*)BaseEpt));
+}
+
+VOID
+NTAPI
+HvppEptDestroy(
+  _In_ PEPT Ept
+  )
+{
+  delete ept_;
+}
+
+VOID
+NTAPI
+HvppEptMapIdentity(
+  _In_ PEPT Ept,
+  _In_ ULONG Access
+  )
+{
+  ept_->map_identity((epte_t::access_type)Access);
+}
+
+PEPTE
+NTAPI
+HvppEptGetEntry(
+  _In_ PEPT Ept,
+  _In_ PHYSICAL_ADDRESS GuestPhysicalAddress,
+  _In_ ULONG Level
+  )
+{
+  return (PEPTE)
+    ept_->ept_entry(
+    pa_t{ (uint64_t)GuestPhysicalAddress.QuadPart },
+    (pml)Level
+    );
+}
+
+SIZE_T
+NTAPI
+HvppEptProtectRange(
+  _In_ PEPT Ept,
+  _In_ PHYSICAL_ADDRESS GuestPhysicalAddress,
+  _In_ SIZE_T Size,
+  _In_ ULONG Access
+  )
+{
+  return ept_->protect_range(
+    pa_t{ (uint64_t)GuestPhysicalAddress.QuadPart },
+    Size,
+    (epte_t::access_type)Access
+    );
+}
+
+BOOLEAN
+NTAPI
+HvppEptCoalesce(
+  _In_ PEPT Ept,
+  _In_ PHYSICAL_ADDRESS GuestPhysicalAddress
+  )
+{
+  return ept_->coalesce(pa_t{ (uint64_t)GuestPhysicalAddress.QuadPart });
+}
+
+VOID
+NTAPI
+HvppEptModified(
+  _In_ PEPT Ept,
+  _In_ ULONG Modification
+  )
+{
+  ept_->modified((ept_t::modification)Modification);
+}
+
+BOOLEAN
+NTAPI
+HvppEptFlushIfNeeded(
+  _In_ PEPT Ept
+  )
+{
+  return ept_->flush_if_needed();
+}
+
+VOID
+NTAPI
+HvppEptMapBatch(
+  _In_ PEPT Ept,
+  _In_reads_(Count) const EPT_MAP_ENTRY* Entries,
+  _In_ ULONG Count
+  )
+{
+  ept_t::transaction transaction{ *ept_ };
+
+  for (ULONG Index = 0; Index < Count; ++Index)
+  {
+    const auto guest_pa = pa_t{ (uint64_t)Entries[Index].GuestPhysicalAddress.QuadPart };
+    const auto host_pa  = pa_t{ (uint64_t)Entries[Index].HostPhysicalAddress.QuadPart };
+    const auto access   = (epte_t::access_type)Entries[Index].Access;
+
+    switch ((pml)Entries[Index].Large)
+    {
+      case pml::pt:   transaction.map_4kb(guest_pa, host_pa, access); break;
+      case pml::pd:   transaction.map_2mb(guest_pa, host_pa, access); break;
+      case pml::pdpt: transaction.map_1gb(guest_pa, host_pa, access); break;
+      default:        hvpp_assert(0);                                  break;
+    }
+  }
+
+  //
+  // Committed in the destructor.
+  //
+}
+
+VOID
+NTAPI
+HvppEptTransactionBegin(
+  _Out_ PEPT_TRANSACTION Transaction,
+  _In_ PEPT Ept
+  )
+{
+  new (Transaction) ept_t::transaction(*ept_);
+}
+
+VOID
+NTAPI
+HvppEptTransactionMap4Kb(
+  _In_ PEPT_TRANSACTION Transaction,
+  _In_ PHYSICAL_ADDRESS GuestPhysicalAddress,
+  _In_ PHYSICAL_ADDRESS HostPhysicalAddress,
+  _In_ ULONG Access
+  )
+{
+  transaction_->map_4kb(
+    pa_t{ (uint64_t)GuestPhysicalAddress.QuadPart },
+    pa_t{ (uint64_t)HostPhysicalAddress.QuadPart },
+    (epte_t::access_type)Access
+    );
+}
+
+VOID
+NTAPI
+HvppEptTransactionMap2Mb(
+  _In_ PEPT_TRANSACTION Transaction,
+  _In_ PHYSICAL_ADDRESS GuestPhysicalAddress,
+  _In_ PHYSICAL_ADDRESS HostPhysicalAddress,
+  _In_ ULONG Access
+  )
+{
+  transaction_->map_2mb(
+    pa_t{ (uint64_t)GuestPhysicalAddress.QuadPart },
+    pa_t{ (uint64_t)HostPhysicalAddress.QuadPart },
+    (epte_t::access_type)Access
+    );
+}
+
+VOID
+NTAPI
+HvppEptTransactionSplit2MbTo4Kb(
+  _In_ PEPT_TRANSACTION Transaction,
+  _In_ PHYSICAL_ADDRESS GuestPhysicalAddress,
+  _In_ PHYSICAL_ADDRESS HostPhysicalAddress
+  )
+{
+  transaction_->split_2mb_to_4kb(
+    pa_t{ (uint64_t)GuestPhysicalAddress.QuadPart },
+    pa_t{ (uint64_t)HostPhysicalAddress.QuadPart }
+    );
+}
+
+VOID
+NTAPI
+HvppEptTransactionJoin4KbTo2Mb(
+  _In_ PEPT_TRANSACTION Transaction,
+  _In_ PHYSICAL_ADDRESS GuestPhysicalAddress,
+  _In_ PHYSICAL_ADDRESS HostPhysicalAddress
+  )
+{
+  transaction_->join_4kb_to_2mb(
+    pa_t{ (uint64_t)GuestPhysicalAddress.QuadPart },
+    pa_t{ (uint64_t)HostPhysicalAddress.QuadPart }
+    );
+}
+
+VOID
+NTAPI
+HvppEptTransactionChangeAccess(
+  _In_ PEPT_TRANSACTION Transaction,
+  _In_ PHYSICAL_ADDRESS GuestPhysicalAddress,
+  _In_ ULONG Access
+  )
+{
+  transaction_->change_access(
+    pa_t{ (uint64_t)GuestPhysicalAddress.QuadPart },
+    (epte_t::access_type)Access
+    );
+}
+
+VOID
+NTAPI
+HvppEptTransactionCommit(
+  _In_ PEPT_TRANSACTION Transaction
+  )
+{
+  transaction_->commit();
+}
+
+VOID
+NTAPI
+HvppEptTransactionEnd(
+  _In_ PEPT_TRANSACTION Transaction
+  )
+{
+  //
+  // The destructor commits the transaction.
+  //
+  transaction_->~transaction();
+}
+
 #pragma endregion
 
 //////////////////////////////////////////////////////////////////////////
@@ -283,6 +533,15 @@ HvppIsStarted(
   return hypervisor::is_started();
 }
 
+PEPT
+NTAPI
+HvppGetSharedEpt(
+  VOID
+  )
+{
+  return (PEPT)&hypervisor::shared_ept();
+}
+
 #pragma endregion
 
 //////////////////////////////////////////////////////////////////////////
@@ -301,6 +560,17 @@ HvppVcpuEnableEpt(
   vcpu_->ept_enable(Count);
 }
 
+VOID
+NTAPI
+HvppVcpuEnableEptView(
+  _In_ PVCPU Vcpu,
+  _In_ PEPT BaseEpt,
+  _In_ USHORT Count
+  )
+{
+  vcpu_->ept_enable(*((ept_t*)BaseEpt), Count);
+}
+
 VOID
 NTAPI
 HvppVcpuDisableEpt(
@@ -310,6 +580,15 @@ HvppVcpuDisableEpt(
   vcpu_->ept_disable();
 }
 
+USHORT
+NTAPI
+HvppVcpuGetEptCount(
+  _In_ PVCPU Vcpu
+  )
+{
+  return vcpu_->ept_count();
+}
+
 USHORT
 NTAPI
 HvppVcpuGetEptIndex(
@@ -398,9 +677,7 @@ HvppVmRead(
   _In_ VMCS_FIELD VmcsField
   )
 {
-  ULONG64 Result = 0;
-  vmx::vmread((vmx::vmcs_t::field)VmcsField, Result);
-  return Result;
+  return vcpu_t::current().vmcs_field((vmx::vmcs_t::field)VmcsField);
 }
 
 VOID
@@ -410,7 +687,7 @@ HvppVmWrite(
   _In_ ULONG64 VmcsValue
   )
 {
-  vmx::vmwrite((vmx::vmcs_t::field)VmcsField, VmcsValue);
+  vcpu_t::current().vmcs_field((vmx::vmcs_t::field)VmcsField, VmcsValue);
 }
 
 ULONG_PTR
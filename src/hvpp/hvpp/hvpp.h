@@ -4,6 +4,8 @@
 #include <ntddk.h>
 #endif
 
+#include <intrin.h>
+
 #pragma warning(push)
 #pragma warning(disable: 4214)
 
@@ -824,6 +826,33 @@ typedef PVOID PHVPP;
 typedef PVOID PVCPU;
 typedef PVOID PEPT;
 
+//////////////////////////////////////////////////////////////////////////
+// VM-exit snapshot.
+//
+// Commonly used fields of the current VM-exit, filled before the
+// handler routine is called (see HvppVmExitSnapshot()).  Reading them
+// from the snapshot avoids calls of HvppVmRead(), HvppVcpuExitContext()
+// and HvppVcpuGetCurrentEpt().
+//
+// GuestPhysicalAddress is valid only for VMEXIT_REASON_EPT_VIOLATION
+// and VMEXIT_REASON_EPT_MISCONFIGURATION, GuestLinearAddress only for
+// VMEXIT_REASON_EPT_VIOLATION.  Both are 0 otherwise.
+//////////////////////////////////////////////////////////////////////////
+
+typedef struct _VMEXIT_SNAPSHOT
+{
+  PVCPU            Vcpu;
+  PVCPU_CONTEXT    Context;
+  PEPT             Ept;
+  ULONG            ProcessorIndex;
+  ULONG            Reason;
+  ULONG64          Qualification;
+  ULONG            InstructionLength;
+  ULONG            Reserved;
+  PHYSICAL_ADDRESS GuestPhysicalAddress;
+  PVOID            GuestLinearAddress;
+} VMEXIT_SNAPSHOT, *PVMEXIT_SNAPSHOT;
+
 //////////////////////////////////////////////////////////////////////////
 // VM-exit pass-trough handler.
 //////////////////////////////////////////////////////////////////////////
@@ -836,6 +865,7 @@ typedef struct _VMEXIT_PASSTHROUGH
 {
   PVMEXIT_PASSTROUGH_ROUTINE PasstroughRoutine;
   PVOID Context;
+  PVMEXIT_SNAPSHOT Snapshot;
   // UCHAR Data[1];
 } VMEXIT_PASSTHROUGH, *PVMEXIT_PASSTHROUGH;
 
@@ -845,6 +875,9 @@ typedef struct _VMEXIT_PASSTHROUGH
 #define HvppVmExitContext(Passthrough)                        \
   ((PVMEXIT_PASSTHROUGH)(Passthrough)->Context)
 
+#define HvppVmExitSnapshot(Passthrough)                       \
+  (((PVMEXIT_PASSTHROUGH)(Passthrough))->Snapshot)
+
 //////////////////////////////////////////////////////////////////////////
 // VM-exit handler.
 //////////////////////////////////////////////////////////////////////////
@@ -1205,6 +1238,196 @@ HvppEptGetEptPointer(
   _In_ PEPT Ept
   );
 
+//
+// Creation of EPTs.  HvppEptCreateView() creates copy-on-write view of
+// the base EPT - paging structures of the base are copied only when
+// they're modified through the view.  The base EPT must outlive all its
+// views.  See also HvppGetSharedEpt() and HvppVcpuEnableEptView().
+//
+
+PEPT
+NTAPI
+HvppEptCreate(
+  VOID
+  );
+
+PEPT
+NTAPI
+HvppEptCreateView(
+  _In_ PEPT BaseEpt
+  );
+
+VOID
+NTAPI
+HvppEptDestroy(
+  _In_ PEPT Ept
+  );
+
+VOID
+NTAPI
+HvppEptMapIdentity(
+  _In_ PEPT Ept,
+  _In_ ULONG Access
+  );
+
+PEPTE
+NTAPI
+HvppEptGetEntry(
+  _In_ PEPT Ept,
+  _In_ PHYSICAL_ADDRESS GuestPhysicalAddress,
+  _In_ ULONG Level
+  );
+
+//
+// Range operations.  HvppEptProtectRange() returns number of updated EPT
+// entries, HvppEptCoalesce() joins 4kb mappings of the 2MB region back
+// into the large page (if possible).  The invalidation is deferred
+// (see HvppEptFlushIfNeeded()).
+//
+
+SIZE_T
+NTAPI
+HvppEptProtectRange(
+  _In_ PEPT Ept,
+  _In_ PHYSICAL_ADDRESS GuestPhysicalAddress,
+  _In_ SIZE_T Size,
+  _In_ ULONG Access
+  );
+
+BOOLEAN
+NTAPI
+HvppEptCoalesce(
+  _In_ PEPT Ept,
+  _In_ PHYSICAL_ADDRESS GuestPhysicalAddress
+  );
+
+//
+// Invalidation tracking (see ept_t::flush_if_needed()).  Modifications
+// made by HvppEpt*() functions are recorded automatically, entries
+// modified directly (via HvppEptGetEntry()) have to be reported by
+// HvppEptModified().  HvppEptFlushIfNeeded() issues INVEPT only if some
+// modification requires it and returns TRUE if it did.  EPTs of the VCPU
+// are flushed this way at the end of each VM-exit.
+//
+
+#define EPT_MODIFICATION_RELAX                                0
+#define EPT_MODIFICATION_RESTRICT                             1
+#define EPT_MODIFICATION_STRUCTURE                            2
+
+VOID
+NTAPI
+HvppEptModified(
+  _In_ PEPT Ept,
+  _In_ ULONG Modification
+  );
+
+BOOLEAN
+NTAPI
+HvppEptFlushIfNeeded(
+  _In_ PEPT Ept
+  );
+
+//
+// Batch of mappings, followed by single INVEPT.  Consecutive 4kb
+// mappings with contiguous guest and host physical addresses are
+// coalesced.  "Large" has the same meaning as in HvppEptMapEx()
+// (0 - 4kb, 1 - 2MB, 2 - 1GB).  Must be called in VMX-root mode (from
+// the VM-exit handler).
+//
+
+typedef struct _EPT_MAP_ENTRY
+{
+  PHYSICAL_ADDRESS GuestPhysicalAddress;
+  PHYSICAL_ADDRESS HostPhysicalAddress;
+  ULONG Access;
+  ULONG Large;
+} EPT_MAP_ENTRY, *PEPT_MAP_ENTRY;
+
+VOID
+NTAPI
+HvppEptMapBatch(
+  _In_ PEPT Ept,
+  _In_reads_(Count) const EPT_MAP_ENTRY* Entries,
+  _In_ ULONG Count
+  );
+
+//
+// Transaction - EPT modifications which are followed by single INVEPT
+// (see ept_t::transaction).  The transaction lives in the storage
+// provided by the caller (e.g. on the stack), HvppEptTransactionCommit()
+// applies queued operations and the transaction can be reused,
+// HvppEptTransactionEnd() commits and destroys it.  Must be used in
+// VMX-root mode (from the VM-exit handler).
+//
+
+#define EPT_TRANSACTION_SIZE                                  1024
+
+typedef struct DECLSPEC_ALIGN(8) _EPT_TRANSACTION
+{
+  UCHAR Data[EPT_TRANSACTION_SIZE];
+} EPT_TRANSACTION, *PEPT_TRANSACTION;
+
+VOID
+NTAPI
+HvppEptTransactionBegin(
+  _Out_ PEPT_TRANSACTION Transaction,
+  _In_ PEPT Ept
+  );
+
+VOID
+NTAPI
+HvppEptTransactionMap4Kb(
+  _In_ PEPT_TRANSACTION Transaction,
+  _In_ PHYSICAL_ADDRESS GuestPhysicalAddress,
+  _In_ PHYSICAL_ADDRESS HostPhysicalAddress,
+  _In_ ULONG Access
+  );
+
+VOID
+NTAPI
+HvppEptTransactionMap2Mb(
+  _In_ PEPT_TRANSACTION Transaction,
+  _In_ PHYSICAL_ADDRESS GuestPhysicalAddress,
+  _In_ PHYSICAL_ADDRESS HostPhysicalAddress,
+  _In_ ULONG Access
+  );
+
+VOID
+NTAPI
+HvppEptTransactionSplit2MbTo4Kb(
+  _In_ PEPT_TRANSACTION Transaction,
+  _In_ PHYSICAL_ADDRESS GuestPhysicalAddress,
+  _In_ PHYSICAL_ADDRESS HostPhysicalAddress
+  );
+
+VOID
+NTAPI
+HvppEptTransactionJoin4KbTo2Mb(
+  _In_ PEPT_TRANSACTION Transaction,
+  _In_ PHYSICAL_ADDRESS GuestPhysicalAddress,
+  _In_ PHYSICAL_ADDRESS HostPhysicalAddress
+  );
+
+VOID
+NTAPI
+HvppEptTransactionChangeAccess(
+  _In_ PEPT_TRANSACTION Transaction,
+  _In_ PHYSICAL_ADDRESS GuestPhysicalAddress,
+  _In_ ULONG Access
+  );
+
+VOID
+NTAPI
+HvppEptTransactionCommit(
+  _In_ PEPT_TRANSACTION Transaction
+  );
+
+VOID
+NTAPI
+HvppEptTransactionEnd(
+  _In_ PEPT_TRANSACTION Transaction
+  );
+
 #pragma endregion
 
 //////////////////////////////////////////////////////////////////////////
@@ -1243,6 +1466,16 @@ HvppIsStarted(
   VOID
   );
 
+//
+// Identity map shared by all VCPUs (read-only base of their views).
+//
+
+PEPT
+NTAPI
+HvppGetSharedEpt(
+  VOID
+  );
+
 #pragma endregion
 
 //////////////////////////////////////////////////////////////////////////
@@ -1258,12 +1491,32 @@ HvppVcpuEnableEpt(
   _In_ USHORT Count
   );
 
+//
+// Enable "Count" EPTs, each initialized as copy-on-write view of the
+// base EPT (e.g. HvppGetSharedEpt()).  Views can be then switched by
+// HvppVcpuSetEptIndex().
+//
+
+VOID
+NTAPI
+HvppVcpuEnableEptView(
+  _In_ PVCPU Vcpu,
+  _In_ PEPT BaseEpt,
+  _In_ USHORT Count
+  );
+
 VOID
 NTAPI
 HvppVcpuDisableEpt(
   _In_ PVCPU Vcpu
   );
 
+USHORT
+NTAPI
+HvppVcpuGetEptCount(
+  _In_ PVCPU Vcpu
+  );
+
 USHORT
 HvppVcpuGetEptIndex(
   _In_ PVCPU Vcpu
@@ -1334,6 +1587,36 @@ HvppVmWrite(
   _In_ ULONG64 VmcsValue
   );
 
+//
+// Inline variants of HvppVmRead() and HvppVmWrite() - single VMREAD
+// (VMWRITE) instruction instead of the call into hvpp.  They must be
+// called only from the VM-exit handler routines (in VMX-root mode).
+//
+// Note that they can't be used if hvpp is built with the enlightened
+// VMCS (HVPP_ENLIGHTENED_VMCS) - use HvppVmRead() and HvppVmWrite().
+//
+
+FORCEINLINE
+ULONG64
+HvppVmReadInline(
+  _In_ VMCS_FIELD VmcsField
+  )
+{
+  size_t Result = 0;
+  __vmx_vmread((size_t)VmcsField, &Result);
+  return (ULONG64)Result;
+}
+
+FORCEINLINE
+VOID
+HvppVmWriteInline(
+  _In_ VMCS_FIELD VmcsField,
+  _In_ ULONG64 VmcsValue
+  )
+{
+  __vmx_vmwrite((size_t)VmcsField, (size_t)VmcsValue);
+}
+
 ULONG_PTR
 NTAPI
 HvppVmCall(
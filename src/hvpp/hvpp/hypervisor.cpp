@@ -6,7 +6,15 @@
 #include "lib/log.h"
 #include "lib/mm.h"
 #include "lib/mp.h"
+#include "lib/object.h"
+#include "lib/spinlock.h"
 
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <mutex>
+#include <new>
 #include <scoped_allocator>
 
 namespace hvpp::hypervisor
@@ -59,15 +67,137 @@ namespace hvpp::hypervisor
     }
   }
 
+  //
+  // Each VCPU is allocated from the memory of the NUMA node of its CPU
+  // and aligned to its stack size, so that vcpu_t::current() can find
+  // the VCPU just by masking the stack pointer.  The allocation is
+  // guaranteed to be only page-aligned - therefore one more stack size
+  // is allocated.
+  //
+  static constexpr size_t vcpu_allocation_size = sizeof(vcpu_t) + vcpu_stack_size;
+
   struct global_t
   {
-    vcpu_t* vcpu_list;
-    bool    started;
+    void*    vcpu_buffer[HVPP_MAX_CPU];
+    vcpu_t*  vcpu_list[HVPP_MAX_CPU];
+    ept_t*   ept;
+
+    //
+    // The identity map of the shared EPT is built on its first use
+    // (see shared_ept()) - handlers which never install the shared EPT
+    // don't pay for its 512 page directories.
+    //
+    spinlock         ept_lock;
+    std::atomic_bool ept_mapped;
+
+    //
+    // Page tables of the VMX-root mode (see HVPP_HOST_PAGE_TABLES).
+    //
+    host_page_table* host_page_tables;
+
+    //
+    // Guest memory windows of VCPUs (see vcpu_t::guest_read()).  They're
+    // owned here, because the virtual address space for them has to be
+    // reserved at PASSIVE_LEVEL - i.e. before VCPUs are constructed.
+    //
+    mapping_t* guest_mapping[HVPP_MAX_CPU];
+
+    //
+    // Virtualized CPUs (see start()).  The first one of them captures
+    // the VMCS template.
+    //
+    mp::cpu_set_t cpu_set;
+    uint32_t      vcpu_count;
+    uint32_t      first_cpu_index;
+
+    //
+    // Per-CPU dirty page bitmaps (see dirty_tracking_enable()).
+    //
+    bitmap*  dirty_bitmap;
+    uint8_t* dirty_bitmap_buffer;
+    size_t   dirty_bitmap_size;
+
+    //
+    // EPT accessed flags are harvested (see access_tracking_enable()).
+    //
+    bool     access_tracking;
+
+    //
+    // VMCS captured by the first VCPU (see start()).
+    //
+    object_t<vmcs_template_t> vmcs_template;
+
+    bool     started;
   };
 
   global_t global;
 
-  auto start(vmexit_handler& handler) noexcept -> error_code_t
+  namespace detail
+  {
+    static
+    auto
+    vcpu_at(
+      uint32_t cpu_index
+      ) noexcept -> vcpu_t&
+    {
+      return *global.vcpu_list[cpu_index];
+    }
+
+    static
+    void
+    vcpu_free(
+      void
+      ) noexcept
+    {
+      for (uint32_t i = 0; i < HVPP_MAX_CPU; ++i)
+      {
+        mm::system_free_node(global.vcpu_buffer[i]);
+        global.vcpu_buffer[i] = nullptr;
+        global.vcpu_list[i] = nullptr;
+
+        delete global.guest_mapping[i];
+        global.guest_mapping[i] = nullptr;
+      }
+    }
+
+    static
+    void
+    vcpu_destroy(
+      void
+      ) noexcept
+    {
+      //
+      // Destroy VCPUs - each one on its own CPU, concurrently on all CPUs
+      // (their EPTs, bitmaps and buffers are released in parallel) - and
+      // free them.  All VCPUs of the set must have been constructed.
+      //
+      mp::run_on_mask(global.cpu_set, []() {
+        mm::allocator_guard _;
+
+        vcpu_at(mp::cpu_index()).~vcpu_t();
+      });
+
+      vcpu_free();
+
+      global.cpu_set = mp::cpu_set_t::none();
+      global.vcpu_count = 0;
+    }
+
+    static
+    void
+    dirty_tracking_destroy(
+      void
+      ) noexcept
+    {
+      delete[] global.dirty_bitmap;
+      ::operator delete[](global.dirty_bitmap_buffer, std::align_val_t{ page_size });
+      global.dirty_bitmap = nullptr;
+      global.dirty_bitmap_buffer = nullptr;
+      global.dirty_bitmap_size = 0;
+    }
+  }
+
+  auto start(vmexit_handler& handler, const mp::cpu_set_t& cpu_set /* = mp::cpu_set_t::all() */) noexcept -> error_code_t
   {
     //
     // If hypervisor is already running,
@@ -80,29 +210,98 @@ namespace hvpp::hypervisor
     }
 
     //
-    // Create array of VCPUs.
-    // Note that since
-    //   - vcpu_t is not default-constructible
-    //   - operator new[] doesn't support constructing objects
-    //     with parameters
-    // ... we have to construct this array "placement new".
+    // Allocate VCPUs - each one from the memory local to its CPU, so that
+    // its VMCS, host stack and bitmaps aren't accessed across the NUMA
+    // interconnect on every VM-exit.
+    // Note that since vcpu_t is not default-constructible, the VCPUs
+    // are constructed by "placement new" below.
     //
-    hvpp_assert(global.vcpu_list == nullptr);
+    hvpp_assert(global.vcpu_count == 0);
+    hvpp_assert(mp::cpu_count() <= HVPP_MAX_CPU);
 
-    global.vcpu_list = reinterpret_cast<vcpu_t*>(operator new[](sizeof(vcpu_t) * mp::cpu_count()));
-    if (!global.vcpu_list)
+    //
+    // Only CPUs which exist are kept in the set - cpu_set_t::all()
+    // contains all HVPP_MAX_CPU bits.
+    //
+    global.cpu_set = mp::cpu_set_t::none();
+    global.vcpu_count = 0;
+    global.first_cpu_index = 0;
+
+    for (uint32_t i = mp::cpu_count(); i-- > 0; )
     {
-      return make_error_code_t(std::errc::not_enough_memory);
+      if (cpu_set.test(i))
+      {
+        global.cpu_set.set(i);
+        global.vcpu_count += 1;
+        global.first_cpu_index = i;
+      }
+    }
+
+    if (!global.vcpu_count)
+    {
+      return make_error_code_t(std::errc::invalid_argument);
+    }
+
+    for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+    {
+      if (!global.cpu_set.test(i))
+      {
+        continue;
+      }
+
+      global.vcpu_buffer[i] = mm::system_allocate_node(vcpu_allocation_size, mp::cpu_node(i));
+      if (!global.vcpu_buffer[i])
+      {
+        detail::vcpu_free();
+        return make_error_code_t(std::errc::not_enough_memory);
+      }
+
+      global.vcpu_list[i] = reinterpret_cast<vcpu_t*>(
+        (reinterpret_cast<uintptr_t>(global.vcpu_buffer[i]) + vcpu_stack_size - 1) & ~uintptr_t(vcpu_stack_size - 1));
+
+      global.guest_mapping[i] = new mapping_t(vcpu_t::guest_mapping_page_count);
+      if (!global.guest_mapping[i] || !global.guest_mapping[i]->capacity())
+      {
+        detail::vcpu_free();
+        return make_error_code_t(std::errc::not_enough_memory);
+      }
     }
 
     //
-    // Construct each vcpu_t object as `vcpu_t(handler)'.
+    // Construct each vcpu_t object as `vcpu_t(handler, guest_mapping)'
+    // and prepare it.
+    // This is done on the CPU of each VCPU, concurrently on all CPUs
+    // and without holding them in the IPI - the IPI below then only
+    // enters the VMX operation and launches the VM.  CPUs which aren't
+    // virtualized aren't interrupted at all.
     //
-    std::for_each_n(global.vcpu_list, mp::cpu_count(),
-      [&](vcpu_t& vp) {
-        ::new (static_cast<void*>(std::addressof(vp)))
-          vcpu_t(handler);
-      });
+    std::atomic_int prepare_error{ 0 };
+
+    mp::run_on_mask(global.cpu_set, [&handler, &prepare_error]() {
+      mm::allocator_guard _;
+      mm::tag_guard vcpu_tag{ mm::memory_tag::vcpu };
+
+      const auto idx = mp::cpu_index();
+
+      auto& vp = detail::vcpu_at(idx);
+      ::new (static_cast<void*>(std::addressof(vp)))
+        vcpu_t(handler, *global.guest_mapping[idx]);
+
+      if (auto err = vp.prepare())
+      {
+        prepare_error.store(err.value(), std::memory_order_relaxed);
+      }
+    });
+
+    //
+    // The VCPUs have been constructed even if they couldn't be prepared
+    // - vcpu_destroy() runs their destructors.
+    //
+    if (const auto err = prepare_error.load(std::memory_order_relaxed))
+    {
+      detail::vcpu_destroy();
+      return make_error_code_t(static_cast<std::errc>(err));
+    }
 
     //
     // Check that CPU supports all required features to
@@ -112,22 +311,142 @@ namespace hvpp::hypervisor
     //
     if (!detail::check_cpu_features())
     {
+      detail::vcpu_destroy();
       return make_error_code_t(std::errc::not_supported);
     }
 
     //
-    // Start virtualization on all CPUs.
+    // Create EPT which can be shared by all VCPUs.
+    //
+    // The identity map is built just once, by the first call of
+    // shared_ept() - VM-exit handlers can install it via
+    // vcpu_t::ept_enable(hypervisor::shared_ept()).  Each VCPU then
+    // receives copy-on-write view of this EPT, so only paging
+    // structures modified by the particular VCPU are duplicated.
+    //
+    hvpp_assert(global.ept == nullptr);
+
+    global.ept = new ept_t();
+    if (!global.ept)
+    {
+      detail::vcpu_destroy();
+      return make_error_code_t(std::errc::not_enough_memory);
+    }
+
+    global.ept_mapped.store(false, std::memory_order_relaxed);
+
+#ifdef HVPP_HOST_PAGE_TABLES
+    //
+    // Build the host address space.  Global pages are used only with
+    // VPIDs (see host_page_table).  If the page tables can't be built,
+    // VCPUs run on the CR3 of the OS.
+    //
+    hvpp_assert(global.host_page_tables == nullptr);
+
+    global.host_page_tables = new host_page_table();
+    if (global.host_page_tables)
+    {
+      const bool global_pages = detail::vcpu_at(global.first_cpu_index).capabilities().ept_vpid_cap.invvpid;
+
+      if (auto err = global.host_page_tables->initialize(global_pages))
+      {
+        hvpp_warn("Host page tables not built (%i)", err.value());
+
+        delete global.host_page_tables;
+        global.host_page_tables = nullptr;
+      }
+    }
+
+    if (global.host_page_tables)
+    {
+      for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+      {
+        if (global.cpu_set.test(i))
+        {
+          detail::vcpu_at(i).host_address_space(global.host_page_tables->cr3());
+        }
+      }
+    }
+#endif
+
+    //
+    // Start virtualization on all CPUs of the set.
+    // The first CPU is launched alone (in a DPC on that CPU - no other
+    // CPU is held meanwhile) and captures its VMCS into the template -
+    // the remaining CPUs then set up their VMCS from it in single IPI,
+    // which shortens the time all of them are held in it.
     // TODO:
-    //   - error handling
     //   - create new error_category for VMX errors?
     //
+    global.vmcs_template.initialize();
+
+    mp::run_on(global.first_cpu_index, []() {
+      mm::allocator_guard _;
+
+      detail::vcpu_at(mp::cpu_index()).launch(&*global.vmcs_template);
+    });
+
+    //
+    // If the first CPU can't be launched, the others wouldn't be
+    // either - don't even try.
+    //
+    if (detail::vcpu_at(global.first_cpu_index).state() != vcpu_state::running)
+    {
+      global.vmcs_template.destroy();
+
+      detail::vcpu_destroy();
+
+      delete global.ept;
+      global.ept = nullptr;
+
+      delete global.host_page_tables;
+      global.host_page_tables = nullptr;
+
+      return make_error_code_t(std::errc::not_supported);
+    }
+
     mp::ipi_call([]() {
       mm::allocator_guard _;
 
       auto idx = mp::cpu_index();
-      global.vcpu_list[idx].launch();
+      if (idx != global.first_cpu_index && global.cpu_set.test(idx))
+      {
+        detail::vcpu_at(idx).launch(&*global.vmcs_template);
+      }
     });
 
+    global.vmcs_template.destroy();
+
+    //
+    // Don't leave the system partially virtualized - if any CPU failed
+    // to launch, roll back all of them.  Destructors of the VCPUs which
+    // are running terminate them (see vcpu_t::~vcpu_t()), the failed
+    // ones have already left the VMX operation.
+    //
+    uint32_t launch_failed_count = 0;
+
+    for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+    {
+      if (global.cpu_set.test(i) && detail::vcpu_at(i).state() != vcpu_state::running)
+      {
+        hvpp_error("Launch of VCPU %u failed", i);
+        launch_failed_count += 1;
+      }
+    }
+
+    if (launch_failed_count)
+    {
+      detail::vcpu_destroy();
+
+      delete global.ept;
+      global.ept = nullptr;
+
+      delete global.host_page_tables;
+      global.host_page_tables = nullptr;
+
+      return make_error_code_t(std::errc::not_supported);
+    }
+
     //
     // Signalize that hypervisor has started.
     //
@@ -145,6 +464,8 @@ namespace hvpp::hypervisor
     hvpp_assert(global.started);
     if (!global.started)
     {
+      detail::dirty_tracking_destroy();
+      global.access_tracking = false;
       return;
     }
 
@@ -155,14 +476,36 @@ namespace hvpp::hypervisor
       mm::allocator_guard _;
 
       auto idx = mp::cpu_index();
-      global.vcpu_list[idx].terminate(); // #TODO !!!!
+      if (global.cpu_set.test(idx))
+      {
+        detail::vcpu_at(idx).terminate(); // #TODO !!!!
+      }
     });
 
     //
-    // Destroy array of VCPUs.
+    // Destroy and free VCPUs.
+    //
+    detail::vcpu_destroy();
+
+    //
+    // Destroy shared EPT.
+    // Note that this must be done after all VCPUs (and therefore
+    // all views of this EPT) are destroyed.
+    //
+    delete global.ept;
+    global.ept = nullptr;
+
+    //
+    // Destroy host page tables - no VCPU uses them anymore.
+    //
+    delete global.host_page_tables;
+    global.host_page_tables = nullptr;
+
+    //
+    // Destroy dirty page bitmaps.
     //
-    delete[] global.vcpu_list;
-    global.vcpu_list = nullptr;
+    detail::dirty_tracking_destroy();
+    global.access_tracking = false;
 
     //
     // Signalize that hypervisor has stopped.
@@ -170,8 +513,377 @@ namespace hvpp::hypervisor
     global.started = false;
   }
 
+  auto handler_swap(vmexit_handler& handler) noexcept -> error_code_t
+  {
+    hvpp_assert(global.started);
+    if (!global.started)
+    {
+      return make_error_code_t(std::errc::operation_not_permitted);
+    }
+
+    //
+    // Serialize concurrent swaps - each VCPU holds only one request.
+    // The swap waits for all CPUs, therefore a concurrent caller fails
+    // instead of spinning (it might spin on the CPU the swap waits for).
+    //
+    static spinlock swap_lock;
+
+    if (!swap_lock.try_lock())
+    {
+      return make_error_code_t(std::errc::device_or_resource_busy);
+    }
+
+    std::lock_guard _{ swap_lock, std::adopt_lock };
+
+    //
+    // Prepare the new handler on each CPU (same as in start()) - its
+    // per-VCPU state is allocated while the old handler still runs.
+    //
+    mp::run_on_mask(global.cpu_set, [&handler]() {
+      mm::allocator_guard _;
+
+      handler.prepare(detail::vcpu_at(mp::cpu_index()));
+    });
+
+    //
+    // Post the new handler and force each VCPU to VM-exit.
+    //
+    for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+    {
+      if (!global.cpu_set.test(i))
+      {
+        continue;
+      }
+
+      detail::vcpu_at(i).handler_swap_post(handler);
+
+      mp::async_call(i, []() {
+        uint32_t cpu_info[4];
+        ia32_asm_cpuid(cpu_info, 0);
+      });
+    }
+
+    //
+    // Wait until each VCPU switched - its previous VM-exit (the last one
+    // handled by the old handler) has completed by then.
+    //
+    for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+    {
+      while (global.cpu_set.test(i) && detail::vcpu_at(i).handler_swap_pending())
+      {
+        mp::sleep(1);
+      }
+    }
+
+    return error_code_t{};
+  }
+
   bool is_started() noexcept
   {
     return global.started;
   }
+
+  bool is_virtualized(uint32_t cpu_index) noexcept
+  {
+    return cpu_index < HVPP_MAX_CPU && global.cpu_set.test(cpu_index);
+  }
+
+  auto cpu_set() noexcept -> const mp::cpu_set_t&
+  {
+    return global.cpu_set;
+  }
+
+  auto vcpu_count() noexcept -> uint32_t
+  {
+    return global.vcpu_count;
+  }
+
+  auto host_page_tables() noexcept -> const host_page_table*
+  {
+    return global.host_page_tables;
+  }
+
+  auto shared_ept() noexcept -> ept_t&
+  {
+    hvpp_assert(global.ept != nullptr);
+
+    //
+    // Handlers usually call this from attach() - i.e. concurrently on
+    // all CPUs and in VMX-root mode (the tables are then allocated from
+    // the pool, see mm::host_stack_register()).  Other CPUs wait until
+    // the first one has built the map.
+    //
+    if (!global.ept_mapped.load(std::memory_order_acquire))
+    {
+      std::lock_guard _{ global.ept_lock };
+
+      if (!global.ept_mapped.load(std::memory_order_relaxed))
+      {
+        mm::tag_guard ept_tag{ mm::memory_tag::ept };
+
+#if HVPP_EPT_MODE == HVPP_EPT_MODE_1GB
+        global.ept->map_identity_1gb();
+#else
+        global.ept->map_identity();
+#endif
+        global.ept_mapped.store(true, std::memory_order_release);
+      }
+    }
+
+    return *global.ept;
+  }
+
+  auto vcpu(uint32_t cpu_index) noexcept -> vcpu_t&
+  {
+    hvpp_assert(is_virtualized(cpu_index) && global.vcpu_list[cpu_index] != nullptr);
+    return detail::vcpu_at(cpu_index);
+  }
+
+  void ept_invalidate(bool force_exit /* = false */) noexcept
+  {
+    //
+    // Asynchronously invalidate EPT-derived mappings on all CPUs.
+    // This is needed e.g. when the shared EPT is modified.
+    //
+    // Each VCPU performs the INVEPT on its next VM-exit.  If "force_exit"
+    // is set, each CPU is also asked (by a DPC executing CPUID, which
+    // unconditionally causes VM-exit) to exit as soon as possible.
+    // Neither of these waits for the other CPUs.
+    //
+    // Note that "force_exit" must not be requested from VMX-root mode.
+    //
+    hvpp_assert(global.started);
+    if (!global.started)
+    {
+      return;
+    }
+
+    for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+    {
+      if (!global.cpu_set.test(i))
+      {
+        continue;
+      }
+
+      detail::vcpu_at(i).ept_invalidate_post();
+
+      if (force_exit)
+      {
+        mp::async_call(i, []() {
+          uint32_t cpu_info[4];
+          ia32_asm_cpuid(cpu_info, 0);
+        });
+      }
+    }
+  }
+
+  bool command_post(uint32_t cpu_index, const vcpu_command_t& command, bool kick /* = false */) noexcept
+  {
+    hvpp_assert(global.started);
+    if (!global.started || cpu_index >= mp::cpu_count() || !global.cpu_set.test(cpu_index))
+    {
+      return false;
+    }
+
+    if (!detail::vcpu_at(cpu_index).command_post(command))
+    {
+      return false;
+    }
+
+    if (kick)
+    {
+      mp::async_call(cpu_index, []() {
+        uint32_t cpu_info[4];
+        ia32_asm_cpuid(cpu_info, 0);
+      });
+    }
+
+    return true;
+  }
+
+  auto dirty_tracking_enable() noexcept -> error_code_t
+  {
+    //
+    // Allocate per-CPU dirty page bitmaps (one bit per each 4kb page
+    // of the physical memory).  VM-exit handlers can then enable PML
+    // on each VCPU with vcpu_t::pml_enable(hypervisor::dirty_bitmap(...)).
+    //
+    // Must be called before the hypervisor is started.
+    //
+    hvpp_assert(!global.started && !global.dirty_bitmap);
+    if (global.started || global.dirty_bitmap)
+    {
+      return make_error_code_t(std::errc::operation_not_permitted);
+    }
+
+    pa_t highest_pa{};
+    for (auto& range : mm::physical_memory_descriptor())
+    {
+      highest_pa = std::max(highest_pa.value(), range.end().value());
+    }
+
+    const auto page_count = static_cast<int>(highest_pa.pfn());
+    const auto size_in_bytes = ((page_count + 63) / 64) * sizeof(uint64_t);
+
+    global.dirty_bitmap_buffer = new (std::align_val_t{ page_size }) uint8_t[size_in_bytes * mp::cpu_count()];
+    global.dirty_bitmap = new bitmap[mp::cpu_count()];
+
+    if (!global.dirty_bitmap_buffer || !global.dirty_bitmap)
+    {
+      detail::dirty_tracking_destroy();
+      return make_error_code_t(std::errc::not_enough_memory);
+    }
+
+    memset(global.dirty_bitmap_buffer, 0, size_in_bytes * mp::cpu_count());
+
+    for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+    {
+      global.dirty_bitmap[i] = bitmap(global.dirty_bitmap_buffer + i * size_in_bytes, page_count);
+    }
+
+    global.dirty_bitmap_size = size_in_bytes;
+
+    return error_code_t{};
+  }
+
+  bool dirty_tracking_enabled() noexcept
+  {
+    return global.dirty_bitmap != nullptr;
+  }
+
+  auto dirty_bitmap(uint32_t cpu_index) noexcept -> bitmap&
+  {
+    hvpp_assert(global.dirty_bitmap != nullptr && cpu_index < mp::cpu_count());
+    return global.dirty_bitmap[cpu_index];
+  }
+
+  auto dirty_bitmap_collect(void* buffer, size_t buffer_size) noexcept -> size_t
+  {
+    //
+    // Merge (OR) dirty page bitmaps of all CPUs into the provided buffer
+    // and reset them.  Returns number of bytes written into the buffer.
+    // If the buffer is smaller than the bitmap, only the beginning of the
+    // bitmap is collected (and reset).
+    //
+    // Each CPU first forces VM-exit (CPUID), so that its partially filled
+    // PML buffer is drained.  The bitmap is then merged in VMX-non-root
+    // mode on the very same CPU, therefore there is no VM-exit handler
+    // concurrently writing to it.
+    //
+    hvpp_assert(global.started && global.dirty_bitmap);
+    if (!global.started || !global.dirty_bitmap || !buffer)
+    {
+      return 0;
+    }
+
+    const auto size = std::min(buffer_size, global.dirty_bitmap_size);
+    auto output = reinterpret_cast<uint8_t*>(buffer);
+    memset(output, 0, size);
+
+    spinlock lock;
+
+    mp::ipi_call([&]() {
+      auto idx = mp::cpu_index();
+
+      if (!global.cpu_set.test(idx))
+      {
+        return;
+      }
+
+      detail::vcpu_at(idx).pml_flush_post();
+
+      uint32_t cpu_info[4];
+      ia32_asm_cpuid(cpu_info, 0);
+
+      auto input = reinterpret_cast<uint8_t*>(global.dirty_bitmap[idx].buffer());
+
+      std::lock_guard _{ lock };
+
+      for (size_t i = 0; i < size; ++i)
+      {
+        output[i] |= input[i];
+      }
+
+      memset(input, 0, size);
+    });
+
+    return size;
+  }
+
+  auto access_tracking_enable() noexcept -> error_code_t
+  {
+    //
+    // Enable harvesting of EPT accessed flags (see access_bitmap_collect()).
+    // VM-exit handlers must enable accessed and dirty flags on each VCPU
+    // with vcpu_t::ept_access_dirty_enable().  Unlike PML, this doesn't
+    // cause any VM-exit.
+    //
+    // Must be called before the hypervisor is started.
+    //
+    hvpp_assert(!global.started);
+    if (global.started)
+    {
+      return make_error_code_t(std::errc::operation_not_permitted);
+    }
+
+    if (!msr::read<msr::vmx_ept_vpid_cap_t>().ept_accessed_and_dirty_flags)
+    {
+      return make_error_code_t(std::errc::not_supported);
+    }
+
+    global.access_tracking = true;
+    return error_code_t{};
+  }
+
+  bool access_tracking_enabled() noexcept
+  {
+    return global.access_tracking;
+  }
+
+  auto access_bitmap_collect(void* buffer, size_t buffer_size) noexcept -> size_t
+  {
+    //
+    // Collect pages accessed by the guest since the previous call into
+    // the provided buffer (one bit per 4kb page) and clear their EPT
+    // accessed flags.  Returns number of bytes written into the buffer.
+    // Pages beyond the buffer are not reported, but their flags are
+    // cleared as well.
+    //
+    // Each CPU harvests EPTs of its own VCPU in VMX-non-root mode (its
+    // VM-exit handler therefore can't modify them concurrently).  Entries
+    // of large pages report all their 4kb pages.  Cached translations are
+    // invalidated afterwards, so that the processor sets the accessed
+    // flags again.
+    //
+    hvpp_assert(global.started && global.access_tracking);
+    if (!global.started || !global.access_tracking || !buffer)
+    {
+      return 0;
+    }
+
+    const auto size = std::min(buffer_size, size_t(INT_MAX / 8));
+    memset(buffer, 0, size);
+
+    bitmap accessed{ buffer, static_cast<int>(size * 8) };
+    spinlock lock;
+
+    mp::ipi_call([&]() {
+      if (!global.cpu_set.test(mp::cpu_index()))
+      {
+        return;
+      }
+
+      auto& vp = detail::vcpu_at(mp::cpu_index());
+
+      std::lock_guard _{ lock };
+
+      for (uint16_t index = 0; index < vp.ept_count(); ++index)
+      {
+        vp.ept(index).access_harvest(accessed);
+      }
+    });
+
+    ept_invalidate(true);
+    return size;
+  }
 }
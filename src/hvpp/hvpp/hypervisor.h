@@ -1,13 +1,66 @@
 #pragma once
+#include "host_page_table.h"
 #include "vcpu.h"
 #include "vmexit.h"
 
 #include "lib/error.h"
+#include "lib/mp.h"
 
 namespace hvpp::hypervisor
 {
-  auto start(vmexit_handler& handler) noexcept -> error_code_t;
+  //
+  // Only CPUs in "cpu_set" are virtualized - other CPUs keep running
+  // natively and don't have any VCPU (hypervisor::vcpu() must not be
+  // called for them).  Fails if the set doesn't contain any CPU.
+  //
+  auto start(vmexit_handler& handler, const mp::cpu_set_t& cpu_set = mp::cpu_set_t::all()) noexcept -> error_code_t;
   void stop() noexcept;
 
+  //
+  // Replace the VM-exit handler of all VCPUs without devirtualizing.
+  // The new handler is prepared on each CPU, each VCPU then switches
+  // to it on its next VM-exit (forced by CPUID).  Returns after no VCPU
+  // uses the old handler anymore - after that, it can be destroyed.
+  // Fails with device_or_resource_busy while another swap is in
+  // progress.  Must be called at PASSIVE_LEVEL.
+  //
+  auto handler_swap(vmexit_handler& handler) noexcept -> error_code_t;
+
   bool is_started() noexcept;
+
+  //
+  // Virtualized CPUs (subset of the set passed to start()).
+  //
+  bool is_virtualized(uint32_t cpu_index) noexcept;
+  auto cpu_set() noexcept -> const mp::cpu_set_t&;
+  auto vcpu_count() noexcept -> uint32_t;
+
+  auto shared_ept() noexcept -> ept_t&;
+  void ept_invalidate(bool force_exit = false) noexcept;
+
+  //
+  // Post the command to the mailbox of the VCPU (see vcpu_mailbox.h).
+  // Doesn't wait for the command to be processed.  If "kick" is set,
+  // the CPU is also asked (by CPUID in a DPC) to VM-exit as soon as
+  // possible - "kick" must not be requested from VMX-root mode.
+  // Returns false if the CPU isn't virtualized or the mailbox is full.
+  //
+  bool command_post(uint32_t cpu_index, const vcpu_command_t& command, bool kick = false) noexcept;
+
+  auto vcpu(uint32_t cpu_index) noexcept -> vcpu_t&;
+
+  //
+  // Page tables of the VMX-root mode, nullptr if VCPUs run on the CR3
+  // of the OS (see HVPP_HOST_PAGE_TABLES in config.h).
+  //
+  auto host_page_tables() noexcept -> const host_page_table*;
+
+  auto dirty_tracking_enable() noexcept -> error_code_t;
+  bool dirty_tracking_enabled() noexcept;
+  auto dirty_bitmap(uint32_t cpu_index) noexcept -> bitmap&;
+  auto dirty_bitmap_collect(void* buffer, size_t buffer_size) noexcept -> size_t;
+
+  auto access_tracking_enable() noexcept -> error_code_t;
+  bool access_tracking_enabled() noexcept;
+  auto access_bitmap_collect(void* buffer, size_t buffer_size) noexcept -> size_t;
 }
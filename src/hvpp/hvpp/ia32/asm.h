@@ -53,4 +53,8 @@ struct invvpid_desc_t
 
 static_assert(sizeof(invvpid_desc_t) == 16);
 
-#include "win32/asm.h"
+#ifdef HVPP_MOCK
+#  include "mock/asm.h"
+#else
+#  include "win32/asm.h"
+#endif
@@ -292,7 +292,22 @@ struct epte_t
       uint64_t user_mode_execute : 1;
       uint64_t reserved_1 : 1;
       uint64_t page_frame_number : 36;
-      uint64_t reserved_2 : 15;
+      uint64_t reserved_2 : 4;
+
+      //
+      // Software-available bit (bits 52-62 are ignored by the CPU).
+      // Set when the subtable this entry points to is owned by
+      // another ept_t instance (see ept_t copy-on-write).
+      //
+      uint64_t shared : 1;
+
+      //
+      // Software-available bit.  Set when the subtable this entry
+      // points to has been created by splitting a large page (see
+      // ept_t automatic re-coalescing).
+      //
+      uint64_t split : 1;
+      uint64_t reserved_3 : 9;
       uint64_t suppress_ve : 1;
     };
 
@@ -306,7 +321,13 @@ struct epte_t
 
   void clear() noexcept
   {
+    //
+    // Cleared entries suppress #VE by default - EPT violations
+    // are delivered to the guest as #VE only for entries which
+    // explicitly allow it (see ept_t::ve_enable()).
+    //
     flags = 0;
+    suppress_ve = true;
   }
 
   void update(access_type new_access) noexcept
@@ -1,11 +1,23 @@
 #include "memory.h"
 
+#include "hvpp/lib/assert.h"
+
+#include <algorithm>
+#include <cstring>
+
 namespace ia32 {
 
 //////////////////////////////////////////////////////////////////////////
 // namespace detail
 //////////////////////////////////////////////////////////////////////////
 
+#ifndef HVPP_MOCK
+
+//
+// The user-mode build replaces translations and mapping windows (see
+// ia32/mock/memory.cpp).
+//
+
 namespace detail
 {
   uint64_t pa_from_va(const void* va, cr3_t cr3) noexcept
@@ -16,6 +28,8 @@ namespace detail
   }
 }
 
+#endif
+
 //////////////////////////////////////////////////////////////////////////
 // va_t
 //////////////////////////////////////////////////////////////////////////
@@ -60,60 +74,149 @@ pe_t* va_t::pt_entry(cr3_t cr3 /*= read<cr3_t>()*/, pml level /*= pml::pt*/) con
 // mapping_t
 //////////////////////////////////////////////////////////////////////////
 
-mapping_t::mapping_t() noexcept
+#ifndef HVPP_MOCK
+
+mapping_t::mapping_t(size_t page_count /* = default_page_count */) noexcept
+  : va_{ nullptr }
+  , pte_{ nullptr }
+  , page_count_{ 0 }
+  , mapped_count_{ 0 }
 {
   //
-  // Reserve 1 page of the virtual address space.
+  // Reserve "page_count" pages of the virtual address space.
   // Note that the memory is NOT allocated, just reserved.
   //
-  va_ = detail::mapping_allocate(page_size);
+  va_ = detail::mapping_allocate(page_count * page_size);
+
+  if (!va_)
+  {
+    return;
+  }
+
+  pte_ = new pe_t*[page_count];
+
+  if (!pte_)
+  {
+    detail::mapping_free(va_);
+    va_ = nullptr;
+    return;
+  }
 
   //
-  // Get page-table entry for the virtual address.
+  // Get page-table entries for each page of the virtual address range.
+  // Note that they're not necessarily in the same page table.
   //
-  pte_ = va_t(va_).pt_entry();
+  for (size_t i = 0; i < page_count; ++i)
+  {
+    pte_[i] = va_t(reinterpret_cast<uint8_t*>(va_) + i * page_size).pt_entry();
+  }
+
+  page_count_ = page_count;
 }
 
 mapping_t::~mapping_t() noexcept
 {
+  unmap();
+
   //
   // Release the virtual address space.
   //
-  detail::mapping_free(va_);
+  if (va_)
+  {
+    detail::mapping_free(va_);
+  }
+
+  delete[] pte_;
 }
 
 void* mapping_t::map(pa_t pa) noexcept
 {
-  //
-  // Make this entry present & writable.
-  //
-  pte_->present = true;
-  pte_->write = true;
+  return map(pa, 1);
+}
 
-  //
-  // Do not flush this page from the TLB on CR3 switch.
-  //
-  pte_->global = true;
+void* mapping_t::map(pa_t pa, size_t size) noexcept
+{
+  const auto page_count = bytes_to_pages(byte_offset(pa.value()) + size);
+
+  hvpp_assert(page_count > 0 && page_count <= page_count_);
 
   //
-  // Set the PFN of this PTE to the PFN of the
-  // provided physical address.
+  // Update all PTEs first and then flush the TLB just once.
   //
-  pte_->page_frame_number = pa.pfn();
+  for (size_t i = 0; i < page_count; ++i)
+  {
+    auto pte = pte_[i];
+
+    //
+    // Make this entry present & writable.
+    //
+    pte->present = true;
+    pte->write = true;
+
+    //
+    // Do not flush this page from the TLB on CR3 switch.
+    //
+    pte->global = true;
+
+    //
+    // Set the PFN of this PTE to the PFN of the
+    // provided physical address.
+    //
+    pte->page_frame_number = pa.pfn() + i;
+  }
 
   //
-  // Finally, invalidate the cache for the virtual address.
+  // Finally, invalidate the cache for the virtual address range.
   //
-  ia32_asm_inv_page(va_);
+  flush(page_count);
+
+  mapped_count_ = std::max(mapped_count_, page_count);
 
   return reinterpret_cast<uint8_t*>(va_) + byte_offset(pa.value());
 }
 
 void mapping_t::unmap() noexcept
 {
-  pte_->flags = 0;
+  for (size_t i = 0; i < mapped_count_; ++i)
+  {
+    pte_[i]->flags = 0;
+  }
+
+  mapped_count_ = 0;
+}
+
+void mapping_t::flush(size_t page_count) noexcept
+{
+  if (page_count <= flush_page_threshold)
+  {
+    for (size_t i = 0; i < page_count; ++i)
+    {
+      ia32_asm_inv_page(reinterpret_cast<uint8_t*>(va_) + i * page_size);
+    }
+
+    return;
+  }
+
+  //
+  // Toggling CR4.PGE flushes all TLB entries, including the global
+  // ones.  Interrupts are disabled, so that nothing else sees (or
+  // modifies) the CR4 in the meantime.
+  //
+  const auto eflags = ia32_asm_read_eflags();
+  ia32_asm_disable_interrupts();
+
+  auto cr4 = read<cr4_t>();
+  auto cr4_pge_off = cr4;
+  cr4_pge_off.page_global_enable = false;
+
+  write<cr4_t>(cr4_pge_off);
+  write<cr4_t>(cr4);
+
+  ia32_asm_write_eflags(eflags);
 }
 
+#endif
+
 void mapping_t::read(pa_t pa, void* buffer, size_t size) noexcept
 {
   read_write(pa, buffer, size, false);
@@ -129,19 +232,20 @@ void mapping_t::read_write(pa_t pa, void* buffer, size_t size, bool write) noexc
   uint8_t* byte_buffer = reinterpret_cast<uint8_t*>(buffer);
 
   //
-  // Map each page of the physical memory to the reserved
-  // virtual address and then copy.
+  // Map as many pages of the physical memory as fit into the
+  // reserved virtual address range and then copy.
   //
   while (size != 0)
   {
-    void* va = map(pa);
-    size_t bytes_to_copy = page_size - byte_offset(va);
+    size_t bytes_to_copy = capacity() - byte_offset(pa.value());
 
     if (bytes_to_copy > size)
     {
       bytes_to_copy = size;
     }
 
+    void* va = map(pa, bytes_to_copy);
+
     if (write)
     {
       memcpy(va, byte_buffer, bytes_to_copy);
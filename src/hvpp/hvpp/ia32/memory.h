@@ -1,8 +1,10 @@
 #pragma once
 #include "hvpp/lib/log.h"
+#include "hvpp/lib/seqlock.h"
 #include "paging.h"
 #include "arch.h"
 
+#include <algorithm>
 #include <cstddef>      // std::byte
 #include <cstdint>
 #include <numeric>
@@ -174,7 +176,15 @@ class va_t
 class mapping_t
 {
   public:
-    mapping_t() noexcept;
+    //
+    // Mapping window of "page_count" pages.  Bigger windows allow
+    // read()/write() to map many pages at once - with one batch of PTE
+    // updates and one TLB flush per window instead of per page.
+    //
+    static constexpr size_t default_page_count = 1;
+    static constexpr size_t large_page_count   = 512;   // 2MB
+
+    mapping_t(size_t page_count = default_page_count) noexcept;
     ~mapping_t() noexcept;
 
     mapping_t(const mapping_t& other) noexcept = delete;
@@ -183,16 +193,37 @@ class mapping_t
     mapping_t& operator=(mapping_t&& other) noexcept = delete;
 
     void* map(pa_t pa) noexcept;
+
+    //
+    // Map physical memory range [pa, pa + size).  The range must fit
+    // into the window (see capacity()).
+    //
+    void* map(pa_t pa, size_t size) noexcept;
     void  unmap() noexcept;
 
     void  read(pa_t pa, void* buffer, size_t size) noexcept;
     void  write(pa_t pa, const void* buffer, size_t size) noexcept;
 
+    //
+    // Size of the window in bytes.
+    //
+    auto  capacity() const noexcept -> size_t
+    { return page_count_ * page_size; }
+
   private:
+    //
+    // Windows with more pages than this are flushed from the TLB at once
+    // (by toggling CR4.PGE) instead of page by page (INVLPG).
+    //
+    static constexpr size_t flush_page_threshold = 32;
+
+    void  flush(size_t page_count) noexcept;
     void  read_write(pa_t pa, void* buffer, size_t size, bool write) noexcept;
 
-    void* va_;
-    pe_t* pte_;
+    void*   va_;
+    pe_t**  pte_;
+    size_t  page_count_;
+    size_t  mapped_count_;
 };
 
 //
@@ -307,13 +338,24 @@ class physical_memory_range
 // Class for receiving physical memory ranges which are backed up
 // by actual physical memory.
 //
+// Ranges are sorted and adjacent ranges are merged, so that lookups
+// (find(), contains(), next_range()) are binary searches - they can be
+// used e.g. for validation of guest physical addresses on each VM-exit.
+//
+// refresh() re-reads the ranges (e.g. after memory hot-add).  Lookups
+// are synchronized with refresh() by a seqlock and can run
+// concurrently with it (at any IRQL, including VMX-root mode).  Direct
+// iteration (begin()/end()) isn't synchronized - it's meant for the
+// initialization.  refresh() itself must be called at PASSIVE_LEVEL and
+// calls of it should be serialized by the caller.
+//
 
 class physical_memory_descriptor
 {
   public:
     static constexpr int max_range_count = 32;
 
-    physical_memory_descriptor() noexcept { check_physical_memory(); }
+    physical_memory_descriptor() noexcept { check_physical_memory(range_, count_); }
     physical_memory_descriptor(const physical_memory_descriptor& other) noexcept = delete;
     physical_memory_descriptor(physical_memory_descriptor&& other) noexcept = delete;
     physical_memory_descriptor& operator=(const physical_memory_descriptor& other) noexcept = delete;
@@ -330,6 +372,80 @@ class physical_memory_descriptor
       });
     }
 
+    //
+    // Range which contains the physical address.
+    //
+    bool find(pa_t pa, physical_memory_range& result) const noexcept
+    {
+      return read([&]() {
+        const auto range = lower_range(pa);
+        if (range != end() && range->contains(pa))
+        {
+          result = *range;
+          return true;
+        }
+
+        return false;
+      });
+    }
+
+    //
+    // True if the whole [pa, pa + size) is backed by physical memory
+    // (i.e. it doesn't overlap any hole, e.g. MMIO).
+    //
+    bool contains(pa_t pa, size_t size = 1) const noexcept
+    {
+      return read([&]() {
+        const auto range = lower_range(pa);
+        return range != end()
+            && range->contains(pa)
+            && size <= static_cast<size_t>(range->end().value() - pa.value());
+      });
+    }
+
+    //
+    // The first range which contains the physical address or which
+    // begins above it.  Returns false if there is no such range.
+    //
+    bool next_range(pa_t pa, physical_memory_range& result) const noexcept
+    {
+      return read([&]() {
+        const auto range = lower_range(pa);
+        if (range != end())
+        {
+          result = *range;
+          return true;
+        }
+
+        return false;
+      });
+    }
+
+    //
+    // Re-read the physical memory ranges.  Returns true if they have
+    // changed.
+    //
+    bool refresh() noexcept
+    {
+      physical_memory_range range[max_range_count];
+      int count;
+
+      check_physical_memory(range, count);
+
+      if (count == count_ && std::equal(range, range + count, range_, [](auto& lhs, auto& rhs) {
+            return lhs.begin() == rhs.begin() && lhs.end() == rhs.end();
+          }))
+      {
+        return false;
+      }
+
+      lock_.write_begin();
+      std::copy(range, range + count, range_);
+      count_ = count;
+      lock_.write_end();
+      return true;
+    }
+
     void dump() const noexcept
     {
       hvpp_info("Physical memory ranges (%i)", count_);
@@ -345,11 +461,64 @@ class physical_memory_descriptor
     }
 
   private:
-    void check_physical_memory() noexcept
-    { detail::check_physical_memory(range_, max_range_count, count_); }
+    static void check_physical_memory(physical_memory_range* range, int& count) noexcept
+    {
+      detail::check_physical_memory(range, max_range_count, count);
+
+      //
+      // Sort the ranges and merge the overlapping (or adjacent) ones.
+      //
+      std::sort(range, range + count, [](auto& lhs, auto& rhs) {
+        return lhs.begin() < rhs.begin();
+      });
+
+      int merged_count = 0;
+      for (int i = 0; i < count; ++i)
+      {
+        if (merged_count && range[i].begin() <= range[merged_count - 1].end())
+        {
+          range[merged_count - 1].set(range[merged_count - 1].begin(),
+                                      std::max(range[merged_count - 1].end(), range[i].end()));
+        }
+        else
+        {
+          range[merged_count++] = range[i];
+        }
+      }
+
+      count = merged_count;
+    }
+
+    //
+    // The first range whose end is above the physical address.
+    //
+    auto lower_range(pa_t pa) const noexcept -> const physical_memory_range*
+    {
+      return std::upper_bound(begin(), end(), pa, [](pa_t value, auto& range) {
+        return value < range.end();
+      });
+    }
+
+    template <
+      typename F
+    >
+    bool read(F&& function) const noexcept
+    {
+      bool result;
+      uint32_t sequence;
+
+      do
+      {
+        sequence = lock_.read_begin();
+        result = function();
+      } while (lock_.read_retry(sequence));
+
+      return result;
+    }
 
     physical_memory_range range_[max_range_count];
     int                   count_ = 0;
+    mutable seqlock       lock_;
 };
 
 inline constexpr const char* memory_type_to_string(memory_type type) noexcept
@@ -0,0 +1,50 @@
+;++
+;
+; Copyright (c) Petr Benes. All rights reserved.
+;
+; Module:
+;
+;   asm.asm
+;
+; Abstract:
+;
+;   Contains the emulated VMLAUNCH of the user-mode build (see HVPP_MOCK).
+;   Everything else of the mocked CPU is implemented in asm.cpp.
+;
+; Environment:
+;
+;    User mode only.
+;
+;--
+
+INCLUDE ksamd64.inc
+
+EXTERN ia32_mock_vmx_entry : PROC
+
+.CODE
+
+    VMX_ERROR_CODE_FAILED               = 2
+
+    ;
+    ; VMLAUNCH - continue at the guest RIP with the guest RSP (both read
+    ; from the current VMCS by ia32_mock_vmx_entry()).  Returns only if
+    ; the VM-entry fails.
+    ;
+
+    ia32_asm_vmx_vmlaunch PROC
+        sub     rsp, 28h
+        lea     rcx, qword ptr [rsp + 20h]
+        call    ia32_mock_vmx_entry
+        test    rax, rax
+        jz      @F
+
+        mov     rsp, qword ptr [rsp + 20h]
+        jmp     rax
+
+@@:
+        add     rsp, 28h
+        mov     al, VMX_ERROR_CODE_FAILED
+        ret
+    ia32_asm_vmx_vmlaunch ENDP
+
+END
@@ -0,0 +1,578 @@
+#include "cpu.h"
+
+#include "../asm.h"
+
+#include "hvpp/config.h"
+
+#include <cstdlib>
+#include <cstring>
+
+namespace ia32::mock {
+
+namespace detail
+{
+  static cpu_t cpu_list[HVPP_MAX_CPU];
+  static thread_local uint32_t current_cpu_index = 0;
+
+  //
+  // VMCS stores (see vmcs_store()).  The table is never shrunk - stores
+  // are destroyed only by reset().
+  //
+  static constexpr uint32_t vmcs_store_count = 2 * HVPP_MAX_CPU;
+  static vmcs_store_t* vmcs_store_list[vmcs_store_count];
+
+  static auto vmcs_store_create(uint64_t pa) noexcept -> vmcs_store_t*
+  {
+    if (auto store = vmcs_store(pa))
+    {
+      return store;
+    }
+
+    for (auto& store : vmcs_store_list)
+    {
+      if (!store)
+      {
+        store = static_cast<vmcs_store_t*>(std::calloc(1, sizeof(vmcs_store_t)));
+
+        if (store)
+        {
+          store->pa = pa;
+        }
+
+        return store;
+      }
+    }
+
+    return nullptr;
+  }
+
+  static auto field_width(uint32_t field) noexcept -> uint32_t
+  {
+    //
+    // 0 = 16-bit, 1 = 64-bit, 2 = 32-bit, 3 = natural-width.
+    // (ref: Vol3D[Appendix B(Field Encoding in VMCS)])
+    //
+    return (field >> 13) & 3;
+  }
+
+  static uint8_t fail_or_succeed(bool success) noexcept
+  {
+    return success ? 0 : 2;
+  }
+}
+
+void reset() noexcept
+{
+  for (auto& store : detail::vmcs_store_list)
+  {
+    std::free(store);
+    store = nullptr;
+  }
+
+  for (uint32_t i = 0; i < HVPP_MAX_CPU; ++i)
+  {
+    auto& cpu = detail::cpu_list[i];
+
+    memset(&cpu, 0, sizeof(cpu));
+    cpu.index = i;
+
+    //
+    // PE, MP, ET, NE, WP, AM, PG.
+    // DE, PSE, PAE, PGE, OSFXSR, OSXMMEXCPT, OSXSAVE.
+    //
+    cpu.cr0  = 0x8005'0033;
+    cpu.cr4  = 0x0004'06f8;
+    cpu.xcr0 = 0x7;
+
+    cpu.cs   = 0x10;
+    cpu.ss   = 0x18;
+    cpu.ds   = 0x2b;
+    cpu.es   = 0x2b;
+    cpu.fs   = 0x53;
+    cpu.gs   = 0x2b;
+    cpu.tr   = 0x40;
+
+    cpu.gdt[2]  = 0x0020'9b00'0000'0000;        // 0x10: code, 64-bit
+    cpu.gdt[3]  = 0x00cf'9300'0000'ffff;        // 0x18: data
+    cpu.gdt[4]  = 0x00cf'fb00'0000'ffff;        // 0x23: code, 32-bit, DPL 3
+    cpu.gdt[5]  = 0x00cf'f300'0000'ffff;        // 0x2b: data, DPL 3
+    cpu.gdt[6]  = 0x0020'fb00'0000'0000;        // 0x33: code, 64-bit, DPL 3
+    cpu.gdt[8]  = 0x0000'8b00'0000'0067;        // 0x40: TSS (busy)
+    cpu.gdt[10] = 0x0040'f300'0000'3c00;        // 0x53: data, DPL 3
+
+    const uint16_t gdt_limit = sizeof(cpu.gdt) - 1;
+    const uint64_t gdt_base  = reinterpret_cast<uint64_t>(cpu.gdt);
+    memcpy(&cpu.gdtr[0], &gdt_limit, sizeof(gdt_limit));
+    memcpy(&cpu.gdtr[2], &gdt_base,  sizeof(gdt_base));
+
+    const uint16_t idt_limit = 0x0fff;
+    memcpy(&cpu.idtr[0], &idt_limit, sizeof(idt_limit));
+  }
+
+  //
+  // VMX capabilities - every control can be set to both 0 and 1, all
+  // EPT/VPID features are available.
+  //
+  for (uint32_t i = 0; i < HVPP_MAX_CPU; ++i)
+  {
+    select(i);
+
+    msr(0x0000'003a) = 0x5;                     // IA32_FEATURE_CONTROL: lock, VMXON outside SMX
+    msr(0x0000'00fe) = 0;                       // IA32_MTRRCAP: no fixed or variable MTRRs
+    msr(0x0000'0277) = 0x0007'0406'0007'0406;   // IA32_PAT
+    msr(0x0000'02ff) = 0x0000'0000'0000'0806;   // IA32_MTRR_DEF_TYPE: enabled, WB
+    msr(0xc000'0080) = 0x0000'0000'0000'0d01;   // IA32_EFER: SCE, LME, LMA, NXE
+
+    msr(0x0000'0480) = 1                        // IA32_VMX_BASIC: revision id
+                     | 0x1000ull << 32          //   VMCS size
+                     | 6ull << 50               //   write-back
+                     | 1ull << 54               //   INS/OUTS information
+                     | 1ull << 55;              //   true controls
+
+    for (uint32_t ctls : { 0x481u, 0x482u, 0x483u, 0x484u, 0x48bu,
+                           0x48du, 0x48eu, 0x48fu, 0x490u })
+    {
+      msr(ctls) = 0xffff'ffff'0000'0000;
+    }
+
+    msr(0x0000'0485) = 0x0000'0000'0000'01e5;   // IA32_VMX_MISC
+    msr(0x0000'0486) = 0x0000'0000'8000'0021;   // IA32_VMX_CR0_FIXED0: PE, NE, PG
+    msr(0x0000'0487) = 0x0000'0000'ffff'ffff;   // IA32_VMX_CR0_FIXED1
+    msr(0x0000'0488) = 0x0000'0000'0000'2000;   // IA32_VMX_CR4_FIXED0: VMXE
+    msr(0x0000'0489) = 0x0000'0000'0037'27ff;   // IA32_VMX_CR4_FIXED1
+    msr(0x0000'048a) = 0x0000'0000'0000'002e;   // IA32_VMX_VMCS_ENUM
+    msr(0x0000'048c) = 0xffff'ffff'ffff'ffff;   // IA32_VMX_EPT_VPID_CAP
+    msr(0x0000'0491) = 0x0000'0000'0000'0001;   // IA32_VMX_VMFUNC: EPTP switching
+  }
+
+  select(0);
+}
+
+auto cpu() noexcept -> cpu_t&
+{
+  return detail::cpu_list[detail::current_cpu_index];
+}
+
+void select(uint32_t cpu_index) noexcept
+{
+  detail::current_cpu_index = cpu_index % HVPP_MAX_CPU;
+}
+
+auto msr(uint32_t msr_id) noexcept -> uint64_t&
+{
+  static uint64_t unsupported;
+
+  auto& c = cpu();
+  auto index = (msr_id * 0x9e37'79b9u) >> 23;
+
+  for (uint32_t probe = 0; probe < cpu_t::msr_count; ++probe)
+  {
+    const auto slot = index % cpu_t::msr_count;
+
+    if (c.msr_id[slot] == msr_id)
+    {
+      return c.msr_value[slot];
+    }
+
+    if (c.msr_id[slot] == 0)
+    {
+      c.msr_id[slot] = msr_id;
+      c.msr_value[slot] = 0;
+      return c.msr_value[slot];
+    }
+
+    ++index;
+  }
+
+  unsupported = 0;
+  return unsupported;
+}
+
+auto vmcs_field(uint32_t field) noexcept -> uint64_t&
+{
+  static uint64_t unsupported;
+
+  if (auto store = cpu().current_vmcs)
+  {
+    return store->value[field % vmcs_store_t::field_count];
+  }
+
+  unsupported = 0;
+  return unsupported;
+}
+
+auto vmcs_store(uint64_t pa) noexcept -> vmcs_store_t*
+{
+  for (auto store : detail::vmcs_store_list)
+  {
+    if (store && store->pa == pa)
+    {
+      return store;
+    }
+  }
+
+  return nullptr;
+}
+
+}
+
+using namespace ia32::mock;
+
+extern "C" {
+
+//
+// Halt.
+//
+
+void ia32_asm_halt() noexcept
+{
+}
+
+//
+// Segment registers.
+//
+
+uint16_t ia32_asm_read_cs() noexcept              { return cpu().cs;   }
+void ia32_asm_write_cs(uint16_t cs) noexcept      { cpu().cs = cs;     }
+uint16_t ia32_asm_read_ds() noexcept              { return cpu().ds;   }
+void ia32_asm_write_ds(uint16_t ds) noexcept      { cpu().ds = ds;     }
+uint16_t ia32_asm_read_es() noexcept              { return cpu().es;   }
+void ia32_asm_write_es(uint16_t es) noexcept      { cpu().es = es;     }
+uint16_t ia32_asm_read_fs() noexcept              { return cpu().fs;   }
+void ia32_asm_write_fs(uint16_t fs) noexcept      { cpu().fs = fs;     }
+uint16_t ia32_asm_read_gs() noexcept              { return cpu().gs;   }
+void ia32_asm_write_gs(uint16_t gs) noexcept      { cpu().gs = gs;     }
+uint16_t ia32_asm_read_ss() noexcept              { return cpu().ss;   }
+void ia32_asm_write_ss(uint16_t ss) noexcept      { cpu().ss = ss;     }
+uint16_t ia32_asm_read_tr() noexcept              { return cpu().tr;   }
+void ia32_asm_write_tr(uint16_t tr) noexcept      { cpu().tr = tr;     }
+uint16_t ia32_asm_read_ldtr() noexcept            { return cpu().ldtr; }
+void ia32_asm_write_ldtr(uint16_t ldt) noexcept   { cpu().ldtr = ldt;  }
+
+uint32_t ia32_asm_read_ar(uint16_t selector) noexcept
+{
+  //
+  // Flat 64-bit code segment for CS, flat data segment for everything
+  // else - present, DPL 0, accessed.
+  //
+  return selector == cpu().cs ? 0xa09b : 0xc093;
+}
+
+uint32_t ia32_asm_read_sl(uint32_t segment) noexcept
+{
+  (void)(segment);
+  return 0xffff'ffff;
+}
+
+//
+// Descriptor tables.
+//
+
+void ia32_asm_read_gdtr(void* gdt) noexcept         { memcpy(gdt, cpu().gdtr, sizeof(cpu().gdtr)); }
+void ia32_asm_write_gdtr(const void* gdt) noexcept  { memcpy(cpu().gdtr, gdt, sizeof(cpu().gdtr)); }
+void ia32_asm_read_idtr(void* idt) noexcept         { memcpy(idt, cpu().idtr, sizeof(cpu().idtr)); }
+void ia32_asm_write_idtr(void* idt) noexcept        { memcpy(cpu().idtr, idt, sizeof(cpu().idtr)); }
+
+//
+// Interrupts.
+//
+
+void ia32_asm_enable_interrupts() noexcept
+{
+}
+
+void ia32_asm_disable_interrupts() noexcept
+{
+}
+
+//
+// I/O ports - reads return all ones (no device), writes are dropped.
+//
+
+uint8_t ia32_asm_in_byte(uint16_t port) noexcept    { (void)(port); return 0xff;        }
+uint16_t ia32_asm_in_word(uint16_t port) noexcept   { (void)(port); return 0xffff;      }
+uint32_t ia32_asm_in_dword(uint16_t port) noexcept  { (void)(port); return 0xffff'ffff; }
+
+void ia32_asm_in_byte_string(uint16_t port, uint8_t* data, uint32_t size) noexcept
+{ (void)(port); memset(data, 0xff, size * sizeof(*data)); }
+
+void ia32_asm_in_word_string(uint16_t port, uint16_t* data, uint32_t size) noexcept
+{ (void)(port); memset(data, 0xff, size * sizeof(*data)); }
+
+void ia32_asm_in_dword_string(uint16_t port, uint32_t* data, uint32_t size) noexcept
+{ (void)(port); memset(data, 0xff, size * sizeof(*data)); }
+
+void ia32_asm_out_byte(uint16_t port, uint8_t value) noexcept                          { (void)(port); (void)(value); }
+void ia32_asm_out_word(uint16_t port, uint16_t value) noexcept                         { (void)(port); (void)(value); }
+void ia32_asm_out_dword(uint16_t port, uint32_t value) noexcept                        { (void)(port); (void)(value); }
+void ia32_asm_out_byte_string(uint16_t port, uint8_t* data, uint32_t count) noexcept   { (void)(port); (void)(data); (void)(count); }
+void ia32_asm_out_word_string(uint16_t port, uint16_t* data, uint32_t count) noexcept  { (void)(port); (void)(data); (void)(count); }
+void ia32_asm_out_dword_string(uint16_t port, uint32_t* data, uint32_t count) noexcept { (void)(port); (void)(data); (void)(count); }
+
+//
+// Control registers.
+//
+
+void ia32_asm_clear_ts(void) noexcept               { cpu().cr0 &= ~0x8ull; }
+void ia32_asm_write_msw(uint16_t msw) noexcept      { cpu().cr0 = (cpu().cr0 & ~0xfull) | (msw & 0xf); }
+
+uint64_t ia32_asm_read_cr0() noexcept               { return cpu().cr0; }
+void ia32_asm_write_cr0(uint64_t value) noexcept    { cpu().cr0 = value; }
+uint64_t ia32_asm_read_cr2() noexcept               { return cpu().cr2; }
+void ia32_asm_write_cr2(uint64_t value) noexcept    { cpu().cr2 = value; }
+uint64_t ia32_asm_read_cr3() noexcept               { return cpu().cr3; }
+void ia32_asm_write_cr3(uint64_t value) noexcept    { cpu().cr3 = value; ++cpu().tlb_flush_count; }
+uint64_t ia32_asm_read_cr4() noexcept               { return cpu().cr4; }
+void ia32_asm_write_cr4(uint64_t value) noexcept    { cpu().cr4 = value; }
+uint64_t ia32_asm_read_cr8() noexcept               { return cpu().cr8; }
+
+//
+// Debug registers.
+//
+
+uint64_t ia32_asm_read_dr0() noexcept               { return cpu().dr[0]; }
+void ia32_asm_write_dr0(uint64_t value) noexcept    { cpu().dr[0] = value; }
+uint64_t ia32_asm_read_dr1() noexcept               { return cpu().dr[1]; }
+void ia32_asm_write_dr1(uint64_t value) noexcept    { cpu().dr[1] = value; }
+uint64_t ia32_asm_read_dr2() noexcept               { return cpu().dr[2]; }
+void ia32_asm_write_dr2(uint64_t value) noexcept    { cpu().dr[2] = value; }
+uint64_t ia32_asm_read_dr3() noexcept               { return cpu().dr[3]; }
+void ia32_asm_write_dr3(uint64_t value) noexcept    { cpu().dr[3] = value; }
+uint64_t ia32_asm_read_dr4() noexcept               { return cpu().dr[4]; }
+void ia32_asm_write_dr4(uint64_t value) noexcept    { cpu().dr[4] = value; }
+uint64_t ia32_asm_read_dr5() noexcept               { return cpu().dr[5]; }
+void ia32_asm_write_dr5(uint64_t value) noexcept    { cpu().dr[5] = value; }
+uint64_t ia32_asm_read_dr6() noexcept               { return cpu().dr[6]; }
+void ia32_asm_write_dr6(uint64_t value) noexcept    { cpu().dr[6] = value; }
+uint64_t ia32_asm_read_dr7() noexcept               { return cpu().dr[7]; }
+void ia32_asm_write_dr7(uint64_t value) noexcept    { cpu().dr[7] = value; }
+
+//
+// Model specific registers.
+//
+
+uint64_t ia32_asm_read_msr(uint32_t msr) noexcept               { return ia32::mock::msr(msr); }
+void ia32_asm_write_msr(uint32_t msr, uint64_t value) noexcept  { ia32::mock::msr(msr) = value; }
+
+//
+// Extended control registers (only XCR0 is supported).
+//
+
+uint64_t ia32_asm_read_xcr(uint32_t reg) noexcept
+{ return reg == 0 ? cpu().xcr0 : 0; }
+
+void ia32_asm_write_xcr(uint32_t reg, uint64_t value) noexcept
+{ if (reg == 0) { cpu().xcr0 = value; } }
+
+//
+// Cache & TLB.
+//
+
+void ia32_asm_invd() noexcept
+{
+}
+
+void ia32_asm_wb_invd(void) noexcept
+{
+}
+
+void ia32_asm_inv_page(void* address) noexcept
+{
+  (void)(address);
+  ++cpu().tlb_flush_count;
+}
+
+void ia32_asm_inv_pcid(invpcid_t type, invpcid_desc_t* descriptor) noexcept
+{
+  (void)(type);
+  (void)(descriptor);
+  ++cpu().tlb_flush_count;
+}
+
+//
+// VMX.
+//
+// Note that VMLAUNCH is implemented in ia32/mock/asm.asm - it calls
+// ia32_mock_vmx_entry() below and continues at the guest RIP.
+//
+
+uint8_t ia32_asm_vmx_on(uint64_t* vmxon_pa) noexcept
+{
+  (void)(vmxon_pa);
+
+  if (cpu().vmx_on || !(cpu().cr4 & 0x2000))
+  {
+    return 2;
+  }
+
+  cpu().vmx_on = true;
+  return 0;
+}
+
+void ia32_asm_vmx_off(void) noexcept
+{
+  cpu().vmx_on = false;
+  cpu().current_vmcs = nullptr;
+}
+
+uint64_t ia32_mock_vmx_entry(uint64_t* guest_rsp) noexcept
+{
+  //
+  // VM-entry to the guest RIP and RSP - returns 0 if the VM-entry
+  // fails.  Nothing else of the guest state is loaded.
+  //
+  if (!cpu().vmx_on || !cpu().current_vmcs)
+  {
+    return 0;
+  }
+
+  *guest_rsp = vmcs_field(0x681c);              // guest_rsp
+  return vmcs_field(0x681e);                    // guest_rip
+}
+
+uint8_t ia32_asm_vmx_vmresume(void) noexcept
+{
+  //
+  // VM-exits are simulated by calling the VM-exit handler directly,
+  // the guest is never resumed through VMRESUME.
+  //
+  return 2;
+}
+
+uint8_t ia32_asm_vmx_vmclear(uint64_t* vmcs_pa) noexcept
+{
+  if (!cpu().vmx_on)
+  {
+    return 2;
+  }
+
+  auto store = detail::vmcs_store_create(*vmcs_pa);
+
+  if (store && cpu().current_vmcs == store)
+  {
+    cpu().current_vmcs = nullptr;
+  }
+
+  return detail::fail_or_succeed(store != nullptr);
+}
+
+uint8_t ia32_asm_vmx_vmread(uint64_t vmcs_field, uint64_t* value) noexcept
+{
+  auto store = cpu().current_vmcs;
+
+  if (!store)
+  {
+    return 2;
+  }
+
+  ++cpu().vmread_count;
+
+  const auto field = static_cast<uint32_t>(vmcs_field) % vmcs_store_t::field_count;
+
+  if (detail::field_width(field) == 1 && (field & 1))
+  {
+    *value = store->value[field & ~1u] >> 32;
+  }
+  else
+  {
+    *value = store->value[field];
+  }
+
+  return 0;
+}
+
+uint8_t ia32_asm_vmx_vmwrite(uint64_t vmcs_field, uint64_t value) noexcept
+{
+  auto store = cpu().current_vmcs;
+
+  if (!store)
+  {
+    return 2;
+  }
+
+  ++cpu().vmwrite_count;
+
+  const auto field = static_cast<uint32_t>(vmcs_field) % vmcs_store_t::field_count;
+
+  switch (detail::field_width(field))
+  {
+    case 0:
+      store->value[field] = value & 0xffff;
+      break;
+
+    case 1:
+      if (field & 1)
+      {
+        auto& full = store->value[field & ~1u];
+        full = (full & 0xffff'ffff) | (value << 32);
+      }
+      else
+      {
+        store->value[field] = value;
+      }
+      break;
+
+    case 2:
+      store->value[field] = value & 0xffff'ffff;
+      break;
+
+    default:
+      store->value[field] = value;
+      break;
+  }
+
+  return 0;
+}
+
+uint64_t ia32_asm_vmx_vmcall(uint64_t rcx, uint64_t rdx, uint64_t r8, uint64_t r9) noexcept
+{
+  //
+  // There is no VMX non-root mode to call from - VMCALL handlers are
+  // benchmarked by simulating the VM-exit (see vcpu_t::mock_exit()).
+  //
+  (void)(rcx);
+  (void)(rdx);
+  (void)(r8);
+  (void)(r9);
+  return 0;
+}
+
+void ia32_asm_vmx_vmptr_read(uint64_t* vmcs_pa) noexcept
+{
+  *vmcs_pa = cpu().current_vmcs ? cpu().current_vmcs->pa : ~0ull;
+}
+
+uint8_t ia32_asm_vmx_vmptr_write(uint64_t* vmcs_pa) noexcept
+{
+  if (!cpu().vmx_on)
+  {
+    return 2;
+  }
+
+  auto store = detail::vmcs_store_create(*vmcs_pa);
+
+  if (store)
+  {
+    cpu().current_vmcs = store;
+  }
+
+  return detail::fail_or_succeed(store != nullptr);
+}
+
+uint8_t ia32_asm_inv_ept(invept_t type, invept_desc_t* descriptor) noexcept
+{
+  (void)(type);
+  (void)(descriptor);
+  ++cpu().invept_count;
+  return 0;
+}
+
+uint8_t ia32_asm_inv_vpid(invvpid_t type, invvpid_desc_t* descriptor) noexcept
+{
+  (void)(type);
+  (void)(descriptor);
+  ++cpu().invvpid_count;
+  return 0;
+}
+
+}
@@ -0,0 +1,354 @@
+#pragma once
+#include <cstdint>
+
+//
+// User-mode build (see HVPP_MOCK).
+//
+// Unprivileged instructions (CPUID, RDTSC, bit operations, ...) are
+// executed as they are.  Privileged instructions would fault in the
+// user-mode - they're implemented by ia32/mock/asm.cpp on top of the
+// state of the mocked CPU (see ia32/mock/cpu.h).
+//
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Breakpoint.
+//
+
+inline void ia32_asm_int3() noexcept
+{
+  __debugbreak();
+}
+
+//
+// CPUID.
+//
+
+void __cpuid(int[4], int);
+#pragma intrinsic(__cpuid)
+inline void ia32_asm_cpuid(uint32_t result[4], uint32_t eax) noexcept
+{
+  __cpuid((int*)result, (int)eax);
+}
+
+void __cpuidex(int[4], int, int);
+#pragma intrinsic(__cpuidex)
+inline void ia32_asm_cpuid_ex(uint32_t result[4], uint32_t eax, uint32_t ecx) noexcept
+{
+  __cpuidex((int*)result, (int)eax, (int)ecx);
+}
+
+//
+// Stack pointer (approximate - address within the current stack frame).
+//
+
+void* _AddressOfReturnAddress(void);
+#pragma intrinsic(_AddressOfReturnAddress)
+inline uint64_t ia32_asm_read_rsp() noexcept
+{
+  return (uint64_t)_AddressOfReturnAddress();
+}
+
+//
+// TSC.
+//
+
+unsigned __int64 __rdtsc(void);
+#pragma intrinsic(__rdtsc)
+inline uint64_t ia32_asm_read_tsc() noexcept
+{
+  return __rdtsc();
+}
+
+unsigned __int64 __rdtscp(unsigned int*);
+#pragma intrinsic(__rdtscp)
+inline uint64_t ia32_asm_read_tscp(uint32_t* aux) noexcept
+{
+  return __rdtscp(aux);
+}
+
+//
+// Float state save/restore.
+//
+
+void _fxsave(void*);
+#pragma intrinsic(_fxsave)
+inline void ia32_asm_fx_save(void* fxarea) noexcept
+{
+  _fxsave(fxarea);
+}
+
+void _fxrstor(void const*);
+#pragma intrinsic(_fxrstor)
+inline void ia32_asm_fx_restore(const void* fxarea) noexcept
+{
+  _fxrstor(fxarea);
+}
+
+void _xsaveopt64(void*, unsigned __int64);
+#pragma intrinsic(_xsaveopt64)
+inline void ia32_asm_xsaveopt(void* xsave_area, uint64_t mask) noexcept
+{
+  _xsaveopt64(xsave_area, mask);
+}
+
+void _xrstor64(void const*, unsigned __int64);
+#pragma intrinsic(_xrstor64)
+inline void ia32_asm_xrstor(const void* xsave_area, uint64_t mask) noexcept
+{
+  _xrstor64(xsave_area, mask);
+}
+
+//
+// Pause/halt.
+//
+
+void _mm_pause(void);
+#pragma intrinsic(_mm_pause)
+inline void ia32_asm_pause() noexcept
+{
+  _mm_pause();
+}
+
+void ia32_asm_halt() noexcept;
+
+//
+// Segment registers.
+//
+
+uint16_t ia32_asm_read_cs() noexcept;
+void ia32_asm_write_cs(uint16_t cs) noexcept;
+uint16_t ia32_asm_read_ds() noexcept;
+void ia32_asm_write_ds(uint16_t ds) noexcept;
+uint16_t ia32_asm_read_es() noexcept;
+void ia32_asm_write_es(uint16_t es) noexcept;
+uint16_t ia32_asm_read_fs() noexcept;
+void ia32_asm_write_fs(uint16_t fs) noexcept;
+uint16_t ia32_asm_read_gs() noexcept;
+void ia32_asm_write_gs(uint16_t gs) noexcept;
+uint16_t ia32_asm_read_ss() noexcept;
+void ia32_asm_write_ss(uint16_t ss) noexcept;
+uint16_t ia32_asm_read_tr() noexcept;
+void ia32_asm_write_tr(uint16_t tr) noexcept;
+uint16_t ia32_asm_read_ldtr() noexcept;
+void ia32_asm_write_ldtr(uint16_t ldt) noexcept;
+
+uint32_t ia32_asm_read_ar(uint16_t selector) noexcept;
+uint32_t ia32_asm_read_sl(uint32_t segment) noexcept;
+
+//
+// Descriptor registers.
+//
+
+void ia32_asm_read_gdtr(void* gdt) noexcept;
+void ia32_asm_write_gdtr(const void* gdt) noexcept;
+void ia32_asm_read_idtr(void* idt) noexcept;
+void ia32_asm_write_idtr(void* idt) noexcept;
+
+//
+// Interrupts.
+//
+
+void ia32_asm_enable_interrupts() noexcept;
+void ia32_asm_disable_interrupts() noexcept;
+
+//
+// I/O ports.
+//
+
+uint8_t ia32_asm_in_byte(uint16_t port) noexcept;
+uint16_t ia32_asm_in_word(uint16_t port) noexcept;
+uint32_t ia32_asm_in_dword(uint16_t port) noexcept;
+void ia32_asm_in_byte_string(uint16_t port, uint8_t* data, uint32_t size) noexcept;
+void ia32_asm_in_word_string(uint16_t port, uint16_t* data, uint32_t size) noexcept;
+void ia32_asm_in_dword_string(uint16_t port, uint32_t* data, uint32_t size) noexcept;
+void ia32_asm_out_byte(uint16_t port, uint8_t value) noexcept;
+void ia32_asm_out_word(uint16_t port, uint16_t value) noexcept;
+void ia32_asm_out_dword(uint16_t port, uint32_t value) noexcept;
+void ia32_asm_out_byte_string(uint16_t port, uint8_t* data, uint32_t count) noexcept;
+void ia32_asm_out_word_string(uint16_t port, uint16_t* data, uint32_t count) noexcept;
+void ia32_asm_out_dword_string(uint16_t port, uint32_t* data, uint32_t count) noexcept;
+
+//
+// Control registers.
+//
+
+void ia32_asm_clear_ts(void) noexcept;
+void ia32_asm_write_msw(uint16_t msw) noexcept;
+
+uint64_t ia32_asm_read_cr0() noexcept;
+void ia32_asm_write_cr0(uint64_t value) noexcept;
+uint64_t ia32_asm_read_cr2() noexcept;
+void ia32_asm_write_cr2(uint64_t value) noexcept;
+uint64_t ia32_asm_read_cr3() noexcept;
+void ia32_asm_write_cr3(uint64_t value) noexcept;
+uint64_t ia32_asm_read_cr4() noexcept;
+void ia32_asm_write_cr4(uint64_t value) noexcept;
+uint64_t ia32_asm_read_cr8() noexcept;
+
+//
+// Debug registers.
+//
+
+uint64_t ia32_asm_read_dr0() noexcept;
+void ia32_asm_write_dr0(uint64_t value) noexcept;
+uint64_t ia32_asm_read_dr1() noexcept;
+void ia32_asm_write_dr1(uint64_t value) noexcept;
+uint64_t ia32_asm_read_dr2() noexcept;
+void ia32_asm_write_dr2(uint64_t value) noexcept;
+uint64_t ia32_asm_read_dr3() noexcept;
+void ia32_asm_write_dr3(uint64_t value) noexcept;
+uint64_t ia32_asm_read_dr4() noexcept;
+void ia32_asm_write_dr4(uint64_t value) noexcept;
+uint64_t ia32_asm_read_dr5() noexcept;
+void ia32_asm_write_dr5(uint64_t value) noexcept;
+uint64_t ia32_asm_read_dr6() noexcept;
+void ia32_asm_write_dr6(uint64_t value) noexcept;
+uint64_t ia32_asm_read_dr7() noexcept;
+void ia32_asm_write_dr7(uint64_t value) noexcept;
+
+//
+// EFLAGS/RFLAGS.
+//
+// POPFQ doesn't fault in the user-mode, it just ignores IF and IOPL.
+//
+
+unsigned __int64 __readeflags(void);
+#pragma intrinsic(__readeflags)
+inline uint64_t ia32_asm_read_eflags() noexcept
+{
+  return __readeflags();
+}
+
+void __writeeflags(unsigned __int64);
+#pragma intrinsic(__writeeflags)
+inline void ia32_asm_write_eflags(uint64_t value) noexcept
+{
+  __writeeflags(value);
+}
+
+//
+// MSRs.
+//
+
+uint64_t ia32_asm_read_msr(uint32_t msr) noexcept;
+void ia32_asm_write_msr(uint32_t msr, uint64_t value) noexcept;
+
+//
+// XCRs.
+//
+
+uint64_t ia32_asm_read_xcr(uint32_t reg) noexcept;
+void ia32_asm_write_xcr(uint32_t reg, uint64_t value) noexcept;
+
+//
+// Bit operations.
+//
+
+unsigned char _BitScanForward64(unsigned long*, unsigned __int64);
+#pragma intrinsic(_BitScanForward64)
+inline uint32_t ia32_asm_bsf(uint64_t value) noexcept
+{
+  uint32_t result;
+  _BitScanForward64((unsigned long*)&result, value);
+  return result;
+}
+
+unsigned char _BitScanReverse64(unsigned long*, unsigned __int64);
+#pragma intrinsic(_BitScanReverse64)
+inline uint32_t ia32_asm_bsr(uint64_t value) noexcept
+{
+  uint32_t result;
+  _BitScanReverse64((unsigned long*)&result, value);
+  return result;
+}
+
+unsigned char _bittest64(__int64 const*, __int64);
+#pragma intrinsic(_bittest64)
+inline uint8_t ia32_asm_bt(const void* base, uint64_t offset) noexcept
+{
+  return _bittest64((const __int64*)base, offset);
+}
+
+unsigned char _bittestandset64(__int64*, __int64);
+#pragma intrinsic(_bittestandset64)
+inline uint8_t ia32_asm_bts(void* base, uint64_t offset) noexcept
+{
+  return _bittestandset64((__int64*)base, offset);
+}
+
+unsigned char _interlockedbittestandset64(__int64 volatile*, __int64);
+#pragma intrinsic(_interlockedbittestandset64)
+inline uint8_t ia32_asm_interlocked_bts(volatile void* base, uint64_t offset) noexcept
+{
+  return _interlockedbittestandset64((volatile __int64*)base, (__int64)offset);
+}
+
+unsigned char _interlockedbittestandreset64(__int64 volatile*, __int64);
+#pragma intrinsic(_interlockedbittestandreset64)
+inline uint8_t ia32_asm_interlocked_btr(volatile void* base, uint64_t offset) noexcept
+{
+  return _interlockedbittestandreset64((volatile __int64*)base, (__int64)offset);
+}
+
+unsigned __int64 __popcnt64(unsigned __int64);
+#pragma intrinsic(__popcnt64)
+inline uint64_t ia32_asm_popcnt(uint64_t value) noexcept
+{
+  return __popcnt64(value);
+}
+
+unsigned __int64 _umul128(unsigned __int64, unsigned __int64, unsigned __int64*);
+#pragma intrinsic(_umul128)
+inline uint64_t ia32_asm_mul128(uint64_t a, uint64_t b, uint64_t* high) noexcept
+{
+  return _umul128(a, b, high);
+}
+
+//
+// Cache control.
+//
+
+void ia32_asm_invd() noexcept;
+void ia32_asm_wb_invd(void) noexcept;
+void ia32_asm_inv_page(void* address) noexcept;
+void ia32_asm_inv_pcid(invpcid_t type, invpcid_desc_t* descriptor) noexcept;
+
+//
+// VMX.
+//
+
+uint8_t ia32_asm_vmx_on(uint64_t* vmxon_pa) noexcept;
+void ia32_asm_vmx_off(void) noexcept;
+uint8_t ia32_asm_vmx_vmlaunch(void) noexcept;
+uint8_t ia32_asm_vmx_vmresume(void) noexcept;
+uint8_t ia32_asm_vmx_vmclear(uint64_t* vmcs_pa) noexcept;
+uint8_t ia32_asm_vmx_vmread(uint64_t vmcs_field, uint64_t* value) noexcept;
+uint8_t ia32_asm_vmx_vmwrite(uint64_t vmcs_field, uint64_t value) noexcept;
+uint64_t ia32_asm_vmx_vmcall(uint64_t rcx, uint64_t rdx, uint64_t r8, uint64_t r9) noexcept;
+void ia32_asm_vmx_vmptr_read(uint64_t* vmcs_pa) noexcept;
+uint8_t ia32_asm_vmx_vmptr_write(uint64_t* vmcs_pa) noexcept;
+
+uint8_t ia32_asm_inv_ept(invept_t type, invept_desc_t* descriptor) noexcept;
+uint8_t ia32_asm_inv_vpid(invvpid_t type, invvpid_desc_t* descriptor) noexcept;
+
+#ifdef __cplusplus
+}
+#endif
+
+//
+// This macro expands to code which will cause compiler to print error message
+// which includes size of the object.
+//
+#define static_sizeof(object)                 \
+  do                                          \
+  {                                           \
+    switch (*reinterpret_cast<int*>(nullptr)) \
+    {                                         \
+      case sizeof(object): break;             \
+      case sizeof(object): break;             \
+    }                                         \
+  } while (0)
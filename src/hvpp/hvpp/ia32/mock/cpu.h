@@ -0,0 +1,124 @@
+#pragma once
+#include <cstdint>
+
+//
+// Mocked CPU of the user-mode build (see HVPP_MOCK).
+//
+// Privileged instructions (see ia32/mock/asm.h) access the state of the
+// CPU of the current thread - each thread starts on CPU 0 and can switch
+// to another one by select().  mp::cpu_index() returns index of the CPU
+// of the current thread.
+//
+// Each VMCS has its own store of fields, created by its first VMCLEAR or
+// VMPTRLD.  VMREAD/VMWRITE access the store of the current VMCS (they
+// fail with VMfailInvalid if there is none).  The store is indexed by
+// bits 14:0 of the field encoding, the high access of 64-bit fields
+// accesses the upper half of the full field.  VMLAUNCH "enters" the
+// guest by jumping to the guest RIP with the guest RSP (see
+// ia32/mock/asm.asm) - which is enough for vcpu_t::launch() to return.
+// VMRESUME always fails - VM-exits are simulated by filling the
+// exit-information fields and calling vcpu_t::mock_exit().
+//
+// Usage:
+//   ia32::mock::reset();                 // VMX capabilities allow anything
+//   ia32::mock::msr(0x10) = 1234;        // set value of the MSR
+//
+//   vp.launch();                         // VMCS store is created in setup()
+//   ...
+//   ia32::mock::vmcs_field(vmcs_t::field::vmexit_reason) = 10;
+//   vp.mock_exit();
+//
+
+namespace ia32::mock {
+
+struct vmcs_store_t
+{
+  static constexpr uint32_t field_count = 0x8000;
+
+  uint64_t pa;
+  uint64_t value[field_count];
+};
+
+struct cpu_t
+{
+  static constexpr uint32_t msr_count = 512;
+
+  uint32_t      index;
+
+  uint64_t      cr0;
+  uint64_t      cr2;
+  uint64_t      cr3;
+  uint64_t      cr4;
+  uint64_t      cr8;
+  uint64_t      dr[8];
+  uint64_t      xcr0;
+
+  uint16_t      cs;
+  uint16_t      ds;
+  uint16_t      es;
+  uint16_t      fs;
+  uint16_t      gs;
+  uint16_t      ss;
+  uint16_t      tr;
+  uint16_t      ldtr;
+
+  uint8_t       gdtr[10];
+  uint8_t       idtr[10];
+
+  //
+  // GDT referenced by the GDTR after reset() - segment_t reads the
+  // descriptors of the selectors above from it.
+  //
+  uint64_t      gdt[16];
+
+  //
+  // MSRs - open addressing by MSR index (msr_id 0 marks free slot, MSR 0
+  // (IA32_P5_MC_ADDR) is not supported).
+  //
+  uint32_t      msr_id[msr_count];
+  uint64_t      msr_value[msr_count];
+
+  bool          vmx_on;
+  vmcs_store_t* current_vmcs;
+
+  //
+  // Statistics - useful for checking what the benchmarked code path does.
+  //
+  uint64_t      vmread_count;
+  uint64_t      vmwrite_count;
+  uint64_t      invept_count;
+  uint64_t      invvpid_count;
+  uint64_t      tlb_flush_count;
+};
+
+//
+// Reset state of all CPUs and destroy all VMCS stores.
+//
+void reset() noexcept;
+
+//
+// CPU of the current thread.
+//
+auto cpu() noexcept -> cpu_t&;
+void select(uint32_t cpu_index) noexcept;
+
+//
+// MSR of the CPU of the current thread (created on the first access).
+//
+auto msr(uint32_t msr_id) noexcept -> uint64_t&;
+
+//
+// Field of the current VMCS.
+//
+auto vmcs_field(uint32_t field) noexcept -> uint64_t&;
+
+template <typename T>
+auto vmcs_field(T field) noexcept -> uint64_t&
+{ return vmcs_field(static_cast<uint32_t>(field)); }
+
+//
+// Store of the VMCS (nullptr if the VMCS has never been used).
+//
+auto vmcs_store(uint64_t pa) noexcept -> vmcs_store_t*;
+
+}
@@ -0,0 +1,108 @@
+#include "../memory.h"
+
+#include "hvpp/lib/assert.h"
+
+#include <algorithm>
+
+namespace ia32::detail
+{
+  //
+  // The user-mode build (see HVPP_MOCK) has identity "physical" memory -
+  // physical address of each byte is its virtual address.  Page tables
+  // aren't walked and mapping windows don't need any PTEs.
+  //
+
+  uint64_t pa_from_va(const void* va) noexcept
+  {
+    return reinterpret_cast<uint64_t>(va);
+  }
+
+  uint64_t pa_from_va(const void* va, cr3_t cr3) noexcept
+  {
+    (void)(cr3);
+    return reinterpret_cast<uint64_t>(va);
+  }
+
+  void* va_from_pa(uint64_t pa) noexcept
+  {
+    return reinterpret_cast<void*>(pa);
+  }
+
+  void* mapping_allocate(size_t size) noexcept
+  {
+    (void)(size);
+    return nullptr;
+  }
+
+  void mapping_free(void* va) noexcept
+  {
+    (void)(va);
+  }
+
+  void check_physical_memory(physical_memory_range* range_list, int range_list_size, int& count) noexcept
+  {
+    //
+    // Single range covering the first 16 GB, so that the EPT identity
+    // mapping has a realistic size.
+    //
+    count = 0;
+
+    if (range_list_size > 0)
+    {
+      range_list[count++] = physical_memory_range(pa_t(0), pa_t(16ull * 1024 * 1024 * 1024));
+    }
+  }
+}
+
+namespace ia32 {
+
+//////////////////////////////////////////////////////////////////////////
+// mapping_t
+//////////////////////////////////////////////////////////////////////////
+
+//
+// Mapping windows of the user-mode build map nothing - map() returns
+// the identity address (see detail::va_from_pa()).
+//
+
+mapping_t::mapping_t(size_t page_count /* = default_page_count */) noexcept
+  : va_{ nullptr }
+  , pte_{ nullptr }
+  , page_count_{ page_count }
+  , mapped_count_{ 0 }
+{
+
+}
+
+mapping_t::~mapping_t() noexcept
+{
+  unmap();
+}
+
+void* mapping_t::map(pa_t pa) noexcept
+{
+  return map(pa, 1);
+}
+
+void* mapping_t::map(pa_t pa, size_t size) noexcept
+{
+  const auto page_count = bytes_to_pages(byte_offset(pa.value()) + size);
+
+  hvpp_assert(page_count > 0 && page_count <= page_count_);
+
+  mapped_count_ = std::max(mapped_count_, page_count);
+
+  return detail::va_from_pa(pa.value());
+}
+
+void mapping_t::unmap() noexcept
+{
+  mapped_count_ = 0;
+}
+
+void mapping_t::flush(size_t page_count) noexcept
+{
+  (void)(page_count);
+}
+
+}
@@ -52,6 +52,30 @@ struct debugctl_t
   };
 };
 
+//
+// Last Branch Record stack.
+// Depth of the stack is model-specific (4 - 32 entries).
+// (ref: Vol3B[17.4.8(LBR Stack)])
+//
+struct lastbranch_tos_t
+{
+  static constexpr uint32_t msr_id = 0x000001c9;
+  using result_type = lastbranch_tos_t;
+
+  union
+  {
+    uint64_t flags;
+
+    struct
+    {
+      uint64_t index : 5;
+    };
+  };
+};
+
+static constexpr uint32_t lastbranch_from_ip_msr_id = 0x00000680;   // + index
+static constexpr uint32_t lastbranch_to_ip_msr_id   = 0x000006c0;   // + index
+
 struct efer_t
 {
   static constexpr uint32_t msr_id = 0xc0000080;
@@ -296,4 +296,21 @@ struct vmx_ept_vpid_cap_t
   };
 };
 
+struct vmx_vmfunc_t
+{
+  static constexpr uint32_t msr_id = 0x00000491;
+  using result_type = vmx_vmfunc_t;
+
+  union
+  {
+    uint64_t flags;
+
+    struct
+    {
+      uint64_t eptp_switching : 1;
+      uint64_t reserved_1 : 63;
+    };
+  };
+};
+
 }
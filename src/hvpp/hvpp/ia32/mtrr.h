@@ -3,6 +3,8 @@
 #include "msr.h"
 #include "msr/mtrr.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <cinttypes>
 
@@ -20,7 +22,14 @@ class mtrr
     static constexpr int fixed_count = (1 + 2 + 8) * 8;
     static constexpr int max_variable_count = 255;
 
-    mtrr() noexcept { check_fixed(); check_variable(); }
+    //
+    // Each MTRR range contributes at most 2 boundaries, which split
+    // the physical address space into at most (boundaries + 1) ranges.
+    //
+    static constexpr int max_map_count = 2 * (fixed_count + max_variable_count) + 1;
+    static constexpr uint64_t max_physical_address = 1ull << 52;
+
+    mtrr() noexcept { check_fixed(); check_variable(); build_map(); }
     mtrr(const mtrr& other) noexcept = delete;
     mtrr(mtrr&& other) noexcept = delete;
     mtrr& operator=(const mtrr& other) noexcept = delete;
@@ -31,66 +40,140 @@ class mtrr
     size_t            size()  const noexcept { return fixed_count + variable_count_; }
 
     memory_type type(pa_t pa) const noexcept
+    {
+      auto item = find(pa);
+      return item ? item->type : default_memory_type_;
+    }
+
+    memory_type type(pa_t pa, size_t size) const noexcept
     {
       //
-      // If the MTRRs are not enabled (by setting the E flag in the
-      // IA32_MTRR_DEF_TYPE MSR), then all memory accesses are of the
-      // UC memory type.  If the MTRRs are enabled, then the memory
-      // type used for a memory access is determined as follows:
+      // Returns memory type of the whole range [pa, pa + size) if it's
+      // uniform, memory_type::invalid otherwise.
       //
-      // 1. If the physical address falls within the first 1 MByte of
-      //    physical memory and fixed MTRRs are enabled, the processor
-      //    uses the memory type stored for the appropriate fixed-range
-      //    MTRR.
+      auto item = find(pa);
+
+      if (!item)
+      {
+        return default_memory_type_;
+      }
+
+      return pa + size <= item->range.end()
+        ? item->type
+        : memory_type::invalid;
+    }
+
+    bool is_uniform(pa_t pa, size_t size) const noexcept
+    {
+      return type(pa, size) != memory_type::invalid;
+    }
+
+    memory_type type_next(pa_t pa, const mtrr_range*& cursor) const noexcept
+    {
       //
-      // 2. Otherwise, the processor attempts to match the physical
-      //    address with a memory type set by the variable-range MTRRs:
-      //    -  If one variable memory range matches, the processor uses
-      //       the memory type stored in the IA32_MTRR_PHYSBASEn register
-      //       for that range.
+      // Same as type(pa), but for non-decreasing addresses - the cursor
+      // (nullptr before the first call) is advanced through the map
+      // instead of searching it, so that a pass over the whole address
+      // space is linear.  The MTRRs must not be updated during the pass.
       //
-      //    -  If two or more variable memory ranges match and the memory
-      //       types are identical, then that memory type is used.
+      const auto& map = map_[map_index_];
+      const auto map_end = &map.item[map.count];
+
+      if (!cursor)
+      {
+        cursor = &map.item[0];
+      }
+
+      while (cursor != map_end && cursor->range.end() <= pa)
+      {
+        ++cursor;
+      }
+
+      return cursor != map_end && cursor->range.contains(pa)
+        ? cursor->type
+        : default_memory_type_;
+    }
+
+    static bool is_mtrr(uint32_t msr_id) noexcept
+    {
       //
-      //    -  If two or more variable memory ranges match and one of the
-      //       memory types is UC, the UC memory type is used.
+      // IA32_MTRR_DEF_TYPE, fixed-range MTRRs and pairs of variable-range
+      // MTRRs (IA32_MTRR_CAP is read-only).
       //
-      //    -  If two or more variable memory ranges match and the memory
-      //       types are WT and WB, the WT memory type is used.
-      //
-      //    -  For overlaps not defined by the above rules, processor
-      //       behavior is undefined.
+      if (msr_id == msr::mtrr_def_type_t::msr_id)
+      {
+        return true;
+      }
+
+      if (msr_id >= msr::mtrr_physbase_t::msr_id &&
+          msr_id <  msr::mtrr_physbase_t::msr_id + max_variable_count * 2)
+      {
+        return true;
+      }
+
+      bool result = false;
+      for_each_type(msr::mtrr_fix_list_t{}, [&](auto mtrr_fixed, int) {
+        result |= decltype(mtrr_fixed)::msr_id == msr_id;
+      });
+
+      return result;
+    }
+
+    physical_memory_range update(uint32_t msr_id, uint64_t old_value) noexcept
+    {
       //
-      // 3. If no fixed or variable memory range matches, the processor uses
-      //    the default memory type.
+      // Re-read the MTRRs after the MTRR "msr_id" has been written
+      // (its previous value was "old_value").  Returns the range of
+      // physical addresses whose memory type might have changed - the
+      // union of the range described by the MTRR before and after the
+      // write.  Change of IA32_MTRR_DEF_TYPE affects everything.
       //
-      // (ref: Vol3A[11.11.4.1(MTRR Precedences)]
+      // Note that the map is rebuilt in the inactive buffer and then
+      // published - concurrent type() calls see either the old or the
+      // new map.  Updates themselves must be serialized by the caller.
       //
-      memory_type result = memory_type::invalid;
+      physical_memory_range result;
 
-      for (auto mtrr_item : *this)
+      if (msr_id == msr::mtrr_def_type_t::msr_id)
       {
-        if (mtrr_item.range.contains(pa))
+        result.set(pa_t{ 0 }, pa_t{ max_physical_address });
+      }
+      else if (msr_id >= msr::mtrr_physbase_t::msr_id &&
+               msr_id <  msr::mtrr_physbase_t::msr_id + max_variable_count * 2)
+      {
+        const auto base_id = msr_id & ~1u;
+
+        auto old_base = msr::read<msr::mtrr_physbase_t>(base_id);
+        auto old_mask = msr::read<msr::mtrr_physmask_t>(base_id + 1);
+        const auto new_range = variable_range(old_base, old_mask);
+
+        if (msr_id == base_id)
         {
-          if (is_fixed(mtrr_item) || mtrr_item.type == memory_type::uncacheable)
-          {
-            result = mtrr_item.type;
-            break;
-          }
+          old_base.flags = old_value;
+        }
+        else
+        {
+          old_mask.flags = old_value;
+        }
+
+        result = hull(variable_range(old_base, old_mask), new_range);
+      }
+      else
+      {
+        for_each_type(msr::mtrr_fix_list_t{}, [&](auto mtrr_fixed, int) {
+          using ia32_mtrr_t = decltype(mtrr_fixed);
 
-          if ( result == memory_type::write_back &&
-              (result == memory_type::write_through ||
-               mtrr_item.type == memory_type::write_through))
+          if (ia32_mtrr_t::msr_id == msr_id)
           {
-            result = memory_type::write_through;
+            result.set(pa_t{ ia32_mtrr_t::mtrr_base },
+                       pa_t{ ia32_mtrr_t::mtrr_base + ia32_mtrr_t::mtrr_size * 8 });
           }
-        }
+        });
       }
 
-      if (result == memory_type::invalid)
-      {
-        result = default_memory_type_;
-      }
+      check_fixed();
+      check_variable();
+      build_map();
 
       return result;
     }
@@ -118,6 +201,13 @@ class mtrr
       {
         dump_range(i, variable_[i]);
       }
+
+      const auto& map = map_[map_index_];
+      hvpp_info("Memory type map (%i)", map.count);
+      for (int i = 0; i < map.count; ++i)
+      {
+        dump_range(i, map.item[i]);
+      }
     }
 
 
@@ -129,6 +219,11 @@ class mtrr
 
       default_memory_type_ = static_cast<memory_type>(mtrr_default.default_memory_type);
 
+      for (auto& fixed_item : fixed_)
+      {
+        fixed_item = mtrr_range{};
+      }
+
       if (mtrr_capabilities.fixed_range_supported && mtrr_default.fixed_range_mtrr_enable)
       {
         for_each_type(msr::mtrr_fix_list_t{}, [this](auto mtrr_fixed, int i) {
@@ -160,16 +255,216 @@ class mtrr
         auto mtrr_base = msr::read<msr::mtrr_physbase_t>(msr::mtrr_physbase_t::msr_id + i * 2);
         auto mtrr_mask = msr::read<msr::mtrr_physmask_t>(msr::mtrr_physmask_t::msr_id + i * 2);
 
-        if (mtrr_mask.valid)
+        variable_[i].range = variable_range(mtrr_base, mtrr_mask);
+        variable_[i].type  = static_cast<memory_type>(mtrr_base.type);
+      }
+    }
+
+    static physical_memory_range variable_range(msr::mtrr_physbase_t mtrr_base,
+                                                msr::mtrr_physmask_t mtrr_mask) noexcept
+    {
+      //
+      // Range described by the pair of variable-range MTRRs (empty if
+      // the pair isn't valid).
+      //
+      if (!mtrr_mask.valid || !mtrr_mask.page_frame_number)
+      {
+        return physical_memory_range{};
+      }
+
+      uint64_t size = 1ull << ia32_asm_bsf(mtrr_mask.page_frame_number);
+
+      return physical_memory_range(
+        pa_t::from_pfn(mtrr_base.page_frame_number),
+        pa_t::from_pfn(mtrr_base.page_frame_number + size));
+    }
+
+    static physical_memory_range hull(const physical_memory_range& lhs,
+                                      const physical_memory_range& rhs) noexcept
+    {
+      if (lhs.size() == 0) return rhs;
+      if (rhs.size() == 0) return lhs;
+
+      return physical_memory_range(std::min(lhs.begin(), rhs.begin()),
+                                   std::max(lhs.end(),   rhs.end()));
+    }
+
+    void build_map() noexcept
+    {
+      //
+      // Build sorted list of non-overlapping ranges covering the whole
+      // physical address space, each with the memory type resolved by
+      // resolve_type().  Adjacent ranges of the same type are merged,
+      // so that type(pa) is a single binary search and a range query
+      // answers whether the whole range has single memory type.
+      //
+      // Start by collecting boundaries of all MTRR ranges (the "begin"
+      // of the map items is used as a scratch space).  Between two
+      // consecutive boundaries, each address is matched by the very
+      // same set of MTRRs.
+      //
+      auto& map = map_[map_index_ ^ 1];
+      auto items = map.item;
+
+      int count = 0;
+      items[count++].range.set(pa_t{ 0 }, pa_t{ 0 });
+
+      for (auto mtrr_item : *this)
+      {
+        if (mtrr_item.range.size() == 0)
+        {
+          continue;
+        }
+
+        items[count++].range.set(mtrr_item.range.begin(), pa_t{ 0 });
+        items[count++].range.set(mtrr_item.range.end(),   pa_t{ 0 });
+      }
+
+      auto less = [](const mtrr_range& lhs, const mtrr_range& rhs) noexcept {
+        return lhs.range.begin() < rhs.range.begin();
+      };
+
+      auto equal = [](const mtrr_range& lhs, const mtrr_range& rhs) noexcept {
+        return lhs.range.begin() == rhs.range.begin();
+      };
+
+      std::sort(&items[0], &items[count], less);
+      count = static_cast<int>(std::unique(&items[0], &items[count], equal) - &items[0]);
+
+      //
+      // Turn boundaries into ranges.  Items are written at indices which
+      // were already read, so this can be done in place.
+      //
+      int map_count = 0;
+
+      for (int i = 0; i < count; ++i)
+      {
+        const pa_t range_begin = items[i].range.begin();
+        const pa_t range_end   = i + 1 < count
+          ? items[i + 1].range.begin()
+          : pa_t{ max_physical_address };
+
+        if (range_end <= range_begin)
         {
-          uint64_t size = 1ull << ia32_asm_bsf(mtrr_mask.page_frame_number);
+          break;
+        }
+
+        const auto range_type = resolve_type(range_begin);
 
-          variable_[i].range = physical_memory_range(
-            pa_t::from_pfn(mtrr_base.page_frame_number),
-            pa_t::from_pfn(mtrr_base.page_frame_number + size));
-          variable_[i].type  = static_cast<memory_type>(mtrr_base.type);
+        if (map_count > 0 && items[map_count - 1].type == range_type)
+        {
+          items[map_count - 1].range.set(items[map_count - 1].range.begin(), range_end);
+        }
+        else
+        {
+          items[map_count].range.set(range_begin, range_end);
+          items[map_count].type = range_type;
+          map_count += 1;
         }
       }
+
+      map.count = map_count;
+
+      //
+      // Publish the new map.
+      //
+      std::atomic_thread_fence(std::memory_order_release);
+      map_index_ ^= 1;
+    }
+
+    memory_type resolve_type(pa_t pa) const noexcept
+    {
+      //
+      // If the MTRRs are not enabled (by setting the E flag in the
+      // IA32_MTRR_DEF_TYPE MSR), then all memory accesses are of the
+      // UC memory type.  If the MTRRs are enabled, then the memory
+      // type used for a memory access is determined as follows:
+      //
+      // 1. If the physical address falls within the first 1 MByte of
+      //    physical memory and fixed MTRRs are enabled, the processor
+      //    uses the memory type stored for the appropriate fixed-range
+      //    MTRR.
+      //
+      // 2. Otherwise, the processor attempts to match the physical
+      //    address with a memory type set by the variable-range MTRRs:
+      //    -  If one variable memory range matches, the processor uses
+      //       the memory type stored in the IA32_MTRR_PHYSBASEn register
+      //       for that range.
+      //
+      //    -  If two or more variable memory ranges match and the memory
+      //       types are identical, then that memory type is used.
+      //
+      //    -  If two or more variable memory ranges match and one of the
+      //       memory types is UC, the UC memory type is used.
+      //
+      //    -  If two or more variable memory ranges match and the memory
+      //       types are WT and WB, the WT memory type is used.
+      //
+      //    -  For overlaps not defined by the above rules, processor
+      //       behavior is undefined.
+      //
+      // 3. If no fixed or variable memory range matches, the processor uses
+      //    the default memory type.
+      //
+      // (ref: Vol3A[11.11.4.1(MTRR Precedences)]
+      //
+      memory_type result = memory_type::invalid;
+
+      for (auto& mtrr_item : *this)
+      {
+        if (mtrr_item.range.contains(pa))
+        {
+          if (is_fixed(mtrr_item) || mtrr_item.type == memory_type::uncacheable)
+          {
+            result = mtrr_item.type;
+            break;
+          }
+
+          if (result == memory_type::invalid || result == mtrr_item.type)
+          {
+            result = mtrr_item.type;
+          }
+          else if ((result == memory_type::write_back    && mtrr_item.type == memory_type::write_through) ||
+                   (result == memory_type::write_through && mtrr_item.type == memory_type::write_back))
+          {
+            result = memory_type::write_through;
+          }
+          else
+          {
+            //
+            // Undefined behavior - pick the safest option.
+            //
+            result = memory_type::uncacheable;
+            break;
+          }
+        }
+      }
+
+      if (result == memory_type::invalid)
+      {
+        result = default_memory_type_;
+      }
+
+      return result;
+    }
+
+    const mtrr_range* find(pa_t pa) const noexcept
+    {
+      const auto& map = map_[map_index_];
+      const auto items = map.item;
+
+      auto item = std::upper_bound(&items[0], &items[map.count], pa,
+        [](pa_t value, const mtrr_range& range_item) noexcept {
+          return value < range_item.range.begin();
+        });
+
+      if (item == &items[0])
+      {
+        return nullptr;
+      }
+
+      --item;
+      return item->range.contains(pa) ? item : nullptr;
     }
 
     bool is_fixed(const mtrr_range& range) const noexcept
@@ -193,6 +488,19 @@ class mtrr
       mtrr_range mtrr_[fixed_count + max_variable_count];
     };
 
+    //
+    // Two buffers of the memory type map - build_map() fills the inactive
+    // one and then flips map_index_ (see update()).
+    //
+    struct map_t
+    {
+      mtrr_range item[max_map_count];
+      int        count;
+    };
+
+    map_t map_[2] = {};
+    volatile int map_index_ = 0;
+
     memory_type default_memory_type_ = memory_type::uncacheable;
     int variable_count_ = 0;
 };
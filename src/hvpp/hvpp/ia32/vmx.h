@@ -6,15 +6,23 @@
 
 #include "msr/vmx.h"
 
+#include "vmx/apic.h"
+#include "vmx/capabilities.h"
 #include "vmx/exit_qualification.h"
 #include "vmx/exit_reason.h"
 #include "vmx/interrupt.h"
 #include "vmx/instruction_error.h"
 #include "vmx/instruction_info.h"
 #include "vmx/vmcs.h"
+#include "vmx/vmcs_bitmap.h"
+#include "vmx/eptp_list.h"
+#include "vmx/evmcs.h"
 #include "vmx/exception_bitmap.h"
 #include "vmx/io_bitmap.h"
+#include "vmx/msr_area.h"
 #include "vmx/msr_bitmap.h"
+#include "vmx/pml.h"
+#include "vmx/ve_info.h"
 
 #include <cstdint>
 
@@ -127,6 +135,48 @@ auto adjust(T desired) noexcept
   return desired;
 }
 
+//
+// Same as above, except that the capability MSRs are taken from the
+// snapshot (see capabilities_t) - no RDMSR is executed.
+//
+template <typename T>
+auto adjust(T desired, const capabilities_t& caps) noexcept
+{
+  if constexpr (std::is_same_v<T, cr0_t>)
+  {
+    desired.flags |= caps.cr0_fixed0.flags;
+    desired.flags &= caps.cr0_fixed1.flags;
+  }
+  else if constexpr (std::is_same_v<T, cr4_t>)
+  {
+    desired.flags |= caps.cr4_fixed0.flags;
+    desired.flags &= caps.cr4_fixed1.flags;
+  }
+  else if constexpr (std::is_same_v<T, msr::vmx_pinbased_ctls_t>  ||
+                     std::is_same_v<T, msr::vmx_procbased_ctls_t> ||
+                     std::is_same_v<T, msr::vmx_exit_ctls_t>      ||
+                     std::is_same_v<T, msr::vmx_entry_ctls_t>     ||
+                     std::is_same_v<T, msr::vmx_procbased_ctls2_t>)
+  {
+    const auto& ctls =
+      std::is_same_v<T, msr::vmx_pinbased_ctls_t>  ? caps.pinbased_ctls  :
+      std::is_same_v<T, msr::vmx_procbased_ctls_t> ? caps.procbased_ctls :
+      std::is_same_v<T, msr::vmx_exit_ctls_t>      ? caps.exit_ctls      :
+      std::is_same_v<T, msr::vmx_entry_ctls_t>     ? caps.entry_ctls     :
+                                                     caps.procbased_ctls2;
+
+    desired.flags |= ctls.allowed_0_settings;
+    desired.flags &= ctls.allowed_1_settings;
+  }
+  else
+  {
+    (void)(caps);
+    desired = adjust(desired);
+  }
+
+  return desired;
+}
+
 inline error_code on(pa_t pa) noexcept
 { return static_cast<error_code>(ia32_asm_vmx_on((uint64_t*)&pa)); }
 
@@ -0,0 +1,69 @@
+#pragma once
+#include "../memory.h"
+
+#include <cstdint>
+
+namespace ia32::vmx {
+
+//
+// Virtual-APIC page.
+// (ref: Vol3C[29.1(Virtual Apic State)])
+//
+// Layout follows the xAPIC register page - only the registers used by
+// the TPR shadow and by the virtual-interrupt delivery are named.
+//
+
+struct alignas(page_size) virtual_apic_t
+{
+  static constexpr uint32_t tpr_offset = 0x080;
+  static constexpr uint32_t isr_offset = 0x100;
+  static constexpr uint32_t irr_offset = 0x200;
+
+  uint8_t data[page_size];
+
+  //
+  // VISR/VIRR are 256-bit registers - 32 bits in each 16-byte slot.
+  //
+  uint32_t& tpr() noexcept
+  { return *reinterpret_cast<uint32_t*>(&data[tpr_offset]); }
+
+  uint32_t& irr(uint8_t vector) noexcept
+  { return *reinterpret_cast<uint32_t*>(&data[irr_offset + (vector / 32) * 16]); }
+
+  uint32_t& isr(uint8_t vector) noexcept
+  { return *reinterpret_cast<uint32_t*>(&data[isr_offset + (vector / 32) * 16]); }
+};
+
+static_assert(sizeof(virtual_apic_t) == page_size);
+
+//
+// Posted-interrupt descriptor.
+// (ref: Vol3C[29.6(Posted-Interrupt Processing)])
+//
+// Requested vectors are set in "pir" and "outstanding_notification" is
+// set before the notification vector is sent to the CPU.  The processor
+// moves "pir" into the VIRR when it receives the notification vector in
+// VMX non-root mode (or on the next VM-entry).
+//
+
+struct alignas(64) posted_interrupt_descriptor_t
+{
+  uint64_t pir[4];
+
+  union
+  {
+    uint64_t flags;
+
+    struct
+    {
+      uint64_t outstanding_notification : 1;
+      uint64_t reserved_1 : 63;
+    };
+  };
+
+  uint64_t reserved_2[3];
+};
+
+static_assert(sizeof(posted_interrupt_descriptor_t) == 64);
+
+}
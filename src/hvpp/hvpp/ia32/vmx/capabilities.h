@@ -0,0 +1,87 @@
+#pragma once
+#include "../msr.h"
+#include "../msr/vmx.h"
+
+#include <cstdint>
+
+namespace ia32::vmx {
+
+//
+// Snapshot of the VMX capability MSRs.
+// (ref: Vol3D[A(VMX Capability Reporting Facility)])
+//
+// Capabilities don't change while the CPU is running, therefore they
+// can be read once (per CPU) and then used by vmx::adjust() - without
+// executing RDMSR each time VMX controls are written.
+//
+// Note that some of these MSRs exist only if the processor supports
+// the related control - they're left zeroed otherwise.
+//
+
+struct capabilities_t
+{
+  msr::vmx_basic_t        basic;
+  msr::vmx_true_ctls_t    pinbased_ctls;      // IA32_VMX_TRUE_PINBASED_CTLS
+  msr::vmx_true_ctls_t    procbased_ctls;     // IA32_VMX_TRUE_PROCBASED_CTLS
+  msr::vmx_true_ctls_t    exit_ctls;          // IA32_VMX_TRUE_EXIT_CTLS
+  msr::vmx_true_ctls_t    entry_ctls;         // IA32_VMX_TRUE_ENTRY_CTLS
+  msr::vmx_true_ctls_t    procbased_ctls2;    // IA32_VMX_PROCBASED_CTLS2
+  msr::vmx_misc_t         misc;
+  cr0_t                   cr0_fixed0;
+  cr0_t                   cr0_fixed1;
+  cr4_t                   cr4_fixed0;
+  cr4_t                   cr4_fixed1;
+  msr::vmx_ept_vpid_cap_t ept_vpid_cap;
+  msr::vmx_vmfunc_t       vmfunc;
+
+  //
+  // Read capabilities of the current CPU.
+  //
+  static auto read() noexcept -> capabilities_t
+  {
+    capabilities_t result{};
+
+    result.basic          = msr::read<msr::vmx_basic_t>();
+
+    //
+    // IA32_VMX_TRUE_*_CTLS MSRs are located 0xC after their
+    // counterparts and exist only if IA32_VMX_BASIC[55] is set.
+    //
+    const uint32_t true_offset = result.basic.true_controls ? 0xC : 0;
+
+    result.pinbased_ctls  = msr::read<msr::vmx_true_ctls_t>(msr::vmx_pinbased_ctls_t::msr_id  + true_offset);
+    result.procbased_ctls = msr::read<msr::vmx_true_ctls_t>(msr::vmx_procbased_ctls_t::msr_id + true_offset);
+    result.exit_ctls      = msr::read<msr::vmx_true_ctls_t>(msr::vmx_exit_ctls_t::msr_id      + true_offset);
+    result.entry_ctls     = msr::read<msr::vmx_true_ctls_t>(msr::vmx_entry_ctls_t::msr_id     + true_offset);
+    result.misc           = msr::read<msr::vmx_misc_t>();
+    result.cr0_fixed0     = msr::read<msr::vmx_cr0_fixed0_t>();
+    result.cr0_fixed1     = msr::read<msr::vmx_cr0_fixed1_t>();
+    result.cr4_fixed0     = msr::read<msr::vmx_cr4_fixed0_t>();
+    result.cr4_fixed1     = msr::read<msr::vmx_cr4_fixed1_t>();
+
+    msr::vmx_procbased_ctls_t allowed_procbased_ctls{};
+    allowed_procbased_ctls.flags = result.procbased_ctls.allowed_1_settings;
+
+    if (allowed_procbased_ctls.activate_secondary_controls)
+    {
+      result.procbased_ctls2 = msr::read<msr::vmx_true_ctls_t>(msr::vmx_procbased_ctls2_t::msr_id);
+
+      msr::vmx_procbased_ctls2_t allowed_procbased_ctls2{};
+      allowed_procbased_ctls2.flags = result.procbased_ctls2.allowed_1_settings;
+
+      if (allowed_procbased_ctls2.enable_ept || allowed_procbased_ctls2.enable_vpid)
+      {
+        result.ept_vpid_cap = msr::read<msr::vmx_ept_vpid_cap_t>();
+      }
+
+      if (allowed_procbased_ctls2.enable_vm_functions)
+      {
+        result.vmfunc = msr::read<msr::vmx_vmfunc_t>();
+      }
+    }
+
+    return result;
+  }
+};
+
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include "../ept.h"
+#include "../memory.h"
+
+#include <cstdint>
+
+namespace ia32::vmx {
+
+//
+// EPTP list used by the EPTP switching VM-function (VMFUNC leaf 0).
+// (ref: Vol3C[24.6.14(VM-Function Controls)])
+// (ref: Vol3C[25.5.5.3(EPTP Switching)])
+//
+
+struct alignas(page_size) eptp_list_t
+{
+  static constexpr int count = 512;
+
+  ept_ptr_t entry[count];
+};
+
+static_assert(sizeof(eptp_list_t) == page_size);
+
+}
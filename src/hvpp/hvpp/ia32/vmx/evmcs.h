@@ -0,0 +1,525 @@
+#pragma once
+#include "capabilities.h"
+#include "vmcs.h"
+#include "../asm.h"
+#include "../memory.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace ia32::vmx {
+
+//
+// Enlightened VMCS (version 1).
+// (ref: Hypervisor Top Level Functional Specification, "Enlightened VMCS")
+//
+// When running nested under Hyper-V, the VMCS can be kept in the ordinary
+// memory instead of in the processor - VMREAD/VMWRITE become plain memory
+// accesses (each of them would otherwise trap to the L0 hypervisor).
+// The L0 hypervisor reloads on VM-entry only groups of fields, whose bit
+// in "hv_clean_fields" is cleared - therefore each write has to clear
+// the bit of the group of the written field (see write()).
+//
+// The enlightened VMCS is made current by the VP assist page (see
+// vp_assist_page_t) instead of VMPTRLD.
+//
+
+struct alignas(page_size) evmcs_t
+{
+  static constexpr uint32_t version = 1;
+
+  //
+  // Groups of fields (see hv_clean_fields).
+  //
+  enum clean_field : uint32_t
+  {
+    clean_none                  = 0,
+    clean_io_bitmap             = 1 <<  0,
+    clean_msr_bitmap            = 1 <<  1,
+    clean_control_grp2          = 1 <<  2,
+    clean_guest_grp1            = 1 <<  3,
+    clean_control_proc          = 1 <<  4,
+    clean_control_event         = 1 <<  5,
+    clean_control_entry         = 1 <<  6,
+    clean_control_excpn         = 1 <<  7,
+    clean_crdr                  = 1 <<  8,
+    clean_control_xlat          = 1 <<  9,
+    clean_guest_basic           = 1 << 10,
+    clean_control_grp1          = 1 << 11,
+    clean_guest_grp2            = 1 << 12,
+    clean_host_pointer          = 1 << 13,
+    clean_host_grp1             = 1 << 14,
+    clean_enlightenments_ctl    = 1 << 15,
+    clean_all                   = 0xffff,
+  };
+
+  uint32_t revision_id;
+  uint32_t abort;
+
+  uint16_t host_es_selector;
+  uint16_t host_cs_selector;
+  uint16_t host_ss_selector;
+  uint16_t host_ds_selector;
+  uint16_t host_fs_selector;
+  uint16_t host_gs_selector;
+  uint16_t host_tr_selector;
+  uint16_t padding16_1;
+
+  uint64_t host_pat;
+  uint64_t host_efer;
+
+  uint64_t host_cr0;
+  uint64_t host_cr3;
+  uint64_t host_cr4;
+
+  uint64_t host_sysenter_esp;
+  uint64_t host_sysenter_eip;
+  uint64_t host_rip;
+  uint32_t host_sysenter_cs;
+
+  uint32_t pin_based_vm_execution_controls;
+  uint32_t vmexit_controls;
+  uint32_t secondary_processor_based_vm_execution_controls;
+
+  uint64_t io_bitmap_a_address;
+  uint64_t io_bitmap_b_address;
+  uint64_t msr_bitmap_address;
+
+  uint16_t guest_es_selector;
+  uint16_t guest_cs_selector;
+  uint16_t guest_ss_selector;
+  uint16_t guest_ds_selector;
+  uint16_t guest_fs_selector;
+  uint16_t guest_gs_selector;
+  uint16_t guest_ldtr_selector;
+  uint16_t guest_tr_selector;
+
+  uint32_t guest_es_limit;
+  uint32_t guest_cs_limit;
+  uint32_t guest_ss_limit;
+  uint32_t guest_ds_limit;
+  uint32_t guest_fs_limit;
+  uint32_t guest_gs_limit;
+  uint32_t guest_ldtr_limit;
+  uint32_t guest_tr_limit;
+  uint32_t guest_gdtr_limit;
+  uint32_t guest_idtr_limit;
+
+  uint32_t guest_es_access_rights;
+  uint32_t guest_cs_access_rights;
+  uint32_t guest_ss_access_rights;
+  uint32_t guest_ds_access_rights;
+  uint32_t guest_fs_access_rights;
+  uint32_t guest_gs_access_rights;
+  uint32_t guest_ldtr_access_rights;
+  uint32_t guest_tr_access_rights;
+
+  uint64_t guest_es_base;
+  uint64_t guest_cs_base;
+  uint64_t guest_ss_base;
+  uint64_t guest_ds_base;
+  uint64_t guest_fs_base;
+  uint64_t guest_gs_base;
+  uint64_t guest_ldtr_base;
+  uint64_t guest_tr_base;
+  uint64_t guest_gdtr_base;
+  uint64_t guest_idtr_base;
+
+  uint64_t padding64_1[3];
+
+  uint64_t vmexit_msr_store_address;
+  uint64_t vmexit_msr_load_address;
+  uint64_t vmentry_msr_load_address;
+
+  uint64_t cr3_target_value_0;
+  uint64_t cr3_target_value_1;
+  uint64_t cr3_target_value_2;
+  uint64_t cr3_target_value_3;
+
+  uint32_t pagefault_error_code_mask;
+  uint32_t pagefault_error_code_match;
+
+  uint32_t cr3_target_count;
+  uint32_t vmexit_msr_store_count;
+  uint32_t vmexit_msr_load_count;
+  uint32_t vmentry_msr_load_count;
+
+  uint64_t tsc_offset;
+  uint64_t virtual_apic_address;
+  uint64_t guest_vmcs_link_pointer;
+
+  uint64_t guest_debugctl;
+  uint64_t guest_pat;
+  uint64_t guest_efer;
+
+  uint64_t guest_pdpte0;
+  uint64_t guest_pdpte1;
+  uint64_t guest_pdpte2;
+  uint64_t guest_pdpte3;
+
+  uint64_t guest_pending_debug_exceptions;
+  uint64_t guest_sysenter_esp;
+  uint64_t guest_sysenter_eip;
+
+  uint32_t guest_activity_state;
+  uint32_t guest_sysenter_cs;
+
+  uint64_t cr0_guest_host_mask;
+  uint64_t cr4_guest_host_mask;
+  uint64_t cr0_read_shadow;
+  uint64_t cr4_read_shadow;
+  uint64_t guest_cr0;
+  uint64_t guest_cr3;
+  uint64_t guest_cr4;
+  uint64_t guest_dr7;
+
+  uint64_t host_fs_base;
+  uint64_t host_gs_base;
+  uint64_t host_tr_base;
+  uint64_t host_gdtr_base;
+  uint64_t host_idtr_base;
+  uint64_t host_rsp;
+
+  uint64_t ept_pointer;
+
+  uint16_t virtual_processor_identifier;
+  uint16_t padding16_2[3];
+
+  uint64_t padding64_2[5];
+  uint64_t vmexit_guest_physical_address;
+
+  uint32_t vmexit_instruction_error;
+  uint32_t vmexit_reason;
+  uint32_t vmexit_interruption_info;
+  uint32_t vmexit_interruption_error_code;
+  uint32_t vmexit_idt_vectoring_info;
+  uint32_t vmexit_idt_vectoring_error_code;
+  uint32_t vmexit_instruction_length;
+  uint32_t vmexit_instruction_info;
+
+  uint64_t vmexit_qualification;
+  uint64_t vmexit_io_rcx;
+  uint64_t vmexit_io_rsi;
+  uint64_t vmexit_io_rdi;
+  uint64_t vmexit_io_rip;
+
+  uint64_t vmexit_guest_linear_address;
+  uint64_t guest_rsp;
+  uint64_t guest_rflags;
+
+  uint32_t guest_interruptibility_state;
+  uint32_t processor_based_vm_execution_controls;
+  uint32_t exception_bitmap;
+  uint32_t vmentry_controls;
+  uint32_t vmentry_interruption_info;
+  uint32_t vmentry_exception_error_code;
+  uint32_t vmentry_instruction_length;
+  uint32_t tpr_threshold;
+
+  uint64_t guest_rip;
+
+  uint32_t hv_clean_fields;
+  uint32_t padding32_1;
+  uint32_t hv_synthetic_controls;
+  uint32_t hv_enlightenments_control;
+  uint32_t hv_vp_id;
+  uint32_t padding32_2;
+  uint64_t hv_vm_id;
+  uint64_t partition_assist_page;
+
+  //
+  // Location of the field in the enlightened VMCS.  Fields without
+  // counterpart (offset == 0) can't be used - controls which need them
+  // are removed from the capabilities (see adjust()).
+  //
+  struct field_t
+  {
+    uint16_t offset;
+    uint16_t size;
+    uint32_t clean;
+  };
+
+  static constexpr auto field_of(vmcs_t::field vmcs_field) noexcept -> field_t
+  {
+#define HVPP_EVMCS_FIELD(name, member, group)                                         \
+    case vmcs_t::field::name:                                                           \
+      return field_t{ uint16_t(offsetof(evmcs_t, member)),                              \
+                      uint16_t(sizeof(evmcs_t::member)),                                \
+                      uint32_t(group) }
+
+    switch (vmcs_field)
+    {
+      HVPP_EVMCS_FIELD(ctrl_virtual_processor_identifier,                    virtual_processor_identifier,                     clean_control_xlat);
+      HVPP_EVMCS_FIELD(ctrl_io_bitmap_a_address,                             io_bitmap_a_address,                              clean_io_bitmap);
+      HVPP_EVMCS_FIELD(ctrl_io_bitmap_b_address,                             io_bitmap_b_address,                              clean_io_bitmap);
+      HVPP_EVMCS_FIELD(ctrl_msr_bitmap_address,                              msr_bitmap_address,                               clean_msr_bitmap);
+      HVPP_EVMCS_FIELD(ctrl_vmexit_msr_store_address,                        vmexit_msr_store_address,                         clean_control_grp1);
+      HVPP_EVMCS_FIELD(ctrl_vmexit_msr_load_address,                         vmexit_msr_load_address,                          clean_control_grp1);
+      HVPP_EVMCS_FIELD(ctrl_vmentry_msr_load_address,                        vmentry_msr_load_address,                         clean_control_grp1);
+      HVPP_EVMCS_FIELD(ctrl_tsc_offset,                                      tsc_offset,                                       clean_control_grp2);
+      HVPP_EVMCS_FIELD(ctrl_virtual_apic_address,                            virtual_apic_address,                             clean_control_grp2);
+      HVPP_EVMCS_FIELD(ctrl_ept_pointer,                                     ept_pointer,                                      clean_control_xlat);
+      HVPP_EVMCS_FIELD(ctrl_pin_based_vm_execution_controls,                 pin_based_vm_execution_controls,                  clean_control_grp1);
+      HVPP_EVMCS_FIELD(ctrl_processor_based_vm_execution_controls,           processor_based_vm_execution_controls,            clean_control_proc);
+      HVPP_EVMCS_FIELD(ctrl_exception_bitmap,                                exception_bitmap,                                 clean_control_excpn);
+      HVPP_EVMCS_FIELD(ctrl_pagefault_error_code_mask,                       pagefault_error_code_mask,                        clean_control_grp2);
+      HVPP_EVMCS_FIELD(ctrl_pagefault_error_code_match,                      pagefault_error_code_match,                       clean_control_grp2);
+      HVPP_EVMCS_FIELD(ctrl_cr3_target_count,                                cr3_target_count,                                 clean_control_grp2);
+      HVPP_EVMCS_FIELD(ctrl_vmexit_controls,                                 vmexit_controls,                                  clean_control_grp1);
+      HVPP_EVMCS_FIELD(ctrl_vmexit_msr_store_count,                          vmexit_msr_store_count,                           clean_control_grp1);
+      HVPP_EVMCS_FIELD(ctrl_vmexit_msr_load_count,                           vmexit_msr_load_count,                            clean_control_grp1);
+      HVPP_EVMCS_FIELD(ctrl_vmentry_controls,                                vmentry_controls,                                 clean_control_entry);
+      HVPP_EVMCS_FIELD(ctrl_vmentry_msr_load_count,                          vmentry_msr_load_count,                           clean_control_grp1);
+      HVPP_EVMCS_FIELD(ctrl_vmentry_interruption_info,                       vmentry_interruption_info,                        clean_control_event);
+      HVPP_EVMCS_FIELD(ctrl_vmentry_exception_error_code,                    vmentry_exception_error_code,                     clean_control_event);
+      HVPP_EVMCS_FIELD(ctrl_vmentry_instruction_length,                      vmentry_instruction_length,                       clean_control_event);
+      HVPP_EVMCS_FIELD(ctrl_tpr_threshold,                                   tpr_threshold,                                    clean_control_grp2);
+      HVPP_EVMCS_FIELD(ctrl_secondary_processor_based_vm_execution_controls, secondary_processor_based_vm_execution_controls,  clean_control_grp1);
+      HVPP_EVMCS_FIELD(ctrl_cr0_guest_host_mask,                             cr0_guest_host_mask,                              clean_crdr);
+      HVPP_EVMCS_FIELD(ctrl_cr4_guest_host_mask,                             cr4_guest_host_mask,                              clean_crdr);
+      HVPP_EVMCS_FIELD(ctrl_cr0_read_shadow,                                 cr0_read_shadow,                                  clean_crdr);
+      HVPP_EVMCS_FIELD(ctrl_cr4_read_shadow,                                 cr4_read_shadow,                                  clean_crdr);
+      HVPP_EVMCS_FIELD(ctrl_cr3_target_value_0,                              cr3_target_value_0,                               clean_control_grp2);
+      HVPP_EVMCS_FIELD(ctrl_cr3_target_value_1,                              cr3_target_value_1,                               clean_control_grp2);
+      HVPP_EVMCS_FIELD(ctrl_cr3_target_value_2,                              cr3_target_value_2,                               clean_control_grp2);
+      HVPP_EVMCS_FIELD(ctrl_cr3_target_value_3,                              cr3_target_value_3,                               clean_control_grp2);
+
+      //
+      // Exit-information fields are read-only.
+      //
+      HVPP_EVMCS_FIELD(vmexit_guest_physical_address,                        vmexit_guest_physical_address,                    clean_none);
+      HVPP_EVMCS_FIELD(vmexit_instruction_error,                             vmexit_instruction_error,                         clean_none);
+      HVPP_EVMCS_FIELD(vmexit_reason,                                        vmexit_reason,                                    clean_none);
+      HVPP_EVMCS_FIELD(vmexit_interruption_info,                             vmexit_interruption_info,                         clean_none);
+      HVPP_EVMCS_FIELD(vmexit_interruption_error_code,                       vmexit_interruption_error_code,                   clean_none);
+      HVPP_EVMCS_FIELD(vmexit_idt_vectoring_info,                            vmexit_idt_vectoring_info,                        clean_none);
+      HVPP_EVMCS_FIELD(vmexit_idt_vectoring_error_code,                      vmexit_idt_vectoring_error_code,                  clean_none);
+      HVPP_EVMCS_FIELD(vmexit_instruction_length,                            vmexit_instruction_length,                        clean_none);
+      HVPP_EVMCS_FIELD(vmexit_instruction_info,                              vmexit_instruction_info,                          clean_none);
+      HVPP_EVMCS_FIELD(vmexit_qualification,                                 vmexit_qualification,                             clean_none);
+      HVPP_EVMCS_FIELD(vmexit_io_rcx,                                        vmexit_io_rcx,                                    clean_none);
+      HVPP_EVMCS_FIELD(vmexit_io_rsx,                                        vmexit_io_rsi,                                    clean_none);
+      HVPP_EVMCS_FIELD(vmexit_io_rdi,                                        vmexit_io_rdi,                                    clean_none);
+      HVPP_EVMCS_FIELD(vmexit_io_rip,                                        vmexit_io_rip,                                    clean_none);
+      HVPP_EVMCS_FIELD(vmexit_guest_linear_address,                          vmexit_guest_linear_address,                      clean_none);
+
+      HVPP_EVMCS_FIELD(guest_es_selector,                                    guest_es_selector,                                clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_cs_selector,                                    guest_cs_selector,                                clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_ss_selector,                                    guest_ss_selector,                                clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_ds_selector,                                    guest_ds_selector,                                clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_fs_selector,                                    guest_fs_selector,                                clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_gs_selector,                                    guest_gs_selector,                                clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_ldtr_selector,                                  guest_ldtr_selector,                              clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_tr_selector,                                    guest_tr_selector,                                clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_vmcs_link_pointer,                              guest_vmcs_link_pointer,                          clean_guest_grp1);
+      HVPP_EVMCS_FIELD(guest_debugctl,                                       guest_debugctl,                                   clean_guest_grp1);
+      HVPP_EVMCS_FIELD(guest_pat,                                            guest_pat,                                        clean_guest_grp1);
+      HVPP_EVMCS_FIELD(guest_efer,                                           guest_efer,                                       clean_guest_grp1);
+      HVPP_EVMCS_FIELD(guest_pdpte0,                                         guest_pdpte0,                                     clean_guest_grp1);
+      HVPP_EVMCS_FIELD(guest_pdpte1,                                         guest_pdpte1,                                     clean_guest_grp1);
+      HVPP_EVMCS_FIELD(guest_pdpte2,                                         guest_pdpte2,                                     clean_guest_grp1);
+      HVPP_EVMCS_FIELD(guest_pdpte3,                                         guest_pdpte3,                                     clean_guest_grp1);
+      HVPP_EVMCS_FIELD(guest_es_limit,                                       guest_es_limit,                                   clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_cs_limit,                                       guest_cs_limit,                                   clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_ss_limit,                                       guest_ss_limit,                                   clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_ds_limit,                                       guest_ds_limit,                                   clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_fs_limit,                                       guest_fs_limit,                                   clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_gs_limit,                                       guest_gs_limit,                                   clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_ldtr_limit,                                     guest_ldtr_limit,                                 clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_tr_limit,                                       guest_tr_limit,                                   clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_gdtr_limit,                                     guest_gdtr_limit,                                 clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_idtr_limit,                                     guest_idtr_limit,                                 clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_es_access_rights,                               guest_es_access_rights,                           clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_cs_access_rights,                               guest_cs_access_rights,                           clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_ss_access_rights,                               guest_ss_access_rights,                           clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_ds_access_rights,                               guest_ds_access_rights,                           clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_fs_access_rights,                               guest_fs_access_rights,                           clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_gs_access_rights,                               guest_gs_access_rights,                           clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_ldtr_access_rights,                             guest_ldtr_access_rights,                         clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_tr_access_rights,                               guest_tr_access_rights,                           clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_interruptibility_state,                         guest_interruptibility_state,                     clean_guest_basic);
+      HVPP_EVMCS_FIELD(guest_activity_state,                                 guest_activity_state,                             clean_guest_grp1);
+      HVPP_EVMCS_FIELD(guest_sysenter_cs,                                    guest_sysenter_cs,                                clean_guest_grp1);
+      HVPP_EVMCS_FIELD(guest_cr0,                                            guest_cr0,                                        clean_crdr);
+      HVPP_EVMCS_FIELD(guest_cr3,                                            guest_cr3,                                        clean_crdr);
+      HVPP_EVMCS_FIELD(guest_cr4,                                            guest_cr4,                                        clean_crdr);
+      HVPP_EVMCS_FIELD(guest_es_base,                                        guest_es_base,                                    clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_cs_base,                                        guest_cs_base,                                    clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_ss_base,                                        guest_ss_base,                                    clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_ds_base,                                        guest_ds_base,                                    clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_fs_base,                                        guest_fs_base,                                    clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_gs_base,                                        guest_gs_base,                                    clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_ldtr_base,                                      guest_ldtr_base,                                  clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_tr_base,                                        guest_tr_base,                                    clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_gdtr_base,                                      guest_gdtr_base,                                  clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_idtr_base,                                      guest_idtr_base,                                  clean_guest_grp2);
+      HVPP_EVMCS_FIELD(guest_dr7,                                            guest_dr7,                                        clean_crdr);
+      HVPP_EVMCS_FIELD(guest_rsp,                                            guest_rsp,                                        clean_guest_basic);
+      HVPP_EVMCS_FIELD(guest_rip,                                            guest_rip,                                        clean_none);
+      HVPP_EVMCS_FIELD(guest_rflags,                                         guest_rflags,                                     clean_guest_basic);
+      HVPP_EVMCS_FIELD(guest_pending_debug_exceptions,                       guest_pending_debug_exceptions,                   clean_guest_grp1);
+      HVPP_EVMCS_FIELD(guest_sysenter_esp,                                   guest_sysenter_esp,                               clean_guest_grp1);
+      HVPP_EVMCS_FIELD(guest_sysenter_eip,                                   guest_sysenter_eip,                               clean_guest_grp1);
+
+      HVPP_EVMCS_FIELD(host_es_selector,                                     host_es_selector,                                 clean_host_grp1);
+      HVPP_EVMCS_FIELD(host_cs_selector,                                     host_cs_selector,                                 clean_host_grp1);
+      HVPP_EVMCS_FIELD(host_ss_selector,                                     host_ss_selector,                                 clean_host_grp1);
+      HVPP_EVMCS_FIELD(host_ds_selector,                                     host_ds_selector,                                 clean_host_grp1);
+      HVPP_EVMCS_FIELD(host_fs_selector,                                     host_fs_selector,                                 clean_host_grp1);
+      HVPP_EVMCS_FIELD(host_gs_selector,                                     host_gs_selector,                                 clean_host_grp1);
+      HVPP_EVMCS_FIELD(host_tr_selector,                                     host_tr_selector,                                 clean_host_grp1);
+      HVPP_EVMCS_FIELD(host_pat,                                             host_pat,                                         clean_host_grp1);
+      HVPP_EVMCS_FIELD(host_efer,                                            host_efer,                                        clean_host_grp1);
+      HVPP_EVMCS_FIELD(host_sysenter_cs,                                     host_sysenter_cs,                                 clean_host_grp1);
+      HVPP_EVMCS_FIELD(host_cr0,                                             host_cr0,                                         clean_host_grp1);
+      HVPP_EVMCS_FIELD(host_cr3,                                             host_cr3,                                         clean_host_grp1);
+      HVPP_EVMCS_FIELD(host_cr4,                                             host_cr4,                                         clean_host_grp1);
+      HVPP_EVMCS_FIELD(host_fs_base,                                         host_fs_base,                                     clean_host_pointer);
+      HVPP_EVMCS_FIELD(host_gs_base,                                         host_gs_base,                                     clean_host_pointer);
+      HVPP_EVMCS_FIELD(host_tr_base,                                         host_tr_base,                                     clean_host_pointer);
+      HVPP_EVMCS_FIELD(host_gdtr_base,                                       host_gdtr_base,                                   clean_host_pointer);
+      HVPP_EVMCS_FIELD(host_idtr_base,                                       host_idtr_base,                                   clean_host_pointer);
+      HVPP_EVMCS_FIELD(host_sysenter_esp,                                    host_sysenter_esp,                                clean_host_grp1);
+      HVPP_EVMCS_FIELD(host_sysenter_eip,                                    host_sysenter_eip,                                clean_host_grp1);
+      HVPP_EVMCS_FIELD(host_rsp,                                             host_rsp,                                         clean_host_pointer);
+      HVPP_EVMCS_FIELD(host_rip,                                             host_rip,                                         clean_host_grp1);
+
+      default:
+        return field_t{ 0, 0, clean_none };
+    }
+
+#undef HVPP_EVMCS_FIELD
+  }
+
+  //
+  // Counterparts of vmx::vmread()/vmx::vmwrite() with raw 64-bit values -
+  // the value is zero-extended (truncated) to the width of the field.
+  // Return false if the field isn't present in the enlightened VMCS.
+  //
+  bool read(vmcs_t::field vmcs_field, uint64_t& value) const noexcept
+  {
+    const auto field = field_of(vmcs_field);
+
+    if (!field.offset)
+    {
+      return false;
+    }
+
+    value = 0;
+    memcpy(&value, reinterpret_cast<const uint8_t*>(this) + field.offset, field.size);
+    return true;
+  }
+
+  bool write(vmcs_t::field vmcs_field, uint64_t value) noexcept
+  {
+    const auto field = field_of(vmcs_field);
+
+    if (!field.offset)
+    {
+      return false;
+    }
+
+    memcpy(reinterpret_cast<uint8_t*>(this) + field.offset, &value, field.size);
+    hv_clean_fields &= ~field.clean;
+    return true;
+  }
+
+  //
+  // Remove controls which need fields absent in the enlightened VMCS
+  // (posted interrupts, VMX-preemption timer, APIC virtualization, PLE,
+  // VM functions, VMCS shadowing, PML, #VE and TSC scaling).
+  //
+  static void adjust(capabilities_t& caps) noexcept
+  {
+    msr::vmx_pinbased_ctls_t pinbased_ctls{};
+    pinbased_ctls.activate_vmx_preemption_timer = true;
+    pinbased_ctls.process_posted_interrupts = true;
+
+    msr::vmx_procbased_ctls2_t procbased_ctls2{};
+    procbased_ctls2.virtualize_apic_accesses = true;
+    procbased_ctls2.apic_register_virtualization = true;
+    procbased_ctls2.virtual_interrupt_delivery = true;
+    procbased_ctls2.pause_loop_exiting = true;
+    procbased_ctls2.enable_vm_functions = true;
+    procbased_ctls2.vmcs_shadowing = true;
+    procbased_ctls2.enable_pml = true;
+    procbased_ctls2.ept_violation_ve = true;
+    procbased_ctls2.use_tsc_scaling = true;
+
+    caps.pinbased_ctls.allowed_1_settings   &= ~uint32_t(pinbased_ctls.flags);
+    caps.procbased_ctls2.allowed_1_settings &= ~uint32_t(procbased_ctls2.flags);
+    caps.vmfunc.flags = 0;
+  }
+
+  //
+  // Returns true if the L0 hypervisor is Hyper-V, which recommends
+  // the enlightened VMCS, provides the VP assist page and supports
+  // the version 1 of the enlightened VMCS.
+  //
+  static bool is_supported() noexcept
+  {
+    uint32_t regs[4];
+
+    ia32_asm_cpuid(regs, 1);
+    if (!(regs[2] & (1u << 31)))                      // hypervisor present
+    {
+      return false;
+    }
+
+    //
+    // "Microsoft Hv"
+    //
+    ia32_asm_cpuid(regs, 0x40000000);
+    if (regs[0] < 0x4000000A ||
+        regs[1] != 0x7263694D || regs[2] != 0x666F736F || regs[3] != 0x76482074)
+    {
+      return false;
+    }
+
+    ia32_asm_cpuid(regs, 0x40000003);
+    if (!(regs[0] & (1u << 4)))                       // VP assist page MSR
+    {
+      return false;
+    }
+
+    ia32_asm_cpuid(regs, 0x40000004);
+    if (!(regs[0] & (1u << 14)))                      // eVMCS recommended
+    {
+      return false;
+    }
+
+    ia32_asm_cpuid(regs, 0x4000000A);
+    const auto low_version  = regs[0] & 0xff;
+    const auto high_version = (regs[0] >> 8) & 0xff;
+
+    return low_version <= version && version <= high_version;
+  }
+};
+
+static_assert(sizeof(evmcs_t) == page_size);
+
+//
+// VP assist page - the enlightened VMCS is made current by writing its
+// physical address into "current_nested_vmcs" and setting
+// "enlighten_vmentry".
+//
+
+struct alignas(page_size) vp_assist_page_t
+{
+  static constexpr uint32_t msr_id = 0x40000073;
+
+  uint32_t apic_assist;
+  uint32_t reserved_1;
+  uint64_t vtl_control[3];
+  uint64_t nested_enlightenments_control;
+  uint8_t  enlighten_vmentry;
+  uint8_t  reserved_2[7];
+  uint64_t current_nested_vmcs;
+};
+
+static_assert(offsetof(vp_assist_page_t, enlighten_vmentry)   == 0x28);
+static_assert(offsetof(vp_assist_page_t, current_nested_vmcs) == 0x30);
+static_assert(sizeof(vp_assist_page_t) == page_size);
+
+}
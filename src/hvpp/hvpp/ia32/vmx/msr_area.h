@@ -0,0 +1,33 @@
+#pragma once
+#include "../memory.h"
+
+#include <cstdint>
+
+namespace ia32::vmx {
+
+//
+// VM-entry MSR-load, VM-exit MSR-store and VM-exit MSR-load area.
+// (ref: Vol3C[24.7.2(VM-Exit Controls for MSRs)],
+//       Vol3C[24.8.2(VM-Entry Controls for MSRs)])
+//
+// The processor loads (or stores) MSRs listed in the first "count"
+// entries (set in the VMCS) during VM-entry or VM-exit.
+//
+
+struct alignas(page_size) msr_area_t
+{
+  struct entry_t
+  {
+    uint32_t msr_id;
+    uint32_t reserved;
+    uint64_t value;
+  };
+
+  static constexpr uint16_t count = page_size / sizeof(entry_t);
+
+  entry_t entry[count];
+};
+
+static_assert(sizeof(msr_area_t) == page_size);
+
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "../memory.h"
+
+#include <cstdint>
+
+namespace ia32::vmx {
+
+//
+// Page-modification log.
+// (ref: Vol3C[28.2.6(Page-Modification Logging)])
+//
+// The processor logs guest physical addresses of pages, whose EPT
+// dirty flag is being set, from the "last" entry down to the first one.
+// The guest PML index VMCS field holds index of the next free entry.
+//
+
+struct alignas(page_size) pml_t
+{
+  static constexpr uint16_t count = 512;
+
+  pa_t entry[count];
+};
+
+static_assert(sizeof(pml_t) == page_size);
+
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include "exit_qualification.h"
+#include "../memory.h"
+
+#include <cstdint>
+
+namespace ia32::vmx {
+
+//
+// Virtualization-exception information area.
+// (ref: Vol3C[25.5.6.2(Delivery of Virtualization Exceptions)])
+//
+// The processor delivers #VE only when "busy" is 0 and sets it to
+// 0xFFFFFFFF afterwards.  The guest #VE handler is expected to reset it
+// back to 0 when it's done with the information.
+//
+
+struct alignas(page_size) ve_info_t
+{
+  static constexpr uint32_t busy_value = 0xFFFFFFFF;
+
+  uint32_t                            exit_reason;
+  uint32_t                            busy;
+  exit_qualification_ept_violation_t  qualification;
+  uint64_t                            guest_linear_address;
+  uint64_t                            guest_physical_address;
+  uint16_t                            eptp_index;
+};
+
+static_assert(sizeof(ve_info_t) == page_size);
+
+}
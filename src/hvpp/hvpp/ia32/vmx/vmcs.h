@@ -1,7 +1,9 @@
 #pragma once
 #include "../memory.h"
 
+#include <cstddef>
 #include <cstdint>
+#include <type_traits>
 
 namespace ia32::vmx {
 
@@ -93,6 +95,12 @@ namespace detail
 
 struct alignas(page_size) vmcs_t
 {
+  //
+  // Bit 31 of the revision ID - set in the shadow VMCS.
+  // (ref: Vol3C[24.2(Format of the VMCS Region)])
+  //
+  static constexpr uint32_t shadow_vmcs_indicator = 0x80000000;
+
   uint32_t revision_id;
   uint32_t abort_indicator;
 
@@ -355,4 +363,33 @@ inline vmcs_t::field& operator-=(vmcs_t::field& vmcs_field, int index) noexcept
 
 static_assert(sizeof(vmcs_t) == page_size);
 
+namespace detail
+{
+  //
+  // Size of the VMCS field (in bytes) - 8 for natural-width fields.
+  //
+  static constexpr size_t field_size(vmcs_t::field vmcs_field) noexcept
+  {
+    return static_cast<size_t>(width_to_bits(
+      static_cast<vmcs_width_t>((static_cast<uint32_t>(vmcs_field) >> 13) & 3)));
+  }
+
+  //
+  // Returns true for the "high" access to the 64-bit field.
+  //
+  static constexpr bool field_is_high(vmcs_t::field vmcs_field) noexcept
+  {
+    return (static_cast<uint32_t>(vmcs_field) & 1) != 0;
+  }
+
+  //
+  // Unsigned integer of the width of the VMCS field.
+  //
+  template <vmcs_t::field FIELD>
+  using field_type_t =
+    std::conditional_t<field_size(FIELD) == 2, uint16_t,
+    std::conditional_t<field_size(FIELD) == 4, uint32_t,
+                                               uint64_t>>;
+}
+
 }
@@ -0,0 +1,54 @@
+#pragma once
+#include "vmcs.h"
+#include "../memory.h"
+
+#include <cstdint>
+#include <cstring>
+
+namespace ia32::vmx {
+
+//
+// VMREAD bitmap / VMWRITE bitmap.
+// (ref: Vol3C[24.6.15(VMCS Shadowing Bitmap Addresses)])
+//
+// With VMCS shadowing enabled, VMREAD (VMWRITE) executed by the guest
+// causes VM-exit only if the bit of the field (indexed by bits 14:0 of
+// the field encoding) is set - otherwise it accesses the shadow VMCS
+// referenced by the VMCS link pointer.  Encodings with any of the bits
+// 63:15 set always cause the VM-exit.
+//
+
+struct alignas(page_size) vmcs_bitmap_t
+{
+  uint8_t data[page_size];
+
+  void set_all() noexcept
+  { memset(data, 0xff, sizeof(data)); }
+
+  void clear_all() noexcept
+  { memset(data, 0x00, sizeof(data)); }
+
+  void set(vmcs_t::field field, bool exiting = true) noexcept
+  {
+    const auto index = static_cast<uint32_t>(field) & 0x7fff;
+
+    if (exiting)
+    {
+      data[index / 8] |=  static_cast<uint8_t>(1 << (index % 8));
+    }
+    else
+    {
+      data[index / 8] &= ~static_cast<uint8_t>(1 << (index % 8));
+    }
+  }
+
+  bool test(vmcs_t::field field) const noexcept
+  {
+    const auto index = static_cast<uint32_t>(field) & 0x7fff;
+    return (data[index / 8] & (1 << (index % 8))) != 0;
+  }
+};
+
+static_assert(sizeof(vmcs_bitmap_t) == page_size);
+
+}
@@ -32,6 +32,17 @@ inline void ia32_asm_cpuid_ex(uint32_t result[4], uint32_t eax, uint32_t ecx) no
   __cpuidex((int*)result, (int)eax, (int)ecx);
 }
 
+//
+// Stack pointer (approximate - address within the current stack frame).
+//
+
+void* _AddressOfReturnAddress(void);
+#pragma intrinsic(_AddressOfReturnAddress)
+inline uint64_t ia32_asm_read_rsp() noexcept
+{
+  return (uint64_t)_AddressOfReturnAddress();
+}
+
 //
 // TSC.
 //
@@ -68,6 +79,20 @@ inline void ia32_asm_fx_restore(const void* fxarea) noexcept
   _fxrstor(fxarea);
 }
 
+void _xsaveopt64(void*, unsigned __int64);
+#pragma intrinsic(_xsaveopt64)
+inline void ia32_asm_xsaveopt(void* xsave_area, uint64_t mask) noexcept
+{
+  _xsaveopt64(xsave_area, mask);
+}
+
+void _xrstor64(void const*, unsigned __int64);
+#pragma intrinsic(_xrstor64)
+inline void ia32_asm_xrstor(const void* xsave_area, uint64_t mask) noexcept
+{
+  _xrstor64(xsave_area, mask);
+}
+
 //
 // Pause/halt.
 //
@@ -303,6 +328,13 @@ inline void ia32_asm_write_cr4(uint64_t value) noexcept
   __writecr4(value);
 }
 
+unsigned __int64 __readcr8(void);
+#pragma intrinsic(__readcr8)
+inline uint64_t ia32_asm_read_cr8() noexcept
+{
+  return __readcr8();
+}
+
 //
 // Debug registers.
 //
@@ -482,6 +514,20 @@ inline uint8_t ia32_asm_bts(void* base, uint64_t offset) noexcept
   return _bittestandset64((__int64*)base, offset);
 }
 
+unsigned char _interlockedbittestandset64(__int64 volatile*, __int64);
+#pragma intrinsic(_interlockedbittestandset64)
+inline uint8_t ia32_asm_interlocked_bts(volatile void* base, uint64_t offset) noexcept
+{
+  return _interlockedbittestandset64((volatile __int64*)base, (__int64)offset);
+}
+
+unsigned char _interlockedbittestandreset64(__int64 volatile*, __int64);
+#pragma intrinsic(_interlockedbittestandreset64)
+inline uint8_t ia32_asm_interlocked_btr(volatile void* base, uint64_t offset) noexcept
+{
+  return _interlockedbittestandreset64((volatile __int64*)base, (__int64)offset);
+}
+
 unsigned __int64 __popcnt64(unsigned __int64);
 #pragma intrinsic(__popcnt64)
 inline uint64_t ia32_asm_popcnt(uint64_t value) noexcept
@@ -489,6 +535,13 @@ inline uint64_t ia32_asm_popcnt(uint64_t value) noexcept
   return __popcnt64(value);
 }
 
+unsigned __int64 _umul128(unsigned __int64, unsigned __int64, unsigned __int64*);
+#pragma intrinsic(_umul128)
+inline uint64_t ia32_asm_mul128(uint64_t a, uint64_t b, uint64_t* high) noexcept
+{
+  return _umul128(a, b, high);
+}
+
 //
 // Cache control.
 //
@@ -1,18 +1,35 @@
 #include "../memory.h"
 
+#include "hvpp/lib/mm.h"
+
 #include <ntddk.h>
 
 #define HVPP_MAPPING_TAG 'mpvh'
 
 namespace ia32::detail
 {
+  //
+  // Memory of the hypervisor (e.g. EPT tables) is translated
+  // by the memory manager, without calling the OS.
+  //
+
   uint64_t pa_from_va(const void* va) noexcept
   {
+    if (auto pa = mm::pa_from_va(va))
+    {
+      return pa;
+    }
+
     return MmGetPhysicalAddress((PVOID)(va)).QuadPart;
   }
 
   void* va_from_pa(uint64_t pa) noexcept
   {
+    if (auto va = mm::va_from_pa(pa))
+    {
+      return va;
+    }
+
     PHYSICAL_ADDRESS win_pa;
     win_pa.QuadPart = pa;
 
@@ -0,0 +1,238 @@
+#include "io_policy.h"
+#include "hypervisor.h"
+
+#include "lib/assert.h"
+#include "lib/bitmap.h"
+#include "lib/mp.h"
+
+#include <cstring>
+#include <mutex>
+
+namespace hvpp {
+
+io_policy::io_policy() noexcept
+  : current_{ nullptr }
+  , epoch_{}
+  , update_lock_{}
+  , attached_{}
+{
+
+}
+
+io_policy::~io_policy() noexcept
+{
+  //
+  // The policy must not be referenced by any VCPU anymore.
+  //
+  delete current_.exchange(nullptr);
+}
+
+auto io_policy::update(const range_t* ranges, size_t count) noexcept -> error_code_t
+{
+  if (count > max_range_count)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  //
+  // Compile the policy.
+  //
+  auto compiled = new compiled_t;
+
+  if (!compiled)
+  {
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  memset(compiled, 0, sizeof(*compiled));
+  compiled->rule[0].action = action_t::passthrough;
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    const auto& range = ranges[i];
+
+    if (range.first > range.last)
+    {
+      delete compiled;
+      return make_error_code_t(std::errc::invalid_argument);
+    }
+
+    compiled->rule[i + 1] = rule_t{ range.action, range.callback, range.context };
+
+    for (uint32_t port = range.first; port <= range.last; ++port)
+    {
+      compiled->rule_index[port] = static_cast<uint8_t>(i + 1);
+    }
+  }
+
+  //
+  // Bits of the I/O bitmap A cover ports 0x0000 - 0x7FFF, bits of the
+  // I/O bitmap B cover ports 0x8000 - 0xFFFF.  They're contiguous in
+  // the io_bitmap_t, therefore they can be treated as single bitmap.
+  //
+  bitmap io_bitmap{ compiled->bitmap.data, 0x10000 };
+
+  for (uint32_t port = 0; port < 0x10000; ++port)
+  {
+    if (compiled->rule[compiled->rule_index[port]].action != action_t::passthrough)
+    {
+      io_bitmap.set(port);
+    }
+  }
+
+  compiled_t* previous;
+  const bool started = hypervisor::is_started();
+
+  {
+    //
+    // The lock orders concurrent updates - the policy published last
+    // is also the last one posted to the VCPUs.
+    //
+    std::lock_guard _{ update_lock_ };
+
+    //
+    // Publish the new policy - from now on, dispatch() uses it.
+    //
+    previous = current_.exchange(compiled, std::memory_order_acq_rel);
+
+    //
+    // Switch all VCPUs which reference the I/O bitmaps to the new ones.
+    // Each CPU is forced to VM-exit by CPUID (see hypervisor::ept_invalidate()).
+    //
+    if (started)
+    {
+      for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+      {
+        if (attached_[i])
+        {
+          hypervisor::vcpu(i).io_bitmap_share_post(compiled->bitmap);
+
+          mp::async_call(i, []() {
+            uint32_t cpu_info[4];
+            ia32_asm_cpuid(cpu_info, 0);
+          });
+        }
+      }
+    }
+  }
+
+  //
+  // Wait (without the lock) until the VCPUs have switched to the posted
+  // bitmaps - or to bitmaps of a newer update - and for dispatch() calls
+  // which might still use the old policy.
+  //
+  if (started)
+  {
+    for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+    {
+      while (attached_[i] && hypervisor::vcpu(i).io_bitmap_share_pending())
+      {
+        ia32_asm_pause();
+      }
+    }
+  }
+
+  epoch_.synchronize();
+  delete previous;
+
+  return error_code_t{};
+}
+
+void io_policy::setup(vcpu_t& vp) noexcept
+{
+  auto compiled = current_.load(std::memory_order_acquire);
+  hvpp_assert(compiled != nullptr);
+
+  if (compiled)
+  {
+    vp.io_bitmap_share(compiled->bitmap);
+    attached_[vp.cpu_index()] = true;
+  }
+}
+
+bool io_policy::dispatch(vcpu_t& vp) noexcept
+{
+  const auto port = static_cast<uint16_t>(vp.exit_qualification().io_instruction.port_number);
+
+  epoch_domain::read_guard _{ epoch_ };
+
+  const auto compiled = current_.load(std::memory_order_acquire);
+
+  if (!compiled)
+  {
+    return false;
+  }
+
+  const auto& rule = compiled->rule[compiled->rule_index[port]];
+
+  switch (rule.action)
+  {
+    case action_t::intercept:
+      return rule.callback && rule.callback(vp, port, rule.context);
+
+    case action_t::deny:
+      deny(vp);
+      return true;
+
+    default:
+      //
+      // The VM-exit has been caused by the I/O bitmaps of the previous
+      // policy (the VCPU hasn't switched yet).
+      //
+      return false;
+  }
+}
+
+void io_policy::deny(vcpu_t& vp) noexcept
+{
+  auto exit_qualification = vp.exit_qualification().io_instruction;
+
+  if (exit_qualification.string_instruction)
+  {
+    //
+    // String instructions are skipped without any memory access.
+    // The count is the part of RCX selected by the address size -
+    // 32-bit writes zero the upper half, 16-bit writes keep it (same
+    // as vmexit_passthrough_handler::handle_execute_io_instruction()).
+    //
+    if (exit_qualification.rep_prefixed)
+    {
+      uint32_t address_size;
+
+      if (vp.capabilities().basic.ins_outs_vmexit_information)
+      {
+        address_size = static_cast<uint32_t>(vp.exit_instruction_info().ins_outs.address_size);
+      }
+      else
+      {
+        const auto cs_access = vp.guest_segment_access(context_t::seg_cs);
+
+        address_size = cs_access.long_mode     ? vmx::instruction_info_t::size_64bit
+                     : cs_access.default_big   ? vmx::instruction_info_t::size_32bit
+                     :                           vmx::instruction_info_t::size_16bit;
+      }
+
+      auto& rcx = vp.exit_context().rcx;
+
+      rcx = address_size == vmx::instruction_info_t::size_16bit
+        ? rcx & ~vmx::instruction_info_t::size_to_mask[address_size]
+        : 0;
+    }
+
+    return;
+  }
+
+  if (exit_qualification.access_type == vmx::exit_qualification_io_instruction_t::access_in)
+  {
+    auto& rax = vp.exit_context().rax;
+
+    switch (exit_qualification.size_of_access + 1)
+    {
+      case 1: rax |= 0xff; break;
+      case 2: rax |= 0xffff; break;
+      case 4: rax  = 0xffffffff; break;
+    }
+  }
+}
+
+}
@@ -0,0 +1,148 @@
+#pragma once
+#include "vcpu.h"
+
+#include "ia32/vmx/io_bitmap.h"
+
+#include "lib/epoch.h"
+#include "lib/error.h"
+#include "lib/spinlock.h"
+
+#include <atomic>
+#include <cstdint>
+
+namespace hvpp {
+
+//
+// Declarative I/O interception policy.
+//
+// The policy is a list of port ranges, each mapped to an action.  It's
+// compiled once into the I/O bitmaps (shared by all VCPUs) and into flat
+// table indexed by the port number, so that the I/O VM-exit handler finds
+// the rule of the port with single lookup.  Ports not covered by any range
+// are passed through without VM-exit.
+//
+// Usage:
+//   auto my_handler::initialize() noexcept -> error_code_t
+//   {
+//     return io_policy_.update(ranges, std::size(ranges));
+//   }
+//
+//   void my_handler::attach(vcpu_t& vp) noexcept
+//   {
+//     io_policy_.setup(vp);
+//   }
+//
+//   void my_handler::handle_execute_io_instruction(vcpu_t& vp) noexcept
+//   {
+//     if (!io_policy_.dispatch(vp))
+//     {
+//       base_type::handle_execute_io_instruction(vp);
+//     }
+//   }
+//
+
+class io_policy
+{
+  public:
+    enum class action_t : uint8_t
+    {
+      //
+      // Don't cause VM-exit.
+      //
+      passthrough,
+
+      //
+      // Cause VM-exit and call the callback.  If there isn't any callback
+      // (or it returns false), the I/O instruction is left to the VM-exit
+      // handler (see dispatch()).
+      //
+      intercept,
+
+      //
+      // Cause VM-exit and skip the instruction - reads return all ones,
+      // writes are dropped.
+      //
+      deny,
+    };
+
+    using callback_t = bool(*)(vcpu_t& vp, uint16_t port, void* context) noexcept;
+
+    struct range_t
+    {
+      uint16_t   first;
+      uint16_t   last;               // inclusive
+      action_t   action;
+      callback_t callback;
+      void*      context;
+    };
+
+    //
+    // Maximum number of ranges in single policy.
+    //
+    static constexpr size_t max_range_count = 255;
+
+    io_policy() noexcept;
+    ~io_policy() noexcept;
+
+    io_policy(const io_policy& other) noexcept = delete;
+    io_policy(io_policy&& other) noexcept = delete;
+    io_policy& operator=(const io_policy& other) noexcept = delete;
+    io_policy& operator=(io_policy&& other) noexcept = delete;
+
+    //
+    // Compile "ranges" and make them the current policy.  Later ranges
+    // override earlier ones.
+    //
+    // The switch is atomic for dispatch() on all VCPUs - each VM-exit sees
+    // either the old or the new policy as a whole.  VCPUs switch to the new
+    // I/O bitmaps on their next VM-exit, which is forced - this method
+    // returns after all of them did.  Must be called at PASSIVE_LEVEL.
+    //
+    auto update(const range_t* ranges, size_t count) noexcept -> error_code_t;
+
+    //
+    // Reference the I/O bitmaps of the current policy in the VCPU (called
+    // from vmexit_handler::attach()).  Note that "use_io_bitmaps" control
+    // must be enabled by the caller.
+    //
+    void setup(vcpu_t& vp) noexcept;
+
+    //
+    // Handle the I/O VM-exit according to the policy.  Returns false if
+    // the VM-exit is left to the caller (the port isn't denied and there
+    // is no callback which would handle it).
+    //
+    bool dispatch(vcpu_t& vp) noexcept;
+
+  private:
+    struct rule_t
+    {
+      action_t   action;
+      callback_t callback;
+      void*      context;
+    };
+
+    //
+    // Compiled policy.  Rule 0 is always passthrough.
+    //
+    struct compiled_t
+    {
+      vmx::io_bitmap_t bitmap;
+      uint8_t          rule_index[0x10000];
+      rule_t           rule[max_range_count + 1];
+    };
+
+    void deny(vcpu_t& vp) noexcept;
+
+    std::atomic<compiled_t*> current_;
+    epoch_domain             epoch_;
+    spinlock                 update_lock_;
+
+    //
+    // VCPUs which reference the I/O bitmaps of the policy (see setup()).
+    // Each CPU writes only its own entry.
+    //
+    bool                     attached_[HVPP_MAX_CPU];
+};
+
+}
@@ -0,0 +1,113 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+//
+// Bump-pointer arena.
+//
+// Allocation only moves the offset (no lock, no bookkeeping, nothing
+// to free), reset() releases everything at once.  Memory of the arena
+// is provided by the owner.  Not thread-safe - each arena is meant to
+// be used by single CPU (e.g. per-VCPU scratch memory, see
+// vcpu_t::scratch()).
+//
+// Objects allocated from the arena are never destroyed - the arena is
+// suitable only for trivially destructible (transient) data.
+//
+// Usage:
+//   auto buffer = vp.scratch().allocate(4096);
+//   auto list   = vp.scratch().allocate<uint64_t>(count);
+//
+
+namespace mm
+{
+  class arena
+  {
+    public:
+      static constexpr size_t default_alignment = 16;
+
+      arena() noexcept
+        : buffer_{ nullptr }
+        , capacity_{ 0 }
+        , offset_{ 0 }
+        , peak_{ 0 }
+        , failure_count_{ 0 }
+      { }
+
+      arena(const arena& other) noexcept = delete;
+      arena(arena&& other) noexcept = delete;
+      arena& operator=(const arena& other) noexcept = delete;
+      arena& operator=(arena&& other) noexcept = delete;
+
+      void assign(void* buffer, size_t capacity) noexcept
+      {
+        buffer_   = static_cast<uint8_t*>(buffer);
+        capacity_ = buffer ? capacity : 0;
+        offset_   = 0;
+        peak_     = 0;
+      }
+
+      auto allocate(size_t size, size_t alignment = default_alignment) noexcept -> void*
+      {
+        //
+        // Alignment must be power of 2.
+        //
+        const auto offset = (offset_ + alignment - 1) & ~(alignment - 1);
+
+        if (offset + size > capacity_ || offset + size < offset)
+        {
+          failure_count_ += 1;
+          return nullptr;
+        }
+
+        offset_ = offset + size;
+
+        if (offset_ > peak_)
+        {
+          peak_ = offset_;
+        }
+
+        return buffer_ + offset;
+      }
+
+      template <
+        typename T
+      >
+      auto allocate(size_t count = 1) noexcept -> T*
+      {
+        if (count > capacity_ / sizeof(T))
+        {
+          failure_count_ += 1;
+          return nullptr;
+        }
+
+        return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+      }
+
+      //
+      // Release all allocations.
+      //
+      void reset() noexcept
+      { offset_ = 0; }
+
+      bool contains(const void* address) const noexcept
+      {
+        return static_cast<const uint8_t*>(address) >= buffer_ &&
+               static_cast<const uint8_t*>(address) <  buffer_ + capacity_;
+      }
+
+      auto buffer() const noexcept -> void*         { return buffer_;        }
+      auto capacity() const noexcept -> size_t      { return capacity_;      }
+      auto used() const noexcept -> size_t          { return offset_;        }
+      auto peak() const noexcept -> size_t          { return peak_;          }
+      auto failure_count() const noexcept -> size_t { return failure_count_; }
+
+    private:
+      uint8_t* buffer_;
+      size_t   capacity_;
+      size_t   offset_;
+      size_t   peak_;
+      size_t   failure_count_;
+  };
+}
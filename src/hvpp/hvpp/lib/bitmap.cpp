@@ -137,34 +137,19 @@ int bitmap::find_first_set(int index, int count) const noexcept
     return index & ~7;
   }
 
-  int current_bit = index;
-
-  while (current_bit + count <= size_in_bits_)
-  {
-    static constexpr int max_count = std::numeric_limits<decltype(count)>::max();
-
-    current_bit += get_length_of_clear(current_bit, max_count);
-    int current_length = get_length_of_set(current_bit, count);
-
-    if (current_length >= count)
-    {
-      return current_bit;
-    }
-
-    current_bit += current_length;
-  }
-
-  return -1;
+  return find_run(index, count, 0);
 }
 
 int bitmap::find_first_set() const noexcept
 {
-  for (int i = 0; i * 8 < size_in_bits_; ++i)
+  const int word_count = static_cast<int>(word(size_in_bits_ + bit_count - 1));
+
+  for (int i = 0; i < word_count; ++i)
   {
     if (buffer_[i])
     {
       return std::min(
-        static_cast<int>(i * 8 + ia32_asm_bsf(static_cast<uint64_t>(buffer_[i]))),
+        static_cast<int>(i * bit_count + ia32_asm_bsf(static_cast<uint64_t>(buffer_[i]))),
         size_in_bits_);
     }
   }
@@ -189,24 +174,7 @@ int bitmap::find_first_clear(int index, int count) const noexcept
     return index & ~7;
   }
 
-  int current_bit = index;
-
-  while (current_bit + count < size_in_bits_)
-  {
-    static constexpr int max_count = std::numeric_limits<decltype(count)>::max();
-
-    current_bit += get_length_of_set(current_bit, max_count);
-    int current_length = get_length_of_clear(current_bit, count);
-
-    if (current_length >= count)
-    {
-      return current_bit;
-    }
-
-    current_bit += current_length;
-  }
-
-  return -1;
+  return find_run(index, count, ~word_t(0));
 }
 
 int bitmap::find_first_clear(int count) const noexcept
@@ -216,12 +184,14 @@ int bitmap::find_first_clear(int count) const noexcept
 
 int bitmap::find_first_clear() const noexcept
 {
-  for (int i = 0; i * 8 < size_in_bits_; ++i)
+  const int word_count = static_cast<int>(word(size_in_bits_ + bit_count - 1));
+
+  for (int i = 0; i < word_count; ++i)
   {
     if (buffer_[i] != word_t(~0))
     {
       return std::min(
-        static_cast<int>(i * 8 + ia32_asm_bsf(~static_cast<uint64_t>(buffer_[i]))),
+        static_cast<int>(i * bit_count + ia32_asm_bsf(~static_cast<uint64_t>(buffer_[i]))),
         size_in_bits_);
     }
   }
@@ -344,3 +314,105 @@ int bitmap::get_length_of_clear(int index, int count) const noexcept
 
   return length;
 }
+
+int bitmap::find_run(int index, int count, word_t invert) const noexcept
+{
+  //
+  // Find the first run of "count" set bits (of words XORed with
+  // "invert", i.e. clear bits when "invert" is ~0) starting at or after
+  // "index".  The bitmap is processed a word at a time:
+  //   - the run which continues from the previous word is extended by
+  //     the trailing ones of the word (TZCNT of the inverted word),
+  //   - runs shorter than a word are searched inside of the word by
+  //     shift-and reduction (bit N of the result is set if bits
+  //     N .. N + count - 1 are set) - O(log count) operations,
+  //   - the leading ones of the word (LZCNT) start the next run.
+  // Full and empty words are handled by a single comparison.
+  //
+  // Note that SSE/AVX isn't used - the extended state of the guest
+  // isn't necessarily preserved in VMX-root mode (see HVPP_XSTATE_MODE).
+  //
+
+  const int first_word = static_cast<int>(word(index));
+  const int last_word  = static_cast<int>(word(size_in_bits_ - 1));
+
+  int run_start  = index;
+  int run_length = 0;
+
+  for (int i = first_word; i <= last_word; ++i)
+  {
+    word_t value = buffer_[i] ^ invert;
+
+    //
+    // Ignore bits below "index" and beyond the end of the bitmap.
+    //
+    if (i == first_word)
+    {
+      value &= ~word_t(0) << offset(index);
+    }
+
+    if (i == last_word && offset(size_in_bits_))
+    {
+      value &= mask(size_in_bits_) - 1;
+    }
+
+    const int base = i * static_cast<int>(bit_count);
+
+    if (value == ~word_t(0))
+    {
+      if (run_length == 0)
+      {
+        run_start = base;
+      }
+
+      run_length += static_cast<int>(bit_count);
+
+      if (run_length >= count)
+      {
+        return run_start;
+      }
+
+      continue;
+    }
+
+    //
+    // Continuation of the previous run.
+    //
+    const int trailing = static_cast<int>(ia32_asm_bsf(~value));
+
+    if (run_length && run_length + trailing >= count)
+    {
+      return run_start;
+    }
+
+    //
+    // Run inside of the word.
+    //
+    if (count <= static_cast<int>(bit_count))
+    {
+      word_t run = value;
+
+      for (int length = 1; length < count && run; )
+      {
+        const int shift = std::min(length, count - length);
+        run &= run >> shift;
+        length += shift;
+      }
+
+      if (run)
+      {
+        return base + static_cast<int>(ia32_asm_bsf(run));
+      }
+    }
+
+    //
+    // Start of the next run.
+    //
+    const int leading = static_cast<int>(bit_count) - 1 - static_cast<int>(ia32_asm_bsr(~value));
+
+    run_length = leading;
+    run_start  = base + static_cast<int>(bit_count) - leading;
+  }
+
+  return -1;
+}
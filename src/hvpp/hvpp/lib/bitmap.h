@@ -78,6 +78,7 @@ class bitmap
   private:
     int get_length_of_set(int index, int count) const noexcept;
     int get_length_of_clear(int index, int count) const noexcept;
+    int find_run(int index, int count, word_t invert) const noexcept;
 
     word_t* buffer_;
     int size_in_bits_;
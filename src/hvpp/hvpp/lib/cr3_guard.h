@@ -18,10 +18,27 @@
 // since we don't have control over Windows' internal PFN lock, the return
 // value of this function might be unreliable.
 //
+// If PCID is enabled (CR4.PCIDE), the previous CR3 is restored without
+// invalidation of the TLB (bit 63 of the source operand of MOV to CR3 is
+// set).  The hypervisor touches only the kernel address space, which is
+// the same in all processes - therefore translations cached while the
+// guarded CR3 was loaded can't hurt.  Without PCID, each switch flushes
+// all non-global TLB entries.
+//
 
 namespace detail
 {
   ia32::cr3_t kernel_cr3(ia32::cr3_t cr3) noexcept;
+
+  inline void write_cr3(ia32::cr3_t cr3, bool flush) noexcept
+  {
+    if (!flush && ia32::read<ia32::cr4_t>().pcid_enable)
+    {
+      cr3.pcid_invalidate = true;
+    }
+
+    ia32::write<ia32::cr3_t>(cr3);
+  }
 }
 
 class cr3_guard
@@ -29,10 +46,25 @@ class cr3_guard
   public:
     cr3_guard(ia32::cr3_t new_cr3) noexcept
       : previous_cr3_{ ia32::read<ia32::cr3_t>() }
-    { ia32::write<ia32::cr3_t>(::detail::kernel_cr3(new_cr3)); }
+    { ::detail::write_cr3(::detail::kernel_cr3(new_cr3), true); }
+
+    //
+    // Switch to "new_kernel_cr3", which already is the kernel CR3 (see
+    // ::detail::kernel_cr3()).  If "flush" is false and PCID is enabled,
+    // the TLB entries of its PCID are kept - use only if they belong to
+    // the same address space (see vcpu_t::guest_address_space()).
+    //
+    cr3_guard(ia32::cr3_t new_kernel_cr3, bool flush) noexcept
+      : previous_cr3_{ ia32::read<ia32::cr3_t>() }
+    { ::detail::write_cr3(new_kernel_cr3, flush); }
 
     ~cr3_guard() noexcept
-    { ia32::write<ia32::cr3_t>(previous_cr3_); }
+    { ::detail::write_cr3(previous_cr3_, false); }
+
+    cr3_guard(const cr3_guard& other) noexcept = delete;
+    cr3_guard(cr3_guard&& other) noexcept = delete;
+    cr3_guard& operator=(const cr3_guard& other) noexcept = delete;
+    cr3_guard& operator=(cr3_guard&& other) noexcept = delete;
 
   private:
     ia32::cr3_t previous_cr3_;
@@ -12,7 +12,7 @@
 class device
 {
   public:
-             device() noexcept {}
+             device() noexcept : impl_{ nullptr } {}
     virtual ~device() noexcept { destroy(); }
 
     virtual const char*  name() const noexcept = 0;
@@ -39,6 +39,14 @@ class device
     virtual error_code_t on_close() noexcept
     { return error_code_t{}; }
 
+    //
+    // Called when the last handle to the device in the process
+    // is closed.  Unlike on_close(), this method is called in the
+    // context of that process.
+    //
+    virtual error_code_t on_cleanup() noexcept
+    { return error_code_t{}; }
+
     virtual error_code_t on_read(void* buffer, size_t buffer_size, size_t& bytes_read) noexcept
     { (void)(buffer); (void)(buffer_size); (void)(bytes_read); return error_code_t{}; }
 
@@ -48,6 +56,59 @@ class device
     virtual error_code_t on_ioctl(void* buffer, size_t buffer_size, uint32_t code) noexcept
     { (void)(buffer); (void)(buffer_size); (void)(code); return error_code_t{}; }
 
+    //
+    // Called for IOCTLs with ioctl_method::in_direct/out_direct instead
+    // of on_ioctl().  "buffer" is the (copied) input buffer, "direct_buffer"
+    // is the output buffer of the caller, locked and mapped into the
+    // system address space - it can be read or written without any copy.
+    //
+    virtual error_code_t on_ioctl_direct(void* buffer, size_t buffer_size,
+                                         void* direct_buffer, size_t direct_buffer_size,
+                                         uint32_t code) noexcept
+    {
+      (void)(buffer); (void)(buffer_size);
+      (void)(direct_buffer); (void)(direct_buffer_size);
+      (void)(code);
+      return make_error_code_t(std::errc::not_supported);
+    }
+
+    //
+    // Asynchronous (overlapped) IOCTLs.
+    //
+    // IOCTL for which on_ioctl_queue() returns index of a queue isn't
+    // dispatched right away - the request is kept pending in the queue
+    // and the caller (e.g. with overlapped I/O) can issue other requests
+    // meanwhile.  When the data are ready, the driver completes pending
+    // requests by complete() (or complete_async()) - on_ioctl() is called
+    // for each of them (this time at IRQL <= DISPATCH_LEVEL) to fill the
+    // buffer.  Pending requests are cancelled when the caller cancels
+    // them, closes the device or when the device is destroyed.
+    //
+    static constexpr int max_queue_count = 4;
+
+    virtual int on_ioctl_queue(uint32_t code) noexcept
+    { (void)(code); return -1; }
+
+    //
+    // Complete up to "count" pending requests of the queue.  Returns
+    // number of completed requests.  Must be called at IRQL <= DISPATCH_LEVEL.
+    //
+    auto complete(int queue_index, size_t count = size_t(-1)) noexcept -> size_t;
+
+    //
+    // Complete all pending requests of the queue from a DPC.  Can be
+    // called at any IRQL (but not in the VMX-root mode).
+    //
+    void complete_async(int queue_index) noexcept;
+
+    auto pending_count(int queue_index) const noexcept -> size_t;
+
+    //
+    // Called by the driver dispatch routine.
+    //
+    bool enqueue(int queue_index, void* request) noexcept;
+    void cancel(void* file_object) noexcept;
+
     static error_code_t copy_from_user(void* buffer_to, const void* buffer_from, size_t length) noexcept;
     static error_code_t copy_to_user(void* buffer_to, const void* buffer_from, size_t length) noexcept;
 
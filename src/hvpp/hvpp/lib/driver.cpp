@@ -1,20 +1,163 @@
+#define HVPP_LOG_MODULE driver
+
 #include "driver.h"
 
+#include "hvpp/config.h"
+#include "hvpp/ept.h"
+#include "hvpp/vcpu.h"
+#include "hvpp/ia32/cpuid/cpuid_eax_01.h"
+
 #include "assert.h"
 #include "mm.h"
 #include "mp.h"
 #include "log.h"
+#include "work_queue.h"
 
+#include <algorithm>
 #include <cinttypes>
 
 namespace driver::common
 {
   void*  system_memory_ = nullptr;
   size_t system_memory_size_ = 0;
+  bool   system_memory_contiguous_ = false;
 
   driver_initialize_fn driver_initialize_;
   driver_destroy_fn    driver_destroy_;
 
+  static
+  auto
+  required_memory_size(
+    void
+    ) noexcept -> size_t
+  {
+    //
+    // Estimate size of the memory pool from the size of the physical
+    // memory and the EPT layout used by VCPUs (see HVPP_EPT_MODE).
+    //
+
+    //
+    // Find the highest physical address which has to be mapped by EPT.
+    //
+    uint64_t highest_pa = 0;
+    for (auto& range : mm::physical_memory_descriptor())
+    {
+      highest_pa = std::max(highest_pa, range.end().value());
+    }
+
+    //
+    // Number of page directories (each one maps 1GB) needed to map
+    // the physical memory.
+    //
+    const auto pd_count = ia32::bytes_to_pages(highest_pa, ia32::pdpt_t{});
+
+    //
+    // EPT tables are allocated in chunks of 64 pages (see ept_t::reserve()),
+    // the ept_t object itself holds the PML4 and the bookkeeping.
+    //
+    const auto ept_size = [](uint64_t table_count) noexcept -> uint64_t {
+      return ia32::round_to_pages(sizeof(hvpp::ept_t)) +
+             (table_count + 63) / 64 * 64 * ia32::page_size;
+    };
+
+    //
+    // Number of EPT tables each VCPU allocates from the pool.
+    //
+    uint64_t table_count =
+#if   HVPP_EPT_MODE == HVPP_EPT_MODE_SHARED
+      //
+      // Private copies of the PDPT and page directories modified
+      // by this VCPU.
+      //
+      1 + 4
+#elif HVPP_EPT_MODE == HVPP_EPT_MODE_2MB || HVPP_EPT_MODE == HVPP_EPT_MODE_LAZY
+      //
+      // PDPT + all PDs (lazy EPT might eventually populate all of them).
+      //
+      1 + pd_count
+#elif HVPP_EPT_MODE == HVPP_EPT_MODE_1GB
+      //
+      // Private copies of the PDPT and page directories modified
+      // by this VCPU (1GB pages split by hooks are covered below).
+      //
+      1 + 4
+#else
+# error Unknown HVPP_EPT_MODE
+#endif
+      ;
+
+    //
+    // Make space for page-tables of 2MB pages split by VM-exit handlers.
+    //
+    table_count += 64;
+
+    //
+    // Pool memory of each VCPU, besides its EPT (vcpu_t itself and its
+    // stack are allocated outside of the pool, see hypervisor::start()):
+    // timing and profile of VM-exits, the guest memory window, eVMCS and
+    // VP assist page and the XSAVE area (up to AVX-512 and AMX state).
+    //
+    const auto vcpu_size =
+      ia32::round_to_pages(sizeof(hvpp::vcpu_exit_timing_t)) +
+      ia32::round_to_pages(sizeof(hvpp::vcpu_exit_profile_t)) +
+      ia32::round_to_pages(sizeof(ia32::mapping_t)) +
+      2 * ia32::page_size +
+      4 * ia32::page_size;
+
+    //
+    // Dirty page bitmap of each CPU (see hypervisor::dirty_tracking_enable()),
+    // one bit per 4kb page.
+    //
+    const auto dirty_bitmap_size = ia32::round_to_pages((highest_pa / ia32::page_size + 63) / 64 * 8);
+
+    auto size =
+      (ept_size(table_count) + vcpu_size + dirty_bitmap_size + HVPP_HANDLER_MEMORY_PER_CPU) * mp::cpu_count();
+
+    //
+    // Memory shared by all CPUs:
+    //   - the shared identity map (see hypervisor::shared_ept()) -
+    //     1 PDPT + 512 PDs covering 512GB with 2MB pages (see
+    //     ept_t::map_identity()), or 1 PDPT + PDs and PTs of the
+    //     few 1GB/2MB ranges with non-uniform memory type with 1GB
+    //     pages (see ept_t::map_identity_1gb())
+    //   - the dirty bitmap of snapshots (see lib/snapshot.cpp)
+    //   - host page tables - PML4, PDPT, PDs of the direct map and
+    //     a few PTs around MTRR boundaries (see host_page_table)
+    //
+#if HVPP_EPT_MODE == HVPP_EPT_MODE_1GB
+    //
+    // VMX capability MSRs exist only if the CPU supports VMX (if it
+    // doesn't, the hypervisor won't start anyway).
+    //
+    const auto ept_1gb_pages = []() noexcept {
+      ia32::cpuid_eax_01 cpuid_info;
+      ia32_asm_cpuid(cpuid_info.cpu_info, 1);
+
+      return cpuid_info.feature_information_ecx.virtual_machine_extensions &&
+             ia32::vmx::capabilities_t::read().ept_vpid_cap.pdpte_1gb_pages;
+    };
+
+    size += ept_1gb_pages()
+      ? ept_size(1 + 8 + 32)
+      : ept_size(1 + 512);
+#else
+    size += ept_size(1 + 512);
+#endif
+    size += dirty_bitmap_size;
+#ifdef HVPP_HOST_PAGE_TABLES
+    size += (2 + pd_count + 16) * ia32::page_size;
+#endif
+
+    //
+    // Bookkeeping of the memory manager takes ~3 bytes per page (see
+    // mm::assign()) - reserve 1/16 (~6%) more to cover it together with
+    // the slack of slabs and page runs.
+    //
+    size += size / 16;
+
+    return size_t(size);
+  }
+
   auto
   initialize(
     driver_initialize_fn driver_initialize,
@@ -53,33 +196,11 @@ namespace driver::common
     mm::physical_memory_descriptor().dump();
 
     //
-    // Estimate required memory size.
-    // If hypervisor begins to run out of memory, required_memory_size
-    // is the right variable to adjust.
-    //
-    // Default required memory size is 34MB per CPU.
+    // Estimate required memory size and round it up to 2MB boundary
+    // (see below).  If hypervisor begins to run out of memory, see
+    // HVPP_EPT_MODE and HVPP_HANDLER_MEMORY_PER_CPU in config.h.
     //
-    auto required_memory_size = (
-      //
-      // Estimated EPT size:
-      // Make space for 2MB EPT entries for 512 GB of the physical
-      // memory.  Each EPT entry has 8 bytes.
-      // 512GB / 2MB * 8 = 256kb * 8 = 2MB per CPU.
-      //
-      ((512ull * 1024 * 1024 * 1024) / (2ull * 1024 * 1024) * 8)
-
-      +
-
-      //
-      // Additional 32MB per CPU.
-      //
-      (32ull * 1024 * 1024)
-      ) * mp::cpu_count();
-
-    //
-    // Round up to page boundary.
-    //
-    system_memory_size_ = ia32::round_to_pages(required_memory_size);
+    system_memory_size_ = ia32::round_to_pages(required_memory_size(), ia32::pd_t{});
 
     hvpp_info("Number of processors: %u", mp::cpu_count());
     hvpp_info("Reserved memory:      %" PRIu64 " MB",
@@ -87,18 +208,52 @@ namespace driver::common
 
     //
     // Allocate memory.
+    // Prefer physically contiguous memory - the memory manager then
+    // translates physical addresses of the pool (e.g. during EPT walks)
+    // by a fixed offset (see mm::va_from_pa()).  The contiguous pool
+    // also starts at 2MB physical boundary, so that the whole pool
+    // consists of naturally aligned 2MB chunks, which can be mapped
+    // by large pages (the OS mapping, as well as the direct map of the
+    // host page tables).  At most 2MB - 4kb is wasted by the alignment.
     //
-    system_memory_ = mm::system_allocate(required_memory_size);
+    auto pool_address = static_cast<uint8_t*>(nullptr);
+
+    system_memory_ = mm::system_allocate_node(system_memory_size_ + ia32::pd_t::size - ia32::page_size,
+                                              mp::cpu_node(mp::cpu_index()));
+    system_memory_contiguous_ = system_memory_ != nullptr;
+
+    if (system_memory_)
+    {
+      const auto pa = ia32::pa_t::from_va(system_memory_).value();
+
+      pool_address = static_cast<uint8_t*>(system_memory_) + (ia32::page_align_up(pa, ia32::pd_t{}) - pa);
+    }
+    else
+    {
+      system_memory_ = mm::system_allocate(system_memory_size_);
+      pool_address = static_cast<uint8_t*>(system_memory_);
+    }
 
     if (!system_memory_)
     {
       return make_error_code_t(std::errc::not_enough_memory);
     }
 
+    hvpp_info("Memory pool:          %s",
+              system_memory_contiguous_ ? "contiguous, 2MB-aligned" : "non-contiguous");
+
     //
     // Assign allocated memory to the memory manager.
     //
-    if (auto err = mm::assign(system_memory_, system_memory_size_))
+    if (auto err = mm::assign(pool_address, system_memory_size_))
+    {
+      return err;
+    }
+
+    //
+    // Start the worker of the work deferred from the VMX-root mode.
+    //
+    if (auto err = work_queue::initialize())
     {
       return err;
     }
@@ -120,8 +275,10 @@ namespace driver::common
     }
 
     //
-    // Destroy memory manager and logger.
+    // Stop the worker (after the hypervisor has been stopped, so that
+    // nothing is posted anymore), destroy memory manager and logger.
     //
+    work_queue::destroy();
     mm::destroy();
     logger::destroy();
 
@@ -130,7 +287,9 @@ namespace driver::common
     //
     if (system_memory_)
     {
-      mm::system_free(system_memory_);
+      system_memory_contiguous_
+        ? mm::system_free_node(system_memory_)
+        : mm::system_free(system_memory_);
     }
   }
 }
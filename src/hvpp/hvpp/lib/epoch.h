@@ -0,0 +1,134 @@
+#pragma once
+#include "mp.h"
+
+#include "hvpp/config.h"
+#include "hvpp/ia32/asm.h"
+
+#include <atomic>
+#include <cstdint>
+
+//
+// Epoch-based reclamation (RCU-like).
+//
+// Readers (e.g. VM-exit handlers) access shared data through an atomic
+// pointer inside the read-side section - without taking any lock and
+// without writing to any shared cache line.  The writer publishes new
+// version of the data by exchanging the pointer and then calls
+// synchronize(), which waits until every CPU which might still see
+// the old version leaves its read-side section.  After that, the old
+// version can be freed.
+//
+// Usage:
+//   epoch_domain   domain;
+//   std::atomic<policy_t*> policy;
+//
+//   // Reader:
+//   {
+//     epoch_domain::read_guard _(domain);
+//     auto current_policy = policy.load(std::memory_order_acquire);
+//     ...
+//   }
+//
+//   // Writer:
+//   auto old_policy = policy.exchange(new_policy);
+//   domain.synchronize();
+//   delete old_policy;
+//
+// Read-side sections must be short and must not migrate between CPUs
+// (which is always true in VMX-root mode and at IRQL >= DISPATCH_LEVEL).
+// synchronize() must not be called inside of a read-side section.
+//
+
+class epoch_domain
+{
+  public:
+    class read_guard
+    {
+      public:
+        explicit read_guard(epoch_domain& domain) noexcept
+          : domain_{ domain }
+        { domain_.read_lock(); }
+
+        ~read_guard() noexcept
+        { domain_.read_unlock(); }
+
+        read_guard(const read_guard& other) noexcept = delete;
+        read_guard(read_guard&& other) noexcept = delete;
+        read_guard& operator=(const read_guard& other) noexcept = delete;
+        read_guard& operator=(read_guard&& other) noexcept = delete;
+
+      private:
+        epoch_domain& domain_;
+    };
+
+    void read_lock() noexcept
+    {
+      auto& slot = slot_[mp::cpu_index()];
+
+      //
+      // Nested sections keep the epoch of the outermost one.
+      //
+      if (slot.nesting++ == 0)
+      {
+        slot.epoch.store(epoch_.load(std::memory_order_relaxed), std::memory_order_seq_cst);
+      }
+    }
+
+    void read_unlock() noexcept
+    {
+      auto& slot = slot_[mp::cpu_index()];
+
+      if (--slot.nesting == 0)
+      {
+        slot.epoch.store(quiescent, std::memory_order_release);
+      }
+    }
+
+    void synchronize() noexcept
+    {
+      //
+      // Start new epoch.  Readers which entered their section before
+      // this point might still hold the old data - wait for them.
+      // Readers which enter after this point see the new data.
+      //
+      const auto epoch = epoch_.fetch_add(1, std::memory_order_seq_cst) + 1;
+
+      for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+      {
+        for (;;)
+        {
+          const auto cpu_epoch = slot_[i].epoch.load(std::memory_order_acquire);
+
+          if (cpu_epoch == quiescent || cpu_epoch >= epoch)
+          {
+            break;
+          }
+
+          ia32_asm_pause();
+        }
+      }
+    }
+
+    //
+    // Publish new value and free the old one once no reader can see it.
+    //
+    template <typename T>
+    void replace(std::atomic<T*>& pointer, T* value) noexcept
+    {
+      auto old_value = pointer.exchange(value, std::memory_order_acq_rel);
+      synchronize();
+      delete old_value;
+    }
+
+  private:
+    static constexpr uint64_t quiescent = 0;
+
+    struct alignas(64) slot_t
+    {
+      std::atomic_uint64_t epoch;
+      uint32_t             nesting;
+    };
+
+    std::atomic_uint64_t epoch_ = 1;
+    slot_t               slot_[HVPP_MAX_CPU] = {};
+};
@@ -0,0 +1,247 @@
+#include "event_channel.h"
+
+#include "assert.h"
+#include "mm.h"
+#include "mp.h"
+
+#include "hvpp/ia32/asm.h"
+#include "hvpp/ia32/paging.h"
+
+#include <atomic>
+#include <cstring>
+
+namespace event_channel
+{
+  ring_t*  ring_      = nullptr;
+  size_t   ring_size_ = 0;
+  bool     active_    = false;
+
+  auto initialize() noexcept -> error_code_t
+  {
+    hvpp_assert(ring_ == nullptr);
+
+    ring_size_ = ia32::round_to_pages(ring_t::size(mp::cpu_count()));
+    ring_ = reinterpret_cast<ring_t*>(mm::system_allocate(ring_size_));
+
+    if (!ring_)
+    {
+      ring_size_ = 0;
+      return make_error_code_t(std::errc::not_enough_memory);
+    }
+
+    memset(ring_, 0, ring_size_);
+
+    ring_->signature = ring_t::ring_signature;
+    ring_->cpu_count = mp::cpu_count();
+
+    if (auto err = detail::initialize())
+    {
+      destroy();
+      return err;
+    }
+
+    return error_code_t{};
+  }
+
+  void destroy() noexcept
+  {
+    if (!ring_)
+    {
+      return;
+    }
+
+    notify_disable();
+    detail::destroy();
+
+    mm::system_free(ring_);
+    ring_ = nullptr;
+    ring_size_ = 0;
+  }
+
+  auto ring() noexcept -> ring_t*
+  {
+    return ring_;
+  }
+
+  auto ring_size() noexcept -> size_t
+  {
+    return ring_size_;
+  }
+
+  auto notify_enable(uint64_t event_handle) noexcept -> error_code_t
+  {
+    if (!ring_)
+    {
+      return make_error_code_t(std::errc::not_supported);
+    }
+
+    if (active_)
+    {
+      return make_error_code_t(std::errc::device_or_resource_busy);
+    }
+
+    //
+    // Start with empty rings.
+    //
+    for (uint32_t cpu_index = 0; cpu_index < ring_->cpu_count; ++cpu_index)
+    {
+      auto& cpu_ring = ring_->cpu[cpu_index];
+      cpu_ring.tail = cpu_ring.head;
+      cpu_ring.dropped = 0;
+      cpu_ring.pending = 0;
+    }
+
+    ring_->waiting = 0;
+
+    if (auto err = detail::notify_enable(event_handle))
+    {
+      return err;
+    }
+
+    active_ = true;
+    return error_code_t{};
+  }
+
+  void notify_disable() noexcept
+  {
+    if (!active_)
+    {
+      return;
+    }
+
+    active_ = false;
+    detail::notify_disable();
+  }
+
+  void notify_callback(void (*callback)(void*), void* context) noexcept
+  {
+    detail::notify_callback(callback, context);
+  }
+
+  auto unread_count() noexcept -> uint64_t
+  {
+    if (!ring_)
+    {
+      return 0;
+    }
+
+    uint64_t result = 0;
+
+    for (uint32_t cpu_index = 0; cpu_index < ring_->cpu_count; ++cpu_index)
+    {
+      const auto& cpu_ring = ring_->cpu[cpu_index];
+
+      //
+      // The tail is controlled by the user-mode (see post()).
+      //
+      const uint64_t unread = cpu_ring.head - cpu_ring.tail;
+      result += unread < cpu_ring_t::record_count
+        ? unread
+        : cpu_ring_t::record_count;
+    }
+
+    return result;
+  }
+
+  bool post(event_type type,
+            uint64_t data0 /* = 0 */, uint64_t data1 /* = 0 */, uint64_t data2 /* = 0 */,
+            uint64_t data3 /* = 0 */, uint64_t data4 /* = 0 */, uint64_t data5 /* = 0 */) noexcept
+  {
+    if (!active_)
+    {
+      return false;
+    }
+
+    auto& cpu_ring = ring_->cpu[mp::cpu_index()];
+
+    //
+    // The tail is controlled by the user-mode - never trust it
+    // to be anything else than a hint.
+    //
+    const auto head = cpu_ring.head;
+    const auto tail = cpu_ring.tail;
+
+    if (head - tail >= cpu_ring_t::record_count)
+    {
+      cpu_ring.dropped = cpu_ring.dropped + 1;
+      return false;
+    }
+
+    auto& record = cpu_ring.record[head % cpu_ring_t::record_count];
+    record.timestamp = ia32_asm_read_tsc();
+    record.type      = type;
+    record.part      = 0;
+    record.data[0]   = data0;
+    record.data[1]   = data1;
+    record.data[2]   = data2;
+    record.data[3]   = data3;
+    record.data[4]   = data4;
+    record.data[5]   = data5;
+
+    //
+    // Make the record visible before the head.
+    //
+    std::atomic_thread_fence(std::memory_order_release);
+    cpu_ring.head = head + 1;
+    cpu_ring.pending = 1;
+
+    return true;
+  }
+
+  bool post_multi(event_type type, const void* data, size_t size) noexcept
+  {
+    if (!active_)
+    {
+      return false;
+    }
+
+    static constexpr size_t part_size = sizeof(event_record_t::data);
+
+    const auto count = (size + part_size - 1) / part_size;
+
+    auto& cpu_ring = ring_->cpu[mp::cpu_index()];
+
+    //
+    // See post().
+    //
+    const auto head = cpu_ring.head;
+    const auto tail = cpu_ring.tail;
+
+    if (count > cpu_ring_t::record_count ||
+        head - tail > cpu_ring_t::record_count - count)
+    {
+      cpu_ring.dropped = cpu_ring.dropped + 1;
+      return false;
+    }
+
+    const auto timestamp = ia32_asm_read_tsc();
+    auto bytes = static_cast<const uint8_t*>(data);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+      const auto part_bytes = i + 1 < count ? part_size : size - i * part_size;
+
+      auto& record = cpu_ring.record[(head + i) % cpu_ring_t::record_count];
+      record.timestamp = timestamp;
+      record.type      = type;
+      record.part      = static_cast<uint32_t>(i);
+
+      memset(record.data, 0, sizeof(record.data));
+      memcpy(record.data, bytes + i * part_size, part_bytes);
+    }
+
+    //
+    // Make all records visible before the head.
+    //
+    std::atomic_thread_fence(std::memory_order_release);
+    cpu_ring.head = head + count;
+    cpu_ring.pending = 1;
+
+    return true;
+  }
+
+  bool is_active() noexcept
+  {
+    return active_;
+  }
+}
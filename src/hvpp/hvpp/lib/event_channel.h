@@ -0,0 +1,79 @@
+#pragma once
+#include "event_ring.h"
+#include "error.h"
+
+#include <cstdint>
+
+//
+// Channel of events delivered from the hypervisor to the user-mode
+// without any IOCTL per event.
+//
+// The channel (see event_ring.h) is allocated from the non-paged pool,
+// so that it can be mapped into the consumer process by mm::user_map().
+// Events are written by post() - which is wait-free and can be called
+// from the VMX-root mode.  The consumer is notified via an event object
+// it provides (see notify_enable()).
+//
+
+namespace event_channel
+{
+  namespace detail
+  {
+    auto initialize() noexcept -> error_code_t;
+    void destroy() noexcept;
+
+    auto notify_enable(uint64_t event_handle) noexcept -> error_code_t;
+    void notify_disable() noexcept;
+
+    void notify_callback(void (*callback)(void*), void* context) noexcept;
+  }
+
+  auto initialize() noexcept -> error_code_t;
+  void destroy() noexcept;
+
+  auto ring() noexcept -> ring_t*;
+  auto ring_size() noexcept -> size_t;
+
+  //
+  // Reference the user-mode event (handle valid in the current process),
+  // which is signaled when new events arrive while the consumer waits.
+  //
+  auto notify_enable(uint64_t event_handle) noexcept -> error_code_t;
+  void notify_disable() noexcept;
+
+  //
+  // Register the routine called (at DISPATCH_LEVEL) while the rings
+  // contain unread events - e.g. to complete pending IOCTLs of the
+  // consumer (see device::complete_async()).  Unlike the event, the
+  // callback doesn't depend on the "waiting" flag.  Passing nullptr
+  // unregisters the callback.
+  //
+  void notify_callback(void (*callback)(void*), void* context) noexcept;
+
+  //
+  // Returns number of events which haven't been consumed yet.
+  //
+  auto unread_count() noexcept -> uint64_t;
+
+  //
+  // Returns true if the event has been written, false if the channel
+  // isn't initialized or the ring of the current CPU is full.
+  //
+  bool post(event_type type,
+            uint64_t data0 = 0, uint64_t data1 = 0, uint64_t data2 = 0,
+            uint64_t data3 = 0, uint64_t data4 = 0, uint64_t data5 = 0) noexcept;
+
+  //
+  // Post "size" bytes of the "data" as consecutive records of the same
+  // type ("part" of each record is its index) - either all of them are
+  // written, or none.  Returns false if the channel isn't initialized
+  // or the ring of the current CPU doesn't have enough space.
+  //
+  bool post_multi(event_type type, const void* data, size_t size) noexcept;
+
+  //
+  // Returns true if the consumer is attached (i.e. events are worth
+  // producing).
+  //
+  bool is_active() noexcept;
+}
@@ -0,0 +1,112 @@
+#pragma once
+#include <cstdint>
+
+//
+// Layout of the shared-memory event channel (see event_channel.h).
+//
+// This header is shared with the user-mode (hvppctrl), therefore
+// it shouldn't depend on anything else.
+//
+// The channel consists of a header followed by "cpu_count" per-CPU
+// rings.  Each per-CPU ring is single-producer (the VCPU of that CPU,
+// in VMX-root mode) and single-consumer (the user-mode process which
+// mapped the channel):
+//   - producer writes the record at (head % record_count) and then
+//     increments the head
+//   - consumer reads the record at (tail % record_count) and then
+//     increments the tail
+//   - when the ring is full (head - tail == record_count), the producer
+//     drops the event and increments "dropped"
+//
+// Consumer which has nothing to read sets "waiting" to 1, checks all
+// rings once more and then waits for the notification event.  The
+// driver signals the event shortly after any event has been written
+// while "waiting" is set (and resets "waiting" back to 0).
+//
+
+namespace event_channel {
+
+enum class event_type : uint32_t
+{
+  none,
+
+  //
+  // data[0] - exit reason
+  // data[1] - exit qualification
+  // data[2] - guest RIP
+  //
+  vmexit_trace,
+
+  //
+  // data[0] - guest physical address
+  // data[1] - guest linear address
+  // data[2] - exit qualification
+  // data[3] - guest RIP
+  //
+  ept_violation,
+
+  //
+  // data[0] - guest RIP
+  // data[1] - guest CR3
+  // data[2] - guest CPL
+  //
+  sample,
+
+  //
+  // data[0] - exit reason
+  // data[1] - new level (see vmexit_governor_handler::level_t)
+  // data[2] - VM-exits in the current window
+  // data[3] - budget
+  //
+  governor,
+
+  //
+  // exit_record::record_t split into exit_record::part_count records
+  // (see exit_record.h), "part" is the index of the record.
+  //
+  exit_record,
+};
+
+struct event_record_t
+{
+  static constexpr uint32_t data_count = 6;
+
+  uint64_t    timestamp;        // TSC at the time of writing
+  event_type  type;
+  uint32_t    part;             // see event_channel::post_multi()
+  uint64_t    data[data_count];
+};
+
+struct cpu_ring_t
+{
+  static constexpr uint32_t record_count = 512;
+
+  volatile uint64_t head;       // written by the producer
+  volatile uint64_t dropped;    // written by the producer
+  volatile uint32_t pending;    // set by the producer, cleared by the driver
+  uint32_t          reserved1;
+  uint64_t          reserved2[5];
+
+  volatile uint64_t tail;       // written by the consumer
+  uint64_t          reserved3[7];
+
+  event_record_t    record[record_count];
+};
+
+struct ring_t
+{
+  static constexpr uint32_t ring_signature = 'revh';
+
+  uint32_t          signature;
+  uint32_t          cpu_count;
+  volatile uint32_t waiting;    // set by the consumer, cleared by the driver
+  uint32_t          reserved1;
+  uint64_t          reserved2[6];
+
+  cpu_ring_t        cpu[1];     // [cpu_count]
+
+  static constexpr size_t size(uint32_t count) noexcept
+  { return sizeof(ring_t) + (count - 1) * sizeof(cpu_ring_t); }
+};
+
+}
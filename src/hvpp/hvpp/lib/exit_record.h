@@ -0,0 +1,100 @@
+#pragma once
+#include <cstdint>
+
+//
+// Recorded VM-exits (see vmexit_recorder_handler) and the layout of the
+// replay file written by "hvppctrl record" (and replayed by hvppbench).
+//
+// This header is shared with the user-mode (hvppctrl, hvppbench),
+// therefore it shouldn't depend on anything else.
+//
+// Each VM-exit is delivered through the event channel (see event_ring.h)
+// as "part_count" consecutive records of event_type::exit_record, the
+// record_t is split into their "data" (see event_channel::post_multi()).
+//
+// The replay file consists of:
+//   - file_header_t
+//   - record_t[record_count]         (at record_offset)
+//   - index_entry_t[index_count]     (at index_offset)
+//
+// Records are in the order in which they were drained from the per-CPU
+// rings - they're ordered per CPU, but not necessarily across CPUs.
+// The index has one entry for every index_interval-th record, so that
+// the replay can seek into the time range it's interested in without
+// reading whole file.  All offsets are in bytes from the beginning of
+// the file.
+//
+
+namespace exit_record {
+
+struct record_t
+{
+  uint64_t timestamp;                 // TSC at the time of the VM-exit
+  uint32_t cpu_index;
+  uint32_t exit_reason;
+  uint64_t exit_qualification;
+  uint64_t guest_linear_address;
+  uint64_t guest_physical_address;
+  uint32_t instruction_length;
+  uint32_t instruction_info;
+  uint32_t interruption_info;
+  uint32_t interruption_error_code;
+  uint32_t idt_vectoring_info;
+  uint32_t idt_vectoring_error_code;
+  uint64_t guest_rip;
+  uint64_t guest_rflags;
+  uint64_t guest_cr0;
+  uint64_t guest_cr3;
+  uint64_t guest_cr4;
+  uint64_t reserved;
+  uint64_t gp_register[16];           // context_t::reg_rax .. reg_r15 (RSP included)
+};
+
+//
+// Number of event records needed for one record_t.
+//
+constexpr uint32_t part_size  = 6 * sizeof(uint64_t); // event_record_t::data
+constexpr uint32_t part_count = (sizeof(record_t) + part_size - 1) / part_size;
+
+static_assert(sizeof(record_t) == part_count * part_size);
+
+struct index_entry_t
+{
+  uint64_t timestamp;                 // timestamp of the record
+  uint64_t record_index;
+};
+
+struct file_header_t
+{
+  static constexpr uint32_t file_signature    = 'rxvh';
+  static constexpr uint32_t file_version      = 1;
+  static constexpr uint32_t index_interval    = 4096;
+  static constexpr uint32_t exit_reason_count = 65;
+
+  uint32_t signature;
+  uint32_t version;
+  uint32_t record_size;               // sizeof(record_t)
+  uint32_t cpu_count;
+
+  uint64_t record_offset;
+  uint64_t record_count;
+  uint64_t index_offset;
+  uint64_t index_count;
+
+  //
+  // Records dropped while recording (the rings were full).
+  //
+  uint64_t dropped_count;
+
+  uint64_t first_timestamp;
+  uint64_t last_timestamp;
+  uint64_t reserved;
+
+  //
+  // Number of records per exit reason - the mix of the recorded
+  // workload, without reading the records.
+  //
+  uint64_t exit_reason_record_count[exit_reason_count];
+};
+
+}
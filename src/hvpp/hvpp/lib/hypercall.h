@@ -0,0 +1,178 @@
+#pragma once
+#include <cstdint>
+
+//
+// Layout of the batched hypercall request buffer.
+//
+// This header is shared with the user-mode (hvppctrl), therefore
+// it shouldn't depend on anything else.
+//
+// Instead of one operation per VMCALL (passed in RCX/RDX/R8), the guest
+// fills a request buffer with many operations and executes single
+// VMCALL:
+//   RCX = hypercall::batch_id
+//   RDX = virtual address of the request buffer
+//   R8  = size of the request buffer (in bytes)
+//
+// The buffer consists of a header followed by "operation_count"
+// operations.  The header is validated once - if the signature, the
+// operation count or the size doesn't match, the whole batch is
+// rejected.  Otherwise the operations are processed in order and the
+// status (and the result) of each operation is written back into the
+// buffer.  RAX receives the number of processed operations (or ~0 if the
+// batch has been rejected).
+//
+// Operations which change the EPT or hooks (map, protect, hook, unhook)
+// are privileged - they fail with status_code::access_denied unless the
+// batch has been issued at CPL 0.  The host page of map must be a RAM
+// page.
+//
+// EPT changes (map, protect) of the whole batch are followed by single
+// INVEPT.  Note that they're applied only to the current EPT view of the
+// CPU which executed the VMCALL - just like the rest of the VMCALL
+// interface, the batch has to be issued on each CPU.  Hooks are shared by
+// all VCPUs and the batch only synchronizes them with the calling CPU.
+//
+
+namespace hypercall {
+
+static constexpr uint64_t batch_id        = 0xc5;
+static constexpr uint32_t batch_signature = 0x68637668;   // "hvch"
+static constexpr uint32_t max_operation_count = 4096;
+
+enum class operation_type : uint32_t
+{
+  none,
+
+  //
+  // Map 4kb page.
+  //   argument[0] - guest physical address
+  //   argument[1] - host physical address
+  //   argument[2] - access (bit 0 - read, bit 1 - write, bit 2 - execute)
+  //
+  map,
+
+  //
+  // Change access of all mapped pages in the range.
+  //   argument[0] - guest physical address (page aligned)
+  //   argument[1] - size (in bytes, page aligned)
+  //   argument[2] - access (see map)
+  //   result      - number of updated EPT entries
+  //
+  protect,
+
+  //
+  // Install an invisible hook (see hook_manager).
+  //   argument[0] - virtual address of the executed page
+  //   argument[1] - virtual address of the read page
+  //
+  hook,
+
+  //
+  // Remove the hook.
+  //   argument[0] - virtual address of the executed page
+  //
+  unhook,
+
+  //
+  // Query a statistic.
+  //   argument[0] - stats_id
+  //   result      - value
+  //
+  stats_query,
+};
+
+enum class stats_id : uint64_t
+{
+  hook_count,
+  allocated_bytes,
+  free_bytes,
+};
+
+enum class status_code : int32_t
+{
+  success           =  0,
+  invalid_operation = -1,
+  invalid_argument  = -2,
+  invalid_address   = -3,
+  no_resources      = -4,
+  access_denied     = -5,
+};
+
+struct header_t
+{
+  uint32_t signature;
+  uint32_t operation_count;
+};
+
+struct operation_t
+{
+  operation_type type;
+  status_code    status;        // written by the hypervisor
+  uint64_t       argument[3];
+  uint64_t       result;        // written by the hypervisor
+};
+
+static_assert(sizeof(header_t) == 8);
+static_assert(sizeof(operation_t) == 40);
+
+//
+// Command ring.
+//
+// Non-urgent operations don't need a VMCALL each - the guest kernel
+// registers one ring per CPU (by VMCALL executed on that CPU, at CPL 0):
+//   RCX = hypercall::ring_register_id
+//   RDX = virtual address of the ring (page aligned, nonpaged), or 0 to
+//         unregister the ring of this CPU
+// RAX receives 0 on success or ~0 on failure (the signature must be set
+// before the registration).  The page must stay locked until the ring
+// is unregistered - the hypervisor keeps accessing it by its physical
+// address.
+//
+// The ring is single-producer (the guest code running on that CPU, with
+// interrupts or preemption disabled while it's filling an entry) and
+// single-consumer (the VCPU of that CPU):
+//   - producer writes the operation at (head % entry_count) and then
+//     increments the head
+//   - consumer executes the operation at (tail % entry_count), writes
+//     back its status and result and then increments the tail
+//   - the ring is full when head - tail == entry_count
+//
+// The VCPU drains the ring at the beginning of each VM-exit it handles
+// (any natural VM-exit - or VMX-preemption timer expiration, if it's
+// enabled), i.e. without any VM-exit caused by the guest.  If the ring is
+// full or the operation is urgent, the guest rings the doorbell:
+//   RCX = hypercall::ring_doorbell_id
+// which drains the ring right away.  RAX receives the number of drained
+// operations, or ~0 if there's no ring registered on this CPU.
+//
+// Operations are the same as in the batch (see operation_type), only
+// they may be executed in an arbitrary guest context - virtual addresses
+// (hook, unhook) must be addresses of the system address space.
+//
+
+static constexpr uint64_t ring_register_id = 0xc7;
+static constexpr uint64_t ring_doorbell_id = 0xc8;
+static constexpr uint32_t ring_signature   = 0x72637668;   // "hvcr"
+
+struct alignas(4096) ring_t
+{
+  static constexpr uint32_t entry_count = 64;
+
+  uint32_t          signature;
+  uint32_t          reserved1;
+  volatile uint32_t head;       // written by the guest
+  uint32_t          reserved2;
+  uint64_t          reserved3[6];
+
+  volatile uint32_t tail;       // written by the hypervisor
+  uint32_t          reserved4;
+  volatile uint64_t drained;    // written by the hypervisor (statistics)
+  uint64_t          reserved5[6];
+
+  operation_t       entry[entry_count];
+};
+
+static_assert(sizeof(ring_t) == 4096);
+
+}
@@ -10,11 +10,30 @@ enum class ioctl_access : uint32_t
   read_write = read | write
 };
 
+//
+// Transfer type of the IOCTL buffers (Windows only).
+//   buffered   - both buffers are copied through the system buffer
+//   in_direct  - input buffer is copied, output buffer is locked
+//                (MDL) and probed for read access
+//   out_direct - input buffer is copied, output buffer is locked
+//                (MDL) and probed for write access
+//
+// Direct transfers avoid the copy of the (potentially large) output
+// buffer - see device::on_ioctl_direct().
+//
+enum class ioctl_method : uint32_t
+{
+  buffered   = 0,
+  in_direct  = 1,
+  out_direct = 2,
+};
+
 inline constexpr auto
 make_ioctl_code_windows(
   uint32_t id,
   ioctl_access access,
-  uint32_t size
+  uint32_t size,
+  ioctl_method method = ioctl_method::buffered
   ) noexcept
 {
   //
@@ -56,7 +75,7 @@ make_ioctl_code_windows(
   //
 
   return ctl_code_impl(0x00000022,         // FILE_DEVICE_UNKNOWN
-                       0,                  // METHOD_BUFFERED
+                       uint32_t(method),   // METHOD_BUFFERED, METHOD_IN_DIRECT, METHOD_OUT_DIRECT
                        0x800 | id,
                        uint32_t(access));
 }
@@ -90,12 +109,14 @@ inline constexpr auto
 make_ioctl_code(
   uint32_t id,
   ioctl_access access,
-  uint32_t size
+  uint32_t size,
+  ioctl_method method = ioctl_method::buffered
   ) noexcept
 {
 #ifdef _WIN32
-  return make_ioctl_code_windows(id, access, size);
+  return make_ioctl_code_windows(id, access, size, method);
 #elif __linux__
+  (void)(method);
   return make_ioctl_code_linux(id, access, size);
 #else
 #error Unsupported operating system!
@@ -105,12 +126,14 @@ make_ioctl_code(
 template <
   uint32_t Id,
   ioctl_access Access,
-  uint32_t Size
+  uint32_t Size,
+  ioctl_method Method = ioctl_method::buffered
 >
 struct ioctl_t
 {
-  static constexpr uint32_t code = make_ioctl_code(Id, Access, Size);
+  static constexpr uint32_t code = make_ioctl_code(Id, Access, Size, Method);
   static constexpr uint32_t size = Size;
+  static constexpr ioctl_method method = Method;
 };
 
 template <uint32_t Id>
@@ -124,3 +147,13 @@ using ioctl_write_t = ioctl_t<Id, ioctl_access::write, Size>;
 
 template <uint32_t Id, uint32_t Size>
 using ioctl_read_write_t = ioctl_t<Id, ioctl_access::read_write, Size>;
+
+//
+// "Size" of the direct IOCTLs is the minimal size of the output buffer.
+//
+
+template <uint32_t Id, uint32_t Size>
+using ioctl_in_direct_t = ioctl_t<Id, ioctl_access::read_write, Size, ioctl_method::in_direct>;
+
+template <uint32_t Id, uint32_t Size>
+using ioctl_out_direct_t = ioctl_t<Id, ioctl_access::read_write, Size, ioctl_method::out_direct>;
@@ -1,7 +1,16 @@
 #include "log.h"
 
+#include "mm.h"
+#include "mp.h"
+
+#include "hvpp/ia32/asm.h"
+
+#include <atomic>
+#include <cinttypes>
 #include <cstdarg>
 #include <cstdio>
+#include <cstring>
+#include <iterator>
 
 //
 // Simple logger implementation.
@@ -20,17 +29,90 @@
 // can be called at VERY HIGH frequency (more than 10000 per sec.) and
 // on Windows they can be called from any IRQL.
 //
+// Even the tracing API is too slow to be called on each VM-exit, though.
+// hvpp_trace_fast() therefore only stores the format string and raw
+// arguments into the per-CPU trace ring.  The ring is drained by the
+// platform-specific drainer (a system thread on Windows), which formats
+// the records and emits them as regular trace logs.
+//
+// With HVPP_LOG_BINARY defined, all log levels take the same path -
+// each hvpp_info() etc. stores just the ID of its compile-time format
+// descriptor and the raw arguments.  Records of levels other than
+// "trace" are printed to the debugger by the drainer.  Nothing is
+// formatted (and no process or thread is queried) by the caller, which
+// keeps logging-heavy sessions from distorting the measured timing.
+//
+// Each per-CPU ring is written wait-free - a slot is reserved by atomic
+// increment of the head (which also covers a VM-exit interrupting a
+// trace in the guest on the same CPU).  When the drainer is too slow,
+// the oldest records are overwritten and counted as lost.
+//
 
 namespace logger
 {
   level_t   current_level   = level_t::default_flags;
   options_t current_options = options_t::default_flags;
+  uint32_t  current_modules = ~0u;
+  uint64_t  current_exit_reasons[2] = { ~0ull, ~0ull };
+
+  struct trace_ring_t
+  {
+    //
+    // Large enough to hold VM-exit events (see trace_exit_event())
+    // of ~10ms (drainer interval) of a busy CPU.
+    //
+    static constexpr uint32_t record_count = 1024;
+
+    std::atomic_uint64_t head;
+    uint64_t             tail;          // accessed only by the drainer
+    uint64_t             lost;          // accessed only by the drainer
+    uint64_t             reserved[5];   // keep records off the cache line of the head
+
+    trace_record_t       record[record_count];
+  };
+
+  trace_ring_t* trace_ring       = nullptr;
+  uint32_t      trace_ring_count = 0;
 
   auto initialize() noexcept -> error_code_t
-  { return detail::initialize(); }
+  {
+    trace_ring_count = mp::cpu_count();
+    trace_ring = reinterpret_cast<trace_ring_t*>(
+      mm::system_allocate(sizeof(trace_ring_t) * trace_ring_count));
+
+    if (!trace_ring)
+    {
+      return make_error_code_t(std::errc::not_enough_memory);
+    }
+
+    memset(trace_ring, 0, sizeof(trace_ring_t) * trace_ring_count);
+
+    if (auto err = detail::initialize())
+    {
+      mm::system_free(trace_ring);
+      trace_ring = nullptr;
+      trace_ring_count = 0;
+      return err;
+    }
+
+    return error_code_t{};
+  }
 
   void destroy() noexcept
-  { detail::destroy(); }
+  {
+    //
+    // detail::destroy() stops the drainer, which drains the rings one
+    // last time.
+    //
+    detail::destroy();
+
+    if (trace_ring)
+    {
+      mm::system_free(trace_ring);
+      trace_ring = nullptr;
+      trace_ring_count = 0;
+    }
+  }
 
   void set_options(options_t options) noexcept
   { current_options = options; }
@@ -38,8 +120,6 @@ namespace logger
   auto get_options() noexcept -> options_t
   { return current_options; }
 
-  bool test_options(options_t options) noexcept
-  { return (current_options & options) == options; }
 
   void set_level(level_t level) noexcept
   { current_level = level; }
@@ -47,8 +127,23 @@ namespace logger
   auto get_level() noexcept -> level_t
   { return current_level; }
 
-  bool test_level(level_t level) noexcept
-  { return (current_level & level) == level; }
+  void set_module_filter(module_t module, bool enable) noexcept
+  {
+    const auto bit = 1u << static_cast<uint32_t>(module);
+    current_modules = enable ? (current_modules | bit) : (current_modules & ~bit);
+  }
+
+  void set_exit_reason_filter(uint32_t exit_reason, bool enable) noexcept
+  {
+    if (exit_reason >= 128)
+    {
+      return;
+    }
+
+    auto& bits = current_exit_reasons[exit_reason / 64];
+    const auto bit = 1ull << (exit_reason % 64);
+    bits = enable ? (bits | bit) : (bits & ~bit);
+  }
 
   void print(level_t level, const char* function, const char* format, ...) noexcept
   {
@@ -66,4 +161,137 @@ namespace logger
 
     va_end(args);
   }
+
+  void trace_exit_event(uint32_t exit_reason, uint64_t exit_qualification,
+                        uint64_t guest_rip, uint64_t guest_cr3, uint64_t handler_ticks) noexcept
+  {
+    //
+    // The format string is used only by consumers which don't handle
+    // typed events.
+    //
+    static constexpr format_t id{
+      level_t::trace,
+      "vmexit",
+      "reason: %u, qualification: 0x%llx, rip: 0x%llx, cr3: 0x%llx, ticks: %llu",
+      event_t::vmexit
+    };
+
+    const uint64_t argument[] = {
+      exit_reason, exit_qualification, guest_rip, guest_cr3, handler_ticks
+    };
+
+    detail::trace_ring_write(id, argument, uint32_t(std::size(argument)));
+  }
+
+  void trace_ring_drain() noexcept
+  {
+    for (uint32_t cpu_index = 0; cpu_index < trace_ring_count; ++cpu_index)
+    {
+      auto& ring = trace_ring[cpu_index];
+      const auto head = ring.head.load(std::memory_order_acquire);
+
+      if (head - ring.tail > trace_ring_t::record_count)
+      {
+        ring.lost += head - ring.tail - trace_ring_t::record_count;
+        ring.tail  = head - trace_ring_t::record_count;
+      }
+
+      while (ring.tail < head)
+      {
+        const auto& slot = ring.record[ring.tail % trace_ring_t::record_count];
+        const auto expected_sequence = ring.tail + 1;
+
+        if (reinterpret_cast<const volatile uint64_t&>(slot.sequence) != expected_sequence)
+        {
+          //
+          // The record is either still being written (try again
+          // next time) or it has already been overwritten.
+          //
+          if (ring.head.load(std::memory_order_acquire) - ring.tail <= trace_ring_t::record_count)
+          {
+            break;
+          }
+
+          ++ring.lost;
+          ++ring.tail;
+          continue;
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        trace_record_t record = slot;
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (reinterpret_cast<const volatile uint64_t&>(slot.sequence) == expected_sequence)
+        {
+          if (record.id->level == level_t::trace)
+          {
+            detail::print_trace_record(record);
+          }
+          else
+          {
+            detail::print_log_record(record);
+          }
+        }
+        else
+        {
+          ++ring.lost;
+        }
+
+        ++ring.tail;
+      }
+
+      if (ring.lost)
+      {
+        print(level_t::warn, __FUNCTION__, "CPU #%u: %" PRIu64 " trace records lost", cpu_index, ring.lost);
+        ring.lost = 0;
+      }
+    }
+  }
+}
+
+namespace logger::detail
+{
+  void trace_ring_write(const format_t& id, const uint64_t* argument, uint32_t argument_count) noexcept
+  {
+    const auto cpu_index = mp::cpu_index();
+
+    if (!trace_ring)
+    {
+      //
+      // The logger isn't initialized yet (or it has already been
+      // destroyed) - messages of the "trace" level are dropped, the
+      // others are printed right away.
+      //
+      if (id.level != level_t::trace)
+      {
+        trace_record_t record{};
+        record.timestamp = ia32_asm_read_tsc();
+        record.id = &id;
+        record.cpu_index = cpu_index;
+        record.argument_count = argument_count;
+        memcpy(record.argument, argument, argument_count * sizeof(argument[0]));
+
+        print_log_record(record);
+      }
+
+      return;
+    }
+
+    auto& ring = trace_ring[cpu_index];
+
+    const auto index = ring.head.fetch_add(1, std::memory_order_relaxed);
+    auto& record = ring.record[index % trace_ring_t::record_count];
+
+    reinterpret_cast<volatile uint64_t&>(record.sequence) = 0;
+    std::atomic_thread_fence(std::memory_order_release);
+
+    record.timestamp = ia32_asm_read_tsc();
+    record.id = &id;
+    record.cpu_index = cpu_index;
+    record.argument_count = argument_count;
+    memcpy(record.argument, argument, argument_count * sizeof(argument[0]));
+
+    std::atomic_thread_fence(std::memory_order_release);
+    reinterpret_cast<volatile uint64_t&>(record.sequence) = index + 1;
+  }
 }
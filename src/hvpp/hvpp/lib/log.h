@@ -1,13 +1,103 @@
 #pragma once
 #include "error.h"
 
+#include "hvpp/config.h"
+
 #include <cstdint>
+#include <type_traits>
+
+//
+// Module of the translation unit (see logger::module_t) - define it
+// before including any header, e.g.:
+//   #define HVPP_LOG_MODULE ept
+//
+#ifndef HVPP_LOG_MODULE
+# define HVPP_LOG_MODULE general
+#endif
 
-#define hvpp_trace(format, ...)  ::logger::print(::logger::level_t::trace, __FUNCTION__, format, __VA_ARGS__)
-#define hvpp_debug(format, ...)  ::logger::print(::logger::level_t::debug, __FUNCTION__, format, __VA_ARGS__)
-#define hvpp_info(format, ...)   ::logger::print(::logger::level_t::info,  __FUNCTION__, format, __VA_ARGS__)
-#define hvpp_warn(format, ...)   ::logger::print(::logger::level_t::warn,  __FUNCTION__, format, __VA_ARGS__)
-#define hvpp_error(format, ...)  ::logger::print(::logger::level_t::error, __FUNCTION__, format, __VA_ARGS__)
+#define hvpp_trace(format, ...)  hvpp_log(::logger::level_t::trace, format, __VA_ARGS__)
+#define hvpp_debug(format, ...)  hvpp_log(::logger::level_t::debug, format, __VA_ARGS__)
+#define hvpp_info(format, ...)   hvpp_log(::logger::level_t::info,  format, __VA_ARGS__)
+#define hvpp_warn(format, ...)   hvpp_log(::logger::level_t::warn,  format, __VA_ARGS__)
+#define hvpp_error(format, ...)  hvpp_log(::logger::level_t::error, format, __VA_ARGS__)
+
+//
+// Levels below HVPP_LOG_MIN_LEVEL are discarded at compile time - not
+// even the arguments are evaluated.  The rest is filtered by the level
+// and the module (see logger::test_filter()) inline, before any argument
+// is passed.
+//
+#define hvpp_log(level, format, ...)                                         \
+  do                                                                         \
+  {                                                                          \
+    if constexpr (::logger::is_compiled_in(level))                           \
+    {                                                                        \
+      if (::logger::test_filter(level, ::logger::module_t::HVPP_LOG_MODULE)) \
+      {                                                                      \
+        hvpp_log_emit(level, format, __VA_ARGS__);                           \
+      }                                                                      \
+    }                                                                        \
+  } while (0)
+
+//
+// Trace of a VM-exit handler - additionally filtered by the exit reason
+// (see logger::set_exit_reason_filter()).
+//
+#define hvpp_trace_exit(exit_reason, format, ...)                            \
+  do                                                                         \
+  {                                                                          \
+    if constexpr (::logger::is_compiled_in(::logger::level_t::trace))        \
+    {                                                                        \
+      if (::logger::test_exit_reason(static_cast<uint32_t>(exit_reason)) &&  \
+          ::logger::test_filter(::logger::level_t::trace,                    \
+                                ::logger::module_t::HVPP_LOG_MODULE))        \
+      {                                                                      \
+        hvpp_log_emit(::logger::level_t::trace, format, __VA_ARGS__);        \
+      }                                                                      \
+    }                                                                        \
+  } while (0)
+
+#ifndef HVPP_LOG_BINARY
+# define hvpp_log_emit(level, format, ...)  ::logger::print(level, __FUNCTION__, format, __VA_ARGS__)
+#else
+# define hvpp_log_emit(level, format, ...)  hvpp_log_binary(level, format, __VA_ARGS__)
+#endif
+
+//
+// Wait-free variant of hvpp_trace, intended for VMX-root mode.
+// Arguments are stored in the per-CPU trace ring and formatted later
+// by the drainer (see logger::trace_ring_drain()).
+//
+// Note that the format string and all "%s" arguments must be static
+// strings (literals) - only their pointers are stored.
+//
+#define hvpp_trace_fast(format, ...)                                         \
+  do                                                                         \
+  {                                                                          \
+    if constexpr (::logger::is_compiled_in(::logger::level_t::trace))        \
+    {                                                                        \
+      if (::logger::test_filter(::logger::level_t::trace,                    \
+                                ::logger::module_t::HVPP_LOG_MODULE))        \
+      {                                                                      \
+        hvpp_log_binary(::logger::level_t::trace, format, __VA_ARGS__);      \
+      }                                                                      \
+    }                                                                        \
+  } while (0)
+
+//
+// Binary log record - the level, the function name and the format
+// string are registered at compile time in a static descriptor, whose
+// address serves as the ID of the record.  Only the ID and the raw
+// arguments are stored, formatting is deferred to the drainer.
+//
+#define hvpp_log_binary(level, format, ...)                                  \
+  do                                                                         \
+  {                                                                          \
+    static constexpr ::logger::format_t hvpp_log_format{ level,              \
+                                                         __FUNCTION__,       \
+                                                         format };           \
+    ::logger::trace(hvpp_log_format, __VA_ARGS__);                           \
+  } while (0)
 
 namespace logger
 {
@@ -26,12 +116,36 @@ namespace logger
 #endif
   };
 
+  //
+  // Modules which can be filtered (see HVPP_LOG_MODULE).
+  //
+  enum class module_t : uint32_t
+  {
+    general,
+    hypervisor,
+    vcpu,
+    ept,
+    vmexit,
+    mm,
+    driver,
+    user,
+
+    count
+  };
+
   enum class options_t : uint32_t
   {
     print_time                = 0x01,
     print_processor_number    = 0x02,
     print_function_name       = 0x04,
 
+    //
+    // Emit typed TraceLogging event for each VM-exit (see
+    // trace_exit_event()).  Filtered by the "trace" level, the "vcpu"
+    // module and the exit reason.
+    //
+    trace_exit_events         = 0x08,
+
     default_flags = print_time | print_processor_number /*| print_function_name*/,
   };
 
@@ -59,13 +173,90 @@ namespace logger
   constexpr inline options_t& operator|=(options_t& value1, options_t value2) noexcept
   { value1 = value1 | value2; return value1; }
 
+  //
+  // Kind of the binary record - plain messages are formatted with the
+  // format string, other records are emitted as typed events.
+  //
+  enum class event_t : uint32_t
+  {
+    message,
+    vmexit,
+  };
+
+  struct format_t
+  {
+    level_t     level;
+    const char* function;
+    const char* format;
+    event_t     event;
+  };
+
+  struct trace_record_t
+  {
+    static constexpr int max_argument_count = 6;
+
+    uint64_t        sequence;   // index of the record + 1 (0 while being written)
+    uint64_t        timestamp;  // TSC at the time of writing
+    const format_t* id;
+    uint32_t        cpu_index;
+    uint32_t        argument_count;
+    uint64_t        argument[max_argument_count];
+  };
+
+  extern level_t   current_level;
+  extern options_t current_options;
+  extern uint32_t  current_modules;
+  extern uint64_t  current_exit_reasons[2];
+
+  constexpr inline bool is_compiled_in(level_t level) noexcept
+  { return static_cast<uint32_t>(level) >= HVPP_LOG_MIN_LEVEL; }
+
+  inline bool test_level(level_t level) noexcept
+  { return (current_level & level) == level; }
+
+  inline bool test_filter(level_t level, module_t module) noexcept
+  { return test_level(level) && (current_modules & (1u << static_cast<uint32_t>(module))); }
+
+  inline bool test_exit_reason(uint32_t exit_reason) noexcept
+  { return exit_reason < 128 && (current_exit_reasons[exit_reason / 64] & (1ull << (exit_reason % 64))); }
+
+  inline bool test_options(options_t options) noexcept
+  { return (current_options & options) == options; }
+
+  inline bool test_exit_event(uint32_t exit_reason) noexcept
+  {
+    return test_options(options_t::trace_exit_events) &&
+           test_filter(level_t::trace, module_t::vcpu) &&
+           test_exit_reason(exit_reason);
+  }
+
   namespace detail
   {
+    template <typename T>
+    constexpr auto trace_argument(T value) noexcept -> uint64_t
+    {
+      if constexpr (std::is_pointer_v<T>)
+      {
+        return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(value));
+      }
+      else
+      {
+        static_assert(std::is_integral_v<T> || std::is_enum_v<T>,
+                      "Only integers, enums and pointers can be traced");
+
+        return static_cast<uint64_t>(value);
+      }
+    }
+
+    void trace_ring_write(const format_t& id, const uint64_t* argument, uint32_t argument_count) noexcept;
+
     auto initialize() noexcept -> error_code_t;
     void destroy() noexcept;
 
     void vprint(level_t level, const char* function, const char* format, va_list args) noexcept;
     void vprint_trace(level_t level, const char* function, const char* format, va_list args) noexcept;
+    void print_trace_record(const trace_record_t& record) noexcept;
+    void print_log_record(const trace_record_t& record) noexcept;
   }
 
   auto initialize() noexcept -> error_code_t;
@@ -73,11 +264,49 @@ namespace logger
 
   auto get_options() noexcept -> options_t;
   void set_options(options_t options) noexcept;
-  bool test_options(options_t option) noexcept;
 
   auto get_level() noexcept -> level_t;
   void set_level(level_t level) noexcept;
-  bool test_level(level_t level) noexcept;
+
+  //
+  // Enable or disable logging of the module, or of the VM-exit
+  // reason (see hvpp_trace_exit).  Everything is enabled by default.
+  //
+  void set_module_filter(module_t module, bool enable) noexcept;
+  void set_exit_reason_filter(uint32_t exit_reason, bool enable) noexcept;
 
   void print(level_t level, const char* function, const char* format, ...) noexcept;
+
+  //
+  // Store the binary record (see hvpp_log_binary).  Records of all
+  // levels share the trace ring - records of the "trace" level are
+  // emitted by the tracing API, the others are printed to the debugger.
+  //
+  template <typename ...ARGS>
+  void trace(const format_t& id, ARGS... args) noexcept
+  {
+    static_assert(sizeof...(ARGS) <= trace_record_t::max_argument_count,
+                  "Too many trace arguments");
+
+    if (test_level(id.level))
+    {
+      const uint64_t argument[] = { detail::trace_argument(args)..., 0 };
+      detail::trace_ring_write(id, argument, sizeof...(ARGS));
+    }
+  }
+
+  //
+  // Store the VM-exit event into the trace ring of the current CPU.
+  // The drainer emits it as typed TraceLogging event "VmExit" - no
+  // formatting is done, neither in VMX-root mode nor later.
+  // Call only if test_exit_event() returned true.
+  //
+  void trace_exit_event(uint32_t exit_reason, uint64_t exit_qualification,
+                        uint64_t guest_rip, uint64_t guest_cr3, uint64_t handler_ticks) noexcept;
+
+  //
+  // Format and emit all pending records of the trace rings.
+  // Must be called at PASSIVE_LEVEL (see detail::initialize()).
+  //
+  void trace_ring_drain() noexcept;
 }
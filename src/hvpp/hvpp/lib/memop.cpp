@@ -0,0 +1,263 @@
+#include "memop.h"
+
+namespace memop
+{
+  namespace detail
+  {
+    //
+    // Length of the ModR/M byte and everything which follows it (SIB,
+    // displacement).  Returns 0 for the register form (mod == 3) or
+    // if the buffer is too short.
+    //
+    static size_t modrm_length(const uint8_t* code, size_t size, bool address_size_16) noexcept
+    {
+      if (size < 1)
+      {
+        return 0;
+      }
+
+      const uint8_t modrm = code[0];
+      const uint8_t mod   = modrm >> 6;
+      const uint8_t rm    = modrm & 7;
+
+      if (mod == 3)
+      {
+        return 0;
+      }
+
+      size_t length = 1;
+
+      if (address_size_16)
+      {
+        //
+        // 16-bit addressing has no SIB, [disp16] is encoded as mod 0, rm 6.
+        //
+        length += mod == 1 ? 1 : mod == 2 ? 2 : rm == 6 ? 2 : 0;
+      }
+      else
+      {
+        if (rm == 4)
+        {
+          if (size < 2)
+          {
+            return 0;
+          }
+
+          length += 1;
+
+          //
+          // SIB without base register takes disp32.
+          //
+          if (mod == 0 && (code[1] & 7) == 5)
+          {
+            length += 4;
+          }
+        }
+
+        length += mod == 1 ? 1 : mod == 2 ? 4 : rm == 5 ? 4 : 0;
+      }
+
+      return length <= size ? length : 0;
+    }
+  }
+
+  bool decode(const uint8_t* code, size_t size, bool long_mode, instruction_t& instruction) noexcept
+  {
+    instruction = instruction_t{};
+
+    if (size > max_instruction_size)
+    {
+      size = max_instruction_size;
+    }
+
+    bool    operand_size_16 = false;
+    bool    address_size    = false;    // 0x67 prefix
+    uint8_t rex             = 0;
+    size_t  offset          = 0;
+
+    //
+    // Legacy prefixes.  REP/LOCK prefixes don't change the MOV family
+    // (LOCK MOV is #UD anyway).
+    //
+    for (; offset < size; ++offset)
+    {
+      switch (code[offset])
+      {
+        case 0x66: operand_size_16 = true; continue;
+        case 0x67: address_size    = true; continue;
+
+        case 0x26: case 0x2e: case 0x36: case 0x3e:
+        case 0x64: case 0x65:
+        case 0xf0: case 0xf2: case 0xf3:
+          continue;
+
+        default:
+          break;
+      }
+
+      break;
+    }
+
+    //
+    // REX prefix must immediately precede the opcode.
+    //
+    if (long_mode && offset < size && (code[offset] & 0xf0) == 0x40)
+    {
+      rex = code[offset++];
+    }
+
+    if (offset >= size)
+    {
+      return false;
+    }
+
+    const bool rex_w = (rex & 0b1000) != 0;
+    const bool rex_r = (rex & 0b0100) != 0;
+
+    //
+    // In 64-bit mode, 0x67 selects 32-bit addressing (ModR/M encoding is
+    // the same), in 32-bit mode it selects 16-bit addressing.
+    //
+    const bool address_size_16 = !long_mode && address_size;
+
+    const uint8_t operand_size = rex_w ? 8 : operand_size_16 ? 2 : 4;
+
+    uint8_t opcode = code[offset++];
+    bool    two_byte = false;
+
+    if (opcode == 0x0f)
+    {
+      if (offset >= size)
+      {
+        return false;
+      }
+
+      opcode = code[offset++];
+      two_byte = true;
+    }
+
+    //
+    // Moffs forms (MOV AL/rAX, [moffs] and vice versa) have no ModR/M.
+    //
+    if (!two_byte && opcode >= 0xa0 && opcode <= 0xa3)
+    {
+      const size_t moffs_size = long_mode
+        ? (address_size ? 4 : 8)
+        : (address_size ? 2 : 4);
+
+      if (offset + moffs_size > size)
+      {
+        return false;
+      }
+
+      instruction.op             = opcode <= 0xa1 ? operation::load : operation::store;
+      instruction.access_size    = (opcode & 1) ? operand_size : 1;
+      instruction.register_size  = instruction.access_size;
+      instruction.register_index = 0;
+      instruction.length         = static_cast<uint8_t>(offset + moffs_size);
+      return true;
+    }
+
+    uint8_t access_size;
+    uint8_t register_size;
+    size_t  immediate_size = 0;
+
+    if (!two_byte)
+    {
+      switch (opcode)
+      {
+        case 0x88: instruction.op = operation::store;           access_size = 1;            break;
+        case 0x89: instruction.op = operation::store;           access_size = operand_size; break;
+        case 0x8a: instruction.op = operation::load;            access_size = 1;            break;
+        case 0x8b: instruction.op = operation::load;            access_size = operand_size; break;
+        case 0xc6: instruction.op = operation::store_immediate; access_size = 1;            break;
+        case 0xc7: instruction.op = operation::store_immediate; access_size = operand_size; break;
+        default:   return false;
+      }
+
+      register_size = access_size;
+
+      if (instruction.op == operation::store_immediate)
+      {
+        //
+        // Only /0 is MOV, immediate is at most 32 bits (sign-extended).
+        //
+        if (offset >= size || ((code[offset] >> 3) & 7) != 0)
+        {
+          return false;
+        }
+
+        immediate_size = access_size > 4 ? 4 : access_size;
+      }
+    }
+    else
+    {
+      switch (opcode)
+      {
+        case 0xb6: instruction.op = operation::load_zero_extend; access_size = 1; break;
+        case 0xb7: instruction.op = operation::load_zero_extend; access_size = 2; break;
+        case 0xbe: instruction.op = operation::load_sign_extend; access_size = 1; break;
+        case 0xbf: instruction.op = operation::load_sign_extend; access_size = 2; break;
+        default:   return false;
+      }
+
+      register_size = operand_size;
+    }
+
+    const auto modrm_length = detail::modrm_length(code + offset, size - offset, address_size_16);
+
+    if (!modrm_length)
+    {
+      return false;
+    }
+
+    const uint8_t reg = (code[offset] >> 3) & 7;
+    offset += modrm_length;
+
+    if (offset + immediate_size > size)
+    {
+      return false;
+    }
+
+    if (immediate_size)
+    {
+      uint64_t immediate = 0;
+
+      for (size_t i = 0; i < immediate_size; ++i)
+      {
+        immediate |= uint64_t(code[offset + i]) << (i * 8);
+      }
+
+      //
+      // 32-bit immediate of the 64-bit store is sign-extended.
+      //
+      if (access_size == 8 && (immediate & 0x8000'0000))
+      {
+        immediate |= 0xffff'ffff'0000'0000;
+      }
+
+      instruction.immediate = immediate;
+      offset += immediate_size;
+    }
+    else
+    {
+      //
+      // Without REX, byte registers 4-7 are AH, CH, DH and BH.
+      //
+      if (register_size == 1 && !rex && reg >= 4)
+      {
+        instruction.register_index = reg - 4;
+        instruction.high_byte      = true;
+      }
+      else
+      {
+        instruction.register_index = reg | (rex_r ? 8 : 0);
+      }
+    }
+
+    instruction.access_size   = access_size;
+    instruction.register_size = register_size;
+    instruction.length        = static_cast<uint8_t>(offset);
+    return true;
+  }
+}
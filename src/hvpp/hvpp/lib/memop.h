@@ -0,0 +1,59 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+//
+// Decoder of x86 instructions which move data between a general purpose
+// register (or an immediate) and memory.
+//
+// This is not a general disassembler - it recognizes only the MOV family
+// (MOV r/m, MOV moffs, MOVZX, MOVSX), which covers practically all
+// accesses of drivers to device registers.  Only the length of the
+// memory operand is decoded, not its address - the address of trapped
+// accesses is already known from the VM-exit (see mmio_manager).
+// The decoder doesn't touch anything but the provided buffer and it's
+// safe to use in the VMX-root mode.
+//
+// Usage:
+//   memop::instruction_t instruction;
+//   if (memop::decode(code, code_size, long_mode, instruction))
+//   {
+//     ...
+//   }
+//
+
+namespace memop
+{
+  //
+  // Longest x86 instruction.
+  //
+  static constexpr size_t max_instruction_size = 15;
+
+  enum class operation : uint8_t
+  {
+    none,
+    load,                       // register = memory
+    load_zero_extend,           // register = zero-extended memory (MOVZX)
+    load_sign_extend,           // register = sign-extended memory (MOVSX)
+    store,                      // memory = register
+    store_immediate,            // memory = immediate
+  };
+
+  struct instruction_t
+  {
+    operation op;
+    uint8_t   length;           // length of the whole instruction
+    uint8_t   access_size;      // size of the memory access (1, 2, 4 or 8)
+    uint8_t   register_size;    // size of the register operand (1, 2, 4 or 8)
+    uint8_t   register_index;   // see context_t::reg_*
+    bool      high_byte;        // AH, CH, DH or BH (register_index is rax...rbx)
+    uint64_t  immediate;        // sign-extended to access_size
+  };
+
+  //
+  // Decode the instruction at "code" ("size" bytes are available).
+  // "long_mode" selects 64-bit code (CS.L), otherwise 32-bit code is
+  // assumed.  Returns false if the instruction isn't recognized.
+  //
+  bool decode(const uint8_t* code, size_t size, bool long_mode, instruction_t& instruction) noexcept;
+}
@@ -1,5 +1,6 @@
 #include "mm.h"
 
+#include "hvpp/ia32/asm.h"
 #include "hvpp/ia32/memory.h"
 #include "hvpp/config.h"
 
@@ -9,9 +10,12 @@
 #include "spinlock.h"
 #include "mp.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstring>
 #include <limits>
 #include <mutex>
+#include <new>
 
 //
 // Simple memory manager implementation.
@@ -38,9 +42,51 @@
 // On deallocation, corresponding number in the map is reset
 // to 0.
 //
-// Note: allocations are always page-aligned - therefore
-//       allocation for even 1 byte results in waste of
-//       4096 bytes.
+// Page summary is the second level of the page bitmap - it
+// sets bit 1 for each 64-bit word of the page bitmap which is
+// completely full (i.e.: 64 consecutive allocated pages).  Search
+// for a free run uses it to skip full regions of the pool without
+// touching the page bitmap, and steps over completely free words
+// at once.
+//
+// Note: page allocations are always page-aligned - therefore
+//       allocation for even 2017 bytes results in waste of
+//       the rest of the page.  Smaller allocations (see slabs
+//       below) are NOT page-aligned - buffers which need the
+//       alignment must use allocate_aligned() (or the aligned
+//       operator new).
+//
+// Allocations of 1, 2, 4 and 8 pages are served from per-CPU
+// caches ("magazines") of free runs of these sizes.  Magazines
+// are refilled from (and drained back to) the page bitmap in
+// batches, so that the global lock is taken only once per batch.
+// Runs cached in magazines are accounted as allocated, but they're
+// marked in the page allocation map (magazine_page_flag) - so that
+// freeing such run again is still detected as a double-free.  Before
+// an allocation fails, magazines of all CPUs are drained back to the
+// page bitmap and the allocation is retried.
+//
+// Small allocations (up to ~2kb) are served from slabs - pages
+// split into objects of the same size class (16, 32, ..., 1024
+// and 2016 bytes).  Objects of power-of-2 classes are aligned
+// to their size, 2016-byte objects only to 32 bytes.  Each CPU
+// has its own partially filled slab for each size class.  Slab
+// pages are marked in the page allocation map (slab_page_flag),
+// so that free() can tell them apart from regular page
+// allocations.  Slab header is stored at the end of the page.
+// Slab which is not owned by any CPU is returned back to the
+// page allocator once all its objects are freed.
+//
+// Each CPU keeps its own allocation statistics (counts, bytes
+// per size class and latency histogram), so that no shared cache
+// line is written on the allocation path.  Statistics are merged
+// only when they're queried (see mm::statistics()).
+//
+// Every allocation is tagged (see memory_tag).  Tag of each page is
+// stored in the page tag map (next to the page allocation map), so
+// that free() can account the memory back to its tag.  Therefore
+// each slab holds objects of a single tag - CPUs have their own
+// partially filled slab for each tag and size class.
 //
 
 namespace mm
@@ -48,6 +94,75 @@ namespace mm
   using pgbmp_t = object_t<bitmap>;
   using pgmap_t = uint16_t;
 
+  static constexpr int magazine_class_count = 4;    // 1, 2, 4 and 8 pages
+  static constexpr int magazine_size        = 16;   // runs per magazine
+  static constexpr int magazine_batch_size  = magazine_size / 2;
+
+  struct magazine_t
+  {
+    //
+    // Taken by the owning CPU (with interrupts disabled) and by
+    // magazine_drain_all().  Lock order: magazine lock, then the
+    // global lock.
+    //
+    spinlock lock;
+    int      count;
+    void*    item[magazine_size];
+  };
+
+  static constexpr pgmap_t slab_page_flag     = 0x8000;
+  static constexpr pgmap_t magazine_page_flag = 0x4000;   // run is cached in a magazine
+  static constexpr int     slab_class_count = 8;
+  static constexpr size_t  slab_class_size[slab_class_count] = {
+    16, 32, 64, 128, 256, 512, 1024, 2016
+  };
+
+  struct slab_object_t
+  {
+    slab_object_t* next;
+  };
+
+  struct slab_t
+  {
+    spinlock       lock;
+    bool           owned;         // slab is the current slab of some CPU
+    uint16_t       object_size;
+    uint16_t       object_count;
+    uint16_t       free_count;
+    slab_object_t* free_list;
+  };
+
+  static_assert(sizeof(slab_t) + 2 * 2016 <= ia32::page_size);
+
+  static_assert(statistics_t::class_count == slab_class_count + magazine_class_count + 1);
+
+  struct cpu_statistics_t
+  {
+    uint64_t allocation_count;
+    uint64_t free_count;
+    uint64_t failure_count;
+    uint64_t class_bytes[statistics_t::class_count];
+    uint64_t latency[statistics_t::latency_bucket_count];
+    int64_t  tag_bytes[memory_tag_count];
+    int64_t  tag_allocation_count[memory_tag_count];
+  };
+
+  //
+  // The global lock is taken by all CPUs (when magazines are refilled
+  // or drained and for large allocations) - use the fair lock.
+  //
+  using global_lock_t = queued_spinlock;
+
+  struct host_context_t
+  {
+    std::atomic<uintptr_t> stack;
+    uint32_t               cpu_index;
+    allocator_t            allocator;
+    memory_tag             tag;
+  };
+
+  static constexpr size_t host_context_capacity = HVPP_MAX_CPU * 2;
+
   struct global_t
   {
     uint8_t*    base_address;               // Pool base address
@@ -59,301 +174,1164 @@ namespace mm
     pgmap_t*    page_allocation_map;        // Map holding number of allocated pages
     int         page_allocation_map_size;   //
 
+    pgbmp_t     page_summary;               // Bitmap holding full words of the page bitmap
+    int         page_summary_buffer_size;   //
+
+    uint8_t*    page_tag;                   // Map holding tag of each allocated page
+    int         page_tag_size;              //
+
     int         last_page_offset;           // Last returned page offset - used as hint
 
+    uint64_t*   page_pfn;                   // PFN of each page of the pool
+    uint32_t*   pfn_table;                  // Hash table of PFNs (page index + 1, 0 = empty)
+    size_t      pfn_table_capacity;         // Number of slots of pfn_table (power of 2)
+    uint64_t    base_pfn;                   // PFN of the first page, if the pool is contiguous
+    bool        contiguous;                 // Pool is physically contiguous
+
     size_t      allocated_bytes;
     size_t      free_bytes;
+    size_t      peak_allocated_bytes;
 
     allocator_t allocator[HVPP_MAX_CPU];
+    memory_tag  tag[HVPP_MAX_CPU];
+    arena*      scratch[HVPP_MAX_CPU];
+
+    //
+    // Allocation context of the registered host stacks (see
+    // host_stack_register()).  Open-addressed hash table keyed by the
+    // base of the stack (0 = empty, 1 = removed).  Each key is looked up
+    // only by the CPU which owns the stack, therefore slots need no lock.
+    //
+    host_context_t host_context[host_context_capacity];
+    uintptr_t   host_stack_mask;
+    magazine_t  magazine[HVPP_MAX_CPU][magazine_class_count];
+    slab_t*     slab[HVPP_MAX_CPU][memory_tag_count][slab_class_count];
+
+    cpu_statistics_t statistics[HVPP_MAX_CPU];
 
     object_t<ia32::physical_memory_descriptor> memory_descriptor;
     object_t<ia32::mtrr> memory_type_range_registers;
-    object_t<spinlock> lock;
+    spinlock    memory_type_range_registers_lock;
+    object_t<global_lock_t> lock;
   };
 
   global_t global;
 
-  const allocator_t system_allocator = { &system_allocate, &system_free };
-  const allocator_t custom_allocator = { &allocate,        &free        };
-
-#pragma optimize("", on)
-  allocator_guard::allocator_guard() noexcept
-    : allocator_guard(custom_allocator)
-  {
-
-  }
-
-  allocator_guard::allocator_guard(const allocator_t& new_allocator) noexcept
-    : previous_allocator_(allocator())
+  static auto host_context_hash(uintptr_t stack) noexcept -> size_t
   {
-    allocator(new_allocator);
+    return static_cast<size_t>(((stack >> 12) * 0x9e3779b97f4a7c15) >> 32) & (host_context_capacity - 1);
   }
 
-  allocator_guard::~allocator_guard() noexcept
+  //
+  // Context of the host stack the current CPU runs on, nullptr outside
+  // of the VMX-root mode.
+  //
+  static auto host_context() noexcept -> host_context_t*
   {
-    allocator(previous_allocator_);
-  }
-#pragma optimize("", off)
+    const auto mask = global.host_stack_mask;
 
-  auto initialize() noexcept -> error_code_t
-  {
-    //
-    // Initialize physical memory descriptor and MTRRs.
-    //
-    global.memory_descriptor.initialize();
-    global.memory_type_range_registers.initialize();
+    if (!mask)
+    {
+      return nullptr;
+    }
 
-    //
-    // Initialize lock.
-    //
-    global.lock.initialize();
+    const auto stack = static_cast<uintptr_t>(ia32_asm_read_rsp()) & mask;
 
-    //
-    // Set system allocator by default.
-    //
-    for (auto& allocator_item : global.allocator)
+    for (size_t i = 0, index = host_context_hash(stack); i < host_context_capacity; ++i, index = (index + 1) & (host_context_capacity - 1))
     {
-      allocator_item = system_allocator;
+      const auto key = global.host_context[index].stack.load(std::memory_order_relaxed);
+
+      if (key == stack)
+      {
+        return &global.host_context[index];
+      }
+
+      if (key == 0)
+      {
+        break;
+      }
     }
 
-    return error_code_t{};
+    return nullptr;
   }
 
-  void destroy() noexcept
+  static auto current_allocator() noexcept -> allocator_t&
   {
-    //
-    // Destroy all objects.
-    // Note that this method doesn't acquire the lock and
-    // assumes all allocations has been already freed.
-    //
-    global.memory_type_range_registers.destroy();
-    global.memory_descriptor.destroy();
-    global.lock.destroy();
+    if (const auto context = host_context())
+    {
+      return context->allocator;
+    }
 
-    //
-    // If no memory has been assigned - leave.
-    //
-    if (!global.base_address)
+    return global.allocator[mp::cpu_index()];
+  }
+
+  static auto current_tag() noexcept -> memory_tag&
+  {
+    if (const auto context = host_context())
     {
-      return;
+      return context->tag;
     }
 
-    //
-    // Mark memory of page_bitmap and page_allocation_map
-    // as freed.
-    //
-    // Note that everything "free" does is clear bits in
-    // page_bitmap and sets 0 to particular page_allocation_map
-    // items.
-    //
-    // These two calls are needed to assure that the next two
-    // asserts below will pass.
-    //
-    free(global.page_bitmap->buffer());
-    free(global.page_allocation_map);
+    return global.tag[mp::cpu_index()];
+  }
 
-    //
-    // Checks for memory leaks.
-    //
-    hvpp_assert(global.page_bitmap->all_clear());
+  const allocator_t system_allocator = { &system_allocate, &system_free };
+  const allocator_t custom_allocator = { &allocate,        &free        };
 
-    //
-    // Checks for allocator corruption.
-    //
-    hvpp_assert(std::all_of(
-      global.page_allocation_map,
-      global.page_allocation_map + global.page_allocation_map_size / sizeof(pgmap_t),
-      [](auto page_count) { return page_count == 0; }));
+  static auto scratch_allocate(size_t size) noexcept -> void*;
+  static void scratch_free(void* address) noexcept;
 
-    global.base_address = nullptr;
-    global.available_size = 0;
+  const allocator_t scratch_allocator = { &scratch_allocate, &scratch_free };
 
-    global.page_bitmap.destroy();
-    global.page_bitmap_buffer_size = 0;
+  //
+  // Interrupts are disabled while per-CPU magazine is accessed - this
+  // prevents both preemption of the current thread (and migration to
+  // another CPU) and re-entrance from an interrupt handler.
+  //
+  class interrupt_guard
+  {
+    public:
+      interrupt_guard() noexcept : eflags_{ ia32_asm_read_eflags() } { ia32_asm_disable_interrupts(); }
+      ~interrupt_guard() noexcept { ia32_asm_write_eflags(eflags_); }
 
-    global.page_allocation_map = nullptr;
-    global.page_allocation_map_size = 0;
+      interrupt_guard(const interrupt_guard& other) noexcept = delete;
+      interrupt_guard(interrupt_guard&& other) noexcept = delete;
+      interrupt_guard& operator=(const interrupt_guard& other) noexcept = delete;
+      interrupt_guard& operator=(interrupt_guard&& other) noexcept = delete;
 
-    global.last_page_offset = 0;
-    global.allocated_bytes = 0;
-    global.free_bytes = 0;
-  }
+    private:
+      uint64_t eflags_;
+  };
 
-  auto assign(void* address, size_t size) noexcept -> error_code_t
+  static size_t pfn_hash(uint64_t pfn) noexcept
   {
-    if (size < ia32::page_size * 3)
-    {
-      //
-      // We need at least 3 pages (see explanation below).
-      //
-      hvpp_assert(0);
-      return make_error_code_t(std::errc::invalid_argument);
-    }
+    return static_cast<size_t>((pfn * 0x9e3779b97f4a7c15) >> 32) & (global.pfn_table_capacity - 1);
+  }
 
+  static auto pfn_table_build(size_t page_count) noexcept -> error_code_t
+  {
     //
-    // If the provided address is not page aligned, align it
-    // to the next page.
+    // Record physical address of each page of the pool, so that
+    // translations of the hypervisor-owned memory (e.g. EPT walks)
+    // don't have to call the OS.  Pages of the pool are non-paged,
+    // therefore their physical addresses never change.
     //
-    if (ia32::byte_offset(address) != 0)
-    {
-      uint32_t lost_bytes = ia32::byte_offset(address);
-
-      address = reinterpret_cast<uint8_t*>(ia32::page_align(address)) + ia32::page_size;
+    // Note that global.page_pfn is published after it's filled - until
+    // then, ia32::detail::pa_from_va() asks the OS.
+    //
+    auto page_pfn = reinterpret_cast<uint64_t*>(system_allocate(page_count * sizeof(uint64_t)));
 
-      //
-      // Subtract amount of "lost" bytes due to alignment.
-      //
-      size -= lost_bytes;
+    if (!page_pfn)
+    {
+      return make_error_code_t(std::errc::not_enough_memory);
     }
 
-    //
-    // Align size to the page boundary.
-    //
-    size = ia32::page_align(size);
+    bool contiguous = true;
 
-    //
-    // Check again.
-    //
-    if (size < ia32::page_size * 3)
+    for (size_t i = 0; i < page_count; ++i)
     {
-      hvpp_assert(0);
-      return make_error_code_t(std::errc::invalid_argument);
+      page_pfn[i] = ia32::pa_t::from_va(global.base_address + i * ia32::page_size).pfn();
+      contiguous &= page_pfn[i] == page_pfn[0] + i;
     }
 
     //
-    // Address is page-aligned, size is page-aligned, and all
-    // requirements are met.  Proceed with initialization.
+    // Physically contiguous pool is translated by a fixed offset,
+    // otherwise PFNs are looked up in an open-addressed hash table
+    // (at most half full).
     //
+    if (!contiguous)
+    {
+      size_t capacity = 1;
 
-    //
-    // The provided memory is split up to 3 parts:
-    //   1. page bitmap - stores information if page is allocated
-    //      or not
-    //   2. page count  - stores information how many consecutive
-    //      pages has been allocated
-    //   3. memory pool - this is the memory which will be provided
-    //
-    // For (1), there is taken (size / PAGE_SIZE / 8) bytes from the
-    //          provided memory space.
-    // For (2), there is taken (size / PAGE_SIZE * sizeof(pgmap_t))
-    //          bytes from the provided memory space.
-    // The rest memory is used for (3).
-    //
-    // This should account for ~93% of the provided memory space (if
-    // it is big enough, e.g.: 32MB).
-    //
+      while (capacity < page_count * 2)
+      {
+        capacity <<= 1;
+      }
 
-    //
-    // Construct the page bitmap.
-    //
-    uint8_t* page_bitmap_buffer = reinterpret_cast<uint8_t*>(address);
-    global.page_bitmap_buffer_size = static_cast<int>(ia32::round_to_pages(size / ia32::page_size / 8));
-    memset(page_bitmap_buffer, 0, global.page_bitmap_buffer_size);
+      auto pfn_table = reinterpret_cast<uint32_t*>(system_allocate(capacity * sizeof(uint32_t)));
 
-    int page_bitmap_size_in_bits = static_cast<int>(size / ia32::page_size);
-    global.page_bitmap.initialize(page_bitmap_buffer, page_bitmap_size_in_bits);
+      if (!pfn_table)
+      {
+        system_free(page_pfn);
+        return make_error_code_t(std::errc::not_enough_memory);
+      }
 
-    //
-    // Construct the page allocation map.
-    //
-    global.page_allocation_map = reinterpret_cast<pgmap_t*>(page_bitmap_buffer + global.page_bitmap_buffer_size);
-    global.page_allocation_map_size = static_cast<int>(ia32::round_to_pages(size / ia32::page_size) * sizeof(pgmap_t));
-    memset(global.page_allocation_map, 0, global.page_allocation_map_size);
+      memset(pfn_table, 0, capacity * sizeof(uint32_t));
 
-    //
-    // Compute available memory.
-    //
-    global.base_address = reinterpret_cast<uint8_t*>(address);
-    global.available_size = size;
+      global.pfn_table_capacity = capacity;
 
-    //
-    // Mark memory of page_bitmap and page_allocation_map as allocated.
-    // The return value of these allocations should return the exact
-    // address of page_bitmap_buffer and page_allocation_map.
-    //
-    void* page_bitmap_buffer_tmp  = allocate(global.page_bitmap_buffer_size);
-    void* page_allocation_map_tmp = allocate(global.page_allocation_map_size);
+      for (size_t i = 0; i < page_count; ++i)
+      {
+        auto index = pfn_hash(page_pfn[i]);
 
-    hvpp_assert(reinterpret_cast<uintptr_t>(       page_bitmap_buffer)  == reinterpret_cast<uintptr_t>(page_bitmap_buffer_tmp));
-    hvpp_assert(reinterpret_cast<uintptr_t>(global.page_allocation_map) == reinterpret_cast<uintptr_t>(page_allocation_map_tmp));
+        while (pfn_table[index])
+        {
+          index = (index + 1) & (capacity - 1);
+        }
 
-    (void)(page_bitmap_buffer_tmp);
-    (void)(page_allocation_map_tmp);
+        pfn_table[index] = static_cast<uint32_t>(i + 1);
+      }
 
-    //
-    // Initialize memory pool with garbage.
-    // This should help with debugging uninitialized variables
-    // and class members.
-    //
-    int reserved_bytes = static_cast<int>(global.page_bitmap_buffer_size + global.page_allocation_map_size);
-    memset(global.base_address + reserved_bytes, 0xcc, size - reserved_bytes);
+      global.pfn_table = pfn_table;
+    }
 
-    //
-    // Set initial values of allocated/free bytes.
-    //
-    global.allocated_bytes = 0;
-    global.free_bytes = size;
+    global.base_pfn   = page_pfn[0];
+    global.contiguous = contiguous;
+    global.page_pfn   = page_pfn;
 
     return error_code_t{};
   }
 
-  auto allocate(size_t size) noexcept -> void*
+  static void pfn_table_destroy() noexcept
   {
-    hvpp_assert(global.base_address != nullptr && global.available_size > 0);
+    auto page_pfn  = global.page_pfn;
+    auto pfn_table = global.pfn_table;
 
+    global.page_pfn           = nullptr;
+    global.pfn_table          = nullptr;
+    global.pfn_table_capacity = 0;
+    global.base_pfn           = 0;
+    global.contiguous         = false;
+
+    system_free(pfn_table);
+    system_free(page_pfn);
+  }
+
+  static int magazine_class(int page_count) noexcept
+  {
     //
-    // Return at least 1 page, even if someone required 0.
+    // Returns index of the magazine for the run of page_count pages,
+    // or -1 if such runs aren't cached.
     //
-    if (size == 0)
+    switch (page_count)
     {
-      hvpp_assert(0);
-      size = 1;
+      case 1: return 0;
+      case 2: return 1;
+      case 4: return 2;
+      case 8: return 3;
+      default: return -1;
     }
+  }
 
-    int page_count = static_cast<int>(ia32::bytes_to_pages(size));
-
+  static void summary_update(int offset, int page_count) noexcept
+  {
     //
-    // Check if the desired number of pages can fit into the
-    // allocation map.
+    // Recompute bits of the page summary for all words of the page
+    // bitmap touched by the range [offset, offset + page_count).
     //
-    if (page_count > std::numeric_limits<pgmap_t>::max() - 1)
+    const auto words = reinterpret_cast<const uint64_t*>(global.page_bitmap->buffer());
+
+    const int first_word = offset / 64;
+    const int last_word  = (offset + page_count - 1) / 64;
+
+    for (int word_index = first_word; word_index <= last_word; ++word_index)
     {
-      hvpp_assert(0);
-      return nullptr;
+      if (words[word_index] == ~uint64_t(0))
+      {
+        global.page_summary->set(word_index);
+      }
+      else
+      {
+        global.page_summary->clear(word_index);
+      }
     }
+  }
 
-    int previous_page_offset;
+  static int find_free_run(int offset, int page_count) noexcept
+  {
+    //
+    // Find run of page_count free pages starting at offset or above.
+    // Returns page offset, or -1 if there is no such run.
+    //
+    const auto words = reinterpret_cast<const uint64_t*>(global.page_bitmap->buffer());
+    const int  total = global.page_bitmap->size_in_bits();
 
-    {
-      std::lock_guard _(*global.lock);
+    int run_offset = offset;
+    int run_length = 0;
 
-      global.last_page_offset = global.page_bitmap->find_first_clear(global.last_page_offset, page_count);
+    while (offset < total)
+    {
+      const int word_index = offset / 64;
+
+      if (offset % 64 == 0)
+      {
+        if (global.page_summary->test(word_index))
+        {
+          //
+          // Whole word is allocated - skip all consecutive full
+          // words using the page summary (64 words at once, if
+          // possible).
+          //
+          const auto summary = reinterpret_cast<const uint64_t*>(global.page_summary->buffer());
+          const int  summary_total = global.page_summary->size_in_bits();
+
+          int next_word = word_index + 1;
+
+          while (next_word < summary_total)
+          {
+            if (next_word % 64 == 0 && summary[next_word / 64] == ~uint64_t(0))
+            {
+              next_word += 64;
+            }
+            else if (global.page_summary->test(next_word))
+            {
+              next_word += 1;
+            }
+            else
+            {
+              break;
+            }
+          }
+
+          offset     = next_word * 64;
+          run_offset = offset;
+          run_length = 0;
+          continue;
+        }
+
+        if (words[word_index] == 0)
+        {
+          //
+          // Whole word is free.
+          //
+          const int length = std::min(64, total - offset);
+
+          offset     += length;
+          run_length += length;
+
+          if (run_length >= page_count)
+          {
+            return run_offset;
+          }
+
+          continue;
+        }
+      }
+
+      if (words[word_index] & (uint64_t(1) << (offset % 64)))
+      {
+        offset    += 1;
+        run_offset = offset;
+        run_length = 0;
+      }
+      else
+      {
+        offset     += 1;
+        run_length += 1;
+
+        if (run_length >= page_count)
+        {
+          return run_offset;
+        }
+      }
+    }
+
+    return -1;
+  }
+
+  static int allocate_pages_locked(int page_count) noexcept
+  {
+    //
+    // Find and mark run of free pages.  Returns page offset,
+    // or -1 if there is not enough memory.  Caller must hold the lock.
+    //
+    global.last_page_offset = find_free_run(global.last_page_offset, page_count);
+
+    if (global.last_page_offset == -1)
+    {
+      global.last_page_offset = 0;
+      global.last_page_offset = find_free_run(global.last_page_offset, page_count);
 
       if (global.last_page_offset == -1)
       {
-        global.last_page_offset = 0;
-        global.last_page_offset = global.page_bitmap->find_first_clear(global.last_page_offset, page_count);
+        global.last_page_offset = 0;
+        return -1;
+      }
+    }
+
+    global.page_bitmap->set(global.last_page_offset, page_count);
+    summary_update(global.last_page_offset, page_count);
+    global.page_allocation_map[global.last_page_offset] = static_cast<pgmap_t>(page_count);
+
+    int result = global.last_page_offset;
+    global.last_page_offset += page_count;
+
+    global.allocated_bytes += page_count * ia32::page_size;
+    global.free_bytes      -= page_count * ia32::page_size;
+
+    global.peak_allocated_bytes = std::max(global.peak_allocated_bytes, global.allocated_bytes);
+
+    return result;
+  }
+
+  static void free_pages_locked(int offset) noexcept
+  {
+    //
+    // Caller must hold the lock.
+    //
+    int page_count = global.page_allocation_map[offset];
+    global.page_allocation_map[offset] = 0;
+
+    global.page_bitmap->clear(offset, page_count);
+    summary_update(offset, page_count);
+
+    global.allocated_bytes -= page_count * ia32::page_size;
+    global.free_bytes      += page_count * ia32::page_size;
+  }
+
+  static int largest_free_run_locked() noexcept
+  {
+    //
+    // Returns length of the longest run of free pages.
+    // Caller must hold the lock.
+    //
+    const auto words = reinterpret_cast<const uint64_t*>(global.page_bitmap->buffer());
+    const int  total = global.page_bitmap->size_in_bits();
+
+    int result     = 0;
+    int run_length = 0;
+
+    for (int offset = 0; offset < total; )
+    {
+      const int word_index = offset / 64;
+
+      if (offset % 64 == 0 && global.page_summary->test(word_index))
+      {
+        offset    += 64;
+        run_length = 0;
+        continue;
+      }
+
+      if (offset % 64 == 0 && words[word_index] == 0)
+      {
+        const int length = std::min(64, total - offset);
+
+        offset     += length;
+        run_length += length;
+        result      = std::max(result, run_length);
+        continue;
+      }
+
+      if (words[word_index] & (uint64_t(1) << (offset % 64)))
+      {
+        run_length = 0;
+      }
+      else
+      {
+        run_length += 1;
+        result      = std::max(result, run_length);
+      }
+
+      offset += 1;
+    }
+
+    return result;
+  }
+
+  static int page_offset(void* address) noexcept
+  {
+    return static_cast<int>((reinterpret_cast<uint8_t*>(address) - global.base_address) / ia32::page_size);
+  }
+
+  static void magazine_refill(magazine_t& magazine, int page_count) noexcept
+  {
+    //
+    // Caller must hold the magazine lock.
+    //
+    global_lock_t::guard _(*global.lock);
+
+    while (magazine.count < magazine_batch_size)
+    {
+      int offset = allocate_pages_locked(page_count);
+
+      if (offset == -1)
+      {
+        break;
+      }
+
+      global.page_allocation_map[offset] |= magazine_page_flag;
+      magazine.item[magazine.count++] = global.base_address + offset * ia32::page_size;
+    }
+  }
+
+  static void magazine_drain(magazine_t& magazine, int count) noexcept
+  {
+    //
+    // Caller must hold the magazine lock.
+    //
+    global_lock_t::guard _(*global.lock);
+
+    while (magazine.count > 0 && count-- > 0)
+    {
+      const int offset = page_offset(magazine.item[--magazine.count]);
+
+      global.page_allocation_map[offset] &= ~magazine_page_flag;
+      free_pages_locked(offset);
+    }
+  }
+
+  static bool magazine_drain_all() noexcept
+  {
+    //
+    // Return runs cached in magazines of all CPUs back to the page
+    // bitmap, so that they can be merged into larger runs (or used
+    // by other size classes).  Returns true if any run has been
+    // returned.  Caller must not hold any magazine lock.
+    //
+    bool result = false;
+
+    for (auto& cpu_magazine : global.magazine)
+    {
+      for (auto& magazine : cpu_magazine)
+      {
+        interrupt_guard _;
+        std::lock_guard magazine_lock{ magazine.lock };
+
+        if (magazine.count > 0)
+        {
+          magazine_drain(magazine, magazine_size);
+          result = true;
+        }
+      }
+    }
+
+    return result;
+  }
+
+  static auto magazine_allocate(int magazine_index, int page_count, memory_tag tag) noexcept -> void*
+  {
+    interrupt_guard _;
+
+    auto& magazine = global.magazine[mp::cpu_index()][magazine_index];
+    std::lock_guard magazine_lock{ magazine.lock };
+
+    if (magazine.count == 0)
+    {
+      magazine_refill(magazine, page_count);
+    }
+
+    if (magazine.count == 0)
+    {
+      return nullptr;
+    }
+
+    auto result = magazine.item[--magazine.count];
+    const int offset = page_offset(result);
+
+    global.page_allocation_map[offset] &= ~magazine_page_flag;
+    global.page_tag[offset] = static_cast<uint8_t>(tag);
+    return result;
+  }
+
+  static int slab_class(size_t size) noexcept
+  {
+    //
+    // Returns index of the slab size class for the allocation,
+    // or -1 if the allocation is too big for slabs.
+    //
+    for (int i = 0; i < slab_class_count; ++i)
+    {
+      if (size <= slab_class_size[i])
+      {
+        return i;
+      }
+    }
+
+    return -1;
+  }
+
+  static slab_t* slab_from_page(void* page) noexcept
+  {
+    return reinterpret_cast<slab_t*>(reinterpret_cast<uint8_t*>(page) + ia32::page_size - sizeof(slab_t));
+  }
+
+  static void* slab_page(slab_t* slab) noexcept
+  {
+    return reinterpret_cast<uint8_t*>(slab) + sizeof(slab_t) - ia32::page_size;
+  }
+
+  static auto allocate_internal(size_t size, memory_tag tag) noexcept -> void*;
+  static void free_internal(void* address) noexcept;
+
+  static slab_t* slab_create(int slab_index, memory_tag tag) noexcept
+  {
+    //
+    // Allocate new page (of the same tag as its objects) and split
+    // it into objects.
+    //
+    auto page = reinterpret_cast<uint8_t*>(allocate_internal(ia32::page_size, tag));
+
+    if (!page)
+    {
+      return nullptr;
+    }
+
+    const auto object_size  = slab_class_size[slab_index];
+    const auto object_count = static_cast<uint16_t>((ia32::page_size - sizeof(slab_t)) / object_size);
+
+    auto slab = ::new (static_cast<void*>(slab_from_page(page))) slab_t{};
+    slab->owned        = true;
+    slab->object_size  = static_cast<uint16_t>(object_size);
+    slab->object_count = object_count;
+    slab->free_count   = object_count;
+    slab->free_list    = nullptr;
+
+    for (int i = object_count - 1; i >= 0; --i)
+    {
+      auto object = reinterpret_cast<slab_object_t*>(page + i * object_size);
+      object->next = slab->free_list;
+      slab->free_list = object;
+    }
+
+    //
+    // Mark the page as slab page.
+    //
+    global.page_allocation_map[page_offset(page)] |= slab_page_flag;
+
+    return slab;
+  }
+
+  static void slab_destroy(slab_t* slab) noexcept
+  {
+    auto page = slab_page(slab);
+
+    global.page_allocation_map[page_offset(page)] &= ~slab_page_flag;
+    slab->~slab_t();
+
+    free_internal(page);
+  }
+
+  static void* slab_allocate(int slab_index, memory_tag tag) noexcept
+  {
+    interrupt_guard _;
+
+    auto& cpu_slab = global.slab[mp::cpu_index()][static_cast<int>(tag)][slab_index];
+
+    if (!cpu_slab)
+    {
+      cpu_slab = slab_create(slab_index, tag);
+
+      if (!cpu_slab)
+      {
+        return nullptr;
+      }
+    }
+
+    slab_t* slab = cpu_slab;
+
+    std::lock_guard slab_lock(slab->lock);
+
+    auto object = slab->free_list;
+    slab->free_list = object->next;
+    slab->free_count -= 1;
+
+    if (slab->free_count == 0)
+    {
+      //
+      // The slab is exhausted - next allocation will create new one.
+      // This slab is released once all its objects are freed.
+      //
+      slab->owned = false;
+      cpu_slab = nullptr;
+    }
+
+    return object;
+  }
+
+  static int statistics_class(size_t size) noexcept
+  {
+    if (int slab_index = slab_class(size); slab_index != -1)
+    {
+      return slab_index;
+    }
+
+    if (int magazine_index = magazine_class(static_cast<int>(ia32::bytes_to_pages(size))); magazine_index != -1)
+    {
+      return slab_class_count + magazine_index;
+    }
+
+    return slab_class_count + magazine_class_count;
+  }
+
+  static int statistics_latency_bucket(uint64_t ticks) noexcept
+  {
+    int bucket = 0;
+
+    while ((ticks >>= 1) != 0 && bucket < statistics_t::latency_bucket_count - 1)
+    {
+      bucket += 1;
+    }
+
+    return bucket;
+  }
+
+  static bool allocation_info(void* address, memory_tag& tag, size_t& size) noexcept
+  {
+    //
+    // Tag and size (rounded up to the size class) of the allocation
+    // at the address.  Returns false if the address doesn't point to
+    // allocated memory of the pool.  As with free_internal(), the page
+    // allocation map can be read without the lock.
+    //
+    if (reinterpret_cast<uint8_t*>(address) <  global.base_address ||
+        reinterpret_cast<uint8_t*>(address) >= global.base_address + global.available_size)
+    {
+      return false;
+    }
+
+    const int offset     = page_offset(address);
+    const int page_count = global.page_allocation_map[offset];
+
+    if (page_count & slab_page_flag)
+    {
+      size = slab_from_page(ia32::page_align(address))->object_size;
+    }
+    else if (page_count & magazine_page_flag)
+    {
+      return false;
+    }
+    else if (page_count != 0)
+    {
+      size = page_count * ia32::page_size;
+    }
+    else
+    {
+      return false;
+    }
+
+    tag = static_cast<memory_tag>(global.page_tag[offset]);
+    return true;
+  }
+
+  static void slab_free(void* address) noexcept
+  {
+    auto slab = slab_from_page(ia32::page_align(address));
+    bool release;
+
+    {
+      std::lock_guard slab_lock(slab->lock);
+
+      auto object = reinterpret_cast<slab_object_t*>(address);
+      object->next = slab->free_list;
+      slab->free_list = object;
+      slab->free_count += 1;
+
+      release = !slab->owned && slab->free_count == slab->object_count;
+    }
+
+    if (release)
+    {
+      slab_destroy(slab);
+    }
+  }
+
+#pragma optimize("", on)
+  tag_guard::tag_guard(memory_tag new_tag) noexcept
+    : previous_tag_(allocation_tag())
+  {
+    allocation_tag(new_tag);
+  }
+
+  tag_guard::~tag_guard() noexcept
+  {
+    allocation_tag(previous_tag_);
+  }
+
+  allocator_guard::allocator_guard() noexcept
+    : allocator_guard(custom_allocator)
+  {
+
+  }
+
+  allocator_guard::allocator_guard(const allocator_t& new_allocator) noexcept
+    : previous_allocator_(allocator())
+  {
+    allocator(new_allocator);
+  }
+
+  allocator_guard::~allocator_guard() noexcept
+  {
+    allocator(previous_allocator_);
+  }
+#pragma optimize("", off)
+
+  auto initialize() noexcept -> error_code_t
+  {
+    //
+    // Initialize physical memory descriptor and MTRRs.
+    //
+    global.memory_descriptor.initialize();
+    global.memory_type_range_registers.initialize();
+
+    //
+    // Initialize lock.
+    //
+    global.lock.initialize();
+
+    //
+    // Set system allocator by default.
+    //
+    for (auto& allocator_item : global.allocator)
+    {
+      allocator_item = system_allocator;
+    }
+
+    return error_code_t{};
+  }
+
+  void destroy() noexcept
+  {
+    //
+    // Destroy all objects.
+    // Note that this method doesn't acquire the lock and
+    // assumes all allocations has been already freed.
+    //
+    global.memory_type_range_registers.destroy();
+    global.memory_descriptor.destroy();
+    global.lock.destroy();
+
+    //
+    // If no memory has been assigned - leave.
+    //
+    if (!global.base_address)
+    {
+      return;
+    }
+
+    //
+    // Mark memory of page_bitmap, page_allocation_map and
+    // page_summary as freed.
+    //
+    // Note that everything "free" does is clear bits in
+    // page_bitmap and sets 0 to particular page_allocation_map
+    // items.
+    //
+    // These calls are needed to assure that the next two
+    // asserts below will pass.
+    //
+    free(global.page_bitmap->buffer());
+    free(global.page_allocation_map);
+    free(global.page_summary->buffer());
+    free(global.page_tag);
+
+    //
+    // Release current slabs of all CPUs.  All their objects should
+    // be freed by now.
+    //
+    for (auto& cpu_slab : global.slab)
+    {
+      for (auto& tag_slab : cpu_slab)
+      {
+        for (auto& slab : tag_slab)
+        {
+          if (slab)
+          {
+            hvpp_assert(slab->free_count == slab->object_count);
+            slab_destroy(slab);
+            slab = nullptr;
+          }
+        }
+      }
+    }
+
+    //
+    // Return all runs cached in per-CPU magazines back
+    // to the page bitmap.
+    //
+    magazine_drain_all();
+
+    //
+    // Checks for memory leaks.
+    //
+    hvpp_assert(global.page_bitmap->all_clear());
+
+    //
+    // Checks for allocator corruption.
+    //
+    hvpp_assert(std::all_of(
+      global.page_allocation_map,
+      global.page_allocation_map + global.page_allocation_map_size / sizeof(pgmap_t),
+      [](auto page_count) { return page_count == 0; }));
+
+    pfn_table_destroy();
+
+    global.base_address = nullptr;
+    global.available_size = 0;
+
+    global.page_bitmap.destroy();
+    global.page_bitmap_buffer_size = 0;
+
+    global.page_allocation_map = nullptr;
+    global.page_allocation_map_size = 0;
+
+    global.page_summary.destroy();
+    global.page_summary_buffer_size = 0;
+
+    global.page_tag = nullptr;
+    global.page_tag_size = 0;
+
+    global.last_page_offset = 0;
+    global.allocated_bytes = 0;
+    global.free_bytes = 0;
+    global.peak_allocated_bytes = 0;
+
+    memset(global.statistics, 0, sizeof(global.statistics));
+  }
+
+  auto assign(void* address, size_t size) noexcept -> error_code_t
+  {
+    if (size < ia32::page_size * 4)
+    {
+      //
+      // We need at least 4 pages (see explanation below).
+      //
+      hvpp_assert(0);
+      return make_error_code_t(std::errc::invalid_argument);
+    }
+
+    //
+    // If the provided address is not page aligned, align it
+    // to the next page.
+    //
+    if (ia32::byte_offset(address) != 0)
+    {
+      uint32_t lost_bytes = ia32::byte_offset(address);
+
+      address = reinterpret_cast<uint8_t*>(ia32::page_align(address)) + ia32::page_size;
+
+      //
+      // Subtract amount of "lost" bytes due to alignment.
+      //
+      size -= lost_bytes;
+    }
+
+    //
+    // Align size to the page boundary.
+    //
+    size = ia32::page_align(size);
+
+    //
+    // Check again.
+    //
+    if (size < ia32::page_size * 4)
+    {
+      hvpp_assert(0);
+      return make_error_code_t(std::errc::invalid_argument);
+    }
+
+    //
+    // Address is page-aligned, size is page-aligned, and all
+    // requirements are met.  Proceed with initialization.
+    //
+
+    //
+    // The provided memory is split up to 5 parts:
+    //   1. page bitmap  - stores information if page is allocated
+    //      or not
+    //   2. page count   - stores information how many consecutive
+    //      pages has been allocated
+    //   3. page summary - stores information if word of the page
+    //      bitmap is full
+    //   4. page tag     - stores tag of the allocated pages
+    //   5. memory pool  - this is the memory which will be provided
+    //
+    // For (1), there is taken (size / PAGE_SIZE / 8) bytes from the
+    //          provided memory space.
+    // For (2), there is taken (size / PAGE_SIZE * sizeof(pgmap_t))
+    //          bytes from the provided memory space.
+    // For (3), there is taken (size / PAGE_SIZE / 64 / 8) bytes from
+    //          the provided memory space.
+    // For (4), there is taken (size / PAGE_SIZE) bytes from the
+    //          provided memory space.
+    // The rest memory is used for (5).
+    //
+    // This should account for ~93% of the provided memory space (if
+    // it is big enough, e.g.: 32MB).
+    //
+
+    //
+    // Construct the page bitmap.
+    //
+    uint8_t* page_bitmap_buffer = reinterpret_cast<uint8_t*>(address);
+    global.page_bitmap_buffer_size = static_cast<int>(ia32::round_to_pages(size / ia32::page_size / 8));
+    memset(page_bitmap_buffer, 0, global.page_bitmap_buffer_size);
+
+    int page_bitmap_size_in_bits = static_cast<int>(size / ia32::page_size);
+    global.page_bitmap.initialize(page_bitmap_buffer, page_bitmap_size_in_bits);
+
+    //
+    // Construct the page allocation map.
+    //
+    global.page_allocation_map = reinterpret_cast<pgmap_t*>(page_bitmap_buffer + global.page_bitmap_buffer_size);
+    global.page_allocation_map_size = static_cast<int>(ia32::round_to_pages(size / ia32::page_size) * sizeof(pgmap_t));
+    memset(global.page_allocation_map, 0, global.page_allocation_map_size);
+
+    //
+    // Construct the page summary.
+    //
+    uint8_t* page_summary_buffer = reinterpret_cast<uint8_t*>(global.page_allocation_map) + global.page_allocation_map_size;
+    int page_summary_size_in_bits = (page_bitmap_size_in_bits + 63) / 64;
+    global.page_summary_buffer_size = static_cast<int>(ia32::round_to_pages((page_summary_size_in_bits + 7) / 8));
+    memset(page_summary_buffer, 0, global.page_summary_buffer_size);
+
+    global.page_summary.initialize(page_summary_buffer, page_summary_size_in_bits);
+
+    //
+    // Construct the page tag map.
+    //
+    global.page_tag = page_summary_buffer + global.page_summary_buffer_size;
+    global.page_tag_size = static_cast<int>(ia32::round_to_pages(size / ia32::page_size));
+    memset(global.page_tag, 0, global.page_tag_size);
+
+    //
+    // Compute available memory.
+    //
+    global.base_address = reinterpret_cast<uint8_t*>(address);
+    global.available_size = size;
+
+    //
+    // Build the PA -> VA translation table of the pool.
+    //
+    if (auto err = pfn_table_build(size / ia32::page_size))
+    {
+      global.base_address = nullptr;
+      global.available_size = 0;
+      return err;
+    }
+
+    //
+    // Mark memory of page_bitmap, page_allocation_map, page_summary and
+    // page_tag as allocated.  The return value of these allocations
+    // should return the exact address of page_bitmap_buffer,
+    // page_allocation_map, page_summary_buffer and page_tag.
+    //
+    // Note that these allocations bypass per-CPU magazines.
+    //
+    void* page_bitmap_buffer_tmp  = global.base_address + allocate_pages_locked(static_cast<int>(ia32::bytes_to_pages(global.page_bitmap_buffer_size)))  * ia32::page_size;
+    void* page_allocation_map_tmp = global.base_address + allocate_pages_locked(static_cast<int>(ia32::bytes_to_pages(global.page_allocation_map_size))) * ia32::page_size;
+    void* page_summary_buffer_tmp = global.base_address + allocate_pages_locked(static_cast<int>(ia32::bytes_to_pages(global.page_summary_buffer_size))) * ia32::page_size;
+    void* page_tag_tmp            = global.base_address + allocate_pages_locked(static_cast<int>(ia32::bytes_to_pages(global.page_tag_size)))            * ia32::page_size;
+
+    hvpp_assert(reinterpret_cast<uintptr_t>(       page_bitmap_buffer)  == reinterpret_cast<uintptr_t>(page_bitmap_buffer_tmp));
+    hvpp_assert(reinterpret_cast<uintptr_t>(global.page_allocation_map) == reinterpret_cast<uintptr_t>(page_allocation_map_tmp));
+    hvpp_assert(reinterpret_cast<uintptr_t>(       page_summary_buffer) == reinterpret_cast<uintptr_t>(page_summary_buffer_tmp));
+    hvpp_assert(reinterpret_cast<uintptr_t>(global.page_tag)            == reinterpret_cast<uintptr_t>(page_tag_tmp));
+
+    (void)(page_bitmap_buffer_tmp);
+    (void)(page_allocation_map_tmp);
+    (void)(page_summary_buffer_tmp);
+    (void)(page_tag_tmp);
+
+    //
+    // Initialize memory pool with garbage.
+    // This should help with debugging uninitialized variables
+    // and class members.
+    //
+    int reserved_bytes = static_cast<int>(global.page_bitmap_buffer_size + global.page_allocation_map_size + global.page_summary_buffer_size + global.page_tag_size);
+    memset(global.base_address + reserved_bytes, 0xcc, size - reserved_bytes);
+
+    //
+    // Set initial values of allocated/free bytes.
+    //
+    global.allocated_bytes = 0;
+    global.free_bytes = size;
+    global.peak_allocated_bytes = 0;
+
+    return error_code_t{};
+  }
+
+  static auto allocate_internal(size_t size, memory_tag tag) noexcept -> void*
+  {
+    hvpp_assert(global.base_address != nullptr && global.available_size > 0);
+
+    //
+    // Return at least 1 byte, even if someone required 0.
+    //
+    if (size == 0)
+    {
+      hvpp_assert(0);
+      size = 1;
+    }
+
+    //
+    // Small allocations are served from slabs.
+    //
+    if (int slab_index = slab_class(size); slab_index != -1)
+    {
+      auto result = slab_allocate(slab_index, tag);
+
+      //
+      // Not enough memory...
+      //
+      hvpp_assert(result != nullptr);
+      return result;
+    }
+
+    int page_count = static_cast<int>(ia32::bytes_to_pages(size));
+
+    //
+    // Check if the desired number of pages can fit into the
+    // allocation map.
+    //
+    if (page_count >= magazine_page_flag)
+    {
+      hvpp_assert(0);
+      return nullptr;
+    }
+
+    //
+    // Try the per-CPU magazine first.  If neither the magazine nor the
+    // page bitmap has a free run, take back runs cached by all CPUs.
+    //
+    if (int magazine_index = magazine_class(page_count); magazine_index != -1)
+    {
+      if (auto result = magazine_allocate(magazine_index, page_count, tag))
+      {
+        return result;
+      }
+
+      if (magazine_drain_all())
+      {
+        if (auto result = magazine_allocate(magazine_index, page_count, tag))
+        {
+          return result;
+        }
+      }
+
+      //
+      // Not enough memory...
+      //
+      hvpp_assert(0);
+      return nullptr;
+    }
+
+    int previous_page_offset;
+
+    for (bool drained = false; ; drained = true)
+    {
+      {
+        global_lock_t::guard _(*global.lock);
 
-        if (global.last_page_offset == -1)
-        {
-          //
-          // Not enough memory...
-          //
-          hvpp_assert(0);
-          return nullptr;
-        }
+        previous_page_offset = allocate_pages_locked(page_count);
       }
 
-      global.page_bitmap->set(global.last_page_offset, page_count);
-      global.page_allocation_map[global.last_page_offset] = static_cast<pgmap_t>(page_count);
-
-      previous_page_offset = global.last_page_offset;
-      global.last_page_offset += page_count;
+      if (previous_page_offset != -1 || drained || !magazine_drain_all())
+      {
+        break;
+      }
+    }
 
-      global.allocated_bytes += page_count * ia32::page_size;
-      global.free_bytes      -= page_count * ia32::page_size;
+    if (previous_page_offset == -1)
+    {
+      //
+      // Not enough memory...
+      //
+      hvpp_assert(0);
+      return nullptr;
     }
 
+    global.page_tag[previous_page_offset] = static_cast<uint8_t>(tag);
+
     //
     // Return the final address.
     // Note that we're not under lock here - we don't need it, because
@@ -363,14 +1341,9 @@ namespace mm
     return global.base_address + previous_page_offset * ia32::page_size;
   }
 
-  void free(void* address) noexcept
+  static void free_internal(void* address) noexcept
   {
-    //
-    // Our allocator always provides page-aligned memory.
-    //
-    hvpp_assert(ia32::byte_offset(address) == 0);
-
-    int offset = static_cast<int>(ia32::bytes_to_pages(reinterpret_cast<uint8_t*>(address) - global.base_address));
+    int offset = page_offset(address);
 
     if (address == nullptr)
     {
@@ -390,30 +1363,154 @@ namespace mm
       return;
     }
 
-    std::lock_guard _(*global.lock);
+    //
+    // Number of pages doesn't change while the memory is allocated,
+    // therefore we can read it without the lock.
+    //
+    int page_count = global.page_allocation_map[offset];
+
+    if (page_count & slab_page_flag)
+    {
+      slab_free(address);
+      return;
+    }
+
+    //
+    // Page allocations are always page-aligned.
+    //
+    hvpp_assert(ia32::byte_offset(address) == 0);
 
-    if (global.page_allocation_map[offset] == 0)
+    if (page_count == 0 || (page_count & magazine_page_flag))
     {
       //
-      // This memory wasn't allocated.
+      // This memory wasn't allocated (or it has already been freed
+      // and it's cached in a magazine).
       //
       hvpp_assert(0);
       return;
     }
 
     //
-    // Clear number of allocated pages.
+    // Put the run back to the per-CPU magazine.  If the magazine
+    // is full, return half of it back to the page bitmap first.
     //
-    int page_count = global.page_allocation_map[offset];
-    global.page_allocation_map[offset] = 0;
+    if (int magazine_index = magazine_class(page_count); magazine_index != -1)
+    {
+      interrupt_guard _;
+
+      auto& magazine = global.magazine[mp::cpu_index()][magazine_index];
+      std::lock_guard magazine_lock{ magazine.lock };
+
+      if (magazine.count == magazine_size)
+      {
+        magazine_drain(magazine, magazine_size - magazine_batch_size);
+      }
+
+      global.page_allocation_map[offset] |= magazine_page_flag;
+      magazine.item[magazine.count++] = address;
+      return;
+    }
+
+    global_lock_t::guard _(*global.lock);
+
+    free_pages_locked(offset);
+  }
+
+  auto allocate(size_t size) noexcept -> void*
+  {
+    return allocate(size, current_tag());
+  }
+
+  auto allocate_aligned(size_t size, size_t alignment) noexcept -> void*
+  {
+    hvpp_assert(alignment <= ia32::page_size && (alignment & (alignment - 1)) == 0);
 
     //
-    // Clear pages in the bitmap.
+    // Objects of power-of-2 slab classes are aligned to their size -
+    // requesting at least "alignment" bytes therefore suffices.  The
+    // 2016-byte class (aligned to 32 bytes) is skipped by requesting
+    // the whole page, which both the pool and the system allocator
+    // align to the page boundary.
     //
-    global.page_bitmap->clear(offset, page_count);
+    size = std::max(size, alignment);
 
-    global.allocated_bytes -= page_count * ia32::page_size;
-    global.free_bytes      += page_count * ia32::page_size;
+    if (alignment > 32 &&
+        size > slab_class_size[slab_class_count - 2] &&
+        size < ia32::page_size)
+    {
+      size = ia32::page_size;
+    }
+
+    //
+    // The scratch arena aligns only to arena::default_alignment.
+    //
+    auto& allocator = current_allocator();
+
+    return allocator.allocate == &scratch_allocate && alignment > arena::default_alignment
+      ? allocate(size)
+      : allocator.allocate(size);
+  }
+
+  auto allocate(size_t size, memory_tag tag) noexcept -> void*
+  {
+    hvpp_assert(static_cast<int>(tag) < memory_tag_count);
+
+    const auto start = ia32_asm_read_tsc();
+
+    auto result = allocate_internal(size, tag);
+
+    const auto ticks = ia32_asm_read_tsc() - start;
+
+    //
+    // Statistics of the current CPU.  Interrupts aren't disabled
+    // here - counters might be (very rarely) off by one, which is
+    // acceptable.
+    //
+    auto& cpu_statistics = global.statistics[mp::cpu_index()];
+
+    if (result)
+    {
+      cpu_statistics.allocation_count += 1;
+      cpu_statistics.class_bytes[statistics_class(size)] += size;
+      cpu_statistics.latency[statistics_latency_bucket(ticks)] += 1;
+
+      cpu_statistics.tag_bytes[static_cast<int>(tag)] += static_cast<int64_t>(slab_class(size) != -1
+        ? slab_class_size[slab_class(size)]
+        : ia32::round_to_pages(size));
+      cpu_statistics.tag_allocation_count[static_cast<int>(tag)] += 1;
+    }
+    else
+    {
+      cpu_statistics.failure_count += 1;
+    }
+
+    return result;
+  }
+
+  void free(void* address) noexcept
+  {
+    if (address)
+    {
+      auto& cpu_statistics = global.statistics[mp::cpu_index()];
+
+      cpu_statistics.free_count += 1;
+
+      memory_tag tag;
+      size_t size;
+
+      if (allocation_info(address, tag, size))
+      {
+        cpu_statistics.tag_bytes[static_cast<int>(tag)] -= static_cast<int64_t>(size);
+        cpu_statistics.tag_allocation_count[static_cast<int>(tag)] -= 1;
+      }
+    }
+
+    free_internal(address);
+  }
+
+  auto lock_statistics() noexcept -> spinlock_statistics_t
+  {
+    return global.lock->statistics();
   }
 
   auto system_allocate(size_t size) noexcept -> void*
@@ -426,6 +1523,31 @@ namespace mm
     detail::system_free(address);
   }
 
+  auto system_allocate_node(size_t size, uint32_t node) noexcept -> void*
+  {
+    return detail::system_allocate_node(size, node);
+  }
+
+  void system_free_node(void* address) noexcept
+  {
+    detail::system_free_node(address);
+  }
+
+  auto user_map(void* address, size_t size, user_mapping_t& mapping, bool read_only /* = false */) noexcept -> error_code_t
+  {
+    return detail::user_map(address, size, mapping, read_only);
+  }
+
+  void user_unmap(user_mapping_t& mapping) noexcept
+  {
+    detail::user_unmap(mapping);
+  }
+
+  bool user_mapping_owned(const user_mapping_t& mapping) noexcept
+  {
+    return detail::user_mapping_owned(mapping);
+  }
+
   auto allocated_bytes() noexcept -> size_t
   {
     return global.allocated_bytes;
@@ -436,14 +1558,304 @@ namespace mm
     return global.free_bytes;
   }
 
+  //
+  // Bytes of the host stack of the CPU which have been used - the stack
+  // grows down, so it's the distance between the first byte which
+  // doesn't hold host_stack_fill and the top of the stack.
+  //
+  static auto host_stack_used(uint32_t cpu_index) noexcept -> size_t
+  {
+    const auto mask = global.host_stack_mask;
+
+    if (!mask)
+    {
+      return 0;
+    }
+
+    const auto size = ~mask + 1;
+
+    for (const auto& context : global.host_context)
+    {
+      const auto stack = context.stack.load(std::memory_order_relaxed);
+
+      if (stack > 1 && context.cpu_index == cpu_index)
+      {
+        //
+        // The stack is concurrently used by its CPU - only the bytes
+        // below the high-water mark are read, and those aren't changing.
+        //
+        const auto data = reinterpret_cast<const volatile uint8_t*>(stack);
+
+        size_t unused = 0;
+        while (unused < size && data[unused] == host_stack_fill)
+        {
+          unused += 1;
+        }
+
+        return size - unused;
+      }
+    }
+
+    return 0;
+  }
+
+  auto statistics() noexcept -> statistics_t
+  {
+    auto result = statistics(-1);
+
+    //
+    // Merge statistics of all CPUs.
+    //
+    for (int cpu_index = 0; cpu_index < int(mp::cpu_count()); ++cpu_index)
+    {
+      const auto& cpu_statistics = global.statistics[cpu_index];
+
+      result.allocation_count += cpu_statistics.allocation_count;
+      result.free_count       += cpu_statistics.free_count;
+      result.failure_count    += cpu_statistics.failure_count;
+
+      for (int i = 0; i < statistics_t::class_count; ++i)
+      {
+        result.class_bytes[i] += cpu_statistics.class_bytes[i];
+      }
+
+      for (int i = 0; i < statistics_t::latency_bucket_count; ++i)
+      {
+        result.latency[i] += cpu_statistics.latency[i];
+      }
+
+      for (int i = 0; i < memory_tag_count; ++i)
+      {
+        result.tag_bytes[i]            += cpu_statistics.tag_bytes[i];
+        result.tag_allocation_count[i] += cpu_statistics.tag_allocation_count[i];
+      }
+
+      result.host_stack_used = std::max<uint64_t>(result.host_stack_used, host_stack_used(uint32_t(cpu_index)));
+    }
+
+    return result;
+  }
+
+  auto statistics(int cpu_index) noexcept -> statistics_t
+  {
+    //
+    // Returns statistics of the particular CPU (or only the pool-wide
+    // values if cpu_index is -1).
+    //
+    statistics_t result{};
+
+    if (cpu_index != -1)
+    {
+      hvpp_assert(cpu_index >= 0 && cpu_index < int(mp::cpu_count()));
+
+      const auto& cpu_statistics = global.statistics[cpu_index];
+
+      result.allocation_count = cpu_statistics.allocation_count;
+      result.free_count       = cpu_statistics.free_count;
+      result.failure_count    = cpu_statistics.failure_count;
+
+      std::copy_n(cpu_statistics.class_bytes, statistics_t::class_count,          result.class_bytes);
+      std::copy_n(cpu_statistics.latency,     statistics_t::latency_bucket_count, result.latency);
+
+      std::copy_n(cpu_statistics.tag_bytes,            memory_tag_count, result.tag_bytes);
+      std::copy_n(cpu_statistics.tag_allocation_count, memory_tag_count, result.tag_allocation_count);
+
+      result.host_stack_used = host_stack_used(uint32_t(cpu_index));
+    }
+
+    result.host_stack_size = global.host_stack_mask
+      ? ~global.host_stack_mask + 1
+      : 0;
+
+    if (global.base_address)
+    {
+      global_lock_t::guard _(*global.lock);
+
+      result.allocated_bytes      = global.allocated_bytes;
+      result.free_bytes           = global.free_bytes;
+      result.peak_allocated_bytes = global.peak_allocated_bytes;
+      result.largest_free_run     = largest_free_run_locked() * ia32::page_size;
+    }
+
+    return result;
+  }
+
   auto allocator() noexcept -> const allocator_t&
   {
-    return global.allocator[mp::cpu_index()];
+    return current_allocator();
   }
 
   void allocator(const allocator_t& new_allocator) noexcept
   {
-    global.allocator[mp::cpu_index()] = new_allocator;
+    current_allocator() = new_allocator;
+  }
+
+  auto allocation_tag() noexcept -> memory_tag
+  {
+    return current_tag();
+  }
+
+  void allocation_tag(memory_tag new_tag) noexcept
+  {
+    hvpp_assert(static_cast<int>(new_tag) < memory_tag_count);
+    current_tag() = new_tag;
+  }
+
+  auto memory_tag_name(memory_tag tag) noexcept -> const char*
+  {
+    switch (tag)
+    {
+      case memory_tag::untagged: return "untagged";
+      case memory_tag::vcpu:     return "vcpu";
+      case memory_tag::ept:      return "ept";
+      case memory_tag::stats:    return "stats";
+      case memory_tag::hook:     return "hook";
+      case memory_tag::trace:    return "trace";
+      default:                   return "unknown";
+    }
+  }
+
+  auto host_stack_register(void* stack, size_t size, uint32_t cpu_index) noexcept -> error_code_t
+  {
+    const auto key  = reinterpret_cast<uintptr_t>(stack);
+    const auto mask = ~static_cast<uintptr_t>(size - 1);
+
+    hvpp_assert(size && (size & (size - 1)) == 0 && (key & ~mask) == 0);
+    hvpp_assert(!global.host_stack_mask || global.host_stack_mask == mask);
+
+    for (size_t i = 0, index = host_context_hash(key); i < host_context_capacity; ++i, index = (index + 1) & (host_context_capacity - 1))
+    {
+      auto& context = global.host_context[index];
+      auto expected = context.stack.load(std::memory_order_relaxed);
+
+      //
+      // Stacks are registered concurrently (each CPU registers its
+      // own) - claim the slot first.  Nobody else looks up this key
+      // until the CPU enters the VMX-root mode, so the context can be
+      // filled after that.
+      //
+      if ((expected == 0 || expected == 1) &&
+          context.stack.compare_exchange_strong(expected, key, std::memory_order_relaxed))
+      {
+        context.cpu_index = cpu_index;
+        context.allocator = custom_allocator;
+        context.tag       = memory_tag::untagged;
+        global.host_stack_mask = mask;
+        return error_code_t{};
+      }
+    }
+
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  void host_stack_unregister(void* stack) noexcept
+  {
+    const auto key = reinterpret_cast<uintptr_t>(stack);
+
+    for (size_t i = 0, index = host_context_hash(key); i < host_context_capacity; ++i, index = (index + 1) & (host_context_capacity - 1))
+    {
+      auto& context = global.host_context[index];
+      const auto slot_key = context.stack.load(std::memory_order_relaxed);
+
+      if (slot_key == key)
+      {
+        //
+        // Keep the probe chains of other stacks intact.
+        //
+        context.stack.store(1, std::memory_order_relaxed);
+        return;
+      }
+
+      if (slot_key == 0)
+      {
+        return;
+      }
+    }
+  }
+
+  auto scratch_arena() noexcept -> arena*
+  {
+    return global.scratch[mp::cpu_index()];
+  }
+
+  void scratch_arena(uint32_t cpu_index, arena* new_arena) noexcept
+  {
+    hvpp_assert(cpu_index < HVPP_MAX_CPU);
+    global.scratch[cpu_index] = new_arena;
+  }
+
+  static auto scratch_allocate(size_t size) noexcept -> void*
+  {
+    const auto context   = host_context();
+    const auto cpu_index = context ? context->cpu_index : mp::cpu_index();
+
+    if (const auto scratch = global.scratch[cpu_index])
+    {
+      if (const auto result = scratch->allocate(size))
+      {
+        return result;
+      }
+    }
+
+    return allocate(size);
+  }
+
+  static void scratch_free(void* address) noexcept
+  {
+    const auto context = host_context();
+    const auto scratch = global.scratch[context ? context->cpu_index : mp::cpu_index()];
+
+    if (scratch && scratch->contains(address))
+    {
+      return;
+    }
+
+    free(address);
+  }
+
+  auto va_from_pa(uint64_t pa) noexcept -> void*
+  {
+    const auto page_pfn = global.page_pfn;
+
+    if (!page_pfn)
+    {
+      return nullptr;
+    }
+
+    const auto pfn = pa >> ia32::page_shift;
+    const auto page_count = global.available_size / ia32::page_size;
+
+    if (global.contiguous)
+    {
+      return pfn - global.base_pfn < page_count
+        ? global.base_address + (pa - (global.base_pfn << ia32::page_shift))
+        : nullptr;
+    }
+
+    for (auto index = pfn_hash(pfn); global.pfn_table[index]; index = (index + 1) & (global.pfn_table_capacity - 1))
+    {
+      const auto page_index = global.pfn_table[index] - 1;
+
+      if (page_pfn[page_index] == pfn)
+      {
+        return global.base_address + page_index * ia32::page_size + ia32::byte_offset(pa);
+      }
+    }
+
+    return nullptr;
+  }
+
+  auto pa_from_va(const void* va) noexcept -> uint64_t
+  {
+    const auto page_pfn = global.page_pfn;
+    const auto offset = static_cast<size_t>(reinterpret_cast<const uint8_t*>(va) - global.base_address);
+
+    if (!page_pfn || reinterpret_cast<const uint8_t*>(va) < global.base_address || offset >= global.available_size)
+    {
+      return 0;
+    }
+
+    return (page_pfn[offset / ia32::page_size] << ia32::page_shift) + ia32::byte_offset(va);
   }
 
   auto physical_memory_descriptor() noexcept -> const ia32::physical_memory_descriptor&
@@ -451,10 +1863,21 @@ namespace mm
     return *global.memory_descriptor;
   }
 
+  bool physical_memory_descriptor_refresh() noexcept
+  {
+    return global.memory_descriptor->refresh();
+  }
+
   auto mtrr() noexcept -> const ia32::mtrr&
   {
     return *global.memory_type_range_registers;
   }
+
+  auto mtrr_update(uint32_t msr_id, uint64_t old_value) noexcept -> ia32::physical_memory_range
+  {
+    std::lock_guard _{ global.memory_type_range_registers_lock };
+    return global.memory_type_range_registers->update(msr_id, old_value);
+  }
 }
 
 namespace detail
@@ -468,10 +1891,10 @@ namespace detail
   }
 }
 
-void* operator new  (size_t size)                                    { return mm::global.allocator[mp::cpu_index()].allocate(size); }
-void* operator new[](size_t size)                                    { return mm::global.allocator[mp::cpu_index()].allocate(size); }
-void* operator new  (size_t size, std::align_val_t)                  { return mm::global.allocator[mp::cpu_index()].allocate(size); }
-void* operator new[](size_t size, std::align_val_t)                  { return mm::global.allocator[mp::cpu_index()].allocate(size); }
+void* operator new  (size_t size)                                    { return mm::current_allocator().allocate(size); }
+void* operator new[](size_t size)                                    { return mm::current_allocator().allocate(size); }
+void* operator new  (size_t size, std::align_val_t align)            { return mm::allocate_aligned(size, size_t(align)); }
+void* operator new[](size_t size, std::align_val_t align)            { return mm::allocate_aligned(size, size_t(align)); }
 
 void operator delete  (void* address)                                { detail::generic_free(address); }
 void operator delete[](void* address)                                { detail::generic_free(address); }
@@ -2,16 +2,36 @@
 #include "hvpp/ia32/memory.h"
 #include "hvpp/ia32/mtrr.h"
 
+#include "arena.h"
 #include "error.h"
+#include "spinlock.h"
 
 #include <cstdint>
 
 namespace mm
 {
+  //
+  // Mapping of non-paged kernel memory into the user address space
+  // (see mm::user_map()).
+  //
+  struct user_mapping_t
+  {
+    void* address;    // user-mode address
+    void* impl;       // OS-specific data
+    void* owner;      // OS-specific process which owns the mapping
+  };
+
   namespace detail
   {
     auto system_allocate(size_t size) noexcept -> void*;
     void system_free(void* address) noexcept;
+
+    auto system_allocate_node(size_t size, uint32_t node) noexcept -> void*;
+    void system_free_node(void* address) noexcept;
+
+    auto user_map(void* address, size_t size, user_mapping_t& mapping, bool read_only) noexcept -> error_code_t;
+    void user_unmap(user_mapping_t& mapping) noexcept;
+    bool user_mapping_owned(const user_mapping_t& mapping) noexcept;
   }
 
   using allocate_fn_t = void*(*)(size_t);
@@ -23,6 +43,39 @@ namespace mm
     free_fn_t     free;
   };
 
+  //
+  // Tags of the allocations from the pool - each allocation is
+  // accounted to the subsystem which has made it (see statistics_t).
+  // The tag is either passed to allocate() explicitly, or it's the
+  // current tag of the CPU (see allocation_tag() and tag_guard).
+  //
+  enum class memory_tag : uint8_t
+  {
+    untagged,
+    vcpu,               // vcpu_t (everything allocated by vcpu_t::prepare())
+    ept,                // EPT paging structures
+    stats,              // VM-exit statistics
+    hook,               // EPT paging structures split by hooks
+    trace,              // trace and stream rings
+  };
+
+  static constexpr int memory_tag_count = 6;
+
+  class tag_guard
+  {
+    public:
+      tag_guard(memory_tag new_tag) noexcept;
+      tag_guard(const tag_guard& other) noexcept = delete;
+      tag_guard(tag_guard&& other) noexcept = delete;
+      ~tag_guard() noexcept;
+
+      tag_guard& operator=(const tag_guard& other) noexcept = delete;
+      tag_guard& operator=(tag_guard&& other) noexcept = delete;
+
+    private:
+      memory_tag previous_tag_;
+  };
+
   class allocator_guard
   {
     public:
@@ -39,26 +92,182 @@ namespace mm
       allocator_t previous_allocator_;
   };
 
+  struct statistics_t
+  {
+    //
+    // Size classes: 16, 32, 64, 128, 256, 512, 1024 and 2016 bytes
+    // (slabs), 1, 2, 4 and 8 pages (magazines) and larger allocations.
+    //
+    static constexpr int class_count = 13;
+
+    //
+    // Latency bucket N counts allocations which took [2^N, 2^(N+1))
+    // TSC ticks (the last bucket counts everything above).
+    //
+    static constexpr int latency_bucket_count = 16;
+
+    uint64_t allocation_count;
+    uint64_t free_count;
+    uint64_t failure_count;
+
+    uint64_t allocated_bytes;
+    uint64_t free_bytes;
+    uint64_t peak_allocated_bytes;
+    uint64_t largest_free_run;            // in bytes
+
+    uint64_t class_bytes[class_count];    // requested bytes per size class
+    uint64_t latency[latency_bucket_count];
+
+    //
+    // High-water mark of the host stack of the CPU (the largest of all
+    // CPUs in the merged statistics) - bytes which don't hold
+    // host_stack_fill anymore (see host_stack_register()).
+    //
+    uint64_t host_stack_size;
+    uint64_t host_stack_used;
+
+    //
+    // Pool memory in use per tag (see memory_tag) - bytes (rounded up
+    // to the size class) and number of allocations.  Values of the CPU
+    // are allocations minus frees made on that CPU - they're negative
+    // if the CPU frees more than it has allocated.  Merged values are
+    // exact.
+    //
+    int64_t  tag_bytes[memory_tag_count];
+    int64_t  tag_allocation_count[memory_tag_count];
+  };
+
+  //
+  // Value of each byte of the host stack before its first use.
+  //
+  static constexpr uint8_t host_stack_fill = 0xcc;
+
   extern const allocator_t system_allocator;
   extern const allocator_t custom_allocator;
 
+  //
+  // Allocator backed by the scratch arena of the current CPU (see
+  // scratch_arena()).  Allocations which don't fit into the arena (or
+  // without any arena) are served by the custom allocator.  free() of
+  // arena memory does nothing - the owner of the arena resets it.
+  //
+  extern const allocator_t scratch_allocator;
+
   auto initialize() noexcept -> error_code_t;
   void destroy() noexcept;
 
   auto assign(void* address, size_t size) noexcept -> error_code_t;
 
   auto allocate(size_t size) noexcept -> void*;
+  auto allocate(size_t size, memory_tag tag) noexcept -> void*;
   void free(void* address) noexcept;
 
+  //
+  // Allocate memory aligned to "alignment" (power of 2, at most the page
+  // size) from the current allocator (see allocator()) - the aligned
+  // operator new calls this.  Note that allocate() returns page-aligned
+  // memory only for allocations larger than the largest slab size class
+  // (2016 bytes), smaller allocations are aligned only to their size
+  // class.  Paging structures and other buffers which need the alignment
+  // must be allocated by this (e.g. new (std::align_val_t{ page_size })).
+  // Memory is freed by the regular operator delete.
+  //
+  auto allocate_aligned(size_t size, size_t alignment) noexcept -> void*;
+
   auto system_allocate(size_t size) noexcept -> void*;
   void system_free(void* address) noexcept;
 
+  //
+  // Allocate page-aligned non-paged memory, preferably from the physical
+  // memory of the specified NUMA node (see mp::cpu_node()).  Memory must
+  // be freed by system_free_node().  Must be called at IRQL <= DISPATCH_LEVEL.
+  //
+  auto system_allocate_node(size_t size, uint32_t node) noexcept -> void*;
+  void system_free_node(void* address) noexcept;
+
+  //
+  // Map non-paged kernel memory (allocated either from the pool or by
+  // system_allocate()) into the address space of the current process.
+  // Must be called at PASSIVE_LEVEL, in the context of the process.
+  //
+  // The mapping can be removed only in the context of the process which
+  // owns it - user_unmap() does nothing in other processes (and if
+  // there's no mapping).  user_mapping_owned() returns true if the
+  // mapping exists and belongs to the current process.
+  //
+  auto user_map(void* address, size_t size, user_mapping_t& mapping, bool read_only = false) noexcept -> error_code_t;
+  void user_unmap(user_mapping_t& mapping) noexcept;
+  bool user_mapping_owned(const user_mapping_t& mapping) noexcept;
+
+  //
+  // Translate addresses of the pool memory without calling the OS
+  // (in O(1), even in VMX-root mode).  va_from_pa() returns nullptr
+  // and pa_from_va() returns 0 if the address doesn't belong to
+  // the pool.  Physical page 0 is never part of the pool.
+  //
+  auto va_from_pa(uint64_t pa) noexcept -> void*;
+  auto pa_from_va(const void* va) noexcept -> uint64_t;
+
   auto allocated_bytes() noexcept -> size_t;
   auto free_bytes() noexcept -> size_t;
 
+  auto statistics() noexcept -> statistics_t;
+  auto statistics(int cpu_index) noexcept -> statistics_t;
+
+  //
+  // Contention statistics of the global lock of the memory manager.
+  //
+  auto lock_statistics() noexcept -> spinlock_statistics_t;
+
   auto allocator() noexcept -> const allocator_t&;
   void allocator(const allocator_t& new_allocator) noexcept;
 
+  //
+  // Tag of the allocations which don't specify one - kept per CPU (or
+  // per host stack, like the allocator).
+  //
+  auto allocation_tag() noexcept -> memory_tag;
+  void allocation_tag(memory_tag new_tag) noexcept;
+
+  auto memory_tag_name(memory_tag tag) noexcept -> const char*;
+
+  //
+  // Register the host (VMX-root mode) stack of the CPU.
+  //
+  // While the CPU runs on the registered stack, allocations are routed
+  // to the custom allocator implicitly - and allocator()/allocator_guard
+  // change only the allocator of this stack.  The stack is found by the
+  // current RSP (single hash lookup), without querying the CPU index.
+  // The stack must be aligned to its size, size must be power of 2 and
+  // the same for all stacks.  If the stack is filled with
+  // host_stack_fill before it's used, statistics() report how much of
+  // it has been used since.
+  //
+  auto host_stack_register(void* stack, size_t size, uint32_t cpu_index) noexcept -> error_code_t;
+  void host_stack_unregister(void* stack) noexcept;
+
+  //
+  // Scratch arena of the current CPU (see scratch_allocator), nullptr
+  // = none.  The arena must stay valid while it's set (see
+  // vcpu_t::scratch()).
+  //
+  auto scratch_arena() noexcept -> arena*;
+  void scratch_arena(uint32_t cpu_index, arena* new_arena) noexcept;
+
   auto physical_memory_descriptor() noexcept -> const ia32::physical_memory_descriptor&;
+
+  //
+  // Re-read the physical memory ranges (e.g. after memory hot-add).
+  // Returns true if they have changed.  Must be called at PASSIVE_LEVEL.
+  //
+  bool physical_memory_descriptor_refresh() noexcept;
+
   auto mtrr() noexcept -> const ia32::mtrr&;
+
+  //
+  // Refresh the MTRR model after the MTRR "msr_id" has been written on
+  // the current CPU (see ia32::mtrr::update()).  Returns the range of
+  // physical addresses whose memory type might have changed.
+  //
+  auto mtrr_update(uint32_t msr_id, uint64_t old_value) noexcept -> ia32::physical_memory_range;
 }
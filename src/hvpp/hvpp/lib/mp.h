@@ -1,4 +1,7 @@
 #pragma once
+#include "hvpp/config.h"
+
+#include <atomic>
 #include <cstdint>
 
 //
@@ -7,12 +10,67 @@
 
 namespace mp
 {
+  //
+  // Set of logical CPUs (by index).
+  //
+
+  struct cpu_set_t
+  {
+    static constexpr uint32_t word_count = (HVPP_MAX_CPU + 63) / 64;
+
+    uint64_t mask[word_count];
+
+    static cpu_set_t all() noexcept
+    {
+      cpu_set_t result;
+      for (auto& word : result.mask) { word = ~0ull; }
+      return result;
+    }
+
+    static cpu_set_t none() noexcept
+    { return cpu_set_t{}; }
+
+    void set(uint32_t cpu_index) noexcept   { mask[cpu_index / 64] |=  (1ull << (cpu_index % 64)); }
+    void clear(uint32_t cpu_index) noexcept { mask[cpu_index / 64] &= ~(1ull << (cpu_index % 64)); }
+    bool test(uint32_t cpu_index) const noexcept
+    { return (mask[cpu_index / 64] & (1ull << (cpu_index % 64))) != 0; }
+  };
+
+  //
+  // Asynchronous broadcast request (see async_broadcast()).
+  // The request must stay valid until it's complete.
+  //
+
+  struct async_request_t
+  {
+    void               (*callback)(void*);
+    void*                context;
+
+    //
+    // Number of CPUs which haven't processed the request yet.
+    //
+    std::atomic_uint32_t remaining;
+
+    //
+    // Number of CPUs which didn't accept the request (their queue
+    // was full).  These are not counted in "remaining".
+    //
+    std::atomic_uint32_t dropped;
+
+    bool is_complete() const noexcept
+    { return remaining.load(std::memory_order_acquire) == 0; }
+  };
+
   namespace detail
   {
     uint32_t cpu_count() noexcept;
     uint32_t cpu_index() noexcept;
+    uint32_t cpu_node(uint32_t cpu_index) noexcept;
     void     sleep(uint32_t milliseconds) noexcept;
     void     ipi_call(void(*callback)(void*), void* context) noexcept;
+    void     run_on_mask(const cpu_set_t& cpu_set, void(*callback)(void*), void* context) noexcept;
+    bool     async_call(uint32_t cpu_index, void(*callback)(void*), void* context) noexcept;
+    bool     async_broadcast(async_request_t& request, const cpu_set_t& cpu_set) noexcept;
   }
 
   inline uint32_t cpu_count() noexcept
@@ -21,6 +79,13 @@ namespace mp
   inline uint32_t cpu_index() noexcept
   { return detail::cpu_index(); }
 
+  //
+  // NUMA node of the specified logical CPU.
+  //
+
+  inline uint32_t cpu_node(uint32_t cpu_index) noexcept
+  { return detail::cpu_node(cpu_index); }
+
   inline void sleep(uint32_t milliseconds) noexcept
   { detail::sleep(milliseconds); }
 
@@ -37,4 +102,99 @@ namespace mp
   template <typename T>
   inline void ipi_call(T function) noexcept
   { ipi_call([](void* context) noexcept { ((T*)context)->operator()(); }, &function); }
+
+  //
+  // Runs specified method on all logical CPUs concurrently (at DISPATCH_LEVEL)
+  // and waits until all of them finish.  Unlike ipi_call(), CPUs don't wait
+  // for each other - each CPU continues as soon as its own callback returns.
+  //
+  // Note that this function must be called at PASSIVE_LEVEL and that
+  // only one parallel call can be in progress at a time (other callers
+  // wait).
+  //
+
+  inline void parallel_call(void(*callback)(void*), void* context) noexcept
+  { detail::run_on_mask(cpu_set_t::all(), callback, context); }
+
+  inline void parallel_call(void(*callback)()) noexcept
+  { detail::run_on_mask(cpu_set_t::all(), [](void* context) { ((void(*)())context)(); }, callback); }
+
+  template <typename T>
+  inline void parallel_call(T function) noexcept
+  { parallel_call([](void* context) noexcept { ((T*)context)->operator()(); }, &function); }
+
+  //
+  // Same as parallel_call(), but runs specified method only on the
+  // specified logical CPU(s).  Other CPUs aren't interrupted at all.
+  // Same restrictions as for parallel_call() apply.
+  //
+
+  inline void run_on_mask(const cpu_set_t& cpu_set, void(*callback)(void*), void* context) noexcept
+  { detail::run_on_mask(cpu_set, callback, context); }
+
+  template <typename T>
+  inline void run_on_mask(const cpu_set_t& cpu_set, T function) noexcept
+  { run_on_mask(cpu_set, [](void* context) noexcept { ((T*)context)->operator()(); }, &function); }
+
+  inline void run_on(uint32_t cpu_index, void(*callback)(void*), void* context) noexcept
+  {
+    auto cpu_set = cpu_set_t::none();
+    cpu_set.set(cpu_index);
+    detail::run_on_mask(cpu_set, callback, context);
+  }
+
+  template <typename T>
+  inline void run_on(uint32_t cpu_index, T function) noexcept
+  { run_on(cpu_index, [](void* context) noexcept { ((T*)context)->operator()(); }, &function); }
+
+  //
+  // Asynchronously runs specified method on the specified logical CPU.
+  // Unlike ipi_call(), this function doesn't wait for the callback to
+  // finish.  Returns false if the previous asynchronous call targeted
+  // to the same CPU hasn't been processed yet (the new one is dropped).
+  //
+  // Note that this function must not be called from VMX-root mode.
+  //
+
+  inline bool async_call(uint32_t cpu_index, void(*callback)(void*), void* context) noexcept
+  { return detail::async_call(cpu_index, callback, context); }
+
+  inline bool async_call(uint32_t cpu_index, void(*callback)()) noexcept
+  { return detail::async_call(cpu_index, [](void* context) { ((void(*)())context)(); }, callback); }
+
+  //
+  // Asynchronously runs specified method on each logical CPU in the set
+  // (at DISPATCH_LEVEL, in a DPC).  Unlike ipi_call(), this function
+  // returns immediately and no CPU waits for the others.  Completion
+  // can be checked by request.is_complete() (or waited for by
+  // async_wait()).
+  //
+  // Unlike async_call(), requests are queued - each CPU can have several
+  // requests in flight.  Returns false if some CPU didn't accept the
+  // request (see async_request_t::dropped).
+  //
+  // Note that this function must be called at IRQL <= DISPATCH_LEVEL
+  // and must not be called from VMX-root mode.
+  //
+
+  inline bool async_broadcast(async_request_t& request, void(*callback)(void*), void* context,
+                              const cpu_set_t& cpu_set = cpu_set_t::all()) noexcept
+  {
+    request.callback = callback;
+    request.context  = context;
+    return detail::async_broadcast(request, cpu_set);
+  }
+
+  //
+  // Waits for the completion of the asynchronous broadcast.
+  // Must be called at PASSIVE_LEVEL.
+  //
+
+  inline void async_wait(const async_request_t& request) noexcept
+  {
+    while (!request.is_complete())
+    {
+      sleep(1);
+    }
+  }
 }
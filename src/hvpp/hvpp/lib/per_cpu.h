@@ -0,0 +1,156 @@
+#pragma once
+#include "assert.h"
+#include "error.h"
+#include "mm.h"
+#include "mp.h"
+
+#include "hvpp/config.h"
+
+#include <cstdint>
+#include <new>
+
+//
+// Per-CPU storage.
+//
+// Holds one instance of T for each logical CPU (mp::cpu_count(), not
+// HVPP_MAX_CPU).  Each instance is padded to the cache line, so that
+// VCPUs don't share cache lines.  Instances of CPUs of the same NUMA
+// node are allocated together, from the memory of that node (see
+// mm::system_allocate_node()).
+//
+// Usage:
+//   per_cpu<per_vcpu_t> per_vcpu_;
+//
+//   my_handler::my_handler() noexcept
+//   {
+//     auto err = per_vcpu_.initialize();       // at PASSIVE_LEVEL
+//     hvpp_assert(!err);
+//   }
+//
+//   void my_handler::handle(vcpu_t& vp) noexcept
+//   {
+//     auto& data = per_vcpu_[vp.cpu_index()];
+//     ...
+//   }
+//
+// initialize() must be called at IRQL <= DISPATCH_LEVEL (e.g. in the
+// constructor of the VM-exit handler), before the storage is accessed.
+//
+
+template <
+  typename T
+>
+class per_cpu
+{
+  public:
+    static constexpr size_t cache_line_size = 64;
+
+    per_cpu() noexcept
+      : slot_{}
+      , block_{}
+      , block_count_{ 0 }
+      , cpu_count_{ 0 }
+    { }
+
+    ~per_cpu() noexcept
+    { destroy(); }
+
+    per_cpu(const per_cpu& other) noexcept = delete;
+    per_cpu(per_cpu&& other) noexcept = delete;
+    per_cpu& operator=(const per_cpu& other) noexcept = delete;
+    per_cpu& operator=(per_cpu&& other) noexcept = delete;
+
+    auto initialize() noexcept -> error_code_t
+    {
+      hvpp_assert(cpu_count_ == 0);
+
+      const uint32_t cpu_count = mp::cpu_count();
+      hvpp_assert(cpu_count <= HVPP_MAX_CPU);
+
+      for (uint32_t i = 0; i < cpu_count; ++i)
+      {
+        if (slot_[i])
+        {
+          continue;
+        }
+
+        //
+        // Allocate one block for all remaining CPUs of this node.
+        //
+        const auto node = mp::cpu_node(i);
+        uint32_t node_cpu_count = 0;
+
+        for (uint32_t j = i; j < cpu_count; ++j)
+        {
+          node_cpu_count += mp::cpu_node(j) == node;
+        }
+
+        auto block = reinterpret_cast<slot_t*>(
+          mm::system_allocate_node(node_cpu_count * sizeof(slot_t), node));
+
+        if (!block)
+        {
+          cpu_count_ = cpu_count;
+          destroy();
+          return make_error_code_t(std::errc::not_enough_memory);
+        }
+
+        block_[block_count_++] = block;
+
+        for (uint32_t j = i; j < cpu_count; ++j)
+        {
+          if (mp::cpu_node(j) == node)
+          {
+            slot_[j] = new (block++) slot_t{};
+          }
+        }
+      }
+
+      cpu_count_ = cpu_count;
+      return error_code_t{};
+    }
+
+    void destroy() noexcept
+    {
+      for (uint32_t i = 0; i < cpu_count_; ++i)
+      {
+        if (slot_[i])
+        {
+          slot_[i]->~slot_t();
+          slot_[i] = nullptr;
+        }
+      }
+
+      for (uint32_t i = 0; i < block_count_; ++i)
+      {
+        mm::system_free_node(block_[i]);
+        block_[i] = nullptr;
+      }
+
+      block_count_ = 0;
+      cpu_count_ = 0;
+    }
+
+    bool is_initialized() const noexcept
+    { return cpu_count_ != 0; }
+
+    uint32_t size() const noexcept
+    { return cpu_count_; }
+
+    T& operator[](uint32_t cpu_index) noexcept
+    { hvpp_assert(cpu_index < cpu_count_); return slot_[cpu_index]->value; }
+
+    const T& operator[](uint32_t cpu_index) const noexcept
+    { hvpp_assert(cpu_index < cpu_count_); return slot_[cpu_index]->value; }
+
+  private:
+    struct alignas(cache_line_size) slot_t
+    {
+      T value;
+    };
+
+    slot_t*  slot_[HVPP_MAX_CPU];
+    void*    block_[HVPP_MAX_CPU];
+    uint32_t block_count_;
+    uint32_t cpu_count_;
+};
@@ -0,0 +1,81 @@
+#pragma once
+#include "hvpp/ia32/asm.h"
+
+#include <atomic>
+#include <cstdint>
+
+//
+// Reader-writer spinlock.
+//
+// Any number of readers can hold the lock at the same time, writers
+// hold it exclusively.  Writers are preferred - once a writer starts
+// waiting, new readers wait until it's done.  This keeps rare writers
+// from being starved by readers which hold the lock on every VM-exit.
+//
+// The lock has the same interface as std::shared_mutex (lock_shared(),
+// unlock_shared(), lock(), unlock(), ...), therefore it can be used
+// with std::shared_lock and std::lock_guard.
+//
+// Note that the lock is not recursive and the reader can't be upgraded
+// to the writer.
+//
+
+class rw_spinlock
+{
+  public:
+    bool try_lock_shared() noexcept
+    {
+      auto state = state_.load(std::memory_order_relaxed);
+
+      return !(state & (writer_flag | writer_waiting_flag)) &&
+             state_.compare_exchange_weak(state, state + 1, std::memory_order_acquire);
+    }
+
+    void lock_shared() noexcept
+    {
+      while (!try_lock_shared())
+      {
+        ia32_asm_pause();
+      }
+    }
+
+    void unlock_shared() noexcept
+    {
+      state_.fetch_sub(1, std::memory_order_release);
+    }
+
+    bool try_lock() noexcept
+    {
+      auto state = state_.load(std::memory_order_relaxed);
+
+      return !(state & ~writer_waiting_flag) &&
+             state_.compare_exchange_strong(state, writer_flag, std::memory_order_acquire);
+    }
+
+    void lock() noexcept
+    {
+      while (!try_lock())
+      {
+        //
+        // Announce the writer, so that new readers stay away.
+        //
+        state_.fetch_or(writer_waiting_flag, std::memory_order_relaxed);
+        ia32_asm_pause();
+      }
+    }
+
+    void unlock() noexcept
+    {
+      //
+      // This also clears the writer_waiting_flag - other waiting writers
+      // set it again on their next attempt.
+      //
+      state_.store(0, std::memory_order_release);
+    }
+
+  private:
+    static constexpr uint32_t writer_flag         = 0x80000000;
+    static constexpr uint32_t writer_waiting_flag = 0x40000000;
+
+    std::atomic_uint32_t state_ = 0;
+};
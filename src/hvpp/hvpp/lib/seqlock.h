@@ -0,0 +1,105 @@
+#pragma once
+#include "spinlock.h"
+
+#include "hvpp/ia32/asm.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+//
+// Sequence lock.
+//
+// Readers never write to the shared memory - they read the sequence
+// number, copy the data and retry if the sequence number has changed
+// in the meantime (or if it was odd - i.e. the writer was in the middle
+// of the update).  Writers are serialized by the spinlock and increment
+// the sequence number before and after the update.
+//
+// This makes reads very cheap (no cache line is bounced between readers)
+// and suitable for small, frequently read and rarely written data (e.g.
+// policy read on every VM-exit).  The data must be trivially copyable,
+// because readers might copy it while it's being modified.
+//
+
+class seqlock
+{
+  public:
+    auto read_begin() const noexcept -> uint32_t
+    {
+      uint32_t sequence;
+
+      while ((sequence = sequence_.load(std::memory_order_acquire)) & 1)
+      {
+        ia32_asm_pause();
+      }
+
+      return sequence;
+    }
+
+    bool read_retry(uint32_t sequence) const noexcept
+    {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return sequence_.load(std::memory_order_relaxed) != sequence;
+    }
+
+    void write_begin() noexcept
+    {
+      lock_.lock();
+      sequence_.store(sequence_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void write_end() noexcept
+    {
+      sequence_.store(sequence_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+      lock_.unlock();
+    }
+
+  private:
+    std::atomic_uint32_t sequence_ = 0;
+    spinlock             lock_;
+};
+
+//
+// Value of type T protected by the seqlock.
+//
+// Usage:
+//   seqlocked<policy_t> policy;
+//
+//   policy.write(new_policy);           // writer
+//   auto current_policy = policy.read(); // reader (e.g. VM-exit handler)
+//
+
+template <typename T>
+class seqlocked
+{
+  static_assert(std::is_trivially_copyable_v<T>);
+
+  public:
+    auto read() const noexcept -> T
+    {
+      T result;
+      uint32_t sequence;
+
+      do
+      {
+        sequence = lock_.read_begin();
+        memcpy(&result, &value_, sizeof(T));
+      } while (lock_.read_retry(sequence));
+
+      return result;
+    }
+
+    void write(const T& value) noexcept
+    {
+      lock_.write_begin();
+      memcpy(&value_, &value, sizeof(T));
+      lock_.write_end();
+    }
+
+  private:
+    mutable seqlock lock_;
+    T               value_ = {};
+};
@@ -0,0 +1,241 @@
+#include "snapshot.h"
+
+#include "assert.h"
+#include "bitmap.h"
+#include "mm.h"
+#include "mp.h"
+
+#include "hvpp/hypervisor.h"
+#include "hvpp/ia32/memory.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+namespace snapshot
+{
+  struct global_t
+  {
+    chunk_t*          chunk;
+
+    //
+    // Pages of the current incremental snapshot (one bit per 4kb page).
+    //
+    uint8_t*          dirty_bitmap_buffer;
+    size_t            dirty_bitmap_size;
+
+    //
+    // Mapping window of the copied pages.
+    //
+    ia32::mapping_t*  mapping;
+
+    bool              incremental;
+    bool              has_previous;
+    uint64_t          sequence;
+
+    //
+    // Next physical address (full snapshot) or page (incremental
+    // snapshot) to be copied.
+    //
+    uint64_t          cursor;
+  };
+
+  global_t global;
+
+  namespace detail
+  {
+    static void copy(uint64_t pfn, uint32_t page_count) noexcept
+    {
+      //
+      // Copy "page_count" contiguous pages into the chunk.
+      //
+      auto& chunk = *global.chunk;
+
+      for (uint32_t i = 0; i < page_count; ++i)
+      {
+        chunk.pfn[chunk.page_count + i] = pfn + i;
+      }
+
+      global.mapping->read(ia32::pa_t::from_pfn(pfn),
+                           chunk.page[chunk.page_count],
+                           size_t(page_count) * chunk_t::page_size);
+
+      chunk.page_count += page_count;
+    }
+
+    static void fill_full() noexcept
+    {
+      auto& chunk = *global.chunk;
+      const auto& descriptor = mm::physical_memory_descriptor();
+
+      ia32::physical_memory_range range;
+
+      while (chunk.page_count < chunk_t::max_page_count &&
+             descriptor.next_range(ia32::pa_t{ global.cursor }, range))
+      {
+        const auto first_pfn = std::max(ia32::pa_t{ global.cursor }, range.begin()).pfn();
+        const auto end_pfn   = ia32::pa_t{ range.end().value() + ia32::page_size - 1 }.pfn();
+
+        const auto page_count = static_cast<uint32_t>(std::min<uint64_t>(end_pfn - first_pfn,
+                                                                         chunk_t::max_page_count - chunk.page_count));
+
+        copy(first_pfn, page_count);
+        global.cursor = ia32::pa_t::from_pfn(first_pfn + page_count).value();
+      }
+    }
+
+    static void fill_incremental() noexcept
+    {
+      auto& chunk = *global.chunk;
+      bitmap dirty_bitmap{ global.dirty_bitmap_buffer, static_cast<int>(global.dirty_bitmap_size * 8) };
+
+      const auto bit_count = static_cast<uint64_t>(dirty_bitmap.size_in_bits());
+
+      while (chunk.page_count < chunk_t::max_page_count && global.cursor < bit_count)
+      {
+        const auto first = dirty_bitmap.find_first_set(static_cast<int>(global.cursor), 1);
+
+        if (first < 0)
+        {
+          global.cursor = bit_count;
+          break;
+        }
+
+        //
+        // Copy runs of dirty pages at once.
+        //
+        uint32_t page_count = 1;
+
+        while (chunk.page_count + page_count < chunk_t::max_page_count &&
+               uint64_t(first) + page_count < bit_count &&
+               dirty_bitmap.test(first + page_count))
+        {
+          page_count += 1;
+        }
+
+        copy(uint64_t(first), page_count);
+        global.cursor = uint64_t(first) + page_count;
+      }
+    }
+  }
+
+  auto initialize() noexcept -> error_code_t
+  {
+    hvpp_assert(global.chunk == nullptr);
+
+    const auto& descriptor = mm::physical_memory_descriptor();
+    const auto highest_pa = descriptor.size()
+      ? (descriptor.end() - 1)->end().value()
+      : 0;
+
+    global.dirty_bitmap_size = (ia32::pa_t{ highest_pa + ia32::page_size - 1 }.pfn() + 63) / 64 * 8;
+
+    global.chunk = reinterpret_cast<chunk_t*>(mm::system_allocate(sizeof(chunk_t)));
+    global.dirty_bitmap_buffer = new (std::align_val_t{ ia32::page_size }) uint8_t[global.dirty_bitmap_size];
+    global.mapping = new ia32::mapping_t(ia32::mapping_t::large_page_count);
+
+    if (!global.chunk || !global.dirty_bitmap_buffer || !global.mapping)
+    {
+      destroy();
+      return make_error_code_t(std::errc::not_enough_memory);
+    }
+
+    memset(global.chunk, 0, sizeof(chunk_t));
+    global.chunk->signature = chunk_t::chunk_signature;
+
+    global.incremental  = false;
+    global.has_previous = false;
+    global.sequence     = 0;
+    global.cursor       = ~0ull;
+
+    return error_code_t{};
+  }
+
+  void destroy() noexcept
+  {
+    if (global.chunk)
+    {
+      mm::system_free(global.chunk);
+    }
+
+    ::operator delete[](global.dirty_bitmap_buffer, std::align_val_t{ ia32::page_size });
+    delete global.mapping;
+
+    global = global_t{};
+  }
+
+  auto chunk() noexcept -> chunk_t*
+  {
+    return global.chunk;
+  }
+
+  auto chunk_size() noexcept -> size_t
+  {
+    return global.chunk ? sizeof(chunk_t) : 0;
+  }
+
+  auto begin(bool incremental) noexcept -> error_code_t
+  {
+    if (!global.chunk)
+    {
+      return make_error_code_t(std::errc::not_supported);
+    }
+
+    const bool dirty_tracking = hvpp::hypervisor::is_started() &&
+                                hvpp::hypervisor::dirty_tracking_enabled();
+
+    if (incremental && (!dirty_tracking || !global.has_previous))
+    {
+      return make_error_code_t(std::errc::operation_not_permitted);
+    }
+
+    //
+    // Collect pages written since the previous snapshot has begun - and
+    // reset the bitmaps, so that the next incremental snapshot contains
+    // only pages written from now on.
+    //
+    if (dirty_tracking)
+    {
+      hvpp::hypervisor::dirty_bitmap_collect(global.dirty_bitmap_buffer, global.dirty_bitmap_size);
+    }
+
+    global.incremental  = incremental;
+    global.has_previous = dirty_tracking;
+    global.sequence     = incremental ? global.sequence + 1 : 0;
+    global.cursor       = 0;
+
+    global.chunk->page_count = 0;
+    global.chunk->sequence   = global.sequence;
+
+    return error_code_t{};
+  }
+
+  auto next() noexcept -> uint32_t
+  {
+    if (!global.chunk)
+    {
+      return 0;
+    }
+
+    global.chunk->page_count = 0;
+    global.chunk->sequence   = global.sequence;
+
+    //
+    // The mapping window is modified (and flushed from the TLB) only
+    // on the current CPU - make sure the thread doesn't migrate while
+    // it's used.
+    //
+    mp::run_on(mp::cpu_index(), []() {
+      if (global.incremental)
+      {
+        detail::fill_incremental();
+      }
+      else
+      {
+        detail::fill_full();
+      }
+    });
+
+    return global.chunk->page_count;
+  }
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include "snapshot_chunk.h"
+#include "error.h"
+
+#include <cstdint>
+
+//
+// Snapshot of the guest physical memory, streamed to the user-mode.
+//
+// The consumer maps the chunk (see snapshot_chunk.h) into its process
+// and requests it to be filled repeatedly - each request copies up to
+// chunk_t::max_page_count pages (through the multi-page mapping window,
+// see ia32::mapping_t) into the chunk, without any copy to the IOCTL
+// buffers.
+//
+// The full snapshot contains all pages of the physical memory ranges.
+// Incremental snapshot contains only pages written since the beginning
+// of the previous snapshot (see hypervisor::dirty_tracking_enable()) -
+// pages written while the previous snapshot was being copied are
+// therefore included again.  Because the guest keeps running, the
+// snapshot isn't atomic; applying the incremental snapshots in order
+// converges to the memory of the last one.
+//
+// Note that incremental snapshots consume the dirty page bitmaps
+// (see hypervisor::dirty_bitmap_collect()).
+//
+// All functions must be called at PASSIVE_LEVEL and must be serialized
+// by the caller.
+//
+
+namespace snapshot
+{
+  auto initialize() noexcept -> error_code_t;
+  void destroy() noexcept;
+
+  auto chunk() noexcept -> chunk_t*;
+  auto chunk_size() noexcept -> size_t;
+
+  //
+  // Begin new snapshot.  Incremental snapshot requires the dirty page
+  // tracking and a previous snapshot.
+  //
+  auto begin(bool incremental) noexcept -> error_code_t;
+
+  //
+  // Fill the chunk with the next pages of the snapshot.  Returns number
+  // of pages in the chunk (0 = the snapshot is complete).
+  //
+  auto next() noexcept -> uint32_t;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+//
+// Layout of the chunk of the guest memory snapshot (see snapshot.h).
+//
+// This header is shared with the user-mode (hvppctrl), therefore
+// it shouldn't depend on anything else.
+//
+// The chunk is mapped into the consumer process - each "next" request
+// fills it with up to "max_page_count" pages: "pfn[i]" is the page frame
+// number of the page stored in "page[i]".  Pages are stored in ascending
+// order.  Chunk with "page_count" 0 ends the snapshot.
+//
+
+namespace snapshot {
+
+struct chunk_t
+{
+  static constexpr uint32_t chunk_signature = 'pnsh';
+  static constexpr uint32_t max_page_count  = 1024;     // 4MB
+  static constexpr uint32_t page_size       = 4096;
+
+  uint32_t signature;
+  uint32_t page_count;
+  uint64_t sequence;            // 0 = full snapshot, N = N-th incremental snapshot
+  uint64_t pfn[max_page_count];
+
+  //
+  // Pages begin on the page boundary.
+  //
+  uint8_t  reserved[3 * page_size - 16 - max_page_count * sizeof(uint64_t)];
+  uint8_t  page[max_page_count][page_size];
+};
+
+static_assert(offsetof(chunk_t, page) % chunk_t::page_size == 0);
+
+//
+// Requests of the snapshot IOCTL.
+//
+struct request_t
+{
+  static constexpr uint32_t command_begin_full        = 0;
+  static constexpr uint32_t command_begin_incremental = 1;
+  static constexpr uint32_t command_next              = 2;
+
+  uint32_t command;
+  uint32_t page_count;          // output - pages in the chunk
+};
+
+static_assert(sizeof(request_t) == 8);
+
+}
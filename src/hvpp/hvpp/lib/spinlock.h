@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <atomic>
 #include <algorithm>
+#include <mutex>
 
 #ifdef min
 # undef min
@@ -18,14 +19,50 @@
 // Also, benefit of this implementation is that we can use it with
 // STL lock guards, e.g.: std::lock_guard.
 //
+// Under heavy contention (many CPUs hammering the same lock) the backoff
+// is unfair and can starve some CPUs - queued_spinlock (below) is the
+// alternative for such locks.  Both locks keep contention statistics
+// (see spinlock_statistics_t), so that hot locks can be identified.
+//
 // Look here for more information:
 //   - https://locklessinc.com/articles/locks/
 //   - https://github.com/cyfdecyf/spinlock
 //
 
+//
+// Contention statistics of a lock.  Counters are updated by the owner
+// of the lock (i.e. while the lock is held), therefore they don't need
+// to be atomic.  Readers might see slightly inconsistent values.
+//
+
+struct spinlock_statistics_t
+{
+  uint64_t acquire_count;     // number of acquisitions
+  uint64_t contention_count;  // acquisitions which had to wait
+  uint64_t spin_count;        // total number of spin iterations
+  uint64_t max_wait;          // longest wait (in TSC ticks)
+};
+
+namespace detail
+{
+  inline void spinlock_record(spinlock_statistics_t& statistics, uint64_t spin_count, uint64_t wait) noexcept
+  {
+    statistics.acquire_count += 1;
+
+    if (spin_count)
+    {
+      statistics.contention_count += 1;
+      statistics.spin_count += spin_count;
+      statistics.max_wait = std::max(statistics.max_wait, wait);
+    }
+  }
+}
+
 class spinlock
 {
   public:
+    using guard = std::lock_guard<spinlock>;
+
     //
     // Manually fine-tuned.
     //
@@ -33,26 +70,44 @@ class spinlock
 
     bool try_lock() noexcept
     {
-      return !lock_.test_and_set(std::memory_order_acquire);
+      if (lock_.test_and_set(std::memory_order_acquire))
+      {
+        return false;
+      }
+
+      detail::spinlock_record(statistics_, 0, 0);
+      return true;
     }
 
     void lock() noexcept
     {
+      if (try_lock())
+      {
+        return;
+      }
+
+      const auto start = ia32_asm_read_tsc();
+
       unsigned wait = 1;
+      uint64_t spin_count = 0;
 
-      while (!try_lock())
+      do
       {
         for (unsigned i = 0; i < wait; ++i)
         {
           ia32_asm_pause();
         }
 
+        spin_count += wait;
+
         //
         // Don't call "pause" too many times. If the wait becomes too big,
         // clamp it to the max_wait.
         //
         wait = std::min(wait * 2, max_wait);
-      }
+      } while (lock_.test_and_set(std::memory_order_acquire));
+
+      detail::spinlock_record(statistics_, spin_count, ia32_asm_read_tsc() - start);
     }
 
     void unlock() noexcept
@@ -60,6 +115,153 @@ class spinlock
       lock_.clear(std::memory_order_release);
     }
 
+    auto statistics() const noexcept -> spinlock_statistics_t
+    {
+      return statistics_;
+    }
+
+    void reset_statistics() noexcept
+    {
+      statistics_ = spinlock_statistics_t{};
+    }
+
+  private:
+    std::atomic_flag      lock_ = ATOMIC_FLAG_INIT;
+    spinlock_statistics_t statistics_ = {};
+};
+
+//
+// Queued (MCS) spinlock.
+//
+// Unlike the spinlock above, this lock is fair - CPUs acquire it in
+// the order in which they started waiting - and each waiting CPU spins
+// only on its own node, so the cache line with the lock isn't bounced
+// between the waiting CPUs.  This makes it a better choice for locks
+// contended by many CPUs at once (e.g. from VM-exit handlers).
+//
+// Each acquisition needs its own node, which must stay valid until the
+// lock is released.  Use the "guard" (which holds the node) instead of
+// std::lock_guard:
+//
+//   queued_spinlock::guard _(lock);
+//
+// Note that the guard has the same usage as spinlock::guard, so the lock
+// type can be selected by a single type alias at the use site.
+//
+
+class queued_spinlock
+{
+  public:
+    struct node_t
+    {
+      std::atomic<node_t*> next;
+      std::atomic_bool     locked;
+    };
+
+    class guard
+    {
+      public:
+        explicit guard(queued_spinlock& lock) noexcept
+          : lock_{ lock }
+        { lock_.lock(node_); }
+
+        ~guard() noexcept
+        { lock_.unlock(node_); }
+
+        guard(const guard& other) noexcept = delete;
+        guard(guard&& other) noexcept = delete;
+        guard& operator=(const guard& other) noexcept = delete;
+        guard& operator=(guard&& other) noexcept = delete;
+
+      private:
+        queued_spinlock& lock_;
+        node_t           node_;
+    };
+
+    bool try_lock(node_t& node) noexcept
+    {
+      node.next.store(nullptr, std::memory_order_relaxed);
+
+      node_t* expected = nullptr;
+      if (!tail_.compare_exchange_strong(expected, &node, std::memory_order_acquire))
+      {
+        return false;
+      }
+
+      detail::spinlock_record(statistics_, 0, 0);
+      return true;
+    }
+
+    void lock(node_t& node) noexcept
+    {
+      node.next.store(nullptr, std::memory_order_relaxed);
+      node.locked.store(true, std::memory_order_relaxed);
+
+      const auto previous = tail_.exchange(&node, std::memory_order_acq_rel);
+
+      if (!previous)
+      {
+        detail::spinlock_record(statistics_, 0, 0);
+        return;
+      }
+
+      //
+      // Enqueue behind the previous node and wait until its owner
+      // hands the lock over.
+      //
+      const auto start = ia32_asm_read_tsc();
+      uint64_t spin_count = 0;
+
+      previous->next.store(&node, std::memory_order_release);
+
+      while (node.locked.load(std::memory_order_acquire))
+      {
+        ia32_asm_pause();
+        spin_count += 1;
+      }
+
+      detail::spinlock_record(statistics_, std::max(spin_count, uint64_t(1)), ia32_asm_read_tsc() - start);
+    }
+
+    void unlock(node_t& node) noexcept
+    {
+      auto next = node.next.load(std::memory_order_acquire);
+
+      if (!next)
+      {
+        //
+        // No known successor - try to release the lock.
+        //
+        node_t* expected = &node;
+        if (tail_.compare_exchange_strong(expected, nullptr, std::memory_order_release))
+        {
+          return;
+        }
+
+        //
+        // Some CPU is just enqueueing itself - wait until it links
+        // its node.
+        //
+        while (!(next = node.next.load(std::memory_order_acquire)))
+        {
+          ia32_asm_pause();
+        }
+      }
+
+      next->locked.store(false, std::memory_order_release);
+    }
+
+    auto statistics() const noexcept -> spinlock_statistics_t
+    {
+      return statistics_;
+    }
+
+    void reset_statistics() noexcept
+    {
+      statistics_ = spinlock_statistics_t{};
+    }
+
   private:
-    std::atomic_flag lock_ = ATOMIC_FLAG_INIT;
+    std::atomic<node_t*>  tail_ = nullptr;
+    spinlock_statistics_t statistics_ = {};
 };
@@ -0,0 +1,53 @@
+#pragma once
+#include <cstdint>
+
+//
+// Layout of the steal-time record shared with the guest.
+//
+// This header is shared with the guest (drivers and tooling), therefore
+// it shouldn't depend on anything else.
+//
+// Each CPU of the guest registers its own record by VMCALL executed on
+// that CPU, at CPL 0:
+//   RCX = steal_time::register_id
+//   RDX = virtual address of the record (aligned to 64 bytes), or 0 to
+//         unregister the record of this CPU
+// RAX receives 0 on success or ~0 on failure.  The page of the record
+// must stay locked until the record is unregistered - the hypervisor
+// writes into its physical page (resolved at the registration).
+//
+// The VCPU accumulates TSC ticks spent in the VMX-root mode and publishes
+// them at most once per steal_time::publish_interval ticks.  The record
+// is updated as a seqcount - "sequence" is odd while it's being updated,
+// readers retry their copy until they observe the same even value before
+// and after it.
+//
+
+namespace steal_time {
+
+static constexpr uint64_t register_id      = 0xc6;
+static constexpr uint64_t publish_interval = 1'000'000;
+
+struct alignas(64) record_t
+{
+  uint32_t sequence;
+  uint32_t cpu_index;
+
+  //
+  // TSC ticks spent in the VMX-root mode (VM-exits handled by the fast
+  // path excluded) and number of these VM-exits, since the registration.
+  //
+  uint64_t root_ticks;
+  uint64_t exit_count;
+
+  //
+  // TSC of the host at the time of the last publication.
+  //
+  uint64_t timestamp;
+
+  uint64_t reserved[4];
+};
+
+static_assert(sizeof(record_t) == 64);
+
+}
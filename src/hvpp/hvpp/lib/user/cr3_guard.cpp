@@ -0,0 +1,13 @@
+#include "../cr3_guard.h"
+
+namespace detail {
+
+ia32::cr3_t kernel_cr3(ia32::cr3_t cr3) noexcept
+{
+  //
+  // User-mode build (see HVPP_MOCK) - there is just one address space.
+  //
+  return cr3;
+}
+
+}
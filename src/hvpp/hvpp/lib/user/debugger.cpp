@@ -0,0 +1,11 @@
+#include "../debugger.h"
+
+#include <windows.h>
+
+namespace debugger::detail
+{
+  bool is_enabled() noexcept
+  {
+    return !!IsDebuggerPresent();
+  }
+}
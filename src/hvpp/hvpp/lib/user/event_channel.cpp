@@ -0,0 +1,36 @@
+#include "../event_channel.h"
+
+namespace event_channel::detail
+{
+  //
+  // User-mode build (see HVPP_MOCK) - there is no consumer to notify,
+  // the rings are read directly by the caller.
+  //
+
+  auto initialize() noexcept -> error_code_t
+  {
+    return error_code_t{};
+  }
+
+  void destroy() noexcept
+  {
+
+  }
+
+  auto notify_enable(uint64_t event_handle) noexcept -> error_code_t
+  {
+    (void)(event_handle);
+    return make_error_code_t(std::errc::not_supported);
+  }
+
+  void notify_callback(void (*callback)(void*), void* context) noexcept
+  {
+    (void)(callback);
+    (void)(context);
+  }
+
+  void notify_disable() noexcept
+  {
+
+  }
+}
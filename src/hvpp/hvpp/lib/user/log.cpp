@@ -0,0 +1,110 @@
+#include "../log.h"
+
+#include "../mp.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iterator> // std::size
+
+namespace logger::detail
+{
+  //
+  // User-mode build (see HVPP_MOCK) - everything, including the trace
+  // and binary records, is printed to the standard output.
+  //
+
+  template <size_t SIZE>
+  void make_level(char (&buffer)[SIZE], level_t level) noexcept
+  {
+    const char* level_string =
+      level == level_t::debug ? "DBG\t" :
+      level == level_t::info  ? "INF\t" :
+      level == level_t::warn  ? "WRN\t" :
+      level == level_t::error ? "ERR\t" :
+                                "###\t";
+
+    strcpy_s(buffer, SIZE, level_string);
+  }
+
+  template <size_t SIZE>
+  void make_processor_number(char(&buffer)[SIZE], uint32_t cpu_index) noexcept
+  {
+    if (!test_options(options_t::print_processor_number))
+    {
+      buffer[0] = '\0';
+      return;
+    }
+
+    sprintf_s(buffer, SIZE, "#%u\t", cpu_index);
+  }
+
+  template <size_t SIZE>
+  void make_function_name(char(&buffer)[SIZE], const char* function) noexcept
+  {
+    if (!test_options(options_t::print_function_name))
+    {
+      buffer[0] = '\0';
+      return;
+    }
+
+    sprintf_s(buffer, SIZE, "%-40s\t", function);
+  }
+
+  void do_print(level_t level, uint32_t cpu_index, const char* function, const char* format, va_list args) noexcept
+  {
+    char level_string[8];
+    make_level(level_string, level);
+
+    char processor_number[16];
+    make_processor_number(processor_number, cpu_index);
+
+    char function_name[64];
+    make_function_name(function_name, function);
+
+    char log_message[512];
+    vsprintf_s(log_message, std::size(log_message), format, args);
+
+    printf("%s%s%s%s\n", level_string, processor_number, function_name, log_message);
+  }
+
+  auto initialize() noexcept -> error_code_t
+  {
+    return error_code_t{};
+  }
+
+  void destroy() noexcept
+  {
+
+  }
+
+  void vprint(level_t level, const char* function, const char* format, va_list args) noexcept
+  {
+    if (test_level(level))
+    {
+      do_print(level, mp::cpu_index(), function, format, args);
+    }
+  }
+
+  void vprint_trace(level_t level, const char* function, const char* format, va_list args) noexcept
+  {
+    vprint(level, function, format, args);
+  }
+
+  void print_log_record(const trace_record_t& record) noexcept
+  {
+    if (test_level(record.id->level))
+    {
+      //
+      // See win32/log.cpp for the va_list.
+      //
+      auto args = reinterpret_cast<va_list>(const_cast<uint64_t*>(record.argument));
+
+      do_print(record.id->level, record.cpu_index, record.id->function, record.id->format, args);
+    }
+  }
+
+  void print_trace_record(const trace_record_t& record) noexcept
+  {
+    print_log_record(record);
+  }
+}
@@ -0,0 +1,62 @@
+#include "../mm.h"
+
+#include <malloc.h>
+
+namespace mm::detail
+{
+  //
+  // User-mode build (see HVPP_MOCK) - memory is allocated from the CRT
+  // heap.  Allocations are page-aligned, as contiguous allocations of
+  // the kernel are.
+  //
+
+  static constexpr size_t alignment = 4096;
+
+  auto system_allocate(size_t size) noexcept -> void*
+  {
+    return _aligned_malloc(size, alignment);
+  }
+
+  void system_free(void* address) noexcept
+  {
+    _aligned_free(address);
+  }
+
+  auto system_allocate_node(size_t size, uint32_t node) noexcept -> void*
+  {
+    (void)(node);
+    return _aligned_malloc(size, alignment);
+  }
+
+  void system_free_node(void* address) noexcept
+  {
+    _aligned_free(address);
+  }
+
+  auto user_map(void* address, size_t size, user_mapping_t& mapping, bool read_only) noexcept -> error_code_t
+  {
+    //
+    // Everything is already in the user-mode address space.
+    //
+    (void)(size);
+    (void)(read_only);
+
+    mapping.address = address;
+    mapping.impl = nullptr;
+    mapping.owner = nullptr;
+
+    return error_code_t{};
+  }
+
+  void user_unmap(user_mapping_t& mapping) noexcept
+  {
+    mapping.address = nullptr;
+    mapping.impl = nullptr;
+    mapping.owner = nullptr;
+  }
+
+  bool user_mapping_owned(const user_mapping_t& mapping) noexcept
+  {
+    return mapping.address != nullptr;
+  }
+}
@@ -0,0 +1,105 @@
+#include "../mp.h"
+
+#include "hvpp/config.h"
+#include "hvpp/ia32/mock/cpu.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+#include <windows.h>
+
+namespace mp::detail
+{
+  //
+  // User-mode build (see HVPP_MOCK) - CPUs are mocked (see
+  // ia32/mock/cpu.h) and all "CPUs" are run by the calling thread.
+  // Calls targeted to other CPUs are made synchronously, with the
+  // mocked CPU switched for the duration of the callback.
+  //
+
+  static void call_on(uint32_t cpu_index, void(*callback)(void*), void* context) noexcept
+  {
+    const auto previous_cpu_index = ia32::mock::cpu().index;
+
+    ia32::mock::select(cpu_index);
+    callback(context);
+    ia32::mock::select(previous_cpu_index);
+  }
+
+  uint32_t cpu_count() noexcept
+  {
+    const auto count = std::thread::hardware_concurrency();
+    return std::clamp(count, 1u, static_cast<uint32_t>(HVPP_MAX_CPU));
+  }
+
+  uint32_t cpu_index() noexcept
+  {
+    return ia32::mock::cpu().index;
+  }
+
+  uint32_t cpu_node(uint32_t cpu_index) noexcept
+  {
+    (void)(cpu_index);
+    return 0;
+  }
+
+  void sleep(uint32_t milliseconds) noexcept
+  {
+    Sleep(milliseconds);
+  }
+
+  void ipi_call(void(*callback)(void*), void* context) noexcept
+  {
+    for (uint32_t i = 0; i < cpu_count(); ++i)
+    {
+      call_on(i, callback, context);
+    }
+  }
+
+  void run_on_mask(const cpu_set_t& cpu_set, void(*callback)(void*), void* context) noexcept
+  {
+    for (uint32_t i = 0; i < cpu_count(); ++i)
+    {
+      if (cpu_set.test(i))
+      {
+        call_on(i, callback, context);
+      }
+    }
+  }
+
+  bool async_call(uint32_t cpu_index, void(*callback)(void*), void* context) noexcept
+  {
+    if (cpu_index >= cpu_count())
+    {
+      return false;
+    }
+
+    call_on(cpu_index, callback, context);
+    return true;
+  }
+
+  bool async_broadcast(async_request_t& request, const cpu_set_t& cpu_set) noexcept
+  {
+    uint32_t target_count = 0;
+    for (uint32_t i = 0; i < cpu_count(); ++i)
+    {
+      target_count += cpu_set.test(i);
+    }
+
+    request.dropped = 0;
+    request.remaining = target_count;
+
+    for (uint32_t i = 0; i < cpu_count(); ++i)
+    {
+      if (cpu_set.test(i))
+      {
+        call_on(i, request.callback, request.context);
+        request.remaining.fetch_sub(1, std::memory_order_release);
+      }
+    }
+
+    return true;
+  }
+}
@@ -1,5 +1,7 @@
 #include "vmware.h"
 
+#include "hvpp/ia32/asm.h"
+
 bool
 try_decode_io_instruction(
   const uint8_t* rip,
@@ -93,6 +95,25 @@ error:
   return false;
 }
 
+bool
+is_vmware_present(
+  ) noexcept
+{
+  uint32_t regs[4];
+
+  ia32_asm_cpuid(regs, 1);
+  if (!(regs[2] & (1u << 31)))                      // hypervisor present
+  {
+    return false;
+  }
+
+  //
+  // "VMwareVMware"
+  //
+  ia32_asm_cpuid(regs, 0x40000000);
+  return regs[1] == 0x61774d56 && regs[2] == 0x4d566572 && regs[3] == 0x65726177;
+}
+
 bool
 try_decode_io_instruction(
   const ia32::context_t& ctx,
@@ -35,6 +35,20 @@
 // When all of this is done, VMWare Tools continue to work.
 //
 
+//
+// Low-bandwidth and high-bandwidth backdoor I/O ports.
+//
+inline constexpr bool is_vmware_backdoor_port(uint16_t port) noexcept
+{ return port == 0x5658 || port == 0x5659; }
+
+//
+// Returns true if the hypervisor we're running under is VMWare
+// ("VMwareVMware" signature of the CPUID hypervisor leaf).
+//
+bool
+is_vmware_present(
+  ) noexcept;
+
 extern "C"
 int
 ia32_asm_io_with_context(
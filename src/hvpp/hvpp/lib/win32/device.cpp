@@ -10,6 +10,27 @@ extern PDRIVER_OBJECT GlobalDriverObject;
 #define HVPP_DEVICE_TAG     'vdvh'
 #define MAX_BUFFER_SIZE     64
 
+//
+// Macro to extract access out of the device io control code
+// (see win32/driver.cpp).
+//
+#define ACCESS_FROM_CTL_CODE(ctrlCode)  (((ULONG)(ctrlCode & 0x0000c000)) >> 14)
+
+//
+// Queue of pending IOCTL requests (see device::on_ioctl_queue()).
+// Cancellation is handled by the cancel-safe queue (IoCsq*).
+//
+typedef struct _DEVICE_QUEUE
+{
+  IO_CSQ Csq;
+  LIST_ENTRY PendingList;
+  KSPIN_LOCK Lock;
+  KDPC CompleteDpc;
+  device* Device;
+  int Index;
+  volatile LONG PendingCount;
+} DEVICE_QUEUE, *PDEVICE_QUEUE;
+
 //
 // Private implementation.
 //
@@ -19,8 +40,134 @@ typedef struct _DEVICE_IMPL
 
   UNICODE_STRING DeviceLink;
   WCHAR DeviceLinkBuffer[MAX_BUFFER_SIZE + sizeof(L"\\DosDevices\\") - 1];
+
+  DEVICE_QUEUE Queue[device::max_queue_count];
 } DEVICE_IMPL, *PDEVICE_IMPL;
 
+static
+VOID
+NTAPI
+CsqInsertIrp(
+  _In_ PIO_CSQ Csq,
+  _In_ PIRP Irp
+  )
+{
+  PDEVICE_QUEUE Queue = CONTAINING_RECORD(Csq, DEVICE_QUEUE, Csq);
+
+  InsertTailList(&Queue->PendingList, &Irp->Tail.Overlay.ListEntry);
+  InterlockedIncrement(&Queue->PendingCount);
+}
+
+static
+VOID
+NTAPI
+CsqRemoveIrp(
+  _In_ PIO_CSQ Csq,
+  _In_ PIRP Irp
+  )
+{
+  PDEVICE_QUEUE Queue = CONTAINING_RECORD(Csq, DEVICE_QUEUE, Csq);
+
+  RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+  InterlockedDecrement(&Queue->PendingCount);
+}
+
+static
+PIRP
+NTAPI
+CsqPeekNextIrp(
+  _In_ PIO_CSQ Csq,
+  _In_opt_ PIRP Irp,
+  _In_opt_ PVOID PeekContext
+  )
+{
+  PDEVICE_QUEUE Queue = CONTAINING_RECORD(Csq, DEVICE_QUEUE, Csq);
+
+  //
+  // PeekContext is either NULL (any request) or the file object whose
+  // requests are looked for (see device::cancel()).
+  //
+  PLIST_ENTRY Entry = Irp
+    ? Irp->Tail.Overlay.ListEntry.Flink
+    : Queue->PendingList.Flink;
+
+  for (; Entry != &Queue->PendingList; Entry = Entry->Flink)
+  {
+    PIRP NextIrp = CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
+
+    if (!PeekContext || IoGetCurrentIrpStackLocation(NextIrp)->FileObject == PeekContext)
+    {
+      return NextIrp;
+    }
+  }
+
+  return nullptr;
+}
+
+_IRQL_raises_(DISPATCH_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Acquires_lock_(CONTAINING_RECORD(Csq, DEVICE_QUEUE, Csq)->Lock)
+static
+VOID
+NTAPI
+CsqAcquireLock(
+  _In_ PIO_CSQ Csq,
+  _Out_ _At_(*Irql, _Post_ _IRQL_saves_) PKIRQL Irql
+  )
+{
+  PDEVICE_QUEUE Queue = CONTAINING_RECORD(Csq, DEVICE_QUEUE, Csq);
+
+  KeAcquireSpinLock(&Queue->Lock, Irql);
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+_Releases_lock_(CONTAINING_RECORD(Csq, DEVICE_QUEUE, Csq)->Lock)
+static
+VOID
+NTAPI
+CsqReleaseLock(
+  _In_ PIO_CSQ Csq,
+  _In_ _IRQL_restores_ KIRQL Irql
+  )
+{
+  PDEVICE_QUEUE Queue = CONTAINING_RECORD(Csq, DEVICE_QUEUE, Csq);
+
+  KeReleaseSpinLock(&Queue->Lock, Irql);
+}
+
+static
+VOID
+NTAPI
+CsqCompleteCanceledIrp(
+  _In_ PIO_CSQ Csq,
+  _In_ PIRP Irp
+  )
+{
+  UNREFERENCED_PARAMETER(Csq);
+
+  Irp->IoStatus.Status = STATUS_CANCELLED;
+  Irp->IoStatus.Information = 0;
+  IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+static
+VOID
+NTAPI
+QueueCompleteDpcRoutine(
+  _In_ PKDPC Dpc,
+  _In_opt_ PVOID DeferredContext,
+  _In_opt_ PVOID SystemArgument1,
+  _In_opt_ PVOID SystemArgument2
+  )
+{
+  UNREFERENCED_PARAMETER(Dpc);
+  UNREFERENCED_PARAMETER(SystemArgument1);
+  UNREFERENCED_PARAMETER(SystemArgument2);
+
+  PDEVICE_QUEUE Queue = (PDEVICE_QUEUE)DeferredContext;
+  Queue->Device->complete(Queue->Index);
+}
+
 auto device::create() noexcept -> error_code_t
 {
   error_code_t err;
@@ -39,8 +186,28 @@ auto device::create() noexcept -> error_code_t
 
   if (!DeviceImpl)
   {
-    err = make_error_code_t(std::errc::not_enough_memory);
-    goto Error;
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  RtlZeroMemory(DeviceImpl, sizeof(DEVICE_IMPL));
+
+  for (int QueueIndex = 0; QueueIndex < max_queue_count; ++QueueIndex)
+  {
+    PDEVICE_QUEUE Queue = &DeviceImpl->Queue[QueueIndex];
+
+    InitializeListHead(&Queue->PendingList);
+    KeInitializeSpinLock(&Queue->Lock);
+    KeInitializeDpc(&Queue->CompleteDpc, &QueueCompleteDpcRoutine, Queue);
+    IoCsqInitialize(&Queue->Csq,
+                    &CsqInsertIrp,
+                    &CsqRemoveIrp,
+                    &CsqPeekNextIrp,
+                    &CsqAcquireLock,
+                    &CsqReleaseLock,
+                    &CsqCompleteCanceledIrp);
+
+    Queue->Device = this;
+    Queue->Index = QueueIndex;
   }
 
   //
@@ -151,6 +318,13 @@ void device::destroy() noexcept
 
   if (DeviceImpl)
   {
+    //
+    // Wait for completion DPCs which might be still running and cancel
+    // all requests which are still pending.
+    //
+    KeFlushQueuedDpcs();
+    cancel(nullptr);
+
     IoDeleteSymbolicLink(&DeviceImpl->DeviceLink);
     IoDeleteDevice(DeviceImpl->DeviceObject);
 
@@ -160,6 +334,121 @@ void device::destroy() noexcept
   }
 }
 
+auto device::complete(int queue_index, size_t count /* = size_t(-1) */) noexcept -> size_t
+{
+  PDEVICE_IMPL DeviceImpl = (PDEVICE_IMPL)impl_;
+
+  if (!DeviceImpl || queue_index < 0 || queue_index >= max_queue_count)
+  {
+    return 0;
+  }
+
+  PDEVICE_QUEUE Queue = &DeviceImpl->Queue[queue_index];
+  size_t result = 0;
+
+  while (result < count)
+  {
+    PIRP Irp = IoCsqRemoveNextIrp(&Queue->Csq, nullptr);
+
+    if (!Irp)
+    {
+      break;
+    }
+
+    //
+    // Dispatch the request now - see DriverDispatch() (win32/driver.cpp).
+    //
+    PIO_STACK_LOCATION IoStackLocation = IoGetCurrentIrpStackLocation(Irp);
+
+    const ULONG IoControlCode = IoStackLocation->Parameters.DeviceIoControl.IoControlCode;
+    const ULONG OutputBufferLength = IoStackLocation->Parameters.DeviceIoControl.OutputBufferLength;
+    const ULONG InputBufferLength = IoStackLocation->Parameters.DeviceIoControl.InputBufferLength;
+    const ULONG BufferLength = InputBufferLength > OutputBufferLength
+      ? InputBufferLength
+      : OutputBufferLength;
+
+    const auto err = on_ioctl(Irp->AssociatedIrp.SystemBuffer, BufferLength, IoControlCode);
+
+    Irp->IoStatus.Status = !err ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+    Irp->IoStatus.Information = (ACCESS_FROM_CTL_CODE(IoControlCode) & FILE_WRITE_ACCESS)
+      ? OutputBufferLength
+      : 0;
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    ++result;
+  }
+
+  return result;
+}
+
+void device::complete_async(int queue_index) noexcept
+{
+  PDEVICE_IMPL DeviceImpl = (PDEVICE_IMPL)impl_;
+
+  if (!DeviceImpl || queue_index < 0 || queue_index >= max_queue_count)
+  {
+    return;
+  }
+
+  //
+  // Does nothing if the DPC is already queued.
+  //
+  KeInsertQueueDpc(&DeviceImpl->Queue[queue_index].CompleteDpc, nullptr, nullptr);
+}
+
+auto device::pending_count(int queue_index) const noexcept -> size_t
+{
+  PDEVICE_IMPL DeviceImpl = (PDEVICE_IMPL)impl_;
+
+  if (!DeviceImpl || queue_index < 0 || queue_index >= max_queue_count)
+  {
+    return 0;
+  }
+
+  return size_t(DeviceImpl->Queue[queue_index].PendingCount);
+}
+
+bool device::enqueue(int queue_index, void* request) noexcept
+{
+  PDEVICE_IMPL DeviceImpl = (PDEVICE_IMPL)impl_;
+
+  if (!DeviceImpl || queue_index < 0 || queue_index >= max_queue_count)
+  {
+    return false;
+  }
+
+  //
+  // Marks the IRP as pending (or completes it right away, if it has
+  // been cancelled meanwhile).
+  //
+  IoCsqInsertIrp(&DeviceImpl->Queue[queue_index].Csq, (PIRP)request, nullptr);
+  return true;
+}
+
+void device::cancel(void* file_object) noexcept
+{
+  PDEVICE_IMPL DeviceImpl = (PDEVICE_IMPL)impl_;
+
+  if (!DeviceImpl)
+  {
+    return;
+  }
+
+  //
+  // Cancel pending requests of the file object (or all of them, if
+  // file_object is NULL).
+  //
+  for (int QueueIndex = 0; QueueIndex < max_queue_count; ++QueueIndex)
+  {
+    PIRP Irp;
+
+    while ((Irp = IoCsqRemoveNextIrp(&DeviceImpl->Queue[QueueIndex].Csq, file_object)) != nullptr)
+    {
+      CsqCompleteCanceledIrp(&DeviceImpl->Queue[QueueIndex].Csq, Irp);
+    }
+  }
+}
+
 error_code_t device::copy_from_user(void* buffer_to, const void* buffer_from, size_t length) noexcept
 {
   __try
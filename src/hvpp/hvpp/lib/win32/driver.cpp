@@ -20,6 +20,10 @@
 //
 #define ACCESS_FROM_CTL_CODE(ctrlCode)  (((ULONG)(ctrlCode & 0x0000c000)) >> 14)
 
+#ifndef METHOD_FROM_CTL_CODE
+# define METHOD_FROM_CTL_CODE(ctrlCode) ((ULONG)(ctrlCode & 3))
+#endif
+
 EXTERN_C DRIVER_INITIALIZE DriverEntry;
 
 PDRIVER_OBJECT GlobalDriverObject = nullptr;
@@ -77,6 +81,14 @@ DriverDispatch(
       err = CppDeviceObject->on_close();
       break;
 
+    case IRP_MJ_CLEANUP:
+      //
+      // Pending requests of the closed handle have to be cancelled.
+      //
+      CppDeviceObject->cancel(IoStackLocation->FileObject);
+      err = CppDeviceObject->on_cleanup();
+      break;
+
     case IRP_MJ_READ:
       //
       // TODO: Offset?
@@ -99,6 +111,52 @@ DriverDispatch(
       //
       IoControlCode = IoStackLocation->Parameters.DeviceIoControl.IoControlCode;
 
+      if (METHOD_FROM_CTL_CODE(IoControlCode) == METHOD_IN_DIRECT ||
+          METHOD_FROM_CTL_CODE(IoControlCode) == METHOD_OUT_DIRECT)
+      {
+        //
+        // The input buffer is in the system buffer, the output buffer
+        // is described by the MDL (already locked by the I/O manager).
+        //
+        const ULONG DirectBufferLength = IoStackLocation->Parameters.DeviceIoControl.OutputBufferLength;
+        PVOID DirectBuffer = nullptr;
+
+        if (Irp->MdlAddress)
+        {
+          DirectBuffer = MmGetSystemAddressForMdlSafe(Irp->MdlAddress,
+                                                      NormalPagePriority | MdlMappingNoExecute);
+
+          if (!DirectBuffer)
+          {
+            err = make_error_code_t(std::errc::not_enough_memory);
+            break;
+          }
+        }
+
+        err = CppDeviceObject->on_ioctl_direct(Buffer,
+                                               IoStackLocation->Parameters.DeviceIoControl.InputBufferLength,
+                                               DirectBuffer,
+                                               DirectBuffer ? DirectBufferLength : 0,
+                                               IoControlCode);
+
+        if (!err && DirectBuffer)
+        {
+          BytesTransferred = DirectBufferLength;
+        }
+
+        break;
+      }
+
+      //
+      // Requests which can't be served right now are marked as pending
+      // and completed later by the device (see device::complete()).
+      //
+      if (const int QueueIndex = CppDeviceObject->on_ioctl_queue(IoControlCode);
+          QueueIndex >= 0 && CppDeviceObject->enqueue(QueueIndex, Irp))
+      {
+        return STATUS_PENDING;
+      }
+
       //
       // Set buffer length as the biggest of these buffers.
       // Note that Irp->AssociatedIrp.SystemBuffer is guaranteed
@@ -139,8 +197,9 @@ DriverDispatch(
   // that completed the IRP.
   // (ref: https://docs.microsoft.com/en-us/windows-hardware/drivers/ifs/returning-status-from-dispatch-routines)
   //
-  // Note that we're not doing any async-I/O, so we never return
-  // STATUS_PENDING.  Just pass down whatever is in IoStatus.Status.
+  // Note that pending requests return STATUS_PENDING above (they're
+  // completed by the device).  Just pass down whatever is in
+  // IoStatus.Status.
   //
   return Irp->IoStatus.Status;
 }
@@ -172,6 +231,7 @@ DriverEntry(
   DriverObject->DriverUnload                         = &DriverUnload;
   DriverObject->MajorFunction[IRP_MJ_CREATE]         = &DriverDispatch;
   DriverObject->MajorFunction[IRP_MJ_CLOSE]          = &DriverDispatch;
+  DriverObject->MajorFunction[IRP_MJ_CLEANUP]        = &DriverDispatch;
   DriverObject->MajorFunction[IRP_MJ_READ]           = &DriverDispatch;
   DriverObject->MajorFunction[IRP_MJ_WRITE]          = &DriverDispatch;
   DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = &DriverDispatch;
@@ -0,0 +1,140 @@
+#include "../event_channel.h"
+#include "../assert.h"
+
+#include <ntddk.h>
+
+namespace event_channel::detail
+{
+  //
+  // post() is called from the VMX-root mode, where the event can't be
+  // signaled.  Instead, the periodic timer DPC looks for rings with
+  // pending events and signals the event if the consumer waits.
+  //
+
+  static constexpr auto notify_interval_ms = 1;
+
+  KTIMER  notify_timer;
+  KDPC    notify_dpc;
+  PKEVENT notify_event = nullptr;
+
+  void  (*notify_callback_routine)(void*) = nullptr;
+  void*   notify_callback_context = nullptr;
+
+  static
+  void
+  notify_routine(
+    PKDPC Dpc,
+    PVOID DeferredContext,
+    PVOID SystemArgument1,
+    PVOID SystemArgument2
+    ) noexcept
+  {
+    (void)(Dpc);
+    (void)(DeferredContext);
+    (void)(SystemArgument1);
+    (void)(SystemArgument2);
+
+    auto channel = ring();
+
+    if (!channel)
+    {
+      return;
+    }
+
+    if (const auto callback = notify_callback_routine;
+        callback && unread_count())
+    {
+      callback(notify_callback_context);
+    }
+
+    if (!notify_event || !channel->waiting)
+    {
+      return;
+    }
+
+    bool pending = false;
+
+    for (uint32_t cpu_index = 0; cpu_index < channel->cpu_count; ++cpu_index)
+    {
+      auto& cpu_ring = channel->cpu[cpu_index];
+
+      if (cpu_ring.pending)
+      {
+        cpu_ring.pending = 0;
+        pending = true;
+      }
+    }
+
+    if (pending)
+    {
+      channel->waiting = 0;
+      KeSetEvent(notify_event, IO_NO_INCREMENT, FALSE);
+    }
+  }
+
+  auto initialize() noexcept -> error_code_t
+  {
+    KeInitializeTimerEx(&notify_timer, NotificationTimer);
+    KeInitializeDpc(&notify_dpc, &notify_routine, nullptr);
+
+    return error_code_t{};
+  }
+
+  void destroy() noexcept
+  {
+    hvpp_assert(notify_event == nullptr);
+  }
+
+  auto notify_enable(uint64_t event_handle) noexcept -> error_code_t
+  {
+    PKEVENT event;
+    const auto status = ObReferenceObjectByHandle(reinterpret_cast<HANDLE>(event_handle),
+                                                  EVENT_MODIFY_STATE,
+                                                  *ExEventObjectType,
+                                                  UserMode,
+                                                  reinterpret_cast<void**>(&event),
+                                                  nullptr);
+
+    if (!NT_SUCCESS(status))
+    {
+      return make_error_code_t(std::errc::invalid_argument);
+    }
+
+    notify_event = event;
+
+    LARGE_INTEGER due_time;
+    due_time.QuadPart = -10'000ll * notify_interval_ms;
+    KeSetTimerEx(&notify_timer, due_time, notify_interval_ms, &notify_dpc);
+
+    return error_code_t{};
+  }
+
+  void notify_callback(void (*callback)(void*), void* context) noexcept
+  {
+    //
+    // Unregister before the context changes and wait for the DPC
+    // which might be still using the previous callback.
+    //
+    notify_callback_routine = nullptr;
+    KeFlushQueuedDpcs();
+
+    notify_callback_context = context;
+    notify_callback_routine = callback;
+  }
+
+  void notify_disable() noexcept
+  {
+    KeCancelTimer(&notify_timer);
+
+    //
+    // Wait for the DPC which might be still running.
+    //
+    KeFlushQueuedDpcs();
+
+    if (notify_event)
+    {
+      ObDereferenceObject(notify_event);
+      notify_event = nullptr;
+    }
+  }
+}
@@ -122,4 +122,55 @@ namespace logger::detail
       do_print(buffer);
     }
   }
+
+  void print_log_record(const trace_record_t& record) noexcept
+  {
+    if (test_level(record.id->level))
+    {
+      //
+      // Binary record (see hvpp_log_binary) - formatted by the drainer,
+      // therefore the process and the thread are unknown and the time
+      // is the TSC at the time of writing.
+      // See print_trace_record() for the va_list.
+      //
+      auto args = reinterpret_cast<va_list>(const_cast<uint64_t*>(record.argument));
+
+      char buffer[512];
+
+      char level_string[8];
+      make_level(level_string, record.id->level);
+
+      char time[32];
+      if (test_options(options_t::print_time))
+      {
+        sprintf_s(time, std::size(time), "@%llu\t", record.timestamp);
+      }
+      else
+      {
+        time[0] = '\0';
+      }
+
+      char processor_number[16];
+      if (test_options(options_t::print_processor_number))
+      {
+        sprintf_s(processor_number, std::size(processor_number), "#%u\t", record.cpu_index);
+      }
+      else
+      {
+        processor_number[0] = '\0';
+      }
+
+      char function_name[64];
+      make_function_name(function_name, record.id->function);
+
+      char log_message[512];
+      make_log_message(log_message, record.id->format, args);
+
+      sprintf_s(buffer, std::size(buffer), "%s%s%s%s%s\r\n",
+        time, level_string, processor_number,
+        function_name, log_message);
+
+      do_print(buffer);
+    }
+  }
 }
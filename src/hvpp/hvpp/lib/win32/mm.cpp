@@ -25,4 +25,125 @@ namespace mm::detail
 
     ExFreePoolWithTag(address, HVPP_MEMORY_TAG);
   }
+
+  auto system_allocate_node(size_t size, uint32_t node) noexcept -> void*
+  {
+    PHYSICAL_ADDRESS lowest_acceptable_address;
+    PHYSICAL_ADDRESS highest_acceptable_address;
+    PHYSICAL_ADDRESS boundary_address_multiple;
+
+    lowest_acceptable_address.QuadPart  = 0;
+    highest_acceptable_address.QuadPart = -1;
+    boundary_address_multiple.QuadPart  = 0;
+
+    //
+    // If the node doesn't have enough free memory, memory from other
+    // nodes is used.
+    //
+    return MmAllocateContiguousNodeMemory(size,
+                                          lowest_acceptable_address,
+                                          highest_acceptable_address,
+                                          boundary_address_multiple,
+                                          PAGE_READWRITE,
+                                          node);
+  }
+
+  void system_free_node(void* address) noexcept
+  {
+    if (address == nullptr)
+    {
+      return;
+    }
+
+    MmFreeContiguousMemory(address);
+  }
+
+  auto user_map(void* address, size_t size, user_mapping_t& mapping, bool read_only) noexcept -> error_code_t
+  {
+    mapping.address = nullptr;
+    mapping.impl = nullptr;
+    mapping.owner = nullptr;
+
+    PMDL Mdl = IoAllocateMdl(address,
+                             (ULONG)size,
+                             FALSE,
+                             FALSE,
+                             NULL);
+
+    if (!Mdl)
+    {
+      return make_error_code_t(std::errc::not_enough_memory);
+    }
+
+    MmBuildMdlForNonPagedPool(Mdl);
+
+    PVOID UserAddress = nullptr;
+
+    __try
+    {
+      UserAddress = MmMapLockedPagesSpecifyCache(Mdl,
+                                                 UserMode,
+                                                 MmCached,
+                                                 NULL,
+                                                 FALSE,
+                                                 NormalPagePriority | (read_only ? MdlMappingNoWrite : 0));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+      UserAddress = nullptr;
+    }
+
+    if (!UserAddress)
+    {
+      IoFreeMdl(Mdl);
+      return make_error_code_t(std::errc::not_enough_memory);
+    }
+
+    //
+    // The mapping can be removed only in the context of this process
+    // (see user_unmap()) - keep the process referenced until then.
+    //
+    PEPROCESS Process = PsGetCurrentProcess();
+    ObReferenceObject(Process);
+
+    mapping.address = UserAddress;
+    mapping.impl = Mdl;
+    mapping.owner = Process;
+
+    return error_code_t{};
+  }
+
+  void user_unmap(user_mapping_t& mapping) noexcept
+  {
+    PMDL Mdl = (PMDL)mapping.impl;
+
+    if (!Mdl)
+    {
+      return;
+    }
+
+    //
+    // MmUnmapLockedPages() of a user-mode address must be called in
+    // the context of the process which owns it - otherwise it would
+    // unmap whatever lives at that address in the current process.
+    //
+    if (!user_mapping_owned(mapping))
+    {
+      return;
+    }
+
+    MmUnmapLockedPages(mapping.address, Mdl);
+    IoFreeMdl(Mdl);
+
+    ObDereferenceObject((PEPROCESS)mapping.owner);
+
+    mapping.address = nullptr;
+    mapping.impl = nullptr;
+    mapping.owner = nullptr;
+  }
+
+  bool user_mapping_owned(const user_mapping_t& mapping) noexcept
+  {
+    return mapping.impl && mapping.owner == PsGetCurrentProcess();
+  }
 }
@@ -1,11 +1,54 @@
 #include "../mp.h"
 
+#include "hvpp/config.h"
+
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 
 #include <ntddk.h>
 
 namespace mp::detail
 {
+  struct async_call_t
+  {
+    KDPC             dpc;
+    void           (*callback)(void*);
+    void*            context;
+    std::atomic_bool busy;
+  };
+
+  static async_call_t async_call_list[HVPP_MAX_CPU];
+
+  struct parallel_call_t
+  {
+    void               (*callback)(void*);
+    void*                context;
+    std::atomic_uint32_t remaining;
+    KEVENT               done;
+  };
+
+  static KDPC             parallel_call_dpc_list[HVPP_MAX_CPU];
+  static std::atomic_bool parallel_call_busy;
+
+  //
+  // Per-CPU queue of asynchronous broadcast requests.  The queue is
+  // drained by the DPC targeted to its CPU.
+  //
+  static constexpr uint32_t async_queue_size = 64;
+
+  struct async_queue_t
+  {
+    KDPC                 dpc;
+    KSPIN_LOCK           lock;
+    std::atomic_uint32_t state;     // 0 - uninitialized, 1 - initializing, 2 - ready
+    uint32_t             head;
+    uint32_t             tail;
+    async_request_t*     item[async_queue_size];
+  };
+
+  static async_queue_t async_queue_list[HVPP_MAX_CPU];
+
   uint32_t cpu_count() noexcept
   {
     return KeQueryActiveProcessorCountEx(0);
@@ -16,6 +59,32 @@ namespace mp::detail
     return KeGetCurrentProcessorNumberEx(NULL);
   }
 
+  uint32_t cpu_node(uint32_t cpu_index) noexcept
+  {
+    PROCESSOR_NUMBER processor_number;
+    if (!NT_SUCCESS(KeGetProcessorNumberFromIndex(cpu_index, &processor_number)))
+    {
+      return 0;
+    }
+
+    const auto node_count = KeQueryHighestNodeNumber() + 1;
+
+    for (USHORT node = 0; node < node_count; ++node)
+    {
+      GROUP_AFFINITY affinity;
+      USHORT count;
+      KeQueryNodeActiveAffinity(node, &affinity, &count);
+
+      if (affinity.Group == processor_number.Group &&
+          affinity.Mask & (KAFFINITY(1) << processor_number.Number))
+      {
+        return node;
+      }
+    }
+
+    return 0;
+  }
+
   void sleep(uint32_t milliseconds) noexcept
   {
     LARGE_INTEGER interval;
@@ -50,4 +119,269 @@ namespace mp::detail
       return 0;
     }, (ULONG_PTR)&ipi_context);
   }
+
+  static void parallel_call_complete(parallel_call_t& item) noexcept
+  {
+    //
+    // The last CPU wakes up the caller.
+    //
+    if (--item.remaining == 0)
+    {
+      KeSetEvent(&item.done, IO_NO_INCREMENT, FALSE);
+    }
+  }
+
+  void run_on_mask(const cpu_set_t& cpu_set, void(*callback)(void*), void* context) noexcept
+  {
+    const auto count = std::min(cpu_count(), static_cast<uint32_t>(HVPP_MAX_CPU));
+
+    uint32_t target_count = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      target_count += cpu_set.test(i);
+    }
+
+    if (target_count == 0)
+    {
+      return;
+    }
+
+    //
+    // DPCs are shared by all parallel calls - serialize them.
+    //
+    while (parallel_call_busy.exchange(true))
+    {
+      sleep(1);
+    }
+
+    parallel_call_t call;
+    call.callback  = callback;
+    call.context   = context;
+    call.remaining = target_count;
+    KeInitializeEvent(&call.done, NotificationEvent, FALSE);
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      if (!cpu_set.test(i))
+      {
+        continue;
+      }
+
+      auto& dpc = parallel_call_dpc_list[i];
+
+      PROCESSOR_NUMBER processor_number;
+      if (!NT_SUCCESS(KeGetProcessorNumberFromIndex(i, &processor_number)))
+      {
+        parallel_call_complete(call);
+        continue;
+      }
+
+      KeInitializeDpc(&dpc, [](PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2) noexcept {
+        UNREFERENCED_PARAMETER(Dpc);
+        UNREFERENCED_PARAMETER(SystemArgument1);
+        UNREFERENCED_PARAMETER(SystemArgument2);
+
+        //
+        // Note that the function is called with IRQL at DISPATCH_LEVEL.
+        //
+        auto item = reinterpret_cast<parallel_call_t*>(DeferredContext);
+        item->callback(item->context);
+
+        parallel_call_complete(*item);
+      }, &call);
+
+      KeSetTargetProcessorDpcEx(&dpc, &processor_number);
+      KeSetImportanceDpc(&dpc, HighImportance);
+      KeInsertQueueDpc(&dpc, nullptr, nullptr);
+    }
+
+    KeWaitForSingleObject(&call.done, Executive, KernelMode, FALSE, nullptr);
+
+    parallel_call_busy = false;
+  }
+
+  static void async_queue_drain(async_queue_t& queue) noexcept
+  {
+    for (;;)
+    {
+      async_request_t* request;
+
+      KeAcquireSpinLockAtDpcLevel(&queue.lock);
+      if (queue.head == queue.tail)
+      {
+        KeReleaseSpinLockFromDpcLevel(&queue.lock);
+        break;
+      }
+
+      request = queue.item[queue.tail % async_queue_size];
+      queue.tail += 1;
+      KeReleaseSpinLockFromDpcLevel(&queue.lock);
+
+      request->callback(request->context);
+
+      //
+      // Don't touch the request after this point - it might be freed
+      // by its owner as soon as it's complete.
+      //
+      request->remaining.fetch_sub(1, std::memory_order_release);
+    }
+  }
+
+  static bool async_queue_initialize(async_queue_t& queue, uint32_t cpu_index) noexcept
+  {
+    uint32_t expected = 0;
+
+    if (queue.state.compare_exchange_strong(expected, 1))
+    {
+      PROCESSOR_NUMBER processor_number;
+      if (!NT_SUCCESS(KeGetProcessorNumberFromIndex(cpu_index, &processor_number)))
+      {
+        queue.state = 0;
+        return false;
+      }
+
+      KeInitializeSpinLock(&queue.lock);
+      KeInitializeDpc(&queue.dpc, [](PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2) noexcept {
+        UNREFERENCED_PARAMETER(Dpc);
+        UNREFERENCED_PARAMETER(SystemArgument1);
+        UNREFERENCED_PARAMETER(SystemArgument2);
+
+        //
+        // Note that the function is called with IRQL at DISPATCH_LEVEL.
+        //
+        async_queue_drain(*reinterpret_cast<async_queue_t*>(DeferredContext));
+      }, &queue);
+
+      KeSetTargetProcessorDpcEx(&queue.dpc, &processor_number);
+      queue.state = 2;
+      return true;
+    }
+
+    //
+    // Somebody else is initializing the queue.
+    //
+    while (queue.state.load() == 1)
+    {
+      YieldProcessor();
+    }
+
+    return queue.state.load() == 2;
+  }
+
+  bool async_broadcast(async_request_t& request, const cpu_set_t& cpu_set) noexcept
+  {
+    const auto count = std::min(cpu_count(), static_cast<uint32_t>(HVPP_MAX_CPU));
+
+    //
+    // Count the targets first - the request might be processed (and
+    // "remaining" decremented) as soon as it's queued on the first CPU.
+    //
+    uint32_t target_count = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      target_count += cpu_set.test(i);
+    }
+
+    request.dropped = 0;
+    request.remaining = target_count;
+
+    //
+    // Note that this function can't touch the request once the last
+    // CPU has been handled - the request might be already complete.
+    //
+    bool result = true;
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      if (!cpu_set.test(i))
+      {
+        continue;
+      }
+
+      auto& queue = async_queue_list[i];
+      bool queued = false;
+
+      if (async_queue_initialize(queue, i))
+      {
+        KIRQL irql;
+        KeAcquireSpinLock(&queue.lock, &irql);
+
+        if (queue.head - queue.tail < async_queue_size)
+        {
+          queue.item[queue.head % async_queue_size] = &request;
+          queue.head += 1;
+          queued = true;
+        }
+
+        KeReleaseSpinLock(&queue.lock, irql);
+      }
+
+      if (!queued)
+      {
+        result = false;
+        request.dropped.fetch_add(1);
+        request.remaining.fetch_sub(1, std::memory_order_release);
+        continue;
+      }
+
+      //
+      // If the DPC is already queued, it picks up this request as well.
+      //
+      KeInsertQueueDpc(&queue.dpc, nullptr, nullptr);
+    }
+
+    return result;
+  }
+
+  bool async_call(uint32_t cpu_index, void(*callback)(void*), void* context) noexcept
+  {
+    if (cpu_index >= HVPP_MAX_CPU)
+    {
+      return false;
+    }
+
+    auto& item = async_call_list[cpu_index];
+
+    //
+    // Only one asynchronous call per CPU can be in flight.
+    // The "busy" flag is reset by the DPC routine right before
+    // the callback is called.
+    //
+    if (item.busy.exchange(true))
+    {
+      return false;
+    }
+
+    PROCESSOR_NUMBER processor_number;
+    if (!NT_SUCCESS(KeGetProcessorNumberFromIndex(cpu_index, &processor_number)))
+    {
+      item.busy = false;
+      return false;
+    }
+
+    item.callback = callback;
+    item.context  = context;
+
+    KeInitializeDpc(&item.dpc, [](PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2) noexcept {
+      UNREFERENCED_PARAMETER(Dpc);
+      UNREFERENCED_PARAMETER(SystemArgument1);
+      UNREFERENCED_PARAMETER(SystemArgument2);
+
+      //
+      // Note that the function is called with IRQL at DISPATCH_LEVEL.
+      //
+      auto item = reinterpret_cast<async_call_t*>(DeferredContext);
+      auto callback = item->callback;
+      auto context = item->context;
+
+      item->busy = false;
+      callback(context);
+    }, &item);
+
+    KeSetTargetProcessorDpcEx(&item.dpc, &processor_number);
+    KeSetImportanceDpc(&item.dpc, HighImportance);
+    KeInsertQueueDpc(&item.dpc, nullptr, nullptr);
+
+    return true;
+  }
 }
@@ -26,6 +26,104 @@ PsGetProcessImageFileName (
 
 namespace logger::detail
 {
+  //
+  // Drainer of the trace rings (see logger::trace_ring_drain()).
+  //
+
+  static constexpr auto drainer_interval_ms = 10;
+
+  PETHREAD drainer_thread = nullptr;
+  KEVENT   drainer_stop_event;
+
+  static
+  void
+  drainer_routine(
+    void* context
+    ) noexcept
+  {
+    (void)(context);
+
+    LARGE_INTEGER timeout;
+    timeout.QuadPart = -10'000ll * drainer_interval_ms;
+
+    for (;;)
+    {
+      const auto status = KeWaitForSingleObject(&drainer_stop_event,
+                                                Executive,
+                                                KernelMode,
+                                                FALSE,
+                                                &timeout);
+
+      trace_ring_drain();
+
+      if (status != STATUS_TIMEOUT)
+      {
+        break;
+      }
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+  }
+
+  static
+  auto
+  drainer_start(
+    void
+    ) noexcept -> error_code_t
+  {
+    KeInitializeEvent(&drainer_stop_event, NotificationEvent, FALSE);
+
+    HANDLE thread_handle;
+    auto status = PsCreateSystemThread(&thread_handle,
+                                       THREAD_ALL_ACCESS,
+                                       nullptr,
+                                       nullptr,
+                                       nullptr,
+                                       &drainer_routine,
+                                       nullptr);
+
+    if (!NT_SUCCESS(status))
+    {
+      return make_error_code_t(std::errc::resource_unavailable_try_again);
+    }
+
+    status = ObReferenceObjectByHandle(thread_handle,
+                                       THREAD_ALL_ACCESS,
+                                       *PsThreadType,
+                                       KernelMode,
+                                       reinterpret_cast<void**>(&drainer_thread),
+                                       nullptr);
+
+    ZwClose(thread_handle);
+
+    if (!NT_SUCCESS(status))
+    {
+      //
+      // The thread is running, but we have no way to wait for it.
+      // Stop it right away.
+      //
+      KeSetEvent(&drainer_stop_event, IO_NO_INCREMENT, FALSE);
+      return make_error_code_t(std::errc::resource_unavailable_try_again);
+    }
+
+    return error_code_t{};
+  }
+
+  static
+  void
+  drainer_stop(
+    void
+    ) noexcept
+  {
+    if (drainer_thread)
+    {
+      KeSetEvent(&drainer_stop_event, IO_NO_INCREMENT, FALSE);
+      KeWaitForSingleObject(drainer_thread, Executive, KernelMode, FALSE, nullptr);
+      ObDereferenceObject(drainer_thread);
+      drainer_thread = nullptr;
+    }
+  }
+
   void do_print_trace(const char* process_name, const char* function, const char* message) noexcept
   {
     if (test_options(options_t::print_function_name))
@@ -52,11 +150,18 @@ namespace logger::detail
       return make_error_code_t(std::errc::not_enough_memory);
     }
 
+    if (auto err = drainer_start())
+    {
+      TraceLoggingUnregister(provider);
+      return err;
+    }
+
     return error_code_t{};
   }
 
   void destroy() noexcept
   {
+    drainer_stop();
     TraceLoggingUnregister(provider);
   }
 
@@ -73,4 +178,42 @@ namespace logger::detail
       do_print_trace(process_name, function_name, log_message);
     }
   }
+
+  void print_trace_record(const trace_record_t& record) noexcept
+  {
+    if (record.id->event == event_t::vmexit)
+    {
+      //
+      // See logger::trace_exit_event().
+      //
+      TraceLoggingWrite(provider,
+        "VmExit",
+        TraceLoggingUInt32(record.cpu_index, "Processor"),
+        TraceLoggingUInt64(record.timestamp, "Tsc"),
+        TraceLoggingUInt32(static_cast<uint32_t>(record.argument[0]), "ExitReason"),
+        TraceLoggingHexUInt64(record.argument[1], "ExitQualification"),
+        TraceLoggingHexUInt64(record.argument[2], "GuestRip"),
+        TraceLoggingHexUInt64(record.argument[3], "GuestCr3"),
+        TraceLoggingUInt64(record.argument[4], "HandlerTicks"));
+
+      return;
+    }
+
+    if (test_level(level_t::trace))
+    {
+      //
+      // On x64 the va_list is just a pointer to the 8-byte argument
+      // slots, therefore the stored arguments can be passed directly.
+      //
+      auto args = reinterpret_cast<va_list>(const_cast<uint64_t*>(record.argument));
+
+      char process_name[16];
+      sprintf_s(process_name, std::size(process_name), "VMX-root #%u", record.cpu_index);
+
+      char log_message[512];
+      vsprintf_s(log_message, std::size(log_message), record.id->format, args);
+
+      do_print_trace(process_name, record.id->function, log_message);
+    }
+  }
 }
@@ -0,0 +1,97 @@
+#include "../work_queue.h"
+#include "../assert.h"
+
+#include <ntddk.h>
+
+namespace work_queue::detail
+{
+  //
+  // Worker which drains the rings (see work_queue::drain()).
+  //
+
+  static constexpr auto worker_interval_ms = 10;
+
+  PETHREAD worker_thread = nullptr;
+  KEVENT   worker_stop_event;
+
+  static
+  void
+  worker_routine(
+    void* context
+    ) noexcept
+  {
+    (void)(context);
+
+    LARGE_INTEGER timeout;
+    timeout.QuadPart = -10'000ll * worker_interval_ms;
+
+    for (;;)
+    {
+      const auto status = KeWaitForSingleObject(&worker_stop_event,
+                                                Executive,
+                                                KernelMode,
+                                                FALSE,
+                                                &timeout);
+
+      drain();
+
+      if (status != STATUS_TIMEOUT)
+      {
+        break;
+      }
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+  }
+
+  auto initialize() noexcept -> error_code_t
+  {
+    KeInitializeEvent(&worker_stop_event, NotificationEvent, FALSE);
+
+    HANDLE thread_handle;
+    auto status = PsCreateSystemThread(&thread_handle,
+                                       THREAD_ALL_ACCESS,
+                                       nullptr,
+                                       nullptr,
+                                       nullptr,
+                                       &worker_routine,
+                                       nullptr);
+
+    if (!NT_SUCCESS(status))
+    {
+      return make_error_code_t(std::errc::resource_unavailable_try_again);
+    }
+
+    status = ObReferenceObjectByHandle(thread_handle,
+                                       THREAD_ALL_ACCESS,
+                                       *PsThreadType,
+                                       KernelMode,
+                                       reinterpret_cast<void**>(&worker_thread),
+                                       nullptr);
+
+    ZwClose(thread_handle);
+
+    if (!NT_SUCCESS(status))
+    {
+      //
+      // The thread is running, but we have no way to wait for it.
+      // Stop it right away.
+      //
+      KeSetEvent(&worker_stop_event, IO_NO_INCREMENT, FALSE);
+      return make_error_code_t(std::errc::resource_unavailable_try_again);
+    }
+
+    return error_code_t{};
+  }
+
+  void destroy() noexcept
+  {
+    if (worker_thread)
+    {
+      KeSetEvent(&worker_stop_event, IO_NO_INCREMENT, FALSE);
+      KeWaitForSingleObject(worker_thread, Executive, KernelMode, FALSE, nullptr);
+      ObDereferenceObject(worker_thread);
+      worker_thread = nullptr;
+    }
+  }
+}
@@ -0,0 +1,145 @@
+#include "work_queue.h"
+
+#include "assert.h"
+#include "mm.h"
+#include "mp.h"
+
+#include <cstring>
+
+namespace work_queue
+{
+  struct ring_t
+  {
+    static constexpr uint32_t item_count = 256;
+
+    std::atomic_uint64_t head;
+    std::atomic_uint64_t tail;          // written only by the worker
+    std::atomic_uint64_t dropped;
+    uint64_t             reserved[5];   // keep items off the cache line of the head
+
+    item_t               item[item_count];
+  };
+
+  ring_t*  ring_       = nullptr;
+  uint32_t ring_count_ = 0;
+
+  auto initialize() noexcept -> error_code_t
+  {
+    hvpp_assert(ring_ == nullptr);
+
+    ring_count_ = mp::cpu_count();
+    ring_ = reinterpret_cast<ring_t*>(mm::system_allocate(sizeof(ring_t) * ring_count_));
+
+    if (!ring_)
+    {
+      ring_count_ = 0;
+      return make_error_code_t(std::errc::not_enough_memory);
+    }
+
+    memset(ring_, 0, sizeof(ring_t) * ring_count_);
+
+    if (auto err = detail::initialize())
+    {
+      mm::system_free(ring_);
+      ring_ = nullptr;
+      ring_count_ = 0;
+      return err;
+    }
+
+    return error_code_t{};
+  }
+
+  void destroy() noexcept
+  {
+    if (!ring_)
+    {
+      return;
+    }
+
+    //
+    // detail::destroy() stops the worker, which drains the rings one
+    // last time.
+    //
+    detail::destroy();
+
+    mm::system_free(ring_);
+    ring_ = nullptr;
+    ring_count_ = 0;
+  }
+
+  void drain() noexcept
+  {
+    for (uint32_t ring_index = 0; ring_index < ring_count_; ++ring_index)
+    {
+      auto& ring = ring_[ring_index];
+      auto tail = ring.tail.load(std::memory_order_relaxed);
+
+      for (;;)
+      {
+        const auto& item = ring.item[tail % ring_t::item_count];
+
+        if (item.sequence.load(std::memory_order_acquire) != tail + 1)
+        {
+          break;
+        }
+
+        //
+        // Copy the closure and release the slot before the call - the
+        // closure might post another work.
+        //
+        const auto invoke = item.invoke;
+
+        alignas(8) uint8_t storage[item_t::storage_size];
+        memcpy(storage, item.storage, sizeof(storage));
+
+        tail += 1;
+        ring.tail.store(tail, std::memory_order_release);
+
+        invoke(storage);
+      }
+    }
+  }
+
+  auto dropped_count() noexcept -> uint64_t
+  {
+    uint64_t result = 0;
+
+    for (uint32_t ring_index = 0; ring_index < ring_count_; ++ring_index)
+    {
+      result += ring_[ring_index].dropped.load(std::memory_order_relaxed);
+    }
+
+    return result;
+  }
+
+  bool detail::post(void (*invoke)(const void* storage) noexcept,
+                    const void* storage, size_t storage_size) noexcept
+  {
+    if (!ring_)
+    {
+      return false;
+    }
+
+    auto& ring = ring_[mp::cpu_index()];
+    auto head = ring.head.load(std::memory_order_relaxed);
+
+    do
+    {
+      if (head - ring.tail.load(std::memory_order_acquire) >= ring_t::item_count)
+      {
+        ring.dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+    } while (!ring.head.compare_exchange_weak(head, head + 1, std::memory_order_relaxed));
+
+    auto& item = ring.item[head % ring_t::item_count];
+    item.invoke = invoke;
+    memcpy(item.storage, storage, storage_size);
+
+    //
+    // Publish the item.
+    //
+    item.sequence.store(head + 1, std::memory_order_release);
+    return true;
+  }
+}
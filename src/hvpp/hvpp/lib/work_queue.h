@@ -0,0 +1,93 @@
+#pragma once
+#include "error.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+
+//
+// Queue of work deferred from the VMX-root mode to a worker running at
+// PASSIVE_LEVEL (a system thread on Windows).
+//
+// VM-exit handlers can't allocate from the OS, can't log safely and
+// shouldn't do anything expensive.  Instead, they post() a closure -
+// e.g. a lambda capturing few values - which is later called by the
+// worker, where all of this is allowed.
+//
+// Each CPU has its own ring, written wait-free by the CPU itself (a
+// slot is reserved by compare-exchange of the head, which also covers
+// a VM-exit interrupting post() in the guest on the same CPU).  The
+// closure is copied into the slot - it must be trivially copyable (and
+// trivially destructible) and at most item_t::storage_size bytes large.
+// If the ring is full, the closure is dropped and counted.
+//
+// The worker polls the rings every ~10ms (the worker can't be signaled
+// from the VMX-root mode).  Closures are called in the order in which
+// they have been posted on each CPU, there's no order between CPUs.
+//
+// Usage:
+//   work_queue::post([cpu_index = vp.cpu_index(), value] {
+//     hvpp_info("CPU %u: value: %u", cpu_index, value);
+//   });
+//
+
+namespace work_queue
+{
+  struct item_t
+  {
+    static constexpr size_t storage_size = 48;
+
+    std::atomic_uint64_t sequence;      // index + 1 when ready
+    void               (*invoke)(const void* storage) noexcept;
+
+    alignas(8) uint8_t   storage[storage_size];
+  };
+
+  static_assert(sizeof(item_t) == 64);
+
+  namespace detail
+  {
+    auto initialize() noexcept -> error_code_t;
+    void destroy() noexcept;
+
+    bool post(void (*invoke)(const void* storage) noexcept,
+              const void* storage, size_t storage_size) noexcept;
+  }
+
+  auto initialize() noexcept -> error_code_t;
+  void destroy() noexcept;
+
+  //
+  // Post the closure to the ring of the current CPU.  Can be called
+  // from the VMX-root mode (and at any IRQL).  Returns false if the
+  // queue isn't initialized or the ring is full.
+  //
+  template <
+    typename T
+  >
+  bool post(const T& closure) noexcept
+  {
+    static_assert(std::is_trivially_copyable_v<T> && std::is_trivially_destructible_v<T>,
+                  "Closure must be trivially copyable");
+    static_assert(sizeof(T) <= item_t::storage_size && alignof(T) <= 8,
+                  "Closure is too large");
+
+    return detail::post([](const void* storage) noexcept {
+                          (*reinterpret_cast<const T*>(storage))();
+                        },
+                        &closure, sizeof(closure));
+  }
+
+  //
+  // Call all posted closures.  Called by the worker at PASSIVE_LEVEL,
+  // must not be called concurrently.
+  //
+  void drain() noexcept;
+
+  //
+  // Number of closures dropped because the ring was full.
+  //
+  auto dropped_count() noexcept -> uint64_t;
+}
@@ -0,0 +1,381 @@
+#include "mmio_manager.h"
+
+#include "lib/assert.h"
+
+namespace hvpp {
+
+namespace detail
+{
+  //
+  // Pack the decoded instruction into the data of the VCPU decode cache
+  // (see vcpu_t::decode_cache_insert()).  Immediates don't fit, therefore
+  // stores of immediates aren't cached.
+  //
+  static auto memop_pack(const memop::instruction_t& instruction) noexcept -> uint32_t
+  {
+    return (uint32_t(instruction.op)             <<  0) |
+           (uint32_t(instruction.access_size)    <<  4) |
+           (uint32_t(instruction.register_size)  <<  8) |
+           (uint32_t(instruction.register_index) << 12) |
+           (uint32_t(instruction.high_byte)      << 16) |
+           (uint32_t(instruction.length)         << 20);
+  }
+
+  static auto memop_unpack(uint32_t data) noexcept -> memop::instruction_t
+  {
+    memop::instruction_t instruction{};
+    instruction.op             = static_cast<memop::operation>(data & 0xf);
+    instruction.access_size    = static_cast<uint8_t>((data >>  4) & 0xf);
+    instruction.register_size  = static_cast<uint8_t>((data >>  8) & 0xf);
+    instruction.register_index = static_cast<uint8_t>((data >> 12) & 0xf);
+    instruction.high_byte      = ((data >> 16) & 1) != 0;
+    instruction.length         = static_cast<uint8_t>((data >> 20) & 0xf);
+    return instruction;
+  }
+
+  static auto size_mask(uint32_t size) noexcept -> uint64_t
+  {
+    return size >= 8 ? ~0ull : (1ull << (size * 8)) - 1;
+  }
+
+  static auto read_register(const context_t& context, const memop::instruction_t& instruction) noexcept -> uint64_t
+  {
+    const auto value = context.gp_register[instruction.register_index];
+    return instruction.high_byte ? (value >> 8) & 0xff : value;
+  }
+
+  static void write_register(context_t& context, const memop::instruction_t& instruction, uint64_t value) noexcept
+  {
+    auto& reg = context.gp_register[instruction.register_index];
+
+    switch (instruction.register_size)
+    {
+      case 1:
+        reg = instruction.high_byte
+          ? (reg & ~0xff00ull) | ((value & 0xff) << 8)
+          : (reg & ~0x00ffull) |  (value & 0xff);
+        break;
+
+      case 2:
+        reg = (reg & ~0xffffull) | (value & 0xffff);
+        break;
+
+      case 4:
+        //
+        // 32-bit destination is zero-extended.
+        //
+        reg = value & 0xffff'ffff;
+        break;
+
+      default:
+        reg = value;
+        break;
+    }
+  }
+}
+
+mmio_manager::mmio_manager(ept_dispatcher& dispatcher) noexcept
+  : dispatcher_{ dispatcher }
+  , lock_{}
+  , epoch_{}
+  , generation_{ 0 }
+  , read_count_{ 0 }
+  , write_count_{ 0 }
+  , fallback_count_{ 0 }
+  , per_vcpu_{}
+  , mtf_stepper_{}
+  , region_{}
+{
+  const auto err = per_vcpu_.initialize();
+  hvpp_assert(!err);
+  (void)(err);
+}
+
+auto mmio_manager::add(pa_t pa, size_t size, read_fn_t read, write_fn_t write, void* context) noexcept -> error_code_t
+{
+  if (!size || !write)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  const auto first = pa.value() & ~(page_size - 1);
+  const auto end   = (pa.value() + size + page_size - 1) & ~(page_size - 1);
+
+  spinlock::guard _{ lock_ };
+
+  //
+  // Reuse the slot of the same (removed) range, or take a free one.
+  //
+  region_t* region = nullptr;
+
+  for (auto& item : region_)
+  {
+    if (item.size && item.pa.value() == first && item.size == end - first)
+    {
+      if (item.active.load(std::memory_order_relaxed))
+      {
+        return make_error_code_t(std::errc::file_exists);
+      }
+
+      region = &item;
+      break;
+    }
+
+    if (!item.size && !region)
+    {
+      region = &item;
+    }
+  }
+
+  if (!region)
+  {
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  region->read    = read;
+  region->write   = write;
+  region->context = context;
+
+  //
+  // Pages of the reused slot are still routed to it.
+  //
+  if (!region->size)
+  {
+    region->manager = this;
+    region->pa      = pa_t{ first };
+    region->size    = end - first;
+
+    if (auto err = dispatcher_.add(region->pa, region->size, &mmio_manager::ept_fault, region))
+    {
+      region->size = 0;
+      return err;
+    }
+  }
+
+  const auto generation = generation_.load(std::memory_order_relaxed) + 1;
+
+  region->generation.store(generation, std::memory_order_relaxed);
+  region->active.store(true, std::memory_order_release);
+
+  //
+  // Publish the modification to sync().
+  //
+  generation_.store(generation, std::memory_order_release);
+  return error_code_t{};
+}
+
+auto mmio_manager::remove(pa_t pa) noexcept -> error_code_t
+{
+  const auto first = pa.value() & ~(page_size - 1);
+
+  spinlock::guard _{ lock_ };
+
+  for (auto& region : region_)
+  {
+    if (region.size && region.pa.value() == first && region.active.load(std::memory_order_relaxed))
+    {
+      //
+      // Pages stay routed to the region - VCPUs which haven't been synced
+      // yet map them back on their next EPT violation (see step()).
+      //
+      const auto generation = generation_.load(std::memory_order_relaxed) + 1;
+
+      region.generation.store(generation, std::memory_order_relaxed);
+      region.active.store(false, std::memory_order_release);
+
+      generation_.store(generation, std::memory_order_release);
+
+      //
+      // Wait for emulate() calls which might have seen the region active.
+      //
+      epoch_.synchronize();
+      return error_code_t{};
+    }
+  }
+
+  return make_error_code_t(std::errc::invalid_argument);
+}
+
+void mmio_manager::sync(vcpu_t& vp) noexcept
+{
+  auto& data = per_vcpu_[vp.cpu_index()];
+
+  const auto generation = generation_.load(std::memory_order_acquire);
+
+  if (generation == data.generation)
+  {
+    return;
+  }
+
+  for (uint16_t view = 0; view < vp.ept_count(); ++view)
+  {
+    ept_t::transaction transaction{ vp.ept(view) };
+
+    for (auto& region : region_)
+    {
+      if (!region.size || region.generation.load(std::memory_order_relaxed) <= data.generation)
+      {
+        continue;
+      }
+
+      const auto access = mmio_manager::access(region, region.active.load(std::memory_order_acquire));
+
+      for (size_t offset = 0; offset < region.size; offset += page_size)
+      {
+        const auto page_pa = region.pa + pa_t{ offset };
+
+        transaction.split_1gb_to_2mb(page_pa & ept_pdpt_t::mask, page_pa & ept_pdpt_t::mask);
+        transaction.split_2mb_to_4kb(page_pa & ept_pd_t::mask, page_pa & ept_pd_t::mask);
+
+        transaction.map_4kb(page_pa, page_pa, access);
+      }
+    }
+  }
+
+  data.generation = generation;
+}
+
+bool mmio_manager::monitor_trap_flag(vcpu_t& vp) noexcept
+{
+  return mtf_stepper_.monitor_trap_flag(vp);
+}
+
+bool mmio_manager::ept_fault(vcpu_t& vp, const ept_dispatcher::fault_t& fault, void* context) noexcept
+{
+  auto& region = *static_cast<region_t*>(context);
+  return region.manager->emulate(vp, region, fault);
+}
+
+bool mmio_manager::emulate(vcpu_t& vp, region_t& region, const ept_dispatcher::fault_t& fault) noexcept
+{
+  if (fault.misconfiguration)
+  {
+    return false;
+  }
+
+  epoch_domain::read_guard _{ epoch_ };
+
+  const auto guest_pa = fault.guest_pa;
+  const bool is_write = (fault.access & epte_t::access_type::write)   != epte_t::access_type::none;
+  const bool is_fetch = (fault.access & epte_t::access_type::execute) != epte_t::access_type::none;
+
+  memop::instruction_t instruction;
+
+  if (is_fetch || !region.active.load(std::memory_order_acquire) || !decode(vp, instruction))
+  {
+    step(vp, region, guest_pa);
+    return true;
+  }
+
+  const bool is_store = instruction.op == memop::operation::store ||
+                        instruction.op == memop::operation::store_immediate;
+
+  //
+  // Decoded instruction which doesn't match the fault (e.g. the guest
+  // has modified it unnoticed) isn't emulated.
+  //
+  if (is_store != is_write)
+  {
+    step(vp, region, guest_pa);
+    return true;
+  }
+
+  auto& context = vp.exit_context();
+  const auto mask = detail::size_mask(instruction.access_size);
+
+  if (is_store)
+  {
+    const auto value = instruction.op == memop::operation::store_immediate
+      ? instruction.immediate
+      : detail::read_register(context, instruction);
+
+    region.write(vp, guest_pa, instruction.access_size, value & mask, region.context);
+    write_count_.fetch_add(1, std::memory_order_relaxed);
+  }
+  else
+  {
+    auto value = region.read(vp, guest_pa, instruction.access_size, region.context) & mask;
+
+    if (instruction.op == memop::operation::load_sign_extend)
+    {
+      const auto sign_bit = 1ull << (instruction.access_size * 8 - 1);
+      value = (value ^ sign_bit) - sign_bit;
+    }
+
+    detail::write_register(context, instruction, value);
+    read_count_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  //
+  // Skip the emulated instruction - VM-exit instruction length isn't
+  // defined for EPT violations.
+  //
+  context.rip += instruction.length;
+  vp.suppress_rip_adjust();
+  return true;
+}
+
+bool mmio_manager::decode(vcpu_t& vp, memop::instruction_t& instruction) noexcept
+{
+  const auto rip = va_t{ vp.exit_context().rip };
+
+  if (auto entry = vp.decode_cache_lookup(rip); entry && entry->kind == decode_cache_kind)
+  {
+    instruction = detail::memop_unpack(entry->data);
+    return true;
+  }
+
+  uint8_t code[memop::max_instruction_size];
+  const auto size = vp.guest_read(rip, code, sizeof(code));
+
+  if (!memop::decode(code, size, vp.guest_cs().access.long_mode, instruction))
+  {
+    return false;
+  }
+
+  if (instruction.op != memop::operation::store_immediate)
+  {
+    vp.decode_cache_insert(rip, decode_cache_kind, detail::memop_pack(instruction));
+  }
+
+  return true;
+}
+
+void mmio_manager::step(vcpu_t& vp, const region_t& region, pa_t guest_pa) noexcept
+{
+  //
+  // Let the guest access the device directly for single instruction.
+  // Region which has been removed meanwhile is mapped back for good.
+  //
+  const auto page_pa = pa_t::from_pfn(guest_pa.pfn());
+  const bool active  = region.active.load(std::memory_order_acquire);
+
+  if (active)
+  {
+    mtf_stepper_.step(vp, page_pa,
+                      page_pa, epte_t::access_type::read_write_execute,
+                      page_pa, access(region, true));
+
+    fallback_count_.fetch_add(1, std::memory_order_relaxed);
+  }
+  else
+  {
+    vp.ept(vp.ept_index()).map_4kb(page_pa, page_pa, epte_t::access_type::read_write_execute);
+  }
+
+  vp.suppress_rip_adjust();
+}
+
+auto mmio_manager::access(const region_t& region, bool active) noexcept -> epte_t::access_type
+{
+  if (!active)
+  {
+    return epte_t::access_type::read_write_execute;
+  }
+
+  return region.read
+    ? epte_t::access_type::none
+    : epte_t::access_type::read_execute;
+}
+
+}
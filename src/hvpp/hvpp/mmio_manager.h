@@ -0,0 +1,163 @@
+#pragma once
+#include "ept_dispatcher.h"
+#include "mtf_stepper.h"
+#include "vcpu.h"
+
+#include "lib/epoch.h"
+#include "lib/error.h"
+#include "lib/memop.h"
+#include "lib/per_cpu.h"
+#include "lib/spinlock.h"
+
+#include <atomic>
+#include <cstdint>
+
+namespace hvpp {
+
+//
+// Emulation of memory-mapped I/O of EPT-trapped regions.
+//
+// Pages of each region are unmapped from the EPT (or mapped read-only,
+// if only writes are monitored) and their EPT violations are routed here
+// by the ept_dispatcher.  The faulting instruction is decoded (see memop)
+// and emulated - the callback of the region performs the access (e.g.
+// logs it and forwards it to the device) and the guest continues with
+// the next instruction, therefore each access costs single VM-exit.
+// Decoded instructions are cached by the VCPU (see
+// vcpu_t::decode_cache_lookup()), so repeated accesses from the same
+// RIP don't read the guest memory again.
+//
+// Instructions which aren't recognized by the decoder (string moves,
+// read-modify-write instructions, ...) are executed by the guest itself,
+// with the page mapped for that single instruction (see mtf_stepper) -
+// callbacks don't see such accesses (see fallback_count()).
+//
+// As with hook_manager, EPT modifications are applied lazily by sync(),
+// which must be called on each VCPU after add()/remove().  Until then,
+// VCPUs which still trap a removed region map its pages back on the next
+// access.  Slots of removed regions (and their pages in the dispatcher)
+// are reused only by the same range.
+//
+// Usage:
+//   mmio_manager_.add(pa, size, &my_read, &my_write, this);
+//
+//   void my_handler::handle_execute_vmcall(vcpu_t& vp) noexcept
+//   {
+//     mmio_manager_.sync(vp);
+//   }
+//
+//   void my_handler::handle_ept_violation(vcpu_t& vp) noexcept
+//   {
+//     if (!ept_dispatcher_.ept_violation(vp))
+//     {
+//       base_type::handle_ept_violation(vp);
+//     }
+//   }
+//
+//   void my_handler::handle_monitor_trap_flag(vcpu_t& vp) noexcept
+//   {
+//     if (!mmio_manager_.monitor_trap_flag(vp))
+//     {
+//       base_type::handle_monitor_trap_flag(vp);
+//     }
+//   }
+//
+
+class mmio_manager
+{
+  public:
+    static constexpr size_t max_region_count = 64;
+
+    //
+    // Kind of entries of the VCPU decode cache used by this manager.
+    //
+    static constexpr uint32_t decode_cache_kind = 0x100;
+
+    //
+    // Callbacks are called in the VMX-root mode.  "pa" is the exact
+    // guest-physical address of the access, "size" is 1, 2, 4 or 8.
+    //
+    using read_fn_t  = uint64_t(*)(vcpu_t& vp, pa_t pa, uint32_t size, void* context) noexcept;
+    using write_fn_t = void(*)(vcpu_t& vp, pa_t pa, uint32_t size, uint64_t value, void* context) noexcept;
+
+    mmio_manager(ept_dispatcher& dispatcher) noexcept;
+
+    mmio_manager(const mmio_manager& other) noexcept = delete;
+    mmio_manager(mmio_manager&& other) noexcept = delete;
+    mmio_manager& operator=(const mmio_manager& other) noexcept = delete;
+    mmio_manager& operator=(mmio_manager&& other) noexcept = delete;
+
+    //
+    // Emulate accesses to [pa, pa + size) - the range is extended to
+    // whole pages.  If "read" is nullptr, reads aren't trapped (the pages
+    // stay readable).  remove() returns after no VCPU can call callbacks
+    // of the region anymore.  These methods must be called at IRQL <=
+    // DISPATCH_LEVEL (see ept_dispatcher::add()).
+    //
+    auto add(pa_t pa, size_t size, read_fn_t read, write_fn_t write, void* context) noexcept -> error_code_t;
+    auto remove(pa_t pa) noexcept -> error_code_t;
+
+    //
+    // Apply modifications made since the last sync() of this VCPU to all
+    // its EPT views.
+    //
+    void sync(vcpu_t& vp) noexcept;
+
+    //
+    // Handle the MTF VM-exit of the fallback step.  Returns false if the
+    // VM-exit wasn't caused by this manager.
+    //
+    bool monitor_trap_flag(vcpu_t& vp) noexcept;
+
+    auto read_count() const noexcept -> uint64_t
+    { return read_count_.load(std::memory_order_relaxed); }
+
+    auto write_count() const noexcept -> uint64_t
+    { return write_count_.load(std::memory_order_relaxed); }
+
+    auto fallback_count() const noexcept -> uint64_t
+    { return fallback_count_.load(std::memory_order_relaxed); }
+
+  private:
+    struct region_t
+    {
+      mmio_manager*        manager;
+      pa_t                 pa;            // page-aligned
+      size_t               size;          // multiple of page size, 0 = free
+      read_fn_t            read;
+      write_fn_t           write;
+      void*                context;
+      std::atomic_uint64_t generation;
+      std::atomic_bool     active;
+    };
+
+    static bool ept_fault(vcpu_t& vp, const ept_dispatcher::fault_t& fault, void* context) noexcept;
+
+    bool emulate(vcpu_t& vp, region_t& region, const ept_dispatcher::fault_t& fault) noexcept;
+    bool decode(vcpu_t& vp, memop::instruction_t& instruction) noexcept;
+    void step(vcpu_t& vp, const region_t& region, pa_t guest_pa) noexcept;
+
+    static auto access(const region_t& region, bool active) noexcept -> epte_t::access_type;
+
+    ept_dispatcher&      dispatcher_;
+    spinlock             lock_;
+    epoch_domain         epoch_;
+    std::atomic_uint64_t generation_;
+
+    std::atomic_uint64_t read_count_;
+    std::atomic_uint64_t write_count_;
+    std::atomic_uint64_t fallback_count_;
+
+    struct per_vcpu_t
+    {
+      uint64_t generation;
+    };
+
+    per_cpu<per_vcpu_t>  per_vcpu_;
+
+    mtf_stepper          mtf_stepper_;
+
+    region_t             region_[max_region_count];
+};
+
+}
@@ -0,0 +1,189 @@
+#include "msr_policy.h"
+#include "hypervisor.h"
+
+#include "ia32/msr.h"
+
+#include "lib/assert.h"
+#include "lib/bitmap.h"
+
+namespace hvpp {
+
+namespace detail
+{
+  //
+  // MSRs whose guest value is held in the guest-state area of the VMCS
+  // (see vmexit_passthrough_handler::handle_execute_rdmsr()).
+  //
+  static bool is_vmcs_msr(uint32_t msr_id) noexcept
+  {
+    switch (msr_id)
+    {
+      case 0x00000174:                  // IA32_SYSENTER_CS
+      case 0x00000175:                  // IA32_SYSENTER_ESP
+      case 0x00000176:                  // IA32_SYSENTER_EIP
+      case msr::debugctl_t::msr_id:
+      case msr::fs_base_t::msr_id:
+      case msr::gs_base_t::msr_id:
+        return true;
+
+      default:
+        return false;
+    }
+  }
+}
+
+msr_policy::msr_policy() noexcept
+  : bitmap_{}
+  , msr_id_{}
+  , handler_{}
+  , msr_count_{ 0 }
+  , shadow_valid_{}
+  , shadow_value_{}
+{
+
+}
+
+auto msr_policy::add(uint32_t msr_id, const handler_t& handler) noexcept -> error_code_t
+{
+  hvpp_assert(!hypervisor::is_started());
+
+  if (detail::is_vmcs_msr(msr_id) || find(msr_id) != -1)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  if (msr_count_ == max_msr_count)
+  {
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  msr_id_[msr_count_] = msr_id;
+  handler_[msr_count_] = handler;
+  ++msr_count_;
+
+  //
+  // Writes of shadowed MSRs must exit too, otherwise the shadow would
+  // go stale.  MSRs outside of the MSR bitmap ranges always exit.
+  //
+  const bool read_exit  = handler.on_read  || handler.shadow;
+  const bool write_exit = handler.on_write || handler.shadow;
+
+  if (msr_id <= vmx::msr_bitmap_t::msr_id_low_max)
+  {
+    if (read_exit)  { bitmap(bitmap_.rdmsr_low).set(msr_id); }
+    if (write_exit) { bitmap(bitmap_.wrmsr_low).set(msr_id); }
+  }
+  else if (msr_id >= vmx::msr_bitmap_t::msr_id_high_min &&
+           msr_id <= vmx::msr_bitmap_t::msr_id_high_max)
+  {
+    msr_id -= vmx::msr_bitmap_t::msr_id_high_min;
+
+    if (read_exit)  { bitmap(bitmap_.rdmsr_high).set(msr_id); }
+    if (write_exit) { bitmap(bitmap_.wrmsr_high).set(msr_id); }
+  }
+
+  return error_code_t{};
+}
+
+void msr_policy::setup(vcpu_t& vp) noexcept
+{
+  shadow_flush(vp);
+  vp.msr_bitmap_share(bitmap_);
+}
+
+bool msr_policy::rdmsr(vcpu_t& vp) noexcept
+{
+  const uint32_t msr_id = vp.exit_context().ecx;
+  const auto index = find(msr_id);
+
+  if (index == -1)
+  {
+    return false;
+  }
+
+  const auto& handler = handler_[index];
+  const auto cpu_index = vp.cpu_index();
+  const auto mask = 1ull << index;
+
+  uint64_t msr_value;
+
+  if (shadow_valid_[cpu_index] & mask)
+  {
+    msr_value = shadow_value_[cpu_index][index];
+  }
+  else
+  {
+    msr_value = msr::read(msr_id);
+
+    if (handler.shadow)
+    {
+      shadow_value_[cpu_index][index] = msr_value;
+      shadow_valid_[cpu_index] |= mask;
+    }
+  }
+
+  if (handler.on_read)
+  {
+    handler.on_read(vp, msr_id, msr_value, handler.context);
+  }
+
+  vp.exit_context().rax = msr_value & 0xffffffff;
+  vp.exit_context().rdx = msr_value >> 32;
+
+  return true;
+}
+
+bool msr_policy::wrmsr(vcpu_t& vp) noexcept
+{
+  const uint32_t msr_id = vp.exit_context().ecx;
+  const auto index = find(msr_id);
+
+  if (index == -1)
+  {
+    return false;
+  }
+
+  const auto& handler = handler_[index];
+
+  uint64_t msr_value =
+    vp.exit_context().rax |
+    vp.exit_context().rdx << 32;
+
+  if (handler.on_write && !handler.on_write(vp, msr_id, msr_value, handler.context))
+  {
+    return true;
+  }
+
+  msr::write(msr_id, msr_value);
+
+  if (handler.shadow)
+  {
+    //
+    // Some bits might be read-only (or ignored) - don't assume the
+    // written value is the value which will be read back.
+    //
+    shadow_valid_[vp.cpu_index()] &= ~(1ull << index);
+  }
+
+  return true;
+}
+
+void msr_policy::shadow_flush(vcpu_t& vp) noexcept
+{
+  shadow_valid_[vp.cpu_index()] = 0;
+}
+
+auto msr_policy::find(uint32_t msr_id) const noexcept -> int
+{
+  for (uint32_t i = 0; i < msr_count_; ++i)
+  {
+    if (msr_id_[i] == msr_id)
+    {
+      return static_cast<int>(i);
+    }
+  }
+
+  return -1;
+}
+
+}
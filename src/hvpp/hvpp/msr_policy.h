@@ -0,0 +1,130 @@
+#pragma once
+#include "vcpu.h"
+
+#include "ia32/vmx/msr_bitmap.h"
+
+#include "lib/error.h"
+
+#include <cstdint>
+
+namespace hvpp {
+
+//
+// MSR interception policy.
+//
+// Only MSRs registered by add() cause VM-exit - the MSR bitmap (shared
+// by all VCPUs) is generated from the registered MSRs.  Each MSR can have
+// a read and a write callback, and can be "shadowed" - the value last read
+// from the hardware is cached per VCPU and further reads are served from
+// the cache without executing RDMSR (until the guest writes the MSR).
+// This is meant for MSRs which are read often and changed rarely (e.g.
+// IA32_APIC_BASE, IA32_FEATURE_CONTROL, MSR_PLATFORM_INFO).
+//
+// Usage:
+//   msr_policy_.add(msr::apic_base_t::msr_id, { nullptr, nullptr, nullptr, true });
+//
+//   void my_handler::setup(vcpu_t& vp) noexcept
+//   {
+//     msr_policy_.setup(vp);
+//   }
+//
+//   void my_handler::handle_execute_rdmsr(vcpu_t& vp) noexcept
+//   {
+//     if (!msr_policy_.rdmsr(vp))
+//     {
+//       base_type::handle_execute_rdmsr(vp);
+//     }
+//   }
+//
+//   (and the same for handle_execute_wrmsr())
+//
+
+class msr_policy
+{
+  public:
+    //
+    // Called after the value has been read (from the hardware or from
+    // the shadow) - the callback can modify the value the guest receives.
+    //
+    using read_callback_t  = void(*)(vcpu_t& vp, uint32_t msr_id, uint64_t& value, void* context) noexcept;
+
+    //
+    // Called before the value is written to the hardware - the callback
+    // can modify the value, or drop the write by returning false.
+    //
+    using write_callback_t = bool(*)(vcpu_t& vp, uint32_t msr_id, uint64_t& value, void* context) noexcept;
+
+    struct handler_t
+    {
+      read_callback_t  on_read;
+      write_callback_t on_write;
+      void*            context;
+      bool             shadow;
+    };
+
+    //
+    // Maximum number of registered MSRs.
+    //
+    static constexpr size_t max_msr_count = 64;
+
+    msr_policy() noexcept;
+
+    msr_policy(const msr_policy& other) noexcept = delete;
+    msr_policy(msr_policy&& other) noexcept = delete;
+    msr_policy& operator=(const msr_policy& other) noexcept = delete;
+    msr_policy& operator=(msr_policy&& other) noexcept = delete;
+
+    //
+    // Register the MSR.  Must be called before the hypervisor is started
+    // (e.g. in the VM-exit handler constructor).
+    //
+    // MSRs held in the guest-state area of the VMCS (IA32_DEBUGCTL,
+    // IA32_FS_BASE, IA32_GS_BASE, ...) can't be registered - their
+    // hardware value isn't the guest value.
+    //
+    auto add(uint32_t msr_id, const handler_t& handler) noexcept -> error_code_t;
+
+    //
+    // Reference the MSR bitmap of the policy in the VCPU (called from
+    // vmexit_handler::attach()).
+    //
+    void setup(vcpu_t& vp) noexcept;
+
+    //
+    // Handle the RDMSR/WRMSR VM-exit according to the policy.  Returns
+    // false if the MSR isn't registered - the VM-exit is left to the
+    // caller then.
+    //
+    bool rdmsr(vcpu_t& vp) noexcept;
+    bool wrmsr(vcpu_t& vp) noexcept;
+
+    //
+    // Drop all shadowed values of the current VCPU - e.g. after the
+    // hypervisor itself changed the MSRs.
+    //
+    void shadow_flush(vcpu_t& vp) noexcept;
+
+  private:
+    auto find(uint32_t msr_id) const noexcept -> int;
+
+    vmx::msr_bitmap_t  bitmap_;
+
+    //
+    // Registered MSRs.  IDs are kept apart from the handlers, so that
+    // the lookup scans at most 4 cache lines.
+    //
+    uint32_t           msr_id_[max_msr_count];
+    handler_t          handler_[max_msr_count];
+    uint32_t           msr_count_;
+
+    //
+    // Shadowed values, indexed by the CPU index and the MSR index.
+    // Each CPU accesses only its own entries.
+    //
+    uint64_t           shadow_valid_[HVPP_MAX_CPU];
+    uint64_t           shadow_value_[HVPP_MAX_CPU][max_msr_count];
+
+    static_assert(max_msr_count <= sizeof(shadow_valid_[0]) * 8);
+};
+
+}
@@ -0,0 +1,98 @@
+#include "mtf_stepper.h"
+
+#include "lib/assert.h"
+
+namespace hvpp {
+
+mtf_stepper::mtf_stepper() noexcept
+  : per_vcpu_{}
+{
+  const auto err = per_vcpu_.initialize();
+  hvpp_assert(!err);
+  (void)(err);
+}
+
+void mtf_stepper::step(vcpu_t& vp, pa_t guest_pa,
+                       pa_t host_pa, epte_t::access_type access,
+                       pa_t restore_host_pa, epte_t::access_type restore_access) noexcept
+{
+  auto& data = per_vcpu_[vp.cpu_index()];
+
+  //
+  // The same page may be stepped over again by the same instruction
+  // (e.g. execute-only page which reads itself) - the first restore
+  // entry is kept then.
+  //
+  bool found = false;
+
+  for (uint32_t i = 0; i < data.restore_count; ++i)
+  {
+    if (data.restore[i].guest_pa == guest_pa)
+    {
+      found = true;
+      break;
+    }
+  }
+
+  if (!found)
+  {
+    hvpp_assert(data.restore_count < max_step_count);
+    data.restore[data.restore_count++] = step_t{ guest_pa, restore_host_pa, restore_access };
+  }
+
+  //
+  // The EPT violation itself invalidates the mappings of guest_pa -
+  // INVEPT isn't needed when the access is granted (see
+  // vmexit_custom_handler::handle_ept_violation()).
+  //
+  vp.ept(vp.ept_index()).map_4kb(guest_pa, host_pa, access);
+
+  auto procbased_ctls = vp.processor_based_controls();
+
+  if (!procbased_ctls.monitor_trap_flag)
+  {
+    procbased_ctls.monitor_trap_flag = true;
+    vp.processor_based_controls(procbased_ctls);
+  }
+}
+
+bool mtf_stepper::is_stepping(const vcpu_t& vp) const noexcept
+{
+  return per_vcpu_[vp.cpu_index()].restore_count != 0;
+}
+
+bool mtf_stepper::monitor_trap_flag(vcpu_t& vp) noexcept
+{
+  auto& data = per_vcpu_[vp.cpu_index()];
+
+  if (data.restore_count == 0)
+  {
+    return false;
+  }
+
+  {
+    //
+    // Access rights are reduced - single INVEPT covers all pages.
+    //
+    ept_t::transaction transaction{ vp.ept(vp.ept_index()) };
+
+    for (uint32_t i = 0; i < data.restore_count; ++i)
+    {
+      transaction.map_4kb(data.restore[i].guest_pa, data.restore[i].host_pa, data.restore[i].access);
+    }
+  }
+
+  data.restore_count = 0;
+
+  auto procbased_ctls = vp.processor_based_controls();
+  procbased_ctls.monitor_trap_flag = false;
+  vp.processor_based_controls(procbased_ctls);
+
+  //
+  // MTF VM-exit is trap-like - RIP already points to the next instruction.
+  //
+  vp.suppress_rip_adjust();
+  return true;
+}
+
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include "vcpu.h"
+
+#include "lib/per_cpu.h"
+
+#include <cstdint>
+
+namespace hvpp {
+
+//
+// Monitor-trap-flag based step-over of EPT permission changes.
+//
+// Split hooks (e.g. execute-only page with different read-write view)
+// have to change the EPT entry on each EPT violation.  step() changes
+// the mapping for a single instruction only: it maps the page, arms
+// the monitor trap flag and after the instruction has been executed,
+// monitor_trap_flag() restores the original mapping.  Each access then
+// costs exactly two VM-exits.
+//
+// Several pages can be stepped over at once (e.g. an instruction which
+// touches two hooked pages) - all of them are restored by a single EPT
+// transaction (therefore with single INVEPT).
+//
+// Note that if an event is delivered before the instruction is executed,
+// the MTF VM-exit occurs at the first instruction of the event handler -
+// the mapping is restored and the instruction simply faults again later.
+//
+// Usage:
+//   void my_handler::handle_ept_violation(vcpu_t& vp) noexcept
+//   {
+//     mtf_stepper_.step(vp, guest_pa, read_pa, epte_t::access_type::read_write,
+//                           exec_pa, epte_t::access_type::execute);
+//     vp.suppress_rip_adjust();
+//   }
+//
+//   void my_handler::handle_monitor_trap_flag(vcpu_t& vp) noexcept
+//   {
+//     if (!mtf_stepper_.monitor_trap_flag(vp))
+//     {
+//       base_type::handle_monitor_trap_flag(vp);
+//     }
+//   }
+//
+
+class mtf_stepper
+{
+  public:
+    //
+    // Maximum number of pages stepped over by one instruction.
+    //
+    static constexpr size_t max_step_count = 4;
+
+    mtf_stepper() noexcept;
+
+    mtf_stepper(const mtf_stepper& other) noexcept = delete;
+    mtf_stepper(mtf_stepper&& other) noexcept = delete;
+    mtf_stepper& operator=(const mtf_stepper& other) noexcept = delete;
+    mtf_stepper& operator=(mtf_stepper&& other) noexcept = delete;
+
+    //
+    // Map the guest_pa to the host_pa with "access" for the next instruction.
+    // The mapping is restored to restore_host_pa with "restore_access" when
+    // the instruction has been executed.
+    //
+    void step(vcpu_t& vp, pa_t guest_pa,
+              pa_t host_pa, epte_t::access_type access,
+              pa_t restore_host_pa, epte_t::access_type restore_access) noexcept;
+
+    bool is_stepping(const vcpu_t& vp) const noexcept;
+
+    //
+    // Handle the MTF VM-exit.  Returns false if the VM-exit wasn't caused
+    // by step().
+    //
+    bool monitor_trap_flag(vcpu_t& vp) noexcept;
+
+  private:
+    struct step_t
+    {
+      pa_t                guest_pa;
+      pa_t                host_pa;
+      epte_t::access_type access;
+    };
+
+    struct per_vcpu_t
+    {
+      step_t   restore[max_step_count];
+      uint32_t restore_count;
+    };
+
+    per_cpu<per_vcpu_t> per_vcpu_;
+};
+
+}
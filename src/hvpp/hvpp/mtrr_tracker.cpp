@@ -0,0 +1,96 @@
+#include "mtrr_tracker.h"
+#include "hypervisor.h"
+
+#include "ia32/msr.h"
+#include "ia32/mtrr.h"
+
+#include "lib/assert.h"
+#include "lib/mm.h"
+
+namespace hvpp {
+
+mtrr_tracker::mtrr_tracker() noexcept
+  : per_vcpu_{}
+{
+  const auto err = per_vcpu_.initialize();
+  hvpp_assert(!err);
+  (void)(err);
+}
+
+auto mtrr_tracker::attach(msr_policy& policy) noexcept -> error_code_t
+{
+  hvpp_assert(!hypervisor::is_started());
+
+  //
+  // IA32_MTRR_DEF_TYPE, fixed-range MTRRs (if supported) and all pairs
+  // of variable-range MTRRs.
+  //
+  uint32_t msr_id_list[1 + 11 + ia32::mtrr::max_variable_count * 2];
+  uint32_t msr_id_count = 0;
+
+  msr_id_list[msr_id_count++] = msr::mtrr_def_type_t::msr_id;
+
+  const auto mtrr_capabilities = msr::read<msr::mtrr_capabilities_t>();
+
+  if (mtrr_capabilities.fixed_range_supported)
+  {
+    for_each_type(msr::mtrr_fix_list_t{}, [&](auto mtrr_fixed, int) {
+      msr_id_list[msr_id_count++] = decltype(mtrr_fixed)::msr_id;
+    });
+  }
+
+  for (uint32_t i = 0; i < mtrr_capabilities.variable_range_count * 2u; ++i)
+  {
+    msr_id_list[msr_id_count++] = msr::mtrr_physbase_t::msr_id + i;
+  }
+
+  for (uint32_t i = 0; i < msr_id_count; ++i)
+  {
+    hvpp_assert(ia32::mtrr::is_mtrr(msr_id_list[i]));
+
+    if (auto err = policy.add(msr_id_list[i], { nullptr, &on_write, this, false }))
+    {
+      return err;
+    }
+  }
+
+  return {};
+}
+
+bool mtrr_tracker::on_write(vcpu_t& vp, uint32_t msr_id, uint64_t& value, void* context) noexcept
+{
+  auto self = reinterpret_cast<mtrr_tracker*>(context);
+
+  const auto old_value = msr::read(msr_id);
+
+  if (old_value == value)
+  {
+    //
+    // Nothing changes - let the policy write the value.
+    //
+    return true;
+  }
+
+  msr::write(msr_id, value);
+
+  auto& data = self->per_vcpu_[vp.cpu_index()];
+  data.write_count += 1;
+
+  const auto range = mm::mtrr_update(msr_id, old_value);
+
+  if (range.size() > 0)
+  {
+    for (uint16_t index = 0; index < vp.ept_count(); ++index)
+    {
+      data.entry_count += vp.ept(index).memory_type_update(range);
+    }
+  }
+
+  //
+  // The value has been written already.  The INVEPT (if any
+  // entry has changed) is issued at the end of the VM-exit.
+  //
+  return false;
+}
+
+}
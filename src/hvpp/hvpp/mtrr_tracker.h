@@ -0,0 +1,69 @@
+#pragma once
+#include "msr_policy.h"
+#include "vcpu.h"
+
+#include "lib/error.h"
+#include "lib/per_cpu.h"
+
+#include <cstdint>
+
+namespace hvpp {
+
+//
+// Keeps memory types of the EPT in sync with the MTRRs.
+//
+// Memory types of the EPT entries are taken from the MTRRs when the
+// entries are mapped (see ept_t::map_identity()).  If the firmware or the
+// OS reprograms the MTRRs later, the EPT would keep the stale types.  The
+// tracker intercepts writes of all MTRRs (through the msr_policy), performs
+// the write, refreshes the MTRR model (see mm::mtrr_update()) and re-stamps
+// only the affected entries of all EPTs of the VCPU (see
+// ept_t::memory_type_update()) - large pages keep their size whenever
+// the new MTRRs allow it.
+//
+// The OS updates the MTRRs on each CPU, therefore each VCPU re-stamps its
+// own EPTs (copy-on-write views of the shared EPT get private copies of
+// the changed paging structures).  Note that the shared EPT itself is not
+// updated - views created after the MTRR change inherit the old types.
+//
+// Usage:
+//   mtrr_tracker_.attach(msr_policy_);               // e.g. in the ctor
+//
+//   (the rest is handled by the msr_policy)
+//
+
+class mtrr_tracker
+{
+  public:
+    mtrr_tracker() noexcept;
+
+    mtrr_tracker(const mtrr_tracker& other) noexcept = delete;
+    mtrr_tracker(mtrr_tracker&& other) noexcept = delete;
+    mtrr_tracker& operator=(const mtrr_tracker& other) noexcept = delete;
+    mtrr_tracker& operator=(mtrr_tracker&& other) noexcept = delete;
+
+    //
+    // Register all MTRRs of this CPU in the policy.  Must be called
+    // before the hypervisor is started.
+    //
+    auto attach(msr_policy& policy) noexcept -> error_code_t;
+
+    uint64_t write_count(uint32_t cpu_index) const noexcept
+    { return per_vcpu_[cpu_index].write_count; }
+
+    uint64_t entry_count(uint32_t cpu_index) const noexcept
+    { return per_vcpu_[cpu_index].entry_count; }
+
+  private:
+    static bool on_write(vcpu_t& vp, uint32_t msr_id, uint64_t& value, void* context) noexcept;
+
+    struct per_vcpu_t
+    {
+      uint64_t write_count;           // MTRR writes
+      uint64_t entry_count;           // re-stamped EPT entries
+    };
+
+    per_cpu<per_vcpu_t> per_vcpu_;
+};
+
+}
@@ -0,0 +1,660 @@
+#include "nested_vmx.h"
+
+#include "lib/assert.h"
+
+#include <cstddef>
+#include <iterator>
+
+namespace hvpp {
+
+namespace detail
+{
+  using field = vmx::vmcs_t::field;
+
+  //
+  // Fields kept in the shadow VMCS - guest VMREAD/VMWRITE of them don't
+  // cause VM-exit.  Exit-information fields aren't shadowed - they're
+  // read-only for the guest (see nested_vmx::vmread()).
+  //
+  static constexpr field shadowed_fields[] = {
+    field::ctrl_virtual_processor_identifier,
+    field::ctrl_io_bitmap_a_address,
+    field::ctrl_io_bitmap_b_address,
+    field::ctrl_msr_bitmap_address,
+    field::ctrl_vmexit_msr_store_address,
+    field::ctrl_vmexit_msr_load_address,
+    field::ctrl_vmentry_msr_load_address,
+    field::ctrl_tsc_offset,
+    field::ctrl_virtual_apic_address,
+    field::ctrl_ept_pointer,
+    field::ctrl_pin_based_vm_execution_controls,
+    field::ctrl_processor_based_vm_execution_controls,
+    field::ctrl_exception_bitmap,
+    field::ctrl_pagefault_error_code_mask,
+    field::ctrl_pagefault_error_code_match,
+    field::ctrl_cr3_target_count,
+    field::ctrl_vmexit_controls,
+    field::ctrl_vmexit_msr_store_count,
+    field::ctrl_vmexit_msr_load_count,
+    field::ctrl_vmentry_controls,
+    field::ctrl_vmentry_msr_load_count,
+    field::ctrl_vmentry_interruption_info,
+    field::ctrl_vmentry_exception_error_code,
+    field::ctrl_vmentry_instruction_length,
+    field::ctrl_tpr_threshold,
+    field::ctrl_secondary_processor_based_vm_execution_controls,
+    field::ctrl_cr0_guest_host_mask,
+    field::ctrl_cr4_guest_host_mask,
+    field::ctrl_cr0_read_shadow,
+    field::ctrl_cr4_read_shadow,
+
+    field::guest_es_selector,
+    field::guest_cs_selector,
+    field::guest_ss_selector,
+    field::guest_ds_selector,
+    field::guest_fs_selector,
+    field::guest_gs_selector,
+    field::guest_ldtr_selector,
+    field::guest_tr_selector,
+    field::guest_vmcs_link_pointer,
+    field::guest_debugctl,
+    field::guest_pat,
+    field::guest_efer,
+    field::guest_es_limit,
+    field::guest_cs_limit,
+    field::guest_ss_limit,
+    field::guest_ds_limit,
+    field::guest_fs_limit,
+    field::guest_gs_limit,
+    field::guest_ldtr_limit,
+    field::guest_tr_limit,
+    field::guest_gdtr_limit,
+    field::guest_idtr_limit,
+    field::guest_es_access_rights,
+    field::guest_cs_access_rights,
+    field::guest_ss_access_rights,
+    field::guest_ds_access_rights,
+    field::guest_fs_access_rights,
+    field::guest_gs_access_rights,
+    field::guest_ldtr_access_rights,
+    field::guest_tr_access_rights,
+    field::guest_interruptibility_state,
+    field::guest_activity_state,
+    field::guest_sysenter_cs,
+    field::guest_cr0,
+    field::guest_cr3,
+    field::guest_cr4,
+    field::guest_es_base,
+    field::guest_cs_base,
+    field::guest_ss_base,
+    field::guest_ds_base,
+    field::guest_fs_base,
+    field::guest_gs_base,
+    field::guest_ldtr_base,
+    field::guest_tr_base,
+    field::guest_gdtr_base,
+    field::guest_idtr_base,
+    field::guest_dr7,
+    field::guest_rsp,
+    field::guest_rip,
+    field::guest_rflags,
+    field::guest_pending_debug_exceptions,
+    field::guest_sysenter_esp,
+    field::guest_sysenter_eip,
+
+    field::host_es_selector,
+    field::host_cs_selector,
+    field::host_ss_selector,
+    field::host_ds_selector,
+    field::host_fs_selector,
+    field::host_gs_selector,
+    field::host_tr_selector,
+    field::host_pat,
+    field::host_efer,
+    field::host_sysenter_cs,
+    field::host_cr0,
+    field::host_cr3,
+    field::host_cr4,
+    field::host_fs_base,
+    field::host_gs_base,
+    field::host_tr_base,
+    field::host_gdtr_base,
+    field::host_idtr_base,
+    field::host_sysenter_esp,
+    field::host_sysenter_eip,
+    field::host_rsp,
+    field::host_rip,
+  };
+
+  static constexpr size_t shadowed_field_count = std::size(shadowed_fields);
+
+  static constexpr uint64_t invalid_vmcs = ~0ull;
+
+  static constexpr auto interrupt_invalid_opcode     = interrupt_t {
+                                                         vmx::interrupt_type::hardware_exception,
+                                                         exception_vector::invalid_opcode
+                                                       };
+
+  static constexpr auto interrupt_general_protection = interrupt_t {
+                                                         vmx::interrupt_type::hardware_exception,
+                                                         exception_vector::general_protection,
+                                                         exception_error_code_t{}
+                                                       };
+
+  static bool is_shadowed(field vmcs_field) noexcept
+  {
+    for (const auto shadowed_field : shadowed_fields)
+    {
+      if (shadowed_field == vmcs_field)
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  static bool is_exit_information(field vmcs_field) noexcept
+  {
+    //
+    // Bits 11:10 of the encoding - type (1 = VM-exit information).
+    //
+    return ((static_cast<uint32_t>(vmcs_field) >> 10) & 3) == 1;
+  }
+
+  static void inject(vcpu_t& vp, const interrupt_t& interrupt) noexcept
+  {
+    vp.interrupt_inject(interrupt);
+    vp.suppress_rip_adjust();
+  }
+
+  static void inject_page_fault(vcpu_t& vp, va_t va, size_t size, bool write_access) noexcept
+  {
+    //
+    // See vmexit_passthrough_handler::inject_page_fault().
+    //
+    const auto fault_va = va + va_t{ vp.guest_accessible(va, size, write_access) };
+
+    exception_error_code_t error_code{};
+    error_code.pagefault.present = !!vp.gva_to_gpa(fault_va);
+    error_code.pagefault.write = write_access;
+    error_code.pagefault.user_mode_access =
+      vp.guest_segment_access(context_t::seg_ss).descriptor_privilege_level == 3;
+
+    write<cr2_t>(cr2_t{ fault_va.value() });
+
+    inject(vp, interrupt_t{ vmx::interrupt_type::hardware_exception,
+                            exception_vector::page_fault,
+                            error_code });
+  }
+
+  static bool cpl_is_zero(vcpu_t& vp) noexcept
+  {
+    return vp.guest_segment_access(context_t::seg_ss).descriptor_privilege_level == 0;
+  }
+}
+
+nested_vmx::nested_vmx() noexcept
+  : per_vcpu_{}
+{
+  const auto err = per_vcpu_.initialize();
+  hvpp_assert(!err);
+  (void)(err);
+
+  static_assert(offsetof(image_t, value) + sizeof(uint64_t) * detail::shadowed_field_count <= page_size);
+}
+
+bool nested_vmx::setup(vcpu_t& vp) noexcept
+{
+  auto& data = per_vcpu_[vp.cpu_index()];
+
+  data = per_vcpu_t{};
+  data.current_vmcs = pa_t{ detail::invalid_vmcs };
+
+  if (!vp.vmcs_shadowing_enable())
+  {
+    return false;
+  }
+
+  for (const auto vmcs_field : detail::shadowed_fields)
+  {
+    vp.vmread_bitmap().set(vmcs_field, false);
+    vp.vmwrite_bitmap().set(vmcs_field, false);
+  }
+
+  data.enabled = true;
+  return true;
+}
+
+bool nested_vmx::handle(vcpu_t& vp) noexcept
+{
+  auto& data = per_vcpu_[vp.cpu_index()];
+
+  if (!data.enabled)
+  {
+    return false;
+  }
+
+  const auto exit_reason = vp.exit_reason();
+
+  switch (exit_reason)
+  {
+    case vmx::exit_reason::execute_vmxon:
+      vmxon(vp, data);
+      return true;
+
+    case vmx::exit_reason::execute_vmxoff:
+    case vmx::exit_reason::execute_vmclear:
+    case vmx::exit_reason::execute_vmptrld:
+    case vmx::exit_reason::execute_vmptrst:
+    case vmx::exit_reason::execute_vmread:
+    case vmx::exit_reason::execute_vmwrite:
+    case vmx::exit_reason::execute_vmlaunch:
+    case vmx::exit_reason::execute_vmresume:
+    case vmx::exit_reason::execute_invept:
+    case vmx::exit_reason::execute_invvpid:
+      break;
+
+    default:
+      return false;
+  }
+
+  //
+  // Outside of VMX operation, these instructions raise #UD, in VMX
+  // operation with CPL > 0 they raise #GP(0).
+  //
+  if (!data.vmxon)
+  {
+    detail::inject(vp, detail::interrupt_invalid_opcode);
+    return true;
+  }
+
+  if (!detail::cpl_is_zero(vp))
+  {
+    detail::inject(vp, detail::interrupt_general_protection);
+    return true;
+  }
+
+  switch (exit_reason)
+  {
+    case vmx::exit_reason::execute_vmxoff:   vmxoff(vp, data);          break;
+    case vmx::exit_reason::execute_vmclear:  vmclear(vp, data);         break;
+    case vmx::exit_reason::execute_vmptrld:  vmptrld(vp, data);         break;
+    case vmx::exit_reason::execute_vmptrst:  vmptrst(vp, data);         break;
+    case vmx::exit_reason::execute_vmread:   vmread(vp, data);          break;
+    case vmx::exit_reason::execute_vmwrite:  vmwrite(vp, data);         break;
+    case vmx::exit_reason::execute_vmlaunch: vmentry(vp, data, true);   break;
+    case vmx::exit_reason::execute_vmresume: vmentry(vp, data, false);  break;
+
+    default:
+      //
+      // INVEPT/INVVPID - the nested guest never runs, therefore there
+      // are no cached translations of it.
+      //
+      vm_succeed(vp);
+      break;
+  }
+
+  return true;
+}
+
+void nested_vmx::vmxon(vcpu_t& vp, per_vcpu_t& data) noexcept
+{
+  if (!vp.cr4_shadow().vmx_enable)
+  {
+    detail::inject(vp, detail::interrupt_invalid_opcode);
+    return;
+  }
+
+  if (!detail::cpl_is_zero(vp))
+  {
+    detail::inject(vp, detail::interrupt_general_protection);
+    return;
+  }
+
+  if (data.vmxon)
+  {
+    vm_fail(vp, data, vmx::instruction_error::vmxon_in_vmx_root_op);
+    return;
+  }
+
+  uint64_t vmxon_region;
+
+  if (!read_operand(vp, vmxon_region))
+  {
+    return;
+  }
+
+  uint32_t revision_id = 0;
+
+  if (!(vmxon_region & (page_size - 1)))
+  {
+    vp.guest_physical_read(pa_t{ vmxon_region }, &revision_id, sizeof(revision_id));
+  }
+
+  if (!vmxon_region || (vmxon_region & (page_size - 1)) ||
+      revision_id != vp.capabilities().basic.vmcs_revision_id)
+  {
+    vm_fail_invalid(vp);
+    return;
+  }
+
+  data.vmxon = true;
+  data.vmxon_region = pa_t{ vmxon_region };
+  data.current_vmcs = pa_t{ detail::invalid_vmcs };
+  vm_succeed(vp);
+}
+
+void nested_vmx::vmxoff(vcpu_t& vp, per_vcpu_t& data) noexcept
+{
+  if (data.current_vmcs != pa_t{ detail::invalid_vmcs })
+  {
+    vmcs_store(vp, data);
+  }
+
+  data.vmxon = false;
+  data.vmxon_region = pa_t{};
+  vm_succeed(vp);
+}
+
+void nested_vmx::vmclear(vcpu_t& vp, per_vcpu_t& data) noexcept
+{
+  uint64_t vmcs;
+
+  if (!read_operand(vp, vmcs))
+  {
+    return;
+  }
+
+  if (vmcs & (page_size - 1))
+  {
+    vm_fail(vp, data, vmx::instruction_error::vmclear_invalid_physical_address);
+    return;
+  }
+
+  if (pa_t{ vmcs } == data.vmxon_region)
+  {
+    vm_fail(vp, data, vmx::instruction_error::vmclear_invalid_vmxon_pointer);
+    return;
+  }
+
+  if (pa_t{ vmcs } == data.current_vmcs)
+  {
+    vmcs_store(vp, data);
+  }
+
+  //
+  // The launch state of the VMCS is "clear" from now on.
+  //
+  const uint32_t launch_state = 0;
+  vp.guest_physical_write(pa_t{ vmcs + offsetof(image_t, launch_state) }, &launch_state, sizeof(launch_state));
+
+  vm_succeed(vp);
+}
+
+void nested_vmx::vmptrld(vcpu_t& vp, per_vcpu_t& data) noexcept
+{
+  uint64_t vmcs;
+
+  if (!read_operand(vp, vmcs))
+  {
+    return;
+  }
+
+  if (vmcs & (page_size - 1))
+  {
+    vm_fail(vp, data, vmx::instruction_error::vmptrld_invalid_physical_address);
+    return;
+  }
+
+  if (pa_t{ vmcs } == data.vmxon_region)
+  {
+    vm_fail(vp, data, vmx::instruction_error::vmptrld_vmxon_pointer);
+    return;
+  }
+
+  uint32_t revision_id;
+  vp.guest_physical_read(pa_t{ vmcs }, &revision_id, sizeof(revision_id));
+
+  //
+  // Shadow VMCS of the guest (bit 31) isn't supported.
+  //
+  if (revision_id != vp.capabilities().basic.vmcs_revision_id)
+  {
+    vm_fail(vp, data, vmx::instruction_error::vmptrld_incorrect_vmcs_revision_id);
+    return;
+  }
+
+  if (pa_t{ vmcs } != data.current_vmcs)
+  {
+    if (data.current_vmcs != pa_t{ detail::invalid_vmcs })
+    {
+      vmcs_store(vp, data);
+    }
+
+    vmcs_load(vp, data, pa_t{ vmcs });
+  }
+
+  vm_succeed(vp);
+}
+
+void nested_vmx::vmptrst(vcpu_t& vp, per_vcpu_t& data) noexcept
+{
+  const auto guest_va = va_t{ vp.exit_instruction_info_guest_va() };
+  const auto vmcs = data.current_vmcs.value();
+
+  if (vp.guest_write(guest_va, &vmcs, sizeof(vmcs)) != sizeof(vmcs))
+  {
+    detail::inject_page_fault(vp, guest_va, sizeof(vmcs), true);
+    return;
+  }
+
+  vm_succeed(vp);
+}
+
+void nested_vmx::vmread(vcpu_t& vp, per_vcpu_t& data) noexcept
+{
+  //
+  // VMREAD of the shadowed field exits only if there's no current VMCS
+  // (VMCS link pointer is ~0) - which is checked first anyway.
+  //
+  const auto instruction_info = vp.exit_instruction_info().vmread_vmwrite;
+  auto& gp_register = vp.exit_context().gp_register;
+
+  const auto vmcs_field = static_cast<vmx::vmcs_t::field>(gp_register[instruction_info.register_2]);
+
+  if (data.current_vmcs == pa_t{ detail::invalid_vmcs })
+  {
+    vm_fail_invalid(vp);
+    return;
+  }
+
+  uint64_t value = 0;
+
+  if (detail::is_shadowed(vmcs_field))
+  {
+    vp.shadow_vmcs_read(&vmcs_field, &value, 1);
+  }
+  else if (vmcs_field == vmx::vmcs_t::field::vmexit_instruction_error)
+  {
+    value = data.instruction_error;
+  }
+  else if (!detail::is_exit_information(vmcs_field))
+  {
+    vm_fail_valid(vp, data, vmx::instruction_error::vmread_vmwrite_invalid_component);
+    return;
+  }
+
+  //
+  // Note that only the 64-bit mode is expected (the operand is always
+  // 8 bytes).
+  //
+  if (instruction_info.access_type)
+  {
+    gp_register[instruction_info.register_1] = value;
+  }
+  else
+  {
+    const auto guest_va = va_t{ vp.exit_instruction_info_guest_va() };
+
+    if (vp.guest_write(guest_va, &value, sizeof(value)) != sizeof(value))
+    {
+      detail::inject_page_fault(vp, guest_va, sizeof(value), true);
+      return;
+    }
+  }
+
+  vm_succeed(vp);
+}
+
+void nested_vmx::vmwrite(vcpu_t& vp, per_vcpu_t& data) noexcept
+{
+  const auto instruction_info = vp.exit_instruction_info().vmread_vmwrite;
+  const auto& gp_register = vp.exit_context().gp_register;
+
+  const auto vmcs_field = static_cast<vmx::vmcs_t::field>(gp_register[instruction_info.register_2]);
+
+  uint64_t value;
+
+  if (instruction_info.access_type)
+  {
+    value = gp_register[instruction_info.register_1];
+  }
+  else
+  {
+    if (!read_operand(vp, value))
+    {
+      return;
+    }
+  }
+
+  if (data.current_vmcs == pa_t{ detail::invalid_vmcs })
+  {
+    vm_fail_invalid(vp);
+    return;
+  }
+
+  if (detail::is_exit_information(vmcs_field))
+  {
+    vm_fail_valid(vp, data, vmx::instruction_error::vmwrite_readonly_component);
+    return;
+  }
+
+  if (!detail::is_shadowed(vmcs_field))
+  {
+    vm_fail_valid(vp, data, vmx::instruction_error::vmread_vmwrite_invalid_component);
+    return;
+  }
+
+  vp.shadow_vmcs_write(&vmcs_field, &value, 1);
+  vm_succeed(vp);
+}
+
+void nested_vmx::vmentry(vcpu_t& vp, per_vcpu_t& data, bool launch) noexcept
+{
+  if (data.current_vmcs == pa_t{ detail::invalid_vmcs })
+  {
+    vm_fail_invalid(vp);
+    return;
+  }
+
+  if (launch && data.launch_state != 0)
+  {
+    vm_fail_valid(vp, data, vmx::instruction_error::vmlauch_non_clear_vmcs);
+    return;
+  }
+
+  if (!launch && data.launch_state == 0)
+  {
+    vm_fail_valid(vp, data, vmx::instruction_error::vmresume_non_launched_vmcs);
+    return;
+  }
+
+  //
+  // VM-entry of the nested guest isn't implemented.
+  //
+  vm_fail_valid(vp, data, vmx::instruction_error::vmentry_invalid_control_fields);
+}
+
+void nested_vmx::vmcs_store(vcpu_t& vp, per_vcpu_t& data) noexcept
+{
+  uint64_t value[detail::shadowed_field_count];
+  vp.shadow_vmcs_read(detail::shadowed_fields, value, detail::shadowed_field_count);
+
+  const auto vmcs = data.current_vmcs.value();
+
+  vp.guest_physical_write(pa_t{ vmcs + offsetof(image_t, launch_state) },      &data.launch_state,      sizeof(data.launch_state));
+  vp.guest_physical_write(pa_t{ vmcs + offsetof(image_t, instruction_error) }, &data.instruction_error, sizeof(data.instruction_error));
+  vp.guest_physical_write(pa_t{ vmcs + offsetof(image_t, value) },             value,                   sizeof(value));
+
+  vp.shadow_vmcs_link(false);
+  data.current_vmcs = pa_t{ detail::invalid_vmcs };
+}
+
+void nested_vmx::vmcs_load(vcpu_t& vp, per_vcpu_t& data, pa_t vmcs) noexcept
+{
+  //
+  // Note that region of VMCS which has never been cleared contains
+  // garbage - that's what the real CPU would do as well.
+  //
+  uint64_t value[detail::shadowed_field_count];
+
+  vp.guest_physical_read(vmcs + offsetof(image_t, launch_state),      &data.launch_state,      sizeof(data.launch_state));
+  vp.guest_physical_read(vmcs + offsetof(image_t, instruction_error), &data.instruction_error, sizeof(data.instruction_error));
+  vp.guest_physical_read(vmcs + offsetof(image_t, value),             value,                   sizeof(value));
+
+  vp.shadow_vmcs_write(detail::shadowed_fields, value, detail::shadowed_field_count);
+  vp.shadow_vmcs_link(true);
+  data.current_vmcs = vmcs;
+}
+
+bool nested_vmx::read_operand(vcpu_t& vp, uint64_t& value) noexcept
+{
+  const auto guest_va = va_t{ vp.exit_instruction_info_guest_va() };
+
+  if (vp.guest_read(guest_va, &value, sizeof(value)) != sizeof(value))
+  {
+    detail::inject_page_fault(vp, guest_va, sizeof(value), false);
+    return false;
+  }
+
+  return true;
+}
+
+void nested_vmx::vm_succeed(vcpu_t& vp) noexcept
+{
+  auto& rflags = vp.exit_context().rflags;
+  rflags.carry_flag           = false;
+  rflags.parity_flag          = false;
+  rflags.auxiliary_carry_flag = false;
+  rflags.zero_flag            = false;
+  rflags.sign_flag            = false;
+  rflags.overflow_flag        = false;
+}
+
+void nested_vmx::vm_fail_invalid(vcpu_t& vp) noexcept
+{
+  vm_succeed(vp);
+  vp.exit_context().rflags.carry_flag = true;
+}
+
+void nested_vmx::vm_fail_valid(vcpu_t& vp, per_vcpu_t& data, vmx::instruction_error error) noexcept
+{
+  vm_succeed(vp);
+  vp.exit_context().rflags.zero_flag = true;
+  data.instruction_error = error;
+}
+
+void nested_vmx::vm_fail(vcpu_t& vp, per_vcpu_t& data, vmx::instruction_error error) noexcept
+{
+  if (data.current_vmcs != pa_t{ detail::invalid_vmcs })
+  {
+    vm_fail_valid(vp, data, error);
+  }
+  else
+  {
+    vm_fail_invalid(vp);
+  }
+}
+
+}
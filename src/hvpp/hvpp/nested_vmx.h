@@ -0,0 +1,125 @@
+#pragma once
+#include "vcpu.h"
+
+#include "lib/per_cpu.h"
+
+#include <cstdint>
+
+namespace hvpp {
+
+//
+// Emulation of VMX operation of the guest, based on VMCS shadowing.
+//
+// The guest VMCS is kept in the shadow VMCS of the VCPU while it's
+// current (between VMPTRLD and VMCLEAR/another VMPTRLD) - guest
+// VMREAD/VMWRITE of the fields listed in nested_vmx.cpp don't cause
+// VM-exit at all.  Only VMXON, VMXOFF, VMCLEAR, VMPTRLD, VMPTRST,
+// VMLAUNCH, VMRESUME, INVEPT, INVVPID and VMREAD/VMWRITE of other fields
+// are emulated here.  When the guest VMCS stops being current, its
+// fields are stored into the VMCS region in the guest memory (the format
+// of the VMCS region is implementation-specific, see image_t).
+//
+// Note that VM-entries of the nested guest aren't implemented yet -
+// VMLAUNCH/VMRESUME fail with "VM entry with invalid control field(s)".
+// The guest can still use VMX operation up to that point (e.g. probe
+// VMX support and the VMCS layout).
+//
+// The guest must see VMX in CPUID.1:ECX (and the VMX capability MSRs)
+// - which is the case if CPUID and RDMSR are passed through.
+//
+// Usage:
+//   void my_handler::setup(vcpu_t& vp) noexcept
+//   {
+//     base_type::setup(vp);
+//     nested_vmx_.setup(vp);
+//   }
+//
+//   void my_handler::handle_vm_fallback(vcpu_t& vp) noexcept
+//   {
+//     if (!nested_vmx_.handle(vp))
+//     {
+//       base_type::handle_vm_fallback(vp);
+//     }
+//   }
+//
+
+class nested_vmx
+{
+  public:
+    nested_vmx() noexcept;
+
+    nested_vmx(const nested_vmx& other) noexcept = delete;
+    nested_vmx(nested_vmx&& other) noexcept = delete;
+    nested_vmx& operator=(const nested_vmx& other) noexcept = delete;
+    nested_vmx& operator=(nested_vmx&& other) noexcept = delete;
+
+    //
+    // Enable VMCS shadowing of this VCPU.  Returns false if the CPU
+    // doesn't support it (handle() then always returns false).
+    //
+    bool setup(vcpu_t& vp) noexcept;
+
+    //
+    // Handle the VM-exit caused by VMX instruction of the guest (except
+    // VMCALL and VMFUNC).  Returns false if the VM-exit is left to the
+    // caller.
+    //
+    bool handle(vcpu_t& vp) noexcept;
+
+  private:
+    //
+    // Content of the guest VMCS region while the VMCS isn't current.
+    //
+    struct image_t
+    {
+      uint32_t revision_id;
+      uint32_t abort_indicator;
+      uint32_t launch_state;          // 0 = clear, 1 = launched
+      uint32_t instruction_error;
+      uint64_t value[1];              // see shadowed_fields
+    };
+
+    struct per_vcpu_t
+    {
+      bool     enabled;
+      bool     vmxon;
+      pa_t     vmxon_region;
+      pa_t     current_vmcs;          // ~0 = no current VMCS
+      uint32_t launch_state;
+      uint32_t instruction_error;
+    };
+
+    void vmxon(vcpu_t& vp, per_vcpu_t& data) noexcept;
+    void vmxoff(vcpu_t& vp, per_vcpu_t& data) noexcept;
+    void vmclear(vcpu_t& vp, per_vcpu_t& data) noexcept;
+    void vmptrld(vcpu_t& vp, per_vcpu_t& data) noexcept;
+    void vmptrst(vcpu_t& vp, per_vcpu_t& data) noexcept;
+    void vmread(vcpu_t& vp, per_vcpu_t& data) noexcept;
+    void vmwrite(vcpu_t& vp, per_vcpu_t& data) noexcept;
+    void vmentry(vcpu_t& vp, per_vcpu_t& data, bool launch) noexcept;
+
+    //
+    // Move the current VMCS between the shadow VMCS and the guest memory.
+    //
+    void vmcs_store(vcpu_t& vp, per_vcpu_t& data) noexcept;
+    void vmcs_load(vcpu_t& vp, per_vcpu_t& data, pa_t vmcs) noexcept;
+
+    //
+    // Read the 64-bit memory operand of VMXON, VMCLEAR and VMPTRLD.
+    // Returns false (with #PF injected) if the operand isn't accessible.
+    //
+    bool read_operand(vcpu_t& vp, uint64_t& value) noexcept;
+
+    //
+    // Set RFLAGS according to the result of the emulated instruction.
+    // (ref: Vol3C[30.2(Conventions)])
+    //
+    void vm_succeed(vcpu_t& vp) noexcept;
+    void vm_fail_invalid(vcpu_t& vp) noexcept;
+    void vm_fail_valid(vcpu_t& vp, per_vcpu_t& data, vmx::instruction_error error) noexcept;
+    void vm_fail(vcpu_t& vp, per_vcpu_t& data, vmx::instruction_error error) noexcept;
+
+    per_cpu<per_vcpu_t> per_vcpu_;
+};
+
+}
@@ -0,0 +1,66 @@
+#include "pause_policy.h"
+#include "hypervisor.h"
+
+#include "lib/assert.h"
+
+#include <algorithm>
+
+namespace hvpp {
+
+pause_policy::pause_policy() noexcept
+  : callback_{ nullptr }
+  , callback_context_{ nullptr }
+  , gap_{ default_gap }
+  , window_min_{ default_window_min }
+  , window_max_{ default_window_max }
+  , per_vcpu_{}
+{
+
+}
+
+void pause_policy::callback(callback_t callback, void* context) noexcept
+{
+  hvpp_assert(!hypervisor::is_started());
+
+  callback_ = callback;
+  callback_context_ = context;
+}
+
+void pause_policy::window(uint32_t gap, uint32_t window_min, uint32_t window_max) noexcept
+{
+  hvpp_assert(!hypervisor::is_started());
+  hvpp_assert(window_min != 0 && window_min <= window_max);
+
+  gap_ = gap;
+  window_min_ = window_min;
+  window_max_ = window_max;
+}
+
+auto pause_policy::setup(vcpu_t& vp) noexcept -> error_code_t
+{
+  auto& data = per_vcpu_[vp.cpu_index()];
+  data = per_vcpu_t{};
+  data.window = window_min_;
+
+  return vp.pause_loop_exiting(gap_, data.window);
+}
+
+void pause_policy::pause_loop(vcpu_t& vp) noexcept
+{
+  auto& data = per_vcpu_[vp.cpu_index()];
+  data.pause_loop_count += 1;
+
+  const bool useful = callback_ && callback_(vp, callback_context_);
+
+  const auto window = useful
+    ? std::max(data.window / 2, window_min_)
+    : static_cast<uint32_t>(std::min<uint64_t>(uint64_t(data.window) * 2, window_max_));
+
+  if (window != data.window)
+  {
+    data.window = window;
+    vp.pause_loop_window(window);
+  }
+}
+
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include "vcpu.h"
+
+#include "lib/error.h"
+
+#include <cstdint>
+
+namespace hvpp {
+
+//
+// PAUSE-loop exiting policy.
+//
+// Spinning guest reports itself by the PAUSE-loop VM-exit - which is
+// a good opportunity for the hypervisor to do its deferred work (drain
+// trace rings, apply pending EPT changes, ...) or to yield.  The callback
+// returns true if it has done something useful.
+//
+// The window is tuned adaptively for each VCPU: VM-exits which weren't
+// useful double the window (up to "window_max"), so that the spinning
+// guest isn't interrupted needlessly, useful ones halve it (down to
+// "window_min").
+//
+// Usage:
+//   pause_policy_.callback(&on_guest_spin, this);    // e.g. in the ctor
+//
+//   void my_handler::setup(vcpu_t& vp) noexcept
+//   {
+//     pause_policy_.setup(vp);
+//   }
+//
+//   void my_handler::handle_execute_pause(vcpu_t& vp) noexcept
+//   {
+//     pause_policy_.pause_loop(vp);
+//   }
+//
+
+class pause_policy
+{
+  public:
+    using callback_t = bool(*)(vcpu_t& vp, void* context) noexcept;
+
+    //
+    // Defaults (in TSC ticks) - similar to these used by other
+    // hypervisors.
+    //
+    static constexpr uint32_t default_gap        = 128;
+    static constexpr uint32_t default_window_min = 4096;
+    static constexpr uint32_t default_window_max = 1024 * 1024;
+
+    pause_policy() noexcept;
+
+    pause_policy(const pause_policy& other) noexcept = delete;
+    pause_policy(pause_policy&& other) noexcept = delete;
+    pause_policy& operator=(const pause_policy& other) noexcept = delete;
+    pause_policy& operator=(pause_policy&& other) noexcept = delete;
+
+    //
+    // These methods must be called before the hypervisor is started.
+    //
+    void callback(callback_t callback, void* context) noexcept;
+    void window(uint32_t gap, uint32_t window_min, uint32_t window_max) noexcept;
+
+    //
+    // Enable the PAUSE-loop exiting with the minimal window (called from
+    // vmexit_handler::attach()).
+    //
+    auto setup(vcpu_t& vp) noexcept -> error_code_t;
+
+    //
+    // Handle the PAUSE-loop VM-exit.
+    //
+    void pause_loop(vcpu_t& vp) noexcept;
+
+    uint64_t pause_loop_count(uint32_t cpu_index) const noexcept
+    { return per_vcpu_[cpu_index].pause_loop_count; }
+
+  private:
+    struct per_vcpu_t
+    {
+      uint64_t pause_loop_count;
+      uint32_t window;
+    };
+
+    callback_t callback_;
+    void*      callback_context_;
+
+    uint32_t   gap_;
+    uint32_t   window_min_;
+    uint32_t   window_max_;
+
+    per_vcpu_t per_vcpu_[HVPP_MAX_CPU];
+};
+
+}
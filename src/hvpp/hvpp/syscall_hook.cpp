@@ -0,0 +1,236 @@
+#include "syscall_hook.h"
+#include "hypervisor.h"
+#include "vmexit.h"
+
+#include "lib/assert.h"
+#include "lib/bitmap.h"
+
+#include <initializer_list>
+
+namespace hvpp {
+
+syscall_hook::syscall_hook() noexcept
+  : trace_bitmap_{}
+  , trace_all_{ false }
+  , callback_{ nullptr }
+  , callback_context_{ nullptr }
+  , per_vcpu_{}
+{
+
+}
+
+void syscall_hook::callback(callback_t callback, void* context) noexcept
+{
+  hvpp_assert(!hypervisor::is_started());
+
+  callback_ = callback;
+  callback_context_ = context;
+}
+
+void syscall_hook::trace(uint32_t syscall_number) noexcept
+{
+  hvpp_assert(!hypervisor::is_started());
+  hvpp_assert(syscall_number < max_syscall_number);
+
+  bitmap(trace_bitmap_).set(syscall_number);
+}
+
+void syscall_hook::trace_all() noexcept
+{
+  hvpp_assert(!hypervisor::is_started());
+
+  trace_all_ = true;
+}
+
+void syscall_hook::setup(vcpu_t& vp) noexcept
+{
+  auto& data = per_vcpu_[vp.cpu_index()];
+
+  data.efer  = msr::read<msr::efer_t>();
+  data.lstar = msr::read<msr::lstar_t>();
+  data.fmask = msr::read<msr::fmask_t>().flags;
+  star_update(data, msr::read<msr::star_t>());
+
+  //
+  // Run the guest with EFER.SCE cleared - SYSCALL/SYSRET raise #UD then.
+  // The host keeps its EFER.
+  //
+  vp.efer_load_enable();
+
+  auto guest_efer = data.efer;
+  guest_efer.syscall_enable = false;
+  vp.guest_efer(guest_efer);
+
+  auto exception_bitmap = vp.exception_bitmap();
+  exception_bitmap.invalid_opcode = true;
+  vp.exception_bitmap(exception_bitmap);
+
+  //
+  // IA32_EFER is held in the VMCS now and cached values of the other
+  // MSRs must be kept in sync - intercept both reads and writes.
+  //
+  auto& msr_bitmap = vp.msr_bitmap_private();
+
+  for (auto msr_id : { msr::efer_t::msr_id, msr::star_t::msr_id,
+                       msr::lstar_t::msr_id, msr::fmask_t::msr_id })
+  {
+    const auto bit = static_cast<int>(msr_id - vmx::msr_bitmap_t::msr_id_high_min);
+
+    bitmap(msr_bitmap.rdmsr_high).set(bit);
+    bitmap(msr_bitmap.wrmsr_high).set(bit);
+  }
+}
+
+void syscall_hook::emulate_syscall(vcpu_t& vp) noexcept
+{
+  auto& data = per_vcpu_[vp.cpu_index()];
+  auto& context = vp.exit_context();
+
+  if (!data.efer.syscall_enable)
+  {
+    //
+    // The guest itself has SYSCALL disabled - this #UD is genuine.
+    //
+    vp.interrupt_inject(vmexit_handler::interrupt_invalid_opcode);
+    return;
+  }
+
+  const auto syscall_number = static_cast<uint32_t>(context.rax);
+
+  if (callback_ &&
+      (trace_all_ || (syscall_number < max_syscall_number &&
+                      bitmap(trace_bitmap_).test(syscall_number))))
+  {
+    callback_(vp, syscall_number, callback_context_);
+  }
+
+  //
+  // See vmexit_passthrough_handler::handle_emulate_syscall().
+  // Size of the SYSCALL instruction (0F 05) is 2 bytes.
+  //
+  context.rcx = context.rip + 2;
+  context.rip = data.lstar;
+
+  context.r11 = context.rflags.flags;
+  context.rflags.flags &= ~data.fmask;
+
+  vp.guest_cs(data.syscall_cs);
+  vp.guest_ss(data.syscall_ss);
+}
+
+void syscall_hook::emulate_sysret(vcpu_t& vp) noexcept
+{
+  auto& data = per_vcpu_[vp.cpu_index()];
+  auto& context = vp.exit_context();
+
+  if (!data.efer.syscall_enable)
+  {
+    vp.interrupt_inject(vmexit_handler::interrupt_invalid_opcode);
+    return;
+  }
+
+  //
+  // See vmexit_passthrough_handler::handle_emulate_sysret().
+  //
+  context.rip = context.rcx;
+
+  context.rflags.flags = context.r11;
+  context.rflags.flags &= ~rflags_t::reserved_bits;
+  context.rflags.flags |=  rflags_t::fixed_bits;
+
+  vp.guest_cs(data.sysret_cs);
+  vp.guest_ss(data.sysret_ss);
+}
+
+bool syscall_hook::rdmsr(vcpu_t& vp) noexcept
+{
+  auto& data = per_vcpu_[vp.cpu_index()];
+  uint64_t msr_value;
+
+  switch (vp.exit_context().ecx)
+  {
+    case msr::efer_t::msr_id:  msr_value = data.efer.flags; break;
+    case msr::star_t::msr_id:  msr_value = data.star;       break;
+    case msr::lstar_t::msr_id: msr_value = data.lstar;      break;
+    case msr::fmask_t::msr_id: msr_value = data.fmask;      break;
+    default:
+      return false;
+  }
+
+  vp.exit_context().rax = msr_value & 0xffffffff;
+  vp.exit_context().rdx = msr_value >> 32;
+
+  return true;
+}
+
+bool syscall_hook::wrmsr(vcpu_t& vp) noexcept
+{
+  auto& data = per_vcpu_[vp.cpu_index()];
+  const uint32_t msr_id = vp.exit_context().ecx;
+  const uint64_t msr_value =
+    vp.exit_context().rax |
+    vp.exit_context().rdx << 32;
+
+  switch (msr_id)
+  {
+    case msr::efer_t::msr_id:
+      {
+        data.efer = msr::efer_t{ msr_value };
+
+        auto guest_efer = data.efer;
+        guest_efer.syscall_enable = false;
+        vp.guest_efer(guest_efer);
+      }
+      return true;
+
+    case msr::star_t::msr_id:
+      star_update(data, msr_value);
+      break;
+
+    case msr::lstar_t::msr_id:
+      data.lstar = msr_value;
+      break;
+
+    case msr::fmask_t::msr_id:
+      data.fmask = msr_value;
+      break;
+
+    default:
+      return false;
+  }
+
+  msr::write(msr_id, msr_value);
+  return true;
+}
+
+void syscall_hook::star_update(per_vcpu_t& data, uint64_t star) noexcept
+{
+  data.star = star;
+
+  //
+  // Segments loaded by SYSCALL and SYSRET - see the verbose versions
+  // in vmexit_passthrough_handler::handle_emulate_syscall() and
+  // vmexit_passthrough_handler::handle_emulate_sysret().
+  //
+  data.syscall_cs.base_address = nullptr;
+  data.syscall_cs.limit        = uint32_t(0xffffffff);
+  data.syscall_cs.access       = segment_access_vmx_t{ 0xa09b };
+  data.syscall_cs.selector     = cs_t{ uint16_t((star >> 32) & ~3) };
+
+  data.syscall_ss.base_address = nullptr;
+  data.syscall_ss.limit        = uint32_t(0xffffffff);
+  data.syscall_ss.access       = segment_access_vmx_t{ 0xc093 };
+  data.syscall_ss.selector     = ss_t{ uint16_t(((star >> 32) & ~3) + 8) };
+
+  data.sysret_cs.base_address  = nullptr;
+  data.sysret_cs.limit         = uint32_t(0xffffffff);
+  data.sysret_cs.access        = segment_access_vmx_t{ 0xa0fb };
+  data.sysret_cs.selector      = cs_t{ uint16_t(((star >> 48) + 16) | 3) };
+
+  data.sysret_ss.base_address  = nullptr;
+  data.sysret_ss.limit         = uint32_t(0xffffffff);
+  data.sysret_ss.access        = segment_access_vmx_t{ 0xc0f3 };
+  data.sysret_ss.selector      = ss_t{ uint16_t(((star >> 48) + 8) | 3) };
+}
+
+}
@@ -0,0 +1,120 @@
+#pragma once
+#include "vcpu.h"
+
+#include "ia32/msr.h"
+
+#include <cstdint>
+
+namespace hvpp {
+
+//
+// SYSCALL interception.
+//
+// The guest runs with EFER.SCE cleared (see vcpu_t::efer_load_enable()),
+// therefore each SYSCALL/SYSRET raises #UD, which is caught and emulated
+// by emulate_syscall()/emulate_sysret().  Guest accesses of IA32_EFER,
+// IA32_STAR, IA32_LSTAR and IA32_FMASK are intercepted, so that the guest
+// still sees EFER.SCE set and so that the values of these MSRs and the
+// CS/SS segments loaded by SYSCALL/SYSRET can be cached per VCPU - the
+// emulation then doesn't execute any RDMSR or VMREAD.
+//
+// The callback is called only for traced system call numbers (the value
+// of EAX), all other system calls are emulated right away.
+//
+// Usage:
+//   syscall_hook_.callback(&on_syscall, this);       // e.g. in the ctor
+//   syscall_hook_.trace(0x55);
+//
+//   void my_handler::setup(vcpu_t& vp) noexcept
+//   {
+//     base_type::setup(vp);
+//     syscall_hook_.setup(vp);                       // after the MSR bitmap is set
+//   }
+//
+//   void my_handler::handle_emulate_syscall(vcpu_t& vp) noexcept
+//   { syscall_hook_.emulate_syscall(vp); }
+//
+//   void my_handler::handle_emulate_sysret(vcpu_t& vp) noexcept
+//   { syscall_hook_.emulate_sysret(vp); }
+//
+//   void my_handler::handle_execute_rdmsr(vcpu_t& vp) noexcept
+//   {
+//     if (!syscall_hook_.rdmsr(vp))
+//     {
+//       base_type::handle_execute_rdmsr(vp);
+//     }
+//   }
+//
+//   (and the same for handle_execute_wrmsr())
+//
+
+class syscall_hook
+{
+  public:
+    //
+    // Called before the SYSCALL is emulated - the context still holds
+    // the user-mode registers and can be modified.
+    //
+    using callback_t = void(*)(vcpu_t& vp, uint32_t syscall_number, void* context) noexcept;
+
+    //
+    // Traceable system call numbers (this covers both the ntoskrnl
+    // and the win32k service tables).
+    //
+    static constexpr uint32_t max_syscall_number = 0x2000;
+
+    syscall_hook() noexcept;
+
+    syscall_hook(const syscall_hook& other) noexcept = delete;
+    syscall_hook(syscall_hook&& other) noexcept = delete;
+    syscall_hook& operator=(const syscall_hook& other) noexcept = delete;
+    syscall_hook& operator=(syscall_hook&& other) noexcept = delete;
+
+    //
+    // These methods must be called before the hypervisor is started.
+    //
+    void callback(callback_t callback, void* context) noexcept;
+    void trace(uint32_t syscall_number) noexcept;
+    void trace_all() noexcept;
+
+    //
+    // Cache the MSRs, clear EFER.SCE of the guest and intercept #UD and
+    // the SYSCALL MSRs (called from vmexit_handler::attach()).
+    //
+    void setup(vcpu_t& vp) noexcept;
+
+    void emulate_syscall(vcpu_t& vp) noexcept;
+    void emulate_sysret(vcpu_t& vp) noexcept;
+
+    //
+    // Handle the RDMSR/WRMSR VM-exit of the SYSCALL MSRs.  Returns false
+    // for other MSRs.
+    //
+    bool rdmsr(vcpu_t& vp) noexcept;
+    bool wrmsr(vcpu_t& vp) noexcept;
+
+  private:
+    struct per_vcpu_t
+    {
+      msr::efer_t     efer;             // as seen by the guest
+      uint64_t        star;
+      uint64_t        lstar;
+      uint64_t        fmask;
+
+      segment_t<cs_t> syscall_cs;
+      segment_t<ss_t> syscall_ss;
+      segment_t<cs_t> sysret_cs;
+      segment_t<ss_t> sysret_ss;
+    };
+
+    static void star_update(per_vcpu_t& data, uint64_t star) noexcept;
+
+    uint8_t    trace_bitmap_[max_syscall_number / 8];
+    bool       trace_all_;
+    callback_t callback_;
+    void*      callback_context_;
+
+    per_vcpu_t per_vcpu_[HVPP_MAX_CPU];
+};
+
+}
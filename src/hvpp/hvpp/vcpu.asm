@@ -28,22 +28,44 @@ INCLUDE ia32/common.inc
 ;
 ; Useful definitions.
 ;
-    VCPU_OFFSET                         = -8000h             ; -vcpu_stack_size
     VCPU_LAUNCH_CONTEXT_OFFSET          =  0
     VCPU_EXIT_CONTEXT_OFFSET            =  144               ; sizeof context
+    VCPU_FAST_PATH_OFFSET               =  288               ; 2 * sizeof context
     SHADOW_SPACE                        =  20h
 
 ;
-; Externally used symbols.
+; VMCS fields and exit reasons used by the fast path.
+;
+    VMCS_VMEXIT_REASON                  =  4402h
+    VMCS_VMEXIT_INSTRUCTION_LENGTH      =  440Ch
+    VMCS_GUEST_RIP                      =  681Eh
+
+    EXIT_REASON_EXECUTE_CPUID           =  10
+    EXIT_REASON_EXECUTE_INVD            =  13
+    EXIT_REASON_EXECUTE_RDTSCP          =  51
+    EXIT_REASON_EXECUTE_WBINVD          =  54
+    EXIT_REASON_EXECUTE_XSETBV          =  55
+
+;
+; Layout of hvpp::vcpu_fast_path_t (see vcpu.h).
 ;
-    ; "public:  __int64 __cdecl ia32::context_t::capture(void)"
-    EXTERN ?capture@context_t@ia32@@QEAAHXZ           : PROC
+    vcpu_fast_path_t struct
+        exit_reason_bitmap  dq 2 dup (?)
+        cpuid_0_bitmap      dq ?
+        cpuid_8_bitmap      dq ?
+        bypass              dd ?
+        rdtscp_bypass       dd ?
+        vcpu                dq ?
+    vcpu_fast_path_t ends
 
+;
+; Externally used symbols.
+;
     ; "public:  void    __cdecl ia32::context_t::restore(void)"
     EXTERN ?restore@context_t@ia32@@QEAAXXZ           : PROC
 
-    ; "private: void    __cdecl hvpp::vcpu_t::entry_host(void)"
-    EXTERN ?entry_host@vcpu_t@hvpp@@AEAAXXZ           : PROC
+    ; "private: bool    __cdecl hvpp::vcpu_t::entry_host(void)"
+    EXTERN ?entry_host@vcpu_t@hvpp@@AEAA_NXZ          : PROC
 
     ; "private: void    __cdecl hvpp::vcpu_t::entry_guest(void)"
     EXTERN ?entry_guest@vcpu_t@hvpp@@AEAAXXZ          : PROC
@@ -66,7 +88,7 @@ INCLUDE ia32/common.inc
 ; RCX = &vcpu
 ; RBX = &vcpu.launch_context_
 ;
-        lea     rcx, qword ptr [rsp + VCPU_OFFSET]
+        mov     rcx, qword ptr [rsp + VCPU_FAST_PATH_OFFSET + vcpu_fast_path_t.vcpu]
         lea     rbx, qword ptr [rsp + VCPU_LAUNCH_CONTEXT_OFFSET]
 
 ;
@@ -91,8 +113,13 @@ INCLUDE ia32/common.inc
 ;
 ; Routine description:
 ;
-;   This method captures current CPU context and calls vcpu_t::entry_host()
-;   method.
+;   This method saves general purpose registers of the guest into the
+;   vcpu.exit_context_ and calls vcpu_t::entry_host() method.  The guest
+;   is then resumed directly from this method (RIP, RSP and RFLAGS of the
+;   guest live in the VMCS - they're not part of the saved context).
+;
+;   If the VCPU has been terminated (VMX-root mode has been left), the
+;   guest context is restored by context_t::restore() instead.
 ;
 ;   Note that this procedure is declared with FRAME attribute.
 ;
@@ -111,29 +138,40 @@ INCLUDE ia32/common.inc
 ;--
 
     ?entry_host_@vcpu_t@hvpp@@CAXXZ PROC FRAME
-        push    rcx
-
-;
-; RCX = &vcpu.exit_context_
-;
-        lea     rcx, qword ptr [rsp + 8 + VCPU_EXIT_CONTEXT_OFFSET]
-        call    ?capture@context_t@ia32@@QEAAHXZ
-
 ;
 ; RBX = &vcpu.exit_context_
-; RCX = original value of RCX
-; RSP = original value of RSP
 ;
-        mov     rbx, rcx
-        pop     rcx
+        mov     qword ptr [rsp + VCPU_EXIT_CONTEXT_OFFSET + context_t.$rbx], rbx
+        lea     rbx, qword ptr [rsp + VCPU_EXIT_CONTEXT_OFFSET]
 
+        mov     context_t.$rax[rbx], rax
         mov     context_t.$rcx[rbx], rcx
+        mov     context_t.$rdx[rbx], rdx
+        mov     context_t.$rbp[rbx], rbp
+        mov     context_t.$rsi[rbx], rsi
+        mov     context_t.$rdi[rbx], rdi
+        mov     context_t.$r8 [rbx], r8
+        mov     context_t.$r9 [rbx], r9
+        mov     context_t.$r10[rbx], r10
+        mov     context_t.$r11[rbx], r11
+        mov     context_t.$r12[rbx], r12
+        mov     context_t.$r13[rbx], r13
+        mov     context_t.$r14[rbx], r14
+        mov     context_t.$r15[rbx], r15
+
+;
+; Host RFLAGS are always 2 after VM-exit, this is saved only for the
+; context_t::restore() that might follow.  RSP, RIP and RFLAGS of the
+; guest are read from the VMCS by vcpu_t::entry_host().
+;
+        pushfq
+        pop     context_t.$rflags[rbx]
         mov     context_t.$rsp[rbx], rsp
 
 ;
 ; RCX = &vcpu
 ;
-        lea     rcx, qword ptr [rsp + VCPU_OFFSET]
+        mov     rcx, qword ptr [rsp + VCPU_FAST_PATH_OFFSET + vcpu_fast_path_t.vcpu]
 
 ;
 ; Create dummy machine frame.
@@ -211,14 +249,202 @@ INCLUDE ia32/common.inc
 ;
         .endprolog
 
-        call    ?entry_host@vcpu_t@hvpp@@AEAAXXZ
+        call    ?entry_host@vcpu_t@hvpp@@AEAA_NXZ
 
 ;
-; Restore CPU context
+; AL = 0 if the VCPU has been terminated.
 ; Note that RBX is preserved, because it is non-volatile register
 ;
+        test    al, al
+        jz      terminated
+
+;
+; Restore general purpose registers of the guest (RBX at the end) and
+; resume the guest.  The stack isn't unwound - RSP is set to the top
+; of the VCPU stack (host RSP) on the next VM-exit.
+;
+        mov     rax, context_t.$rax[rbx]
+        mov     rcx, context_t.$rcx[rbx]
+        mov     rdx, context_t.$rdx[rbx]
+        mov     rbp, context_t.$rbp[rbx]
+        mov     rsi, context_t.$rsi[rbx]
+        mov     rdi, context_t.$rdi[rbx]
+        mov     r8 , context_t.$r8 [rbx]
+        mov     r9 , context_t.$r9 [rbx]
+        mov     r10, context_t.$r10[rbx]
+        mov     r11, context_t.$r11[rbx]
+        mov     r12, context_t.$r12[rbx]
+        mov     r13, context_t.$r13[rbx]
+        mov     r14, context_t.$r14[rbx]
+        mov     r15, context_t.$r15[rbx]
+        mov     rbx, context_t.$rbx[rbx]
+        vmresume
+
+;
+; VMRESUME failed - the guest state has been checked by the VM-exit
+; handler, there's no sane way to continue.  Break into the debugger.
+;
+        int     3
+        jmp     $
+
+;
+; VMX-root mode has been left, exit_context_ holds the full context
+; of the guest (including RIP, RSP and RFLAGS) - restore it.
+;
+terminated:
         mov     rcx, rbx
         jmp     ?restore@context_t@ia32@@QEAAXXZ
     ?entry_host_@vcpu_t@hvpp@@CAXXZ ENDP
 
+;++
+;
+; private:
+;   static void __cdecl
+;   hvpp::vcpu_t::entry_host_fast_(void)
+;
+; Routine description:
+;
+;   This is the VM-exit entry point (host RIP).  It handles trivial
+;   VM-exits enabled in the vcpu_fast_path_t of the VCPU using only
+;   the registers, advances guest RIP and resumes the guest directly.
+;   All other VM-exits continue to vcpu_t::entry_host_().
+;
+;   On entry, all general purpose registers hold values of the guest
+;   and RSP points to the top of the VCPU stack.  RAX, RCX and RDX are
+;   temporarily saved on the stack (the space is otherwise used later
+;   by entry_host_() for the dummy machine frame).
+;
+;--
+
+    ?entry_host_fast_@vcpu_t@hvpp@@CAXXZ PROC
+;
+; Fast path is bypassed when other CPUs requested something that has to
+; be processed by vcpu_t::entry_host() (e.g. EPT invalidation).
+;
+        cmp     dword ptr [rsp + VCPU_FAST_PATH_OFFSET + vcpu_fast_path_t.bypass], 0
+        jne     ?entry_host_@vcpu_t@hvpp@@CAXXZ
+
+        push    rax
+        push    rcx
+        push    rdx
+
+    FAST_PATH = VCPU_FAST_PATH_OFFSET + 3 * 8
+
+;
+; EAX = exit reason
+; Upper 16 bits (e.g. VM-entry failure) always go to the full path.
+;
+        mov     ecx, VMCS_VMEXIT_REASON
+        vmread  rax, rcx
+        test    eax, 0FFFF0000h
+        jnz     slow_path
+        cmp     eax, 64
+        ja      slow_path
+        bt      qword ptr [rsp + FAST_PATH + vcpu_fast_path_t.exit_reason_bitmap], rax
+        jnc     slow_path
+
+        cmp     eax, EXIT_REASON_EXECUTE_CPUID
+        je      fast_cpuid
+        cmp     eax, EXIT_REASON_EXECUTE_INVD
+        je      fast_wbinvd
+        cmp     eax, EXIT_REASON_EXECUTE_WBINVD
+        je      fast_wbinvd
+        cmp     eax, EXIT_REASON_EXECUTE_XSETBV
+        je      fast_xsetbv
+        cmp     eax, EXIT_REASON_EXECUTE_RDTSCP
+        je      fast_rdtscp
+        jmp     slow_path
+
+fast_cpuid:
+;
+; RAX = guest RAX (CPUID leaf)
+;
+        mov     rax, qword ptr [rsp + 10h]
+        mov     ecx, eax
+        sub     ecx, 80000000h
+        cmp     eax, 64
+        jb      fast_cpuid_0
+        cmp     ecx, 64
+        jae     slow_path
+        bt      qword ptr [rsp + FAST_PATH + vcpu_fast_path_t.cpuid_8_bitmap], rcx
+        jnc     slow_path
+        jmp     fast_cpuid_execute
+
+fast_cpuid_0:
+        bt      qword ptr [rsp + FAST_PATH + vcpu_fast_path_t.cpuid_0_bitmap], rax
+        jnc     slow_path
+
+fast_cpuid_execute:
+        pop     rdx
+        pop     rcx
+        pop     rax
+        cpuid
+        jmp     advance_rip
+
+;
+; INVD is emulated by WBINVD (see vmexit_passthrough_handler::handle_execute_invd()).
+;
+fast_wbinvd:
+        pop     rdx
+        pop     rcx
+        pop     rax
+        wbinvd
+        jmp     advance_rip
+
+fast_xsetbv:
+        pop     rdx
+        pop     rcx
+        pop     rax
+        xsetbv
+        jmp     advance_rip
+
+;
+; RDTSCP returns the TSC without the offset and multiplier of the guest
+; (see vcpu_t::guest_tsc()).
+;
+fast_rdtscp:
+        cmp     dword ptr [rsp + FAST_PATH + vcpu_fast_path_t.rdtscp_bypass], 0
+        jne     slow_path
+
+        pop     rdx
+        pop     rcx
+        pop     rax
+        rdtscp
+        jmp     advance_rip
+
+;
+; Guest RIP += exit instruction length, then resume the guest.
+;
+advance_rip:
+        push    rax
+        push    rcx
+        push    rdx
+
+        mov     ecx, VMCS_GUEST_RIP
+        vmread  rax, rcx
+        mov     ecx, VMCS_VMEXIT_INSTRUCTION_LENGTH
+        vmread  rdx, rcx
+        add     rax, rdx
+        mov     ecx, VMCS_GUEST_RIP
+        vmwrite rcx, rax
+
+        pop     rdx
+        pop     rcx
+        pop     rax
+        vmresume
+
+;
+; VMRESUME should never fail here - only guest RIP has been changed.
+; Don't try to handle the VM-exit again, break into the debugger instead.
+;
+        int     3
+        jmp     $
+
+slow_path:
+        pop     rdx
+        pop     rcx
+        pop     rax
+        jmp     ?entry_host_@vcpu_t@hvpp@@CAXXZ
+    ?entry_host_fast_@vcpu_t@hvpp@@CAXXZ ENDP
+
 END
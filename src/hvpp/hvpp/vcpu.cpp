@@ -1,67 +1,157 @@
+#define HVPP_LOG_MODULE vcpu
+
 #include "vcpu.h"
 #include "vmexit.h"
 
 #include "lib/assert.h"
 #include "lib/log.h"
 #include "lib/mm.h"
+#include "lib/mp.h"
+#include "lib/steal_time.h"
 
+#include <algorithm>
+#include <cstring>
 #include <iterator> // std::end()
+#include <memory>
 
 #include "vcpu.inl"
 
+namespace hvpp::detail
+{
+  //
+  // Guest pages which might hold cached decoded instructions (see
+  // vcpu_t::decode_cache_invalidate()), hashed into 4096 bits.  Shared
+  // by all VCPUs - a write observed by one VCPU invalidates caches of
+  // all VCPUs.
+  //
+  static constexpr size_t decode_cache_filter_size = 64;
+
+  static std::atomic_uint64_t decode_cache_filter[decode_cache_filter_size];
+  static std::atomic_uint64_t decode_cache_generation{ 1 };
+
+  static auto decode_cache_filter_bit(uint64_t pfn) noexcept -> uint32_t
+  { return static_cast<uint32_t>((pfn * 0x9e3779b97f4a7c15) >> 52); }
+}
+
 namespace hvpp {
 
 //
 // Public
 //
 
-vcpu_t::vcpu_t(vmexit_handler& handler) noexcept
+vcpu_t::vcpu_t(vmexit_handler& handler, mapping_t& guest_mapping) noexcept
   //
-  // Initialize VMXON region and VMCS.
-  //
-  : vmxon_{}
-  , vmcs_{}
-
-  //
-  // This is not really needed.
-  // MSR bitmaps and I/O bitmaps are actually copied here from
-  // user-provided buffers (via msr_bitmap() and io_bitmap() methods)
-  // before they are enabled.
+  // Disable fast path of all VM-exits.
   //
-  // , msr_bitmap_{}
-  // , io_bitmap_{}
+  : fast_path_{}
 
-  , handler_ { handler }
+  , exit_cache_{}
+  , handler_ { &handler }
+  , evmcs_{ nullptr }
 
   //
   // Signalize that this VCPU is turned off.
   //
   , state_{ vcpu_state::off }
+  , cpu_index_{ 0 }
+
+  //
+  // Well, this is also not necessary.
+  // This member is reset to "false" on each VM-exit in entry_host() method.
+  //
+  , suppress_rip_adjust_{ false }
 
   //
   // Let EPT be uninitialized.
   // VM-exit handler is responsible for EPT setup.
   //
+  , ept_switching_{ false }
+  , ve_enabled_{ false }
+  , gva_tlb_persistent_{ false }
+
+  //
+  // No event is being injected.
+  //
+  , event_injected_{ false }
+
   , ept_{ nullptr }
   , ept_count_{ 0 }
   , ept_index_{ 0 }
+  , ept_invalidation_requested_{ 0 }
+  , ept_invalidation_completed_{ 0 }
+  , pml_flush_requested_{ false }
+  , pml_dirty_bitmap_{ nullptr }
+  , io_bitmap_requested_{ nullptr }
+  , handler_requested_{ nullptr }
+  , mailbox_{}
+  , terminate_requested_{ false }
+
+  //
+  // Generation 0 is reserved for invalid entries.
+  //
+  , gva_tlb_generation_{ 1 }
+  , caps_{ vmx::capabilities_t::read() }
+  , vmcs_template_{ nullptr }
+  , host_address_space_{}
+  , vpid_cap_{}
+  , processor_based_controls_{}
+  , pending_interrupt_{}
+  , tsc_offset_{ 0 }
+  , tsc_multiplier_{ tsc_multiplier_unity }
+  , tsc_hide_root_time_{ false }
+  , steal_time_enabled_{ false }
+  , apicv_enabled_{ false }
+  , exit_timing_{ nullptr }
+  , xsave_area_{ nullptr }
+  , xsave_area_buffer_{ nullptr }
 
   //
-  // Initialize pending-interrupt FIFO queue.
+  // Initialize VMXON region and VMCS.
   //
-  , pending_interrupt_first_{ 0 }
-  , pending_interrupt_count_{ 0 }
+  , vmxon_{}
+  , vmcs_{}
 
   //
-  // Well, this is also not necessary.
-  // This member is reset to "false" on each VM-exit in entry_host() method.
+  // This is not really needed.
+  // MSR bitmaps and I/O bitmaps are actually copied here from
+  // user-provided buffers (via msr_bitmap() and io_bitmap() methods)
+  // before they are enabled.
   //
-  , suppress_rip_adjust_{ false }
+  // , msr_bitmap_{}
+  // , io_bitmap_{}
+
+  , msr_bitmap_active_{ &msr_bitmap_ }
+  , io_bitmap_active_{ &io_bitmap_ }
+  , msr_swap_count_{ 0 }
+  , exit_profile_{ nullptr }
+  , guest_mapping_{ guest_mapping }
+  , kernel_cr3_guest_{}
+  , kernel_cr3_{}
+  , kernel_cr3_generation_{ 0 }
+  , root_cr3_{}
+  , root_cr3_generation_{ 0 }
+  , gva_tlb_{}
+  , scratch_{}
+  , decode_cache_{}
+  , dr_lazy_{ false }
+  , dr_released_{ false }
+  , cr0_intercept_{}
+  , cr4_intercept_{}
+  , steal_time_pa_{}
+  , steal_time_ticks_{ 0 }
+  , steal_time_exits_{ 0 }
+  , steal_time_published_tsc_{ 0 }
+  , steal_time_sequence_{ 0 }
+  , vp_assist_{ nullptr }
+  , vp_assist_msr_{ 0 }
+  , vp_assist_owned_{ false }
 {
   //
   // Fill out initial stack with garbage.
   //
-  memset(stack_.data, 0xcc, sizeof(stack_));
+  memset(stack_.data, mm::host_stack_fill, sizeof(stack_));
+
+  fast_path_.vcpu = this;
 
   //
   // Reset guest and exit context.
@@ -72,6 +162,60 @@ vcpu_t::vcpu_t(vmexit_handler& handler) noexcept
   guest_context_.clear();
   exit_context_.clear();
 
+#ifdef HVPP_ENABLE_EXIT_TIMING
+  exit_timing_ = new vcpu_exit_timing_t{};
+  hvpp_assert(exit_timing_ != nullptr);
+#endif
+
+  xstate_allocate();
+
+  scratch_.assign(new uint8_t[HVPP_VCPU_SCRATCH_SIZE], HVPP_VCPU_SCRATCH_SIZE);
+
+#ifdef HVPP_ENLIGHTENED_VMCS
+  //
+  // The constructor runs on the CPU of this VCPU (see hypervisor::start()),
+  // therefore CPUID and the VP assist page MSR describe this CPU.
+  //
+  if (vmx::evmcs_t::is_supported())
+  {
+    evmcs_ = new vmx::evmcs_t{};
+    vp_assist_msr_ = msr::read(vmx::vp_assist_page_t::msr_id);
+
+    if (vp_assist_msr_ & 1)
+    {
+      vp_assist_ = reinterpret_cast<vmx::vp_assist_page_t*>(pa_t{ vp_assist_msr_ & ~(page_size - 1) }.va());
+    }
+    else
+    {
+      vp_assist_ = new vmx::vp_assist_page_t{};
+      vp_assist_owned_ = true;
+    }
+
+    if (evmcs_ && vp_assist_)
+    {
+      //
+      // Neither the fast path (vcpu.asm) nor the VMCS template know
+      // the enlightened VMCS - the full path is taken on every VM-exit.
+      //
+      vmx::evmcs_t::adjust(caps_);
+      fast_path_.bypass.store(1, std::memory_order_relaxed);
+    }
+    else
+    {
+      delete evmcs_;
+      evmcs_ = nullptr;
+
+      if (vp_assist_owned_)
+      {
+        delete vp_assist_;
+      }
+
+      vp_assist_ = nullptr;
+      vp_assist_owned_ = false;
+    }
+  }
+#endif
+
   //
   // Assertions.
   //
@@ -83,14 +227,36 @@ vcpu_t::vcpu_t(vmexit_handler& handler) noexcept
     // in the vcpu.asm file.  If they are ever changed, the static_assert
     // should be hint to fix them in the vcpu.asm as well.
     //
+    // Note that none of them depends on vcpu_stack_size - vcpu.asm
+    // finds the VCPU through vcpu_fast_path_t::vcpu.
+    //
     constexpr intptr_t VCPU_RSP                         =  offsetof(vcpu_t, stack_) + sizeof(vcpu_t::stack_);
-    constexpr intptr_t VCPU_OFFSET                      =  -0x8000;   // -vcpu_stack_size
     constexpr intptr_t VCPU_LAUNCH_CONTEXT_OFFSET       =   0;
     constexpr intptr_t VCPU_EXIT_CONTEXT_OFFSET         =   144;      // sizeof(context);
+    constexpr intptr_t VCPU_FAST_PATH_OFFSET            =   288;      // 2 * sizeof(context);
 
-    static_assert(VCPU_RSP + VCPU_OFFSET                == offsetof(vcpu_t, stack_));
+    static_assert(VCPU_RSP - vcpu_stack_size            == offsetof(vcpu_t, stack_));
+    static_assert(offsetof(vcpu_t, stack_)              == 0);        // see vcpu_t::current()
     static_assert(VCPU_RSP + VCPU_LAUNCH_CONTEXT_OFFSET == offsetof(vcpu_t, guest_context_));
     static_assert(VCPU_RSP + VCPU_EXIT_CONTEXT_OFFSET   == offsetof(vcpu_t, exit_context_));
+    static_assert(VCPU_RSP + VCPU_FAST_PATH_OFFSET      == offsetof(vcpu_t, fast_path_));
+
+    //
+    // Layout of vcpu_fast_path_t is hardcoded in vcpu.asm, too.
+    //
+    static_assert(offsetof(vcpu_fast_path_t, exit_reason_bitmap) ==  0);
+    static_assert(offsetof(vcpu_fast_path_t, cpuid_0_bitmap)     == 16);
+    static_assert(offsetof(vcpu_fast_path_t, cpuid_8_bitmap)     == 24);
+    static_assert(offsetof(vcpu_fast_path_t, bypass)             == 32);
+    static_assert(offsetof(vcpu_fast_path_t, rdtscp_bypass)      == 36);
+    static_assert(offsetof(vcpu_fast_path_t, vcpu)               == 40);
+
+    //
+    // Hot fields (see vcpu_t) must stay in the padding between the fast
+    // path and the first page-aligned VMX structure.
+    //
+    static_assert(offsetof(vcpu_t, xsave_area_buffer_) + sizeof(xsave_area_buffer_)
+                                                                <= offsetof(vcpu_t, vmxon_));
   };
 }
 
@@ -99,23 +265,72 @@ vcpu_t::~vcpu_t() noexcept
   //
   // Signalize that this VCPU is terminating.
   //
+  const bool terminated = state_ == vcpu_state::terminated ||
+                          state_ == vcpu_state::off;
   state_ = vcpu_state::terminating;
 
   //
   // Notify the exit handler that we're about to terminate.
   // Exit handler should invoke VMEXIT in such way, that causes
   // handler to call vcpu_t::terminate(); e.g. VMCALL with specific
-  // index.
+  // index.  If the VCPU has already been terminated (see
+  // hypervisor::stop()) or it has never been launched (see
+  // hypervisor::start()), VMX instructions would raise #UD.
   //
-  handler_.invoke_termination(*this);
+  if (!terminated)
+  {
+    handler_->invoke_termination(*this);
+  }
 
   //
   // Destroy EPT.
   //
   ept_disable();
+
+  delete exit_timing_;
+  delete exit_profile_;
+  delete[] xsave_area_buffer_;
+  delete evmcs_;
+
+  if (vp_assist_owned_)
+  {
+    delete vp_assist_;
+  }
+
+  mm::scratch_arena(cpu_index_, nullptr);
+  mm::host_stack_unregister(&stack_);
+  delete[] static_cast<uint8_t*>(scratch_.buffer());
 }
 
-void vcpu_t::launch() noexcept
+auto vcpu_t::prepare() noexcept -> error_code_t
+{
+  //
+  // Called on the CPU of this VCPU, before launch() (see
+  // hypervisor::start()).
+  //
+  cpu_index_ = mp::cpu_index();
+
+  //
+  // Allocations on the host stack are routed to the custom allocator
+  // implicitly (see mm::host_stack_register()).
+  //
+  if (auto err = mm::host_stack_register(&stack_, sizeof(stack_), cpu_index_))
+  {
+    hvpp_error("Host stack not registered (%i)", err.value());
+    return err;
+  }
+
+  if (scratch_.capacity())
+  {
+    mm::scratch_arena(cpu_index_, &scratch_);
+  }
+
+  handler_->prepare(*this);
+
+  return error_code_t{};
+}
+
+void vcpu_t::launch(vmcs_template_t* vmcs_template /* = nullptr */) noexcept
 {
   //
   // Launch of the VCPU is performed via similar principle as setjmp/longjmp:
@@ -132,6 +347,8 @@ void vcpu_t::launch() noexcept
   switch (static_cast<vcpu_state>(guest_context_.capture()))
   {
     case vcpu_state::off:
+      hvpp_assert(cpu_index_ == mp::cpu_index());
+      vmcs_template_ = vmcs_template;
       setup();
       break;
 
@@ -145,6 +362,24 @@ void vcpu_t::launch() noexcept
   }
 }
 
+void vcpu_t::host_address_space(cr3_t cr3) noexcept
+{
+  hvpp_assert(state_ == vcpu_state::off);
+  host_address_space_ = cr3;
+}
+
+auto vcpu_t::vmcs_field(vmx::vmcs_t::field field) const noexcept -> uint64_t
+{
+  uint64_t result = 0;
+  vmcs_read(field, result);
+  return result;
+}
+
+void vcpu_t::vmcs_field(vmx::vmcs_t::field field, uint64_t value) noexcept
+{
+  vmcs_write(field, value);
+}
+
 void vcpu_t::terminate() noexcept
 {
   hvpp_assert(state_ != vcpu_state::off && state_ != vcpu_state::terminated);
@@ -197,6 +432,21 @@ void vcpu_t::terminate() noexcept
   //
   vmx::invept_all_contexts();
 
+  //
+  // Detach the enlightened VMCS from the VP assist page (and give
+  // the VP assist page MSR back, if the OS didn't use it).
+  //
+  if (evmcs_)
+  {
+    vp_assist_->enlighten_vmentry = 0;
+    vp_assist_->current_nested_vmcs = 0;
+
+    if (vp_assist_owned_)
+    {
+      msr::write(vmx::vp_assist_page_t::msr_id, vp_assist_msr_);
+    }
+  }
+
   //
   // Turn off VMX-root mode on this logical processor.
   //
@@ -222,25 +472,20 @@ void vcpu_t::terminate() noexcept
 
 void vcpu_t::ept_enable(uint16_t count /* = 1 */) noexcept
 {
-  hvpp_assert(ept_ == nullptr && count > 0);
-
-  //
-  // Allocate all EPTs and initialize them.
   //
-  ept_ = new ept_t[count];
-  ept_count_ = count;
-
-  //
-  // Enable EPT.
+  // Allocate all EPTs and initialize them as empty.
   //
-  auto procbased_ctls2 = processor_based_controls2();
-  procbased_ctls2.enable_ept = true;
-  processor_based_controls2(procbased_ctls2);
+  ept_allocate(nullptr, count);
+}
 
+void vcpu_t::ept_enable(const ept_t& base, uint16_t count /* = 1 */) noexcept
+{
   //
-  // Automatically select the first EPT.
+  // Allocate all EPTs and initialize them as copy-on-write views
+  // of the provided (shared) EPT.  Paging structures of the base EPT
+  // are copied only when they're modified by this VCPU.
   //
-  ept_index(0);
+  ept_allocate(&base, count);
 }
 
 void vcpu_t::ept_disable() noexcept
@@ -253,8 +498,11 @@ void vcpu_t::ept_disable() noexcept
   //
   // Destroy EPT.
   //
-  delete[] ept_;
+  std::for_each_n(ept_, ept_count_, [](ept_t& ept_item) { ept_item.~ept_t(); });
+  operator delete[](ept_);
   ept_ = nullptr;
+  ept_count_ = 0;
+  ept_switching_ = false;
 
   //
   // Disable EPT functionality.
@@ -269,6 +517,25 @@ void vcpu_t::ept_disable() noexcept
 
 auto vcpu_t::ept_index() noexcept -> uint16_t
 {
+  //
+  // With EPTP switching enabled, the guest can select another EPT
+  // via VMFUNC without causing VM-exit - find out which EPT is active
+  // from the current EPT pointer.
+  //
+  if (ept_switching_)
+  {
+    const auto current_ept_pointer = ept_pointer();
+
+    for (uint16_t index = 0; index < ept_count_; ++index)
+    {
+      if (eptp_list_.entry[index].flags == current_ept_pointer.flags)
+      {
+        ept_index_ = index;
+        break;
+      }
+    }
+  }
+
   return ept_index_;
 }
 
@@ -277,7 +544,13 @@ void vcpu_t::ept_index(uint16_t index) noexcept
   hvpp_assert(index < ept_count_);
 
   ept_pointer(ept_[index].ept_pointer());
+  ept_[index].loaded();
   ept_index_ = index;
+
+  if (ve_enabled_)
+  {
+    vmcs_write(vmx::vmcs_t::field::ctrl_eptp_index, index);
+  }
 }
 
 auto vcpu_t::ept(uint16_t index /* = 0 */) noexcept -> ept_t&
@@ -287,50 +560,1630 @@ auto vcpu_t::ept(uint16_t index /* = 0 */) noexcept -> ept_t&
   return ept_[index];
 }
 
-auto vcpu_t::exit_context() noexcept -> context_t&
+auto vcpu_t::ept_count() const noexcept -> uint16_t
 {
-  return exit_context_;
+  return ept_count_;
 }
 
-void vcpu_t::suppress_rip_adjust() noexcept
+bool vcpu_t::ept_switching_enabled() const noexcept
 {
-  suppress_rip_adjust_ = true;
+  return ept_switching_;
 }
 
-//
-// Private
-//
+bool vcpu_t::ve_enable() noexcept
+{
+  //
+  // Enable delivery of EPT violations as virtualization exceptions (#VE)
+  // directly to the guest - without VM-exit.  Only EPT violations caused
+  // by entries with cleared "suppress #VE" bit are converted
+  // (see ept_t::ve_enable()), all other EPT violations still cause VM-exit.
+  // The guest must have a #VE (vector 20) handler installed.
+  // (ref: Vol3C[25.5.6(Virtualization Exceptions)])
+  //
+  // Returns false if the CPU doesn't support #VE.
+  //
+  hvpp_assert(ept_ != nullptr);
 
-void vcpu_t::error() noexcept
+  auto procbased_ctls2 = processor_based_controls2();
+  procbased_ctls2.ept_violation_ve = true;
+  processor_based_controls2(procbased_ctls2);
+
+  if (!processor_based_controls2().ept_violation_ve)
+  {
+    return false;
+  }
+
+  memset(&ve_info_, 0, sizeof(ve_info_));
+
+  vmcs_write(vmx::vmcs_t::field::ctrl_virtualization_exception_info_address, pa_t::from_va(&ve_info_));
+  vmcs_write(vmx::vmcs_t::field::ctrl_eptp_index, ept_index_);
+
+  ve_enabled_ = true;
+  return true;
+}
+
+void vcpu_t::ve_disable() noexcept
 {
-  vmx::instruction_error instruction_error = exit_instruction_error();
-  hvpp_error("error: %p (%s)\n", instruction_error, vmx::instruction_error_to_string(instruction_error));
-  ia32_asm_int3();
-  terminate();
+  auto procbased_ctls2 = processor_based_controls2();
+  procbased_ctls2.ept_violation_ve = false;
+  processor_based_controls2(procbased_ctls2);
+
+  ve_enabled_ = false;
 }
 
-void vcpu_t::setup() noexcept
+auto vcpu_t::ve_info() noexcept -> vmx::ve_info_t&
+{
+  return ve_info_;
+}
+
+bool vcpu_t::ept_access_dirty_enable() noexcept
 {
   //
-  // Enter VMX operation, invalidate EPT and VPID, load VMCS,
-  // set VMCS fields, call handler's setup() method, and launch
-  // the VM.  This function should NOT return - the next instruction
-  // after vmlaunch should be at vcpu_t::entry_guest_ (vcpu.asm).
+  // Enable accessed and dirty flags in all EPTs of this VCPU and reload
+  // the current EPT pointer (and the EPTP list).  Required by PML and by
+  // access tracing (see ept_t::access_harvest()).
   //
-  load_vmxon();
-  load_vmcs();
+  // Note that EPT must be already enabled.  Returns false if the CPU
+  // doesn't support accessed and dirty flags for EPT.
+  //
+  hvpp_assert(ept_ != nullptr);
+
+  if (!caps_.ept_vpid_cap.ept_accessed_and_dirty_flags)
+  {
+    return false;
+  }
+
+  std::for_each_n(ept_, ept_count_, [](ept_t& ept_item) { ept_item.access_dirty_enable(); });
+  ept_index(ept_index());
+
+  if (ept_switching_)
+  {
+    for (uint16_t index = 0; index < ept_count_; ++index)
+    {
+      eptp_list_.entry[index] = ept_[index].ept_pointer();
+      ept_[index].loaded();
+    }
+  }
+
+  return true;
+}
+
+bool vcpu_t::pml_enable(bitmap& dirty_bitmap) noexcept
+{
+  //
+  // Enable page-modification logging.  Guest physical addresses of
+  // pages written by the guest are logged by the processor into the PML
+  // buffer.  When the buffer is full, VM-exit occurs and the buffer is
+  // drained into the provided bitmap (one bit per 4kb page) - see
+  // pml_flush().  Dirty flags of the drained pages are cleared, so that
+  // the next write to them is logged again.
+  // (ref: Vol3C[28.2.6(Page-Modification Logging)])
+  //
+  // Note that EPT must be already enabled.  Returns false if the CPU
+  // doesn't support PML.
+  //
+  // Paging structures which translate RAM are made private in all EPT
+  // views of this VCPU - dirty flags in structures shared with other
+  // VCPUs would be set by their writes, which then wouldn't be logged
+  // by this VCPU (nor by them, once this VCPU clears the flag).  Later
+  // changes of the shared EPT don't reach these structures anymore.
+  //
+  hvpp_assert(ept_ != nullptr);
+
+  if (!caps_.ept_vpid_cap.ept_accessed_and_dirty_flags)
+  {
+    return false;
+  }
+
+  auto procbased_ctls2 = processor_based_controls2();
+  procbased_ctls2.enable_pml = true;
+  processor_based_controls2(procbased_ctls2);
+
+  if (!processor_based_controls2().enable_pml)
+  {
+    return false;
+  }
+
+  //
+  // PML requires accessed and dirty flags.
+  //
+  ept_access_dirty_enable();
+
+  for (uint16_t index = 0; index < ept_count_; ++index)
+  {
+    for (const auto& range : mm::physical_memory_descriptor())
+    {
+      ept_[index].unshare_range(range.begin(), range.size());
+    }
+  }
+
+  pml_dirty_bitmap_ = &dirty_bitmap;
+
+  vmcs_write(vmx::vmcs_t::field::ctrl_pml_address, pa_t::from_va(&pml_));
+  vmcs_write(vmx::vmcs_t::field::guest_pml_index, uint16_t(vmx::pml_t::count - 1));
+
+  return true;
+}
+
+void vcpu_t::pml_disable() noexcept
+{
+  if (!pml_dirty_bitmap_)
+  {
+    return;
+  }
+
+  pml_flush();
+
+  auto procbased_ctls2 = processor_based_controls2();
+  procbased_ctls2.enable_pml = false;
+  processor_based_controls2(procbased_ctls2);
+
+  pml_dirty_bitmap_ = nullptr;
+}
+
+void vcpu_t::pml_flush() noexcept
+{
+  //
+  // Drain the PML buffer into the dirty bitmap.
+  // Must be called from VMX-root mode.
+  //
+  if (!pml_dirty_bitmap_)
+  {
+    return;
+  }
+
+  uint16_t pml_index;
+  vmcs_read(vmx::vmcs_t::field::guest_pml_index, pml_index);
+
+  //
+  // The index points to the next free entry (entries are logged from
+  // the last one), or it has wrapped around (0xFFFF) if the buffer
+  // is full.
+  //
+  const uint16_t first = pml_index >= vmx::pml_t::count
+    ? uint16_t(0)
+    : uint16_t(pml_index + 1);
+
+  if (first == vmx::pml_t::count)
+  {
+    return;
+  }
+
+  for (uint16_t index = first; index < vmx::pml_t::count; ++index)
+  {
+    const auto guest_pa = pml_.entry[index];
+
+    decode_cache_invalidate(guest_pa);
+
+    //
+    // The write could have been made through any EPT view of this VCPU
+    // (the view might have been switched since).  Clear the dirty flag
+    // in all of them, so that the next write is logged again.
+    //
+    // The processor logs only the first write through the leaf - with
+    // 2MB (or 1GB) pages, writes to other 4kb pages of the same large
+    // page aren't logged, therefore the whole large page is dirty.
+    //
+    uint64_t leaf_size = page_size;
+
+    for (uint16_t view = 0; view < ept_count_; ++view)
+    {
+      pml level;
+      if (auto entry = ept_[view].ept_leaf(guest_pa, level))
+      {
+        entry->dirty = false;
+
+        if (level != pml::pt)
+        {
+          leaf_size = std::max(leaf_size, level == pml::pd
+            ? uint64_t(ept_pd_t::size)
+            : uint64_t(ept_pdpt_t::size));
+        }
+      }
+    }
+
+    const auto first_page  = static_cast<int>((guest_pa.value() & ~(leaf_size - 1)) >> page_shift);
+    const auto page_count  = static_cast<int>(leaf_size >> page_shift);
+    const auto bitmap_size = pml_dirty_bitmap_->size_in_bits();
+
+    if (first_page < bitmap_size)
+    {
+      pml_dirty_bitmap_->set(first_page, std::min(page_count, bitmap_size - first_page));
+    }
+  }
+
+  vmcs_write(vmx::vmcs_t::field::guest_pml_index, uint16_t(vmx::pml_t::count - 1));
+
+  //
+  // Cached translations keep the dirty flag set - the processor
+  // wouldn't set it (and log the page) again otherwise.
+  //
+  for (uint16_t view = 0; view < ept_count_; ++view)
+  {
+    ept_[view].modified(ept_t::modification::restrict);
+    ept_[view].flush_if_needed();
+  }
+}
+
+void vcpu_t::pml_flush_post() noexcept
+{
+  //
+  // Request draining of the PML buffer on the next VM-exit of this VCPU.
+  // This method can be called from any CPU.
+  //
+  pml_flush_requested_.store(true, std::memory_order_release);
+
+  //
+  // Make sure the next VM-exit isn't handled by the fast path.
+  //
+  fast_path_.bypass.store(1, std::memory_order_seq_cst);
+}
+
+bool vcpu_t::vmcs_shadowing_enable() noexcept
+{
+  //
+  // The shadow VMCS must have the shadow-VMCS indicator set and it must
+  // be cleared before it's made current for the first time.
+  // (ref: Vol3C[24.10(VMCS Types: Ordinary and Shadow)])
+  //
+  msr::vmx_procbased_ctls2_t allowed_procbased_ctls2{};
+  allowed_procbased_ctls2.flags = caps_.procbased_ctls2.allowed_1_settings;
+
+  if (!allowed_procbased_ctls2.vmcs_shadowing)
+  {
+    return false;
+  }
+
+  shadow_vmcs_.revision_id = caps_.basic.vmcs_revision_id | vmx::vmcs_t::shadow_vmcs_indicator;
+
+  if (vmx::vmclear(pa_t::from_va(&shadow_vmcs_)) != vmx::error_code::success)
+  {
+    return false;
+  }
+
+  vmread_bitmap_.set_all();
+  vmwrite_bitmap_.set_all();
+
+  vmcs_write(vmx::vmcs_t::field::ctrl_vmread_bitmap_address, pa_t::from_va(&vmread_bitmap_));
+  vmcs_write(vmx::vmcs_t::field::ctrl_vmwrite_bitmap_address, pa_t::from_va(&vmwrite_bitmap_));
+
+  auto procbased_ctls2 = processor_based_controls2();
+  procbased_ctls2.vmcs_shadowing = true;
+  processor_based_controls2(procbased_ctls2);
+
+  return true;
+}
+
+void vcpu_t::vmcs_shadowing_disable() noexcept
+{
+  shadow_vmcs_link(false);
+
+  auto procbased_ctls2 = processor_based_controls2();
+  procbased_ctls2.vmcs_shadowing = false;
+  processor_based_controls2(procbased_ctls2);
+}
+
+bool vcpu_t::vmcs_shadowing_enabled() noexcept
+{
+  return processor_based_controls2().vmcs_shadowing;
+}
+
+auto vcpu_t::vmread_bitmap() noexcept -> vmx::vmcs_bitmap_t&
+{
+  return vmread_bitmap_;
+}
+
+auto vcpu_t::vmwrite_bitmap() noexcept -> vmx::vmcs_bitmap_t&
+{
+  return vmwrite_bitmap_;
+}
+
+void vcpu_t::shadow_vmcs_link(bool link) noexcept
+{
+  //
+  // With VMCS link pointer ~0, the guest VMREAD/VMWRITE which doesn't
+  // exit fails with VMfailInvalid - as if there was no current VMCS.
+  //
+  vmcs_link_pointer(link ? pa_t::from_va(&shadow_vmcs_) : pa_t{ ~0ull });
+}
+
+bool vcpu_t::shadow_vmcs_read(const vmx::vmcs_t::field* fields, uint64_t* values, size_t count) noexcept
+{
+  bool result = true;
+
+  vmx::vmptrld(pa_t::from_va(&shadow_vmcs_));
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    values[i] = 0;
+    result &= vmx::vmread(fields[i], values[i]) == vmx::error_code::success;
+  }
+
+  vmx::vmptrld(pa_t::from_va(&vmcs_));
+  return result;
+}
+
+bool vcpu_t::shadow_vmcs_write(const vmx::vmcs_t::field* fields, const uint64_t* values, size_t count) noexcept
+{
+  bool result = true;
+
+  vmx::vmptrld(pa_t::from_va(&shadow_vmcs_));
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    result &= vmx::vmwrite(fields[i], values[i]) == vmx::error_code::success;
+  }
+
+  vmx::vmptrld(pa_t::from_va(&vmcs_));
+  return result;
+}
+
+void vcpu_t::io_bitmap_share_post(const vmx::io_bitmap_t& io_bitmap) noexcept
+{
+  io_bitmap_requested_.store(&io_bitmap, std::memory_order_release);
+
+  //
+  // Make sure the next VM-exit isn't handled by the fast path.
+  //
+  fast_path_.bypass.store(1, std::memory_order_seq_cst);
+}
+
+bool vcpu_t::io_bitmap_share_pending() const noexcept
+{
+  return io_bitmap_requested_.load(std::memory_order_acquire) != nullptr;
+}
+
+auto vcpu_t::handler() const noexcept -> vmexit_handler&
+{
+  return *handler_;
+}
+
+void vcpu_t::handler_swap_post(vmexit_handler& handler) noexcept
+{
+  handler_requested_.store(&handler, std::memory_order_release);
+
+  //
+  // Make sure the next VM-exit isn't handled by the fast path.
+  //
+  fast_path_.bypass.store(1, std::memory_order_seq_cst);
+}
+
+bool vcpu_t::handler_swap_pending() const noexcept
+{
+  return handler_requested_.load(std::memory_order_acquire) != nullptr;
+}
+
+bool vcpu_t::command_post(const vcpu_command_t& command) noexcept
+{
+  if (!mailbox_.post(command))
+  {
+    return false;
+  }
+
+  //
+  // Make sure the next VM-exit isn't handled by the fast path.
+  //
+  fast_path_.bypass.store(1, std::memory_order_seq_cst);
+  return true;
+}
+
+auto vcpu_t::command_dropped_count() const noexcept -> uint64_t
+{
+  return mailbox_.dropped_count();
+}
+
+void vcpu_t::command_process(const vcpu_command_t& command) noexcept
+{
+  switch (command.type)
+  {
+    case vcpu_command_type::ept_map_4kb:
+      if (command.arg[0] < ept_count_)
+      {
+        const auto guest_pa = pa_t{ command.arg[1] };
+        const auto host_pa  = pa_t{ command.arg[2] & ~uint64_t(page_size - 1) };
+        const auto access   = static_cast<epte_t::access_type>(command.arg[2] & uint64_t(epte_t::access_type::access_mask));
+
+        //
+        // The transaction invalidates the EPT (if needed) when it's
+        // committed.
+        //
+        ept_t::transaction transaction{ ept_[command.arg[0]] };
+        transaction.split_1gb_to_2mb(guest_pa & ept_pdpt_t::mask, guest_pa & ept_pdpt_t::mask);
+        transaction.split_2mb_to_4kb(guest_pa & ept_pd_t::mask, guest_pa & ept_pd_t::mask);
+        transaction.map_4kb(guest_pa, host_pa, access);
+      }
+      break;
+
+    case vcpu_command_type::ept_invalidate:
+      if (command.arg[0] == vcpu_command_t::ept_all)
+      {
+        vmx::invept_all_contexts();
+      }
+      else if (command.arg[0] < ept_count_)
+      {
+        vmx::invept_single_context(ept_[command.arg[0]].ept_pointer());
+      }
+      break;
+
+    case vcpu_command_type::terminate:
+      //
+      // The VCPU can be terminated only after an instruction has been
+      // emulated (see entry_host()).
+      //
+      terminate_requested_ = true;
+      break;
+
+    default:
+      handler_->handle_command(*this, command);
+      break;
+  }
+}
+
+auto vcpu_t::msr_swap_add(uint32_t msr_id, uint64_t guest_value) noexcept -> error_code_t
+{
+  for (uint16_t index = 0; index < msr_swap_count_; ++index)
+  {
+    if (msr_guest_area_.entry[index].msr_id == msr_id)
+    {
+      return make_error_code_t(std::errc::invalid_argument);
+    }
+  }
+
+  //
+  // Recommended maximum number of MSRs in each area is 512 * (N + 1),
+  // where N is the "max_number_of_msr" field of IA32_VMX_MISC - one page
+  // of entries is always within the limit.
+  //
+  if (msr_swap_count_ == vmx::msr_area_t::count)
+  {
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  msr_guest_area_.entry[msr_swap_count_] = { msr_id, 0, guest_value };
+  msr_host_area_ .entry[msr_swap_count_] = { msr_id, 0, msr::read(msr_id) };
+  ++msr_swap_count_;
+
+  //
+  // The VM-entry MSR-load area and the VM-exit MSR-store area are the
+  // same - the value stored on VM-exit is loaded back on VM-entry.
+  //
+  vmcs_write(vmx::vmcs_t::field::ctrl_vmentry_msr_load_address, pa_t::from_va(msr_guest_area_.entry));
+  vmcs_write(vmx::vmcs_t::field::ctrl_vmexit_msr_store_address, pa_t::from_va(msr_guest_area_.entry));
+  vmcs_write(vmx::vmcs_t::field::ctrl_vmexit_msr_load_address,  pa_t::from_va(msr_host_area_.entry));
+
+  vmcs_write(vmx::vmcs_t::field::ctrl_vmentry_msr_load_count, uint32_t(msr_swap_count_));
+  vmcs_write(vmx::vmcs_t::field::ctrl_vmexit_msr_store_count, uint32_t(msr_swap_count_));
+  vmcs_write(vmx::vmcs_t::field::ctrl_vmexit_msr_load_count,  uint32_t(msr_swap_count_));
+
+  return error_code_t{};
+}
+
+void vcpu_t::msr_swap_remove(uint32_t msr_id) noexcept
+{
+  for (uint16_t index = 0; index < msr_swap_count_; ++index)
+  {
+    if (msr_guest_area_.entry[index].msr_id == msr_id)
+    {
+      //
+      // The MSR isn't swapped anymore - from now on, it holds the last
+      // guest value in both the guest and the host.
+      //
+      const auto guest_value = msr_guest_area_.entry[index].value;
+
+      --msr_swap_count_;
+      msr_guest_area_.entry[index] = msr_guest_area_.entry[msr_swap_count_];
+      msr_host_area_ .entry[index] = msr_host_area_ .entry[msr_swap_count_];
+
+      vmcs_write(vmx::vmcs_t::field::ctrl_vmentry_msr_load_count, uint32_t(msr_swap_count_));
+      vmcs_write(vmx::vmcs_t::field::ctrl_vmexit_msr_store_count, uint32_t(msr_swap_count_));
+      vmcs_write(vmx::vmcs_t::field::ctrl_vmexit_msr_load_count,  uint32_t(msr_swap_count_));
+
+      msr::write(msr_id, guest_value);
+      break;
+    }
+  }
+}
+
+auto vcpu_t::msr_swap_guest_value(uint32_t msr_id) const noexcept -> uint64_t
+{
+  for (uint16_t index = 0; index < msr_swap_count_; ++index)
+  {
+    if (msr_guest_area_.entry[index].msr_id == msr_id)
+    {
+      return msr_guest_area_.entry[index].value;
+    }
+  }
+
+  hvpp_assert(0);
+  return 0;
+}
+
+void vcpu_t::msr_swap_guest_value(uint32_t msr_id, uint64_t guest_value) noexcept
+{
+  for (uint16_t index = 0; index < msr_swap_count_; ++index)
+  {
+    if (msr_guest_area_.entry[index].msr_id == msr_id)
+    {
+      msr_guest_area_.entry[index].value = guest_value;
+      return;
+    }
+  }
+
+  hvpp_assert(0);
+}
+
+void vcpu_t::efer_load_enable() noexcept
+{
+  const auto efer = msr::read<msr::efer_t>();
+  guest_efer(efer);
+  host_efer(efer);
+
+  auto entry_ctls = vm_entry_controls();
+  entry_ctls.load_ia32_efer = true;
+  vm_entry_controls(entry_ctls);
+
+  auto exit_ctls = vm_exit_controls();
+  exit_ctls.load_ia32_efer = true;
+  vm_exit_controls(exit_ctls);
+}
+
+auto vcpu_t::tsc_offset() const noexcept -> int64_t
+{
+  return tsc_offset_;
+}
+
+void vcpu_t::tsc_offset(int64_t offset) noexcept
+{
+  tsc_offset_ = offset;
+  vmcs_write(vmx::vmcs_t::field::ctrl_tsc_offset, tsc_offset_);
+
+  if (!processor_based_controls_.use_tsc_offsetting)
+  {
+    auto procbased_ctls = processor_based_controls_;
+    procbased_ctls.use_tsc_offsetting = true;
+    processor_based_controls(procbased_ctls);
+  }
+
+  tsc_fast_path_update();
+}
+
+auto vcpu_t::tsc_multiplier() const noexcept -> uint64_t
+{
+  return tsc_multiplier_;
+}
+
+auto vcpu_t::tsc_multiplier(uint64_t multiplier) noexcept -> error_code_t
+{
+  if (multiplier == 0)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  //
+  // TSC scaling applies only when TSC offsetting is enabled as well.
+  //
+  auto procbased_ctls2 = processor_based_controls2();
+
+  if (!procbased_ctls2.use_tsc_scaling)
+  {
+    procbased_ctls2.use_tsc_scaling = true;
+    processor_based_controls2(procbased_ctls2);
+
+    if (!processor_based_controls2().use_tsc_scaling)
+    {
+      return make_error_code_t(std::errc::not_supported);
+    }
+  }
+
+  tsc_multiplier_ = multiplier;
+  vmcs_write(vmx::vmcs_t::field::ctrl_tsc_multiplier, tsc_multiplier_);
+
+  if (!processor_based_controls_.use_tsc_offsetting)
+  {
+    tsc_offset(tsc_offset_);
+  }
+
+  tsc_fast_path_update();
+
+  return error_code_t{};
+}
+
+auto vcpu_t::steal_time_enable(pa_t pa) noexcept -> error_code_t
+{
+  if (!pa || byte_offset(pa.value()) + sizeof(steal_time::record_t) > page_size)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  steal_time_pa_ = pa;
+  steal_time_ticks_ = 0;
+  steal_time_exits_ = 0;
+  steal_time_sequence_ = 0;
+
+  //
+  // Publish the empty record right away.
+  //
+  steal_time_enabled_ = true;
+  steal_time_publish(ia32_asm_read_tsc());
+
+  return error_code_t{};
+}
+
+void vcpu_t::steal_time_disable() noexcept
+{
+  steal_time_enabled_ = false;
+  steal_time_pa_ = pa_t{};
+}
+
+auto vcpu_t::steal_time() const noexcept -> uint64_t
+{
+  return steal_time_ticks_;
+}
+
+void vcpu_t::steal_time_publish(uint64_t now) noexcept
+{
+  //
+  // The sequence is odd while the record is updated (see steal_time.h).
+  //
+  auto record = reinterpret_cast<volatile steal_time::record_t*>(
+    guest_mapping_.map(steal_time_pa_, sizeof(steal_time::record_t)));
+
+  record->sequence = ++steal_time_sequence_;
+  std::atomic_thread_fence(std::memory_order_release);
+
+  record->cpu_index  = cpu_index_;
+  record->root_ticks = steal_time_ticks_;
+  record->exit_count = steal_time_exits_;
+  record->timestamp  = now;
+
+  std::atomic_thread_fence(std::memory_order_release);
+  record->sequence = ++steal_time_sequence_;
+
+  guest_mapping_.unmap();
+  steal_time_published_tsc_ = now;
+}
+
+void vcpu_t::tsc_hide_root_time(bool enable) noexcept
+{
+  tsc_hide_root_time_ = enable;
+
+  if (enable && !processor_based_controls_.use_tsc_offsetting)
+  {
+    tsc_offset(tsc_offset_);
+  }
+
+  tsc_fast_path_update();
+}
+
+void vcpu_t::tsc_fast_path_update() noexcept
+{
+  //
+  // The fast path of RDTSCP in vcpu.asm returns the raw TSC - it can be
+  // used only while guest_tsc() doesn't change it.  The offset changes
+  // on each VM-exit while the VMX-root time is hidden.
+  //
+  fast_path_.rdtscp_bypass = (tsc_offset_ != 0 ||
+                               tsc_multiplier_ != tsc_multiplier_unity ||
+                               tsc_hide_root_time_) ? 1 : 0;
+}
+
+void vcpu_t::cr0_intercept(cr0_t bits, bool enable /* = true */) noexcept
+{
+  if (enable)
+  {
+    cr0_intercept_.flags |= bits.flags;
+  }
+  else
+  {
+    cr0_intercept_.flags &= ~bits.flags;
+  }
+
+  //
+  // Bits fixed to 0 or 1 in the VMX operation are always owned.
+  //
+  const auto mask  = cr0_intercept_.flags | caps_.cr0_fixed0.flags | ~caps_.cr0_fixed1.flags;
+  const auto added = mask & ~cr0_guest_host_mask().flags;
+
+  auto shadow = cr0_shadow();
+  shadow.flags = (shadow.flags & ~added) | (guest_cr0().flags & added);
+
+  cr0_shadow(shadow);
+  cr0_guest_host_mask(cr0_t{ mask });
+}
+
+void vcpu_t::cr4_intercept(cr4_t bits, bool enable /* = true */) noexcept
+{
+  if (enable)
+  {
+    cr4_intercept_.flags |= bits.flags;
+  }
+  else
+  {
+    cr4_intercept_.flags &= ~bits.flags;
+  }
+
+  const auto mask  = cr4_intercept_.flags | caps_.cr4_fixed0.flags | ~caps_.cr4_fixed1.flags;
+  const auto added = mask & ~cr4_guest_host_mask().flags;
+
+  auto shadow = cr4_shadow();
+  shadow.flags = (shadow.flags & ~added) | (guest_cr4().flags & added);
+  shadow.vmx_enable = false;
+
+  cr4_shadow(shadow);
+  cr4_guest_host_mask(cr4_t{ mask });
+}
+
+auto vcpu_t::cr0_intercepted() const noexcept -> cr0_t
+{
+  return cr0_intercept_;
+}
+
+auto vcpu_t::cr4_intercepted() const noexcept -> cr4_t
+{
+  return cr4_intercept_;
+}
+
+void vcpu_t::dr_lazy(bool enable) noexcept
+{
+  dr_lazy_ = enable;
+
+  if (!enable)
+  {
+    dr_reclaim();
+  }
+}
+
+bool vcpu_t::dr_lazy() const noexcept
+{
+  return dr_lazy_;
+}
+
+bool vcpu_t::dr_released() const noexcept
+{
+  return dr_released_;
+}
+
+void vcpu_t::dr_release() noexcept
+{
+  if (dr_released_ || !processor_based_controls_.mov_dr_exiting)
+  {
+    return;
+  }
+
+  auto procbased_ctls = processor_based_controls();
+  procbased_ctls.mov_dr_exiting = false;
+  processor_based_controls(procbased_ctls);
+
+  dr_released_ = true;
+}
+
+void vcpu_t::dr_reclaim() noexcept
+{
+  if (!dr_released_)
+  {
+    return;
+  }
+
+  auto procbased_ctls = processor_based_controls();
+  procbased_ctls.mov_dr_exiting = true;
+  processor_based_controls(procbased_ctls);
+
+  dr_released_ = false;
+}
+
+auto vcpu_t::guest_tsc(uint64_t tsc) const noexcept -> uint64_t
+{
+  if (!processor_based_controls_.use_tsc_offsetting)
+  {
+    return tsc;
+  }
+
+  if (tsc_multiplier_ != tsc_multiplier_unity)
+  {
+    uint64_t high;
+    const uint64_t low = ia32_asm_mul128(tsc, tsc_multiplier_, &high);
+    tsc = (high << 16) | (low >> 48);
+  }
+
+  return tsc + tsc_offset_;
+}
+
+auto vcpu_t::apicv_enable(uint8_t notification_vector) noexcept -> error_code_t
+{
+  //
+  // Virtual-interrupt delivery requires TPR shadow and external-interrupt
+  // exiting, posted-interrupt processing additionally requires
+  // acknowledge-interrupt-on-exit.
+  // (ref: Vol3C[26.2.1.1(VM-Execution Control Fields)])
+  //
+  auto pin_based_ctls = pin_based_controls();
+  pin_based_ctls.external_interrupt_exiting = true;
+  pin_based_ctls.process_posted_interrupts = true;
+
+  auto procbased_ctls = processor_based_controls();
+  procbased_ctls.use_tpr_shadow = true;
+
+  //
+  // The guest's EOI has to clear the in-service vector of the virtual
+  // APIC - otherwise no lower-priority virtual interrupt would ever be
+  // delivered again.  EOIs (and TPR writes) are virtualized only if they
+  // don't reach the physical APIC: WRMSR to the x2APIC MSRs with "virtualize
+  // x2APIC mode" (and MSR bitmaps which don't intercept them).  EOIs of
+  // the xAPIC are MMIO writes - their virtualization would require the
+  // APIC-access page and emulation of all other xAPIC accesses, which
+  // isn't supported.
+  // (ref: Vol3C[29.5(Virtualizing MSR-Based APIC Accesses)])
+  //
+  if (!msr::read<msr::apic_base_t>().enable_x2apic_mode ||
+      !processor_based_controls().use_msr_bitmaps)
+  {
+    return make_error_code_t(std::errc::not_supported);
+  }
+
+  static constexpr uint32_t x2apic_virtualized_msr[] = {
+    0x808,    // TPR
+    0x80b,    // EOI
+    0x83f,    // SELF IPI
+  };
+
+  for (const auto msr_id : x2apic_virtualized_msr)
+  {
+    if (msr_bitmap_active_->wrmsr_low[msr_id / 8] & (1 << (msr_id % 8)))
+    {
+      return make_error_code_t(std::errc::not_supported);
+    }
+  }
+
+  auto procbased_ctls2 = processor_based_controls2();
+  procbased_ctls2.virtual_interrupt_delivery = true;
+  procbased_ctls2.virtualize_x2apic_mode = true;
+
+  auto exit_ctls = vm_exit_controls();
+  exit_ctls.acknowledge_interrupt_on_exit = true;
+
+  if (!vmx::adjust(pin_based_ctls, caps_).process_posted_interrupts ||
+      !vmx::adjust(procbased_ctls, caps_).use_tpr_shadow ||
+      !vmx::adjust(procbased_ctls2, caps_).virtual_interrupt_delivery ||
+      !vmx::adjust(procbased_ctls2, caps_).virtualize_x2apic_mode ||
+      !vmx::adjust(exit_ctls, caps_).acknowledge_interrupt_on_exit)
+  {
+    return make_error_code_t(std::errc::not_supported);
+  }
+
+  //
+  // Start with the current TPR (CR8 holds TPR[7:4]).
+  //
+  memset(&virtual_apic_, 0, sizeof(virtual_apic_));
+  virtual_apic_.tpr() = static_cast<uint32_t>(ia32_asm_read_cr8() << 4);
+
+  memset(&posted_interrupt_, 0, sizeof(posted_interrupt_));
+
+  vmcs_write(vmx::vmcs_t::field::ctrl_virtual_apic_address, pa_t::from_va(&virtual_apic_));
+  vmcs_write(vmx::vmcs_t::field::ctrl_tpr_threshold, uint32_t(0));
+  vmcs_write(vmx::vmcs_t::field::ctrl_posted_interrupt_descriptor_address, pa_t::from_va(&posted_interrupt_));
+  vmcs_write(vmx::vmcs_t::field::ctrl_posted_interrupt_notification_vector, uint16_t(notification_vector));
+  vmcs_write(vmx::vmcs_t::field::ctrl_eoi_exit_bitmap_0, uint64_t(0));
+  vmcs_write(vmx::vmcs_t::field::ctrl_eoi_exit_bitmap_1, uint64_t(0));
+  vmcs_write(vmx::vmcs_t::field::ctrl_eoi_exit_bitmap_2, uint64_t(0));
+  vmcs_write(vmx::vmcs_t::field::ctrl_eoi_exit_bitmap_3, uint64_t(0));
+  vmcs_write(vmx::vmcs_t::field::guest_interrupt_status, uint16_t(0));
+
+  pin_based_controls(pin_based_ctls);
+  processor_based_controls(procbased_ctls);
+  processor_based_controls2(procbased_ctls2);
+  vm_exit_controls(exit_ctls);
+
+  apicv_enabled_ = true;
+
+  return error_code_t{};
+}
+
+bool vcpu_t::apicv_is_enabled() const noexcept
+{
+  //
+  // Don't rely on "use TPR shadow" - it can be set without the rest of
+  // APIC virtualization.
+  //
+  return apicv_enabled_;
+}
+
+auto vcpu_t::virtual_apic() noexcept -> vmx::virtual_apic_t&
+{
+  return virtual_apic_;
+}
+
+void vcpu_t::apicv_request(uint8_t vector) noexcept
+{
+  hvpp_assert(apicv_is_enabled());
+
+  virtual_apic_.irr(vector) |= 1u << (vector % 32);
+
+  //
+  // Guest interrupt status - RVI in bits 7:0, SVI in bits 15:8.
+  //
+  uint16_t interrupt_status;
+  vmcs_read(vmx::vmcs_t::field::guest_interrupt_status, interrupt_status);
+
+  if (vector > (interrupt_status & 0xff))
+  {
+    interrupt_status = (interrupt_status & 0xff00) | vector;
+    vmcs_write(vmx::vmcs_t::field::guest_interrupt_status, interrupt_status);
+  }
+}
+
+bool vcpu_t::posted_interrupt_post(uint8_t vector) noexcept
+{
+  ia32_asm_interlocked_bts(&posted_interrupt_.pir[vector / 64], vector % 64);
+  return !ia32_asm_interlocked_bts(&posted_interrupt_.flags, 0);
+}
+
+auto vcpu_t::pause_loop_exiting(uint32_t gap, uint32_t window) noexcept -> error_code_t
+{
+  auto procbased_ctls2 = processor_based_controls2();
+  procbased_ctls2.pause_loop_exiting = window != 0;
+
+  if (procbased_ctls2.pause_loop_exiting &&
+      !vmx::adjust(procbased_ctls2, caps_).pause_loop_exiting)
+  {
+    return make_error_code_t(std::errc::not_supported);
+  }
+
+  vmcs_write(vmx::vmcs_t::field::ctrl_ple_gap, gap);
+  vmcs_write(vmx::vmcs_t::field::ctrl_ple_window, window);
+
+  processor_based_controls2(procbased_ctls2);
+  return error_code_t{};
+}
+
+auto vcpu_t::pause_loop_gap() const noexcept -> uint32_t
+{
+  uint32_t gap;
+  vmcs_read(vmx::vmcs_t::field::ctrl_ple_gap, gap);
+  return gap;
+}
+
+auto vcpu_t::pause_loop_window() const noexcept -> uint32_t
+{
+  uint32_t window;
+  vmcs_read(vmx::vmcs_t::field::ctrl_ple_window, window);
+  return window;
+}
+
+void vcpu_t::pause_loop_window(uint32_t window) noexcept
+{
+  vmcs_write(vmx::vmcs_t::field::ctrl_ple_window, window);
+}
+
+void vcpu_t::vpid_invalidate() noexcept
+{
+  if (vpid_cap_.invvpid_single_context)
+  {
+    vmx::invvpid_single_context(vcpu_id());
+  }
+  else if (vpid_cap_.invvpid_all_contexts)
+  {
+    vmx::invvpid_all_contexts();
+  }
+}
+
+void vcpu_t::vpid_invalidate(va_t va) noexcept
+{
+  if (vpid_cap_.invvpid_individual_address)
+  {
+    vmx::invvpid_individual_address(vcpu_id(), va.value());
+  }
+  else
+  {
+    vpid_invalidate();
+  }
+}
+
+void vcpu_t::vpid_invalidate_retaining_globals() noexcept
+{
+  if (vpid_cap_.invvpid_single_context_retain_globals)
+  {
+    vmx::invvpid_single_context_retaining_globals(vcpu_id());
+  }
+  else
+  {
+    vpid_invalidate();
+  }
+}
+
+auto vcpu_t::exit_timing() const noexcept -> const vcpu_exit_timing_t*
+{
+  //
+  // Note that histograms are updated by this VCPU without any
+  // synchronization - readers on other CPUs might see slightly
+  // outdated values.
+  //
+  return exit_timing_;
+}
+
+bool vcpu_t::exit_profiling_enable(uint64_t threshold, uint32_t lbr_depth /* = 16 */) noexcept
+{
+  //
+  // Sample every VM-exit whose handler takes at least "threshold"
+  // TSC ticks.  Requires HVPP_ENABLE_EXIT_TIMING.
+  //
+  // Depth of the LBR stack is model-specific and it can't be safely
+  // probed (access to non-existent LBR MSR raises #GP), therefore it
+  // has to be provided by the caller (e.g. 16 for Nehalem - Broadwell,
+  // 32 for Skylake and newer).
+  //
+  // While the profiling is enabled, LBRs are turned on in VMX-root
+  // mode on each VM-exit.  This doesn't affect the guest - its
+  // IA32_DEBUGCTL is saved on VM-exit and loaded on VM-entry.
+  //
+#ifdef HVPP_ENABLE_EXIT_TIMING
+  if (!exit_profile_)
+  {
+    exit_profile_ = new vcpu_exit_profile_t{};
+
+    if (!exit_profile_)
+    {
+      return false;
+    }
+  }
+
+  exit_profile_->threshold = threshold;
+  exit_profile_->lbr_depth = std::min(lbr_depth, uint32_t(vcpu_exit_sample_t::lbr_count));
+  return true;
+#else
+  (void)(threshold);
+  (void)(lbr_depth);
+  return false;
+#endif
+}
+
+void vcpu_t::exit_profiling_disable() noexcept
+{
+  delete exit_profile_;
+  exit_profile_ = nullptr;
+}
+
+auto vcpu_t::exit_profile() const noexcept -> const vcpu_exit_profile_t*
+{
+  return exit_profile_;
+}
+
+void vcpu_t::ept_invalidate_post() noexcept
+{
+  //
+  // Request invalidation of EPT-derived mappings on this VCPU.
+  // This method can be called from any CPU - it doesn't wait for
+  // the invalidation to happen.  The request is picked up on the
+  // very next VM-exit of this VCPU (see entry_host()).
+  //
+  // Note that multiple requests which arrive before the next VM-exit
+  // are satisfied by single INVEPT.
+  //
+  ept_invalidation_requested_.fetch_add(1, std::memory_order_release);
+
+  //
+  // Make sure the next VM-exit isn't handled by the fast path.
+  //
+  fast_path_.bypass.store(1, std::memory_order_seq_cst);
+}
+
+auto vcpu_t::gva_to_gpa(va_t va) noexcept -> pa_t
+{
+  return gva_to_gpa(va, guest_cr3());
+}
+
+auto vcpu_t::gva_to_gpa(va_t va, cr3_t cr3) noexcept -> pa_t
+{
+  const auto entry = gva_tlb_lookup(va, cr3);
+
+  return entry
+    ? pa_t::from_pfn(entry->pa_pfn) + pa_t{ byte_offset(va.value()) }
+    : pa_t{};
+}
+
+auto vcpu_t::guest_accessible(va_t va, size_t size, bool write) noexcept -> size_t
+{
+  const auto cr3 = guest_cr3();
+  const bool user = guest_segment_access(context_t::seg_ss).descriptor_privilege_level == 3;
+  const bool check_write = write && (user || guest_cr0().write_protect);
+
+  size_t result = 0;
+
+  while (result < size)
+  {
+    const auto entry = gva_tlb_lookup(va, cr3);
+
+    if (!entry ||
+        (user && !entry->user) ||
+        (check_write && !entry->write))
+    {
+      break;
+    }
+
+    const size_t bytes = std::min(size - result, page_size - byte_offset(va.value()));
+
+    va += va_t{ bytes };
+    result += bytes;
+  }
+
+  return result;
+}
+
+auto vcpu_t::gva_tlb_lookup(va_t va, cr3_t cr3) noexcept -> const vcpu_gva_tlb_t::entry_t*
+{
+  cr3.pcid_invalidate = false;
+
+  const auto va_pfn = va.value() >> page_shift;
+  auto& entry = gva_tlb_.entry[va_pfn % vcpu_gva_tlb_t::entry_count];
+
+  if (entry.generation == gva_tlb_generation_ &&
+      entry.cr3 == cr3.flags &&
+      entry.va_pfn == va_pfn)
+  {
+    return &entry;
+  }
+
+  //
+  // Walk the guest page tables.  Note that the walk goes through
+  // physical addresses of the paging structures, therefore it doesn't
+  // need to switch into the guest address space (see cr3_guard).
+  //
+  // Large pages are cached as the 4kb page which contains the address
+  // (note that the lowest bit of the PFN of the large page is the PAT
+  // bit).
+  //
+  uint64_t pfn = cr3.page_frame_number;
+  uint64_t pa_pfn = 0;
+  uint64_t page_count = 1;
+  uint32_t write = 1;
+  uint32_t user = 1;
+
+  for (auto level : { pml::pml4, pml::pdpt, pml::pd, pml::pt })
+  {
+    const auto pe = reinterpret_cast<pe_t*>(pa_t::from_pfn(pfn).va())[va.index(level)];
+
+    if (!pe.present)
+    {
+      return nullptr;
+    }
+
+    write &= pe.write;
+    user  &= pe.supervisor;
+
+    if (level == pml::pt ||
+       (level != pml::pml4 && pe.large_page))
+    {
+      page_count = 1ull << (static_cast<uint8_t>(level) * 9);
+      pa_pfn = (pe.page_frame_number & ~(page_count - 1)) + (va_pfn & (page_count - 1));
+      break;
+    }
+
+    pfn = pe.page_frame_number;
+  }
+
+  entry.generation = gva_tlb_generation_;
+  entry.cr3        = cr3.flags;
+  entry.va_pfn     = va_pfn;
+  entry.pa_pfn     = pa_pfn;
+  entry.page_count = page_count;
+  entry.write      = write;
+  entry.user       = user;
+
+  return &entry;
+}
+
+void vcpu_t::gva_tlb_enable() noexcept
+{
+  auto procbased_ctls = processor_based_controls();
+  procbased_ctls.cr3_load_exiting = true;
+  procbased_ctls.invlpg_exiting = true;
+  processor_based_controls(procbased_ctls);
+
+  //
+  // Writes of CR0/CR4 bits which change the paging mode (or flush
+  // global translations) have to flush the TLB as well.
+  //
+  cr0_t cr0{};
+  cr0.paging_enable = true;
+  cr0.write_protect = true;
+  cr0_intercept(cr0);
+
+  cr4_t cr4{};
+  cr4.page_size_extensions = true;
+  cr4.physical_address_extension = true;
+  cr4.page_global_enable = true;
+  cr4.pcid_enable = true;
+  cr4_intercept(cr4);
+
+  gva_tlb_flush();
+  gva_tlb_persistent_ = true;
+}
+
+void vcpu_t::gva_tlb_disable() noexcept
+{
+  auto procbased_ctls = processor_based_controls();
+  procbased_ctls.cr3_load_exiting = false;
+  procbased_ctls.invlpg_exiting = false;
+  processor_based_controls(procbased_ctls);
+
+  gva_tlb_flush();
+  gva_tlb_persistent_ = false;
+}
+
+void vcpu_t::gva_tlb_flush() noexcept
+{
+  ++gva_tlb_generation_;
+}
+
+void vcpu_t::gva_tlb_flush(va_t va) noexcept
+{
+  //
+  // Entries are dropped regardless of the PCID they have been cached
+  // with - this covers global pages, too.  Slices of the large page
+  // which contains the address might be cached in other entries.
+  //
+  const auto va_pfn = va.value() >> page_shift;
+
+  for (auto& entry : gva_tlb_.entry)
+  {
+    if (((entry.va_pfn ^ va_pfn) & ~(entry.page_count - 1)) == 0)
+    {
+      entry.generation = 0;
+    }
+  }
+
+  //
+  // The TLB of the VMX-root mode has to be flushed on the next switch
+  // into the guest address space (see guest_address_space()).
+  //
+  root_cr3_generation_ = 0;
+}
+
+void vcpu_t::gva_tlb_flush_pcid(uint16_t pcid) noexcept
+{
+  for (auto& entry : gva_tlb_.entry)
+  {
+    if (cr3_t{ entry.cr3 }.pcid == pcid)
+    {
+      entry.generation = 0;
+    }
+  }
+  root_cr3_generation_ = 0;
+}
+
+auto vcpu_t::decode_cache_lookup(va_t rip) noexcept -> const vcpu_decode_cache_t::entry_t*
+{
+  auto cr3 = guest_cr3();
+  cr3.pcid_invalidate = false;
+
+  const auto& entry = decode_cache_.entry[(rip.value() ^ (rip.value() >> 12)) % vcpu_decode_cache_t::entry_count];
+
+  if (entry.kind == 0 ||
+      entry.rip != rip.value() ||
+      entry.cr3 != cr3.flags ||
+      entry.generation != detail::decode_cache_generation.load(std::memory_order_acquire))
+  {
+    return nullptr;
+  }
+
+  //
+  // The page might have been remapped since the instruction has been
+  // decoded.
+  //
+  if (gva_to_gpa(rip, cr3).pfn() != entry.pa_pfn)
+  {
+    return nullptr;
+  }
+
+  return &entry;
+}
+
+void vcpu_t::decode_cache_insert(va_t rip, uint32_t kind, uint32_t data) noexcept
+{
+  hvpp_assert(kind != 0);
+
+  auto cr3 = guest_cr3();
+  cr3.pcid_invalidate = false;
+
+  const auto pa = gva_to_gpa(rip, cr3);
+
+  if (!pa)
+  {
+    return;
+  }
+
+  //
+  // Publish the page in the filter before the generation is read -
+  // a write which is observed after that either sees the bit, or bumps
+  // the generation before it's re-read below.  Instructions crossing
+  // the page boundary are cached only by their first page - writes
+  // into the second page aren't observed.
+  //
+  const auto bit = detail::decode_cache_filter_bit(pa.pfn());
+  const auto generation = detail::decode_cache_generation.load(std::memory_order_seq_cst);
+
+  detail::decode_cache_filter[bit / 64].fetch_or(1ull << (bit % 64), std::memory_order_seq_cst);
+
+  if (detail::decode_cache_generation.load(std::memory_order_seq_cst) != generation)
+  {
+    return;
+  }
+
+  auto& entry = decode_cache_.entry[(rip.value() ^ (rip.value() >> 12)) % vcpu_decode_cache_t::entry_count];
+  entry.generation = generation;
+  entry.cr3        = cr3.flags;
+  entry.rip        = rip.value();
+  entry.pa_pfn     = pa.pfn();
+  entry.kind       = kind;
+  entry.data       = data;
+}
+
+void vcpu_t::decode_cache_invalidate(pa_t pa) noexcept
+{
+  //
+  // Called for each observed write - the common case (page without
+  // any cached instruction) costs single load.  Entries of all VCPUs
+  // are dropped at once by bumping the generation, which makes the
+  // whole filter stale.
+  //
+  const auto bit = detail::decode_cache_filter_bit(pa.pfn());
+
+  if (!(detail::decode_cache_filter[bit / 64].load(std::memory_order_relaxed) & (1ull << (bit % 64))))
+  {
+    return;
+  }
+
+  for (auto& filter : detail::decode_cache_filter)
+  {
+    filter.store(0, std::memory_order_seq_cst);
+  }
+
+  detail::decode_cache_generation.fetch_add(1, std::memory_order_seq_cst);
+}
+
+auto vcpu_t::guest_read(va_t va, void* buffer, size_t size) noexcept -> size_t
+{
+  return guest_read_write(va, buffer, size, false);
+}
+
+auto vcpu_t::guest_write(va_t va, const void* buffer, size_t size) noexcept -> size_t
+{
+  return guest_read_write(va, const_cast<void*>(buffer), size, true);
+}
+
+void vcpu_t::guest_physical_read(pa_t pa, void* buffer, size_t size) noexcept
+{
+  guest_mapping_.read(pa, buffer, size);
+}
+
+void vcpu_t::guest_physical_write(pa_t pa, const void* buffer, size_t size) noexcept
+{
+  guest_mapping_.write(pa, buffer, size);
+}
+
+auto vcpu_t::guest_kernel_cr3() noexcept -> cr3_t
+{
+  const auto cr3 = guest_cr3();
+
+  if (kernel_cr3_generation_ != gva_tlb_generation_ ||
+      kernel_cr3_guest_.flags != cr3.flags)
+  {
+    kernel_cr3_guest_ = cr3;
+    kernel_cr3_ = ::detail::kernel_cr3(cr3);
+    kernel_cr3_generation_ = gva_tlb_generation_;
+  }
+
+  return kernel_cr3_;
+}
+
+auto vcpu_t::guest_address_space() noexcept -> cr3_guard
+{
+  const auto cr3 = guest_kernel_cr3();
+
+  //
+  // TLB of the VMX-root mode may hold translations of another address
+  // space with the same PCID (e.g. Windows uses the same PCID for all
+  // processes) or outdated translations of this one.
+  //
+  const bool flush = root_cr3_generation_ != gva_tlb_generation_ ||
+                     root_cr3_.flags != cr3.flags;
+
+  root_cr3_ = cr3;
+  root_cr3_generation_ = gva_tlb_generation_;
+
+  return cr3_guard{ cr3, flush };
+}
+
+auto vcpu_t::fast_path() noexcept -> vcpu_fast_path_t&
+{
+  return fast_path_;
+}
+
+auto vcpu_t::exit_context() noexcept -> context_t&
+{
+  return exit_context_;
+}
+
+auto vcpu_t::scratch() noexcept -> mm::arena&
+{
+  return scratch_;
+}
+
+void vcpu_t::suppress_rip_adjust() noexcept
+{
+  suppress_rip_adjust_ = true;
+}
+
+//
+// Private
+//
+
+void vcpu_t::error() noexcept
+{
+  vmx::instruction_error instruction_error = exit_instruction_error();
+  hvpp_error("error: %p (%s)\n", instruction_error, vmx::instruction_error_to_string(instruction_error));
+  ia32_asm_int3();
+  terminate();
+}
+
+void vcpu_t::setup() noexcept
+{
+  //
+  // Enter VMX operation, invalidate EPT and VPID, load VMCS,
+  // set VMCS fields, call handler's setup() method, and launch
+  // the VM.  This function should NOT return - the next instruction
+  // after vmlaunch should be at vcpu_t::entry_guest_ (vcpu.asm).
+  //
+  load_vmxon();
+  load_vmcs();
+
+  //
+  // VMCS template is captured/applied by VMREAD/VMWRITE.
+  //
+  if (evmcs_)
+  {
+    vmcs_template_ = nullptr;
+  }
+
+  if (vmcs_template_ && vmcs_template_->matches(caps_))
+  {
+    setup_from_template(*vmcs_template_);
+  }
+  else
+  {
+    setup_host();
+    setup_guest();
+
+    //
+    // Fields which are (on symmetric CPUs) the same for all VCPUs.
+    // Fields set by the handler's setup() aren't captured - handlers
+    // set up per-VCPU state (EPT, bitmaps, ...) anyway.
+    //
+    static constexpr vmx::vmcs_t::field template_fields[] = {
+      vmx::vmcs_t::field::ctrl_pin_based_vm_execution_controls,
+      vmx::vmcs_t::field::ctrl_processor_based_vm_execution_controls,
+      vmx::vmcs_t::field::ctrl_secondary_processor_based_vm_execution_controls,
+      vmx::vmcs_t::field::ctrl_vmentry_controls,
+      vmx::vmcs_t::field::ctrl_vmexit_controls,
+      vmx::vmcs_t::field::guest_vmcs_link_pointer,
+      vmx::vmcs_t::field::guest_rip,
+      vmx::vmcs_t::field::host_es_selector,
+      vmx::vmcs_t::field::host_cs_selector,
+      vmx::vmcs_t::field::host_ss_selector,
+      vmx::vmcs_t::field::host_ds_selector,
+      vmx::vmcs_t::field::host_fs_selector,
+      vmx::vmcs_t::field::host_gs_selector,
+      vmx::vmcs_t::field::host_tr_selector,
+      vmx::vmcs_t::field::host_cr0,
+      vmx::vmcs_t::field::host_cr4,
+      vmx::vmcs_t::field::host_rip,
+    };
+
+    if (vmcs_template_ && !vmcs_template_->is_valid())
+    {
+      vmcs_template_->capture(caps_, template_fields);
+    }
+  }
+
+  vmcs_template_ = nullptr;
+
+  handler_->setup(*this);
+
+  vmx::vmlaunch();
+
+  //
+  // If we got here, something wrong has happened.
+  //
+  error();
+}
+
+void vcpu_t::ept_allocate(const ept_t* base, uint16_t count) noexcept
+{
+  hvpp_assert(ept_ == nullptr && count > 0);
+
+  //
+  // Allocate all EPTs and initialize them.
+  // Note that operator new[] doesn't support constructing objects
+  // with parameters - therefore we have to construct this array with
+  // "placement new" (see ept_disable() for the counter-part).
+  //
+  ept_ = reinterpret_cast<ept_t*>(operator new[](sizeof(ept_t) * count));
+  hvpp_assert(ept_ != nullptr);
+  ept_count_ = count;
+
+  std::for_each_n(ept_, ept_count_, [base](ept_t& ept_item) {
+    if (base)
+    {
+      ::new (static_cast<void*>(std::addressof(ept_item))) ept_t(*base);
+    }
+    else
+    {
+      ::new (static_cast<void*>(std::addressof(ept_item))) ept_t();
+    }
+  });
+
+  //
+  // Enable EPT.
+  //
+  auto procbased_ctls2 = processor_based_controls2();
+  procbased_ctls2.enable_ept = true;
+  processor_based_controls2(procbased_ctls2);
+
+  //
+  // Let the guest switch between EPTs without VM-exits.
+  //
+  if (ept_count_ > 1)
+  {
+    ept_switching_setup();
+  }
+
+  //
+  // Automatically select the first EPT.
+  //
+  ept_index(0);
+}
+
+void vcpu_t::ept_switching_setup() noexcept
+{
+  //
+  // Populate the EPTP list with pointers of all allocated EPTs and
+  // enable EPTP switching VM-function.  The guest (or its #VE handler)
+  // can then switch between them by executing VMFUNC (EAX = 0,
+  // ECX = EPT index) - without VM-exit.
+  // (ref: Vol3C[25.5.5.3(EPTP Switching)])
+  //
+  // VM-functions are optional - vmx::adjust() in processor_based_controls2()
+  // clears the control if it's unsupported; read it back to find out.
+  // Note that IA32_VMX_VMFUNC MSR is part of the capability snapshot
+  // only if the control is supported.
+  //
+  auto procbased_ctls2 = processor_based_controls2();
+  procbased_ctls2.enable_vm_functions = true;
+  processor_based_controls2(procbased_ctls2);
+
+  if (!processor_based_controls2().enable_vm_functions ||
+      !caps_.vmfunc.eptp_switching ||
+      ept_count_ > vmx::eptp_list_t::count)
+  {
+    procbased_ctls2.enable_vm_functions = false;
+    processor_based_controls2(procbased_ctls2);
+    return;
+  }
 
-  setup_host();
-  setup_guest();
+  memset(&eptp_list_, 0, sizeof(eptp_list_));
 
-  handler_.setup(*this);
+  for (uint16_t index = 0; index < ept_count_; ++index)
+  {
+    eptp_list_.entry[index] = ept_[index].ept_pointer();
+    ept_[index].loaded();
+  }
 
-  vmx::vmlaunch();
+  msr::vmx_vmfunc_t vmfunc_controls{};
+  vmfunc_controls.eptp_switching = true;
 
-  //
-  // If we got here, something wrong has happened.
-  //
-  error();
+  vmcs_write(vmx::vmcs_t::field::ctrl_vmfunc_controls, vmfunc_controls);
+  vmcs_write(vmx::vmcs_t::field::ctrl_ept_pointer_list_address, pa_t::from_va(&eptp_list_));
+
+  ept_switching_ = true;
 }
 
 void vcpu_t::load_vmxon() noexcept
@@ -341,8 +2194,8 @@ void vcpu_t::load_vmxon() noexcept
   // any of these bits contains an unsupported value.
   // (ref: Vol3C[23.8(Restrictions on VMX Operation)])
   //
-  write(vmx::adjust(read<cr0_t>()));
-  write(vmx::adjust(read<cr4_t>()));
+  write(vmx::adjust(read<cr0_t>(), caps_));
+  write(vmx::adjust(read<cr4_t>(), caps_));
 
   //
   // Before executing VMXON, software allocates a region of memory
@@ -352,8 +2205,7 @@ void vcpu_t::load_vmxon() noexcept
   // write the VMCS revision identifier to the VMXON region.
   // (ref: Vol3C[24.11.5(VMXON Region)])
   //
-  auto vmx_basic = msr::read<msr::vmx_basic_t>();
-  vmxon_.revision_id = vmx_basic.vmcs_revision_id;
+  vmxon_.revision_id = caps_.basic.vmcs_revision_id;
 
   //
   // Enter VMX operation.
@@ -394,8 +2246,27 @@ void vcpu_t::load_vmcs() noexcept
 {
   hvpp_assert(state_ == vcpu_state::initializing);
 
-  auto vmx_basic = msr::read<msr::vmx_basic_t>();
-  vmcs_.revision_id = vmx_basic.vmcs_revision_id;
+  if (evmcs_)
+  {
+    //
+    // The enlightened VMCS is made current by the VP assist page
+    // instead of VMPTRLD - VMLAUNCH/VMRESUME then use it.  All fields
+    // are dirty (hv_clean_fields == 0) until the first VM-entry.
+    //
+    evmcs_->revision_id = vmx::evmcs_t::version;
+    evmcs_->hv_clean_fields = vmx::evmcs_t::clean_none;
+
+    if (vp_assist_owned_)
+    {
+      msr::write(vmx::vp_assist_page_t::msr_id, pa_t::from_va(vp_assist_).value() | 1);
+    }
+
+    vp_assist_->current_nested_vmcs = pa_t::from_va(evmcs_).value();
+    vp_assist_->enlighten_vmentry = 1;
+    return;
+  }
+
+  vmcs_.revision_id = caps_.basic.vmcs_revision_id;
 
   //
   // Set VMCS to "clear" state and make the VMCS active.
@@ -452,7 +2323,9 @@ void vcpu_t::setup_host() noexcept
   host_tr(segment_t{ gdtr, read<tr_t>() });
 
   host_cr0(read<cr0_t>());
-  host_cr3(read<cr3_t>());
+  host_cr3(host_address_space_.flags
+    ? host_address_space_
+    : read<cr3_t>());
   host_cr4(read<cr4_t>());
 
   //
@@ -463,7 +2336,12 @@ void vcpu_t::setup_host() noexcept
   // on every VM-exit.
   //
   host_rsp(reinterpret_cast<uint64_t>(std::end(stack_.data)));
-  host_rip(reinterpret_cast<uint64_t>(&vcpu_t::entry_host_));
+
+  //
+  // The fast path (see vcpu_fast_path_t) continues to entry_host_()
+  // for VM-exits it doesn't handle.
+  //
+  host_rip(reinterpret_cast<uint64_t>(&vcpu_t::entry_host_fast_));
 }
 
 void vcpu_t::setup_guest() noexcept
@@ -503,7 +2381,10 @@ void vcpu_t::setup_guest() noexcept
   //   Also note that if you enable VPIDs, you can't assign VPID=0 to the
   //   guest VMCS because VPID=0 is reserved for VMX root operation.
   //
-  vcpu_id(1);
+  //   Each VCPU gets its own VPID, so that any INVVPID (and any cached
+  //   mapping) can be attributed to the exact VCPU.
+  //
+  vcpu_id(static_cast<uint16_t>(cpu_index_ + 1));
 
   //
   // VMCS link pointer points to the shadow VMCS if VMCS shadowing is
@@ -541,6 +2422,21 @@ void vcpu_t::setup_guest() noexcept
   procbased_ctls2.enable_invpcid = true;
   processor_based_controls2(procbased_ctls2);
 
+  //
+  // VPID is usable only if the processor supports INVVPID - otherwise
+  // translations cached under the VPID could never be invalidated.
+  //
+  vpid_cap_ = caps_.ept_vpid_cap;
+
+  if (!processor_based_controls2().enable_vpid || !vpid_cap_.invvpid)
+  {
+    procbased_ctls2 = processor_based_controls2();
+    procbased_ctls2.enable_vpid = false;
+    processor_based_controls2(procbased_ctls2);
+
+    vpid_cap_ = msr::vmx_ept_vpid_cap_t{};
+  }
+
   //
   // By default we want each VM-entry and VM-exit in 64bit mode.
   //
@@ -572,12 +2468,117 @@ void vcpu_t::setup_guest() noexcept
   guest_rip(reinterpret_cast<uint64_t>(&vcpu_t::entry_guest_));
 }
 
-void vcpu_t::entry_host() noexcept
+void vcpu_t::setup_from_template(const vmcs_template_t& vmcs_template) noexcept
+{
+  //
+  // Same as setup_host() + setup_guest(), except that fields shared by
+  // all VCPUs are replayed from the template - only fields which differ
+  // between CPUs are set here.
+  //
+  vmcs_template.replay();
+
+  //
+  // Controls have been already adjusted by the capturing VCPU (with the
+  // same capabilities).
+  //
+  vmcs_read(vmx::vmcs_t::field::ctrl_processor_based_vm_execution_controls, processor_based_controls_);
+
+  vpid_cap_ = processor_based_controls2().enable_vpid
+    ? caps_.ept_vpid_cap
+    : msr::vmx_ept_vpid_cap_t{};
+
+  auto gdtr = read<gdtr_t>();
+
+  host_gdtr(gdtr);
+  host_idtr(read<idtr_t>());
+  host_fs(segment_t{ gdtr, read<fs_t>() });
+  host_gs(segment_t{ gdtr, read<gs_t>() });
+  host_tr(segment_t{ gdtr, read<tr_t>() });
+  host_cr3(host_address_space_.flags
+    ? host_address_space_
+    : read<cr3_t>());
+  host_rsp(reinterpret_cast<uint64_t>(std::end(stack_.data)));
+
+  vcpu_id(static_cast<uint16_t>(cpu_index_ + 1));
+  msr_bitmap(vmx::msr_bitmap_t{});
+
+  guest_rsp(reinterpret_cast<uint64_t>(std::end(stack_.data)));
+}
+
+#ifdef HVPP_ENABLE_EXIT_TIMING
+static void exit_timing_record(uint32_t (&histogram)[vcpu_exit_timing_t::bucket_count], uint64_t ticks) noexcept
+{
+  int bucket = 0;
+
+  while ((ticks >>= 1) != 0 && bucket < vcpu_exit_timing_t::bucket_count - 1)
+  {
+    bucket += 1;
+  }
+
+  histogram[bucket] += 1;
+}
+#endif
+
+bool vcpu_t::entry_host() noexcept
 {
   //
-  // Reset RIP-adjust flag.
+  // Invalidate exit-information fields of the previous VM-exit.
+  //
+  exit_cache_.valid = 0;
+
+  //
+  // Nothing in the enlightened VMCS has been modified since the last
+  // VM-entry - writes from now on mark their groups dirty again.
+  //
+  if (evmcs_)
+  {
+    evmcs_->hv_clean_fields = vmx::evmcs_t::clean_all;
+  }
+
+  //
+  // Time spent in this function is hidden from the guest (see
+  // tsc_hide_root_time()) and/or accounted as the steal time (see
+  // steal_time_enable()).
+  //
+  const uint64_t root_start = (tsc_hide_root_time_ || steal_time_enabled_) ? ia32_asm_read_tsc() : 0;
+
+  //
+  // Without MOV-to-CR3 and INVLPG exiting, the software TLB can't
+  // survive the VM-exit (see gva_tlb_enable()).
+  //
+  if (!gva_tlb_persistent_)
+  {
+    gva_tlb_flush();
+  }
+
+#ifdef HVPP_ENABLE_EXIT_TIMING
+  //
+  // Capture the exit reason now - VMREAD can't be executed anymore
+  // at the end of this function if the VCPU has been terminated.
+  //
+  const auto timing_start  = ia32_asm_read_tsc();
+  const auto timing_reason = std::min(static_cast<int>(exit_reason()), vcpu_exit_timing_t::exit_reason_count - 1);
+#endif
+
+  //
+  // Reset RIP-adjust flag.  Any injected event has been delivered by
+  // the last VM-entry.
   //
   suppress_rip_adjust_ = false;
+  event_injected_ = false;
+
+#ifdef HVPP_ENABLE_EXIT_TIMING
+  //
+  // Record branches taken in VMX-root mode (IA32_DEBUGCTL is cleared
+  // on every VM-exit).
+  //
+  if (exit_profile_)
+  {
+    auto debugctl = msr::debugctl_t{};
+    debugctl.lbr = true;
+    msr::write(debugctl);
+  }
+#endif
 
   //
   // Execute "fxsave" instruction.  This causes to save x87 state and SSE
@@ -600,22 +2601,88 @@ void vcpu_t::entry_host() noexcept
   // But as long as we're not compiled with AVX support, fxsave/fxrstor should
   // be enough.
   //
-  ia32_asm_fx_save(&fxsave_area_);
+  // See also HVPP_XSTATE_MODE.
+  //
+  xstate_save();
 
   {
     //
     // Because we're in VMX-root mode, the system memory allocator
-    // has to be disabled.
+    // has to be disabled.  That's done implicitly - we're running
+    // on the host stack registered in prepare().
+    //
+    // Requests of other CPUs which arrive from now on will force
+    // the full path again.
+    //
+    fast_path_.bypass.store(evmcs_ ? 1 : 0, std::memory_order_seq_cst);
+
+    //
+    // Process EPT invalidation requested by other CPUs.
+    //
+    if (auto requested = ept_invalidation_requested_.load(std::memory_order_acquire);
+        requested != ept_invalidation_completed_)
+    {
+      vmx::invept_all_contexts();
+      ept_invalidation_completed_ = requested;
+    }
+
+    //
+    // Drain the PML buffer if requested (see pml_flush_post()).
+    //
+    if (pml_flush_requested_.exchange(false, std::memory_order_acquire))
+    {
+      pml_flush();
+    }
+
+    //
+    // Switch the I/O bitmap if requested (see io_bitmap_share_post()).
+    //
+    if (io_bitmap_requested_.load(std::memory_order_relaxed))
+    {
+      io_bitmap_share(*io_bitmap_requested_.exchange(nullptr, std::memory_order_acq_rel));
+    }
+
     //
-    mm::allocator_guard _;
+    // Switch the VM-exit handler if requested (see handler_swap_post()).
+    // The request is cleared only after the switch - from then on, the
+    // old handler isn't used by this VCPU.
+    //
+    if (auto handler = handler_requested_.load(std::memory_order_acquire))
+    {
+      //
+      // Only controls are re-programmed - the guest state belongs to
+      // the running guest now (see vmexit_handler::attach()).
+      //
+      handler_->detach(*this);
+      handler->attach(*this);
+      handler_ = handler;
 
-    auto captured_rsp    = exit_context_.rsp;
-    auto captured_rflags = exit_context_.rflags;
+      handler_requested_.store(nullptr, std::memory_order_release);
+    }
+
+    //
+    // Process commands posted by other CPUs (see command_post()) -
+    // after the handler switch, so that they're seen by the new one.
+    //
+    if (!mailbox_.empty())
+    {
+      mailbox_.drain([this](const vcpu_command_t& command) {
+        command_process(command);
+      });
+    }
 
     {
-      exit_context_.rsp    = guest_rsp();
-      exit_context_.rip    = guest_rip();
-      exit_context_.rflags = guest_rflags();
+      //
+      // Keep the values read from the VMCS, so that only fields
+      // modified by the VM-exit handler are written back.
+      //
+      const auto exit_rsp    = guest_rsp();
+      const auto exit_rip    = guest_rip();
+      const auto exit_rflags = guest_rflags();
+
+      exit_context_.rsp    = exit_rsp;
+      exit_context_.rip    = exit_rip;
+      exit_context_.rflags = exit_rflags;
 
       //
       // WinDbg will show full callstack (hypervisor + interrupted application)
@@ -630,19 +2697,115 @@ void vcpu_t::entry_host() noexcept
       stack_.machine_frame.rsp = exit_context_.rsp;
 
       {
-        handler_.handle(*this);
-
-        if (state_ == vcpu_state::terminated)
+        //
+        // The guest might have switched the EPT by VMFUNC - fault-in
+        // the memory in the active one (see ept_index()).
+        //
+        auto lazy_ept = ept_ && exit_reason() == vmx::exit_reason::ept_violation
+          ? &ept_[ept_index()]
+          : nullptr;
+
+        if (lazy_ept && lazy_ept->is_lazy() &&
+            lazy_ept->fault_in(exit_guest_physical_address()))
+        {
+          //
+          // EPT violation was caused by access to the memory which
+          // hasn't been mapped yet by lazily populated EPT.  The memory
+          // is mapped now - just execute the instruction again.
+          // The VM-exit handler never sees this VM-exit.
+          //
+          suppress_rip_adjust_ = true;
+        }
+        else if (pml_dirty_bitmap_ &&
+                 exit_reason() == vmx::exit_reason::page_modification_log_full)
+        {
+          //
+          // PML buffer is full - drain it and let the guest repeat
+          // the write which caused this VM-exit.
+          //
+          pml_flush();
+          suppress_rip_adjust_ = true;
+        }
+        else
         {
           //
-          // At this point we're not in the VMX-root mode (vmxoff has been
-          // executed) and we want to return control back to whomever caused
-          // this VM-exit.
+          // Fields of the typed VM-exit event (see logger::trace_exit_event())
+          // are captured before the handler runs - the handler can modify
+          // the RIP or terminate the VCPU.
+          //
+          const auto trace_exit_reason        = static_cast<uint32_t>(exit_reason());
+          const bool trace_exit_event         = logger::test_exit_event(trace_exit_reason);
+          const auto trace_exit_rip           = exit_context_.rip;
+          const auto trace_exit_qualification = trace_exit_event ? exit_qualification().flags : 0;
+          const auto trace_exit_cr3           = trace_exit_event ? guest_cr3().flags : 0;
+
           //
-          // Note that at this point, we can't call any VMX instructions,
-          // as they would raise #UD (invalid opcode exception).
+          // Leaf EPT entries which translate the guest physical address
+          // of the EPT violation can be modified by the handler without
+          // INVEPT (see ept_t::violation()).
           //
-          goto exit;
+          const auto violation_ept = ept_ && exit_reason() == vmx::exit_reason::ept_violation
+            ? &ept_[ept_index()]
+            : nullptr;
+
+          if (violation_ept)
+          {
+            violation_ept->violation(exit_guest_physical_address());
+          }
+
+#ifdef HVPP_ENABLE_EXIT_TIMING
+          const auto handler_start = ia32_asm_read_tsc();
+          handler_->handle(*this);
+          const auto handler_ticks = ia32_asm_read_tsc() - handler_start;
+
+          exit_timing_record(exit_timing_->handler[timing_reason], handler_ticks);
+
+          if (exit_profile_ && handler_ticks >= exit_profile_->threshold &&
+              state_ != vcpu_state::terminated)
+          {
+            exit_profile_sample(handler_ticks, uint32_t(timing_reason));
+          }
+#else
+          const auto handler_start = trace_exit_event ? ia32_asm_read_tsc() : 0;
+          handler_->handle(*this);
+          const auto handler_ticks = trace_exit_event ? ia32_asm_read_tsc() - handler_start : 0;
+#endif
+
+          if (violation_ept)
+          {
+            violation_ept->violation_end();
+          }
+
+          if (trace_exit_event)
+          {
+            logger::trace_exit_event(trace_exit_reason,
+                                     trace_exit_qualification, trace_exit_rip,
+                                     trace_exit_cr3, handler_ticks);
+          }
+
+          if (terminate_requested_ && state_ != vcpu_state::terminated &&
+              !suppress_rip_adjust_ && exit_reason() == vmx::exit_reason::execute_cpuid)
+          {
+            //
+            // Termination requested by the command - the CPUID has been
+            // emulated by the handler, terminate() skips it.
+            //
+            terminate_requested_ = false;
+            terminate();
+          }
+
+          if (state_ == vcpu_state::terminated)
+          {
+            //
+            // At this point we're not in the VMX-root mode (vmxoff has been
+            // executed) and we want to return control back to whomever caused
+            // this VM-exit.
+            //
+            // Note that at this point, we can't call any VMX instructions,
+            // as they would raise #UD (invalid opcode exception).
+            //
+            goto exit;
+          }
         }
 
         if (!suppress_rip_adjust_)
@@ -651,18 +2814,266 @@ void vcpu_t::entry_host() noexcept
         }
       }
 
-      guest_rsp(exit_context_.rsp);
-      guest_rip(exit_context_.rip);
-      guest_rflags(exit_context_.rflags);
-    }
+      //
+      // Single INVEPT (if any) covers all EPT modifications made
+      // during this VM-exit (see ept_t::flush_if_needed()).
+      //
+      for (uint16_t index = 0; index < ept_count_; ++index)
+      {
+        ept_[index].flush_if_needed();
+      }
+
+      //
+      // Inject pending interrupt on this VM-entry instead of waiting for
+      // the interrupt-window VM-exit, if the guest can accept it.
+      //
+      if (interrupt_is_pending() && !event_injected_ && interrupt_window_open())
+      {
+        interrupt_inject_pending();
+      }
+
+      if (exit_context_.rsp != exit_rsp)
+      {
+        guest_rsp(exit_context_.rsp);
+      }
+
+      if (exit_context_.rip != exit_rip)
+      {
+        guest_rip(exit_context_.rip);
+      }
 
-    exit_context_.rflags = captured_rflags;
-    exit_context_.rsp    = captured_rsp;
-    exit_context_.rip    = reinterpret_cast<uint64_t>(&vmx::vmresume);
+      if (exit_context_.rflags.flags != exit_rflags.flags)
+      {
+        guest_rflags(exit_context_.rflags);
+      }
+
+      if (root_start && tsc_hide_root_time_ && processor_based_controls_.use_tsc_offsetting)
+      {
+        tsc_offset_ -= static_cast<int64_t>(ia32_asm_read_tsc() - root_start);
+        vmcs_write(vmx::vmcs_t::field::ctrl_tsc_offset, tsc_offset_);
+      }
+    }
   }
 
 exit:
+  xstate_restore();
+
+  //
+  // Release the scratch memory of this VM-exit.
+  //
+  scratch_.reset();
+
+  if (root_start && steal_time_enabled_ && state_ != vcpu_state::terminated)
+  {
+    const auto now = ia32_asm_read_tsc();
+
+    steal_time_ticks_ += now - root_start;
+    steal_time_exits_ += 1;
+
+    if (now - steal_time_published_tsc_ >= steal_time::publish_interval)
+    {
+      steal_time_publish(now);
+    }
+  }
+
+#ifdef HVPP_ENABLE_EXIT_TIMING
+  exit_timing_record(exit_timing_->total[timing_reason], ia32_asm_read_tsc() - timing_start);
+#endif
+
+  //
+  // The guest is resumed directly by entry_host_() - unless the VCPU
+  // has been terminated, then exit_context_ (with guest RIP, RSP and
+  // RFLAGS) is restored by context_t::restore().
+  //
+  return state_ != vcpu_state::terminated;
+}
+
+auto vcpu_t::guest_read_write(va_t va, void* buffer, size_t size, bool write) noexcept -> size_t
+{
+  const auto cr3 = guest_cr3();
+  const auto capacity = guest_mapping_.capacity();
+
+  //
+  // Check the whole range before anything is copied - the guest must
+  // not see a partial write before the page-fault.
+  //
+  const auto accessible = guest_accessible(va, size, write);
+
+  if (write && accessible < size)
+  {
+    return accessible;
+  }
+
+  size = accessible;
+
+  uint8_t* byte_buffer = reinterpret_cast<uint8_t*>(buffer);
+  size_t result = 0;
+
+  while (result < size)
+  {
+    const auto pa = gva_to_gpa(va, cr3);
+
+    //
+    // Extend the chunk over the following guest pages for as long as
+    // they're physically contiguous and fit into the window.
+    //
+    size_t bytes_to_copy = std::min(size - result, page_size - byte_offset(va.value()));
+
+    while (result + bytes_to_copy < size &&
+           byte_offset(pa.value()) + bytes_to_copy < capacity)
+    {
+      const auto next_pa = gva_to_gpa(va + va_t{ bytes_to_copy }, cr3);
+
+      if (next_pa != pa + pa_t{ bytes_to_copy })
+      {
+        break;
+      }
+
+      bytes_to_copy += std::min(size - result - bytes_to_copy, page_size);
+    }
+
+    bytes_to_copy = std::min(bytes_to_copy, capacity - byte_offset(pa.value()));
+
+    if (write)
+    {
+      guest_mapping_.write(pa, byte_buffer, bytes_to_copy);
+    }
+    else
+    {
+      guest_mapping_.read(pa, byte_buffer, bytes_to_copy);
+    }
+
+    byte_buffer += bytes_to_copy;
+    va += va_t{ bytes_to_copy };
+    result += bytes_to_copy;
+  }
+
+  return result;
+}
+
+void vcpu_t::xstate_allocate() noexcept
+{
+#if HVPP_XSTATE_MODE == HVPP_XSTATE_MODE_XSAVEOPT
+  //
+  // XSAVEOPT is supported if CPUID.(EAX=0DH,ECX=1):EAX[bit 0] is set
+  // and the OS enabled XSAVE (CR4.OSXSAVE).
+  // (ref: Vol1[13.2(ENUMERATION OF CPU SUPPORT FOR XSAVE INSTRUCTIONS
+  //                 AND XSAVE-SUPPORTED FEATURES)])
+  //
+  uint32_t cpu_info[4];
+  ia32_asm_cpuid(cpu_info, 0);
+
+  if (cpu_info[0] < 0xd || !read<cr4_t>().os_xsave)
+  {
+    return;
+  }
+
+  ia32_asm_cpuid_ex(cpu_info, 0xd, 1);
+
+  if (!(cpu_info[0] & 1))
+  {
+    return;
+  }
+
+  //
+  // CPUID.(EAX=0DH,ECX=0):ECX contains size of the XSAVE area required
+  // by all supported state components - XCR0 can be changed by the guest
+  // (XSETBV), therefore don't rely on the size for its current value.
+  //
+  ia32_asm_cpuid_ex(cpu_info, 0xd, 0);
+
+  const auto size = size_t(cpu_info[2]);
+  xsave_area_buffer_ = new uint8_t[size + 64];
+
+  if (!xsave_area_buffer_)
+  {
+    return;
+  }
+
+  memset(xsave_area_buffer_, 0, size + 64);
+
+  //
+  // XSAVE area must be 64-byte aligned.
+  //
+  xsave_area_ = reinterpret_cast<void*>(
+    (reinterpret_cast<uintptr_t>(xsave_area_buffer_) + 63) & ~uintptr_t(63));
+#endif
+}
+
+void vcpu_t::xstate_save() noexcept
+{
+#if   HVPP_XSTATE_MODE == HVPP_XSTATE_MODE_XSAVEOPT
+  //
+  // Save all components enabled in XCR0 (requested-feature bitmap is
+  // the mask ANDed with XCR0).  The processor skips components which are
+  // in their init state or which haven't been modified since the last
+  // XRSTOR from this area.
+  //
+  if (xsave_area_)
+  {
+    ia32_asm_xsaveopt(xsave_area_, ~0ull);
+    return;
+  }
+
+  ia32_asm_fx_save(&fxsave_area_);
+#elif HVPP_XSTATE_MODE == HVPP_XSTATE_MODE_FXSAVE
+  ia32_asm_fx_save(&fxsave_area_);
+#elif HVPP_XSTATE_MODE == HVPP_XSTATE_MODE_NONE
+#else
+# error Unknown HVPP_XSTATE_MODE
+#endif
+}
+
+void vcpu_t::xstate_restore() noexcept
+{
+#if   HVPP_XSTATE_MODE == HVPP_XSTATE_MODE_XSAVEOPT
+  if (xsave_area_)
+  {
+    ia32_asm_xrstor(xsave_area_, ~0ull);
+    return;
+  }
+
   ia32_asm_fx_restore(&fxsave_area_);
+#elif HVPP_XSTATE_MODE == HVPP_XSTATE_MODE_FXSAVE
+  ia32_asm_fx_restore(&fxsave_area_);
+#endif
+}
+
+void vcpu_t::exit_profile_sample(uint64_t handler_ticks, uint32_t reason) noexcept
+{
+  //
+  // Freeze the LBR stack first, so that it isn't polluted by this
+  // function.
+  //
+  msr::write(msr::debugctl_t{});
+
+  const auto head = exit_profile_->head;
+  auto& sample = exit_profile_->sample[head % vcpu_exit_profile_t::sample_count];
+
+  sample.sequence           = 0;
+  sample.timestamp          = ia32_asm_read_tsc();
+  sample.handler_ticks      = handler_ticks;
+  sample.exit_reason        = reason;
+  sample.exit_qualification = exit_qualification().flags;
+  sample.guest_rip          = guest_rip();
+
+  //
+  // Walk the LBR stack from the top (the most recent branch).
+  //
+  const auto tos   = uint32_t(msr::read<msr::lastbranch_tos_t>().index);
+  const auto depth = exit_profile_->lbr_depth;
+
+  for (uint32_t i = 0; i < depth; ++i)
+  {
+    const auto index = (tos + depth - i) % depth;
+
+    sample.lbr_from[i] = msr::read(msr::lastbranch_from_ip_msr_id + index);
+    sample.lbr_to[i]   = msr::read(msr::lastbranch_to_ip_msr_id   + index);
+  }
+
+  std::atomic_thread_fence(std::memory_order_release);
+  sample.sequence = head + 1;
+  exit_profile_->head = head + 1;
 }
 
 void vcpu_t::entry_guest() noexcept
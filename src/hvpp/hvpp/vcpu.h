@@ -1,12 +1,20 @@
 #pragma once
+#include "config.h"
 #include "ept.h"
+#include "vcpu_mailbox.h"
+#include "vmcs_template.h"
 
 #include "ia32/arch.h"
 #include "ia32/exception.h"
 #include "ia32/vmx.h"
 
+#include "lib/arena.h"
+#include "lib/bitmap.h"
+#include "lib/cr3_guard.h"
 #include "lib/error.h"
 
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
 
 namespace hvpp {
@@ -98,12 +106,243 @@ enum class vcpu_state
   terminated,
 };
 
+//
+// Exit-information fields of the current VM-exit, read lazily from
+// the VMCS (see vcpu_t::exit_reason() & co.).  These fields are
+// read-only and they change only on VM-exit, therefore "valid" is
+// cleared at the beginning of each VM-exit (see vcpu_t::entry_host())
+// and each field is VMREAD at most once per VM-exit.
+//
+// Note that VM-instruction error isn't cached - it is also set by
+// failed VMX instructions executed in the VMX-root mode.
+//
+
+struct vcpu_exit_cache_t
+{
+  enum : uint32_t
+  {
+    reason                    = 0x0001,
+    qualification             = 0x0002,
+    instruction_info          = 0x0004,
+    instruction_length        = 0x0008,
+    interruption_info         = 0x0010,
+    interruption_error_code   = 0x0020,
+    idt_vectoring_info        = 0x0040,
+    idt_vectoring_error_code  = 0x0080,
+    guest_physical_address    = 0x0100,
+    guest_linear_address      = 0x0200,
+  };
+
+  uint32_t                  valid;
+
+  vmx::exit_reason          exit_reason;
+  vmx::exit_qualification_t exit_qualification;
+  vmx::instruction_info_t   exit_instruction_info;
+  uint32_t                  exit_instruction_length;
+  vmx::interrupt_info_t     exit_interruption_info;
+  exception_error_code_t    exit_interruption_error_code;
+  vmx::interrupt_info_t     exit_idt_vectoring_info;
+  exception_error_code_t    exit_idt_vectoring_error_code;
+  pa_t                      exit_guest_physical_address;
+  va_t                      exit_guest_linear_address;
+};
+
+//
+// Values of VMCS fields read at once (see vcpu_t::vmcs_fields()).
+// Each value is accessed by its field - get() returns the unsigned
+// integer of the width of the field, or T, if it's provided (T must not
+// be wider than the field):
+//
+//   using field = vmx::vmcs_t::field;
+//
+//   const auto state = vp.vmcs_fields<field::guest_rip,
+//                                     field::guest_cs_selector,
+//                                     field::vmexit_qualification>();
+//
+//   auto rip = state.get<field::guest_rip>();             // uint64_t
+//   auto cs  = state.get<field::guest_cs_selector>();     // uint16_t
+//   auto eq  = state.get<field::vmexit_qualification,
+//                        vmx::exit_qualification_t>();
+//
+// Requesting a field which hasn't been read fails to compile.
+//
+
+template <vmx::vmcs_t::field ...FIELDS>
+struct vcpu_vmcs_fields_t
+{
+  static constexpr size_t count = sizeof...(FIELDS);
+
+  static_assert(count > 0);
+  static_assert(((!vmx::detail::field_is_high(FIELDS)) && ...),
+                "High access to 64-bit fields isn't supported");
+
+  template <vmx::vmcs_t::field FIELD>
+  static constexpr size_t index_of() noexcept
+  {
+    constexpr vmx::vmcs_t::field fields[] = { FIELDS... };
+
+    for (size_t i = 0; i < count; ++i)
+    {
+      if (fields[i] == FIELD)
+      {
+        return i;
+      }
+    }
+
+    return count;
+  }
+
+  template <
+    vmx::vmcs_t::field FIELD,
+    typename T = vmx::detail::field_type_t<FIELD>
+  >
+  auto get() const noexcept -> T
+  {
+    constexpr auto index = index_of<FIELD>();
+
+    static_assert(index < count, "Field hasn't been read");
+    static_assert(sizeof(T) <= vmx::detail::field_size(FIELD), "Type is wider than the field");
+
+    vmx::detail::u64_t<T> u{};
+    u.as_uint64_t = value[index];
+    return u.as_value;
+  }
+
+  uint64_t value[count];
+};
+
+//
+// Histograms of VM-exit latencies (see HVPP_ENABLE_EXIT_TIMING).
+// Bucket N counts VM-exits which took [2^N, 2^(N+1)) TSC ticks
+// (the last bucket counts everything above).
+//
+
+struct vcpu_exit_timing_t
+{
+  static constexpr int exit_reason_count = 65;
+  static constexpr int bucket_count      = 32;
+
+  uint32_t handler[exit_reason_count][bucket_count];  // vmexit_handler::handle() only
+  uint32_t total[exit_reason_count][bucket_count];    // whole entry_host(), incl. fxsave/fxrstor
+};
+
+//
+// Samples of slow VM-exits (see vcpu_t::exit_profiling_enable()).
+// Each sample captures the LBR stack of the host at the time the handler
+// returned (most recent branch first).
+//
+// Record N is stored in the slot (N % sample_count) and its sequence
+// is set to (N + 1) after it has been written.
+//
+
+struct vcpu_exit_sample_t
+{
+  static constexpr int lbr_count = 32;
+
+  uint64_t sequence;
+  uint64_t timestamp;
+  uint64_t handler_ticks;
+  uint32_t exit_reason;
+  uint32_t reserved;
+  uint64_t exit_qualification;
+  uint64_t guest_rip;
+  uint64_t lbr_from[lbr_count];
+  uint64_t lbr_to[lbr_count];
+};
+
+struct vcpu_exit_profile_t
+{
+  static constexpr int sample_count = 16;
+
+  uint64_t           threshold;     // in TSC ticks
+  uint32_t           lbr_depth;     // depth of the LBR stack of this CPU model
+  uint32_t           reserved;
+  volatile uint64_t  head;
+  vcpu_exit_sample_t sample[sample_count];
+};
+
+//
+// VM-exits handled by the register-only fast path in vcpu.asm, without
+// entering vcpu_t::entry_host() at all (see vcpu_t::fast_path()).
+// The fast path emulates the instruction exactly as vmexit_passthrough_handler
+// does, advances guest RIP and VMRESUMEs.  The only exception is RDTSCP,
+// which returns the unmodified TSC - therefore it takes the full path
+// while the VCPU offsets or scales the TSC of the guest (see
+// vcpu_t::tsc_offset()).
+//
+// Keep in mind that VM-exits handled by the fast path are invisible to
+// the VM-exit handler (e.g. they aren't counted by vmexit_stats_handler).
+//
+// If you change layout of this structure, you have to edit vcpu.asm.
+//
+
+struct vcpu_fast_path_t
+{
+  uint64_t             exit_reason_bitmap[2]; // bit N = exit reason N is handled by the fast path
+  uint64_t             cpuid_0_bitmap;        // bit N = CPUID leaf 0x0000'0000 + N
+  uint64_t             cpuid_8_bitmap;        // bit N = CPUID leaf 0x8000'0000 + N
+  std::atomic_uint32_t bypass;                // non-zero = next VM-exit takes the full path
+  uint32_t             rdtscp_bypass;         // non-zero = RDTSCP takes the full path
+  void*                vcpu;                  // owning vcpu_t - vcpu.asm doesn't depend on vcpu_stack_size
+
+  //
+  // Exit reasons which have fast path implemented in vcpu.asm.
+  // CPUID is handled only for leaves enabled by enable_cpuid().
+  //
+  static constexpr bool is_supported(vmx::exit_reason exit_reason) noexcept
+  {
+    return exit_reason == vmx::exit_reason::execute_cpuid  ||
+           exit_reason == vmx::exit_reason::execute_invd   ||
+           exit_reason == vmx::exit_reason::execute_rdtscp ||
+           exit_reason == vmx::exit_reason::execute_wbinvd ||
+           exit_reason == vmx::exit_reason::execute_xsetbv;
+  }
+
+  bool enable(vmx::exit_reason exit_reason, bool value = true) noexcept
+  {
+    if (!is_supported(exit_reason))
+    {
+      return false;
+    }
+
+    const auto index = static_cast<uint32_t>(exit_reason);
+    const auto mask  = 1ull << (index % 64);
+
+    exit_reason_bitmap[index / 64] = value
+      ? exit_reason_bitmap[index / 64] |  mask
+      : exit_reason_bitmap[index / 64] & ~mask;
+
+    return true;
+  }
+
+  bool enable_cpuid(uint32_t leaf, bool value = true) noexcept
+  {
+    auto& bitmap = leaf < 0x8000'0000 ? cpuid_0_bitmap : cpuid_8_bitmap;
+    const auto index = leaf & 0x7fff'ffff;
+
+    if (index >= 64)
+    {
+      return false;
+    }
+
+    bitmap = value
+      ? bitmap |  (1ull << index)
+      : bitmap & ~(1ull << index);
+
+    return true;
+  }
+};
+
 //
 // Definition of the stack structure.
 // See vcpu.asm for more details.
 //
 
-static constexpr int vcpu_stack_size = 0x8000;
+static constexpr int vcpu_stack_size = HVPP_VCPU_STACK_SIZE;
+
+static_assert(vcpu_stack_size >= 2 * ia32::page_size &&
+              (vcpu_stack_size & (vcpu_stack_size - 1)) == 0,
+              "HVPP_VCPU_STACK_SIZE must be power of 2 and at least 2 pages");
 
 struct vcpu_stack_t
 {
@@ -136,44 +375,376 @@ struct vcpu_stack_t
   };
 };
 
+//
+// Software TLB of guest linear-address translations (see
+// vcpu_t::gva_to_gpa()).  It's direct-mapped by the virtual page number
+// and each entry is tagged by the whole CR3 (PML4 PFN and PCID) it has
+// been translated with.  Entries whose generation doesn't match the
+// generation of the VCPU are invalid - this makes the full flush O(1).
+// Access rights of an entry are the R/W and U/S bits of all levels of
+// the walk ANDed together (see vcpu_t::guest_accessible()).
+//
+
+struct vcpu_gva_tlb_t
+{
+  static constexpr int entry_count = 64;
+
+  struct entry_t
+  {
+    uint64_t generation;
+    uint64_t cr3;               // CR3 without bit 63 (see cr3_t::pcid_invalidate)
+    uint64_t va_pfn;
+    uint64_t pa_pfn;
+    uint64_t page_count;        // number of 4kb pages the translation covers
+    uint32_t write;             // R/W of all levels
+    uint32_t user;              // U/S of all levels
+  };
+
+  entry_t entry[entry_count];
+};
+
+//
+// Cache of decoded guest instructions (see vcpu_t::decode_cache_lookup()).
+//
+struct vcpu_decode_cache_t
+{
+  static constexpr int entry_count = 16;
+
+  struct entry_t
+  {
+    uint64_t generation;        // see vcpu_t::decode_cache_invalidate()
+    uint64_t cr3;               // CR3 without bit 63 (see cr3_t::pcid_invalidate)
+    uint64_t rip;
+    uint64_t pa_pfn;            // guest page of the instruction
+    uint32_t kind;              // 0 = empty, other values defined by the caller
+    uint32_t data;
+  };
+
+  entry_t entry[entry_count];
+};
+
 static_assert(sizeof(vcpu_stack_t) == vcpu_stack_size);
 static_assert(sizeof(vcpu_stack_t::shadow_space_t) == 32);
 
 class vcpu_t final
 {
   public:
-    vcpu_t(vmexit_handler& handler) noexcept;
+    //
+    // Number of pages of the window used for guest memory access
+    // (see guest_read()).
+    //
+    static constexpr size_t guest_mapping_page_count = 16;
+
+    vcpu_t(vmexit_handler& handler, mapping_t& guest_mapping) noexcept;
     ~vcpu_t() noexcept;
 
-    void launch() noexcept;
+    //
+    // Returns VCPU of the current CPU.  This is valid only when running
+    // on the host stack of the VCPU (i.e. in the VMX-root mode) - the
+    // VCPU is aligned to vcpu_stack_size and the stack is its first
+    // member (see hypervisor::start()).
+    //
+    static auto current() noexcept -> vcpu_t&;
+
+    //
+    // Index of the CPU this VCPU has been launched on.
+    //
+    auto cpu_index() const noexcept -> uint32_t;
+
+    //
+    // State of this VCPU - vcpu_state::running once launch() succeeded.
+    //
+    auto state() const noexcept -> vcpu_state;
+
+    //
+    // Register the host stack and the scratch arena of this VCPU and
+    // prepare the handler - called on the CPU of this VCPU.  The VCPU
+    // can't be launched if this fails (VM-exit handlers would allocate
+    // from the system allocator in the VMX-root mode).
+    //
+    auto prepare() noexcept -> error_code_t;
+
+    //
+    // VM-exit handler of this VCPU.
+    //
+    auto handler() const noexcept -> vmexit_handler&;
+
+    //
+    // Replace the VM-exit handler on the next VM-exit of this VCPU - the
+    // old handler's detach() and the new handler's attach() are called
+    // in the VMX-root mode and then the VM-exit is handled by the new
+    // one.  This method can be called from any CPU, handler_swap_pending()
+    // returns true until the old handler isn't used by this VCPU anymore
+    // (see hypervisor::handler_swap()).
+    //
+    // Note that VMCS controls set up by the old handler (e.g. exception
+    // bitmap, MSR/IO bitmaps, CR masks) are kept unless its detach()
+    // resets them - the new handler's attach() should set up all
+    // controls it depends on.
+    //
+    void handler_swap_post(vmexit_handler& handler) noexcept;
+    bool handler_swap_pending() const noexcept;
+
+    //
+    // Post the command to the mailbox of this VCPU (see vcpu_mailbox.h).
+    // This method can be called from any CPU, it doesn't wait for the
+    // command to be processed - it's processed on the next VM-exit of
+    // this VCPU (see hypervisor::command_post() for forcing one).
+    // Returns false if the mailbox is full.
+    //
+    bool command_post(const vcpu_command_t& command) noexcept;
+    auto command_dropped_count() const noexcept -> uint64_t;
+
+    //
+    // If the VMCS template is provided, the VCPU either captures its
+    // VMCS into it (if it's empty), or sets up its VMCS from it (see
+    // vmcs_template_t).
+    //
+    void launch(vmcs_template_t* vmcs_template = nullptr) noexcept;
+
+#ifdef HVPP_MOCK
+    //
+    // Simulate VM-exit of the launched VCPU (user-mode build only) - the
+    // exit-information fields must be already set in the mocked VMCS
+    // (see ia32/mock/cpu.h).  Returns false if the VCPU has been
+    // terminated by the VM-exit.
+    //
+    bool mock_exit() noexcept { return entry_host(); }
+
+    //
+    // Fields touched on each VM-exit - from the exit context up to the
+    // first page-aligned VMX structure (see the layout of vcpu_t).
+    // hvppbench evicts them from the cache to measure cold VM-exits.
+    //
+    auto mock_hot_fields() const noexcept -> const void*
+    { return &exit_context_; }
+
+    auto mock_hot_fields_size() const noexcept -> size_t
+    { return offsetof(vcpu_t, vmxon_) - offsetof(vcpu_t, exit_context_); }
+#endif
+
+    //
+    // CR3 loaded on each VM-exit (e.g. see host_page_table).  Must be
+    // set before launch() - by default, the CR3 at the time of launch()
+    // is used.
+    //
+    void host_address_space(cr3_t cr3) noexcept;
     void terminate() noexcept;
 
     void ept_enable(uint16_t count = 1) noexcept;
+    void ept_enable(const ept_t& base, uint16_t count = 1) noexcept;
     void ept_disable() noexcept;
 
     auto ept_index() noexcept -> uint16_t;
     void ept_index(uint16_t index) noexcept;
 
     auto ept(uint16_t index = 0) noexcept -> ept_t&;
+    auto ept_count() const noexcept -> uint16_t;
+
+    bool ept_switching_enabled() const noexcept;
+    bool ept_access_dirty_enable() noexcept;
+
+    bool ve_enable() noexcept;
+    void ve_disable() noexcept;
+    auto ve_info() noexcept -> vmx::ve_info_t&;
+
+    bool pml_enable(bitmap& dirty_bitmap) noexcept;
+    void pml_disable() noexcept;
+    void pml_flush() noexcept;
+    void pml_flush_post() noexcept;
+
+    //
+    // VMCS shadowing (see nested_vmx).
+    //
+    // Guest VMREAD/VMWRITE of fields, whose bit in the VMREAD/VMWRITE
+    // bitmap is clear, access the shadow VMCS without VM-exit.  Both
+    // bitmaps are initially full (every VMREAD/VMWRITE exits), the VMCS
+    // link pointer refers to the shadow VMCS only after
+    // shadow_vmcs_link(true).  Returns false if the CPU doesn't support
+    // VMCS shadowing.
+    //
+    bool vmcs_shadowing_enable() noexcept;
+    void vmcs_shadowing_disable() noexcept;
+    bool vmcs_shadowing_enabled() noexcept;
+
+    auto vmread_bitmap() noexcept -> vmx::vmcs_bitmap_t&;
+    auto vmwrite_bitmap() noexcept -> vmx::vmcs_bitmap_t&;
+
+    void shadow_vmcs_link(bool link) noexcept;
+
+    //
+    // Copy "count" fields from/to the shadow VMCS - the shadow VMCS is
+    // made current only once for all of them.  Returns false if some
+    // field isn't supported.
+    //
+    bool shadow_vmcs_read(const vmx::vmcs_t::field* fields, uint64_t* values, size_t count) noexcept;
+    bool shadow_vmcs_write(const vmx::vmcs_t::field* fields, const uint64_t* values, size_t count) noexcept;
+
+    void ept_invalidate_post() noexcept;
+
+    auto exit_timing() const noexcept -> const vcpu_exit_timing_t*;
+
+    bool exit_profiling_enable(uint64_t threshold, uint32_t lbr_depth = 16) noexcept;
+    void exit_profiling_disable() noexcept;
+    auto exit_profile() const noexcept -> const vcpu_exit_profile_t*;
 
     auto exit_context() noexcept -> context_t&;
+
+    //
+    // Scratch memory of the current VM-exit.
+    //
+    // Bump arena of HVPP_VCPU_SCRATCH_SIZE bytes, reset at the end of
+    // each VM-exit - handlers can use it for transient buffers (decoded
+    // instructions, collected lists, ...) without taking the allocator
+    // lock, and without freeing them.  Any pointer into the arena is
+    // invalid once the VM-exit handler returns.  The arena is also
+    // reachable through mm::scratch_allocator (e.g. via allocator_guard).
+    //
+    auto scratch() noexcept -> mm::arena&;
+
+    //
+    // Translate guest linear address into the guest physical address
+    // (which is the same as the host physical address with the identity
+    // EPT) by walking the guest page tables referenced by "cr3".  Returns
+    // null pa_t if the address isn't mapped.  Translations are cached in
+    // the software TLB of this VCPU (see vcpu_gva_tlb_t).
+    //
+    // Unless gva_tlb_enable() has been called, the TLB is flushed on each
+    // VM-exit - i.e. it only helps handlers which translate the same pages
+    // repeatedly during single VM-exit.
+    //
+    auto gva_to_gpa(va_t va) noexcept -> pa_t;
+    auto gva_to_gpa(va_t va, cr3_t cr3) noexcept -> pa_t;
+
+    //
+    // Returns number of bytes from "va" (up to "size") which the guest
+    // can access at its current CPL - i.e. the pages are present,
+    // user-accessible (U/S) if CPL is 3 and writable (R/W) for writes
+    // (supervisor writes only if CR0.WP is set).
+    //
+    auto guest_accessible(va_t va, size_t size, bool write) noexcept -> size_t;
+
+    //
+    // Keep the software TLB across VM-exits.  This enables MOV-to-CR3
+    // and INVLPG exiting (and intercepts paging bits of CR0/CR4, see
+    // cr0_intercept()), so that vmexit_passthrough_handler sees every
+    // instruction which invalidates guest translations (INVPCID always
+    // exits).  Handlers which don't derive from vmexit_passthrough_handler
+    // have to call gva_tlb_flush*() methods themselves.
+    //
+    void gva_tlb_enable() noexcept;
+    void gva_tlb_disable() noexcept;
+
+    void gva_tlb_flush() noexcept;
+    void gva_tlb_flush(va_t va) noexcept;
+    void gva_tlb_flush_pcid(uint16_t pcid) noexcept;
+
+    //
+    // Cache of decoded guest instructions, keyed by (CR3, RIP).
+    //
+    // Handlers which decode the instruction at the guest RIP (e.g. #UD
+    // and #GP emulation in vmexit_passthrough_handler) can remember what
+    // they have found - "kind" and "data" are defined by the caller - and
+    // skip reading the guest memory when the same instruction exits again.
+    // Lookup only checks that the RIP still translates to the same guest
+    // page (see gva_to_gpa()).
+    //
+    // Entries are dropped on all VCPUs whenever a write into a guest page
+    // holding a cached instruction is observed - either logged by the PML
+    // (see pml_flush()) or trapped by a write EPT violation (see
+    // ept_dispatcher).  Writes which are neither logged nor trapped aren't
+    // observed, therefore handlers should cache only instructions whose
+    // misclassification is harmless or which can't change unnoticed.
+    //
+    auto decode_cache_lookup(va_t rip) noexcept -> const vcpu_decode_cache_t::entry_t*;
+    void decode_cache_insert(va_t rip, uint32_t kind, uint32_t data) noexcept;
+    static void decode_cache_invalidate(pa_t pa) noexcept;
+
+    //
+    // Invalidate cached linear mappings of this VCPU (tagged by its VPID)
+    // with the narrowest INVVPID type supported by the processor.  Each
+    // VCPU has its own VPID, therefore VM-entries and VM-exits don't flush
+    // the TLB.  Combined mappings are tagged by the EPT pointer as well,
+    // so switching between EPT views doesn't require a new VPID nor any
+    // invalidation (see ept_index()).  Does nothing if VPIDs aren't
+    // supported - the processor flushes on each VMX transition then.
+    //
+    void vpid_invalidate() noexcept;
+    void vpid_invalidate(va_t va) noexcept;
+    void vpid_invalidate_retaining_globals() noexcept;
+
+    //
+    // Copy memory from/to the guest linear address "va" (translated
+    // with the current guest CR3).  The guest page tables are walked
+    // without switching CR3 and the pages are accessed through the
+    // mapping window of this VCPU - so non-present guest pages don't
+    // cause page-faults in the VMX-root mode.  Physically contiguous
+    // guest pages are mapped at once.
+    //
+    // The whole range is checked first (see guest_accessible()).
+    // Returns number of bytes which can be accessed - if it's less than
+    // "size", the byte at (va + result) either isn't present or the
+    // guest has no right to access it.  guest_read() copies these bytes
+    // anyway, guest_write() doesn't write anything in that case.
+    //
+    auto guest_read(va_t va, void* buffer, size_t size) noexcept -> size_t;
+    auto guest_write(va_t va, const void* buffer, size_t size) noexcept -> size_t;
+
+    //
+    // Copy memory from/to the guest physical address "pa" through
+    // the same mapping window.
+    //
+    void guest_physical_read(pa_t pa, void* buffer, size_t size) noexcept;
+    void guest_physical_write(pa_t pa, const void* buffer, size_t size) noexcept;
+
+    //
+    // Kernel CR3 of the current guest address space (see cr3_guard).
+    // The resolved CR3 is cached for as long as the software TLB holds
+    // (see gva_tlb_enable()).
+    //
+    auto guest_kernel_cr3() noexcept -> cr3_t;
+
+    //
+    // Switch into the guest address space for the lifetime of the
+    // returned guard, e.g.:
+    //   auto _ = vp.guest_address_space();
+    // The TLB isn't flushed if the same CR3 has been the last one
+    // switched into and the guest didn't invalidate its translations
+    // since then.
+    //
+    auto guest_address_space() noexcept -> cr3_guard;
+
+    //
+    // Fast path of this VCPU (see vcpu_fast_path_t).
+    //
+    auto fast_path() noexcept -> vcpu_fast_path_t&;
     void suppress_rip_adjust() noexcept;
 
     //
-    // VMCS manipulation. Implementation is in vcpu.inl.
+    // Raw access to the VMCS field of this VCPU (the current VMCS must
+    // belong to this VCPU, i.e. in the VMX-root mode).
     //
+    auto vmcs_field(vmx::vmcs_t::field field) const noexcept -> uint64_t;
+    void vmcs_field(vmx::vmcs_t::field field, uint64_t value) noexcept;
 
-  public:
     //
-    // Make storage for up-to 16 pending interrupts.
-    // In practice I haven't seen more than 2 pending interrupts.
+    // VMCS manipulation. Implementation is in vcpu.inl.
     //
-    static constexpr int pending_interrupt_queue_size = 16;
 
+  public:
     auto interrupt_info() const noexcept -> interrupt_t;
     auto idt_vectoring_info() const noexcept -> interrupt_t;
 
-    bool interrupt_inject(interrupt_t interrupt, bool first = false) noexcept;
+    //
+    // External interrupts which can't be injected right away are kept
+    // pending as a bitmap of vectors (like the IRR of the local APIC) -
+    // the same vector pending twice is delivered once and the highest
+    // vector is delivered first.  Pending interrupt is injected on the
+    // first VM-entry at which the guest is interruptible and no other
+    // event is being injected (interrupt-window exiting is enabled for
+    // as long as any interrupt is pending).
+    //
+    bool interrupt_inject(interrupt_t interrupt) noexcept;
     void interrupt_inject_force(interrupt_t interrupt) noexcept;
     void interrupt_inject_pending() noexcept;
     bool interrupt_is_pending() const noexcept;
@@ -199,6 +770,12 @@ class vcpu_t final
     void vmcs_link_pointer(pa_t link_pointer) noexcept;
 
   public:
+    //
+    // VMX capability MSRs of this CPU, read when the VCPU is constructed.
+    // All control setters below adjust the controls against them.
+    //
+    auto capabilities() const noexcept -> const vmx::capabilities_t&;
+
     auto pin_based_controls() const noexcept -> msr::vmx_pinbased_ctls_t;
     void pin_based_controls(msr::vmx_pinbased_ctls_t controls) noexcept;
 
@@ -221,6 +798,169 @@ class vcpu_t final
     auto io_bitmap() const noexcept -> const vmx::io_bitmap_t&;
     void io_bitmap(const vmx::io_bitmap_t& io_bitmap) noexcept;
 
+    //
+    // Reference bitmaps shared by multiple VCPUs instead of copying them
+    // into the VCPU.  Shared bitmaps must stay valid (and unchanged) for
+    // as long as they are referenced.  Calling msr_bitmap()/io_bitmap()
+    // setters or *_private() methods switches back to the private copy.
+    //
+    void msr_bitmap_share(const vmx::msr_bitmap_t& msr_bitmap) noexcept;
+    void io_bitmap_share(const vmx::io_bitmap_t& io_bitmap) noexcept;
+
+    //
+    // Request io_bitmap_share() on the next VM-exit of this VCPU.  This
+    // method can be called from any CPU - io_bitmap_share_pending() returns
+    // true until the request has been processed.
+    //
+    void io_bitmap_share_post(const vmx::io_bitmap_t& io_bitmap) noexcept;
+    bool io_bitmap_share_pending() const noexcept;
+
+    //
+    // Return private (modifiable) bitmap of this VCPU.  If a shared
+    // bitmap is referenced, it's copied first (copy-on-write).
+    //
+    auto msr_bitmap_private() noexcept -> vmx::msr_bitmap_t&;
+    auto io_bitmap_private() noexcept -> vmx::io_bitmap_t&;
+
+    //
+    // Let the processor swap the MSR during VM-entry and VM-exit (see
+    // vmx::msr_area_t) instead of executing WRMSR in the VM-exit handler.
+    // The guest value is loaded on each VM-entry and stored on each VM-exit
+    // (so that guest writes which don't cause VM-exit are preserved), the
+    // current value is restored on each VM-exit.  These methods must be
+    // called on the CPU of this VCPU, e.g. in vmexit_handler::setup().
+    //
+    // Note that RDMSR/WRMSR VM-exit handlers of swapped MSRs must use
+    // msr_swap_guest_value() - the hardware holds the host value.
+    //
+    auto msr_swap_add(uint32_t msr_id, uint64_t guest_value) noexcept -> error_code_t;
+    void msr_swap_remove(uint32_t msr_id) noexcept;
+    auto msr_swap_guest_value(uint32_t msr_id) const noexcept -> uint64_t;
+    void msr_swap_guest_value(uint32_t msr_id, uint64_t guest_value) noexcept;
+
+    //
+    // Let the processor load IA32_EFER on VM-entry (from guest_efer()) and
+    // on VM-exit (the current value), so that the guest and the host can
+    // have different EFER.  Guest EFER starts as the current value.
+    //
+    void efer_load_enable() noexcept;
+
+    //
+    // TSC offsetting and scaling.  While "RDTSC exiting" is disabled, the
+    // guest reads TSC as ((TSC * tsc_multiplier()) >> 48) + tsc_offset()
+    // without any VM-exit (ref: Vol3C[25.3(Changes to Instruction Behavior
+    // in VMX Non-Root Operation)]).  Setting the offset enables offsetting,
+    // setting the multiplier fails if TSC scaling isn't supported.
+    //
+    // With tsc_hide_root_time(true), time spent in entry_host() is
+    // subtracted from the offset on each VM-exit, so that the guest doesn't
+    // observe the time spent in the VMX-root mode.  The compensation is
+    // only approximate:
+    //   - time is measured in unscaled TSC ticks,
+    //   - VM-exit/VM-entry transitions themselves and VM-exits handled by
+    //     the fast path (see vcpu_fast_path_t) aren't compensated,
+    //   - the offset is per VCPU - each one subtracts its own VMX-root
+    //     time, so TSCs seen by the guest on different CPUs drift apart
+    //     (the skew grows with the difference in VM-exit load between
+    //     the CPUs).
+    // Guests which expect synchronized TSCs across CPUs (e.g. TSC used as
+    // a global clock) may observe time going backwards when a thread
+    // migrates.  Enable it only if the guest tolerates that, or bound the
+    // skew by setting the same tsc_offset() on all VCPUs from time to time
+    // (e.g. the smallest one, so that no guest TSC goes backwards).
+    //
+    // guest_tsc() converts the TSC into the value seen by the guest (e.g.
+    // for emulation of RDTSC when "RDTSC exiting" is enabled).
+    //
+    static constexpr uint64_t tsc_multiplier_unity = 1ull << 48;
+
+    auto tsc_offset() const noexcept -> int64_t;
+    void tsc_offset(int64_t offset) noexcept;
+    auto tsc_multiplier() const noexcept -> uint64_t;
+    auto tsc_multiplier(uint64_t multiplier) noexcept -> error_code_t;
+    void tsc_hide_root_time(bool enable) noexcept;
+    auto guest_tsc(uint64_t tsc) const noexcept -> uint64_t;
+
+    //
+    // Steal-time accounting (see steal_time.h).  TSC ticks spent in
+    // entry_host() are accumulated and published into the guest record
+    // at "pa" (through the guest memory window) at most once per
+    // steal_time::publish_interval.  Fails if the record crosses the
+    // page boundary.  steal_time() returns ticks accumulated since the
+    // record has been registered.
+    //
+    auto steal_time_enable(pa_t pa) noexcept -> error_code_t;
+    void steal_time_disable() noexcept;
+    auto steal_time() const noexcept -> uint64_t;
+
+    //
+    // Lazy switching of debug registers.
+    //
+    // With "MOV-DR exiting", every access of the guest to DR0-DR7 causes
+    // a VM-exit.  With dr_lazy(true), the first MOV DR is emulated as
+    // usual (see vmexit_passthrough_handler::handle_mov_dr()) and then the
+    // debug registers are released to the guest - "MOV-DR exiting" is
+    // turned off and further accesses run natively.  dr_reclaim() turns
+    // it back on (e.g. before the hypervisor starts to use the debug
+    // registers itself, or when it wants to observe MOV DR again) - the
+    // registers are released again on the next MOV DR.
+    //
+    // The hypervisor doesn't touch DR0-DR6 in the VMX-root mode and DR7
+    // is switched by the VMCS, therefore nothing has to be saved while
+    // the guest owns the registers.
+    //
+    void dr_lazy(bool enable) noexcept;
+    bool dr_lazy() const noexcept;
+    bool dr_released() const noexcept;
+    void dr_release() noexcept;
+    void dr_reclaim() noexcept;
+
+    //
+    // APIC virtualization - TPR shadow, virtual-interrupt delivery and
+    // posted-interrupt processing with the virtual-APIC page and the
+    // posted-interrupt descriptor of this VCPU.  Must be called on the
+    // CPU of this VCPU, e.g. in vmexit_handler::setup().
+    //
+    // Note that the guest sees a virtual TPR afterwards (it doesn't reach
+    // the physical APIC anymore) and external interrupts cause VM-exits
+    // (they're acknowledged on VM-exit).  Therefore, this is meant only
+    // for handlers which virtualize the local APIC - e.g. by forwarding
+    // acknowledged interrupts via apicv_request().
+    //
+    // EOIs must be virtualized, so the guest must be in the x2APIC mode
+    // and the MSR bitmap (which must be already set) must pass writes of
+    // the TPR, EOI and SELF IPI MSRs through.  Fails otherwise.
+    //
+    auto apicv_enable(uint8_t notification_vector) noexcept -> error_code_t;
+    bool apicv_is_enabled() const noexcept;
+    auto virtual_apic() noexcept -> vmx::virtual_apic_t&;
+
+    //
+    // Request virtual interrupt - it's delivered by the processor itself
+    // as soon as the guest can accept it (no interrupt-window VM-exit).
+    //
+    void apicv_request(uint8_t vector) noexcept;
+
+    //
+    // Post the virtual interrupt - can be called from any CPU.  Returns
+    // true if the caller should send the notification vector to the CPU
+    // of this VCPU (i.e. no notification is outstanding yet).  Without
+    // the notification, the interrupt is delivered on the next VM-entry.
+    //
+    bool posted_interrupt_post(uint8_t vector) noexcept;
+
+    //
+    // PAUSE-loop exiting.  VM-exit occurs when the guest executes PAUSE
+    // instructions no more than "gap" TSC ticks apart for longer than
+    // "window" TSC ticks (i.e. when it spins).  Window of 0 disables the
+    // PAUSE-loop exiting.  See also pause_policy.
+    // (ref: Vol3C[25.1.3(Instructions That Cause VM Exits Conditionally)])
+    //
+    auto pause_loop_exiting(uint32_t gap, uint32_t window) noexcept -> error_code_t;
+    auto pause_loop_gap() const noexcept -> uint32_t;
+    auto pause_loop_window() const noexcept -> uint32_t;
+    void pause_loop_window(uint32_t window) noexcept;
+
     auto pagefault_error_code_mask() const noexcept -> pagefault_error_code_t;
     void pagefault_error_code_mask(pagefault_error_code_t mask) noexcept;
     auto pagefault_error_code_match() const noexcept -> pagefault_error_code_t;
@@ -239,6 +979,37 @@ class vcpu_t final
     auto cr4_shadow() const noexcept -> cr4_t;
     void cr4_shadow(cr4_t cr4) noexcept;
 
+    //
+    // Minimal guest/host masks of CR0 and CR4.
+    //
+    // Handlers declare bits whose writes they need to observe (e.g. in
+    // vmexit_handler::setup()) and the VCPU programs the guest/host mask
+    // as the union of all declared bits and bits fixed by the VMX operation
+    // (see vmx::adjust(), e.g. CR4.VMXE).  MOV to CR0/CR4, CLTS and LMSW
+    // then cause VM-exit only if they change any of these bits - the guest
+    // owns all other bits.  The read shadow of newly owned bits receives
+    // the current guest value (except CR4.VMXE, which the guest never
+    // sees set).  vmexit_passthrough_handler::handle_mov_cr() keeps the
+    // shadow in sync.
+    //
+    // Declarations accumulate, cr*_intercept(bits, false) drops the bits
+    // - handlers sharing a bit have to cooperate.
+    //
+    void cr0_intercept(cr0_t bits, bool enable = true) noexcept;
+    void cr4_intercept(cr4_t bits, bool enable = true) noexcept;
+    auto cr0_intercepted() const noexcept -> cr0_t;
+    auto cr4_intercepted() const noexcept -> cr4_t;
+
+    //
+    // MOV to CR3 doesn't cause VM-exit (even if "cr3_load_exiting" is set)
+    // when the source operand equals one of the first cr3_target_count()
+    // CR3-target values (see cr3_policy).
+    //
+    auto cr3_target_count() const noexcept -> uint32_t;
+    void cr3_target_count(uint32_t count) noexcept;
+    auto cr3_target_value(uint32_t index) const noexcept -> cr3_t;
+    void cr3_target_value(uint32_t index, cr3_t cr3) noexcept;
+
     auto entry_instruction_length() const noexcept -> uint32_t;
     void entry_instruction_length(uint32_t instruction_length) noexcept;
 
@@ -267,6 +1038,15 @@ class vcpu_t final
     auto exit_guest_physical_address() const noexcept -> pa_t;
     auto exit_guest_linear_address() const noexcept -> va_t;
 
+    //
+    // Read multiple VMCS fields at once (see vcpu_vmcs_fields_t).  The
+    // reads are unrolled at compile time.  Exit-information fields are
+    // served from the per-exit cache (and fill it, see exit_reason()
+    // & co.), other fields are VMREAD directly.
+    //
+    template <vmx::vmcs_t::field ...FIELDS>
+    auto vmcs_fields() const noexcept -> vcpu_vmcs_fields_t<FIELDS...>;
+
     //
     // Guest state
     //
@@ -282,6 +1062,8 @@ class vcpu_t final
     void guest_dr7(dr7_t dr7) noexcept;
     auto guest_debugctl() const noexcept -> msr::debugctl_t;
     void guest_debugctl(msr::debugctl_t debugctl) noexcept;
+    auto guest_efer() const noexcept -> msr::efer_t;
+    void guest_efer(msr::efer_t efer) noexcept;
 
     auto guest_rsp() const noexcept -> uint64_t;
     void guest_rsp(uint64_t rsp) noexcept;
@@ -327,6 +1109,9 @@ class vcpu_t final
     auto guest_interruptibility_state() const noexcept -> vmx::interruptibility_state_t;
     void guest_interruptibility_state(vmx::interruptibility_state_t interruptibility_state) noexcept;
 
+    auto guest_vmx_preemption_timer_value() const noexcept -> uint32_t;
+    void guest_vmx_preemption_timer_value(uint32_t value) noexcept;
+
   private:
     //
     // Host state
@@ -338,6 +1123,8 @@ class vcpu_t final
     void host_cr3(cr3_t cr3) noexcept;
     auto host_cr4() const noexcept -> cr4_t;
     void host_cr4(cr4_t cr4) noexcept;
+    auto host_efer() const noexcept -> msr::efer_t;
+    void host_efer(msr::efer_t efer) noexcept;
 
     auto host_rsp() const noexcept -> uint64_t;
     void host_rsp(uint64_t rsp) noexcept;
@@ -375,25 +1162,189 @@ class vcpu_t final
     void error() noexcept;
     void setup() noexcept;
 
+    void ept_allocate(const ept_t* base, uint16_t count) noexcept;
+    void ept_switching_setup() noexcept;
+
     void load_vmxon() noexcept;
     void load_vmcs() noexcept;
 
     void setup_host() noexcept;
     void setup_guest() noexcept;
+    void setup_from_template(const vmcs_template_t& vmcs_template) noexcept;
 
-    void entry_host() noexcept;
+    //
+    // Returns false if the VCPU has been terminated (see vcpu.asm).
+    //
+    bool entry_host() noexcept;
     void entry_guest() noexcept;
 
+    void command_process(const vcpu_command_t& command) noexcept;
+
+    bool interrupt_window_open() const noexcept;
+    void interrupt_window_exiting(bool enable) noexcept;
+
+    void exit_profile_sample(uint64_t handler_ticks, uint32_t reason) noexcept;
+
+    auto gva_tlb_lookup(va_t va, cr3_t cr3) noexcept -> const vcpu_gva_tlb_t::entry_t*;
+    auto guest_read_write(va_t va, void* buffer, size_t size, bool write) noexcept -> size_t;
+
+    void xstate_allocate() noexcept;
+    void xstate_save() noexcept;
+    void xstate_restore() noexcept;
+
+    void steal_time_publish(uint64_t now) noexcept;
+    void tsc_fast_path_update() noexcept;
+
+    template <typename T>
+    auto exit_cache_read(uint32_t flag, T& value, vmx::vmcs_t::field field) const noexcept -> T;
+
+    template <vmx::vmcs_t::field FIELD>
+    auto vmcs_field_read() const noexcept -> uint64_t;
+
+    //
+    // VMREAD/VMWRITE - or accesses of the enlightened VMCS (see
+    // HVPP_ENLIGHTENED_VMCS).
+    //
+    template <typename T>
+    auto vmcs_read(vmx::vmcs_t::field field, T& value) const noexcept -> vmx::error_code;
+
+    template <typename T>
+    auto vmcs_write(vmx::vmcs_t::field field, T value) noexcept -> vmx::error_code;
+
     static void entry_host_() noexcept;
+    static void entry_host_fast_() noexcept;
     static void entry_guest_() noexcept;
 
     //
-    // If you reorder following three members (stack, guest context and exit
-    // context), you have to edit offsets in vcpu.asm.
+    // If you reorder following four members (stack, guest context, exit
+    // context and fast path), you have to edit offsets in vcpu.asm.
     //
     vcpu_stack_t       stack_;
     context_t          guest_context_;
     context_t          exit_context_;
+    vcpu_fast_path_t   fast_path_;
+
+    //
+    // Fields touched on (almost) every VM-exit.  They're kept together
+    // in few cache lines right after the fast path - the page-aligned
+    // VMX structures below would leave this space as a padding anyway.
+    //
+
+    //
+    // Lazily read exit-information fields of the current VM-exit.
+    //
+    alignas(64)
+    mutable vcpu_exit_cache_t exit_cache_;
+
+    vmexit_handler*    handler_;
+
+    //
+    // Enlightened VMCS (nullptr if the hardware VMCS is used).
+    //
+    vmx::evmcs_t*      evmcs_;
+
+    vcpu_state         state_;
+    uint32_t           cpu_index_;
+
+    bool               suppress_rip_adjust_;
+    bool               ept_switching_;
+    bool               ve_enabled_;
+    bool               gva_tlb_persistent_;
+    bool               event_injected_;
+
+    ept_t*             ept_;
+    uint16_t           ept_count_;
+    uint16_t           ept_index_;
+
+    //
+    // EPT invalidation requested by other CPUs (see ept_invalidate_post()).
+    //
+    std::atomic_uint64_t ept_invalidation_requested_;
+    uint64_t           ept_invalidation_completed_;
+
+    //
+    // Dirty page tracking - see pml_enable().
+    //
+    std::atomic_bool   pml_flush_requested_;
+    bitmap*            pml_dirty_bitmap_;
+
+    //
+    // I/O bitmap requested by other CPUs (see io_bitmap_share_post()).
+    //
+    std::atomic<const vmx::io_bitmap_t*> io_bitmap_requested_;
+
+    //
+    // VM-exit handler requested by other CPUs (see handler_swap_post()).
+    //
+    std::atomic<vmexit_handler*> handler_requested_;
+
+    //
+    // Commands posted by other CPUs (see command_post()).
+    //
+    vcpu_mailbox       mailbox_;
+    bool               terminate_requested_;
+
+    //
+    // Current generation of the software TLB (see gva_tlb_flush()).
+    //
+    uint64_t           gva_tlb_generation_;
+
+    //
+    // Snapshot of VMX capability MSRs (see capabilities()).
+    //
+    vmx::capabilities_t caps_;
+
+    //
+    // VMCS template used by setup() (see launch()).
+    //
+    vmcs_template_t*   vmcs_template_;
+
+    //
+    // Host CR3 (see host_address_space()), 0 = CR3 at launch().
+    //
+    cr3_t              host_address_space_;
+
+    //
+    // Supported INVVPID types (zero if VPIDs aren't enabled).
+    //
+    msr::vmx_ept_vpid_cap_t vpid_cap_;
+
+    //
+    // Primary processor-based controls as written to the VMCS (see
+    // processor_based_controls()).
+    //
+    msr::vmx_procbased_ctls_t processor_based_controls_;
+
+    //
+    // Pending external interrupts - one bit per vector.
+    //
+    uint64_t           pending_interrupt_[4];
+
+    //
+    // TSC offset and multiplier as written to the VMCS (see tsc_offset()).
+    //
+    int64_t            tsc_offset_;
+    uint64_t           tsc_multiplier_;
+    bool               tsc_hide_root_time_;
+    bool               steal_time_enabled_;
+
+    //
+    // APIC virtualization has been enabled (see apicv_enable()).
+    //
+    bool               apicv_enabled_;
+
+    //
+    // VM-exit latency histograms (nullptr if HVPP_ENABLE_EXIT_TIMING
+    // isn't defined).
+    //
+    vcpu_exit_timing_t* exit_timing_;
+
+    //
+    // XSAVE area (aligned) and its allocation - only when HVPP_XSTATE_MODE
+    // is HVPP_XSTATE_MODE_XSAVEOPT and the XSAVEOPT is supported.
+    //
+    void*              xsave_area_;
+    uint8_t*           xsave_area_buffer_;
 
     //
     // Various VMX structures.
@@ -403,27 +1354,158 @@ class vcpu_t final
     vmx::vmcs_t        vmcs_;
     vmx::msr_bitmap_t  msr_bitmap_;
     vmx::io_bitmap_t   io_bitmap_;
+    vmx::eptp_list_t   eptp_list_;
+    vmx::ve_info_t     ve_info_;
+    vmx::pml_t         pml_;
+    vmx::msr_area_t    msr_guest_area_;
+    vmx::msr_area_t    msr_host_area_;
+    vmx::virtual_apic_t virtual_apic_;
+    vmx::posted_interrupt_descriptor_t posted_interrupt_;
+    vmx::vmcs_t        shadow_vmcs_;
+    vmx::vmcs_bitmap_t vmread_bitmap_;
+    vmx::vmcs_bitmap_t vmwrite_bitmap_;
+
+    //
+    // Bitmaps referenced by the VMCS - either the private ones (above)
+    // or shared (see msr_bitmap_share() and io_bitmap_share()).
+    //
+    const vmx::msr_bitmap_t* msr_bitmap_active_;
+    const vmx::io_bitmap_t*  io_bitmap_active_;
+
+    //
+    // Number of used entries in the MSR areas (see msr_swap_add()).
+    //
+    uint16_t           msr_swap_count_;
 
     //
     // FXSAVE area - to keep SSE registers sane between VM-exits.
     //
     fxsave_area_t      fxsave_area_;
 
-    vmexit_handler&    handler_;
-    vcpu_state         state_;
+    //
+    // Samples of slow VM-exits (nullptr if profiling is disabled).
+    //
+    vcpu_exit_profile_t* exit_profile_;
 
-    ept_t*             ept_;
-    uint16_t           ept_count_;
-    uint16_t           ept_index_;
+    //
+    // Window for guest memory access (see guest_read()).
+    //
+    mapping_t&         guest_mapping_;
 
     //
-    // Pending interrupt queue (FIFO).
+    // Resolved guest kernel CR3 (see guest_kernel_cr3()) and the CR3
+    // last switched into by guest_address_space().  Both are valid only
+    // in the generation of the software TLB they were set in.
     //
-    interrupt_t        pending_interrupt_[pending_interrupt_queue_size];
-    uint8_t            pending_interrupt_first_;
-    uint8_t            pending_interrupt_count_;
+    cr3_t              kernel_cr3_guest_;
+    cr3_t              kernel_cr3_;
+    uint64_t           kernel_cr3_generation_;
+    cr3_t              root_cr3_;
+    uint64_t           root_cr3_generation_;
 
-    bool               suppress_rip_adjust_;
+    //
+    // Software TLB of guest translations (see gva_to_gpa()).
+    //
+    vcpu_gva_tlb_t     gva_tlb_;
+
+    //
+    // Per-exit scratch memory (see scratch()).
+    //
+    mm::arena          scratch_;
+
+    //
+    // Decoded guest instructions (see decode_cache_lookup()).
+    //
+    vcpu_decode_cache_t decode_cache_;
+
+    //
+    // Lazy switching of debug registers (see dr_lazy()).
+    //
+    bool               dr_lazy_;
+    bool               dr_released_;
+
+    //
+    // CR0/CR4 bits declared by handlers (see cr0_intercept()).
+    //
+    cr0_t              cr0_intercept_;
+    cr4_t              cr4_intercept_;
+
+    //
+    // Steal-time record of the guest (see steal_time_enable()).
+    //
+    pa_t               steal_time_pa_;
+    uint64_t           steal_time_ticks_;
+    uint64_t           steal_time_exits_;
+    uint64_t           steal_time_published_tsc_;
+    uint32_t           steal_time_sequence_;
+
+    //
+    // VP assist page making the enlightened VMCS current (see load_vmcs())
+    // - either the one of the OS or our own (then the original content
+    // of the VP assist page MSR is restored by terminate()).
+    //
+    vmx::vp_assist_page_t* vp_assist_;
+    uint64_t           vp_assist_msr_;
+    bool               vp_assist_owned_;
 };
 
+inline auto vcpu_t::current() noexcept -> vcpu_t&
+{
+  return *reinterpret_cast<vcpu_t*>(ia32_asm_read_rsp() & ~uint64_t(vcpu_stack_size - 1));
+}
+
+inline auto vcpu_t::cpu_index() const noexcept -> uint32_t
+{
+  return cpu_index_;
+}
+
+inline auto vcpu_t::state() const noexcept -> vcpu_state
+{
+  return state_;
+}
+
+template <vmx::vmcs_t::field FIELD>
+inline auto vcpu_t::vmcs_field_read() const noexcept -> uint64_t
+{
+  using field = vmx::vmcs_t::field;
+
+  const auto as_uint64_t = [](auto value) {
+    vmx::detail::u64_t<decltype(value)> u{};
+    u.as_value = value;
+    return u.as_uint64_t;
+  };
+
+  if      constexpr (FIELD == field::vmexit_reason)                   { return as_uint64_t(exit_reason());                   }
+  else if constexpr (FIELD == field::vmexit_qualification)            { return as_uint64_t(exit_qualification());            }
+  else if constexpr (FIELD == field::vmexit_instruction_info)         { return as_uint64_t(exit_instruction_info());         }
+  else if constexpr (FIELD == field::vmexit_instruction_length)       { return as_uint64_t(exit_instruction_length());       }
+  else if constexpr (FIELD == field::vmexit_interruption_info)        { return as_uint64_t(exit_interruption_info());        }
+  else if constexpr (FIELD == field::vmexit_interruption_error_code)  { return as_uint64_t(exit_interruption_error_code());  }
+  else if constexpr (FIELD == field::vmexit_idt_vectoring_info)       { return as_uint64_t(exit_idt_vectoring_info());       }
+  else if constexpr (FIELD == field::vmexit_idt_vectoring_error_code) { return as_uint64_t(exit_idt_vectoring_error_code()); }
+  else if constexpr (FIELD == field::vmexit_guest_physical_address)   { return as_uint64_t(exit_guest_physical_address());   }
+  else if constexpr (FIELD == field::vmexit_guest_linear_address)     { return as_uint64_t(exit_guest_linear_address());     }
+  else
+  {
+#ifdef HVPP_ENLIGHTENED_VMCS
+    return vmcs_field(FIELD);
+#else
+    uint64_t value = 0;
+    vmx::vmread(FIELD, value);
+    return value;
+#endif
+  }
+}
+
+template <vmx::vmcs_t::field ...FIELDS>
+inline auto vcpu_t::vmcs_fields() const noexcept -> vcpu_vmcs_fields_t<FIELDS...>
+{
+  vcpu_vmcs_fields_t<FIELDS...> result;
+
+  size_t index = 0;
+  ((result.value[index++] = vmcs_field_read<FIELDS>()), ...);
+
+  return result;
+}
+
 }
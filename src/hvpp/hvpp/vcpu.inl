@@ -1,5 +1,45 @@
 namespace hvpp {
 
+//
+// VMCS access
+//
+
+template <typename T>
+auto vcpu_t::vmcs_read(vmx::vmcs_t::field field, T& value) const noexcept -> vmx::error_code
+{
+#ifdef HVPP_ENLIGHTENED_VMCS
+  if (evmcs_)
+  {
+    vmx::detail::u64_t<T> u{};
+
+    const bool result = evmcs_->read(field, u.as_uint64_t);
+    value = u.as_value;
+
+    return result ? vmx::error_code::success : vmx::error_code::failed;
+  }
+#endif
+
+  return vmx::vmread(field, value);
+}
+
+template <typename T>
+auto vcpu_t::vmcs_write(vmx::vmcs_t::field field, T value) noexcept -> vmx::error_code
+{
+#ifdef HVPP_ENLIGHTENED_VMCS
+  if (evmcs_)
+  {
+    vmx::detail::u64_t<T> u{};
+    u.as_value = value;
+
+    return evmcs_->write(field, u.as_uint64_t)
+      ? vmx::error_code::success
+      : vmx::error_code::failed;
+  }
+#endif
+
+  return vmx::vmwrite(field, value);
+}
+
 auto vcpu_t::interrupt_info() const noexcept -> interrupt_t
 {
   interrupt_t result;
@@ -36,62 +76,27 @@ auto vcpu_t::idt_vectoring_info() const noexcept -> interrupt_t
   return result;
 }
 
-bool vcpu_t::interrupt_inject(interrupt_t interrupt, bool first /*= false */) noexcept
+bool vcpu_t::interrupt_inject(interrupt_t interrupt) noexcept
 {
   //
   // External interrupts cannot be injected into the
   // guest if guest isn't interruptible (e.g.: guest
-  // is blocked by "mov ss", or EFLAGS.IF == 0).
+  // is blocked by "mov ss", or EFLAGS.IF == 0), or if
+  // another event is already being injected.
   //
-  if (interrupt.type() == vmx::interrupt_type::external)
+  if (interrupt.type() == vmx::interrupt_type::external &&
+      (event_injected_ || !interrupt_window_open()))
   {
-    bool interruptible = exit_context().rflags.interrupt_enable_flag &&
-                         guest_interruptibility_state().flags;
+    const auto vector = static_cast<uint32_t>(interrupt.vector());
+    pending_interrupt_[vector / 64] |= 1ull << (vector % 64);
 
-    if (!interruptible)
-    {
-      //
-      // Make sure there aren't too much pending interrupts.
-      // We don't want the queue to overflow.
-      //
-      hvpp_assert(pending_interrupt_count_ < pending_interrupt_queue_size);
+    interrupt_window_exiting(true);
 
-      if (first)
-      {
-        //
-        // Enqueue pending interrupt ("push_front").
-        //
-        pending_interrupt_first_ = !pending_interrupt_first_
-          ? pending_interrupt_queue_size - 1
-          : pending_interrupt_first_ - 1;
-
-        pending_interrupt_[pending_interrupt_first_] = interrupt;
-        pending_interrupt_count_ += 1;
-      }
-      else
-      {
-        //
-        // Enqueue pending interrupt ("push_back").
-        //
-        auto index = (pending_interrupt_first_ + pending_interrupt_count_) % pending_interrupt_queue_size;
-
-        pending_interrupt_[index] = interrupt;
-        pending_interrupt_count_ += 1;
-      }
-
-      //
-      // Enable Interrupt-window exiting.
-      //
-      auto procbased_ctls = processor_based_controls();
-      procbased_ctls.interrupt_window_exiting = true;
-      processor_based_controls(procbased_ctls);
-
-      //
-      // "false" signalizes that the interrupt hasn't been
-      // immediately injected.
-      //
-      return false;
-    }
+    //
+    // "false" signalizes that the interrupt hasn't been
+    // immediately injected.
+    //
+    return false;
   }
 
   //
@@ -108,6 +113,7 @@ bool vcpu_t::interrupt_inject(interrupt_t interrupt, bool first /*= false */) no
 void vcpu_t::interrupt_inject_force(interrupt_t interrupt) noexcept
 {
   entry_interruption_info(interrupt.info_);
+  event_injected_ = interrupt.valid();
 
   if (interrupt.valid())
   {
@@ -205,30 +211,56 @@ void vcpu_t::interrupt_inject_pending() noexcept
   //
   // Make sure there is at least 1 pending interrupt.
   //
-  hvpp_assert(
-    interrupt_is_pending()   &&
-    pending_interrupt_count_ <= pending_interrupt_queue_size
-  );
+  hvpp_assert(interrupt_is_pending());
 
   //
-  // Dequeue pending interrupt ("pop_front").
+  // Dequeue the pending interrupt with the highest vector.
   //
-  auto interrupt = pending_interrupt_[pending_interrupt_first_];
+  for (int index = 3; index >= 0; --index)
+  {
+    if (pending_interrupt_[index])
+    {
+      const auto bit = ia32_asm_bsr(pending_interrupt_[index]);
+      pending_interrupt_[index] &= ~(1ull << bit);
 
-  pending_interrupt_first_ += 1;
-  pending_interrupt_count_ -= 1;
+      interrupt_inject_force(interrupt_t{
+        vmx::interrupt_type::external,
+        static_cast<exception_vector>(index * 64 + bit)
+      });
 
-  if (!pending_interrupt_count_ || pending_interrupt_first_ == pending_interrupt_queue_size)
-  {
-    pending_interrupt_first_ = 0;
+      break;
+    }
   }
 
-  interrupt_inject_force(interrupt);
+  if (!interrupt_is_pending())
+  {
+    interrupt_window_exiting(false);
+  }
 }
 
 bool vcpu_t::interrupt_is_pending() const noexcept
 {
-  return pending_interrupt_count_ > 0;
+  return (pending_interrupt_[0] | pending_interrupt_[1] |
+          pending_interrupt_[2] | pending_interrupt_[3]) != 0;
+}
+
+bool vcpu_t::interrupt_window_open() const noexcept
+{
+  const auto interruptibility_state = guest_interruptibility_state();
+
+  return exit_context_.rflags.interrupt_enable_flag &&
+         !interruptibility_state.blocking_by_sti &&
+         !interruptibility_state.blocking_by_mov_ss;
+}
+
+void vcpu_t::interrupt_window_exiting(bool enable) noexcept
+{
+  if (processor_based_controls_.interrupt_window_exiting != enable)
+  {
+    auto procbased_ctls = processor_based_controls_;
+    procbased_ctls.interrupt_window_exiting = enable;
+    processor_based_controls(procbased_ctls);
+  }
 }
 
 auto vcpu_t::exit_instruction_info_guest_va() const noexcept -> void*
@@ -263,156 +295,195 @@ auto vcpu_t::exit_instruction_info_guest_va() const noexcept -> void*
 auto vcpu_t::vcpu_id() const noexcept -> uint16_t
 {
   uint16_t result;
-  vmx::vmread(vmx::vmcs_t::field::ctrl_virtual_processor_identifier, result);
+  vmcs_read(vmx::vmcs_t::field::ctrl_virtual_processor_identifier, result);
   return result;
 }
 
 void vcpu_t::vcpu_id(uint16_t virtual_processor_identifier) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_virtual_processor_identifier, virtual_processor_identifier);
+  vmcs_write(vmx::vmcs_t::field::ctrl_virtual_processor_identifier, virtual_processor_identifier);
 }
 
 auto vcpu_t::ept_pointer() const noexcept -> ept_ptr_t
 {
   ept_ptr_t result;
-  vmx::vmread(vmx::vmcs_t::field::ctrl_ept_pointer, result);
+  vmcs_read(vmx::vmcs_t::field::ctrl_ept_pointer, result);
   return result;
 }
 
 void vcpu_t::ept_pointer(ept_ptr_t ept_pointer) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_ept_pointer, ept_pointer);
+  vmcs_write(vmx::vmcs_t::field::ctrl_ept_pointer, ept_pointer);
 }
 
 auto vcpu_t::vmcs_link_pointer() const noexcept -> pa_t
 {
   pa_t result;
-  vmx::vmread(vmx::vmcs_t::field::guest_vmcs_link_pointer, result);
+  vmcs_read(vmx::vmcs_t::field::guest_vmcs_link_pointer, result);
   return result;
 }
 
 void vcpu_t::vmcs_link_pointer(pa_t link_pointer) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_vmcs_link_pointer, link_pointer);
+  vmcs_write(vmx::vmcs_t::field::guest_vmcs_link_pointer, link_pointer);
+}
+
+auto vcpu_t::capabilities() const noexcept -> const vmx::capabilities_t&
+{
+  return caps_;
 }
 
 auto vcpu_t::pin_based_controls() const noexcept -> msr::vmx_pinbased_ctls_t
 {
   msr::vmx_pinbased_ctls_t result;
-  vmx::vmread(vmx::vmcs_t::field::ctrl_pin_based_vm_execution_controls, result);
+  vmcs_read(vmx::vmcs_t::field::ctrl_pin_based_vm_execution_controls, result);
   return result;
 }
 
 void vcpu_t::pin_based_controls(msr::vmx_pinbased_ctls_t controls) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_pin_based_vm_execution_controls, vmx::adjust(controls));
+  vmcs_write(vmx::vmcs_t::field::ctrl_pin_based_vm_execution_controls, vmx::adjust(controls, caps_));
 }
 
 auto vcpu_t::processor_based_controls() const noexcept -> msr::vmx_procbased_ctls_t
 {
-  msr::vmx_procbased_ctls_t result;
-  vmx::vmread(vmx::vmcs_t::field::ctrl_processor_based_vm_execution_controls, result);
-  return result;
+  //
+  // Modified only through the setter below - no need to VMREAD it.
+  //
+  return processor_based_controls_;
 }
 
 void vcpu_t::processor_based_controls(msr::vmx_procbased_ctls_t controls) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_processor_based_vm_execution_controls, vmx::adjust(controls));
+  processor_based_controls_ = vmx::adjust(controls, caps_);
+  vmcs_write(vmx::vmcs_t::field::ctrl_processor_based_vm_execution_controls, processor_based_controls_);
 }
 
 auto vcpu_t::processor_based_controls2() const noexcept -> msr::vmx_procbased_ctls2_t
 {
   msr::vmx_procbased_ctls2_t result;
-  vmx::vmread(vmx::vmcs_t::field::ctrl_secondary_processor_based_vm_execution_controls, result);
+  vmcs_read(vmx::vmcs_t::field::ctrl_secondary_processor_based_vm_execution_controls, result);
   return result;
 }
 
 void vcpu_t::processor_based_controls2(msr::vmx_procbased_ctls2_t controls) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_secondary_processor_based_vm_execution_controls, vmx::adjust(controls));
+  vmcs_write(vmx::vmcs_t::field::ctrl_secondary_processor_based_vm_execution_controls, vmx::adjust(controls, caps_));
 }
 
 auto vcpu_t::vm_entry_controls() const noexcept -> msr::vmx_entry_ctls_t
 {
   msr::vmx_entry_ctls_t result;
-  vmx::vmread(vmx::vmcs_t::field::ctrl_vmentry_controls, result);
+  vmcs_read(vmx::vmcs_t::field::ctrl_vmentry_controls, result);
   return result;
 }
 
 void vcpu_t::vm_entry_controls(msr::vmx_entry_ctls_t controls) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_vmentry_controls, vmx::adjust(controls));
+  vmcs_write(vmx::vmcs_t::field::ctrl_vmentry_controls, vmx::adjust(controls, caps_));
 }
 
 auto vcpu_t::vm_exit_controls() const noexcept -> msr::vmx_exit_ctls_t
 {
   msr::vmx_exit_ctls_t result;
-  vmx::vmread(vmx::vmcs_t::field::ctrl_vmexit_controls, result);
+  vmcs_read(vmx::vmcs_t::field::ctrl_vmexit_controls, result);
   return result;
 }
 
 void vcpu_t::vm_exit_controls(msr::vmx_exit_ctls_t controls) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_vmexit_controls, vmx::adjust(controls));
+  vmcs_write(vmx::vmcs_t::field::ctrl_vmexit_controls, vmx::adjust(controls, caps_));
 }
 
 auto vcpu_t::exception_bitmap() const noexcept -> vmx::exception_bitmap_t
 {
   vmx::exception_bitmap_t result;
-  vmx::vmread(vmx::vmcs_t::field::ctrl_exception_bitmap, result);
+  vmcs_read(vmx::vmcs_t::field::ctrl_exception_bitmap, result);
   return result;
 }
 
 void vcpu_t::exception_bitmap(vmx::exception_bitmap_t exception_bitmap) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_exception_bitmap, exception_bitmap);
+  vmcs_write(vmx::vmcs_t::field::ctrl_exception_bitmap, exception_bitmap);
 }
 
 auto vcpu_t::msr_bitmap() const noexcept -> const vmx::msr_bitmap_t&
 {
-  return msr_bitmap_;
+  return *msr_bitmap_active_;
 }
 
 void vcpu_t::msr_bitmap(const vmx::msr_bitmap_t& msr_bitmap) noexcept
 {
   msr_bitmap_ = msr_bitmap;
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_msr_bitmap_address, pa_t::from_va(msr_bitmap_.data));
+  msr_bitmap_share(msr_bitmap_);
 }
 
 auto vcpu_t::io_bitmap() const noexcept -> const vmx::io_bitmap_t&
 {
-  return io_bitmap_;
+  return *io_bitmap_active_;
 }
 
 void vcpu_t::io_bitmap(const vmx::io_bitmap_t& io_bitmap) noexcept
 {
   io_bitmap_ = io_bitmap;
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_io_bitmap_a_address, pa_t::from_va(io_bitmap_.a));
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_io_bitmap_b_address, pa_t::from_va(io_bitmap_.b));
+  io_bitmap_share(io_bitmap_);
+}
+
+void vcpu_t::msr_bitmap_share(const vmx::msr_bitmap_t& msr_bitmap) noexcept
+{
+  msr_bitmap_active_ = &msr_bitmap;
+  vmcs_write(vmx::vmcs_t::field::ctrl_msr_bitmap_address, pa_t::from_va(msr_bitmap.data));
+}
+
+void vcpu_t::io_bitmap_share(const vmx::io_bitmap_t& io_bitmap) noexcept
+{
+  io_bitmap_active_ = &io_bitmap;
+  vmcs_write(vmx::vmcs_t::field::ctrl_io_bitmap_a_address, pa_t::from_va(io_bitmap.a));
+  vmcs_write(vmx::vmcs_t::field::ctrl_io_bitmap_b_address, pa_t::from_va(io_bitmap.b));
+}
+
+auto vcpu_t::msr_bitmap_private() noexcept -> vmx::msr_bitmap_t&
+{
+  if (msr_bitmap_active_ != &msr_bitmap_)
+  {
+    msr_bitmap(*msr_bitmap_active_);
+  }
+
+  return msr_bitmap_;
+}
+
+auto vcpu_t::io_bitmap_private() noexcept -> vmx::io_bitmap_t&
+{
+  if (io_bitmap_active_ != &io_bitmap_)
+  {
+    io_bitmap(*io_bitmap_active_);
+  }
+
+  return io_bitmap_;
 }
 
 auto vcpu_t::pagefault_error_code_mask() const noexcept -> pagefault_error_code_t
 {
   pagefault_error_code_t result;
-  vmx::vmread(vmx::vmcs_t::field::ctrl_pagefault_error_code_mask, result);
+  vmcs_read(vmx::vmcs_t::field::ctrl_pagefault_error_code_mask, result);
   return result;
 }
 
 void vcpu_t::pagefault_error_code_mask(pagefault_error_code_t mask) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_pagefault_error_code_mask, mask);
+  vmcs_write(vmx::vmcs_t::field::ctrl_pagefault_error_code_mask, mask);
 }
 
 auto vcpu_t::pagefault_error_code_match() const noexcept -> pagefault_error_code_t
 {
   pagefault_error_code_t result;
-  vmx::vmread(vmx::vmcs_t::field::ctrl_pagefault_error_code_match, result);
+  vmcs_read(vmx::vmcs_t::field::ctrl_pagefault_error_code_match, result);
   return result;
 }
 
 void vcpu_t::pagefault_error_code_match(pagefault_error_code_t match) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_pagefault_error_code_match, match);
+  vmcs_write(vmx::vmcs_t::field::ctrl_pagefault_error_code_match, match);
 }
 
 //
@@ -422,166 +493,201 @@ void vcpu_t::pagefault_error_code_match(pagefault_error_code_t match) noexcept
 auto vcpu_t::cr0_guest_host_mask() const noexcept -> cr0_t
 {
   cr0_t cr0;
-  vmx::vmread(vmx::vmcs_t::field::ctrl_cr0_guest_host_mask, cr0);
+  vmcs_read(vmx::vmcs_t::field::ctrl_cr0_guest_host_mask, cr0);
   return cr0;
 }
 
 void vcpu_t::cr0_guest_host_mask(cr0_t cr0) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_cr0_guest_host_mask, cr0);
+  vmcs_write(vmx::vmcs_t::field::ctrl_cr0_guest_host_mask, cr0);
 }
 
 auto vcpu_t::cr0_shadow() const noexcept -> cr0_t
 {
   cr0_t cr0;
-  vmx::vmread(vmx::vmcs_t::field::ctrl_cr0_read_shadow, cr0);
+  vmcs_read(vmx::vmcs_t::field::ctrl_cr0_read_shadow, cr0);
   return cr0;
 }
 
 void vcpu_t::cr0_shadow(cr0_t cr0) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_cr0_read_shadow, cr0);
+  vmcs_write(vmx::vmcs_t::field::ctrl_cr0_read_shadow, cr0);
 }
 
 auto vcpu_t::cr4_guest_host_mask() const noexcept -> cr4_t
 {
   cr4_t cr4;
-  vmx::vmread(vmx::vmcs_t::field::ctrl_cr4_guest_host_mask, cr4);
+  vmcs_read(vmx::vmcs_t::field::ctrl_cr4_guest_host_mask, cr4);
   return cr4;
 }
 
 void vcpu_t::cr4_guest_host_mask(cr4_t cr4) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_cr4_guest_host_mask, cr4);
+  vmcs_write(vmx::vmcs_t::field::ctrl_cr4_guest_host_mask, cr4);
 }
 
 auto vcpu_t::cr4_shadow() const noexcept -> cr4_t
 {
   cr4_t cr4;
-  vmx::vmread(vmx::vmcs_t::field::ctrl_cr4_read_shadow, cr4);
+  vmcs_read(vmx::vmcs_t::field::ctrl_cr4_read_shadow, cr4);
   return cr4;
 }
 
 void vcpu_t::cr4_shadow(cr4_t cr4) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_cr4_read_shadow, cr4);
+  vmcs_write(vmx::vmcs_t::field::ctrl_cr4_read_shadow, cr4);
+}
+
+auto vcpu_t::cr3_target_count() const noexcept -> uint32_t
+{
+  uint32_t result;
+  vmcs_read(vmx::vmcs_t::field::ctrl_cr3_target_count, result);
+  return result;
+}
+
+void vcpu_t::cr3_target_count(uint32_t count) noexcept
+{
+  hvpp_assert(count <= msr::read<msr::vmx_misc_t>().cr3_target_count);
+  vmcs_write(vmx::vmcs_t::field::ctrl_cr3_target_count, count);
+}
+
+auto vcpu_t::cr3_target_value(uint32_t index) const noexcept -> cr3_t
+{
+  hvpp_assert(index < 4);
+
+  static constexpr vmx::vmcs_t::field fields[] = {
+    vmx::vmcs_t::field::ctrl_cr3_target_value_0,
+    vmx::vmcs_t::field::ctrl_cr3_target_value_1,
+    vmx::vmcs_t::field::ctrl_cr3_target_value_2,
+    vmx::vmcs_t::field::ctrl_cr3_target_value_3,
+  };
+
+  cr3_t cr3;
+  vmcs_read(fields[index], cr3);
+  return cr3;
+}
+
+void vcpu_t::cr3_target_value(uint32_t index, cr3_t cr3) noexcept
+{
+  hvpp_assert(index < 4);
+
+  static constexpr vmx::vmcs_t::field fields[] = {
+    vmx::vmcs_t::field::ctrl_cr3_target_value_0,
+    vmx::vmcs_t::field::ctrl_cr3_target_value_1,
+    vmx::vmcs_t::field::ctrl_cr3_target_value_2,
+    vmx::vmcs_t::field::ctrl_cr3_target_value_3,
+  };
+
+  vmcs_write(fields[index], cr3);
 }
 
 auto vcpu_t::entry_instruction_length() const noexcept -> uint32_t
 {
   uint32_t result;
-  vmx::vmread(vmx::vmcs_t::field::ctrl_vmentry_instruction_length, result);
+  vmcs_read(vmx::vmcs_t::field::ctrl_vmentry_instruction_length, result);
   return result;
 }
 
 void vcpu_t::entry_instruction_length(uint32_t instruction_length) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_vmentry_instruction_length, instruction_length);
+  vmcs_write(vmx::vmcs_t::field::ctrl_vmentry_instruction_length, instruction_length);
 }
 
 auto vcpu_t::entry_interruption_info() const noexcept -> vmx::interrupt_info_t
 {
   vmx::interrupt_info_t result;
-  vmx::vmread(vmx::vmcs_t::field::ctrl_vmentry_interruption_info, result);
+  vmcs_read(vmx::vmcs_t::field::ctrl_vmentry_interruption_info, result);
   return result;
 }
 
 void vcpu_t::entry_interruption_info(vmx::interrupt_info_t info) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_vmentry_interruption_info, info);
+  vmcs_write(vmx::vmcs_t::field::ctrl_vmentry_interruption_info, info);
 }
 
 auto vcpu_t::entry_interruption_error_code() const noexcept -> exception_error_code_t
 {
   exception_error_code_t result;
-  vmx::vmread(vmx::vmcs_t::field::ctrl_vmentry_exception_error_code, result);
+  vmcs_read(vmx::vmcs_t::field::ctrl_vmentry_exception_error_code, result);
   return result;
 }
 
 void vcpu_t::entry_interruption_error_code(exception_error_code_t error_code) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_vmentry_exception_error_code, error_code);
+  vmcs_write(vmx::vmcs_t::field::ctrl_vmentry_exception_error_code, error_code);
 }
 
 //
 // exit state
 //
 
+template <typename T>
+auto vcpu_t::exit_cache_read(uint32_t flag, T& value, vmx::vmcs_t::field field) const noexcept -> T
+{
+  if (!(exit_cache_.valid & flag))
+  {
+    vmcs_read(field, value);
+    exit_cache_.valid |= flag;
+  }
+
+  return value;
+}
+
 auto vcpu_t::exit_instruction_error() const noexcept -> vmx::instruction_error
 {
   vmx::instruction_error result;
-  vmx::vmread(vmx::vmcs_t::field::vmexit_instruction_error, result);
+  vmcs_read(vmx::vmcs_t::field::vmexit_instruction_error, result);
   return result;
 }
 
 auto vcpu_t::exit_instruction_info() const noexcept -> vmx::instruction_info_t
 {
-  vmx::instruction_info_t result;
-  vmx::vmread(vmx::vmcs_t::field::vmexit_instruction_info, result);
-  return result;
+  return exit_cache_read(vcpu_exit_cache_t::instruction_info, exit_cache_.exit_instruction_info, vmx::vmcs_t::field::vmexit_instruction_info);
 }
 
 auto vcpu_t::exit_instruction_length() const noexcept -> uint32_t
 {
-  uint32_t result;
-  vmx::vmread(vmx::vmcs_t::field::vmexit_instruction_length, result);
-  return result;
+  return exit_cache_read(vcpu_exit_cache_t::instruction_length, exit_cache_.exit_instruction_length, vmx::vmcs_t::field::vmexit_instruction_length);
 }
 
 auto vcpu_t::exit_interruption_info() const noexcept -> vmx::interrupt_info_t
 {
-  vmx::interrupt_info_t result;
-  vmx::vmread(vmx::vmcs_t::field::vmexit_interruption_info, result);
-  return result;
+  return exit_cache_read(vcpu_exit_cache_t::interruption_info, exit_cache_.exit_interruption_info, vmx::vmcs_t::field::vmexit_interruption_info);
 }
 
 auto vcpu_t::exit_interruption_error_code() const noexcept -> exception_error_code_t
 {
-  exception_error_code_t result;
-  vmx::vmread(vmx::vmcs_t::field::vmexit_interruption_error_code, result);
-  return result;
+  return exit_cache_read(vcpu_exit_cache_t::interruption_error_code, exit_cache_.exit_interruption_error_code, vmx::vmcs_t::field::vmexit_interruption_error_code);
 }
 
 auto vcpu_t::exit_idt_vectoring_info() const noexcept -> vmx::interrupt_info_t
 {
-  vmx::interrupt_info_t result;
-  vmx::vmread(vmx::vmcs_t::field::vmexit_idt_vectoring_info, result);
-  return result;
+  return exit_cache_read(vcpu_exit_cache_t::idt_vectoring_info, exit_cache_.exit_idt_vectoring_info, vmx::vmcs_t::field::vmexit_idt_vectoring_info);
 }
 
 auto vcpu_t::exit_idt_vectoring_error_code() const noexcept -> exception_error_code_t
 {
-  exception_error_code_t result;
-  vmx::vmread(vmx::vmcs_t::field::vmexit_idt_vectoring_error_code, result);
-  return result;
+  return exit_cache_read(vcpu_exit_cache_t::idt_vectoring_error_code, exit_cache_.exit_idt_vectoring_error_code, vmx::vmcs_t::field::vmexit_idt_vectoring_error_code);
 }
 
 auto vcpu_t::exit_reason() const noexcept -> vmx::exit_reason
 {
-  vmx::exit_reason result;
-  vmx::vmread(vmx::vmcs_t::field::vmexit_reason, result);
-  return result;
+  return exit_cache_read(vcpu_exit_cache_t::reason, exit_cache_.exit_reason, vmx::vmcs_t::field::vmexit_reason);
 }
 
 auto vcpu_t::exit_qualification() const noexcept -> vmx::exit_qualification_t
 {
-  vmx::exit_qualification_t result;
-  vmx::vmread(vmx::vmcs_t::field::vmexit_qualification, result);
-  return result;
+  return exit_cache_read(vcpu_exit_cache_t::qualification, exit_cache_.exit_qualification, vmx::vmcs_t::field::vmexit_qualification);
 }
 
 auto vcpu_t::exit_guest_physical_address() const noexcept -> pa_t
 {
-  pa_t result;
-  vmx::vmread(vmx::vmcs_t::field::vmexit_guest_physical_address, result);
-  return result;
+  return exit_cache_read(vcpu_exit_cache_t::guest_physical_address, exit_cache_.exit_guest_physical_address, vmx::vmcs_t::field::vmexit_guest_physical_address);
 }
 
 auto vcpu_t::exit_guest_linear_address() const noexcept -> va_t
 {
-  va_t result;
-  vmx::vmread(vmx::vmcs_t::field::vmexit_guest_linear_address, result);
-  return result;
+  return exit_cache_read(vcpu_exit_cache_t::guest_linear_address, exit_cache_.exit_guest_linear_address, vmx::vmcs_t::field::vmexit_guest_linear_address);
 }
 
 //
@@ -591,325 +697,337 @@ auto vcpu_t::exit_guest_linear_address() const noexcept -> va_t
 auto vcpu_t::guest_cr0() const noexcept -> cr0_t
 {
   cr0_t cr0;
-  vmx::vmread(vmx::vmcs_t::field::guest_cr0, cr0);
+  vmcs_read(vmx::vmcs_t::field::guest_cr0, cr0);
   return cr0;
 }
 
 void vcpu_t::guest_cr0(cr0_t cr0) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_cr0, cr0);
+  vmcs_write(vmx::vmcs_t::field::guest_cr0, cr0);
 }
 
 auto vcpu_t::guest_cr3() const noexcept -> cr3_t
 {
   cr3_t cr3;
-  vmx::vmread(vmx::vmcs_t::field::guest_cr3, cr3);
+  vmcs_read(vmx::vmcs_t::field::guest_cr3, cr3);
   return cr3;
 }
 
 void vcpu_t::guest_cr3(cr3_t cr3) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_cr3, cr3);
+  vmcs_write(vmx::vmcs_t::field::guest_cr3, cr3);
 }
 
 auto vcpu_t::guest_cr4() const noexcept -> cr4_t
 {
   cr4_t cr4;
-  vmx::vmread(vmx::vmcs_t::field::guest_cr4, cr4);
+  vmcs_read(vmx::vmcs_t::field::guest_cr4, cr4);
   return cr4;
 }
 
 void vcpu_t::guest_cr4(cr4_t cr4) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_cr4, cr4);
+  vmcs_write(vmx::vmcs_t::field::guest_cr4, cr4);
 }
 
 auto vcpu_t::guest_dr7() const noexcept -> dr7_t
 {
   dr7_t dr7;
-  vmx::vmread(vmx::vmcs_t::field::guest_dr7, dr7);
+  vmcs_read(vmx::vmcs_t::field::guest_dr7, dr7);
 
   return dr7;
 }
 
 void vcpu_t::guest_dr7(dr7_t dr7) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_dr7, dr7);
+  vmcs_write(vmx::vmcs_t::field::guest_dr7, dr7);
 }
 
 auto vcpu_t::guest_debugctl() const noexcept -> msr::debugctl_t
 {
   msr::debugctl_t debugctl;
-  vmx::vmread(vmx::vmcs_t::field::guest_debugctl, debugctl);
+  vmcs_read(vmx::vmcs_t::field::guest_debugctl, debugctl);
   return debugctl;
 }
 
 void vcpu_t::guest_debugctl(msr::debugctl_t debugctl) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_debugctl, debugctl);
+  vmcs_write(vmx::vmcs_t::field::guest_debugctl, debugctl);
+}
+
+auto vcpu_t::guest_efer() const noexcept -> msr::efer_t
+{
+  msr::efer_t efer;
+  vmcs_read(vmx::vmcs_t::field::guest_efer, efer);
+  return efer;
+}
+
+void vcpu_t::guest_efer(msr::efer_t efer) noexcept
+{
+  vmcs_write(vmx::vmcs_t::field::guest_efer, efer);
 }
 
 auto vcpu_t::guest_rsp() const noexcept -> uint64_t
 {
   uint64_t rsp;
-  vmx::vmread(vmx::vmcs_t::field::guest_rsp, rsp);
+  vmcs_read(vmx::vmcs_t::field::guest_rsp, rsp);
   return rsp;
 }
 
 void vcpu_t::guest_rsp(uint64_t rsp) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_rsp, rsp);
+  vmcs_write(vmx::vmcs_t::field::guest_rsp, rsp);
 }
 
 auto vcpu_t::guest_rip() const noexcept -> uint64_t
 {
   uint64_t rip;
-  vmx::vmread(vmx::vmcs_t::field::guest_rip, rip);
+  vmcs_read(vmx::vmcs_t::field::guest_rip, rip);
   return rip;
 }
 
 void vcpu_t::guest_rip(uint64_t rip) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_rip, rip);
+  vmcs_write(vmx::vmcs_t::field::guest_rip, rip);
 }
 
 auto vcpu_t::guest_rflags() const noexcept -> rflags_t
 {
   rflags_t rflags;
-  vmx::vmread(vmx::vmcs_t::field::guest_rflags, rflags);
+  vmcs_read(vmx::vmcs_t::field::guest_rflags, rflags);
   return rflags;
 }
 
 void vcpu_t::guest_rflags(rflags_t rflags) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_rflags, rflags);
+  vmcs_write(vmx::vmcs_t::field::guest_rflags, rflags);
 }
 
 auto vcpu_t::guest_gdtr() const noexcept -> gdtr_t
 {
   gdtr_t gdtr;
-  vmx::vmread(vmx::vmcs_t::field::guest_gdtr_base, gdtr.base_address);
-  vmx::vmread(vmx::vmcs_t::field::guest_gdtr_limit, gdtr.limit);
+  vmcs_read(vmx::vmcs_t::field::guest_gdtr_base, gdtr.base_address);
+  vmcs_read(vmx::vmcs_t::field::guest_gdtr_limit, gdtr.limit);
   return gdtr;
 }
 
 void vcpu_t::guest_gdtr(gdtr_t gdtr) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_gdtr_base, gdtr.base_address);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_gdtr_limit, gdtr.limit);
+  vmcs_write(vmx::vmcs_t::field::guest_gdtr_base, gdtr.base_address);
+  vmcs_write(vmx::vmcs_t::field::guest_gdtr_limit, gdtr.limit);
 }
 
 auto vcpu_t::guest_idtr() const noexcept -> idtr_t
 {
   idtr_t idtr;
-  vmx::vmread(vmx::vmcs_t::field::guest_idtr_base, idtr.base_address);
-  vmx::vmread(vmx::vmcs_t::field::guest_idtr_limit, idtr.limit);
+  vmcs_read(vmx::vmcs_t::field::guest_idtr_base, idtr.base_address);
+  vmcs_read(vmx::vmcs_t::field::guest_idtr_limit, idtr.limit);
   return idtr;
 }
 
 void vcpu_t::guest_idtr(idtr_t idtr) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_idtr_base, idtr.base_address);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_idtr_limit, idtr.limit);
+  vmcs_write(vmx::vmcs_t::field::guest_idtr_base, idtr.base_address);
+  vmcs_write(vmx::vmcs_t::field::guest_idtr_limit, idtr.limit);
 }
 
 auto vcpu_t::guest_cs() const noexcept -> segment_t<cs_t>
 {
   segment_t<cs_t> cs;
-  vmx::vmread(vmx::vmcs_t::field::guest_cs_base, cs.base_address);
-  vmx::vmread(vmx::vmcs_t::field::guest_cs_limit, cs.limit);
-  vmx::vmread(vmx::vmcs_t::field::guest_cs_access_rights, cs.access);
-  vmx::vmread(vmx::vmcs_t::field::guest_cs_selector, cs.selector);
+  vmcs_read(vmx::vmcs_t::field::guest_cs_base, cs.base_address);
+  vmcs_read(vmx::vmcs_t::field::guest_cs_limit, cs.limit);
+  vmcs_read(vmx::vmcs_t::field::guest_cs_access_rights, cs.access);
+  vmcs_read(vmx::vmcs_t::field::guest_cs_selector, cs.selector);
   return cs;
 }
 
 void vcpu_t::guest_cs(segment_t<cs_t> cs) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_cs_base, cs.base_address /* 0 */);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_cs_limit, cs.limit);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_cs_access_rights, cs.access);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_cs_selector, cs.selector);
+  vmcs_write(vmx::vmcs_t::field::guest_cs_base, cs.base_address /* 0 */);
+  vmcs_write(vmx::vmcs_t::field::guest_cs_limit, cs.limit);
+  vmcs_write(vmx::vmcs_t::field::guest_cs_access_rights, cs.access);
+  vmcs_write(vmx::vmcs_t::field::guest_cs_selector, cs.selector);
 }
 
 auto vcpu_t::guest_ds() const noexcept -> segment_t<ds_t>
 {
   segment_t<ds_t> ds;
-  vmx::vmread(vmx::vmcs_t::field::guest_ds_base, ds.base_address);
-  vmx::vmread(vmx::vmcs_t::field::guest_ds_limit, ds.limit);
-  vmx::vmread(vmx::vmcs_t::field::guest_ds_access_rights, ds.access);
-  vmx::vmread(vmx::vmcs_t::field::guest_ds_selector, ds.selector);
+  vmcs_read(vmx::vmcs_t::field::guest_ds_base, ds.base_address);
+  vmcs_read(vmx::vmcs_t::field::guest_ds_limit, ds.limit);
+  vmcs_read(vmx::vmcs_t::field::guest_ds_access_rights, ds.access);
+  vmcs_read(vmx::vmcs_t::field::guest_ds_selector, ds.selector);
 
   return ds;
 }
 
 void vcpu_t::guest_ds(segment_t<ds_t> ds) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_ds_base, ds.base_address /* 0 */);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_ds_limit, ds.limit);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_ds_access_rights, ds.access);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_ds_selector, ds.selector);
+  vmcs_write(vmx::vmcs_t::field::guest_ds_base, ds.base_address /* 0 */);
+  vmcs_write(vmx::vmcs_t::field::guest_ds_limit, ds.limit);
+  vmcs_write(vmx::vmcs_t::field::guest_ds_access_rights, ds.access);
+  vmcs_write(vmx::vmcs_t::field::guest_ds_selector, ds.selector);
 }
 
 auto vcpu_t::guest_es() const noexcept -> segment_t<es_t>
 {
   segment_t<es_t> es;
-  vmx::vmread(vmx::vmcs_t::field::guest_es_base, es.base_address);
-  vmx::vmread(vmx::vmcs_t::field::guest_es_limit, es.limit);
-  vmx::vmread(vmx::vmcs_t::field::guest_es_access_rights, es.access);
-  vmx::vmread(vmx::vmcs_t::field::guest_es_selector, es.selector);
+  vmcs_read(vmx::vmcs_t::field::guest_es_base, es.base_address);
+  vmcs_read(vmx::vmcs_t::field::guest_es_limit, es.limit);
+  vmcs_read(vmx::vmcs_t::field::guest_es_access_rights, es.access);
+  vmcs_read(vmx::vmcs_t::field::guest_es_selector, es.selector);
 
   return es;
 }
 
 void vcpu_t::guest_es(segment_t<es_t> es) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_es_base, es.base_address /* 0 */);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_es_limit, es.limit);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_es_access_rights, es.access);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_es_selector, es.selector);
+  vmcs_write(vmx::vmcs_t::field::guest_es_base, es.base_address /* 0 */);
+  vmcs_write(vmx::vmcs_t::field::guest_es_limit, es.limit);
+  vmcs_write(vmx::vmcs_t::field::guest_es_access_rights, es.access);
+  vmcs_write(vmx::vmcs_t::field::guest_es_selector, es.selector);
 }
 
 auto vcpu_t::guest_fs() const noexcept -> segment_t<fs_t>
 {
   segment_t<fs_t> fs;
-  vmx::vmread(vmx::vmcs_t::field::guest_fs_base, fs.base_address);
-  vmx::vmread(vmx::vmcs_t::field::guest_fs_limit, fs.limit);
-  vmx::vmread(vmx::vmcs_t::field::guest_fs_access_rights, fs.access);
-  vmx::vmread(vmx::vmcs_t::field::guest_fs_selector, fs.selector);
+  vmcs_read(vmx::vmcs_t::field::guest_fs_base, fs.base_address);
+  vmcs_read(vmx::vmcs_t::field::guest_fs_limit, fs.limit);
+  vmcs_read(vmx::vmcs_t::field::guest_fs_access_rights, fs.access);
+  vmcs_read(vmx::vmcs_t::field::guest_fs_selector, fs.selector);
 
   return fs;
 }
 
 void vcpu_t::guest_fs(segment_t<fs_t> fs) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_fs_base, fs.base_address);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_fs_limit, fs.limit);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_fs_access_rights, fs.access);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_fs_selector, fs.selector);
+  vmcs_write(vmx::vmcs_t::field::guest_fs_base, fs.base_address);
+  vmcs_write(vmx::vmcs_t::field::guest_fs_limit, fs.limit);
+  vmcs_write(vmx::vmcs_t::field::guest_fs_access_rights, fs.access);
+  vmcs_write(vmx::vmcs_t::field::guest_fs_selector, fs.selector);
 }
 
 auto vcpu_t::guest_gs() const noexcept -> segment_t<gs_t>
 {
   segment_t<gs_t> gs;
-  vmx::vmread(vmx::vmcs_t::field::guest_gs_base, gs.base_address);
-  vmx::vmread(vmx::vmcs_t::field::guest_gs_limit, gs.limit);
-  vmx::vmread(vmx::vmcs_t::field::guest_gs_access_rights, gs.access);
-  vmx::vmread(vmx::vmcs_t::field::guest_gs_selector, gs.selector);
+  vmcs_read(vmx::vmcs_t::field::guest_gs_base, gs.base_address);
+  vmcs_read(vmx::vmcs_t::field::guest_gs_limit, gs.limit);
+  vmcs_read(vmx::vmcs_t::field::guest_gs_access_rights, gs.access);
+  vmcs_read(vmx::vmcs_t::field::guest_gs_selector, gs.selector);
 
   return gs;
 }
 
 void vcpu_t::guest_gs(segment_t<gs_t> gs) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_gs_base, gs.base_address);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_gs_limit, gs.limit);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_gs_access_rights, gs.access);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_gs_selector, gs.selector);
+  vmcs_write(vmx::vmcs_t::field::guest_gs_base, gs.base_address);
+  vmcs_write(vmx::vmcs_t::field::guest_gs_limit, gs.limit);
+  vmcs_write(vmx::vmcs_t::field::guest_gs_access_rights, gs.access);
+  vmcs_write(vmx::vmcs_t::field::guest_gs_selector, gs.selector);
 }
 
 auto vcpu_t::guest_ss() const noexcept -> segment_t<ss_t>
 {
   segment_t<ss_t> ss;
-  vmx::vmread(vmx::vmcs_t::field::guest_ss_base, ss.base_address);
-  vmx::vmread(vmx::vmcs_t::field::guest_ss_limit, ss.limit);
-  vmx::vmread(vmx::vmcs_t::field::guest_ss_access_rights, ss.access);
-  vmx::vmread(vmx::vmcs_t::field::guest_ss_selector, ss.selector);
+  vmcs_read(vmx::vmcs_t::field::guest_ss_base, ss.base_address);
+  vmcs_read(vmx::vmcs_t::field::guest_ss_limit, ss.limit);
+  vmcs_read(vmx::vmcs_t::field::guest_ss_access_rights, ss.access);
+  vmcs_read(vmx::vmcs_t::field::guest_ss_selector, ss.selector);
 
   return ss;
 }
 
 void vcpu_t::guest_ss(segment_t<ss_t> ss) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_ss_base, ss.base_address /* 0 */);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_ss_limit, ss.limit);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_ss_access_rights, ss.access);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_ss_selector, ss.selector);
+  vmcs_write(vmx::vmcs_t::field::guest_ss_base, ss.base_address /* 0 */);
+  vmcs_write(vmx::vmcs_t::field::guest_ss_limit, ss.limit);
+  vmcs_write(vmx::vmcs_t::field::guest_ss_access_rights, ss.access);
+  vmcs_write(vmx::vmcs_t::field::guest_ss_selector, ss.selector);
 }
 
 auto vcpu_t::guest_tr() const noexcept -> segment_t<tr_t>
 {
   segment_t<tr_t> tr;
-  vmx::vmread(vmx::vmcs_t::field::guest_tr_base, tr.base_address);
-  vmx::vmread(vmx::vmcs_t::field::guest_tr_limit, tr.limit);
-  vmx::vmread(vmx::vmcs_t::field::guest_tr_access_rights, tr.access);
-  vmx::vmread(vmx::vmcs_t::field::guest_tr_selector, tr.selector);
+  vmcs_read(vmx::vmcs_t::field::guest_tr_base, tr.base_address);
+  vmcs_read(vmx::vmcs_t::field::guest_tr_limit, tr.limit);
+  vmcs_read(vmx::vmcs_t::field::guest_tr_access_rights, tr.access);
+  vmcs_read(vmx::vmcs_t::field::guest_tr_selector, tr.selector);
 
   return tr;
 }
 
 void vcpu_t::guest_tr(segment_t<tr_t> tr) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_tr_base, tr.base_address);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_tr_limit, tr.limit);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_tr_access_rights, tr.access);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_tr_selector, tr.selector);
+  vmcs_write(vmx::vmcs_t::field::guest_tr_base, tr.base_address);
+  vmcs_write(vmx::vmcs_t::field::guest_tr_limit, tr.limit);
+  vmcs_write(vmx::vmcs_t::field::guest_tr_access_rights, tr.access);
+  vmcs_write(vmx::vmcs_t::field::guest_tr_selector, tr.selector);
 }
 
 auto vcpu_t::guest_ldtr() const noexcept -> segment_t<ldtr_t>
 {
   segment_t<ldtr_t> ldtr;
-  vmx::vmread(vmx::vmcs_t::field::guest_ldtr_base, ldtr.base_address);
-  vmx::vmread(vmx::vmcs_t::field::guest_ldtr_limit, ldtr.limit);
-  vmx::vmread(vmx::vmcs_t::field::guest_ldtr_access_rights, ldtr.access);
-  vmx::vmread(vmx::vmcs_t::field::guest_ldtr_selector, ldtr.selector);
+  vmcs_read(vmx::vmcs_t::field::guest_ldtr_base, ldtr.base_address);
+  vmcs_read(vmx::vmcs_t::field::guest_ldtr_limit, ldtr.limit);
+  vmcs_read(vmx::vmcs_t::field::guest_ldtr_access_rights, ldtr.access);
+  vmcs_read(vmx::vmcs_t::field::guest_ldtr_selector, ldtr.selector);
 
   return ldtr;
 }
 
 void vcpu_t::guest_ldtr(segment_t<ldtr_t> ldtr) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_ldtr_base, ldtr.base_address);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_ldtr_limit, ldtr.limit);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_ldtr_access_rights, ldtr.access);
-  vmx::vmwrite(vmx::vmcs_t::field::guest_ldtr_selector, ldtr.selector);
+  vmcs_write(vmx::vmcs_t::field::guest_ldtr_base, ldtr.base_address);
+  vmcs_write(vmx::vmcs_t::field::guest_ldtr_limit, ldtr.limit);
+  vmcs_write(vmx::vmcs_t::field::guest_ldtr_access_rights, ldtr.access);
+  vmcs_write(vmx::vmcs_t::field::guest_ldtr_selector, ldtr.selector);
 }
 
 auto vcpu_t::guest_segment_base_address(int index) const noexcept -> void*
 {
   void* result;
-  vmx::vmread(vmx::vmcs_t::field::guest_es_base + (index << 1), result);
+  vmcs_read(vmx::vmcs_t::field::guest_es_base + (index << 1), result);
   return result;
 }
 
 void vcpu_t::guest_segment_base_address(int index, void* base_address) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_es_base + (index << 1), base_address);
+  vmcs_write(vmx::vmcs_t::field::guest_es_base + (index << 1), base_address);
 }
 
 auto vcpu_t::guest_segment_limit(int index) const noexcept -> uint32_t
 {
   uint32_t result;
-  vmx::vmread(vmx::vmcs_t::field::guest_es_limit + (index << 1), result);
+  vmcs_read(vmx::vmcs_t::field::guest_es_limit + (index << 1), result);
   return result;
 }
 
 void vcpu_t::guest_segment_limit(int index, uint32_t limit) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_es_limit + (index << 1), limit);
+  vmcs_write(vmx::vmcs_t::field::guest_es_limit + (index << 1), limit);
 }
 
 auto vcpu_t::guest_segment_access(int index) const noexcept -> segment_access_vmx_t
 {
   segment_access_vmx_t result;
-  vmx::vmread(vmx::vmcs_t::field::guest_es_access_rights + (index << 1), result);
+  vmcs_read(vmx::vmcs_t::field::guest_es_access_rights + (index << 1), result);
   return result;
 }
 
 void vcpu_t::guest_segment_access(int index, segment_access_vmx_t access_rights) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_es_access_rights + (index << 1), access_rights);
+  vmcs_write(vmx::vmcs_t::field::guest_es_access_rights + (index << 1), access_rights);
 }
 
 auto vcpu_t::guest_segment_selector(int index) const noexcept -> segment_selector_t
 {
   segment_selector_t result;
-  vmx::vmread(vmx::vmcs_t::field::guest_es_selector + (index << 1), result);
+  vmcs_read(vmx::vmcs_t::field::guest_es_selector + (index << 1), result);
   return result;
 }
 
 void vcpu_t::guest_segment_selector(int index, segment_selector_t selector) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_es_selector + (index << 1), selector);
+  vmcs_write(vmx::vmcs_t::field::guest_es_selector + (index << 1), selector);
 }
 
 auto vcpu_t::guest_segment(int index) const noexcept -> segment_t<>
@@ -937,13 +1055,25 @@ void vcpu_t::guest_segment(int index, segment_t<> seg) noexcept
 auto vcpu_t::guest_interruptibility_state() const noexcept -> vmx::interruptibility_state_t
 {
   vmx::interruptibility_state_t interruptibility_state;
-  vmx::vmread(vmx::vmcs_t::field::guest_interruptibility_state, interruptibility_state);
+  vmcs_read(vmx::vmcs_t::field::guest_interruptibility_state, interruptibility_state);
   return interruptibility_state;
 }
 
 void vcpu_t::guest_interruptibility_state(vmx::interruptibility_state_t interruptibility_state) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_interruptibility_state, interruptibility_state);
+  vmcs_write(vmx::vmcs_t::field::guest_interruptibility_state, interruptibility_state);
+}
+
+auto vcpu_t::guest_vmx_preemption_timer_value() const noexcept -> uint32_t
+{
+  uint32_t value;
+  vmcs_read(vmx::vmcs_t::field::guest_vmx_preemption_timer_value, value);
+  return value;
+}
+
+void vcpu_t::guest_vmx_preemption_timer_value(uint32_t value) noexcept
+{
+  vmcs_write(vmx::vmcs_t::field::guest_vmx_preemption_timer_value, value);
 }
 
 //
@@ -953,61 +1083,73 @@ void vcpu_t::guest_interruptibility_state(vmx::interruptibility_state_t interrup
 auto vcpu_t::host_cr0() const noexcept -> cr0_t
 {
   cr0_t cr0;
-  vmx::vmread(vmx::vmcs_t::field::host_cr0, cr0);
+  vmcs_read(vmx::vmcs_t::field::host_cr0, cr0);
   return cr0;
 }
 
 void vcpu_t::host_cr0(cr0_t cr0) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::host_cr0, cr0);
+  vmcs_write(vmx::vmcs_t::field::host_cr0, cr0);
 }
 
 auto vcpu_t::host_cr3() const noexcept -> cr3_t
 {
   cr3_t cr3;
-  vmx::vmread(vmx::vmcs_t::field::host_cr3, cr3);
+  vmcs_read(vmx::vmcs_t::field::host_cr3, cr3);
   return cr3;
 }
 
 void vcpu_t::host_cr3(cr3_t cr3) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::host_cr3, cr3);
+  vmcs_write(vmx::vmcs_t::field::host_cr3, cr3);
 }
 
 auto vcpu_t::host_cr4() const noexcept -> cr4_t
 {
   cr4_t cr4;
-  vmx::vmread(vmx::vmcs_t::field::host_cr4, cr4);
+  vmcs_read(vmx::vmcs_t::field::host_cr4, cr4);
   return cr4;
 }
 
 void vcpu_t::host_cr4(cr4_t cr4) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::host_cr4, cr4);
+  vmcs_write(vmx::vmcs_t::field::host_cr4, cr4);
+}
+
+auto vcpu_t::host_efer() const noexcept -> msr::efer_t
+{
+  msr::efer_t efer;
+  vmcs_read(vmx::vmcs_t::field::host_efer, efer);
+  return efer;
+}
+
+void vcpu_t::host_efer(msr::efer_t efer) noexcept
+{
+  vmcs_write(vmx::vmcs_t::field::host_efer, efer);
 }
 
 auto vcpu_t::host_rsp() const noexcept -> uint64_t
 {
   uint64_t rsp;
-  vmx::vmread(vmx::vmcs_t::field::host_rsp, rsp);
+  vmcs_read(vmx::vmcs_t::field::host_rsp, rsp);
   return rsp;
 }
 
 void vcpu_t::host_rsp(uint64_t rsp) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::host_rsp, rsp);
+  vmcs_write(vmx::vmcs_t::field::host_rsp, rsp);
 }
 
 auto vcpu_t::host_rip() const noexcept -> uint64_t
 {
   uint64_t rip;
-  vmx::vmread(vmx::vmcs_t::field::host_rip, rip);
+  vmcs_read(vmx::vmcs_t::field::host_rip, rip);
   return rip;
 }
 
 void vcpu_t::host_rip(uint64_t rip) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::host_rip, rip);
+  vmcs_write(vmx::vmcs_t::field::host_rip, rip);
 }
 
 //
@@ -1025,27 +1167,27 @@ void vcpu_t::host_rip(uint64_t rip) noexcept
 auto vcpu_t::host_gdtr() const noexcept -> gdtr_t
 {
   gdtr_t gdtr;
-  vmx::vmread(vmx::vmcs_t::field::host_gdtr_base, gdtr.base_address);
+  vmcs_read(vmx::vmcs_t::field::host_gdtr_base, gdtr.base_address);
   gdtr.limit = 0xffff;
   return gdtr;
 }
 
 void vcpu_t::host_gdtr(gdtr_t gdtr) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::host_gdtr_base, gdtr.base_address);
+  vmcs_write(vmx::vmcs_t::field::host_gdtr_base, gdtr.base_address);
 }
 
 auto vcpu_t::host_idtr() const noexcept -> idtr_t
 {
   idtr_t idtr;
-  vmx::vmread(vmx::vmcs_t::field::host_idtr_base, idtr.base_address);
+  vmcs_read(vmx::vmcs_t::field::host_idtr_base, idtr.base_address);
   idtr.limit = 0xffff;
   return idtr;
 }
 
 void vcpu_t::host_idtr(idtr_t idtr) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::host_idtr_base, idtr.base_address);
+  vmcs_write(vmx::vmcs_t::field::host_idtr_base, idtr.base_address);
 }
 
 //
@@ -1066,91 +1208,91 @@ void vcpu_t::host_idtr(idtr_t idtr) noexcept
 auto vcpu_t::host_cs() const noexcept -> segment_t<cs_t>
 {
   segment_t<cs_t> cs;
-  vmx::vmread(vmx::vmcs_t::field::host_cs_selector, cs.selector);
+  vmcs_read(vmx::vmcs_t::field::host_cs_selector, cs.selector);
   return cs;
 }
 
 void vcpu_t::host_cs(segment_t<cs_t> cs) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::host_cs_selector, cs.selector.index * 8);
+  vmcs_write(vmx::vmcs_t::field::host_cs_selector, cs.selector.index * 8);
 }
 
 auto vcpu_t::host_ds() const noexcept -> segment_t<ds_t>
 {
   segment_t<ds_t> ds;
-  vmx::vmread(vmx::vmcs_t::field::host_ds_selector, ds.selector);
+  vmcs_read(vmx::vmcs_t::field::host_ds_selector, ds.selector);
   return ds;
 }
 
 void vcpu_t::host_ds(segment_t<ds_t> ds) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::host_ds_selector, ds.selector.index * 8);
+  vmcs_write(vmx::vmcs_t::field::host_ds_selector, ds.selector.index * 8);
 }
 
 auto vcpu_t::host_es() const noexcept -> segment_t<es_t>
 {
   segment_t<es_t> es;
-  vmx::vmread(vmx::vmcs_t::field::host_es_selector, es.selector);
+  vmcs_read(vmx::vmcs_t::field::host_es_selector, es.selector);
   return es;
 }
 
 void vcpu_t::host_es(segment_t<es_t> es) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::host_es_selector, es.selector.index * 8);
+  vmcs_write(vmx::vmcs_t::field::host_es_selector, es.selector.index * 8);
 }
 
 auto vcpu_t::host_fs() const noexcept -> segment_t<fs_t>
 {
   segment_t<fs_t> fs;
-  vmx::vmread(vmx::vmcs_t::field::host_fs_selector, fs.selector);
-  vmx::vmread(vmx::vmcs_t::field::host_fs_base, fs.base_address);
+  vmcs_read(vmx::vmcs_t::field::host_fs_selector, fs.selector);
+  vmcs_read(vmx::vmcs_t::field::host_fs_base, fs.base_address);
   return fs;
 }
 
 void vcpu_t::host_fs(segment_t<fs_t> fs) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::host_fs_selector, fs.selector.index * 8);
-  vmx::vmwrite(vmx::vmcs_t::field::host_fs_base, fs.base_address);
+  vmcs_write(vmx::vmcs_t::field::host_fs_selector, fs.selector.index * 8);
+  vmcs_write(vmx::vmcs_t::field::host_fs_base, fs.base_address);
 }
 
 auto vcpu_t::host_gs() const noexcept -> segment_t<gs_t>
 {
   segment_t<gs_t> gs;
-  vmx::vmread(vmx::vmcs_t::field::host_gs_selector, gs.selector);
-  vmx::vmread(vmx::vmcs_t::field::host_gs_base, gs.base_address);
+  vmcs_read(vmx::vmcs_t::field::host_gs_selector, gs.selector);
+  vmcs_read(vmx::vmcs_t::field::host_gs_base, gs.base_address);
   return gs;
 }
 
 void vcpu_t::host_gs(segment_t<gs_t> gs) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::host_gs_selector, gs.selector.index * 8);
-  vmx::vmwrite(vmx::vmcs_t::field::host_gs_base, gs.base_address);
+  vmcs_write(vmx::vmcs_t::field::host_gs_selector, gs.selector.index * 8);
+  vmcs_write(vmx::vmcs_t::field::host_gs_base, gs.base_address);
 }
 
 auto vcpu_t::host_ss() const noexcept -> segment_t<ss_t>
 {
   segment_t<ss_t> ss;
-  vmx::vmread(vmx::vmcs_t::field::host_ss_selector, ss.selector);
+  vmcs_read(vmx::vmcs_t::field::host_ss_selector, ss.selector);
   return ss;
 }
 
 void vcpu_t::host_ss(segment_t<ss_t> ss) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::host_ss_selector, ss.selector.index * 8);
+  vmcs_write(vmx::vmcs_t::field::host_ss_selector, ss.selector.index * 8);
 }
 
 auto vcpu_t::host_tr() const noexcept -> segment_t<tr_t>
 {
   segment_t<tr_t> tr;
-  vmx::vmread(vmx::vmcs_t::field::host_tr_selector, tr.selector);
-  vmx::vmread(vmx::vmcs_t::field::host_tr_base, tr.base_address);
+  vmcs_read(vmx::vmcs_t::field::host_tr_selector, tr.selector);
+  vmcs_read(vmx::vmcs_t::field::host_tr_base, tr.base_address);
   return tr;
 }
 
 void vcpu_t::host_tr(segment_t<tr_t> tr) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::host_tr_selector, tr.selector.index * 8);
-  vmx::vmwrite(vmx::vmcs_t::field::host_tr_base, tr.base_address);
+  vmcs_write(vmx::vmcs_t::field::host_tr_selector, tr.selector.index * 8);
+  vmcs_write(vmx::vmcs_t::field::host_tr_base, tr.base_address);
 }
 
 }
@@ -0,0 +1,176 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+namespace hvpp {
+
+//
+// Commands posted to a VCPU by other CPUs (see vcpu_t::command_post()
+// and hypervisor::command_post()).
+//
+// Commands are processed by the VCPU itself, in the order in which they
+// have been posted, at the beginning of its next VM-exit (before the
+// VM-exit handler runs).  Commands which aren't handled by the VCPU are
+// passed to vmexit_handler::handle_command().
+//
+enum class vcpu_command_type : uint32_t
+{
+  none,
+
+  //
+  // Map the guest page arg[1] to the host page arg[2] (with the access
+  // rights in its low 3 bits, see epte_t::access_type) in the EPT view
+  // arg[0] of the VCPU.  Large pages are split.
+  //
+  ept_map_4kb,
+
+  //
+  // Invalidate EPT-derived mappings of the EPT view arg[0] (or of all
+  // EPTs, if arg[0] is ept_all) - e.g. after the issuer has changed
+  // the shared EPT.
+  //
+  ept_invalidate,
+
+  //
+  // Clear VM-exit statistics of the VCPU (see vmexit_stats_handler).
+  //
+  stats_reset,
+
+  //
+  // Trace next arg[1] VM-exits of the reason arg[0] on the VCPU, even
+  // if the reason isn't enabled in the trace bitmap (see
+  // vmexit_stats_handler).
+  //
+  trace_arm,
+
+  //
+  // Leave the VMX operation on the next CPUID VM-exit of the VCPU
+  // (hypervisor::command_post() with "kick" causes one).
+  //
+  terminate,
+
+  //
+  // Commands from here on are defined by the VM-exit handler.
+  //
+  user = 0x10000,
+};
+
+struct vcpu_command_t
+{
+  static constexpr uint64_t ept_all = ~0ull;
+
+  vcpu_command_type type;
+  uint32_t          reserved;
+  uint64_t          arg[3];
+};
+
+static_assert(sizeof(vcpu_command_t) == 32);
+
+//
+// Lock-free multi-producer, single-consumer ring of commands.
+//
+// A slot is reserved by compare-exchange of the head and published by
+// its sequence number (same as work_queue), so the issuer never waits
+// for the VCPU.  If the ring is full, the command is dropped and
+// post() returns false.
+//
+class vcpu_mailbox
+{
+  public:
+    static constexpr uint32_t capacity = 64;
+
+    vcpu_mailbox() noexcept
+      : head_{ 0 }
+      , tail_{ 0 }
+      , dropped_{ 0 }
+      , slot_{}
+    {
+
+    }
+
+    vcpu_mailbox(const vcpu_mailbox& other) noexcept = delete;
+    vcpu_mailbox(vcpu_mailbox&& other) noexcept = delete;
+    vcpu_mailbox& operator=(const vcpu_mailbox& other) noexcept = delete;
+    vcpu_mailbox& operator=(vcpu_mailbox&& other) noexcept = delete;
+
+    //
+    // Can be called from any CPU (and from the VMX-root mode).
+    //
+    bool post(const vcpu_command_t& command) noexcept
+    {
+      auto head = head_.load(std::memory_order_relaxed);
+
+      do
+      {
+        if (head - tail_.load(std::memory_order_acquire) >= capacity)
+        {
+          dropped_.fetch_add(1, std::memory_order_relaxed);
+          return false;
+        }
+      } while (!head_.compare_exchange_weak(head, head + 1, std::memory_order_relaxed));
+
+      auto& slot = slot_[head % capacity];
+      slot.command = command;
+
+      //
+      // Publish the command.
+      //
+      slot.sequence.store(head + 1, std::memory_order_release);
+      return true;
+    }
+
+    //
+    // Call "function" for each published command - called only by the
+    // VCPU.  Processing stops at the first slot which has been reserved
+    // but not published yet (it's picked up by the next drain()).
+    //
+    template <
+      typename TFunction
+    >
+    uint32_t drain(TFunction function) noexcept
+    {
+      auto tail = tail_.load(std::memory_order_relaxed);
+      uint32_t count = 0;
+
+      for (;;)
+      {
+        const auto& slot = slot_[tail % capacity];
+
+        if (slot.sequence.load(std::memory_order_acquire) != tail + 1)
+        {
+          break;
+        }
+
+        const auto command = slot.command;
+
+        tail += 1;
+        tail_.store(tail, std::memory_order_release);
+
+        function(command);
+        count += 1;
+      }
+
+      return count;
+    }
+
+    bool empty() const noexcept
+    { return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_relaxed); }
+
+    uint64_t dropped_count() const noexcept
+    { return dropped_.load(std::memory_order_relaxed); }
+
+  private:
+    struct slot_t
+    {
+      std::atomic_uint64_t sequence;      // index + 1 when published
+      vcpu_command_t       command;
+    };
+
+    std::atomic_uint64_t head_;
+    std::atomic_uint64_t tail_;           // written only by the VCPU
+    std::atomic_uint64_t dropped_;
+
+    slot_t               slot_[capacity];
+};
+
+}
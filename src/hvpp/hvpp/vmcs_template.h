@@ -0,0 +1,103 @@
+#pragma once
+#include "ia32/vmx.h"
+
+#include <cstdint>
+#include <cstring>
+
+namespace hvpp {
+
+using namespace ia32;
+
+//
+// Values of VMCS fields shared by all VCPUs.
+//
+// The first VCPU captures the fields after it has set up its VMCS
+// (see vcpu_t::setup()), the remaining VCPUs then replay them as a tight
+// loop of VMWRITEs and set only fields which differ between CPUs (host
+// stack, descriptor-table and segment bases, VPID, ...) - instead of
+// building each value again.
+//
+// The template is used only by VCPUs with the same VMX capabilities as
+// the capturing one, so that the replayed controls are always valid.
+// The template must not be modified while it's replayed.
+//
+// Usage:
+//   vmcs_template_t vmcs_template;
+//
+//   vp0.launch(&vmcs_template);    // captures
+//   vp1.launch(&vmcs_template);    // replays
+//
+
+class vmcs_template_t
+{
+  public:
+    static constexpr int max_field_count = 32;
+
+    vmcs_template_t() noexcept
+      : caps_{}
+      , field_{}
+      , value_{}
+      , field_count_{ 0 }
+      , valid_{ false }
+    {
+
+    }
+
+    vmcs_template_t(const vmcs_template_t& other) noexcept = delete;
+    vmcs_template_t(vmcs_template_t&& other) noexcept = delete;
+    vmcs_template_t& operator=(const vmcs_template_t& other) noexcept = delete;
+    vmcs_template_t& operator=(vmcs_template_t&& other) noexcept = delete;
+
+    bool is_valid() const noexcept
+    { return valid_; }
+
+    bool matches(const vmx::capabilities_t& caps) const noexcept
+    { return valid_ && !memcmp(&caps_, &caps, sizeof(caps_)); }
+
+    void reset() noexcept
+    {
+      field_count_ = 0;
+      valid_ = false;
+    }
+
+    //
+    // Capture current values of the fields from the current VMCS.
+    //
+    template <
+      int COUNT
+    >
+    void capture(const vmx::capabilities_t& caps, const vmx::vmcs_t::field (&fields)[COUNT]) noexcept
+    {
+      static_assert(COUNT <= max_field_count);
+
+      for (int i = 0; i < COUNT; ++i)
+      {
+        field_[i] = fields[i];
+        vmx::vmread(fields[i], value_[i]);
+      }
+
+      caps_ = caps;
+      field_count_ = COUNT;
+      valid_ = true;
+    }
+
+    //
+    // Write captured values into the current VMCS.
+    //
+    void replay() const noexcept
+    {
+      for (int i = 0; i < field_count_; ++i)
+      {
+        vmx::vmwrite(field_[i], value_[i]);
+      }
+    }
+
+  private:
+    vmx::capabilities_t caps_;
+    vmx::vmcs_t::field  field_[max_field_count];
+    uint64_t            value_[max_field_count];
+    int                 field_count_;
+    bool                valid_;
+};
+
+}
@@ -82,7 +82,22 @@ vmexit_handler::~vmexit_handler() noexcept
 
 }
 
+void vmexit_handler::prepare(vcpu_t& vp) noexcept
+{
+  (void)(vp);
+}
+
 void vmexit_handler::setup(vcpu_t& vp) noexcept
+{
+  attach(vp);
+}
+
+void vmexit_handler::attach(vcpu_t& vp) noexcept
+{
+  (void)(vp);
+}
+
+void vmexit_handler::detach(vcpu_t& vp) noexcept
 {
   (void)(vp);
 }
@@ -98,6 +113,12 @@ void vmexit_handler::invoke_termination(vcpu_t& vp) noexcept
   (void)(vp);
 }
 
+void vmexit_handler::handle_command(vcpu_t& vp, const vcpu_command_t& command) noexcept
+{
+  (void)(vp);
+  (void)(command);
+}
+
 //
 // "Do-nothing" handlers for all VM-exits.
 // VMX-instruction related VM-exits (VMREAD, VMWRITE, INVEPT, ...)
@@ -2,38 +2,88 @@
 #include "ia32/arch.h"
 
 #include "lib/error.h"
+#include "lib/typelist.h"
 
 #include "vcpu.h"
 
 #include <array>
+#include <type_traits>
 
 namespace hvpp {
 
 using namespace ia32;
 
+//
+// Categories of sub-reasons of vmexit_storage_t.  Each category has its
+// own sub-storage (see vmexit_substorage_t), the storage consists only
+// of the categories it's instantiated with - e.g. storage of VM-exit
+// reasons and CPUID leafs takes ~100 items instead of ~200k:
+//
+//   using storage_t = vmexit_storage_t<uint32_t, 16, 16,
+//                                      type_list<vmexit_storage_category::cpuid>>;
+//
+// Storage of VM-exit reasons ("vmexit") is always present.
+//
+
+namespace vmexit_storage_category
+{
+  struct vmexit       {};
+  struct expt_vector  {};
+  struct cpuid        {};
+  struct mov_cr       {};
+  struct mov_dr       {};
+  struct gdtr_idtr    {};
+  struct ldtr_tr      {};
+  struct io           {};
+  struct msr          {};
+
+  //
+  // Order of the categories defines the layout of the storage.
+  //
+  using all = type_list<
+    expt_vector,
+    cpuid,
+    mov_cr,
+    mov_dr,
+    gdtr_idtr,
+    ldtr_tr,
+    io,
+    msr
+    >;
+}
+
 template <
+  typename CATEGORY,
   typename T,
-  size_t CPUID_0_MAX = 16,
-  size_t CPUID_8_MAX = 16
+  size_t CPUID_0_MAX,
+  size_t CPUID_8_MAX
 >
-struct vmexit_storage_t
-{
-  static constexpr size_t cpuid_0_max = CPUID_0_MAX;
-  static constexpr size_t cpuid_8_max = CPUID_8_MAX;
+struct vmexit_substorage_t;
 
+template <typename T, size_t CPUID_0_MAX, size_t CPUID_8_MAX>
+struct vmexit_substorage_t<vmexit_storage_category::vmexit, T, CPUID_0_MAX, CPUID_8_MAX>
+{
   //
   // Storage for each VM-exit reason (ia32::vmx::exit_reason).
   // Currently the highest ID of exit reason is 65.
   //
   std::array<T, 65>           vmexit;
+};
 
+template <typename T, size_t CPUID_0_MAX, size_t CPUID_8_MAX>
+struct vmexit_substorage_t<vmexit_storage_category::expt_vector, T, CPUID_0_MAX, CPUID_8_MAX>
+{
   //
   // Storage for each interrupt and exception vector (ia32::exception_vector).
   // This is subcategory of exit_reason::exception_or_nmi (0) and
   // exit_reason::external_interrupt (1).
   //
   std::array<T, 256>          expt_vector;
+};
 
+template <typename T, size_t CPUID_0_MAX, size_t CPUID_8_MAX>
+struct vmexit_substorage_t<vmexit_storage_category::cpuid, T, CPUID_0_MAX, CPUID_8_MAX>
+{
   //
   // Storage for each CPUID instruction:
   //   - cpuid_0:     CPUID with eax in range [ 0x0000'0000 - (0x0000'0000 + cpuid_0_max) ]
@@ -41,10 +91,14 @@ struct vmexit_storage_t
   //   - cpuid_other: CPUID with other eax values
   // This is subcategory of exit_reason::execute_cpuid (10).
   //
-  std::array<T, cpuid_0_max>  cpuid_0;
-  std::array<T, cpuid_8_max>  cpuid_8;
+  std::array<T, CPUID_0_MAX>  cpuid_0;
+  std::array<T, CPUID_8_MAX>  cpuid_8;
   T                           cpuid_other;
+};
 
+template <typename T, size_t CPUID_0_MAX, size_t CPUID_8_MAX>
+struct vmexit_substorage_t<vmexit_storage_category::mov_cr, T, CPUID_0_MAX, CPUID_8_MAX>
+{
   //
   // Storage for each MOV CR (from/to), CLTS and LMSW instruction.
   // Each array item in mov_from_cr/mov_to_cr represents counter for
@@ -55,7 +109,11 @@ struct vmexit_storage_t
   std::array<T, 8>            mov_to_cr;
   T                           clts;
   T                           lmsw;
+};
 
+template <typename T, size_t CPUID_0_MAX, size_t CPUID_8_MAX>
+struct vmexit_substorage_t<vmexit_storage_category::mov_dr, T, CPUID_0_MAX, CPUID_8_MAX>
+{
   //
   // Storage for each MOV DR (from/to) instruction.
   // Each array item in mov_from_dr/mov_to_dr represents storage for
@@ -64,7 +122,11 @@ struct vmexit_storage_t
   //
   std::array<T, 8>            mov_from_dr;
   std::array<T, 8>            mov_to_dr;
+};
 
+template <typename T, size_t CPUID_0_MAX, size_t CPUID_8_MAX>
+struct vmexit_substorage_t<vmexit_storage_category::gdtr_idtr, T, CPUID_0_MAX, CPUID_8_MAX>
+{
   //
   // Storage for each SGDT, SIDT, LGDT and LIDT instruction.
   // Each array item represents storage for specific instruction according
@@ -72,7 +134,11 @@ struct vmexit_storage_t
   // This is subcategory of exit_reason::gdtr_idtr_access (46).
   //
   std::array<T, 4>            gdtr_idtr;
+};
 
+template <typename T, size_t CPUID_0_MAX, size_t CPUID_8_MAX>
+struct vmexit_substorage_t<vmexit_storage_category::ldtr_tr, T, CPUID_0_MAX, CPUID_8_MAX>
+{
   //
   // Storage for each SLDT, STR, LLDT and LTR instruction.
   // Each array item represents storage for specific instruction according
@@ -80,7 +146,11 @@ struct vmexit_storage_t
   // This is subcategory of exit_reason::ldtr_tr_access (47).
   //
   std::array<T, 4>            ldtr_tr;
+};
 
+template <typename T, size_t CPUID_0_MAX, size_t CPUID_8_MAX>
+struct vmexit_substorage_t<vmexit_storage_category::io, T, CPUID_0_MAX, CPUID_8_MAX>
+{
   //
   // Storage for each IN/OUT (INS/OUTS) instructions.
   // Each array item represents storage for specific I/O port.
@@ -88,7 +158,11 @@ struct vmexit_storage_t
   //
   std::array<T, 0x10000>      io_in;
   std::array<T, 0x10000>      io_out;
+};
 
+template <typename T, size_t CPUID_0_MAX, size_t CPUID_8_MAX>
+struct vmexit_substorage_t<vmexit_storage_category::msr, T, CPUID_0_MAX, CPUID_8_MAX>
+{
   //
   // Storage for each RDMSR/WRMSR instructions.
   // Each array item represents storage for specific MSR number:
@@ -109,6 +183,68 @@ struct vmexit_storage_t
   T                           wrmsr_other;
 };
 
+template <
+  typename T,
+  size_t CPUID_0_MAX = 16,
+  size_t CPUID_8_MAX = 16,
+  typename CATEGORIES = vmexit_storage_category::all
+>
+struct vmexit_storage_t;
+
+template <
+  typename T,
+  size_t CPUID_0_MAX,
+  size_t CPUID_8_MAX,
+  typename ...CATEGORIES
+>
+struct vmexit_storage_t<T, CPUID_0_MAX, CPUID_8_MAX, type_list<CATEGORIES...>>
+  : vmexit_substorage_t<vmexit_storage_category::vmexit, T, CPUID_0_MAX, CPUID_8_MAX>
+  , vmexit_substorage_t<CATEGORIES, T, CPUID_0_MAX, CPUID_8_MAX>...
+{
+  using categories = type_list<CATEGORIES...>;
+
+  static constexpr size_t cpuid_0_max = CPUID_0_MAX;
+  static constexpr size_t cpuid_8_max = CPUID_8_MAX;
+
+  template <typename CATEGORY>
+  static constexpr bool has_category =
+    std::is_same_v<CATEGORY, vmexit_storage_category::vmexit> ||
+    (std::is_same_v<CATEGORY, CATEGORIES> || ...);
+};
+
+//
+// Call function(storages...) only if all storages have the CATEGORY.
+// The function should be a generic lambda - members of a category the
+// storage doesn't have would fail to compile otherwise:
+//
+//   vmexit_storage_if<vmexit_storage_category::io>([&](auto& s) {
+//     s.io_in[port] += 1;
+//   }, storage);
+//
+
+template <
+  typename CATEGORY,
+  typename TFunction,
+  typename ...TStorages
+>
+void vmexit_storage_if(TFunction&& function, TStorages&... storages) noexcept
+{
+  if constexpr ((std::remove_const_t<TStorages>::template has_category<CATEGORY> && ...))
+  {
+    function(storages...);
+  }
+}
+
+//
+// Result of vmexit_handler::handle_chained().
+//
+enum class vmexit_result
+{
+  next,                   // continue with the next handler
+  handled,                // the VM-exit has been handled, don't call other handlers
+  skip_remaining,         // skip the remaining handlers, except the last one
+};
+
 //
 // Abstract base class for VM-exit handlers.
 //
@@ -158,12 +294,42 @@ class vmexit_handler
     //
     virtual ~vmexit_handler() noexcept;
 
+    //
+    // This method is called on the CPU of the VCPU, before the VMX
+    // operation is entered.  All CPUs run it concurrently (at
+    // DISPATCH_LEVEL), so this is the right place for expensive
+    // per-VCPU preparation (e.g. memory allocation), which would
+    // otherwise stall all CPUs in setup().
+    //
+    // Avoid execution of any VMX instructions here.
+    //
+    virtual void prepare(vcpu_t& vp) noexcept;
+
     //
     // This method allows you to set up VCPU state before VMLAUNCH.
-    // Use this method for setting up VMCS.
+    // Use this method for setting up VMCS.  By default it calls
+    // attach() - override it only if the handler initializes the guest
+    // state (see vmexit_passthrough_handler).
     //
     virtual void setup(vcpu_t& vp) noexcept;
 
+    //
+    // Set up VM-execution controls, EPT and bitmaps the handler depends
+    // on.  This method is called by setup() before VMLAUNCH and, in the
+    // VMX-root mode, when the handler replaces another one on a running
+    // VCPU (see hypervisor::handler_swap()) - therefore it must not
+    // touch the guest state.
+    //
+    virtual void attach(vcpu_t& vp) noexcept;
+
+    //
+    // Counterpart of attach() - called in the VMX-root mode on the VCPU
+    // whose handler is being replaced, right before attach() of the new
+    // handler.  Tear down per-VCPU state here (e.g. controls which the
+    // new handler might not override).
+    //
+    virtual void detach(vcpu_t& vp) noexcept;
+
     //
     // This method is called on every VM-exit.
     // By default this method delegates the execution control
@@ -185,6 +351,37 @@ class vmexit_handler
     //
     virtual void invoke_termination(vcpu_t& vp) noexcept;
 
+    //
+    // This method is called (in the VMX-root mode) for each command
+    // posted to the mailbox of the VCPU which isn't processed by the
+    // VCPU itself (see vcpu_command_type) - before handle() is called
+    // for the current VM-exit.
+    //
+    virtual void handle_command(vcpu_t& vp, const vcpu_command_t& command) noexcept;
+
+    //
+    // Handlers composed by vmexit_compositor_handler can hide this
+    // method to declare - at compile time - which VM-exit reasons
+    // they are interested in.  The compositor then doesn't call their
+    // handle() method for other VM-exit reasons at all.
+    //
+    static constexpr bool handles_exit_reason(vmx::exit_reason exit_reason) noexcept
+    { (void)(exit_reason); return true; }
+
+    //
+    // Handlers composed by vmexit_compositor_handler (or by
+    // vmexit_pipeline_handler) can hide this method - the compositor
+    // then calls it instead of handle() and the result decides whether
+    // the next handlers are called.  E.g. a cheap filter can end the
+    // chain (vmexit_result::handled), or skip the remaining observers
+    // and go straight to the last handler (vmexit_result::skip_remaining).
+    //
+    // Handlers which don't hide it are called by handle() and the chain
+    // always continues.
+    //
+    vmexit_result handle_chained(vcpu_t& vp) noexcept
+    { handle(vp); return vmexit_result::next; }
+
   protected:
     //
     // Separate handlers for each VM-exit reason.
@@ -271,4 +468,13 @@ class vmexit_handler
     std::array<handler_fn_t, 65> handlers_;
 };
 
+//
+// True if the handler hides vmexit_handler::handle_chained().
+//
+template <
+  typename T
+>
+inline constexpr bool has_handle_chained_v =
+  !std::is_same_v<decltype(&T::handle_chained), decltype(&vmexit_handler::handle_chained)>;
+
 }
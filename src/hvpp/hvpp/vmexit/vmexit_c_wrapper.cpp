@@ -1,7 +1,10 @@
 #include "vmexit_c_wrapper.h"
 
+#include "hvpp/hypervisor.h"
 #include "hvpp/vcpu.h"
 
+#include "hvpp/lib/assert.h"
+
 namespace hvpp {
 
 vmexit_c_wrapper_handler::vmexit_c_wrapper_handler(const c_handler_array_t& c_handlers, void* context) noexcept
@@ -12,6 +15,10 @@ vmexit_c_wrapper_handler::vmexit_c_wrapper_handler(const c_handler_array_t& c_ha
 
   c_handlers_ = c_handlers;
   context_ = context;
+
+  const auto err = passthrough_context_.initialize();
+  hvpp_assert(!err);
+  (void)(err);
 }
 
 vmexit_c_wrapper_handler::~vmexit_c_wrapper_handler() noexcept
@@ -19,17 +26,30 @@ vmexit_c_wrapper_handler::~vmexit_c_wrapper_handler() noexcept
 
 }
 
-void vmexit_c_wrapper_handler::setup(vcpu_t& vp) noexcept
+void vmexit_c_wrapper_handler::attach(vcpu_t& vp) noexcept
 {
-  base_type::setup(vp);
+  base_type::attach(vp);
 
   //
   // Enable only 1 EPT table in C-wrapper for now.
   // The option of having multiple EPTs should be considered
   // in the future.
   //
-  vp.ept_enable();
-  vp.ept().map_identity();
+  // The identity map is shared between all VCPUs.
+  //
+  vp.ept_enable(hypervisor::shared_ept());
+
+  auto& context = passthrough_context_[vp.cpu_index()];
+  context.passthrough_routine      = passthrough_fn_t(&vmexit_c_wrapper_handler::handle_passthrough);
+  context.context                  = context_;
+  context.snapshot                 = &context.snapshot_data;
+  context.handler_instance         = this;
+  context.handler_method           = nullptr;
+  context.vcpu                     = &vp;
+  context.snapshot_data            = {};
+  context.snapshot_data.vcpu       = &vp;
+  context.snapshot_data.context    = &vp.exit_context();
+  context.snapshot_data.cpu_index  = vp.cpu_index();
 }
 
 void vmexit_c_wrapper_handler::handle(vcpu_t& vp) noexcept
@@ -46,12 +66,30 @@ void vmexit_c_wrapper_handler::handle(vcpu_t& vp) noexcept
     // C-handler has been defined - call that routine.
     //
 
-    passthrough_context context;
-    context.passthrough_routine = passthrough_fn_t(&vmexit_c_wrapper_handler::handle_passthrough);
-    context.context             = context_;
-    context.handler_instance    = this;
-    context.handler_method      = cpp_handler;
-    context.vcpu                = &vp;
+    auto& context = passthrough_context_[vp.cpu_index()];
+    context.handler_method = cpp_handler;
+
+    auto& snapshot = context.snapshot_data;
+    snapshot.ept                     = &vp.ept(vp.ept_index());
+    snapshot.exit_reason             = uint32_t(exit_reason_index);
+    snapshot.exit_qualification      = vp.exit_qualification().flags;
+    snapshot.exit_instruction_length = vp.exit_instruction_length();
+
+    if (exit_reason == vmx::exit_reason::ept_violation)
+    {
+      snapshot.exit_guest_physical_address = vp.exit_guest_physical_address().value();
+      snapshot.exit_guest_linear_address   = vp.exit_guest_linear_address().value();
+    }
+    else if (exit_reason == vmx::exit_reason::ept_misconfiguration)
+    {
+      snapshot.exit_guest_physical_address = vp.exit_guest_physical_address().value();
+      snapshot.exit_guest_linear_address   = 0;
+    }
+    else
+    {
+      snapshot.exit_guest_physical_address = 0;
+      snapshot.exit_guest_linear_address   = 0;
+    }
 
     c_handler(&vp, &context);
   }
@@ -1,7 +1,10 @@
 #pragma once
 #include "vmexit_passthrough.h"
 
+#include "hvpp/lib/per_cpu.h"
+
 #include <array>
+#include <cstdint>
 
 namespace hvpp {
 
@@ -18,28 +21,64 @@ class vmexit_c_wrapper_handler
 
     using c_handler_array_t = std::array<c_handler_fn_t, 65>;
 
+    //
+    // Commonly used fields of the VM-exit, filled before the C-handler
+    // is called - the handler doesn't have to call exported functions
+    // (HvppVmRead, HvppVcpuGetCurrentEpt, ...) for them.  Same layout as
+    // VMEXIT_SNAPSHOT in hvpp.h (checked in hvpp.cpp).
+    //
+    // Guest physical and linear addresses are filled only on EPT
+    // violation (and EPT misconfiguration - physical address only),
+    // they are 0 otherwise.
+    //
+    struct exit_snapshot
+    {
+      void*    vcpu;
+      void*    context;
+      void*    ept;
+      uint32_t cpu_index;
+      uint32_t exit_reason;
+      uint64_t exit_qualification;
+      uint32_t exit_instruction_length;
+      uint32_t reserved;
+      uint64_t exit_guest_physical_address;
+      uint64_t exit_guest_linear_address;
+    };
+
     vmexit_c_wrapper_handler(const c_handler_array_t& c_handlers, void* context = nullptr) noexcept;
     ~vmexit_c_wrapper_handler() noexcept override;
 
-    void setup(vcpu_t& vp) noexcept override;
+    void attach(vcpu_t& vp) noexcept override;
     void handle(vcpu_t& vp) noexcept override;
 
   private:
     using passthrough_fn_t = void(*)(void*);
 
+    //
+    // The first 3 members have the same layout as VMEXIT_PASSTHROUGH
+    // in hvpp.h.
+    //
     struct passthrough_context
     {
       passthrough_fn_t          passthrough_routine;
       void*                     context;
+      exit_snapshot*            snapshot;
       vmexit_c_wrapper_handler* handler_instance;
       handler_fn_t              handler_method;
       vcpu_t*                   vcpu;
+      exit_snapshot             snapshot_data;
     };
 
     static void handle_passthrough(passthrough_context* context) noexcept;
 
     c_handler_array_t c_handlers_;
     void* context_;
+
+    //
+    // Members which don't change between VM-exits are filled once,
+    // in setup().
+    //
+    per_cpu<passthrough_context> passthrough_context_;
 };
 
 }
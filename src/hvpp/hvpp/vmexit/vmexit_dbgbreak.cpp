@@ -2,18 +2,19 @@
 
 #include "hvpp/vcpu.h"
 
+#include "hvpp/ia32/asm.h"
+#include "hvpp/lib/assert.h"
 #include "hvpp/lib/debugger.h"
 
+#include <cstring>
 #include <iterator> // std::size()
 
-#define hvpp_break_if(value)                                    \
+#define hvpp_break_if(slot)                                     \
   do                                                            \
   {                                                             \
-    bool flag_clear = false;                                    \
-    bool flag_set   = true;                                     \
-    if (value.compare_exchange_strong(flag_set, flag_clear))    \
+    if (slot)                                                   \
     {                                                           \
-      debugger::breakpoint();                                   \
+      check(vp, slot);                                          \
     }                                                           \
   } while (0)
 
@@ -21,13 +22,16 @@ namespace hvpp {
 
 vmexit_dbgbreak_handler::vmexit_dbgbreak_handler() noexcept
   : storage_{}
+  , armed_{}
+  , breakpoint_{}
+  , breakpoint_count_{ 1 }
 {
   //
   // Uncomment this to break on IN 0x64 instruction.
   // Breakpoints on specific VM-exit reasons can be enabled/disabled
-  // via this structure.
+  // via breakpoint() and clear() methods.
   //
-  // storage_.io_in[0x64] = true;
+  // breakpoint(vmx::exit_reason::execute_io_instruction, storage_.io_in[0x64]);
   //
 }
 
@@ -36,123 +40,292 @@ vmexit_dbgbreak_handler::~vmexit_dbgbreak_handler() noexcept
 
 }
 
+auto vmexit_dbgbreak_handler::breakpoint(vmx::exit_reason exit_reason,
+                                         const condition_t& condition /* = {} */) noexcept -> error_code_t
+{
+  return breakpoint(exit_reason, storage_.vmexit[static_cast<int>(exit_reason)], condition);
+}
+
+auto vmexit_dbgbreak_handler::breakpoint(vmx::exit_reason exit_reason, uint8_t& slot,
+                                         const condition_t& condition /* = {} */) noexcept -> error_code_t
+{
+  const auto index = static_cast<uint32_t>(exit_reason);
+
+  hvpp_assert(index < std::size(storage_.vmexit));
+  hvpp_assert(reinterpret_cast<uint8_t*>(&slot) >= reinterpret_cast<uint8_t*>(&storage_) &&
+              reinterpret_cast<uint8_t*>(&slot) <  reinterpret_cast<uint8_t*>(&storage_ + 1));
+
+  if (index >= std::size(storage_.vmexit))
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  spinlock::guard _{ lock_ };
+
+  const auto breakpoint_index = allocate(condition);
+
+  if (!breakpoint_index)
+  {
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  //
+  // Publish the breakpoint first, then the slot and the summary bit -
+  // VCPUs which see the bit see the complete breakpoint.
+  //
+  std::atomic_thread_fence(std::memory_order_release);
+  slot = breakpoint_index;
+
+  armed_[index / 64].fetch_or(1ull << (index % 64), std::memory_order_release);
+
+  return error_code_t{};
+}
+
+void vmexit_dbgbreak_handler::clear() noexcept
+{
+  spinlock::guard _{ lock_ };
+
+  //
+  // Disarm the reasons first, so that VCPUs stop looking at the slots.
+  // Breakpoints aren't reused, they might be still evaluated by some
+  // VCPU.
+  //
+  armed_[0].store(0, std::memory_order_release);
+  armed_[1].store(0, std::memory_order_release);
+
+  memset(&storage_, 0, sizeof(storage_));
+}
+
+auto vmexit_dbgbreak_handler::allocate(const condition_t& condition) noexcept -> uint8_t
+{
+  //
+  // Index 0 means "no breakpoint".
+  //
+  if (breakpoint_count_ == max_breakpoint_count)
+  {
+    return 0;
+  }
+
+  auto& bp = breakpoint_[breakpoint_count_];
+  bp.condition = condition;
+  bp.condition.every_nth = condition.every_nth ? condition.every_nth : 1;
+  bp.hit_count.store(0, std::memory_order_relaxed);
+  bp.break_count.store(0, std::memory_order_relaxed);
+  bp.last_break_tsc.store(0, std::memory_order_relaxed);
+
+  return static_cast<uint8_t>(breakpoint_count_++);
+}
+
+void vmexit_dbgbreak_handler::check(vcpu_t& vp, uint8_t& slot) noexcept
+{
+  auto& bp = breakpoint_[slot];
+  const auto& condition = bp.condition;
+
+  //
+  // Filters are evaluated before any atomic operation.
+  //
+  if (condition.rip && condition.rip != vp.exit_context().rip)
+  {
+    return;
+  }
+
+  if (condition.cr3 && (condition.cr3 & ~0xfffull) != (vp.guest_cr3().flags & ~0xfffull))
+  {
+    return;
+  }
+
+  const auto hit = bp.hit_count.fetch_add(1, std::memory_order_relaxed) + 1;
+
+  if (hit <= condition.skip_count ||
+      (hit - condition.skip_count) % condition.every_nth != 0)
+  {
+    return;
+  }
+
+  if (condition.min_interval)
+  {
+    const auto now  = ia32_asm_read_tsc();
+    auto       last = bp.last_break_tsc.load(std::memory_order_relaxed);
+
+    if (now - last < condition.min_interval ||
+        !bp.last_break_tsc.compare_exchange_strong(last, now))
+    {
+      return;
+    }
+  }
+
+  if (condition.hit_limit)
+  {
+    const auto count = bp.break_count.fetch_add(1, std::memory_order_relaxed) + 1;
+
+    if (count > condition.hit_limit)
+    {
+      return;
+    }
+
+    if (count == condition.hit_limit)
+    {
+      //
+      // The last break - disarm the slot (the summary bit stays,
+      // other slots of the reason might be still armed).
+      //
+      slot = 0;
+    }
+  }
+
+  debugger::breakpoint();
+}
+
 void vmexit_dbgbreak_handler::handle(vcpu_t& vp) noexcept
 {
   auto exit_reason = vp.exit_reason();
 
+  //
+  // Fast path - no breakpoint on this VM-exit reason.
+  //
+  if (!is_armed(exit_reason))
+  {
+    return;
+  }
+
   hvpp_break_if(storage_.vmexit[static_cast<int>(exit_reason)]);
 
+  //
+  // Sub-reasons are checked only if the storage has their category
+  // (see HVPP_VMEXIT_DBGBREAK_CATEGORIES).
+  //
+
   switch (exit_reason)
   {
     case vmx::exit_reason::exception_or_nmi:
-      hvpp_break_if(storage_.expt_vector[static_cast<int>(vp.interrupt_info().vector())]);
+      vmexit_storage_if<vmexit_storage_category::expt_vector>([&](auto& s) {
+        hvpp_break_if(s.expt_vector[static_cast<int>(vp.interrupt_info().vector())]);
+      }, storage_);
       break;
 
     case vmx::exit_reason::external_interrupt:
-      hvpp_break_if(storage_.expt_vector[static_cast<int>(vp.interrupt_info().vector())]);
+      vmexit_storage_if<vmexit_storage_category::expt_vector>([&](auto& s) {
+        hvpp_break_if(s.expt_vector[static_cast<int>(vp.interrupt_info().vector())]);
+      }, storage_);
       break;
 
     case vmx::exit_reason::execute_cpuid:
-      if (vp.exit_context().eax < (0x0000'0000u + vmexit_dbgbreak_storage_t::cpuid_0_max))
-      {
-        hvpp_break_if(storage_.cpuid_0[vp.exit_context().eax]);
-      }
-      else if (vp.exit_context().eax >= 0x8000'0000u &&
-               vp.exit_context().eax < (0x8000'0000u + vmexit_dbgbreak_storage_t::cpuid_8_max))
-      {
-        hvpp_break_if(storage_.cpuid_8[vp.exit_context().eax - 0x8000'0000u]);
-      }
-      else
-      {
-        hvpp_break_if(storage_.cpuid_other);
-      }
+      vmexit_storage_if<vmexit_storage_category::cpuid>([&](auto& s) {
+        if (vp.exit_context().eax < (0x0000'0000u + s.cpuid_0_max))
+        {
+          hvpp_break_if(s.cpuid_0[vp.exit_context().eax]);
+        }
+        else if (vp.exit_context().eax >= 0x8000'0000u &&
+                 vp.exit_context().eax < (0x8000'0000u + s.cpuid_8_max))
+        {
+          hvpp_break_if(s.cpuid_8[vp.exit_context().eax - 0x8000'0000u]);
+        }
+        else
+        {
+          hvpp_break_if(s.cpuid_other);
+        }
+      }, storage_);
       break;
 
     case vmx::exit_reason::mov_cr:
-      switch (vp.exit_qualification().mov_cr.access_type)
-      {
-        case vmx::exit_qualification_mov_cr_t::access_to_cr:
-          hvpp_break_if(storage_.mov_to_cr[vp.exit_qualification().mov_cr.cr_number]);
-          break;
-
-        case vmx::exit_qualification_mov_cr_t::access_from_cr:
-          hvpp_break_if(storage_.mov_from_cr[vp.exit_qualification().mov_cr.cr_number]);
-          break;
-
-        case vmx::exit_qualification_mov_cr_t::access_clts:
-          hvpp_break_if(storage_.clts);
-          break;
-
-        case vmx::exit_qualification_mov_cr_t::access_lmsw:
-          hvpp_break_if(storage_.lmsw);
-          break;
-      }
+      vmexit_storage_if<vmexit_storage_category::mov_cr>([&](auto& s) {
+        switch (vp.exit_qualification().mov_cr.access_type)
+        {
+          case vmx::exit_qualification_mov_cr_t::access_to_cr:
+            hvpp_break_if(s.mov_to_cr[vp.exit_qualification().mov_cr.cr_number]);
+            break;
+
+          case vmx::exit_qualification_mov_cr_t::access_from_cr:
+            hvpp_break_if(s.mov_from_cr[vp.exit_qualification().mov_cr.cr_number]);
+            break;
+
+          case vmx::exit_qualification_mov_cr_t::access_clts:
+            hvpp_break_if(s.clts);
+            break;
+
+          case vmx::exit_qualification_mov_cr_t::access_lmsw:
+            hvpp_break_if(s.lmsw);
+            break;
+        }
+      }, storage_);
       break;
 
     case vmx::exit_reason::mov_dr:
-      switch (vp.exit_qualification().mov_dr.access_type)
-      {
-        case vmx::exit_qualification_mov_dr_t::access_to_dr:
-          hvpp_break_if(storage_.mov_to_dr[vp.exit_qualification().mov_dr.dr_number]);
-          break;
-
-        case vmx::exit_qualification_mov_dr_t::access_from_dr:
-          hvpp_break_if(storage_.mov_from_dr[vp.exit_qualification().mov_dr.dr_number]);
-          break;
-      }
+      vmexit_storage_if<vmexit_storage_category::mov_dr>([&](auto& s) {
+        switch (vp.exit_qualification().mov_dr.access_type)
+        {
+          case vmx::exit_qualification_mov_dr_t::access_to_dr:
+            hvpp_break_if(s.mov_to_dr[vp.exit_qualification().mov_dr.dr_number]);
+            break;
+
+          case vmx::exit_qualification_mov_dr_t::access_from_dr:
+            hvpp_break_if(s.mov_from_dr[vp.exit_qualification().mov_dr.dr_number]);
+            break;
+        }
+      }, storage_);
       break;
 
     case vmx::exit_reason::execute_io_instruction:
-      switch (vp.exit_qualification().io_instruction.access_type)
-      {
-        case vmx::exit_qualification_io_instruction_t::access_out:
-          hvpp_break_if(storage_.io_out[vp.exit_qualification().io_instruction.port_number]);
-          break;
-
-        case vmx::exit_qualification_io_instruction_t::access_in:
-          hvpp_break_if(storage_.io_in[vp.exit_qualification().io_instruction.port_number]);
-          break;
-      }
+      vmexit_storage_if<vmexit_storage_category::io>([&](auto& s) {
+        switch (vp.exit_qualification().io_instruction.access_type)
+        {
+          case vmx::exit_qualification_io_instruction_t::access_out:
+            hvpp_break_if(s.io_out[vp.exit_qualification().io_instruction.port_number]);
+            break;
+
+          case vmx::exit_qualification_io_instruction_t::access_in:
+            hvpp_break_if(s.io_in[vp.exit_qualification().io_instruction.port_number]);
+            break;
+        }
+      }, storage_);
       break;
 
     case vmx::exit_reason::execute_rdmsr:
-      if (vp.exit_context().ecx <= 0x0000'1fffu)
-      {
-        hvpp_break_if(storage_.rdmsr_0[vp.exit_context().ecx]);
-      }
-      else if (vp.exit_context().ecx >= 0xc000'0000u &&
-               vp.exit_context().ecx <= 0xc000'1fffu)
-      {
-        hvpp_break_if(storage_.rdmsr_c[vp.exit_context().ecx - 0xc000'0000u]);
-      }
-      else
-      {
-        hvpp_break_if(storage_.rdmsr_other);
-      }
+      vmexit_storage_if<vmexit_storage_category::msr>([&](auto& s) {
+        if (vp.exit_context().ecx <= 0x0000'1fffu)
+        {
+          hvpp_break_if(s.rdmsr_0[vp.exit_context().ecx]);
+        }
+        else if (vp.exit_context().ecx >= 0xc000'0000u &&
+                 vp.exit_context().ecx <= 0xc000'1fffu)
+        {
+          hvpp_break_if(s.rdmsr_c[vp.exit_context().ecx - 0xc000'0000u]);
+        }
+        else
+        {
+          hvpp_break_if(s.rdmsr_other);
+        }
+      }, storage_);
       break;
 
     case vmx::exit_reason::execute_wrmsr:
-      if (vp.exit_context().ecx <= 0x0000'1fffu)
-      {
-        hvpp_break_if(storage_.wrmsr_0[vp.exit_context().ecx]);
-      }
-      else if (vp.exit_context().ecx >= 0xc000'0000u &&
-               vp.exit_context().ecx <= 0xc000'1fffu)
-      {
-        hvpp_break_if(storage_.wrmsr_c[vp.exit_context().ecx - 0xc000'0000u]);
-      }
-      else
-      {
-        hvpp_break_if(storage_.wrmsr_other);
-      }
+      vmexit_storage_if<vmexit_storage_category::msr>([&](auto& s) {
+        if (vp.exit_context().ecx <= 0x0000'1fffu)
+        {
+          hvpp_break_if(s.wrmsr_0[vp.exit_context().ecx]);
+        }
+        else if (vp.exit_context().ecx >= 0xc000'0000u &&
+                 vp.exit_context().ecx <= 0xc000'1fffu)
+        {
+          hvpp_break_if(s.wrmsr_c[vp.exit_context().ecx - 0xc000'0000u]);
+        }
+        else
+        {
+          hvpp_break_if(s.wrmsr_other);
+        }
+      }, storage_);
       break;
 
     case vmx::exit_reason::gdtr_idtr_access:
-      hvpp_break_if(storage_.gdtr_idtr[vp.exit_instruction_info().gdtr_idtr_access.instruction]);
+      vmexit_storage_if<vmexit_storage_category::gdtr_idtr>([&](auto& s) {
+        hvpp_break_if(s.gdtr_idtr[vp.exit_instruction_info().gdtr_idtr_access.instruction]);
+      }, storage_);
       break;
 
     case vmx::exit_reason::ldtr_tr_access:
-      hvpp_break_if(storage_.ldtr_tr[vp.exit_instruction_info().ldtr_tr_access.instruction]);
+      vmexit_storage_if<vmexit_storage_category::ldtr_tr>([&](auto& s) {
+        hvpp_break_if(s.ldtr_tr[vp.exit_instruction_info().ldtr_tr_access.instruction]);
+      }, storage_);
       break;
   }
 }
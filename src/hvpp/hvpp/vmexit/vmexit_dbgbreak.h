@@ -1,36 +1,139 @@
 #pragma once
 #include "hvpp/vmexit.h"
 
+#include "hvpp/config.h"
+#include "hvpp/lib/error.h"
+#include "hvpp/lib/spinlock.h"
+
 #include <atomic>
+#include <cstdint>
+#include <iterator> // std::size()
 
 namespace hvpp {
 
 //
 // Structure for storing on which VM-exits the debug-break
-// should be invoked.
+// should be invoked.  Each member holds index of the breakpoint
+// (see vmexit_dbgbreak_handler::breakpoint_t), 0 means no breakpoint.
+// Only the categories selected by HVPP_VMEXIT_DBGBREAK_CATEGORIES
+// (see config.h) are kept.
+//
+#ifdef HVPP_VMEXIT_DBGBREAK_CATEGORIES
+using vmexit_dbgbreak_categories = type_list<HVPP_VMEXIT_DBGBREAK_CATEGORIES>;
+#else
+using vmexit_dbgbreak_categories = vmexit_storage_category::all;
+#endif
+
+using vmexit_dbgbreak_storage_t = vmexit_storage_t<uint8_t, 16, 16, vmexit_dbgbreak_categories>;
+
+//
+// Condition of the breakpoint.
 //
-using vmexit_dbgbreak_storage_t = vmexit_storage_t<std::atomic_bool>;
+struct vmexit_dbgbreak_condition_t
+{
+  uint64_t rip          = 0;    // guest RIP, 0 = any
+  uint64_t cr3          = 0;    // guest CR3 (page frame only), 0 = any
+  uint32_t skip_count   = 0;    // ignore the first N hits
+  uint32_t every_nth    = 1;    // break on each N-th hit (0 is treated as 1)
+  uint32_t hit_limit    = 1;    // maximum number of breaks, 0 = unlimited
+  uint64_t min_interval = 0;    // minimal TSC ticks between two breaks
+};
 
 //
-// Simple handler which breaks into the debugger
-// on specified VM-exit.  Each breakpoint is hit
-// only once.
+// Handler which breaks into the debugger on specified VM-exits.
+//
+// Breakpoints can be set either on the VM-exit reason or on its
+// sub-reason (slot of the storage, e.g. I/O port or MSR), and they
+// can be conditional - filtered by the guest RIP and CR3, skipping
+// the first hits, breaking only on each N-th hit, limited in number
+// of breaks and rate-limited.  Default condition breaks only once.
+//
+// VM-exits whose reason has no breakpoint are filtered by a summary
+// bitmap of armed reasons - a single load, without any atomic
+// read-modify-write.  Hit counters are updated only when the filters
+// of the breakpoint match.
+//
+// Usage:
+//   handler.breakpoint(vmx::exit_reason::execute_io_instruction,
+//                      handler.storage().io_in[0x64]);
+//
+//   vmexit_dbgbreak_handler::condition_t condition;
+//   condition.cr3 = target_cr3;
+//   condition.every_nth = 100;
+//   condition.hit_limit = 0;
+//   handler.breakpoint(vmx::exit_reason::execute_cpuid, condition);
 //
 
 class vmexit_dbgbreak_handler
   : public vmexit_handler
 {
   public:
+    static constexpr int max_breakpoint_count = 64;
+
+    using condition_t = vmexit_dbgbreak_condition_t;
+
     vmexit_dbgbreak_handler() noexcept;
     ~vmexit_dbgbreak_handler() noexcept override;
 
     void handle(vcpu_t& vp) noexcept override;
 
+    //
+    // Set the breakpoint on the VM-exit reason (any sub-reason), or on
+    // the sub-reason "slot" (member of storage()) of the VM-exit reason.
+    // These methods can be called while the hypervisor is running (at
+    // IRQL <= DISPATCH_LEVEL).
+    //
+    auto breakpoint(vmx::exit_reason exit_reason,
+                    const condition_t& condition = {}) noexcept -> error_code_t;
+
+    auto breakpoint(vmx::exit_reason exit_reason, uint8_t& slot,
+                    const condition_t& condition = {}) noexcept -> error_code_t;
+
+    //
+    // Remove all breakpoints.
+    //
+    void clear() noexcept;
+
+    const vmexit_dbgbreak_storage_t& storage() const noexcept
+    { return storage_; }
+
     vmexit_dbgbreak_storage_t& storage() noexcept
     { return storage_; }
 
   private:
+    struct breakpoint_t
+    {
+      condition_t           condition;
+      std::atomic<uint32_t> hit_count;
+      std::atomic<uint32_t> break_count;
+      std::atomic<uint64_t> last_break_tsc;
+    };
+
+    //
+    // Evaluate the breakpoint referenced by the slot.
+    //
+    void check(vcpu_t& vp, uint8_t& slot) noexcept;
+
+    auto allocate(const condition_t& condition) noexcept -> uint8_t;
+
+    bool is_armed(vmx::exit_reason exit_reason) const noexcept
+    {
+      const auto index = static_cast<uint32_t>(exit_reason);
+      return index < std::size(storage_.vmexit) &&
+             (armed_[index / 64].load(std::memory_order_acquire) & (1ull << (index % 64))) != 0;
+    }
+
     vmexit_dbgbreak_storage_t storage_;
+
+    //
+    // Summary bitmap of VM-exit reasons with (possibly) armed
+    // breakpoints.  There are currently defined 65 VM-exit reasons.
+    //
+    std::atomic<uint64_t> armed_[2];
+
+    breakpoint_t breakpoint_[max_breakpoint_count];
+    int          breakpoint_count_;
+    spinlock     lock_;
 };
 
 }
@@ -0,0 +1,260 @@
+#define HVPP_LOG_MODULE vmexit
+
+#include "vmexit_governor.h"
+
+#include "hvpp/hypervisor.h"
+#include "hvpp/vcpu.h"
+
+#include "hvpp/lib/assert.h"
+#include "hvpp/lib/event_channel.h"
+#include "hvpp/lib/log.h"
+#include "hvpp/lib/work_queue.h"
+
+#include <cstring>
+
+namespace hvpp {
+
+vmexit_governor_handler::vmexit_governor_handler() noexcept
+  : window_{ 1'000'000'000 }
+  , sample_rate_{ 64 }
+  , budget_{}
+  , has_budget_{ false }
+  , per_vcpu_{}
+{
+  const auto err = per_vcpu_.initialize();
+  hvpp_assert(!err);
+  (void)(err);
+}
+
+vmexit_governor_handler::~vmexit_governor_handler() noexcept
+{
+
+}
+
+void vmexit_governor_handler::window(uint64_t tsc_ticks) noexcept
+{
+  hvpp_assert(!hypervisor::is_started());
+  hvpp_assert(tsc_ticks != 0);
+
+  window_ = tsc_ticks;
+}
+
+void vmexit_governor_handler::sample_rate(uint32_t rate) noexcept
+{
+  hvpp_assert(!hypervisor::is_started());
+
+  sample_rate_ = rate ? rate : 1;
+}
+
+void vmexit_governor_handler::budget(vmx::exit_reason exit_reason, uint32_t max_exit_count) noexcept
+{
+  hvpp_assert(!hypervisor::is_started());
+  hvpp_assert(static_cast<uint32_t>(exit_reason) < exit_reason_count);
+
+  budget_[static_cast<uint32_t>(exit_reason)] = max_exit_count;
+
+  has_budget_ = false;
+  for (auto value : budget_)
+  {
+    has_budget_ |= value != 0;
+  }
+}
+
+void vmexit_governor_handler::attach(vcpu_t& vp) noexcept
+{
+  per_vcpu_[vp.cpu_index()] = per_vcpu_t{};
+  per_vcpu_[vp.cpu_index()].window_start = ia32_asm_read_tsc();
+}
+
+void vmexit_governor_handler::handle(vcpu_t& vp) noexcept
+{
+  account(vp);
+}
+
+auto vmexit_governor_handler::level(uint32_t cpu_index, vmx::exit_reason exit_reason) const noexcept -> level_t
+{
+  const auto index = static_cast<uint32_t>(exit_reason);
+
+  return cpu_index < per_vcpu_.size() && index < exit_reason_count
+    ? per_vcpu_[cpu_index].level[index]
+    : level_t::full;
+}
+
+auto vmexit_governor_handler::account(vcpu_t& vp) noexcept -> vmexit_result
+{
+  if (!has_budget_)
+  {
+    return vmexit_result::next;
+  }
+
+  const auto index = static_cast<uint32_t>(vp.exit_reason());
+
+  if (index >= exit_reason_count)
+  {
+    return vmexit_result::next;
+  }
+
+  auto& data = per_vcpu_[vp.cpu_index()];
+
+  const auto now = ia32_asm_read_tsc();
+
+  if (now - data.window_start >= window_)
+  {
+    memset(data.count, 0, sizeof(data.count));
+    data.degraded[0] = 0;
+    data.degraded[1] = 0;
+    data.window_start = now;
+  }
+
+  data.count[index] += 1;
+
+  if (budget_[index] && data.count[index] > budget_[index] &&
+      !(data.degraded[index / 64] & (1ull << (index % 64))))
+  {
+    data.degraded[index / 64] |= 1ull << (index % 64);
+    degrade(vp, data, index);
+  }
+
+  if (data.level[index] == level_t::full)
+  {
+    return vmexit_result::next;
+  }
+
+  //
+  // Degraded reason - observe only every N-th VM-exit.  Note that even
+  // with the interception turned off, some VM-exits of the reason can
+  // still arrive (e.g. via another bitmap).
+  //
+  if (++data.sample_count[index] >= sample_rate_)
+  {
+    data.sample_count[index] = 0;
+    return vmexit_result::next;
+  }
+
+  return vmexit_result::skip_remaining;
+}
+
+void vmexit_governor_handler::degrade(vcpu_t& vp, per_vcpu_t& data, uint32_t exit_reason_index) noexcept
+{
+  const auto exit_reason = static_cast<vmx::exit_reason>(exit_reason_index);
+  auto& level = data.level[exit_reason_index];
+
+  switch (level)
+  {
+    case level_t::full:
+      level = level_t::sampling;
+      break;
+
+    case level_t::sampling:
+      if (!intercept_off(vp, exit_reason))
+      {
+        return;
+      }
+
+      level = level_t::intercept_off;
+      break;
+
+    default:
+      return;
+  }
+
+  //
+  // data[0] - exit reason
+  // data[1] - new level
+  // data[2] - VM-exits in the current window
+  // data[3] - budget
+  //
+  event_channel::post(event_channel::event_type::governor,
+                      exit_reason_index,
+                      static_cast<uint64_t>(level),
+                      data.count[exit_reason_index],
+                      budget_[exit_reason_index]);
+
+  //
+  // Log it outside of the VMX-root mode.
+  //
+  work_queue::post([cpu_index = vp.cpu_index(), exit_reason, level = level] {
+    hvpp_warn("CPU %u: %s degraded to %s",
+              cpu_index,
+              vmx::exit_reason_to_string(exit_reason),
+              level == level_t::sampling ? "sampling" : "intercept_off");
+  });
+}
+
+bool vmexit_governor_handler::intercept_off(vcpu_t& vp, vmx::exit_reason exit_reason) noexcept
+{
+  switch (exit_reason)
+  {
+    case vmx::exit_reason::exception_or_nmi:
+      vp.exception_bitmap(vmx::exception_bitmap_t{ 0 });
+      return true;
+
+    case vmx::exit_reason::execute_io_instruction: {
+      auto procbased_ctls = vp.processor_based_controls();
+      procbased_ctls.use_io_bitmaps = false;
+      procbased_ctls.unconditional_io_exiting = false;
+      vp.processor_based_controls(procbased_ctls);
+      return true;
+    }
+
+    case vmx::exit_reason::execute_rdmsr: {
+      auto& msr_bitmap = vp.msr_bitmap_private();
+      memset(msr_bitmap.rdmsr_low,  0, sizeof(msr_bitmap.rdmsr_low));
+      memset(msr_bitmap.rdmsr_high, 0, sizeof(msr_bitmap.rdmsr_high));
+      return true;
+    }
+
+    case vmx::exit_reason::execute_wrmsr: {
+      auto& msr_bitmap = vp.msr_bitmap_private();
+      memset(msr_bitmap.wrmsr_low,  0, sizeof(msr_bitmap.wrmsr_low));
+      memset(msr_bitmap.wrmsr_high, 0, sizeof(msr_bitmap.wrmsr_high));
+      return true;
+    }
+
+    case vmx::exit_reason::mov_cr: {
+      //
+      // Only CR3 accesses - CR0/CR4 guest/host masks also hide bits
+      // owned by the hypervisor (e.g. CR4.VMXE).
+      //
+      auto procbased_ctls = vp.processor_based_controls();
+      procbased_ctls.cr3_load_exiting = false;
+      procbased_ctls.cr3_store_exiting = false;
+      vp.processor_based_controls(procbased_ctls);
+      return true;
+    }
+
+    case vmx::exit_reason::mov_dr: {
+      auto procbased_ctls = vp.processor_based_controls();
+      procbased_ctls.mov_dr_exiting = false;
+      vp.processor_based_controls(procbased_ctls);
+      return true;
+    }
+
+    case vmx::exit_reason::execute_invlpg: {
+      auto procbased_ctls = vp.processor_based_controls();
+      procbased_ctls.invlpg_exiting = false;
+      vp.processor_based_controls(procbased_ctls);
+      return true;
+    }
+
+    case vmx::exit_reason::execute_rdtsc: {
+      auto procbased_ctls = vp.processor_based_controls();
+      procbased_ctls.rdtsc_exiting = false;
+      vp.processor_based_controls(procbased_ctls);
+      return true;
+    }
+
+    case vmx::exit_reason::gdtr_idtr_access:
+    case vmx::exit_reason::ldtr_tr_access: {
+      auto procbased_ctls2 = vp.processor_based_controls2();
+      procbased_ctls2.descriptor_table_exiting = false;
+      vp.processor_based_controls2(procbased_ctls2);
+      return true;
+    }
+
+    default:
+      return false;
+  }
+}
+
+}
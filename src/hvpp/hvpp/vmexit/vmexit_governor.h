@@ -0,0 +1,117 @@
+#pragma once
+#include "hvpp/vmexit.h"
+
+#include "hvpp/config.h"
+#include "hvpp/lib/error.h"
+#include "hvpp/lib/per_cpu.h"
+
+#include <atomic>
+#include <cstdint>
+
+namespace hvpp {
+
+//
+// Per-VCPU rate governor of VM-exits.
+//
+// Counts VM-exits per reason in fixed windows of TSC ticks.  When the
+// budget of the VM-exit reason is exceeded within a window, the reason
+// is degraded by one level (at most once per window):
+//
+//   1. sampling - only every "sample_rate"-th VM-exit of the reason is
+//      observed, the other ones skip the remaining observers of the
+//      chain (e.g. statistics, debug-breaks) and go straight to the last
+//      handler (see vmexit_result::skip_remaining).
+//
+//   2. intercept_off - the interception itself is turned off in the VMCS
+//      of the VCPU (e.g. the MSR bitmap is cleared, "mov_dr_exiting" is
+//      disabled).  Reasons which can't be turned off (e.g. CPUID) stay
+//      at the sampling level.
+//
+// Each change is posted into the event channel (event_type::governor).
+// Degradation is sticky - levels are reset only by setup() of the VCPU.
+//
+// Note that turning off the interception doesn't care who requested it
+// (e.g. io_policy, cr3_policy) - configure budgets only for VM-exits
+// which are merely monitored.
+//
+// Usage (the first stage of the pipeline):
+//   vmexit_pipeline_handler<
+//     vmexit_governor_handler,
+//     vmexit_stats_handler,
+//     vmexit_custom_handler
+//     >;
+//
+//   auto& governor = std::get<vmexit_governor_handler>(handler->handlers);
+//   governor.window(1'000'000'000);
+//   governor.budget(vmx::exit_reason::execute_rdmsr, 100'000);
+//
+
+class vmexit_governor_handler
+  : public vmexit_handler
+{
+  public:
+    static constexpr uint32_t exit_reason_count = 65;
+
+    enum class level_t : uint8_t
+    {
+      full,
+      sampling,
+      intercept_off,
+    };
+
+    vmexit_governor_handler() noexcept;
+    ~vmexit_governor_handler() noexcept override;
+
+    //
+    // These methods must be called before the hypervisor is started.
+    // Budget of 0 means unlimited (default).
+    //
+    void window(uint64_t tsc_ticks) noexcept;
+    void sample_rate(uint32_t rate) noexcept;
+    void budget(vmx::exit_reason exit_reason, uint32_t max_exit_count) noexcept;
+
+    void attach(vcpu_t& vp) noexcept override;
+    void handle(vcpu_t& vp) noexcept override;
+
+    //
+    // Returns vmexit_result::skip_remaining for VM-exits which aren't
+    // sampled.
+    //
+    vmexit_result handle_chained(vcpu_t& vp) noexcept
+    { return account(vp); }
+
+    auto level(uint32_t cpu_index, vmx::exit_reason exit_reason) const noexcept -> level_t;
+
+  private:
+    struct per_vcpu_t
+    {
+      uint64_t window_start;
+      uint32_t count[exit_reason_count];
+      uint32_t sample_count[exit_reason_count];
+      level_t  level[exit_reason_count];
+
+      //
+      // Reasons already degraded in the current window.
+      //
+      uint64_t degraded[2];
+    };
+
+    auto account(vcpu_t& vp) noexcept -> vmexit_result;
+
+    void degrade(vcpu_t& vp, per_vcpu_t& data, uint32_t exit_reason_index) noexcept;
+
+    //
+    // Turn off the interception of the VM-exit reason.  Returns false
+    // if it can't be turned off.
+    //
+    bool intercept_off(vcpu_t& vp, vmx::exit_reason exit_reason) noexcept;
+
+    uint64_t   window_;
+    uint32_t   sample_rate_;
+    uint32_t   budget_[exit_reason_count];
+    bool       has_budget_;
+
+    per_cpu<per_vcpu_t> per_vcpu_;
+};
+
+}
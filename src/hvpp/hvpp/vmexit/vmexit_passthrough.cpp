@@ -4,13 +4,15 @@
 #include "hvpp/vcpu.h"
 
 #include "hvpp/lib/assert.h"
-#include "hvpp/lib/cr3_guard.h"
 #include "hvpp/lib/debugger.h"
 
 #ifdef HVPP_ENABLE_VMWARE_WORKAROUND
 # include "hvpp/lib/vmware/vmware.h"
 #endif
 
+#include <algorithm>
+#include <cstring>
+
 namespace hvpp {
 
 static constexpr uint64_t vmcall_terminate_id  = 0xDEAD;
@@ -18,19 +20,82 @@ static constexpr uint64_t vmcall_breakpoint_id = 0xAABB;
 
 namespace detail
 {
-  static bool is_syscall_instruction(const void* address) noexcept
+  //
+  // Longest opcode compared below.
+  //
+  static constexpr size_t max_opcode_size = 3;
+
+  static bool is_syscall_instruction(const uint8_t* instruction, size_t size) noexcept
   {
     static constexpr uint8_t opcode[] = { 0x0f, 0x05 };
-    return memcmp(address, opcode, sizeof(opcode)) == 0;
+    return size >= sizeof(opcode) && memcmp(instruction, opcode, sizeof(opcode)) == 0;
   }
 
-  static bool is_sysret_instruction(const void* address) noexcept
+  static bool is_sysret_instruction(const uint8_t* instruction, size_t size) noexcept
   {
     static constexpr uint8_t opcode[] = { 0x48, 0x0f, 0x07 };
-    return memcmp(address, opcode, sizeof(opcode)) == 0;
+    return size >= sizeof(opcode) && memcmp(instruction, opcode, sizeof(opcode)) == 0;
+  }
+
+  //
+  // Kinds of instructions cached by handle_interrupt() (see
+  // vcpu_t::decode_cache_lookup()).
+  //
+  enum class decoded_instruction : uint32_t
+  {
+    none,
+    syscall,
+    sysret,
+    io,                         // data = exit qualification without the port
+  };
+
+  //
+  // Size of the buffer for chunks of string I/O (see
+  // handle_execute_io_string()).
+  //
+  static constexpr size_t io_string_buffer_size = 512;
+
+  //
+  // Reverse order of "count" elements of "size" bytes - string I/O
+  // with RFLAGS.DF set transfers elements at decreasing addresses.
+  //
+  static void reverse_elements(uint8_t* buffer, uint64_t count, uint32_t size) noexcept
+  {
+    for (uint64_t i = 0; i < count / 2; ++i)
+    {
+      uint8_t* first = buffer + i * size;
+      uint8_t* second = buffer + (count - 1 - i) * size;
+
+      std::swap_ranges(first, first + size, second);
+    }
+  }
+
+  //
+  // Write register used for addressing with the given address size.
+  // 32-bit writes zero the upper half, 16-bit writes keep it (see
+  // vmx::instruction_info_t::size_16bit & co.).
+  //
+  static void write_register(uint64_t& reg, uint64_t value, uint32_t address_size) noexcept
+  {
+    switch (address_size)
+    {
+      case vmx::instruction_info_t::size_16bit: reg = (reg & ~0xffffull) | (value & 0xffff); break;
+      case vmx::instruction_info_t::size_32bit: reg = value & 0xffffffff; break;
+      default:                                  reg = value; break;
+    }
   }
 }
 
+vmexit_passthrough_handler::vmexit_passthrough_handler() noexcept
+#ifdef HVPP_ENABLE_VMWARE_WORKAROUND
+  : vmware_workaround_{ is_vmware_present() }
+#else
+  : vmware_workaround_{ false }
+#endif
+{
+
+}
+
 void vmexit_passthrough_handler::setup(vcpu_t& vp) noexcept
 {
   //
@@ -59,6 +124,12 @@ void vmexit_passthrough_handler::setup(vcpu_t& vp) noexcept
   vp.guest_ss(segment_t{ gdtr, read<ss_t>() });
   vp.guest_tr(segment_t{ gdtr, read<tr_t>() });
   vp.guest_ldtr(segment_t{ gdtr, read<ldtr_t>() });
+
+  //
+  // Guest state is initialized only before VMLAUNCH - controls are
+  // set up by attach() (which is also called on handler swap).
+  //
+  attach(vp);
 }
 
 void vmexit_passthrough_handler::invoke_termination(vcpu_t& vp) noexcept
@@ -75,6 +146,17 @@ void vmexit_passthrough_handler::handle_exception_or_nmi(vcpu_t& vp) noexcept
 
 void vmexit_passthrough_handler::handle_external_interrupt(vcpu_t& vp) noexcept
 {
+  if (vp.apicv_is_enabled())
+  {
+    //
+    // The interrupt has been acknowledged on VM-exit - let the processor
+    // deliver it once the virtual TPR allows it (see vcpu_t::apicv_enable()).
+    //
+    vp.apicv_request(static_cast<uint8_t>(vp.interrupt_info().vector()));
+    vp.suppress_rip_adjust();
+    return;
+  }
+
   handle_interrupt(vp);
 }
 
@@ -101,21 +183,11 @@ void vmexit_passthrough_handler::handle_interrupt_window(vcpu_t& vp) noexcept
 
   //
   // Guest is in the interruptible state.
-  // Dequeue one pending interrupt from the queue
-  // and inject it.
+  // Dequeue the highest-priority pending interrupt and inject it.
+  // Interrupt-window exiting is disabled once no interrupt is pending.
   //
   vp.interrupt_inject_pending();
 
-  //
-  // If queue is empty, disable Interrupt-window exiting.
-  //
-  if (!vp.interrupt_is_pending())
-  {
-    auto procbased_ctls = vp.processor_based_controls();
-    procbased_ctls.interrupt_window_exiting = false;
-    vp.processor_based_controls(procbased_ctls);
-  }
-
   vp.suppress_rip_adjust();
 }
 
@@ -192,12 +264,13 @@ void vmexit_passthrough_handler::handle_execute_invlpg(vcpu_t& vp) noexcept
   //     entry
   //
 
-  vmx::invvpid_individual_address(vp.vcpu_id(), linear_address);
+  vp.vpid_invalidate(linear_address);
+  vp.gva_tlb_flush(linear_address);
 }
 
 void vmexit_passthrough_handler::handle_execute_rdtsc(vcpu_t& vp) noexcept
 {
-  uint64_t tsc = ia32_asm_read_tsc();
+  uint64_t tsc = vp.guest_tsc(ia32_asm_read_tsc());
   vp.exit_context().rax = tsc & 0xffffffff;
   vp.exit_context().rdx = tsc >> 32;
 }
@@ -230,8 +303,13 @@ void vmexit_passthrough_handler::handle_mov_cr(vcpu_t& vp) noexcept
       switch (exit_qualification.cr_number)
       {
         case 0:
-          vp.guest_cr0(cr0_t{ gp_register });
+          //
+          // Bits fixed by the VMX operation keep their value, the guest
+          // sees the value it has written (see vcpu_t::cr0_intercept()).
+          //
+          vp.guest_cr0(vmx::adjust(cr0_t{ gp_register }, vp.capabilities()));
           vp.cr0_shadow(cr0_t{ gp_register });
+          vp.gva_tlb_flush();
           break;
 
         case 3:
@@ -248,12 +326,25 @@ void vmexit_passthrough_handler::handle_mov_cr(vcpu_t& vp) noexcept
             auto cr3 = cr3_t{ gp_register };
             if (vp.guest_cr4().pcid_enable)
             {
+              //
+              // Bit 63 cleared means that the translations of the new
+              // PCID are invalidated.
+              //
+              if (!cr3.pcid_invalidate)
+              {
+                vp.gva_tlb_flush_pcid(static_cast<uint16_t>(cr3.pcid));
+              }
+
               //
               // Equivalent to:
               //   gp_register &= ~(1ull << 63);
               //
               cr3.pcid_invalidate = false;
             }
+            else
+            {
+              vp.gva_tlb_flush();
+            }
             vp.guest_cr3(cr3);
 
             //
@@ -267,7 +358,7 @@ void vmexit_passthrough_handler::handle_mov_cr(vcpu_t& vp) noexcept
             //     the virtual processor whose execution is being emulated.
             // (ref: Vol3C[28.3.3.3(Guidelines for Use of the INVVPID Instruction)])
             //
-            vmx::invvpid_single_context_retaining_globals(vp.vcpu_id());
+            vp.vpid_invalidate_retaining_globals();
           }
           break;
 
@@ -290,11 +381,12 @@ void vmexit_passthrough_handler::handle_mov_cr(vcpu_t& vp) noexcept
 
             if (pge_changed)
             {
-              vmx::invvpid_single_context(vp.vcpu_id());
+              vp.vpid_invalidate();
             }
 
-            vp.guest_cr4(new_cr4);
+            vp.guest_cr4(vmx::adjust(new_cr4, vp.capabilities()));
             vp.cr4_shadow(new_cr4);
+            vp.gva_tlb_flush();
           }
           break;
 
@@ -498,22 +590,21 @@ void vmexit_passthrough_handler::handle_mov_dr(vcpu_t& vp) noexcept
     default:
       break;
   }
+
+  //
+  // Hand the debug registers over to the guest - further MOV DR don't
+  // exit (see vcpu_t::dr_lazy()).
+  //
+  if (vp.dr_lazy())
+  {
+    vp.dr_release();
+  }
 }
 
 void vmexit_passthrough_handler::handle_execute_io_instruction(vcpu_t& vp) noexcept
 {
   auto exit_qualification = vp.exit_qualification().io_instruction;
 
-  union
-  {
-    unsigned char*  as_byte_ptr;
-    unsigned short* as_word_ptr;
-    unsigned long*  as_dword_ptr;
-
-    void*           as_ptr;
-    uint64_t        as_uint64_t;
-  } port_value;
-
   //
   // We don't check if CPL == 0 here, because the CPU would
   // raise #GP instead of VM-exit.
@@ -521,144 +612,229 @@ void vmexit_passthrough_handler::handle_execute_io_instruction(vcpu_t& vp) noexc
   // See Vol3C[25.1.1(Relative Priority of Faults and VM Exits)]
   //
 
-  //
-  // Resolve address of the source or destination.
-  //
-  if (exit_qualification.string_instruction)
-  {
-    //
-    // String operations always operate either on RDI (in) or
-    // RSI (out) registers.
-    //
-    port_value.as_ptr =
-      exit_qualification.access_type == vmx::exit_qualification_io_instruction_t::access_in
-        ? vp.exit_context().rdi_as_pointer
-        : vp.exit_context().rsi_as_pointer;
-  }
-  else
-  {
-    //
-    // Save pointer to the RAX register.
-    //
-    port_value.as_ptr = &vp.exit_context().rax;
-  }
-
   //
   // Resolve port as a nice 16bit number.
   //
   uint16_t port = static_cast<uint16_t>(exit_qualification.port_number);
 
+#ifdef HVPP_ENABLE_VMWARE_WORKAROUND
+
   //
-  // Resolve number of bytes to send/receive.
-  // REP prefixed instructions always take their count
-  // from *CX register.
+  // VMWare backdoor uses other registers than RAX, too (see vmware.h).
   //
-  uint32_t count = exit_qualification.rep_prefixed
-    ? vp.exit_context().ecx
-    : 1;
+  if (vmware_workaround_ && is_vmware_backdoor_port(port))
+  {
+    ia32_asm_io_with_context(exit_qualification, vp.exit_context());
+    return;
+  }
 
-  uint32_t size = static_cast<uint32_t>(exit_qualification.size_of_access) + 1;
+#endif
 
-#ifdef HVPP_ENABLE_VMWARE_WORKAROUND
+  //
+  // String operations (INS/OUTS) always operate on the memory - either
+  // on RDI (in) or RSI (out).
+  //
+  if (exit_qualification.string_instruction)
+  {
+    handle_execute_io_string(vp);
+    return;
+  }
 
-  (void)(port_value);
-  (void)(port);
-  (void)(count);
-  (void)(size);
+  union
+  {
+    uint8_t*        as_byte_ptr;
+    uint16_t*       as_word_ptr;
+    uint32_t*       as_dword_ptr;
 
-  ia32_asm_io_with_context(exit_qualification, vp.exit_context());
+    void*           as_ptr;
+  } port_value;
 
-#else
+  //
+  // Save pointer to the RAX register.
+  //
+  port_value.as_ptr = &vp.exit_context().rax;
+
+  uint32_t size = static_cast<uint32_t>(exit_qualification.size_of_access) + 1;
 
   switch (exit_qualification.access_type)
   {
     case vmx::exit_qualification_io_instruction_t::access_in:
-      if (exit_qualification.string_instruction)
-      {
-        switch (size)
-        {
-          case 1: ia32_asm_in_byte_string(port, port_value.as_byte_ptr, count); break;
-          case 2: ia32_asm_in_word_string(port, port_value.as_word_ptr, count); break;
-          case 4: ia32_asm_in_dword_string(port, port_value.as_dword_ptr, count); break;
-        }
-      }
-      else
+      //
+      // Note that port_value holds pointer to the
+      // vp.exit_context().rax member, therefore we're
+      // directly overwriting the RAX value.
+      //
+      switch (size)
       {
-        //
-        // Note that port_value holds pointer to the
-        // vp.exit_context().rax member, therefore we're
-        // directly overwriting the RAX value.
-        //
-        switch (size)
-        {
-          case 1: *port_value.as_byte_ptr = ia32_asm_in_byte(port); break;
-          case 2: *port_value.as_word_ptr = ia32_asm_in_word(port); break;
-          case 4: *port_value.as_dword_ptr = ia32_asm_in_dword(port); break;
-        }
+        case 1: *port_value.as_byte_ptr = ia32_asm_in_byte(port); break;
+        case 2: *port_value.as_word_ptr = ia32_asm_in_word(port); break;
+        case 4: *port_value.as_dword_ptr = ia32_asm_in_dword(port); break;
       }
-    break;
+      break;
 
     case vmx::exit_qualification_io_instruction_t::access_out:
-      if (exit_qualification.string_instruction)
-      {
-        switch (size)
-        {
-          case 1: ia32_asm_out_byte_string(port, port_value.as_byte_ptr, count); break;
-          case 2: ia32_asm_out_word_string(port, port_value.as_word_ptr, count); break;
-          case 4: ia32_asm_out_dword_string(port, port_value.as_dword_ptr, count); break;
-        }
-      }
-      else
+      //
+      // Note that port_value holds pointer to the
+      // vp.exit_context().rax member, therefore we're
+      // directly reading from the RAX value.
+      //
+      switch (size)
       {
-        //
-        // Note that port_value holds pointer to the
-        // vp.exit_context().rax member, therefore we're
-        // directly reading from the RAX value.
-        //
-        switch (size)
-        {
-          case 1: ia32_asm_out_byte(port, *port_value.as_byte_ptr); break;
-          case 2: ia32_asm_out_word(port, *port_value.as_word_ptr); break;
-          case 4: ia32_asm_out_dword(port, *port_value.as_dword_ptr); break;
-        }
+        case 1: ia32_asm_out_byte(port, *port_value.as_byte_ptr); break;
+        case 2: ia32_asm_out_word(port, *port_value.as_word_ptr); break;
+        case 4: ia32_asm_out_dword(port, *port_value.as_dword_ptr); break;
       }
       break;
   }
+}
 
-  if (exit_qualification.string_instruction)
+void vmexit_passthrough_handler::handle_execute_io_string(vcpu_t& vp) noexcept
+{
+  auto exit_qualification = vp.exit_qualification().io_instruction;
+  auto& context = vp.exit_context();
+
+  const uint16_t port = static_cast<uint16_t>(exit_qualification.port_number);
+  const uint32_t size = static_cast<uint32_t>(exit_qualification.size_of_access) + 1;
+  const bool access_in = exit_qualification.access_type == vmx::exit_qualification_io_instruction_t::access_in;
+  const bool direction_down = context.rflags.direction_flag;
+
+  //
+  // Address size determines which part of RCX and RSI/RDI is used.
+  // It's reported in the VM-exit instruction-information field only
+  // if VMX_BASIC[54] is set - otherwise it's derived from the default
+  // address size of the code segment (address-size prefix is ignored).
+  //
+  uint32_t address_size;
+
+  if (vp.capabilities().basic.ins_outs_vmexit_information)
+  {
+    address_size = static_cast<uint32_t>(vp.exit_instruction_info().ins_outs.address_size);
+  }
+  else
   {
+    const auto cs_access = vp.guest_segment_access(context_t::seg_cs);
+
+    address_size = cs_access.long_mode     ? vmx::instruction_info_t::size_64bit
+                 : cs_access.default_big   ? vmx::instruction_info_t::size_32bit
+                 :                           vmx::instruction_info_t::size_16bit;
+  }
+
+  const uint64_t address_mask = vmx::instruction_info_t::size_to_mask[address_size];
+
+  //
+  // REP prefixed instructions always take their count
+  // from *CX register.
+  //
+  const uint64_t count = exit_qualification.rep_prefixed
+    ? context.rcx & address_mask
+    : 1;
+
+  //
+  // Linear address of the first element (i.e. including the segment
+  // base).  Elements are transferred in chunks - each chunk is within
+  // single page (unless single element crosses the page boundary), so
+  // its translation can be checked before any port is accessed.
+  //
+  alignas(8) uint8_t buffer[detail::io_string_buffer_size];
+
+  va_t va = vp.exit_guest_linear_address();
+  uint64_t done = 0;
+
+  while (done < count)
+  {
+    const uint64_t page_elements = direction_down
+      ? (byte_offset(va.value()) + size) / size
+      : (page_size - byte_offset(va.value())) / size;
+
+    const uint64_t chunk = std::max<uint64_t>(1, std::min({ count - done,
+                                                            page_elements,
+                                                            uint64_t(sizeof(buffer) / size) }));
+    const uint32_t chunk_size = static_cast<uint32_t>(chunk * size);
+
+    //
+    // [ chunk_va, chunk_va + chunk_size ) is the memory of the chunk.
+    // The first element transferred is at "va".
     //
-    // Update register:
-    // If the DF (direction flag) is set, decrement,
-    // otherwise increment.
+    const va_t chunk_va = direction_down
+      ? va - va_t{ chunk_size - size }
+      : va;
+
+    const va_t first_byte = va;
+    const va_t last_byte  = direction_down ? chunk_va : chunk_va + va_t{ chunk_size - 1 };
+
     //
-    // For in the register is RDI, for out it's RSI.
+    // Check both ends of the chunk with the rights of the access before
+    // the port is touched (INS writes to the memory, OUTS reads it).
     //
-    uintptr_t& gp_register =
-      exit_qualification.access_type == vmx::exit_qualification_io_instruction_t::access_in
-        ? vp.exit_context().rdi
-        : vp.exit_context().rsi;
+    const bool first_accessible = vp.guest_accessible(first_byte, 1, access_in) == 1;
 
-    if (vp.exit_context().rflags.direction_flag)
+    if (!first_accessible || vp.guest_accessible(last_byte, 1, access_in) != 1)
     {
-      gp_register -= count * size;
+      inject_page_fault(vp, first_accessible ? last_byte : first_byte, 1, access_in);
+      break;
     }
-    else
+
+    if (access_in)
     {
-      gp_register += count * size;
-    }
+      switch (size)
+      {
+        case 1: ia32_asm_in_byte_string(port, buffer, static_cast<uint32_t>(chunk)); break;
+        case 2: ia32_asm_in_word_string(port, reinterpret_cast<uint16_t*>(buffer), static_cast<uint32_t>(chunk)); break;
+        case 4: ia32_asm_in_dword_string(port, reinterpret_cast<uint32_t*>(buffer), static_cast<uint32_t>(chunk)); break;
+      }
 
-    //
-    // We've sent/received everything, reset counter register
-    // to 0.
-    //
-    if (exit_qualification.rep_prefixed)
+      if (direction_down)
+      {
+        detail::reverse_elements(buffer, chunk, size);
+      }
+
+      vp.guest_write(chunk_va, buffer, chunk_size);
+    }
+    else
     {
-      vp.exit_context().rcx = 0;
+      vp.guest_read(chunk_va, buffer, chunk_size);
+
+      if (direction_down)
+      {
+        detail::reverse_elements(buffer, chunk, size);
+      }
+
+      switch (size)
+      {
+        case 1: ia32_asm_out_byte_string(port, buffer, static_cast<uint32_t>(chunk)); break;
+        case 2: ia32_asm_out_word_string(port, reinterpret_cast<uint16_t*>(buffer), static_cast<uint32_t>(chunk)); break;
+        case 4: ia32_asm_out_dword_string(port, reinterpret_cast<uint32_t*>(buffer), static_cast<uint32_t>(chunk)); break;
+      }
     }
+
+    done += chunk;
+    va = direction_down
+      ? va - va_t{ chunk_size }
+      : va + va_t{ chunk_size };
   }
 
-#endif
+  //
+  // Update registers by the number of transferred elements:
+  // If the DF (direction flag) is set, decrement,
+  // otherwise increment.
+  //
+  // For in the register is RDI, for out it's RSI.
+  //
+  // If the transfer has been interrupted by #PF, RIP isn't advanced and
+  // the instruction continues with the remaining count after the guest
+  // handles the fault.
+  //
+  uint64_t& index_register = access_in ? context.rdi : context.rsi;
+
+  detail::write_register(index_register,
+                         direction_down ? index_register - done * size
+                                        : index_register + done * size,
+                         address_size);
+
+  if (exit_qualification.rep_prefixed)
+  {
+    detail::write_register(context.rcx, (context.rcx & address_mask) - done, address_size);
+  }
 }
 
 void vmexit_passthrough_handler::handle_execute_rdmsr(vcpu_t& vp) noexcept
@@ -730,8 +906,6 @@ void vmexit_passthrough_handler::handle_gdtr_idtr_access(vcpu_t& vp) noexcept
     idtr64_t idtr64;
   };
 
-  cr3_guard _(vp.guest_cr3());
-
   //
   // In legacy or compatibility mode, the destination operand
   // is a 6-byte memory location. If the operand-size attribute
@@ -759,18 +933,31 @@ void vmexit_passthrough_handler::handle_gdtr_idtr_access(vcpu_t& vp) noexcept
     return descriptor_entry.access.long_mode;
   };
 
+  //
+  // Note that the guest memory is accessed via vcpu_t::guest_read()
+  // and guest_write() - the GDT itself is in the kernel address space,
+  // which is mapped in the host address space, too.
+  //
+  size_t size;
+
   switch (instruction_info.instruction)
   {
     case vmx::instruction_info_gdtr_idtr_access_t::instruction_sgdt:
       gdtr64 = vp.guest_gdtr();
-      memcpy(guest_va, &gdtr64, guest_in_long_mode() ? sizeof(gdtr64)
-                                                     : sizeof(gdtr32));
+      size = guest_in_long_mode() ? sizeof(gdtr64) : sizeof(gdtr32);
+      if (vp.guest_write(guest_va, &gdtr64, size) != size)
+      {
+        inject_page_fault(vp, guest_va, size, true);
+      }
       break;
 
     case vmx::instruction_info_gdtr_idtr_access_t::instruction_sidt:
       idtr64 = vp.guest_idtr();
-      memcpy(guest_va, &idtr64, guest_in_long_mode() ? sizeof(idtr64)
-                                                     : sizeof(idtr32));
+      size = guest_in_long_mode() ? sizeof(idtr64) : sizeof(idtr32);
+      if (vp.guest_write(guest_va, &idtr64, size) != size)
+      {
+        inject_page_fault(vp, guest_va, size, true);
+      }
       break;
 
     //
@@ -781,12 +968,20 @@ void vmexit_passthrough_handler::handle_gdtr_idtr_access(vcpu_t& vp) noexcept
     //
 
     case vmx::instruction_info_gdtr_idtr_access_t::instruction_lgdt:
-      memcpy(&gdtr64, guest_va, sizeof(gdtr64));
+      if (vp.guest_read(guest_va, &gdtr64, sizeof(gdtr64)) != sizeof(gdtr64))
+      {
+        inject_page_fault(vp, guest_va, sizeof(gdtr64), false);
+        break;
+      }
       vp.guest_gdtr(gdtr64);
       break;
 
     case vmx::instruction_info_gdtr_idtr_access_t::instruction_lidt:
-      memcpy(&idtr64, guest_va, sizeof(idtr64));
+      if (vp.guest_read(guest_va, &idtr64, sizeof(idtr64)) != sizeof(idtr64))
+      {
+        inject_page_fault(vp, guest_va, sizeof(idtr64), false);
+        break;
+      }
       vp.guest_idtr(idtr64);
       break;
   }
@@ -796,23 +991,51 @@ void vmexit_passthrough_handler::handle_ldtr_tr_access(vcpu_t& vp) noexcept
 {
   auto instruction_info = vp.exit_instruction_info().ldtr_tr_access;
 
-  cr3_guard _(vp.guest_cr3());
+  //
+  // The operand is either the low word of the register or a word in the
+  // guest memory (accessed via vcpu_t::guest_read() and guest_write()).
+  //
+  const bool memory_operand = instruction_info.access_type == vmx::instruction_info_t::access_memory;
+  void* guest_va = memory_operand ? vp.exit_instruction_info_guest_va() : nullptr;
+
+  uint16_t& register_word =
+    reinterpret_cast<uint16_t&>(vp.exit_context().gp_register[instruction_info.register_1]);
 
-  uint16_t& low_word =
-    instruction_info.access_type == vmx::instruction_info_t::access_memory
-      ? *reinterpret_cast<uint16_t*>(vp.exit_instruction_info_guest_va())
-      // instruction_info.access_type == vmx::instruction_info::access_register
-      :  reinterpret_cast<uint16_t&>(vp.exit_context().gp_register[instruction_info.register_1]);
+  uint16_t low_word = 0;
 
   switch (instruction_info.instruction)
   {
     case vmx::instruction_info_ldtr_tr_access_t::instruction_sldt:
-      low_word = vp.guest_segment_selector(context_t::seg_ldtr).flags;
-      break;
-
     case vmx::instruction_info_ldtr_tr_access_t::instruction_str:
-      low_word = vp.guest_segment_selector(context_t::seg_tr).flags;
+      low_word = instruction_info.instruction == vmx::instruction_info_ldtr_tr_access_t::instruction_sldt
+        ? vp.guest_segment_selector(context_t::seg_ldtr).flags
+        : vp.guest_segment_selector(context_t::seg_tr).flags;
+
+      if (!memory_operand)
+      {
+        register_word = low_word;
+      }
+      else if (vp.guest_write(guest_va, &low_word, sizeof(low_word)) != sizeof(low_word))
+      {
+        inject_page_fault(vp, guest_va, sizeof(low_word), true);
+      }
+      return;
+
+    default:
+      if (!memory_operand)
+      {
+        low_word = register_word;
+      }
+      else if (vp.guest_read(guest_va, &low_word, sizeof(low_word)) != sizeof(low_word))
+      {
+        inject_page_fault(vp, guest_va, sizeof(low_word), false);
+        return;
+      }
       break;
+  }
+
+  switch (instruction_info.instruction)
+  {
 
     case vmx::instruction_info_ldtr_tr_access_t::instruction_lldt:
       vp.guest_segment_selector(context_t::seg_ldtr, segment_selector_t{ low_word });
@@ -841,6 +1064,9 @@ void vmexit_passthrough_handler::handle_ldtr_tr_access(vcpu_t& vp) noexcept
         descriptor.access.type |= segment_access_t::type_tss_busy_flag;
       }
       break;
+
+    default:
+      break;
   }
 }
 
@@ -852,7 +1078,7 @@ void vmexit_passthrough_handler::handle_ept_violation(vcpu_t& vp) noexcept
 void vmexit_passthrough_handler::handle_execute_rdtscp(vcpu_t& vp) noexcept
 {
   uint32_t tsc_aux;
-  uint64_t tsc = ia32_asm_read_tscp(&tsc_aux);
+  uint64_t tsc = vp.guest_tsc(ia32_asm_read_tscp(&tsc_aux));
 
   vp.exit_context().rax = tsc & 0xffffffff;
   vp.exit_context().rdx = tsc >> 32;
@@ -896,10 +1122,11 @@ void vmexit_passthrough_handler::handle_execute_invpcid(vcpu_t& vp) noexcept
     goto inject_general_protection;
   }
 
-  //
-  // TODO: fetch the descriptor safely, inject #PF on error.
-  //
-  memcpy(&descriptor, guest_va, sizeof(descriptor));
+  if (vp.guest_read(guest_va, &descriptor, sizeof(descriptor)) != sizeof(descriptor))
+  {
+    inject_page_fault(vp, guest_va, sizeof(descriptor), false);
+    return;
+  }
 
   //
   // #GP(0) ... If bits 63:12 of INVPCID_DESC are not all zero.
@@ -945,19 +1172,23 @@ void vmexit_passthrough_handler::handle_execute_invpcid(vcpu_t& vp) noexcept
       // #GP(0) ... If INVPCID_TYPE is 0 and the linear address
       // in INVPCID_DESC[127:64] is not canonical.
       //
-      vmx::invvpid_individual_address(vp.vcpu_id(), descriptor.linear_address);
+      vp.vpid_invalidate(descriptor.linear_address);
+      vp.gva_tlb_flush(descriptor.linear_address);
       break;
 
     case invpcid_t::single_context:
-      vmx::invvpid_single_context(vp.vcpu_id());
+      vp.vpid_invalidate();
+      vp.gva_tlb_flush_pcid(static_cast<uint16_t>(descriptor.pcid));
       break;
 
     case invpcid_t::all_contexts:
-      vmx::invvpid_single_context(vp.vcpu_id());
+      vp.vpid_invalidate();
+      vp.gva_tlb_flush();
       break;
 
     case invpcid_t::all_contexts_retaining_globals:
-      vmx::invvpid_single_context_retaining_globals(vp.vcpu_id());
+      vp.vpid_invalidate_retaining_globals();
+      vp.gva_tlb_flush();
       break;
   }
 
@@ -1025,15 +1256,47 @@ void vmexit_passthrough_handler::handle_interrupt(vcpu_t& vp) noexcept
       {
         case exception_vector::invalid_opcode:
           {
-            cr3_guard _(vp.guest_cr3());
+            using detail::decoded_instruction;
+
+            const auto rip = va_t{ vp.exit_context().rip };
+            auto kind = decoded_instruction::none;
+
+            if (auto entry = vp.decode_cache_lookup(rip))
+            {
+              kind = static_cast<decoded_instruction>(entry->kind);
+            }
+            else
+            {
+              //
+              // Fetch the instruction without switching CR3.  Note that
+              // only part of it might be fetched, if it crosses into
+              // a non-present page.
+              //
+              uint8_t instruction[detail::max_opcode_size];
+              const auto size = vp.guest_read(rip, instruction, sizeof(instruction));
+
+              if (detail::is_syscall_instruction(instruction, size))
+              {
+                kind = decoded_instruction::syscall;
+              }
+              else if (detail::is_sysret_instruction(instruction, size))
+              {
+                kind = decoded_instruction::sysret;
+              }
+
+              if (kind != decoded_instruction::none)
+              {
+                vp.decode_cache_insert(rip, static_cast<uint32_t>(kind), 0);
+              }
+            }
 
-            if (detail::is_syscall_instruction(vp.exit_context().rip_as_pointer))
+            if (kind == decoded_instruction::syscall)
             {
               handle_emulate_syscall(vp);
               vp.suppress_rip_adjust();
               return;
             }
-            else if (detail::is_sysret_instruction(vp.exit_context().rip_as_pointer))
+            else if (kind == decoded_instruction::sysret)
             {
               handle_emulate_sysret(vp);
               vp.suppress_rip_adjust();
@@ -1046,15 +1309,41 @@ void vmexit_passthrough_handler::handle_interrupt(vcpu_t& vp) noexcept
 
 #ifdef HVPP_ENABLE_VMWARE_WORKAROUND
 
+          if (vmware_workaround_)
           {
             //
             // VMWare I/O backdoor (port 0x5658/0x5659) workaround.
             //
-            cr3_guard _(vp.guest_cr3());
+            using detail::decoded_instruction;
+
+            const auto rip = va_t{ vp.exit_context().rip };
 
             vmx::exit_qualification_io_instruction_t exit_qualification;
+
+            if (auto entry = vp.decode_cache_lookup(rip);
+                entry && entry->kind == static_cast<uint32_t>(decoded_instruction::io))
+            {
+              exit_qualification.flags       = entry->data;
+              exit_qualification.port_number = vp.exit_context().rdx & 0xffff;
+
+              //
+              // String I/O still accesses the guest buffer.
+              //
+              auto _ = vp.guest_address_space();
+              ia32_asm_io_with_context(exit_qualification, vp.exit_context());
+              return;
+            }
+
+            auto _ = vp.guest_address_space();
+
             if (try_decode_io_instruction(vp.exit_context(), exit_qualification))
             {
+              auto decoded = exit_qualification;
+              decoded.port_number = 0;
+
+              vp.decode_cache_insert(rip, static_cast<uint32_t>(decoded_instruction::io),
+                                     static_cast<uint32_t>(decoded.flags));
+
               ia32_asm_io_with_context(exit_qualification, vp.exit_context());
               return;
             }
@@ -1241,4 +1530,28 @@ void vmexit_passthrough_handler::handle_emulate_sysret(vcpu_t& vp) noexcept
   vp.guest_ss(ss);
 }
 
+void vmexit_passthrough_handler::inject_page_fault(vcpu_t& vp, va_t va, size_t size, bool write_access) noexcept
+{
+  //
+  // CR2 holds the first byte which can't be accessed (CR2 isn't part
+  // of the guest state, it's shared by the host and the guest).  The P
+  // bit of the error code tells a rights violation from a non-present
+  // page.
+  //
+  const auto fault_va = va + va_t{ vp.guest_accessible(va, size, write_access) };
+
+  exception_error_code_t error_code{};
+  error_code.pagefault.present = !!vp.gva_to_gpa(fault_va);
+  error_code.pagefault.write = write_access;
+  error_code.pagefault.user_mode_access =
+    vp.guest_segment_access(context_t::seg_ss).descriptor_privilege_level == 3;
+
+  write<cr2_t>(cr2_t{ fault_va.value() });
+
+  vp.interrupt_inject(interrupt_t{ vmx::interrupt_type::hardware_exception,
+                                   exception_vector::page_fault,
+                                   error_code });
+  vp.suppress_rip_adjust();
+}
+
 }
@@ -14,6 +14,8 @@ class vmexit_passthrough_handler
   : public vmexit_handler
 {
   public:
+    vmexit_passthrough_handler() noexcept;
+
     void setup(vcpu_t& vp) noexcept override;
     void invoke_termination(vcpu_t& vp) noexcept override;
 
@@ -63,8 +65,24 @@ class vmexit_passthrough_handler
     //
     virtual void handle_interrupt(vcpu_t& vp) noexcept;
 
+    virtual void handle_execute_io_string(vcpu_t& vp) noexcept;
+
     virtual void handle_emulate_syscall(vcpu_t& vp) noexcept;
     virtual void handle_emulate_sysret(vcpu_t& vp) noexcept;
+
+    //
+    // Inject #PF for the failed guest access of "size" bytes at "va"
+    // (see vcpu_t::guest_read()).  CR2 is set to the first byte of the
+    // range which the guest can't access.
+    //
+    void inject_page_fault(vcpu_t& vp, va_t va, size_t size, bool write_access) noexcept;
+
+  private:
+    //
+    // Running in VMWare - emulate I/O of the backdoor ports with the
+    // full register context (see HVPP_ENABLE_VMWARE_WORKAROUND).
+    //
+    bool vmware_workaround_;
 };
 
 }
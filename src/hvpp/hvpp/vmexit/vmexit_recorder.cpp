@@ -0,0 +1,120 @@
+#define HVPP_LOG_MODULE vmexit
+
+#include "vmexit_recorder.h"
+
+#include "hvpp/vcpu.h"
+
+#include "hvpp/lib/assert.h"
+#include "hvpp/lib/event_channel.h"
+#include "hvpp/lib/exit_record.h"
+
+#include <cstring>
+
+namespace hvpp {
+
+vmexit_recorder_handler::vmexit_recorder_handler() noexcept
+  : per_vcpu_{}
+{
+  const auto err = per_vcpu_.initialize();
+  hvpp_assert(!err);
+  (void)(err);
+}
+
+vmexit_recorder_handler::~vmexit_recorder_handler() noexcept
+{
+
+}
+
+void vmexit_recorder_handler::attach(vcpu_t& vp) noexcept
+{
+  per_vcpu_[vp.cpu_index()] = per_vcpu_t{};
+}
+
+void vmexit_recorder_handler::handle(vcpu_t& vp) noexcept
+{
+  if (!event_channel::is_active())
+  {
+    //
+    // Nobody would read the records - don't spend VMREADs on them.
+    //
+    return;
+  }
+
+  using field = vmx::vmcs_t::field;
+
+  //
+  // Exit-information fields are served from the per-exit cache, so the
+  // handlers after the recorder don't read them again.
+  //
+  const auto state = vp.vmcs_fields<field::vmexit_reason,
+                                    field::vmexit_qualification,
+                                    field::vmexit_guest_linear_address,
+                                    field::vmexit_guest_physical_address,
+                                    field::vmexit_instruction_length,
+                                    field::vmexit_instruction_info,
+                                    field::vmexit_interruption_info,
+                                    field::vmexit_interruption_error_code,
+                                    field::vmexit_idt_vectoring_info,
+                                    field::vmexit_idt_vectoring_error_code,
+                                    field::guest_cr0,
+                                    field::guest_cr3,
+                                    field::guest_cr4>();
+
+  const auto& context = vp.exit_context();
+
+  exit_record::record_t record;
+  record.timestamp                = ia32_asm_read_tsc();
+  record.cpu_index                = vp.cpu_index();
+  record.exit_reason              = state.get<field::vmexit_reason>();
+  record.exit_qualification       = state.get<field::vmexit_qualification>();
+  record.guest_linear_address     = state.get<field::vmexit_guest_linear_address>();
+  record.guest_physical_address   = state.get<field::vmexit_guest_physical_address>();
+  record.instruction_length       = state.get<field::vmexit_instruction_length>();
+  record.instruction_info         = state.get<field::vmexit_instruction_info>();
+  record.interruption_info        = state.get<field::vmexit_interruption_info>();
+  record.interruption_error_code  = state.get<field::vmexit_interruption_error_code>();
+  record.idt_vectoring_info       = state.get<field::vmexit_idt_vectoring_info>();
+  record.idt_vectoring_error_code = state.get<field::vmexit_idt_vectoring_error_code>();
+  record.guest_rip                = context.rip;
+  record.guest_rflags             = context.rflags.flags;
+  record.guest_cr0                = state.get<field::guest_cr0>();
+  record.guest_cr3                = state.get<field::guest_cr3>();
+  record.guest_cr4                = state.get<field::guest_cr4>();
+  record.reserved                 = 0;
+
+  static_assert(sizeof(record.gp_register) == sizeof(context.gp_register));
+  memcpy(record.gp_register, context.gp_register, sizeof(record.gp_register));
+
+  const auto posted = event_channel::post_multi(event_channel::event_type::exit_record,
+                                                &record, sizeof(record));
+
+  auto& data = per_vcpu_[vp.cpu_index()];
+  data.record_count  += 1;
+  data.dropped_count += !posted;
+}
+
+uint64_t vmexit_recorder_handler::record_count() const noexcept
+{
+  uint64_t result = 0;
+
+  for (uint32_t i = 0; i < per_vcpu_.size(); ++i)
+  {
+    result += per_vcpu_[i].record_count;
+  }
+
+  return result;
+}
+
+uint64_t vmexit_recorder_handler::dropped_count() const noexcept
+{
+  uint64_t result = 0;
+
+  for (uint32_t i = 0; i < per_vcpu_.size(); ++i)
+  {
+    result += per_vcpu_[i].dropped_count;
+  }
+
+  return result;
+}
+
+}
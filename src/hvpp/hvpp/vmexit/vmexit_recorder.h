@@ -0,0 +1,59 @@
+#pragma once
+#include "hvpp/vmexit.h"
+
+#include "hvpp/config.h"
+#include "hvpp/lib/per_cpu.h"
+
+#include <cstdint>
+
+namespace hvpp {
+
+//
+// Recorder of VM-exits for the offline replay.
+//
+// Each VM-exit is captured - exit reason, qualification, selected VMCS
+// fields and general purpose registers of the guest (see
+// exit_record::record_t) - before the handlers composed after the
+// recorder see it, and it's posted into the event channel.  The consumer
+// (hvppctrl record) streams the records into the replay file, which can
+// be replayed through any handler by the user-mode build (hvppbench
+// replay).
+//
+// The recorder only observes - it should be a stage of the pipeline,
+// enabled by the pipeline mask only while recording.  VM-exits are
+// recorded only while the consumer is attached to the event channel.
+//
+// Usage:
+//   vmexit_pipeline_handler<
+//     vmexit_recorder_handler,
+//     vmexit_custom_handler
+//     >;
+//
+//   handler->masks.mask(handler_t::stage_index<vmexit_recorder_handler>,
+//                       vmexit_pipeline_mask::mask_none);
+//
+
+class vmexit_recorder_handler
+  : public vmexit_handler
+{
+  public:
+    vmexit_recorder_handler() noexcept;
+    ~vmexit_recorder_handler() noexcept override;
+
+    void attach(vcpu_t& vp) noexcept override;
+    void handle(vcpu_t& vp) noexcept override;
+
+    uint64_t record_count() const noexcept;
+    uint64_t dropped_count() const noexcept;
+
+  private:
+    struct per_vcpu_t
+    {
+      uint64_t record_count;
+      uint64_t dropped_count;
+    };
+
+    per_cpu<per_vcpu_t> per_vcpu_;
+};
+
+}
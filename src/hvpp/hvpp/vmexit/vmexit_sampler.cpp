@@ -0,0 +1,208 @@
+#define HVPP_LOG_MODULE vmexit
+
+#include "vmexit_sampler.h"
+
+#include "hvpp/hypervisor.h"
+#include "hvpp/vcpu.h"
+
+#include "hvpp/lib/assert.h"
+#include "hvpp/lib/event_channel.h"
+#include "hvpp/lib/log.h"
+
+#include <algorithm>
+
+namespace hvpp {
+
+vmexit_sampler_handler::vmexit_sampler_handler() noexcept
+  : timer_value_{ 0 }
+  , per_vcpu_{}
+{
+  const auto err = per_vcpu_.initialize();
+  hvpp_assert(!err);
+  (void)(err);
+}
+
+vmexit_sampler_handler::~vmexit_sampler_handler() noexcept
+{
+
+}
+
+auto vmexit_sampler_handler::rate(uint32_t samples_per_second) noexcept -> error_code_t
+{
+  if (samples_per_second == 0)
+  {
+    interval(0);
+    return error_code_t{};
+  }
+
+  const auto frequency = tsc_frequency();
+
+  if (frequency == 0)
+  {
+    //
+    // TSC frequency isn't enumerated by CPUID - use interval() instead.
+    //
+    return make_error_code_t(std::errc::not_supported);
+  }
+
+  interval(std::max<uint64_t>(frequency / samples_per_second, 1));
+  return error_code_t{};
+}
+
+void vmexit_sampler_handler::interval(uint64_t tsc_ticks) noexcept
+{
+  hvpp_assert(!hypervisor::is_started());
+
+  //
+  // The VMX-preemption timer counts down by 1 every time bit X of the
+  // TSC changes, where X is the "preemption_timer_tsc_relationship"
+  // field of IA32_VMX_MISC.
+  // (ref: Vol3C[25.5.1(VMX-Preemption Timer)])
+  //
+  const auto tsc_shift = msr::read<msr::vmx_misc_t>().preemption_timer_tsc_relationship;
+  const auto timer_ticks = tsc_ticks >> tsc_shift;
+
+  timer_value_ = tsc_ticks == 0
+    ? 0
+    : static_cast<uint32_t>(std::clamp<uint64_t>(timer_ticks, 1, UINT32_MAX));
+}
+
+void vmexit_sampler_handler::attach(vcpu_t& vp) noexcept
+{
+  per_vcpu_[vp.cpu_index()] = per_vcpu_t{};
+
+  if (timer_value_ == 0)
+  {
+    return;
+  }
+
+  //
+  // Without "save VMX-preemption timer value", the timer would be
+  // reloaded from the VMCS on each VM-entry - and frequent VM-exits of
+  // other reasons would starve it.
+  //
+  auto pin_based_ctls = vp.pin_based_controls();
+  pin_based_ctls.activate_vmx_preemption_timer = true;
+  vp.pin_based_controls(pin_based_ctls);
+
+  auto exit_ctls = vp.vm_exit_controls();
+  exit_ctls.save_vmx_preemption_timer_value = true;
+  vp.vm_exit_controls(exit_ctls);
+
+  if (!vp.pin_based_controls().activate_vmx_preemption_timer ||
+      !vp.vm_exit_controls().save_vmx_preemption_timer_value)
+  {
+    hvpp_warn("VMX-preemption timer not supported, sampling disabled");
+
+    pin_based_ctls.activate_vmx_preemption_timer = false;
+    vp.pin_based_controls(pin_based_ctls);
+
+    exit_ctls.save_vmx_preemption_timer_value = false;
+    vp.vm_exit_controls(exit_ctls);
+    return;
+  }
+
+  vp.guest_vmx_preemption_timer_value(timer_value_);
+}
+
+void vmexit_sampler_handler::detach(vcpu_t& vp) noexcept
+{
+  //
+  // Don't leave the timer running for the next handler.
+  //
+  auto pin_based_ctls = vp.pin_based_controls();
+  pin_based_ctls.activate_vmx_preemption_timer = false;
+  vp.pin_based_controls(pin_based_ctls);
+
+  auto exit_ctls = vp.vm_exit_controls();
+  exit_ctls.save_vmx_preemption_timer_value = false;
+  vp.vm_exit_controls(exit_ctls);
+}
+
+void vmexit_sampler_handler::handle(vcpu_t& vp) noexcept
+{
+  if (vp.exit_reason() != vmx::exit_reason::vmx_preemption_timer_expired)
+  {
+    return;
+  }
+
+  auto& data = per_vcpu_[vp.cpu_index()];
+
+  const auto posted = event_channel::post(event_channel::event_type::sample,
+                                          vp.exit_context().rip,
+                                          vp.guest_cr3().flags,
+                                          vp.guest_segment_access(context_t::seg_ss).descriptor_privilege_level);
+
+  data.sample_count  += 1;
+  data.dropped_count += !posted;
+
+  //
+  // Rearm the timer (its saved value is 0 now) and re-enter the guest
+  // at the same instruction - this VM-exit isn't caused by any.
+  //
+  vp.guest_vmx_preemption_timer_value(timer_value_);
+  vp.suppress_rip_adjust();
+}
+
+uint64_t vmexit_sampler_handler::sample_count() const noexcept
+{
+  uint64_t result = 0;
+
+  for (uint32_t i = 0; i < per_vcpu_.size(); ++i)
+  {
+    result += per_vcpu_[i].sample_count;
+  }
+
+  return result;
+}
+
+uint64_t vmexit_sampler_handler::dropped_count() const noexcept
+{
+  uint64_t result = 0;
+
+  for (uint32_t i = 0; i < per_vcpu_.size(); ++i)
+  {
+    result += per_vcpu_[i].dropped_count;
+  }
+
+  return result;
+}
+
+uint64_t vmexit_sampler_handler::tsc_frequency() noexcept
+{
+  uint32_t cpu_info[4];
+  ia32_asm_cpuid(cpu_info, 0);
+
+  const auto max_leaf = cpu_info[0];
+
+  if (max_leaf >= 0x15)
+  {
+    //
+    // TSC frequency = crystal frequency * EBX / EAX.
+    //
+    ia32_asm_cpuid(cpu_info, 0x15);
+
+    if (cpu_info[0] && cpu_info[1] && cpu_info[2])
+    {
+      return uint64_t(cpu_info[2]) * cpu_info[1] / cpu_info[0];
+    }
+  }
+
+  if (max_leaf >= 0x16)
+  {
+    //
+    // Processor base frequency (in MHz) - TSC usually runs at this
+    // frequency.
+    //
+    ia32_asm_cpuid(cpu_info, 0x16);
+
+    if (cpu_info[0] & 0xffff)
+    {
+      return uint64_t(cpu_info[0] & 0xffff) * 1'000'000;
+    }
+  }
+
+  return 0;
+}
+
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include "hvpp/vmexit.h"
+
+#include "hvpp/config.h"
+#include "hvpp/lib/error.h"
+#include "hvpp/lib/per_cpu.h"
+
+#include <cstdint>
+
+namespace hvpp {
+
+//
+// System-wide sampling profiler driven by the VMX-preemption timer.
+//
+// Each VCPU arms the preemption timer with the configured interval.
+// The timer counts down only while the guest runs (its value is saved
+// on each VM-exit), so that the overhead is deterministic - exactly one
+// VM-exit per interval of guest time.  On expiry, the guest RIP, CR3
+// and CPL are posted into the event channel (event_type::sample), which
+// is a per-CPU ring mapped into the consumer process.
+//
+// Usage (compose it with other handlers):
+//   vmexit_compositor_handler<
+//     vmexit_sampler_handler,
+//     vmexit_custom_handler
+//     >;
+//
+//   std::get<vmexit_sampler_handler>(handler->handlers).rate(1000);
+//
+
+class vmexit_sampler_handler
+  : public vmexit_handler
+{
+  public:
+    vmexit_sampler_handler() noexcept;
+    ~vmexit_sampler_handler() noexcept override;
+
+    //
+    // These methods must be called before the hypervisor is started.
+    // Interval of 0 disables the sampling.
+    //
+    auto rate(uint32_t samples_per_second) noexcept -> error_code_t;
+    void interval(uint64_t tsc_ticks) noexcept;
+
+    void attach(vcpu_t& vp) noexcept override;
+    void detach(vcpu_t& vp) noexcept override;
+    void handle(vcpu_t& vp) noexcept override;
+
+    uint64_t sample_count() const noexcept;
+    uint64_t dropped_count() const noexcept;
+
+    //
+    // Called by the vmexit_compositor_handler only for the preemption
+    // timer VM-exits.
+    //
+    static constexpr bool handles_exit_reason(vmx::exit_reason exit_reason) noexcept
+    { return exit_reason == vmx::exit_reason::vmx_preemption_timer_expired; }
+
+    //
+    // The preemption timer VM-exit is fully handled by the sampler -
+    // handlers composed after it aren't called.
+    //
+    vmexit_result handle_chained(vcpu_t& vp) noexcept
+    { vmexit_sampler_handler::handle(vp); return vmexit_result::handled; }
+
+  private:
+    //
+    // Returns TSC frequency (in Hz) reported by CPUID, or 0 if unknown.
+    //
+    static uint64_t tsc_frequency() noexcept;
+
+    uint32_t timer_value_;
+
+    struct per_vcpu_t
+    {
+      uint64_t sample_count;
+      uint64_t dropped_count;
+    };
+
+    per_cpu<per_vcpu_t> per_vcpu_;
+};
+
+}
@@ -0,0 +1,115 @@
+#pragma once
+#include "hvpp/vmexit.h"
+#include "hvpp/vmexit/vmexit_passthrough.h"
+
+#include <type_traits>
+
+namespace hvpp {
+
+//
+// Statically dispatched VM-exit handler (CRTP).
+//
+// vmexit_handler::handle() calls handle_* methods through the array of
+// member-function pointers, i.e. each VM-exit costs a virtual call of
+// handle() plus an indirect virtual call of the handle_* method, and
+// neither of them can be inlined.
+//
+// This template replaces handle() with a switch, which calls handle_*
+// methods of the DERIVED class by qualified name - such calls are bound
+// statically and can be inlined.  Existing overrides (declared with the
+// "override" keyword) can stay as they are - simply derive from
+//
+//   vmexit_static_handler<my_handler, vmexit_passthrough_handler>
+//
+// instead of vmexit_passthrough_handler.  Note that handle_* methods
+// redeclared in the DERIVED class must be accessible from this class
+// (i.e. public, or DERIVED must declare this class as a friend).
+//
+
+template <
+  typename DERIVED,
+  typename BASE = vmexit_passthrough_handler
+>
+class vmexit_static_handler
+  : public BASE
+{
+  public:
+    void handle(vcpu_t& vp) noexcept override
+    {
+      static_assert(std::is_base_of_v<vmexit_static_handler, DERIVED>);
+
+      auto& self = static_cast<DERIVED&>(*this);
+
+      switch (vp.exit_reason())
+      {
+        case vmx::exit_reason::exception_or_nmi:             self.DERIVED::handle_exception_or_nmi(vp); break;
+        case vmx::exit_reason::external_interrupt:           self.DERIVED::handle_external_interrupt(vp); break;
+        case vmx::exit_reason::triple_fault:                 self.DERIVED::handle_triple_fault(vp); break;
+        case vmx::exit_reason::init_signal:                  self.DERIVED::handle_init_signal(vp); break;
+        case vmx::exit_reason::startup_ipi:                  self.DERIVED::handle_startup_ipi(vp); break;
+        case vmx::exit_reason::io_smi:                       self.DERIVED::handle_io_smi(vp); break;
+        case vmx::exit_reason::smi:                          self.DERIVED::handle_smi(vp); break;
+        case vmx::exit_reason::interrupt_window:             self.DERIVED::handle_interrupt_window(vp); break;
+        case vmx::exit_reason::nmi_window:                   self.DERIVED::handle_nmi_window(vp); break;
+        case vmx::exit_reason::task_switch:                  self.DERIVED::handle_task_switch(vp); break;
+        case vmx::exit_reason::execute_cpuid:                self.DERIVED::handle_execute_cpuid(vp); break;
+        case vmx::exit_reason::execute_getsec:               self.DERIVED::handle_execute_getsec(vp); break;
+        case vmx::exit_reason::execute_hlt:                  self.DERIVED::handle_execute_hlt(vp); break;
+        case vmx::exit_reason::execute_invd:                 self.DERIVED::handle_execute_invd(vp); break;
+        case vmx::exit_reason::execute_invlpg:               self.DERIVED::handle_execute_invlpg(vp); break;
+        case vmx::exit_reason::execute_rdpmc:                self.DERIVED::handle_execute_rdpmc(vp); break;
+        case vmx::exit_reason::execute_rdtsc:                self.DERIVED::handle_execute_rdtsc(vp); break;
+        case vmx::exit_reason::execute_rsm_in_smm:           self.DERIVED::handle_execute_rsm_in_smm(vp); break;
+        case vmx::exit_reason::execute_vmcall:               self.DERIVED::handle_execute_vmcall(vp); break;
+        case vmx::exit_reason::execute_vmclear:              self.DERIVED::handle_execute_vmclear(vp); break;
+        case vmx::exit_reason::execute_vmlaunch:             self.DERIVED::handle_execute_vmlaunch(vp); break;
+        case vmx::exit_reason::execute_vmptrld:              self.DERIVED::handle_execute_vmptrld(vp); break;
+        case vmx::exit_reason::execute_vmptrst:              self.DERIVED::handle_execute_vmptrst(vp); break;
+        case vmx::exit_reason::execute_vmread:               self.DERIVED::handle_execute_vmread(vp); break;
+        case vmx::exit_reason::execute_vmresume:             self.DERIVED::handle_execute_vmresume(vp); break;
+        case vmx::exit_reason::execute_vmwrite:              self.DERIVED::handle_execute_vmwrite(vp); break;
+        case vmx::exit_reason::execute_vmxoff:               self.DERIVED::handle_execute_vmxoff(vp); break;
+        case vmx::exit_reason::execute_vmxon:                self.DERIVED::handle_execute_vmxon(vp); break;
+        case vmx::exit_reason::mov_cr:                       self.DERIVED::handle_mov_cr(vp); break;
+        case vmx::exit_reason::mov_dr:                       self.DERIVED::handle_mov_dr(vp); break;
+        case vmx::exit_reason::execute_io_instruction:       self.DERIVED::handle_execute_io_instruction(vp); break;
+        case vmx::exit_reason::execute_rdmsr:                self.DERIVED::handle_execute_rdmsr(vp); break;
+        case vmx::exit_reason::execute_wrmsr:                self.DERIVED::handle_execute_wrmsr(vp); break;
+        case vmx::exit_reason::error_invalid_guest_state:    self.DERIVED::handle_error_invalid_guest_state(vp); break;
+        case vmx::exit_reason::error_msr_load:               self.DERIVED::handle_error_msr_load(vp); break;
+        case vmx::exit_reason::reserved_1:                   self.DERIVED::handle_fallback(vp); break;
+        case vmx::exit_reason::execute_mwait:                self.DERIVED::handle_execute_mwait(vp); break;
+        case vmx::exit_reason::monitor_trap_flag:            self.DERIVED::handle_monitor_trap_flag(vp); break;
+        case vmx::exit_reason::reserved_2:                   self.DERIVED::handle_fallback(vp); break;
+        case vmx::exit_reason::execute_monitor:              self.DERIVED::handle_execute_monitor(vp); break;
+        case vmx::exit_reason::execute_pause:                self.DERIVED::handle_execute_pause(vp); break;
+        case vmx::exit_reason::error_machine_check:          self.DERIVED::handle_error_machine_check(vp); break;
+        case vmx::exit_reason::reserved_3:                   self.DERIVED::handle_fallback(vp); break;
+        case vmx::exit_reason::tpr_below_threshold:          self.DERIVED::handle_tpr_below_threshold(vp); break;
+        case vmx::exit_reason::apic_access:                  self.DERIVED::handle_apic_access(vp); break;
+        case vmx::exit_reason::virtualized_eoi:              self.DERIVED::handle_virtualized_eoi(vp); break;
+        case vmx::exit_reason::gdtr_idtr_access:             self.DERIVED::handle_gdtr_idtr_access(vp); break;
+        case vmx::exit_reason::ldtr_tr_access:               self.DERIVED::handle_ldtr_tr_access(vp); break;
+        case vmx::exit_reason::ept_violation:                self.DERIVED::handle_ept_violation(vp); break;
+        case vmx::exit_reason::ept_misconfiguration:         self.DERIVED::handle_ept_misconfiguration(vp); break;
+        case vmx::exit_reason::execute_invept:               self.DERIVED::handle_execute_invept(vp); break;
+        case vmx::exit_reason::execute_rdtscp:               self.DERIVED::handle_execute_rdtscp(vp); break;
+        case vmx::exit_reason::vmx_preemption_timer_expired: self.DERIVED::handle_vmx_preemption_timer_expired(vp); break;
+        case vmx::exit_reason::execute_invvpid:              self.DERIVED::handle_execute_invvpid(vp); break;
+        case vmx::exit_reason::execute_wbinvd:               self.DERIVED::handle_execute_wbinvd(vp); break;
+        case vmx::exit_reason::execute_xsetbv:               self.DERIVED::handle_execute_xsetbv(vp); break;
+        case vmx::exit_reason::apic_write:                   self.DERIVED::handle_apic_write(vp); break;
+        case vmx::exit_reason::execute_rdrand:               self.DERIVED::handle_execute_rdrand(vp); break;
+        case vmx::exit_reason::execute_invpcid:              self.DERIVED::handle_execute_invpcid(vp); break;
+        case vmx::exit_reason::execute_vmfunc:               self.DERIVED::handle_execute_vmfunc(vp); break;
+        case vmx::exit_reason::execute_encls:                self.DERIVED::handle_execute_encls(vp); break;
+        case vmx::exit_reason::execute_rdseed:               self.DERIVED::handle_execute_rdseed(vp); break;
+        case vmx::exit_reason::page_modification_log_full:   self.DERIVED::handle_page_modification_log_full(vp); break;
+        case vmx::exit_reason::execute_xsaves:               self.DERIVED::handle_execute_xsaves(vp); break;
+        case vmx::exit_reason::execute_xrstors:              self.DERIVED::handle_execute_xrstors(vp); break;
+        default:                                             self.DERIVED::handle_fallback(vp); break;
+      }
+    }
+};
+
+}
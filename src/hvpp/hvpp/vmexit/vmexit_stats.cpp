@@ -1,37 +1,103 @@
+#define HVPP_LOG_MODULE vmexit
+
 #include "vmexit_stats.h"
 
 #include "hvpp/vcpu.h"
 
 #include "hvpp/lib/assert.h"
+#include "hvpp/lib/event_channel.h"
 #include "hvpp/lib/log.h"
-#include "hvpp/lib/mp.h" // mp::cpu_index()
+#include "hvpp/lib/mm.h"
+#include "hvpp/lib/mp.h" // mp::cpu_count()
 
+#include <cstddef>  // offsetof()
 #include <iterator> // std::size()
 
 #define hvpp_trace_if_enabled(format, ...)                        \
   do                                                              \
   {                                                               \
-    if (vmexit_trace_bitmap_.test(static_cast<int>(exit_reason))) \
+    if ((vmexit_trace_bitmap_.test(static_cast<int>(exit_reason)) && \
+         trace_sample(vp, exit_reason, cpu_storage)) ||           \
+        trace_armed(exit_reason, cpu_storage))                    \
     {                                                             \
-      hvpp_trace(format, __VA_ARGS__);                            \
+      hvpp_trace_fast(format, __VA_ARGS__);                       \
+                                                                  \
+      event_channel::post(event_channel::event_type::vmexit_trace,\
+                          static_cast<uint64_t>(exit_reason),     \
+                          vp.exit_qualification().flags,          \
+                          vp.exit_context().rip);                 \
     }                                                             \
   } while (0)
 
+//
+// Increment counter of the current VM-exit - either the dense one
+// (if the dense storage has its category), or the one in the sparse
+// table (keyed by exit_reason and sub_key).
+//
+#define hvpp_stats_increment(category, dense_counter, sub_key)                     \
+  do                                                                               \
+  {                                                                                \
+    if (stats)                                                                     \
+    {                                                                              \
+      vmexit_storage_if<vmexit_storage_category::category>(                        \
+        [&](auto& s) { s.dense_counter += 1; }, *stats);                           \
+    }                                                                              \
+    else                                                                           \
+    {                                                                              \
+      cpu_storage.sparse->increment(                                               \
+        vmexit_stats_sparse_storage_t::make_key(exit_reason, uint32_t(sub_key)));  \
+    }                                                                              \
+  } while (0)
+
 namespace hvpp {
 
-vmexit_stats_handler::vmexit_stats_handler() noexcept
-  : storage_merged_{}
+//
+// vmexit_stats_snapshot_t (shared with the user-mode) must match
+// the layout of the storage.
+//
+static_assert(sizeof(vmexit_stats_snapshot_t) == sizeof(vmexit_stats_storage_t));
+static_assert(offsetof(vmexit_stats_snapshot_t, cpuid_other) == offsetof(vmexit_stats_storage_t, cpuid_other));
+static_assert(offsetof(vmexit_stats_snapshot_t, io_in)       == offsetof(vmexit_stats_storage_t, io_in));
+static_assert(offsetof(vmexit_stats_snapshot_t, rdmsr_0)     == offsetof(vmexit_stats_storage_t, rdmsr_0));
+static_assert(offsetof(vmexit_stats_snapshot_t, wrmsr_other) == offsetof(vmexit_stats_storage_t, wrmsr_other));
+
+vmexit_stats_handler::vmexit_stats_handler(storage_mode mode /* = default_storage_mode */) noexcept
+  : storage_{}
+  , storage_snapshot_{}
+  , storage_merged_{}
+  , sparse_snapshot_{}
+  , sparse_merged_{}
+  , attribution_snapshot_{}
+  , attribution_merged_{}
+  , mode_{ mode }
+  , ring_{}
+  , ring_size_{}
   , vmexit_trace_bitmap_{}
+  , vmexit_trace_filter_{}
 {
   terminated_vcpu_count_ = 0;
 
   //
-  // Allocate memory for statistics (per VCPU).
+  // Memory for statistics of each VCPU is allocated in prepare().
   //
-  storage_ = new vmexit_stats_storage_t[mp::cpu_count()];
-  hvpp_assert(storage_ != nullptr);
+  const auto err = storage_.initialize();
+  hvpp_assert(!err);
+  (void)(err);
 
-  memset(storage_, 0, sizeof(*storage_) * mp::cpu_count());
+  mm::tag_guard _{ mm::memory_tag::stats };
+
+  if (mode_ == storage_mode::dense)
+  {
+    storage_snapshot_ = new vmexit_stats_cpu_counters_t;
+    storage_merged_ = new vmexit_stats_storage_t;
+    hvpp_assert(storage_snapshot_ != nullptr && storage_merged_ != nullptr);
+  }
+  else
+  {
+    sparse_snapshot_ = new vmexit_stats_sparse_storage_t;
+    sparse_merged_ = new vmexit_stats_sparse_merged_t;
+    hvpp_assert(sparse_snapshot_ != nullptr && sparse_merged_ != nullptr);
+  }
 
   //
   // Uncomment this to trace all VM-exit reasons.
@@ -45,6 +111,12 @@ vmexit_stats_handler::vmexit_stats_handler() noexcept
   //
   // vmexit_trace_bitmap_.clear(int(vmx::exit_reason::exception_or_nmi));
   //
+  // Example of tracing only every 100th RDMSR of MSRs 0xC0000080 -
+  // 0xC0000084 executed in the user-mode (see trace_filter()):
+  //
+  // vmexit_trace_bitmap_.set(int(vmx::exit_reason::execute_rdmsr));
+  // vmexit_trace_filter_[int(vmx::exit_reason::execute_rdmsr)] = { 100, 0xc000'0080, 0xc000'0084, 1 << 3 };
+  //
 }
 
 vmexit_stats_handler::~vmexit_stats_handler() noexcept
@@ -52,43 +124,341 @@ vmexit_stats_handler::~vmexit_stats_handler() noexcept
   //
   // Free the memory.
   //
-  delete[] storage_;
+  for (uint32_t i = 0; i < storage_.size(); ++i)
+  {
+    delete storage_[i].dense;
+    delete storage_[i].sparse;
+    delete storage_[i].attribution;
+  }
+
+  delete storage_snapshot_;
+  delete storage_merged_;
+  delete sparse_snapshot_;
+  delete sparse_merged_;
+  delete attribution_snapshot_;
+  delete attribution_merged_;
+
+  delete[] reinterpret_cast<uint8_t*>(ring_);
+}
+
+auto vmexit_stats_handler::stream_enable(uint64_t tsc_interval) noexcept -> error_code_t
+{
+  hvpp_assert(ring_ == nullptr);
+
+  //
+  // Note that the ring is allocated from the hypervisor memory pool,
+  // which is non-paged - therefore it can be mapped into the user
+  // address space (see mm::user_map()).
+  //
+  mm::tag_guard _{ mm::memory_tag::trace };
+
+  ring_size_ = ia32::round_to_pages(vmexit_stats_ring_t::size(mp::cpu_count()));
+  ring_ = reinterpret_cast<vmexit_stats_ring_t*>(new uint8_t[ring_size_]);
+
+  if (!ring_)
+  {
+    ring_size_ = 0;
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  memset(ring_, 0, ring_size_);
+
+  ring_->signature    = vmexit_stats_ring_t::ring_signature;
+  ring_->cpu_count    = mp::cpu_count();
+  ring_->tsc_interval = tsc_interval;
+
+  return error_code_t{};
+}
+
+void vmexit_stats_handler::prepare(vcpu_t& vp) noexcept
+{
+  //
+  // Allocate memory for statistics of this VCPU.  Attribution is
+  // allocated only if it has been enabled (see attribution_enable()).
+  //
+  auto& cpu_storage = storage_[vp.cpu_index()];
+
+  if (storage_prepared(cpu_storage))
+  {
+    return;
+  }
+
+  mm::tag_guard _{ mm::memory_tag::stats };
+
+  if (mode_ == storage_mode::dense)
+  {
+    cpu_storage.dense = new vmexit_stats_cpu_counters_t;
+    hvpp_assert(cpu_storage.dense != nullptr);
+
+    memset(cpu_storage.dense, 0, sizeof(*cpu_storage.dense));
+  }
+  else
+  {
+    cpu_storage.sparse = new vmexit_stats_sparse_storage_t;
+    hvpp_assert(cpu_storage.sparse != nullptr);
+
+    memset(cpu_storage.sparse, 0, sizeof(*cpu_storage.sparse));
+  }
+
+  if (attribution_merged_)
+  {
+    cpu_storage.attribution = new vmexit_stats_attribution_t;
+    hvpp_assert(cpu_storage.attribution != nullptr);
+
+    memset(cpu_storage.attribution, 0, sizeof(*cpu_storage.attribution));
+    cpu_storage.attribution->enabled = 1;
+  }
+}
+
+auto vmexit_stats_handler::attribution_enable() noexcept -> error_code_t
+{
+  hvpp_assert(attribution_merged_ == nullptr);
+
+  //
+  // Per-VCPU sketches are allocated in prepare().
+  //
+  mm::tag_guard _{ mm::memory_tag::stats };
+
+  attribution_snapshot_ = new vmexit_stats_attribution_t;
+  attribution_merged_   = new vmexit_stats_attribution_t;
+
+  if (!attribution_snapshot_ || !attribution_merged_)
+  {
+    delete attribution_snapshot_;
+    delete attribution_merged_;
+    attribution_snapshot_ = nullptr;
+    attribution_merged_   = nullptr;
+
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  return error_code_t{};
+}
+
+void vmexit_stats_handler::trace_filter(vmx::exit_reason exit_reason, const vmexit_trace_filter_t& filter) noexcept
+{
+  //
+  // Note that this isn't asserted against hypervisor::is_started() -
+  // the handler is part of the mock library, which doesn't link
+  // hypervisor.cpp.
+  //
+  vmexit_trace_filter_[static_cast<int>(exit_reason)] = filter;
+}
+
+bool vmexit_stats_handler::trace_sample(vcpu_t& vp, vmx::exit_reason exit_reason, vmexit_stats_cpu_storage_t& cpu_storage) noexcept
+{
+  const auto& filter = vmexit_trace_filter_[static_cast<int>(exit_reason)];
+
+  //
+  // The exit qualification and the exit context are already cached,
+  // the CPL and CR3 cost a VMREAD - check them only if they're filtered.
+  //
+  switch (exit_reason)
+  {
+    case vmx::exit_reason::execute_io_instruction:
+      {
+        const uint32_t port = vp.exit_qualification().io_instruction.port_number;
+
+        if (port < filter.range_first || port > filter.range_last)
+        {
+          return false;
+        }
+      }
+      break;
+
+    case vmx::exit_reason::execute_rdmsr:
+    case vmx::exit_reason::execute_wrmsr:
+      if (vp.exit_context().ecx < filter.range_first || vp.exit_context().ecx > filter.range_last)
+      {
+        return false;
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  if (filter.cpl_mask != 0x0f)
+  {
+    //
+    // CPL is the DPL of the SS (ref: Vol3C[24.4.1(Guest Register State)]).
+    //
+    using field = vmx::vmcs_t::field;
+
+    const auto ss_access_rights = vp.vmcs_fields<field::guest_ss_access_rights>()
+                                    .get<field::guest_ss_access_rights>();
+    const auto cpl = (ss_access_rights >> 5) & 3;
+
+    if (!(filter.cpl_mask & (1u << cpl)))
+    {
+      return false;
+    }
+  }
+
+  if (filter.cr3 && vp.guest_cr3().page_frame_number != (filter.cr3 >> ia32::page_shift))
+  {
+    return false;
+  }
+
+  if (filter.sample_rate > 1)
+  {
+    auto& count = cpu_storage.trace_sample[static_cast<int>(exit_reason)];
+
+    if (++count < filter.sample_rate)
+    {
+      return false;
+    }
+
+    count = 0;
+  }
+
+  return true;
+}
+
+void vmexit_stats_handler::stream_publish(vmexit_stats_cpu_storage_t& cpu_storage, uint32_t cpu_index) noexcept
+{
+  const auto now = ia32_asm_read_tsc();
+
+  if (now - cpu_storage.published_tsc < ring_->tsc_interval)
+  {
+    return;
+  }
+
+  auto& cpu_ring = ring_->cpu[cpu_index];
+  const auto head = cpu_ring.head;
+
+  auto& record = cpu_ring.record[head % vmexit_stats_cpu_ring_t::record_count];
+
+  //
+  // Invalidate the record before it is overwritten.
+  //
+  record.sequence = 0;
+  std::atomic_thread_fence(std::memory_order_release);
+
+  const auto& counters = cpu_storage.dense
+    ? cpu_storage.dense->vmexit
+    : cpu_storage.sparse->vmexit;
+
+  for (uint32_t i = 0; i < std::size(record.vmexit); ++i)
+  {
+    record.vmexit[i] = counters[i] - cpu_storage.published[i];
+    cpu_storage.published[i] = counters[i];
+  }
+
+  record.timestamp = now;
+  record.tsc_delta = now - cpu_storage.published_tsc;
+  cpu_storage.published_tsc = now;
+
+  //
+  // Publish the record.
+  //
+  std::atomic_thread_fence(std::memory_order_release);
+  record.sequence = head + 1;
+  cpu_ring.head = head + 1;
+}
+
+void vmexit_stats_handler::handle_command(vcpu_t& vp, const vcpu_command_t& command) noexcept
+{
+  auto& cpu_storage = storage_[vp.cpu_index()];
+
+  switch (command.type)
+  {
+    case vcpu_command_type::stats_reset:
+      //
+      // Counters are cleared within the update of the current VM-exit
+      // (see handle()), same as with snapshot().
+      //
+      cpu_storage.reset_pending.store(true, std::memory_order_relaxed);
+      break;
+
+    case vcpu_command_type::trace_arm:
+      if (command.arg[0] < cpu_storage.trace_armed.size())
+      {
+        cpu_storage.trace_armed[command.arg[0]] = static_cast<uint32_t>(command.arg[1]);
+      }
+      break;
+
+    default:
+      break;
+  }
 }
 
 void vmexit_stats_handler::handle(vcpu_t& vp) noexcept
 {
   auto  exit_reason = vp.exit_reason();
-  auto& stats       = storage_[mp::cpu_index()];
+  auto& cpu_storage = storage_[vp.cpu_index()];
+  auto  stats       = cpu_storage.dense;
+
+  //
+  // Begin the update - readers retry while the sequence is odd.
+  // Only this VCPU writes its counters, therefore no atomic
+  // read-modify-write is needed.
+  //
+  cpu_storage.sequence.store(cpu_storage.sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
 
-  stats.vmexit[static_cast<int>(exit_reason)] += 1;
+  if (cpu_storage.reset_pending.load(std::memory_order_relaxed))
+  {
+    storage_reset(cpu_storage);
+  }
+
+  if (stats)
+  {
+    stats->vmexit[static_cast<int>(exit_reason)] += 1;
+  }
+  else
+  {
+    cpu_storage.sparse->vmexit[static_cast<int>(exit_reason)] += 1;
+  }
+
+  if (auto attribution = cpu_storage.attribution)
+  {
+    //
+    // The PCID (and other low bits) is stripped - all VM-exits of
+    // the process are attributed to the same key.
+    //
+    const auto cr3 = vp.guest_cr3().page_frame_number << ia32::page_shift;
+
+    vmexit_stats_sketch_insert(attribution->cr3, cr3, 1);
+    vmexit_stats_sketch_insert(attribution->rip[static_cast<int>(exit_reason)], vp.exit_context().rip, 1);
+  }
 
   switch (exit_reason)
   {
     case vmx::exit_reason::exception_or_nmi:
-      stats.expt_vector[static_cast<int>(vp.interrupt_info().vector())] += 1;
+      hvpp_stats_increment(expt_vector, expt_vector[static_cast<int>(vp.interrupt_info().vector())], vp.interrupt_info().vector());
 
       hvpp_trace_if_enabled("exit_reason::exception_or_nmi: %s", exception_vector_to_string(vp.interrupt_info().vector()));
       break;
 
     case vmx::exit_reason::external_interrupt:
-      stats.expt_vector[static_cast<int>(vp.interrupt_info().vector())] += 1;
+      hvpp_stats_increment(expt_vector, expt_vector[static_cast<int>(vp.interrupt_info().vector())], vp.interrupt_info().vector());
 
       hvpp_trace_if_enabled("exit_reason::external_interrupt: %s", exception_vector_to_string(vp.interrupt_info().vector()));
       break;
 
     case vmx::exit_reason::execute_cpuid:
-      if (vp.exit_context().eax < (0x0000'0000u + vmexit_stats_storage_t::cpuid_0_max))
-      {
-        stats.cpuid_0[vp.exit_context().eax] += 1;
-      }
-      else if (vp.exit_context().eax >= 0x8000'0000u &&
-               vp.exit_context().eax < (0x8000'0000u + vmexit_stats_storage_t::cpuid_8_max))
+      if (!stats)
       {
-        stats.cpuid_8[vp.exit_context().eax - 0x8000'0000u] += 1;
+        cpu_storage.sparse->increment(vmexit_stats_sparse_storage_t::make_key(exit_reason, vp.exit_context().eax));
       }
       else
       {
-        stats.cpuid_other += 1;
+        vmexit_storage_if<vmexit_storage_category::cpuid>([&](auto& s) {
+          if (vp.exit_context().eax < (0x0000'0000u + s.cpuid_0_max))
+          {
+            s.cpuid_0[vp.exit_context().eax] += 1;
+          }
+          else if (vp.exit_context().eax >= 0x8000'0000u &&
+                   vp.exit_context().eax < (0x8000'0000u + s.cpuid_8_max))
+          {
+            s.cpuid_8[vp.exit_context().eax - 0x8000'0000u] += 1;
+          }
+          else
+          {
+            s.cpuid_other += 1;
+          }
+        }, *stats);
       }
 
       hvpp_trace_if_enabled("exit_reason::execute_cpuid: 0x%08x", vp.exit_context().eax);
@@ -110,7 +480,7 @@ void vmexit_stats_handler::handle(vcpu_t& vp) noexcept
       switch (vp.exit_qualification().mov_cr.access_type)
       {
         case vmx::exit_qualification_mov_cr_t::access_to_cr:
-          stats.mov_to_cr[vp.exit_qualification().mov_cr.cr_number] += 1;
+          hvpp_stats_increment(mov_cr, mov_to_cr[vp.exit_qualification().mov_cr.cr_number], vmx::exit_qualification_mov_cr_t::access_to_cr << 8 | vp.exit_qualification().mov_cr.cr_number);
 
           hvpp_trace_if_enabled(
             "exit_reason::mov_cr: (to_cr%u) 0x%p",
@@ -119,7 +489,7 @@ void vmexit_stats_handler::handle(vcpu_t& vp) noexcept
           break;
 
         case vmx::exit_qualification_mov_cr_t::access_from_cr:
-          stats.mov_from_cr[vp.exit_qualification().mov_cr.cr_number] += 1;
+          hvpp_stats_increment(mov_cr, mov_from_cr[vp.exit_qualification().mov_cr.cr_number], vmx::exit_qualification_mov_cr_t::access_from_cr << 8 | vp.exit_qualification().mov_cr.cr_number);
 
           hvpp_trace_if_enabled(
             "exit_reason::mov_cr: (from_cr%u) 0x%p",
@@ -128,13 +498,13 @@ void vmexit_stats_handler::handle(vcpu_t& vp) noexcept
           break;
 
         case vmx::exit_qualification_mov_cr_t::access_clts:
-          stats.clts += 1;
+          hvpp_stats_increment(mov_cr, clts, vmx::exit_qualification_mov_cr_t::access_clts << 8);
 
           hvpp_trace_if_enabled("exit_reason::mov_cr: (clts)");
           break;
 
         case vmx::exit_qualification_mov_cr_t::access_lmsw:
-          stats.lmsw += 1;
+          hvpp_stats_increment(mov_cr, lmsw, vmx::exit_qualification_mov_cr_t::access_lmsw << 8);
 
           hvpp_trace_if_enabled("exit_reason::mov_cr: (lmsw)");
           break;
@@ -145,7 +515,7 @@ void vmexit_stats_handler::handle(vcpu_t& vp) noexcept
       switch (vp.exit_qualification().mov_dr.access_type)
       {
         case vmx::exit_qualification_mov_dr_t::access_to_dr:
-          stats.mov_to_dr[vp.exit_qualification().mov_dr.dr_number] += 1;
+          hvpp_stats_increment(mov_dr, mov_to_dr[vp.exit_qualification().mov_dr.dr_number], vmx::exit_qualification_mov_dr_t::access_to_dr << 8 | vp.exit_qualification().mov_dr.dr_number);
 
           hvpp_trace_if_enabled(
             "exit_reason::mov_dr: (to_dr%u) 0x%p",
@@ -154,7 +524,7 @@ void vmexit_stats_handler::handle(vcpu_t& vp) noexcept
           break;
 
         case vmx::exit_qualification_mov_dr_t::access_from_dr:
-          stats.mov_from_dr[vp.exit_qualification().mov_dr.dr_number] += 1;
+          hvpp_stats_increment(mov_dr, mov_from_dr[vp.exit_qualification().mov_dr.dr_number], vmx::exit_qualification_mov_dr_t::access_from_dr << 8 | vp.exit_qualification().mov_dr.dr_number);
 
           hvpp_trace_if_enabled(
             "exit_reason::mov_dr: (from_dr%u) 0x%p",
@@ -168,7 +538,7 @@ void vmexit_stats_handler::handle(vcpu_t& vp) noexcept
       switch (vp.exit_qualification().io_instruction.access_type)
       {
         case vmx::exit_qualification_io_instruction_t::access_out:
-          stats.io_out[vp.exit_qualification().io_instruction.port_number] += 1;
+          hvpp_stats_increment(io, io_out[vp.exit_qualification().io_instruction.port_number], vmx::exit_qualification_io_instruction_t::access_out << 16 | vp.exit_qualification().io_instruction.port_number);
 
           hvpp_trace_if_enabled(
             "exit_reason::execute_io_instruction: out 0x%04x",
@@ -176,7 +546,7 @@ void vmexit_stats_handler::handle(vcpu_t& vp) noexcept
           break;
 
         case vmx::exit_qualification_io_instruction_t::access_in:
-          stats.io_in[vp.exit_qualification().io_instruction.port_number] += 1;
+          hvpp_stats_increment(io, io_in[vp.exit_qualification().io_instruction.port_number], vmx::exit_qualification_io_instruction_t::access_in << 16 | vp.exit_qualification().io_instruction.port_number);
 
           hvpp_trace_if_enabled(
             "exit_reason::execute_io_instruction: in 0x%04x",
@@ -186,42 +556,60 @@ void vmexit_stats_handler::handle(vcpu_t& vp) noexcept
       break;
 
     case vmx::exit_reason::execute_rdmsr:
-      if (vp.exit_context().ecx <= 0x0000'1fffu)
-      {
-        stats.rdmsr_0[vp.exit_context().ecx] += 1;
-      }
-      else if (vp.exit_context().ecx >= 0xc000'0000u &&
-               vp.exit_context().ecx <= 0xc000'1fffu)
+      if (!stats)
       {
-        stats.rdmsr_c[vp.exit_context().ecx - 0xc000'0000u] += 1;
+        cpu_storage.sparse->increment(vmexit_stats_sparse_storage_t::make_key(exit_reason, vp.exit_context().ecx));
       }
       else
       {
-        stats.rdmsr_other += 1;
+        vmexit_storage_if<vmexit_storage_category::msr>([&](auto& s) {
+          if (vp.exit_context().ecx <= 0x0000'1fffu)
+          {
+            s.rdmsr_0[vp.exit_context().ecx] += 1;
+          }
+          else if (vp.exit_context().ecx >= 0xc000'0000u &&
+                   vp.exit_context().ecx <= 0xc000'1fffu)
+          {
+            s.rdmsr_c[vp.exit_context().ecx - 0xc000'0000u] += 1;
+          }
+          else
+          {
+            s.rdmsr_other += 1;
+          }
+        }, *stats);
       }
       hvpp_trace_if_enabled("exit_reason::execute_rdmsr: 0x%08x", vp.exit_context().ecx);
       break;
 
     case vmx::exit_reason::execute_wrmsr:
-      if (vp.exit_context().ecx <= 0x0000'1fffu)
+      if (!stats)
       {
-        stats.wrmsr_0[vp.exit_context().ecx] += 1;
-      }
-      else if (vp.exit_context().ecx >= 0xc000'0000u &&
-               vp.exit_context().ecx <= 0xc000'1fffu)
-      {
-        stats.wrmsr_c[vp.exit_context().ecx - 0xc000'0000u] += 1;
+        cpu_storage.sparse->increment(vmexit_stats_sparse_storage_t::make_key(exit_reason, vp.exit_context().ecx));
       }
       else
       {
-        stats.wrmsr_other += 1;
+        vmexit_storage_if<vmexit_storage_category::msr>([&](auto& s) {
+          if (vp.exit_context().ecx <= 0x0000'1fffu)
+          {
+            s.wrmsr_0[vp.exit_context().ecx] += 1;
+          }
+          else if (vp.exit_context().ecx >= 0xc000'0000u &&
+                   vp.exit_context().ecx <= 0xc000'1fffu)
+          {
+            s.wrmsr_c[vp.exit_context().ecx - 0xc000'0000u] += 1;
+          }
+          else
+          {
+            s.wrmsr_other += 1;
+          }
+        }, *stats);
       }
 
       hvpp_trace_if_enabled("exit_reason::execute_wrmsr: 0x%08x", vp.exit_context().ecx);
       break;
 
     case vmx::exit_reason::gdtr_idtr_access:
-      stats.gdtr_idtr[vp.exit_instruction_info().gdtr_idtr_access.instruction] += 1;
+      hvpp_stats_increment(gdtr_idtr, gdtr_idtr[vp.exit_instruction_info().gdtr_idtr_access.instruction], vp.exit_instruction_info().gdtr_idtr_access.instruction);
 
       hvpp_trace_if_enabled(
         "exit_reason::gdtr_idtr_access: %s",
@@ -229,7 +617,7 @@ void vmexit_stats_handler::handle(vcpu_t& vp) noexcept
       break;
 
     case vmx::exit_reason::ldtr_tr_access:
-      stats.ldtr_tr[vp.exit_instruction_info().ldtr_tr_access.instruction] += 1;
+      hvpp_stats_increment(ldtr_tr, ldtr_tr[vp.exit_instruction_info().ldtr_tr_access.instruction], vp.exit_instruction_info().ldtr_tr_access.instruction);
 
       hvpp_trace_if_enabled(
         "exit_reason::ldtr_tr_access: %s",
@@ -238,8 +626,16 @@ void vmexit_stats_handler::handle(vcpu_t& vp) noexcept
 
     case vmx::exit_reason::ept_violation:
       //
-      // Do not trace.
+      // Do not trace, but let the user-mode know (if it listens).
       //
+      if (event_channel::is_active())
+      {
+        event_channel::post(event_channel::event_type::ept_violation,
+                            vp.exit_guest_physical_address().value(),
+                            vp.exit_guest_linear_address().value(),
+                            vp.exit_qualification().flags,
+                            vp.exit_context().rip);
+      }
       break;
 
     case vmx::exit_reason::execute_rdtscp:
@@ -260,63 +656,560 @@ void vmexit_stats_handler::handle(vcpu_t& vp) noexcept
       hvpp_trace_if_enabled("exit_reason::execute_invpcid");
       break;
   }
+
+  //
+  // End the update.
+  //
+  cpu_storage.sequence.store(cpu_storage.sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+
+  if (ring_)
+  {
+    stream_publish(cpu_storage, vp.cpu_index());
+  }
 }
 
 void vmexit_stats_handler::dump() noexcept
+{
+  spinlock::guard _{ snapshot_lock_ };
+
+  if (mode_ == storage_mode::sparse)
+  {
+    memset(sparse_merged_, 0, sizeof(*sparse_merged_));
+
+    for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+    {
+      if (!storage_prepared(storage_[i]))
+      {
+        continue;
+      }
+
+      storage_snapshot(*sparse_snapshot_, *storage_[i].sparse, storage_[i]);
+      sparse_merge(*sparse_merged_, *sparse_snapshot_);
+    }
+
+    sparse_dump(*sparse_merged_);
+  }
+  else
+  {
+    //
+    // Reset values.
+    //
+    memset(storage_merged_, 0, sizeof(*storage_merged_));
+
+    //
+    // Handler saves statistics separately for each VCPU.
+    // We merge statistics from all VCPUs into the first
+    // one (index 0).
+    //
+    for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+    {
+      if (!storage_prepared(storage_[i]))
+      {
+        continue;
+      }
+
+      storage_snapshot(*storage_snapshot_, *storage_[i].dense, storage_[i]);
+      storage_merge(*storage_merged_, *storage_snapshot_);
+    }
+
+    //
+    // Print merged statistics.
+    // This is sum of statistics for each VCPU.
+    //
+    storage_dump(*storage_merged_);
+  }
+
+  if (attribution_merged_)
+  {
+    memset(attribution_merged_, 0, sizeof(*attribution_merged_));
+
+    for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+    {
+      if (!storage_[i].attribution)
+      {
+        continue;
+      }
+
+      storage_snapshot(*attribution_snapshot_, *storage_[i].attribution, storage_[i]);
+      attribution_merge(*attribution_merged_, *attribution_snapshot_);
+    }
+
+    attribution_dump(*attribution_merged_);
+  }
+}
+
+auto vmexit_stats_handler::snapshot(vmexit_stats_storage_t& result, uint32_t cpu_index,
+                                    bool reset /* = false */,
+                                    vmexit_stats_attribution_t* attribution /* = nullptr */) noexcept -> error_code_t
+{
+  if (cpu_index != all_cpus && (cpu_index >= mp::cpu_count() || !storage_prepared(storage_[cpu_index])))
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  const uint32_t first = cpu_index == all_cpus ? 0                : cpu_index;
+  const uint32_t last  = cpu_index == all_cpus ? mp::cpu_count() : cpu_index + 1;
+
+  spinlock::guard _{ snapshot_lock_ };
+
+  memset(&result, 0, sizeof(result));
+
+  if (attribution)
+  {
+    memset(attribution, 0, sizeof(*attribution));
+  }
+
+  for (uint32_t i = first; i < last; ++i)
+  {
+    if (!storage_prepared(storage_[i]))
+    {
+      continue;
+    }
+
+    //
+    // Attribution is copied before the counters are marked for reset.
+    //
+    if (attribution && storage_[i].attribution)
+    {
+      storage_snapshot(*attribution_snapshot_, *storage_[i].attribution, storage_[i]);
+      attribution_merge(*attribution, *attribution_snapshot_);
+    }
+
+    if (mode_ == storage_mode::dense)
+    {
+      storage_snapshot(*storage_snapshot_, *storage_[i].dense, storage_[i]);
+      storage_merge(result, *storage_snapshot_);
+    }
+    else
+    {
+      storage_snapshot(*sparse_snapshot_, *storage_[i].sparse, storage_[i]);
+      sparse_expand(result, *sparse_snapshot_);
+    }
+
+    if (reset)
+    {
+      storage_[i].reset_pending.store(true, std::memory_order_relaxed);
+    }
+  }
+
+  return error_code_t{};
+}
+
+void vmexit_stats_handler::storage_reset(vmexit_stats_cpu_storage_t& cpu_storage) noexcept
 {
   //
-  // Reset values.
+  // Called by the VCPU itself (within the update), so that no
+  // increment races with the reset.  Published values of the stream
+  // ring are reset as well, so that the next deltas stay positive.
   //
-  memset(&storage_merged_, 0, sizeof(storage_merged_));
+  if (cpu_storage.dense)
+  {
+    memset(cpu_storage.dense, 0, sizeof(*cpu_storage.dense));
+  }
+  else
+  {
+    memset(cpu_storage.sparse, 0, sizeof(*cpu_storage.sparse));
+  }
+
+  if (cpu_storage.attribution)
+  {
+    memset(cpu_storage.attribution, 0, sizeof(*cpu_storage.attribution));
+    cpu_storage.attribution->enabled = 1;
+  }
 
+  cpu_storage.published.fill(0);
+  cpu_storage.reset_pending.store(false, std::memory_order_relaxed);
+}
+
+void vmexit_stats_handler::storage_merge(vmexit_stats_storage_t& lhs, const vmexit_stats_cpu_counters_t& rhs) const noexcept
+{
   //
-  // Handler saves statistics separately for each VCPU.
-  // We merge statistics from all VCPUs into the first
-  // one (index 0).
+  // Only categories kept by the VCPU counters are merged, the rest
+  // of "lhs" stays untouched (zero).
   //
-  for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+#define STORAGE_MERGE_IMPL(name)                      \
+  for (uint32_t i = 0; i < std::size(l.name); ++i)    \
+  {                                                   \
+    l.name[i] += r.name[i];                           \
+  }
+
+  for (uint32_t i = 0; i < std::size(lhs.vmexit); ++i)
+  {
+    lhs.vmexit[i] += rhs.vmexit[i];
+  }
+
+  namespace category = vmexit_storage_category;
+
+  vmexit_storage_if<category::expt_vector>([](auto& l, const auto& r) {
+    STORAGE_MERGE_IMPL(expt_vector);
+  }, lhs, rhs);
+
+  vmexit_storage_if<category::cpuid>([](auto& l, const auto& r) {
+    STORAGE_MERGE_IMPL(cpuid_0);
+    STORAGE_MERGE_IMPL(cpuid_8);
+    l.cpuid_other += r.cpuid_other;
+  }, lhs, rhs);
+
+  vmexit_storage_if<category::mov_cr>([](auto& l, const auto& r) {
+    STORAGE_MERGE_IMPL(mov_from_cr);
+    STORAGE_MERGE_IMPL(mov_to_cr);
+    l.clts += r.clts;
+    l.lmsw += r.lmsw;
+  }, lhs, rhs);
+
+  vmexit_storage_if<category::mov_dr>([](auto& l, const auto& r) {
+    STORAGE_MERGE_IMPL(mov_from_dr);
+    STORAGE_MERGE_IMPL(mov_to_dr);
+  }, lhs, rhs);
+
+  vmexit_storage_if<category::gdtr_idtr>([](auto& l, const auto& r) {
+    STORAGE_MERGE_IMPL(gdtr_idtr);
+  }, lhs, rhs);
+
+  vmexit_storage_if<category::ldtr_tr>([](auto& l, const auto& r) {
+    STORAGE_MERGE_IMPL(ldtr_tr);
+  }, lhs, rhs);
+
+  vmexit_storage_if<category::io>([](auto& l, const auto& r) {
+    STORAGE_MERGE_IMPL(io_in);
+    STORAGE_MERGE_IMPL(io_out);
+  }, lhs, rhs);
+
+  vmexit_storage_if<category::msr>([](auto& l, const auto& r) {
+    STORAGE_MERGE_IMPL(rdmsr_0);
+    STORAGE_MERGE_IMPL(rdmsr_c);
+    l.rdmsr_other += r.rdmsr_other;
+    STORAGE_MERGE_IMPL(wrmsr_0);
+    STORAGE_MERGE_IMPL(wrmsr_c);
+    l.wrmsr_other += r.wrmsr_other;
+  }, lhs, rhs);
+
+#undef STORAGE_MERGE_IMPL
+}
+
+template <typename T>
+void vmexit_stats_handler::storage_snapshot(T& snapshot, const T& data, const vmexit_stats_cpu_storage_t& cpu_storage) const noexcept
+{
+  for (;;)
+  {
+    const auto sequence = cpu_storage.sequence.load(std::memory_order_acquire);
+
+    if (sequence & 1)
+    {
+      //
+      // VCPU is updating its counters right now.
+      //
+      ia32_asm_pause();
+      continue;
+    }
+
+    memcpy(&snapshot, &data, sizeof(snapshot));
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if (cpu_storage.sequence.load(std::memory_order_relaxed) == sequence)
+    {
+      break;
+    }
+  }
+}
+
+void vmexit_stats_handler::sparse_merge(vmexit_stats_sparse_merged_t& lhs, const vmexit_stats_sparse_storage_t& rhs) const noexcept
+{
+  for (uint32_t i = 0; i < std::size(lhs.vmexit); ++i)
   {
-    storage_merge(storage_merged_, storage_[i]);
+    lhs.vmexit[i] += rhs.vmexit[i];
   }
 
+  lhs.overflow += rhs.overflow;
+
+  for (uint32_t i = 0; i < std::size(rhs.key); ++i)
+  {
+    if (rhs.key[i])
+    {
+      lhs.increment(rhs.key[i], rhs.count[i]);
+    }
+  }
+}
+
+void vmexit_stats_handler::sparse_expand(vmexit_stats_storage_t& lhs, const vmexit_stats_sparse_storage_t& rhs) const noexcept
+{
+  for (uint32_t i = 0; i < std::size(lhs.vmexit); ++i)
+  {
+    lhs.vmexit[i] += rhs.vmexit[i];
+  }
+
+  for (uint32_t i = 0; i < std::size(rhs.key); ++i)
+  {
+    if (!rhs.key[i])
+    {
+      continue;
+    }
+
+    //
+    // Sub-keys are built in handle().
+    //
+    const auto sub_key = vmexit_stats_sparse_storage_t::key_sub_key(rhs.key[i]);
+    const auto count   = rhs.count[i];
+
+    switch (vmexit_stats_sparse_storage_t::key_exit_reason(rhs.key[i]))
+    {
+      case vmx::exit_reason::exception_or_nmi:
+      case vmx::exit_reason::external_interrupt:
+        lhs.expt_vector[sub_key & 0xff] += count;
+        break;
+
+      case vmx::exit_reason::execute_cpuid:
+        if (sub_key < (0x0000'0000u + vmexit_stats_storage_t::cpuid_0_max))
+        {
+          lhs.cpuid_0[sub_key] += count;
+        }
+        else if (sub_key >= 0x8000'0000u &&
+                 sub_key < (0x8000'0000u + vmexit_stats_storage_t::cpuid_8_max))
+        {
+          lhs.cpuid_8[sub_key - 0x8000'0000u] += count;
+        }
+        else
+        {
+          lhs.cpuid_other += count;
+        }
+        break;
+
+      case vmx::exit_reason::mov_cr:
+        switch (sub_key >> 8)
+        {
+          case vmx::exit_qualification_mov_cr_t::access_to_cr:   lhs.mov_to_cr[sub_key & 7] += count; break;
+          case vmx::exit_qualification_mov_cr_t::access_from_cr: lhs.mov_from_cr[sub_key & 7] += count; break;
+          case vmx::exit_qualification_mov_cr_t::access_clts:    lhs.clts += count; break;
+          case vmx::exit_qualification_mov_cr_t::access_lmsw:    lhs.lmsw += count; break;
+        }
+        break;
+
+      case vmx::exit_reason::mov_dr:
+        switch (sub_key >> 8)
+        {
+          case vmx::exit_qualification_mov_dr_t::access_to_dr:   lhs.mov_to_dr[sub_key & 7] += count; break;
+          case vmx::exit_qualification_mov_dr_t::access_from_dr: lhs.mov_from_dr[sub_key & 7] += count; break;
+        }
+        break;
+
+      case vmx::exit_reason::execute_io_instruction:
+        if ((sub_key >> 16) == vmx::exit_qualification_io_instruction_t::access_in)
+        {
+          lhs.io_in[sub_key & 0xffff] += count;
+        }
+        else
+        {
+          lhs.io_out[sub_key & 0xffff] += count;
+        }
+        break;
+
+      case vmx::exit_reason::execute_rdmsr:
+        if (sub_key <= 0x0000'1fffu)
+        {
+          lhs.rdmsr_0[sub_key] += count;
+        }
+        else if (sub_key >= 0xc000'0000u && sub_key <= 0xc000'1fffu)
+        {
+          lhs.rdmsr_c[sub_key - 0xc000'0000u] += count;
+        }
+        else
+        {
+          lhs.rdmsr_other += count;
+        }
+        break;
+
+      case vmx::exit_reason::execute_wrmsr:
+        if (sub_key <= 0x0000'1fffu)
+        {
+          lhs.wrmsr_0[sub_key] += count;
+        }
+        else if (sub_key >= 0xc000'0000u && sub_key <= 0xc000'1fffu)
+        {
+          lhs.wrmsr_c[sub_key - 0xc000'0000u] += count;
+        }
+        else
+        {
+          lhs.wrmsr_other += count;
+        }
+        break;
+
+      case vmx::exit_reason::gdtr_idtr_access:
+        lhs.gdtr_idtr[sub_key & 3] += count;
+        break;
+
+      case vmx::exit_reason::ldtr_tr_access:
+        lhs.ldtr_tr[sub_key & 3] += count;
+        break;
+
+      default:
+        break;
+    }
+  }
+}
+
+void vmexit_stats_handler::attribution_merge(vmexit_stats_attribution_t& lhs, const vmexit_stats_attribution_t& rhs) const noexcept
+{
+  lhs.enabled = rhs.enabled;
+
+  for (const auto& entry : rhs.cr3)
+  {
+    if (entry.key)
+    {
+      vmexit_stats_sketch_insert(lhs.cr3, entry.key, entry.count, entry.error);
+    }
+  }
+
+  for (uint32_t exit_reason_index = 0; exit_reason_index < std::size(rhs.rip); ++exit_reason_index)
+  {
+    for (const auto& entry : rhs.rip[exit_reason_index])
+    {
+      if (entry.key)
+      {
+        vmexit_stats_sketch_insert(lhs.rip[exit_reason_index], entry.key, entry.count, entry.error);
+      }
+    }
+  }
+}
+
+void vmexit_stats_handler::attribution_dump(const vmexit_stats_attribution_t& attribution_to_dump) const noexcept
+{
   //
-  // Print merged statistics.
-  // This is sum of statistics for each VCPU.
+  // Sort entries of the sketch by count (descending).
   //
-  storage_dump(storage_merged_);
+  auto sort = [](auto& sorted) {
+    for (uint32_t i = 1; i < std::size(sorted); ++i)
+    {
+      const auto entry = sorted[i];
+      uint32_t j = i;
+
+      for (; j > 0 && sorted[j - 1].count < entry.count; --j)
+      {
+        sorted[j] = sorted[j - 1];
+      }
+
+      sorted[j] = entry;
+    }
+  };
+
+  vmexit_stats_sketch_entry_t cr3[vmexit_stats_attribution_t::cr3_count];
+  memcpy(cr3, attribution_to_dump.cr3, sizeof(cr3));
+  sort(cr3);
+
+  hvpp_info("VMEXIT attribution (guest CR3)");
+  for (const auto& entry : cr3)
+  {
+    if (entry.key)
+    {
+      hvpp_info("  0x%p: %u (+/- %u)", entry.key, entry.count, entry.error);
+    }
+  }
+
+  hvpp_info("VMEXIT attribution (guest RIP)");
+  for (uint32_t exit_reason_index = 0; exit_reason_index < std::size(attribution_to_dump.rip); ++exit_reason_index)
+  {
+    vmexit_stats_sketch_entry_t rip[vmexit_stats_attribution_t::rip_count];
+    memcpy(rip, attribution_to_dump.rip[exit_reason_index], sizeof(rip));
+    sort(rip);
+
+    if (!rip[0].key)
+    {
+      continue;
+    }
+
+    hvpp_info("  %s:", vmx::exit_reason_to_string(static_cast<vmx::exit_reason>(exit_reason_index)));
+
+    for (const auto& entry : rip)
+    {
+      if (entry.key)
+      {
+        hvpp_info("    0x%p: %u (+/- %u)", entry.key, entry.count, entry.error);
+      }
+    }
+  }
 }
 
-void vmexit_stats_handler::storage_merge(vmexit_stats_storage_t& lhs, const vmexit_stats_storage_t& rhs) const noexcept
+void vmexit_stats_handler::sparse_dump(const vmexit_stats_sparse_merged_t& storage_to_dump) const noexcept
 {
-#define STORAGE_MERGE_IMPL(name)                      \
-  for (uint32_t i = 0; i < std::size(lhs.name); ++i)  \
-  {                                                   \
-    lhs.name[i] += rhs.name[i];                       \
-  }
-
-  STORAGE_MERGE_IMPL(vmexit);
-  STORAGE_MERGE_IMPL(expt_vector);
-  STORAGE_MERGE_IMPL(cpuid_0);
-  STORAGE_MERGE_IMPL(cpuid_8);
-  lhs.cpuid_other += rhs.cpuid_other;
-  STORAGE_MERGE_IMPL(mov_from_cr);
-  STORAGE_MERGE_IMPL(mov_to_cr);
-  lhs.clts += rhs.clts;
-  lhs.lmsw += rhs.lmsw;
-  STORAGE_MERGE_IMPL(mov_from_dr);
-  STORAGE_MERGE_IMPL(mov_to_dr);
-  STORAGE_MERGE_IMPL(gdtr_idtr);
-  STORAGE_MERGE_IMPL(ldtr_tr);
-  STORAGE_MERGE_IMPL(io_in);
-  STORAGE_MERGE_IMPL(io_out);
-  STORAGE_MERGE_IMPL(rdmsr_0);
-  STORAGE_MERGE_IMPL(rdmsr_c);
-  lhs.rdmsr_other += rhs.rdmsr_other;
-  STORAGE_MERGE_IMPL(wrmsr_0);
-  STORAGE_MERGE_IMPL(wrmsr_c);
-  lhs.wrmsr_other += rhs.wrmsr_other;
+  auto& stats = storage_to_dump;
 
-#undef STORAGE_MERGE_IMPL
+  hvpp_info("VMEXIT statistics (sparse)");
+  for (uint32_t exit_reason_index = 0; exit_reason_index < std::size(stats.vmexit); ++exit_reason_index)
+  {
+    if (stats.vmexit[exit_reason_index] == 0)
+    {
+      continue;
+    }
+
+    const auto exit_reason = static_cast<vmx::exit_reason>(exit_reason_index);
+
+    hvpp_info("  %s: %u",
+      vmx::exit_reason_to_string(exit_reason),
+      stats.vmexit[exit_reason_index]);
+
+    for (uint32_t i = 0; i < std::size(stats.key); ++i)
+    {
+      if (!stats.key[i] || vmexit_stats_sparse_merged_t::key_exit_reason(stats.key[i]) != exit_reason)
+      {
+        continue;
+      }
+
+      const auto sub_key = vmexit_stats_sparse_merged_t::key_sub_key(stats.key[i]);
+      const auto count   = stats.count[i];
+
+      switch (exit_reason)
+      {
+        case vmx::exit_reason::exception_or_nmi:
+        case vmx::exit_reason::external_interrupt:
+          hvpp_info("    %s: %u", exception_vector_to_string(static_cast<exception_vector>(sub_key)), count);
+          break;
+
+        case vmx::exit_reason::mov_cr:
+          switch (sub_key >> 8)
+          {
+            case vmx::exit_qualification_mov_cr_t::access_to_cr:   hvpp_info("    mov_to_cr[%i]: %u", sub_key & 0xff, count); break;
+            case vmx::exit_qualification_mov_cr_t::access_from_cr: hvpp_info("    mov_from_cr[%i]: %u", sub_key & 0xff, count); break;
+            case vmx::exit_qualification_mov_cr_t::access_clts:    hvpp_info("    clts: %u", count); break;
+            case vmx::exit_qualification_mov_cr_t::access_lmsw:    hvpp_info("    lmsw: %u", count); break;
+          }
+          break;
+
+        case vmx::exit_reason::mov_dr:
+          switch (sub_key >> 8)
+          {
+            case vmx::exit_qualification_mov_dr_t::access_to_dr:   hvpp_info("    mov_to_dr[%i]: %u", sub_key & 0xff, count); break;
+            case vmx::exit_qualification_mov_dr_t::access_from_dr: hvpp_info("    mov_from_dr[%i]: %u", sub_key & 0xff, count); break;
+          }
+          break;
+
+        case vmx::exit_reason::gdtr_idtr_access:
+          hvpp_info("    %s: %u", vmx::instruction_info_gdtr_idtr_to_string(sub_key), count);
+          break;
+
+        case vmx::exit_reason::ldtr_tr_access:
+          hvpp_info("    %s: %u", vmx::instruction_info_ldtr_tr_to_string(sub_key), count);
+          break;
+
+        case vmx::exit_reason::execute_io_instruction:
+          hvpp_info("    %s (0x%04x): %u",
+            (sub_key >> 16) == vmx::exit_qualification_io_instruction_t::access_in ? "in" : "out",
+            sub_key & 0xffff,
+            count);
+          break;
+
+        default:
+          //
+          // CPUID leafs and MSR numbers.
+          //
+          hvpp_info("    0x%08x: %u", sub_key, count);
+          break;
+      }
+    }
+  }
+
+  if (stats.overflow > 0)
+  {
+    hvpp_info("  (OVERFLOW): %u", stats.overflow);
+  }
 }
 
 void vmexit_stats_handler::storage_dump(const vmexit_stats_storage_t& storage_to_dump) const noexcept
@@ -1,8 +1,16 @@
 #pragma once
 #include "hvpp/vmexit.h"
 
+#include "hvpp/config.h"
 #include "hvpp/lib/bitmap.h"
+#include "hvpp/lib/error.h"
+#include "hvpp/lib/per_cpu.h"
+#include "hvpp/lib/spinlock.h"
 
+#include "vmexit_stats_ring.h"
+#include "vmexit_stats_snapshot.h"
+
+#include <array>
 #include <atomic>
 
 namespace hvpp {
@@ -14,6 +22,208 @@ namespace hvpp {
 //
 using vmexit_stats_storage_t = vmexit_storage_t<uint32_t>;
 
+//
+// Dense counters of single VCPU - only the categories selected
+// by HVPP_VMEXIT_STATS_CATEGORIES (see config.h).  Snapshots and
+// merged statistics always have the full vmexit_stats_storage_t
+// layout, counters of the missing categories are zero.
+//
+#ifdef HVPP_VMEXIT_STATS_CATEGORIES
+using vmexit_stats_categories = type_list<HVPP_VMEXIT_STATS_CATEGORIES>;
+#else
+using vmexit_stats_categories = vmexit_storage_category::all;
+#endif
+
+using vmexit_stats_cpu_counters_t = vmexit_storage_t<uint32_t, 16, 16, vmexit_stats_categories>;
+
+//
+// Sparse storage for statistics about VM-exits.
+// Counters of VM-exit reasons are kept dense, everything else
+// (exception vectors, CPUID leafs, I/O ports, MSRs, ...) is kept
+// in a small open-addressed hash table keyed by (exit_reason, sub-key).
+// Events which don't fit into the table are counted in "overflow".
+//
+template <
+  size_t SIZE
+>
+struct vmexit_stats_sparse_t
+{
+  static_assert((SIZE & (SIZE - 1)) == 0, "Size must be power of 2");
+
+  static constexpr size_t size            = SIZE;
+  static constexpr size_t max_probe_count = 16;
+
+  std::array<uint32_t, 65>    vmexit;
+  uint32_t                    overflow;
+
+  //
+  // Key 0 represents an empty slot.
+  //
+  std::array<uint64_t, SIZE>  key;
+  std::array<uint32_t, SIZE>  count;
+
+  static constexpr uint64_t make_key(vmx::exit_reason exit_reason, uint32_t sub_key) noexcept
+  { return (uint64_t(exit_reason) + 1) << 32 | sub_key; }
+
+  static constexpr vmx::exit_reason key_exit_reason(uint64_t k) noexcept
+  { return static_cast<vmx::exit_reason>((k >> 32) - 1); }
+
+  static constexpr uint32_t key_sub_key(uint64_t k) noexcept
+  { return static_cast<uint32_t>(k); }
+
+  void increment(uint64_t k, uint32_t value = 1) noexcept
+  {
+    //
+    // Linear probing, bounded by max_probe_count, so that the time
+    // spent in VMX-root mode doesn't depend on the table fill.
+    //
+    auto index = static_cast<size_t>((k * 0x9e37'79b9'7f4a'7c15) >> 32) & (SIZE - 1);
+
+    for (size_t probe = 0; probe < max_probe_count; ++probe)
+    {
+      if (key[index] == k)
+      {
+        count[index] += value;
+        return;
+      }
+
+      if (key[index] == 0)
+      {
+        key[index] = k;
+        count[index] = value;
+        return;
+      }
+
+      index = (index + 1) & (SIZE - 1);
+    }
+
+    overflow += value;
+  }
+};
+
+//
+// Sparse statistics of single VCPU and merged sparse statistics.
+//
+using vmexit_stats_sparse_storage_t = vmexit_stats_sparse_t<512>;
+using vmexit_stats_sparse_merged_t  = vmexit_stats_sparse_t<4096>;
+
+//
+// Add "value" VM-exits of "key" into the space-saving sketch (see
+// vmexit_stats_attribution_t).  "error" is the error of "value" when
+// sketches are merged.
+//
+template <
+  size_t SIZE
+>
+inline void vmexit_stats_sketch_insert(vmexit_stats_sketch_entry_t (&sketch)[SIZE],
+                                       uint64_t key, uint32_t value, uint32_t error = 0) noexcept
+{
+  auto min_entry = &sketch[0];
+
+  for (auto& entry : sketch)
+  {
+    if (entry.key == key)
+    {
+      entry.count += value;
+      entry.error += error;
+      return;
+    }
+
+    if (entry.key == 0)
+    {
+      entry = vmexit_stats_sketch_entry_t{ key, value, error };
+      return;
+    }
+
+    if (entry.count < min_entry->count)
+    {
+      min_entry = &entry;
+    }
+  }
+
+  *min_entry = vmexit_stats_sketch_entry_t{ key, min_entry->count + value, min_entry->count + error };
+}
+
+//
+// Statistics of single VCPU.
+// Each instance is allocated separately, so that counters of
+// different VCPUs never share a cache line (or a page).
+// Exactly one of "dense" and "sparse" is set, depending on the
+// storage mode of the handler.
+//
+// The sequence counter is odd while the VCPU updates its counters.
+// Readers retry their copy until they observe the same even value
+// before and after it (seqcount).
+//
+struct alignas(64) vmexit_stats_cpu_storage_t
+{
+  std::atomic<uint32_t>          sequence;
+  vmexit_stats_cpu_counters_t*   dense;
+  vmexit_stats_sparse_storage_t* sparse;
+
+  //
+  // Values of VM-exit counters at the time of the last record
+  // published into the stream ring (see stream_enable()).
+  //
+  uint64_t                       published_tsc;
+  std::array<uint32_t, 65>       published;
+
+  //
+  // VM-exits by guest CR3 and RIP (see attribution_enable()).
+  //
+  vmexit_stats_attribution_t*    attribution;
+
+  //
+  // Set by snapshot() - the VCPU clears its counters on its next
+  // VM-exit.
+  //
+  std::atomic<bool>              reset_pending;
+
+  //
+  // Traced VM-exits which passed the filters since the last sample
+  // (see vmexit_trace_filter_t::sample_rate).
+  //
+  std::array<uint32_t, 65>       trace_sample;
+
+  //
+  // Number of VM-exits (per reason) to trace regardless of the trace
+  // bitmap (see vcpu_command_type::trace_arm).
+  //
+  std::array<uint32_t, 65>       trace_armed;
+};
+
+//
+// Trace filter of single VM-exit reason (see trace_filter()).
+// The filters are evaluated only for VM-exit reasons enabled in the
+// trace bitmap, before anything is formatted - cheapest checks first,
+// the guest CPL and CR3 are read only if they're filtered.
+//
+struct vmexit_trace_filter_t
+{
+  //
+  // Trace only every "sample_rate"-th VM-exit which passed the filters
+  // below (counted per VCPU).  0 and 1 trace all of them.
+  //
+  uint32_t sample_rate = 1;
+
+  //
+  // Inclusive range of I/O ports (execute_io_instruction) or MSRs
+  // (execute_rdmsr, execute_wrmsr).  Ignored for other VM-exit reasons.
+  //
+  uint32_t range_first = 0;
+  uint32_t range_last  = ~0u;
+
+  //
+  // Bit per guest CPL (bit 0 - ring 0, ..., bit 3 - ring 3).
+  //
+  uint8_t  cpl_mask    = 0x0f;
+
+  //
+  // Guest CR3 (the PCID is ignored), or 0 for any.
+  //
+  uint64_t cr3         = 0;
+};
+
 //
 // Simple VM-exit handler which performs statistics about VM-exits
 // and also allows their tracing (by hvpp_trace()).
@@ -23,24 +233,135 @@ class vmexit_stats_handler
   : public vmexit_handler
 {
   public:
-    vmexit_stats_handler() noexcept;
+    enum class storage_mode
+    {
+      dense,
+      sparse,
+    };
+
+#ifdef HVPP_VMEXIT_STATS_SPARSE
+    static constexpr auto default_storage_mode = storage_mode::sparse;
+#else
+    static constexpr auto default_storage_mode = storage_mode::dense;
+#endif
+
+    vmexit_stats_handler(storage_mode mode = default_storage_mode) noexcept;
     ~vmexit_stats_handler() noexcept override;
 
+    //
+    // Counters are allocated only for the VCPUs which are prepared -
+    // i.e. only for the virtualized CPUs (see hypervisor::start()).
+    //
+    void prepare(vcpu_t& vp) noexcept override;
     void handle(vcpu_t& vp) noexcept override;
 
+    //
+    // Handles vcpu_command_type::stats_reset and trace_arm.
+    //
+    void handle_command(vcpu_t& vp, const vcpu_command_t& command) noexcept override;
+
     bitmap& trace_bitmap() noexcept
     { return vmexit_trace_bitmap_; }
 
-    vmexit_stats_storage_t* storage() const noexcept
-    { return storage_ ; }
+    //
+    // Sample and filter traced VM-exits of the reason (the reason must
+    // be enabled in the trace bitmap as well).  Must be called before
+    // the hypervisor is started.
+    //
+    void trace_filter(vmx::exit_reason exit_reason, const vmexit_trace_filter_t& filter) noexcept;
+
+    const vmexit_trace_filter_t& trace_filter(vmx::exit_reason exit_reason) const noexcept
+    { return vmexit_trace_filter_[static_cast<int>(exit_reason)]; }
+
+    const vmexit_stats_cpu_storage_t& storage(uint32_t cpu_index) const noexcept
+    { return storage_[cpu_index]; }
+
+    storage_mode mode() const noexcept
+    { return mode_; }
 
     void dump() noexcept;
 
+    //
+    // Copy statistics of the VCPU (or the sum of statistics of all
+    // VCPUs, if "cpu_index" is all_cpus) into "result".  Fails if the
+    // CPU isn't virtualized.  Statistics
+    // of the sparse mode are expanded into the dense layout (events
+    // counted in "overflow" are lost).
+    //
+    // If "reset" is true, the copied counters are cleared.  Each VCPU
+    // clears its own counters on its next VM-exit, therefore VM-exits
+    // which occur in between are not counted in any snapshot.
+    //
+    // If "attribution" isn't null, the merged attribution (see
+    // attribution_enable()) is copied into it as well.
+    //
+    static constexpr uint32_t all_cpus = vmexit_stats_snapshot_request_t::all_cpus;
+
+    auto snapshot(vmexit_stats_storage_t& result, uint32_t cpu_index, bool reset = false,
+                  vmexit_stats_attribution_t* attribution = nullptr) noexcept -> error_code_t;
+
+    //
+    // Attribute VM-exits to the guest CR3 (process) and the guest RIP
+    // (per VM-exit reason) which caused them.  Costs one VMREAD (guest
+    // CR3) and two scans of small tables per VM-exit.
+    // Must be called before the hypervisor is started.
+    //
+    auto attribution_enable() noexcept -> error_code_t;
+
+    bool attribution_enabled() const noexcept
+    { return attribution_merged_ != nullptr; }
+
+    //
+    // Enable periodic publishing of VM-exit counters into the shared
+    // ring (see vmexit_stats_ring.h).  Each VCPU publishes a record
+    // at most once per "tsc_interval" TSC ticks.
+    // Must be called before the hypervisor is started.
+    //
+    auto stream_enable(uint64_t tsc_interval) noexcept -> error_code_t;
+
+    vmexit_stats_ring_t* stream_ring() const noexcept
+    { return ring_; }
+
+    size_t stream_ring_size() const noexcept
+    { return ring_size_; }
+
   private:
     //
     // Update "lhs" stats by adding to them values of "rhs" stats.
     //
-    void storage_merge(vmexit_stats_storage_t& lhs, const vmexit_stats_storage_t& rhs) const noexcept;
+    void storage_merge(vmexit_stats_storage_t& lhs, const vmexit_stats_cpu_counters_t& rhs) const noexcept;
+
+    //
+    // Make consistent copy of the VCPU statistics.
+    //
+    static bool storage_prepared(const vmexit_stats_cpu_storage_t& cpu_storage) noexcept
+    { return cpu_storage.dense || cpu_storage.sparse; }
+
+    template <typename T>
+    void storage_snapshot(T& snapshot, const T& data, const vmexit_stats_cpu_storage_t& cpu_storage) const noexcept;
+
+    //
+    // Sparse counterparts of storage_merge() and storage_dump().
+    //
+    void sparse_merge(vmexit_stats_sparse_merged_t& lhs, const vmexit_stats_sparse_storage_t& rhs) const noexcept;
+    void sparse_dump(const vmexit_stats_sparse_merged_t& storage_to_dump) const noexcept;
+
+    //
+    // Add sparse statistics of single VCPU to the dense "lhs" stats.
+    //
+    void sparse_expand(vmexit_stats_storage_t& lhs, const vmexit_stats_sparse_storage_t& rhs) const noexcept;
+
+    //
+    // Clear counters of the current VCPU (see snapshot()).
+    //
+    void storage_reset(vmexit_stats_cpu_storage_t& cpu_storage) noexcept;
+
+    //
+    // Merge the attribution sketches of single VCPU into "lhs" and
+    // dump the (merged) attribution.
+    //
+    void attribution_merge(vmexit_stats_attribution_t& lhs, const vmexit_stats_attribution_t& rhs) const noexcept;
+    void attribution_dump(const vmexit_stats_attribution_t& attribution_to_dump) const noexcept;
 
     //
     // Dump this stats structure.
@@ -48,15 +369,54 @@ class vmexit_stats_handler
     void storage_dump(const vmexit_stats_storage_t& storage_to_dump) const noexcept;
 
     //
-    // Array of statistics (per VCPU).
+    // Publish deltas of VM-exit counters of the current VCPU into the
+    // stream ring, if the interval elapsed.
     //
-    vmexit_stats_storage_t* storage_;
+    void stream_publish(vmexit_stats_cpu_storage_t& cpu_storage, uint32_t cpu_index) noexcept;
 
     //
-    // Merged statistics.
-    // Used in dump() method.
+    // Decide whether the VM-exit (of the reason enabled in the trace
+    // bitmap) is traced (see trace_filter()).
     //
-    vmexit_stats_storage_t storage_merged_;
+    bool trace_sample(vcpu_t& vp, vmx::exit_reason exit_reason, vmexit_stats_cpu_storage_t& cpu_storage) noexcept;
+
+    //
+    // Consume one armed trace of the VM-exit reason (see handle_command()).
+    //
+    static bool trace_armed(vmx::exit_reason exit_reason, vmexit_stats_cpu_storage_t& cpu_storage) noexcept
+    {
+      auto& count = cpu_storage.trace_armed[static_cast<int>(exit_reason)];
+      return count && count--;
+    }
+
+    //
+    // Statistics (per VCPU).
+    //
+    per_cpu<vmexit_stats_cpu_storage_t> storage_;
+
+    //
+    // Snapshot of statistics of single VCPU and merged statistics.
+    // Used in dump() and snapshot() methods (under the lock).
+    // Only the pair matching the storage mode is allocated.
+    //
+    vmexit_stats_cpu_counters_t* storage_snapshot_;
+    vmexit_stats_storage_t*      storage_merged_;
+
+    vmexit_stats_sparse_storage_t* sparse_snapshot_;
+    vmexit_stats_sparse_merged_t*  sparse_merged_;
+
+    vmexit_stats_attribution_t*    attribution_snapshot_;
+    vmexit_stats_attribution_t*    attribution_merged_;
+
+    spinlock snapshot_lock_;
+
+    storage_mode mode_;
+
+    //
+    // Stream ring.
+    //
+    vmexit_stats_ring_t* ring_;
+    size_t ring_size_;
 
     //
     // Bitmap of traced VM-exit reasons.
@@ -64,6 +424,11 @@ class vmexit_stats_handler
     //
     bitmap_local<65> vmexit_trace_bitmap_;
 
+    //
+    // Trace filters (see trace_filter()), indexed by VM-exit reason.
+    //
+    vmexit_trace_filter_t vmexit_trace_filter_[65];
+
     //
     // Count of terminated VCPUs.
     //
@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+
+//
+// Layout of the shared-memory ring into which vmexit_stats_handler
+// periodically publishes deltas of VM-exit counters.
+//
+// This header is shared with the user-mode (hvppctrl), therefore
+// it shouldn't depend on anything else.
+//
+// The ring consists of a header followed by "cpu_count" per-CPU
+// rings.  Each per-CPU ring has exactly one producer (the VCPU,
+// in VMX-root mode) and it never takes any lock:
+//   1. sequence of the record is set to 0
+//   2. the record is filled
+//   3. sequence of the record is set to (head + 1)
+//   4. head is incremented
+//
+// Record N is stored in the slot (N % record_count).  Readers keep
+// their own tail - if (head - tail) > record_count, the reader was
+// too slow and some records have been overwritten.  Readers should
+// verify that the sequence of the record matches the expected value
+// both before and after they copy it.
+//
+
+namespace hvpp {
+
+struct vmexit_stats_record_t
+{
+  uint64_t sequence;            // index of the record + 1 (0 while being written)
+  uint64_t timestamp;           // TSC at the time of publishing
+  uint64_t tsc_delta;           // TSC ticks since the previous record
+  uint32_t vmexit[65];          // VM-exits (per exit reason) since the previous record
+  uint32_t reserved;
+};
+
+struct vmexit_stats_cpu_ring_t
+{
+  static constexpr uint32_t record_count = 64;
+
+  volatile uint64_t     head;
+  uint64_t              reserved[7];    // keep records off the cache line of the head
+
+  vmexit_stats_record_t record[record_count];
+};
+
+struct vmexit_stats_ring_t
+{
+  static constexpr uint32_t ring_signature = 'rsvh';
+
+  uint32_t signature;
+  uint32_t cpu_count;
+  uint64_t tsc_interval;        // minimal TSC ticks between two records
+  uint64_t reserved[6];
+
+  vmexit_stats_cpu_ring_t cpu[1]; // [cpu_count]
+
+  static constexpr size_t size(uint32_t count) noexcept
+  { return sizeof(vmexit_stats_ring_t) + (count - 1) * sizeof(vmexit_stats_cpu_ring_t); }
+};
+
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include <cstdint>
+
+//
+// Layout of the VM-exit statistics snapshot returned to the user-mode
+// (see vmexit_stats_handler::snapshot()).
+//
+// This header is shared with the user-mode (hvppctrl), therefore
+// it shouldn't depend on anything else.
+//
+// The snapshot has the same layout as vmexit_stats_storage_t (see
+// vmexit_storage_t in vmexit.h) - it's checked by static_assert in
+// vmexit_stats.cpp.  Statistics of the handler in the sparse mode are
+// expanded into this layout.
+//
+
+namespace hvpp {
+
+struct vmexit_stats_snapshot_request_t
+{
+  static constexpr uint32_t all_cpus   = ~0u;
+  static constexpr uint32_t flag_reset = 1u << 0;
+
+  uint32_t cpu_index;           // index of the CPU or all_cpus (merged)
+  uint32_t flags;               // flag_reset = clear the counters after the copy
+};
+
+struct vmexit_stats_snapshot_t
+{
+  uint32_t vmexit[65];
+  uint32_t expt_vector[256];
+  uint32_t cpuid_0[16];         // 0x0000'0000 - 0x0000'000f
+  uint32_t cpuid_8[16];         // 0x8000'0000 - 0x8000'000f
+  uint32_t cpuid_other;
+  uint32_t mov_from_cr[8];
+  uint32_t mov_to_cr[8];
+  uint32_t clts;
+  uint32_t lmsw;
+  uint32_t mov_from_dr[8];
+  uint32_t mov_to_dr[8];
+  uint32_t gdtr_idtr[4];
+  uint32_t ldtr_tr[4];
+  uint32_t io_in[0x10000];
+  uint32_t io_out[0x10000];
+  uint32_t rdmsr_0[0x2000];     // 0x0000'0000 - 0x0000'1fff
+  uint32_t rdmsr_c[0x2000];     // 0xc000'0000 - 0xc000'1fff
+  uint32_t rdmsr_other;
+  uint32_t wrmsr_0[0x2000];
+  uint32_t wrmsr_c[0x2000];
+  uint32_t wrmsr_other;
+};
+
+//
+// Attribution of VM-exits (see vmexit_stats_handler::attribution_enable()).
+//
+// Both tables are "space-saving" top-K sketches: each entry counts
+// VM-exits of its key, when a new key doesn't fit, it replaces the entry
+// with the lowest count and inherits that count as its "error".  The
+// real number of VM-exits of the key is between (count - error) and
+// count, keys with more than (total / K) VM-exits are always present.
+//
+// If the output buffer of the stats IOCTL is large enough, this
+// structure follows the vmexit_stats_snapshot_t.
+//
+
+struct vmexit_stats_sketch_entry_t
+{
+  uint64_t key;                 // 0 = empty
+  uint32_t count;
+  uint32_t error;
+};
+
+struct vmexit_stats_attribution_t
+{
+  static constexpr uint32_t exit_reason_count = 65;
+  static constexpr uint32_t cr3_count         = 32;
+  static constexpr uint32_t rip_count         = 8;
+
+  uint32_t                    enabled;
+  uint32_t                    reserved;
+
+  //
+  // Guest CR3 (page frame only, without the PCID) causing VM-exits.
+  //
+  vmexit_stats_sketch_entry_t cr3[cr3_count];
+
+  //
+  // Guest RIPs causing VM-exits, per VM-exit reason.
+  //
+  vmexit_stats_sketch_entry_t rip[exit_reason_count][rip_count];
+};
+
+static_assert(sizeof(vmexit_stats_snapshot_request_t) == 8);
+static_assert(sizeof(vmexit_stats_sketch_entry_t) == 16);
+
+}
@@ -3,7 +3,9 @@
 
 #include "lib/typelist.h"
 
+#include <array>
 #include <tuple>
+#include <utility>
 
 namespace hvpp
 {
@@ -27,6 +29,13 @@ namespace hvpp
 
       }
 
+      void prepare(vcpu_t& vp) noexcept override
+      {
+        for_each_element(handlers, [&](auto&& handler, int) {
+          handler.prepare(vp);
+        });
+      }
+
       void setup(vcpu_t& vp) noexcept override
       {
         for_each_element(handlers, [&](auto&& handler, int) {
@@ -34,19 +43,142 @@ namespace hvpp
         });
       }
 
-      void handle(vcpu_t& vp) noexcept override
+      void attach(vcpu_t& vp) noexcept override
+      {
+        for_each_element(handlers, [&](auto&& handler, int) {
+          handler.attach(vp);
+        });
+      }
+
+      void detach(vcpu_t& vp) noexcept override
       {
         for_each_element(handlers, [&](auto&& handler, int) {
-          handler.handle(vp);
+          handler.detach(vp);
         });
       }
 
+      void handle(vcpu_t& vp) noexcept override
+      {
+        //
+        // Currently the highest ID of exit reason is 64 - the table has
+        // an entry for each ID (see vmexit_storage_t).
+        //
+        static constexpr auto dispatch_table = make_dispatch_table(std::make_index_sequence<65>{});
+
+        dispatch_table[static_cast<int>(vp.exit_reason())](*this, vp);
+      }
+
       void invoke_termination(vcpu_t& vp) noexcept override
       {
         for_each_element(handlers, [&](auto&& handler, int) {
           handler.invoke_termination(vp);
         });
       }
+
+      void handle_command(vcpu_t& vp, const vcpu_command_t& command) noexcept override
+      {
+        for_each_element(handlers, [&](auto&& handler, int) {
+          handler.handle_command(vp, command);
+        });
+      }
+
+    private:
+      //
+      // Flat per-reason dispatch table.  Each entry calls - directly,
+      // without virtual dispatch - handle() of those handlers which
+      // declare interest in that VM-exit reason (see
+      // vmexit_handler::handles_exit_reason()), in the order in which
+      // they're composed - until some of them ends the chain (see
+      // vmexit_handler::handle_chained()).
+      //
+      using dispatch_fn_t = void(*)(vmexit_compositor_handler&, vcpu_t&);
+
+      template <
+        size_t INDEX
+      >
+      static vmexit_result invoke(vmexit_compositor_handler& self, vcpu_t& vp) noexcept
+      {
+        using handler_t = std::tuple_element_t<INDEX, vmexit_handler_tuple_t>;
+
+        if constexpr (has_handle_chained_v<handler_t>)
+        {
+          return std::get<INDEX>(self.handlers).handler_t::handle_chained(vp);
+        }
+        else
+        {
+          std::get<INDEX>(self.handlers).handler_t::handle(vp);
+          return vmexit_result::next;
+        }
+      }
+
+      template <
+        size_t EXIT_REASON,
+        size_t INDEX
+      >
+      static vmexit_result dispatch_handler(vmexit_compositor_handler& self, vcpu_t& vp) noexcept
+      {
+        using handler_t = std::tuple_element_t<INDEX, vmexit_handler_tuple_t>;
+
+        if constexpr (handler_t::handles_exit_reason(static_cast<vmx::exit_reason>(EXIT_REASON)))
+        {
+          return invoke<INDEX>(self, vp);
+        }
+        else
+        {
+          (void)(self);
+          (void)(vp);
+          return vmexit_result::next;
+        }
+      }
+
+      //
+      // Call handlers from INDEX onwards, until some of them ends the
+      // chain (see vmexit_result).  Handlers which don't hide
+      // handle_chained() always return vmexit_result::next, so that
+      // the checks are optimized out.
+      //
+      template <
+        size_t EXIT_REASON,
+        size_t INDEX
+      >
+      static void dispatch(vmexit_compositor_handler& self, vcpu_t& vp) noexcept
+      {
+        constexpr size_t last_index = sizeof...(ARGS) - 1;
+
+        const auto result = dispatch_handler<EXIT_REASON, INDEX>(self, vp);
+
+        if constexpr (INDEX < last_index)
+        {
+          if (result == vmexit_result::next)
+          {
+            dispatch<EXIT_REASON, INDEX + 1>(self, vp);
+          }
+          else if (result == vmexit_result::skip_remaining)
+          {
+            dispatch_handler<EXIT_REASON, last_index>(self, vp);
+          }
+        }
+        else
+        {
+          (void)(result);
+        }
+      }
+
+      template <
+        size_t EXIT_REASON
+      >
+      static void dispatch_reason(vmexit_compositor_handler& self, vcpu_t& vp) noexcept
+      {
+        dispatch<EXIT_REASON, 0>(self, vp);
+      }
+
+      template <
+        size_t ...EXIT_REASON
+      >
+      static constexpr auto make_dispatch_table(std::index_sequence<EXIT_REASON...>) noexcept
+      {
+        return std::array<dispatch_fn_t, sizeof...(EXIT_REASON)>{ { &dispatch_reason<EXIT_REASON>... } };
+      }
   };
 
 }
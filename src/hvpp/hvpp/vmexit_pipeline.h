@@ -0,0 +1,329 @@
+#pragma once
+#include "vmexit.h"
+
+#include "lib/error.h"
+#include "lib/typelist.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace hvpp
+{
+  //
+  // Per-reason enable masks of the pipeline stages.
+  //
+  // Bit N of the stage mask enables the stage for the VM-exit reason N.
+  // Masks can be changed at any time (e.g. from an IOCTL) - each VCPU
+  // observes the change on its next VM-exit.  Note that a stage might be
+  // disabled between two VM-exits which it expects to see in pairs (e.g.
+  // MTF after the EPT violation) - only stages which merely observe
+  // VM-exits (statistics, tracing, breakpoints) should be toggled.
+  //
+  // The last stage of the pipeline is the one which actually handles
+  // the VM-exit (e.g. vmexit_custom_handler), therefore its mask is
+  // locked.
+  //
+
+  class vmexit_pipeline_mask
+  {
+    public:
+      static constexpr uint32_t exit_reason_count = 65;
+      static constexpr uint32_t max_stage_count   = 8;
+
+      using mask_t = std::array<uint64_t, 2>;
+
+      static constexpr mask_t mask_all  = { ~0ull, ~0ull };
+      static constexpr mask_t mask_none = {  0ull,  0ull };
+
+      vmexit_pipeline_mask(uint32_t stage_count) noexcept
+        : mask_{}
+        , stage_count_{ stage_count }
+      {
+        for (auto& stage_mask : mask_)
+        {
+          stage_mask[0].store(mask_all[0], std::memory_order_relaxed);
+          stage_mask[1].store(mask_all[1], std::memory_order_relaxed);
+        }
+      }
+
+      uint32_t stage_count() const noexcept
+      { return stage_count_; }
+
+      bool is_locked(uint32_t stage_index) const noexcept
+      { return stage_index + 1 == stage_count_; }
+
+      bool test(uint32_t stage_index, vmx::exit_reason exit_reason) const noexcept
+      {
+        const auto index = static_cast<uint32_t>(exit_reason);
+        return (mask_[stage_index][index / 64].load(std::memory_order_relaxed) & (1ull << (index % 64))) != 0;
+      }
+
+      auto mask(uint32_t stage_index) const noexcept -> mask_t
+      {
+        if (stage_index >= stage_count_)
+        {
+          return mask_none;
+        }
+
+        return mask_t{ mask_[stage_index][0].load(std::memory_order_relaxed),
+                       mask_[stage_index][1].load(std::memory_order_relaxed) };
+      }
+
+      auto mask(uint32_t stage_index, const mask_t& value) noexcept -> error_code_t
+      {
+        if (stage_index >= stage_count_ || is_locked(stage_index))
+        {
+          return make_error_code_t(std::errc::invalid_argument);
+        }
+
+        mask_[stage_index][0].store(value[0], std::memory_order_relaxed);
+        mask_[stage_index][1].store(value[1], std::memory_order_relaxed);
+        return error_code_t{};
+      }
+
+      auto enable(uint32_t stage_index, vmx::exit_reason exit_reason, bool value = true) noexcept -> error_code_t
+      {
+        const auto index = static_cast<uint32_t>(exit_reason);
+
+        if (stage_index >= stage_count_ || is_locked(stage_index) || index >= exit_reason_count)
+        {
+          return make_error_code_t(std::errc::invalid_argument);
+        }
+
+        if (value)
+        {
+          mask_[stage_index][index / 64].fetch_or(1ull << (index % 64), std::memory_order_relaxed);
+        }
+        else
+        {
+          mask_[stage_index][index / 64].fetch_and(~(1ull << (index % 64)), std::memory_order_relaxed);
+        }
+
+        return error_code_t{};
+      }
+
+    private:
+      std::atomic<uint64_t> mask_[max_stage_count][2];
+      uint32_t              stage_count_;
+  };
+
+  //
+  // Pipeline of VM-exit handlers.
+  //
+  // Same as vmexit_compositor_handler (stages are called directly, in
+  // order, through the flat per-reason dispatch table), except that each
+  // stage can be enabled/disabled per VM-exit reason at runtime.  Disabled
+  // stage costs single bit test - e.g. statistics can be collected only
+  // while investigating.
+  //
+  // Usage:
+  //   using vmexit_handler_t = vmexit_pipeline_handler<
+  //     vmexit_stats_handler,
+  //     vmexit_custom_handler
+  //     >;
+  //
+  //   handler->masks.mask(vmexit_handler_t::stage_index<vmexit_stats_handler>,
+  //                       vmexit_pipeline_mask::mask_none);
+  //
+
+  template <
+    typename ...ARGS
+  >
+  class vmexit_pipeline_handler
+    : public vmexit_handler
+  {
+    public:
+      using vmexit_handler_tuple_t = std::tuple<ARGS...>;
+      vmexit_handler_tuple_t handlers;
+
+      vmexit_pipeline_mask masks;
+
+      static_assert(sizeof...(ARGS) <= vmexit_pipeline_mask::max_stage_count);
+
+      //
+      // Index of the stage with the handler type T.
+      //
+      template <
+        typename T
+      >
+      static constexpr uint32_t stage_index = []() constexpr {
+        constexpr bool is_same[] = { std::is_same_v<T, ARGS>... };
+
+        for (uint32_t i = 0; i < sizeof...(ARGS); ++i)
+        {
+          if (is_same[i])
+          {
+            return i;
+          }
+        }
+
+        return uint32_t(sizeof...(ARGS));
+      }();
+
+      vmexit_pipeline_handler() noexcept
+        : masks{ uint32_t(sizeof...(ARGS)) }
+      {
+
+      }
+
+      ~vmexit_pipeline_handler() noexcept override
+      {
+
+      }
+
+      void prepare(vcpu_t& vp) noexcept override
+      {
+        for_each_element(handlers, [&](auto&& handler, int) {
+          handler.prepare(vp);
+        });
+      }
+
+      void setup(vcpu_t& vp) noexcept override
+      {
+        for_each_element(handlers, [&](auto&& handler, int) {
+          handler.setup(vp);
+        });
+      }
+
+      void attach(vcpu_t& vp) noexcept override
+      {
+        for_each_element(handlers, [&](auto&& handler, int) {
+          handler.attach(vp);
+        });
+      }
+
+      void detach(vcpu_t& vp) noexcept override
+      {
+        for_each_element(handlers, [&](auto&& handler, int) {
+          handler.detach(vp);
+        });
+      }
+
+      void handle(vcpu_t& vp) noexcept override
+      {
+        static constexpr auto dispatch_table = make_dispatch_table(std::make_index_sequence<vmexit_pipeline_mask::exit_reason_count>{});
+
+        dispatch_table[static_cast<int>(vp.exit_reason())](*this, vp);
+      }
+
+      void invoke_termination(vcpu_t& vp) noexcept override
+      {
+        for_each_element(handlers, [&](auto&& handler, int) {
+          handler.invoke_termination(vp);
+        });
+      }
+
+      void handle_command(vcpu_t& vp, const vcpu_command_t& command) noexcept override
+      {
+        for_each_element(handlers, [&](auto&& handler, int) {
+          handler.handle_command(vp, command);
+        });
+      }
+
+    private:
+      using dispatch_fn_t = void(*)(vmexit_pipeline_handler&, vcpu_t&);
+
+      template <
+        size_t INDEX
+      >
+      static vmexit_result invoke(vmexit_pipeline_handler& self, vcpu_t& vp) noexcept
+      {
+        using handler_t = std::tuple_element_t<INDEX, vmexit_handler_tuple_t>;
+
+        if constexpr (has_handle_chained_v<handler_t>)
+        {
+          return std::get<INDEX>(self.handlers).handler_t::handle_chained(vp);
+        }
+        else
+        {
+          std::get<INDEX>(self.handlers).handler_t::handle(vp);
+          return vmexit_result::next;
+        }
+      }
+
+      template <
+        size_t EXIT_REASON,
+        size_t INDEX
+      >
+      static vmexit_result dispatch_handler(vmexit_pipeline_handler& self, vcpu_t& vp) noexcept
+      {
+        using handler_t = std::tuple_element_t<INDEX, vmexit_handler_tuple_t>;
+
+        constexpr auto exit_reason = static_cast<vmx::exit_reason>(EXIT_REASON);
+
+        if constexpr (!handler_t::handles_exit_reason(exit_reason))
+        {
+          (void)(self);
+          (void)(vp);
+          return vmexit_result::next;
+        }
+        else if constexpr (INDEX + 1 == sizeof...(ARGS))
+        {
+          //
+          // The last stage is always enabled (see vmexit_pipeline_mask).
+          //
+          return invoke<INDEX>(self, vp);
+        }
+        else
+        {
+          return self.masks.test(INDEX, exit_reason)
+            ? invoke<INDEX>(self, vp)
+            : vmexit_result::next;
+        }
+      }
+
+      //
+      // Call handlers from INDEX onwards, until some of them ends the
+      // chain (see vmexit_result).  Handlers which don't hide
+      // handle_chained() always return vmexit_result::next, so that
+      // the checks are optimized out.
+      //
+      template <
+        size_t EXIT_REASON,
+        size_t INDEX
+      >
+      static void dispatch(vmexit_pipeline_handler& self, vcpu_t& vp) noexcept
+      {
+        constexpr size_t last_index = sizeof...(ARGS) - 1;
+
+        const auto result = dispatch_handler<EXIT_REASON, INDEX>(self, vp);
+
+        if constexpr (INDEX < last_index)
+        {
+          if (result == vmexit_result::next)
+          {
+            dispatch<EXIT_REASON, INDEX + 1>(self, vp);
+          }
+          else if (result == vmexit_result::skip_remaining)
+          {
+            dispatch_handler<EXIT_REASON, last_index>(self, vp);
+          }
+        }
+        else
+        {
+          (void)(result);
+        }
+      }
+
+      template <
+        size_t EXIT_REASON
+      >
+      static void dispatch_reason(vmexit_pipeline_handler& self, vcpu_t& vp) noexcept
+      {
+        dispatch<EXIT_REASON, 0>(self, vp);
+      }
+
+      template <
+        size_t ...EXIT_REASON
+      >
+      static constexpr auto make_dispatch_table(std::index_sequence<EXIT_REASON...>) noexcept
+      {
+        return std::array<dispatch_fn_t, sizeof...(EXIT_REASON)>{ { &dispatch_reason<EXIT_REASON>... } };
+      }
+  };
+
+}
@@ -0,0 +1,414 @@
+#include <hvpp/ept.h>
+#include <hvpp/vcpu.h>
+#include <hvpp/vmexit_pipeline.h>
+#include <hvpp/vmexit/vmexit_passthrough.h>
+#include <hvpp/vmexit/vmexit_stats.h>
+
+#include <hvpp/ia32/mock/cpu.h>
+
+#include <hvpp/lib/bitmap.h>
+#include <hvpp/lib/exit_record.h>
+#include <hvpp/lib/log.h>
+#include <hvpp/lib/mm.h>
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+#include <intrin.h>
+#include <windows.h>
+
+//
+// Benchmarks of the hvpp core, built in the user-mode (see HVPP_MOCK).
+//
+// Privileged instructions are mocked (see hvpp/ia32/mock/cpu.h) and
+// VM-exits are simulated - the VCPU is launched on the mocked CPU 0 and
+// each VM-exit fills the exit-information fields of the mocked VMCS and
+// calls vcpu_t::mock_exit().  Numbers are therefore comparable between
+// builds, not to VM-exits on the real hardware (VM-exit/VM-entry
+// transitions themselves aren't included).
+//
+// "hvppbench replay <file>" replays VM-exits recorded by "hvppctrl
+// record" (see hvpp/lib/exit_record.h) instead of the synthetic ones.
+//
+
+using namespace hvpp;
+using namespace ia32;
+
+using vmexit_handler_t = vmexit_pipeline_handler<
+  vmexit_stats_handler,
+  vmexit_passthrough_handler
+  >;
+
+static constexpr size_t pool_size = 256 * 1024 * 1024;
+
+template <typename TFunction>
+void bench(const char* name, uint64_t iterations, TFunction&& function) noexcept
+{
+  //
+  // Warm up caches (and the allocator) first.
+  //
+  for (uint64_t i = 0; i < iterations / 16 + 1; ++i)
+  {
+    function(i);
+  }
+
+  const auto start = ia32_asm_read_tsc();
+
+  for (uint64_t i = 0; i < iterations; ++i)
+  {
+    function(i);
+  }
+
+  const auto ticks = ia32_asm_read_tsc() - start;
+
+  printf("%-40s %12llu iterations %10.1f ticks/iteration\n",
+         name, iterations, double(ticks) / double(iterations));
+}
+
+static void bench_bitmap() noexcept
+{
+  static constexpr int bit_count = 64 * 1024;
+  static uint64_t buffer[bit_count / 64];
+
+  bitmap bm{ buffer, bit_count };
+  bm.clear();
+
+  bench("bitmap: set/clear", 1'000'000, [&](uint64_t i) {
+    const auto bit = static_cast<int>(i % bit_count);
+    bm.set(bit);
+    bm.clear(bit);
+  });
+
+  bench("bitmap: set/clear range (512 bits)", 100'000, [&](uint64_t i) {
+    const auto index = static_cast<int>((i * 512) % bit_count);
+    bm.set(index, 512);
+    bm.clear(index, 512);
+  });
+
+  bm.set(0, bit_count / 2);
+
+  bench("bitmap: find_first_clear (half set)", 100'000, [&](uint64_t) {
+    volatile auto index = bm.find_first_clear();
+    (void)(index);
+  });
+}
+
+static void bench_mm() noexcept
+{
+  for (size_t size : { size_t(64), size_t(4096), size_t(64 * 1024) })
+  {
+    char name[64];
+    sprintf_s(name, "mm: allocate/free (%zu bytes)", size);
+
+    bench(name, 100'000, [size](uint64_t) {
+      auto p = mm::allocate(size);
+      mm::free(p);
+    });
+  }
+}
+
+static void bench_ept() noexcept
+{
+  bench("ept: construct + map_identity", 100, [](uint64_t) {
+    ept_t ept;
+    ept.map_identity();
+  });
+
+  ept_t ept;
+  ept.map_identity();
+
+  bench("ept: split_2mb_to_4kb + join_4kb_to_2mb", 1'000, [&ept](uint64_t i) {
+    const auto pa = pa_t((i % 512) * pd_t::size);
+    ept.split_2mb_to_4kb(pa, pa);
+    ept.join_4kb_to_2mb(pa, pa);
+  });
+
+  ept.split_2mb_to_4kb(pa_t(0), pa_t(0));
+
+  bench("ept: map_4kb", 1'000'000, [&ept](uint64_t i) {
+    const auto pa = pa_t((i % 512) * page_size);
+    ept.map_4kb(pa, pa, epte_t::access_type::read_write);
+  });
+
+  bench("ept: ept_entry (4kb)", 1'000'000, [&ept](uint64_t i) {
+    volatile auto entry = ept.ept_entry(pa_t((i % 512) * page_size));
+    (void)(entry);
+  });
+}
+
+static void bench_vmexit(vcpu_t& vp) noexcept
+{
+  auto simulate = [&vp](vmx::exit_reason exit_reason, uint32_t instruction_length, uint64_t qualification) noexcept {
+    mock::vmcs_field(vmx::vmcs_t::field::vmexit_reason)             = uint64_t(exit_reason);
+    mock::vmcs_field(vmx::vmcs_t::field::vmexit_instruction_length) = instruction_length;
+    mock::vmcs_field(vmx::vmcs_t::field::vmexit_qualification)      = qualification;
+    vp.mock_exit();
+  };
+
+  bench("vmexit: CPUID (leaf 0)", 1'000'000, [&](uint64_t) {
+    vp.exit_context().rax = 0;
+    vp.exit_context().rcx = 0;
+    simulate(vmx::exit_reason::execute_cpuid, 2, 0);
+  });
+
+  bench("vmexit: RDMSR (IA32_PAT)", 1'000'000, [&](uint64_t) {
+    vp.exit_context().rcx = 0x277;
+    simulate(vmx::exit_reason::execute_rdmsr, 2, 0);
+  });
+
+  bench("vmexit: MOV to CR3", 1'000'000, [&](uint64_t) {
+    vp.exit_context().rax = mock::cpu().cr3;
+    simulate(vmx::exit_reason::mov_cr, 3, 0x0003);
+  });
+
+  //
+  // Same VM-exit with the per-exit fields of vcpu_t evicted from the
+  // cache first - the difference to "evict only" is the cost of the
+  // cache misses, which depends on how many cache lines the fields
+  // span (see the layout of vcpu_t).
+  //
+  const auto hot_fields = static_cast<const uint8_t*>(vp.mock_hot_fields());
+  const auto hot_fields_size = vp.mock_hot_fields_size();
+
+  auto evict = [&]() noexcept {
+    for (size_t offset = 0; offset < hot_fields_size; offset += 64)
+    {
+      _mm_clflush(hot_fields + offset);
+    }
+
+    _mm_mfence();
+  };
+
+  bench("vmexit: evict only", 1'000'000, [&](uint64_t) {
+    evict();
+  });
+
+  bench("vmexit: CPUID (leaf 0, evicted)", 1'000'000, [&](uint64_t) {
+    evict();
+    vp.exit_context().rax = 0;
+    vp.exit_context().rcx = 0;
+    simulate(vmx::exit_reason::execute_cpuid, 2, 0);
+  });
+
+  printf("vmexit: per-exit fields span %zu bytes (%zu cache lines)\n",
+         hot_fields_size, (hot_fields_size + 63) / 64);
+
+  const auto& cpu = mock::cpu();
+  printf("\n"
+         "VMREAD: %llu, VMWRITE: %llu, INVEPT: %llu, INVVPID: %llu, TLB flushes: %llu\n",
+         cpu.vmread_count, cpu.vmwrite_count,
+         cpu.invept_count, cpu.invvpid_count,
+         cpu.tlb_flush_count);
+}
+
+//
+// Replay VM-exits recorded on the real hardware.  Only VM-exits whose
+// handling touches nothing but registers, MSRs and ports are replayed -
+// the recorded guest addresses don't exist in this process.
+//
+static bool replay_supported(const exit_record::record_t& record) noexcept
+{
+  switch (vmx::exit_reason(record.exit_reason))
+  {
+    case vmx::exit_reason::execute_cpuid:
+    case vmx::exit_reason::execute_rdtsc:
+    case vmx::exit_reason::execute_rdtscp:
+    case vmx::exit_reason::execute_rdmsr:
+    case vmx::exit_reason::execute_wrmsr:
+    case vmx::exit_reason::mov_cr:
+    case vmx::exit_reason::mov_dr:
+      return true;
+
+    case vmx::exit_reason::execute_io_instruction:
+      return !vmx::exit_qualification_io_instruction_t{ record.exit_qualification }.string_instruction;
+
+    default:
+      return false;
+  }
+}
+
+static int replay(vcpu_t& vp, const char* file_name) noexcept
+{
+  using namespace exit_record;
+  using field = vmx::vmcs_t::field;
+
+  const auto file = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+  if (file == INVALID_HANDLE_VALUE)
+  {
+    printf("cannot open '%s'\n", file_name);
+    return 1;
+  }
+
+  const auto file_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  const auto view = file_mapping
+    ? MapViewOfFile(file_mapping, FILE_MAP_READ, 0, 0, 0)
+    : nullptr;
+
+  LARGE_INTEGER file_size{};
+  GetFileSizeEx(file, &file_size);
+
+  const auto header = static_cast<const file_header_t*>(view);
+
+  if (!header ||
+      uint64_t(file_size.QuadPart) < sizeof(file_header_t) ||
+      header->signature != file_header_t::file_signature ||
+      header->version != file_header_t::file_version ||
+      header->record_size != sizeof(record_t) ||
+      header->record_offset + header->record_count * sizeof(record_t) > uint64_t(file_size.QuadPart))
+  {
+    printf("'%s' is not a valid replay file\n", file_name);
+
+    if (view)         { UnmapViewOfFile(view);     }
+    if (file_mapping) { CloseHandle(file_mapping); }
+    CloseHandle(file);
+    return 1;
+  }
+
+  const auto records = reinterpret_cast<const record_t*>(
+    static_cast<const uint8_t*>(view) + header->record_offset);
+
+  printf("replay: %llu records (%llu dropped while recording), %u CPUs\n",
+         header->record_count, header->dropped_count, header->cpu_count);
+
+  uint64_t ticks[file_header_t::exit_reason_count] = {};
+  uint64_t count[file_header_t::exit_reason_count] = {};
+  uint64_t skipped = 0;
+
+  for (uint64_t i = 0; i < header->record_count; ++i)
+  {
+    const auto& record = records[i];
+
+    if (record.exit_reason >= file_header_t::exit_reason_count || !replay_supported(record))
+    {
+      skipped += 1;
+      continue;
+    }
+
+    mock::vmcs_field(field::vmexit_reason)                   = record.exit_reason;
+    mock::vmcs_field(field::vmexit_qualification)            = record.exit_qualification;
+    mock::vmcs_field(field::vmexit_guest_linear_address)     = record.guest_linear_address;
+    mock::vmcs_field(field::vmexit_guest_physical_address)   = record.guest_physical_address;
+    mock::vmcs_field(field::vmexit_instruction_length)       = record.instruction_length;
+    mock::vmcs_field(field::vmexit_instruction_info)         = record.instruction_info;
+    mock::vmcs_field(field::vmexit_interruption_info)        = record.interruption_info;
+    mock::vmcs_field(field::vmexit_interruption_error_code)  = record.interruption_error_code;
+    mock::vmcs_field(field::vmexit_idt_vectoring_info)       = record.idt_vectoring_info;
+    mock::vmcs_field(field::vmexit_idt_vectoring_error_code) = record.idt_vectoring_error_code;
+    mock::vmcs_field(field::guest_rip)                       = record.guest_rip;
+    mock::vmcs_field(field::guest_rsp)                       = record.gp_register[context_t::reg_rsp];
+    mock::vmcs_field(field::guest_rflags)                    = record.guest_rflags;
+    mock::vmcs_field(field::guest_cr0)                       = record.guest_cr0;
+    mock::vmcs_field(field::guest_cr3)                       = record.guest_cr3;
+    mock::vmcs_field(field::guest_cr4)                       = record.guest_cr4;
+
+    memcpy(vp.exit_context().gp_register, record.gp_register, sizeof(record.gp_register));
+
+    const auto start = ia32_asm_read_tsc();
+    vp.mock_exit();
+    ticks[record.exit_reason] += ia32_asm_read_tsc() - start;
+    count[record.exit_reason] += 1;
+  }
+
+  uint64_t total_ticks = 0;
+  uint64_t total_count = 0;
+
+  for (uint32_t exit_reason = 0; exit_reason < file_header_t::exit_reason_count; ++exit_reason)
+  {
+    if (count[exit_reason])
+    {
+      printf("%-40s %12llu exits %10.1f ticks/exit\n",
+             vmx::exit_reason_to_string(vmx::exit_reason(exit_reason)),
+             count[exit_reason], double(ticks[exit_reason]) / double(count[exit_reason]));
+
+      total_ticks += ticks[exit_reason];
+      total_count += count[exit_reason];
+    }
+  }
+
+  printf("%-40s %12llu exits %10.1f ticks/exit (%llu skipped)\n",
+         "total", total_count,
+         total_count ? double(total_ticks) / double(total_count) : 0.0,
+         skipped);
+
+  UnmapViewOfFile(view);
+  CloseHandle(file_mapping);
+  CloseHandle(file);
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  logger::initialize();
+  logger::set_level(logger::level_t::warn);
+
+  if (mm::initialize())
+  {
+    printf("mm::initialize() failed\n");
+    return 1;
+  }
+
+  auto pool = mm::system_allocate(pool_size);
+
+  if (!pool || mm::assign(pool, pool_size))
+  {
+    printf("mm::assign() failed\n");
+    return 1;
+  }
+
+  mock::reset();
+
+  const auto replay_file = argc >= 3 && !strcmp(argv[1], "replay")
+    ? argv[2]
+    : nullptr;
+
+  if (!replay_file)
+  {
+    bench_bitmap();
+    bench_mm();
+    bench_ept();
+  }
+
+  //
+  // Launch the VCPU on the mocked CPU 0 - the same way as
+  // hypervisor::start() does.
+  //
+  auto handler = new vmexit_handler_t();
+  auto guest_mapping = new mapping_t(vcpu_t::guest_mapping_page_count);
+  auto vcpu_buffer = mm::system_allocate(sizeof(vcpu_t) + vcpu_stack_size);
+
+  if (!handler || !guest_mapping || !vcpu_buffer)
+  {
+    printf("allocation failed\n");
+    return 1;
+  }
+
+  auto vp = reinterpret_cast<vcpu_t*>(
+    (reinterpret_cast<uintptr_t>(vcpu_buffer) + vcpu_stack_size - 1) & ~uintptr_t(vcpu_stack_size - 1));
+
+  ::new (vp) vcpu_t(*handler, *guest_mapping);
+
+  //
+  // Note that launch() returns only if the (emulated) VM-entry
+  // succeeded.
+  //
+  vp->prepare();
+  vp->launch();
+
+  if (replay_file)
+  {
+    return replay(*vp, replay_file);
+  }
+
+  bench_vmexit(*vp);
+
+  //
+  // There is no VMX non-root mode to call VMCALL from (the termination
+  // would never reach the VM-exit handler) - the process just exits
+  // without destroying the VCPU.
+  //
+  return 0;
+}
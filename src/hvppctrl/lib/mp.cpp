@@ -38,3 +38,43 @@ exit:
   SetThreadGroupAffinity(GetCurrentThread(), &OriginalGroupAffinity, NULL);
   return Result;
 }
+
+DWORD
+GetLogicalCoreCount(
+  VOID
+  )
+{
+  DWORD Result = 0;
+  WORD GroupCount = GetActiveProcessorGroupCount();
+  for (WORD GroupNumber = 0; GroupNumber < GroupCount; ++GroupNumber)
+  {
+    Result += GetActiveProcessorCount(GroupNumber);
+  }
+
+  return Result;
+}
+
+BOOL
+SetThreadLogicalCore(
+  HANDLE Thread,
+  DWORD CoreIndex
+  )
+{
+  WORD GroupCount = GetActiveProcessorGroupCount();
+  for (WORD GroupNumber = 0; GroupNumber < GroupCount; ++GroupNumber)
+  {
+    DWORD ProcessorCount = GetActiveProcessorCount(GroupNumber);
+
+    if (CoreIndex < ProcessorCount)
+    {
+      GROUP_AFFINITY GroupAffinity = { 0 };
+      GroupAffinity.Mask = (KAFFINITY)(1) << CoreIndex;
+      GroupAffinity.Group = GroupNumber;
+      return SetThreadGroupAffinity(Thread, &GroupAffinity, NULL);
+    }
+
+    CoreIndex -= ProcessorCount;
+  }
+
+  return FALSE;
+}
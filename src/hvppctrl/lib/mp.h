@@ -6,3 +6,18 @@ ForEachLogicalCore(
   void (*CallbackFunction)(void*),
   void* Context
   );
+
+DWORD
+GetLogicalCoreCount(
+  VOID
+  );
+
+//
+// Pin the thread to the logical core (indexed across all processor
+// groups, in the same order as ForEachLogicalCore).
+//
+BOOL
+SetThreadLogicalCore(
+  HANDLE Thread,
+  DWORD CoreIndex
+  );
@@ -1,7 +1,13 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
 
 #include <windows.h>
+#include <conio.h>
+#include <intrin.h>
 
 #include "ia32/asm.h"
 #include "lib/mp.h"
@@ -9,8 +15,130 @@
 #include "udis86/udis86.h"
 
 #include "../hvpp/hvpp/lib/ioctl.h"
+#include "../hvpp/hvpp/lib/event_ring.h"
+#include "../hvpp/hvpp/lib/exit_record.h"
+#include "../hvpp/hvpp/lib/hypercall.h"
+#include "../hvpp/hvpp/lib/snapshot_chunk.h"
+#include "../hvpp/hvpp/ia32/vmx/exit_reason.h"
+#include "../hvpp/hvpp/vmexit/vmexit_stats_ring.h"
+#include "../hvpp/hvpp/vmexit/vmexit_stats_snapshot.h"
 
 using ioctl_enable_io_debugbreak_t = ioctl_read_write_t<1, sizeof(uint16_t)>;
+using ioctl_map_stats_ring_t       = ioctl_read_write_t<4, sizeof(uint64_t)>;
+using ioctl_unmap_stats_ring_t     = ioctl_none_t<5>;
+using ioctl_map_event_channel_t    = ioctl_read_write_t<8, sizeof(uint64_t)>;
+using ioctl_unmap_event_channel_t  = ioctl_none_t<9>;
+using ioctl_wait_event_channel_t   = ioctl_read_write_t<10, sizeof(uint64_t)>;
+using ioctl_query_exit_stats_t     = ioctl_out_direct_t<11, sizeof(hvpp::vmexit_stats_snapshot_request_t)>;
+
+//
+// See hvppdrv/device_custom.h.
+//
+struct pipeline_mask_request_t
+{
+  uint32_t stage_index;
+  uint32_t flags;
+  uint64_t mask[2];
+};
+
+//
+// See hvpp/vcpu.h.
+//
+struct vcpu_exit_timing_t
+{
+  static constexpr int exit_reason_count = 65;
+  static constexpr int bucket_count      = 32;
+
+  uint32_t handler[exit_reason_count][bucket_count];
+  uint32_t total[exit_reason_count][bucket_count];
+};
+
+using ioctl_query_exit_timing_t    = ioctl_read_write_t<6, sizeof(vcpu_exit_timing_t)>;
+using ioctl_pipeline_mask_t        = ioctl_read_write_t<12, sizeof(pipeline_mask_request_t)>;
+
+//
+// See hvppdrv/device_custom.h.
+//
+struct measure_exit_request_t
+{
+  static constexpr uint32_t instruction_in    = 0;
+  static constexpr uint32_t instruction_out   = 1;
+  static constexpr uint32_t instruction_rdmsr = 2;
+
+  static constexpr uint32_t max_sample_count  = 4096;
+
+  uint32_t instruction;
+  uint32_t argument;
+  uint32_t sample_count;
+  uint32_t reserved;
+};
+
+using ioctl_measure_exit_t         = ioctl_out_direct_t<13, sizeof(measure_exit_request_t)>;
+
+//
+// See hvppdrv/self_benchmark.h.
+//
+struct self_benchmark_t
+{
+  static constexpr uint32_t primitive_count = 7;
+
+  struct result_t
+  {
+    uint32_t iteration_count;
+    uint32_t reserved;
+    uint64_t min_ticks;
+    uint64_t max_ticks;
+    uint64_t total_ticks;
+  };
+
+  uint32_t iteration_count;
+  uint32_t cpu_index;
+
+  result_t result[primitive_count];
+};
+
+using ioctl_self_benchmark_t       = ioctl_read_write_t<14, sizeof(self_benchmark_t)>;
+using ioctl_collect_access_bitmap_t = ioctl_out_direct_t<15, sizeof(uint64_t)>;
+using ioctl_map_snapshot_t         = ioctl_read_write_t<16, sizeof(uint64_t)>;
+using ioctl_unmap_snapshot_t       = ioctl_none_t<17>;
+using ioctl_snapshot_t             = ioctl_read_write_t<18, sizeof(snapshot::request_t)>;
+
+//
+// See hvpp/lib/mm.h.
+//
+struct mm_statistics_t
+{
+  static constexpr int class_count          = 13;
+  static constexpr int latency_bucket_count = 16;
+  static constexpr int tag_count            = 6;
+
+  uint64_t allocation_count;
+  uint64_t free_count;
+  uint64_t failure_count;
+
+  uint64_t allocated_bytes;
+  uint64_t free_bytes;
+  uint64_t peak_allocated_bytes;
+  uint64_t largest_free_run;
+
+  uint64_t class_bytes[class_count];
+  uint64_t latency[latency_bucket_count];
+
+  uint64_t host_stack_size;
+  uint64_t host_stack_used;
+
+  int64_t  tag_bytes[tag_count];
+  int64_t  tag_allocation_count[tag_count];
+};
+
+//
+// Names of mm::memory_tag values.
+//
+static const char* MmTagName[mm_statistics_t::tag_count] = {
+  "untagged", "vcpu", "ept", "stats", "hook", "trace"
+};
+
+using ioctl_query_mm_statistics_t  = ioctl_read_write_t<3, sizeof(mm_statistics_t)>;
 
 #define PAGE_SIZE       4096
 #define PAGE_ALIGN(Va)  ((PVOID)((ULONG_PTR)(Va) & ~(PAGE_SIZE - 1)))
@@ -119,11 +247,33 @@ void TestHook()
 
   auto Hide = [](void* PageRead, void* PageExecute)
   {
-    struct CONTEXT { void* PageRead; void* PageExecute; } Context { PageRead, PageExecute };
+    //
+    // Single batched hypercall per core (see hypercall.h) - more hooks
+    // (or other operations) could be appended to the same request.
+    //
+    struct REQUEST
+    {
+      hypercall::header_t Header;
+      hypercall::operation_t Operation[2];
+    } Request{};
+
+    Request.Header.signature = hypercall::batch_signature;
+    Request.Header.operation_count = 2;
+
+    Request.Operation[0].type = hypercall::operation_type::hook;
+    Request.Operation[0].argument[0] = (uint64_t)PageExecute;
+    Request.Operation[0].argument[1] = (uint64_t)PageRead;
+
+    Request.Operation[1].type = hypercall::operation_type::stats_query;
+    Request.Operation[1].argument[0] = (uint64_t)hypercall::stats_id::hook_count;
+
     ForEachLogicalCore([](void* ContextPtr) {
-      CONTEXT* Context = (CONTEXT*)ContextPtr;
-      ia32_asm_vmx_vmcall(0xc1, (uint64_t)Context->PageRead, (uint64_t)Context->PageExecute, 0);
-    }, &Context);
+      ia32_asm_vmx_vmcall(hypercall::batch_id, (uint64_t)ContextPtr, sizeof(REQUEST), 0);
+    }, &Request);
+
+    printf("Hook status: %i, hook count: %u\n",
+           (int)Request.Operation[0].status,
+           (uint32_t)Request.Operation[1].result);
   };
 
   auto Unhide = []()
@@ -216,6 +366,295 @@ void TestHook()
   free(OriginalFunctionBackup);
 }
 
+//
+// Batch of detours which are installed in single Detours transaction and
+// hidden by single batched hypercall per core (see hypercall.h).
+//
+// HookBatchAdd() only records the detour.  HookBatchCommit() backs up all
+// pages affected by the detours (each page only once, even if more
+// functions on it are detoured), attaches all detours in one transaction
+// and then asks the hypervisor to return the backup when the page is read
+// and the detoured page when it's executed.  HookBatchRevert() removes
+// hooks of these pages only (unlike VMCALL 0xc2, which removes all hooks)
+// and detaches the detours.
+//
+
+struct HOOK_BATCH_ENTRY
+{
+  void** OriginalFunction;
+  void*  HookedFunction;
+};
+
+struct HOOK_BATCH
+{
+  std::vector<HOOK_BATCH_ENTRY> Entry;
+
+  //
+  // Affected pages (sorted) and their backups (PageBackup + i * PAGE_SIZE).
+  //
+  std::vector<ULONG_PTR>        Page;
+  PUINT8                        PageBackup;
+};
+
+void HookBatchAdd(HOOK_BATCH* Batch, void** OriginalFunction, void* HookedFunction)
+{
+  Batch->Entry.push_back({ OriginalFunction, HookedFunction });
+}
+
+bool HookBatchSubmit(HOOK_BATCH* Batch, hypercall::operation_type Type)
+{
+  //
+  // One operation per page.  The request is split only if there are more
+  // pages than fit in single batch.
+  //
+  static constexpr size_t MaxPageCount = hypercall::max_operation_count;
+
+  const size_t RequestSize = sizeof(hypercall::header_t) +
+                             sizeof(hypercall::operation_t) * std::min(Batch->Page.size(), MaxPageCount);
+
+  auto Request = (hypercall::header_t*)VirtualAlloc(NULL, RequestSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+  if (!Request)
+  {
+    return false;
+  }
+
+  VirtualLock(Request, RequestSize);
+
+  auto Operation = (hypercall::operation_t*)(Request + 1);
+  size_t FailedCount = 0;
+
+  for (size_t First = 0; First < Batch->Page.size(); First += MaxPageCount)
+  {
+    const size_t Count = std::min(Batch->Page.size() - First, MaxPageCount);
+
+    Request->signature = hypercall::batch_signature;
+    Request->operation_count = (uint32_t)Count;
+
+    for (size_t Index = 0; Index < Count; ++Index)
+    {
+      Operation[Index] = hypercall::operation_t{};
+      Operation[Index].type = Type;
+      Operation[Index].argument[0] = (uint64_t)Batch->Page[First + Index];
+      Operation[Index].argument[1] = (uint64_t)(Batch->PageBackup + (First + Index) * PAGE_SIZE);
+    }
+
+    struct SUBMIT_CONTEXT
+    {
+      hypercall::header_t* Request;
+      size_t               RequestSize;
+    } Context{ Request, sizeof(hypercall::header_t) + sizeof(hypercall::operation_t) * Count };
+
+    ForEachLogicalCore([](void* ContextPtr) {
+      auto Context = (SUBMIT_CONTEXT*)ContextPtr;
+      ia32_asm_vmx_vmcall(hypercall::batch_id, (uint64_t)Context->Request, Context->RequestSize, 0);
+    }, &Context);
+
+    for (size_t Index = 0; Index < Count; ++Index)
+    {
+      FailedCount += Operation[Index].status != hypercall::status_code::success;
+    }
+  }
+
+  VirtualUnlock(Request, RequestSize);
+  VirtualFree(Request, 0, MEM_RELEASE);
+
+  if (FailedCount)
+  {
+    printf("HookBatch: %zu of %zu pages failed\n", FailedCount, Batch->Page.size());
+  }
+
+  return FailedCount == 0;
+}
+
+bool HookBatchCommit(HOOK_BATCH* Batch)
+{
+  //
+  // Collect pages which will be modified by the detours - the patch
+  // (jump to the detour) can cross the page boundary.
+  //
+  static constexpr ULONG_PTR DetourPatchSize = 16;
+
+  Batch->Page.clear();
+
+  for (auto& Entry : Batch->Entry)
+  {
+    const auto Target = (ULONG_PTR)*Entry.OriginalFunction;
+
+    Batch->Page.push_back((ULONG_PTR)PAGE_ALIGN(Target));
+    Batch->Page.push_back((ULONG_PTR)PAGE_ALIGN(Target + DetourPatchSize - 1));
+  }
+
+  std::sort(Batch->Page.begin(), Batch->Page.end());
+  Batch->Page.erase(std::unique(Batch->Page.begin(), Batch->Page.end()), Batch->Page.end());
+
+  //
+  // Back up the pages before they're patched - the backup is what
+  // the reads will see.  Lock both, so that their physical addresses
+  // don't change while they're hooked.
+  //
+  const size_t BackupSize = Batch->Page.size() * PAGE_SIZE;
+
+  Batch->PageBackup = (PUINT8)VirtualAlloc(NULL, BackupSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+  if (!Batch->PageBackup)
+  {
+    return false;
+  }
+
+  VirtualLock(Batch->PageBackup, BackupSize);
+
+  for (size_t Index = 0; Index < Batch->Page.size(); ++Index)
+  {
+    VirtualLock((PVOID)Batch->Page[Index], PAGE_SIZE);
+    memcpy(Batch->PageBackup + Index * PAGE_SIZE, (PVOID)Batch->Page[Index], PAGE_SIZE);
+  }
+
+  //
+  // Attach all detours in single transaction.
+  //
+  DetourTransactionBegin();
+  DetourUpdateThread(GetCurrentThread());
+
+  for (auto& Entry : Batch->Entry)
+  {
+    DetourAttach(Entry.OriginalFunction, Entry.HookedFunction);
+  }
+
+  if (LONG Error = DetourTransactionCommit())
+  {
+    printf("HookBatch: DetourTransactionCommit failed (%li)\n", Error);
+    return false;
+  }
+
+  //
+  // Hide all pages at once.  The hooks are shared by all VCPUs, the
+  // batch is issued on each core only to synchronize them.
+  //
+  return HookBatchSubmit(Batch, hypercall::operation_type::hook);
+}
+
+void HookBatchRevert(HOOK_BATCH* Batch)
+{
+  if (!Batch->PageBackup)
+  {
+    return;
+  }
+
+  HookBatchSubmit(Batch, hypercall::operation_type::unhook);
+
+  DetourTransactionBegin();
+  DetourUpdateThread(GetCurrentThread());
+
+  for (auto& Entry : Batch->Entry)
+  {
+    DetourDetach(Entry.OriginalFunction, Entry.HookedFunction);
+  }
+
+  DetourTransactionCommit();
+
+  for (auto Page : Batch->Page)
+  {
+    VirtualUnlock((PVOID)Page, PAGE_SIZE);
+  }
+
+  VirtualUnlock(Batch->PageBackup, Batch->Page.size() * PAGE_SIZE);
+  VirtualFree(Batch->PageBackup, 0, MEM_RELEASE);
+
+  Batch->PageBackup = nullptr;
+  Batch->Page.clear();
+}
+
+DECLSPEC_NOINLINE
+int
+Hook_Generated(
+  VOID
+  )
+{
+  HookCallCount += 1;
+  return -1;
+}
+
+void TestHookBatch(DWORD FunctionCount)
+{
+  //
+  // Generate "FunctionCount" functions (each one returns its index),
+  // 64 bytes apart - many of them share the same page.  Hook all of them
+  // and hide the hooks.  Calls must be detoured, while reads must see
+  // the original code.
+  //
+  using pfnGenerated = int (*)();
+
+  static constexpr DWORD FunctionStride = 64;
+
+  if (FunctionCount == 0)
+  {
+    FunctionCount = 256;
+  }
+
+  const size_t CodeSize = ((size_t)FunctionCount * FunctionStride + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+  auto Code = (PUINT8)VirtualAlloc(NULL, CodeSize, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+
+  if (!Code)
+  {
+    printf("Cannot allocate code (%u)\n", GetLastError());
+    return;
+  }
+
+  memset(Code, 0xcc, CodeSize);
+
+  std::vector<PVOID> Function(FunctionCount);
+
+  for (DWORD Index = 0; Index < FunctionCount; ++Index)
+  {
+    auto Instruction = Code + Index * FunctionStride;
+
+    Instruction[0] = 0xb8;                            // mov eax, imm32
+    memcpy(&Instruction[1], &Index, sizeof(Index));
+    Instruction[5] = 0xc3;                            // ret
+
+    Function[Index] = Instruction;
+  }
+
+  FlushInstructionCache(GetCurrentProcess(), Code, CodeSize);
+
+  HOOK_BATCH Batch{};
+
+  for (auto& Target : Function)
+  {
+    HookBatchAdd(&Batch, &Target, (PVOID)&Hook_Generated);
+  }
+
+  HookCallCount = 0;
+
+  UINT64 Begin = GetTickCount64();
+  bool Committed = HookBatchCommit(&Batch);
+  UINT64 End = GetTickCount64();
+
+  printf("HookBatch: %u functions, %zu pages, %s in %llu ms\n",
+         FunctionCount, Batch.Page.size(), Committed ? "hidden" : "failed", End - Begin);
+
+  if (Committed)
+  {
+    DWORD VisibleCount = 0;
+
+    for (DWORD Index = 0; Index < FunctionCount; ++Index)
+    {
+      auto Instruction = Code + Index * FunctionStride;
+
+      ((pfnGenerated)Instruction)();
+      VisibleCount += Instruction[0] != 0xb8;
+    }
+
+    printf("HookCallCount = %i (expected: %u)\n", HookCallCount, FunctionCount);
+    printf("Visible detours = %u (expected: 0)\n", VisibleCount);
+  }
+
+  HookBatchRevert(&Batch);
+  VirtualFree(Code, 0, MEM_RELEASE);
+  printf("\n");
+}
+
 void TestIoControl()
 {
   HANDLE DeviceHandle;
@@ -263,11 +702,2419 @@ void TestIoControl()
   printf("IOCTL return value: 0x%04x (size: %u)\n", IoPort, BytesReturned);
 }
 
-int main()
+//
+// Sum the records published into the per-CPU statistics ring since
+// Tail (which is advanced to the current head).  Returns number of
+// records which were lost - overwritten before we could read them.
+//
+UINT64 StatsRingRead(const volatile hvpp::vmexit_stats_cpu_ring_t& CpuRing,
+                     UINT64& Tail,
+                     UINT64 (&VmexitDelta)[65],
+                     UINT64& TscDelta)
+{
+  const UINT64 Head = CpuRing.head;
+  UINT64 Lost = 0;
+
+  if (Head - Tail > hvpp::vmexit_stats_cpu_ring_t::record_count)
+  {
+    Lost = Head - Tail - hvpp::vmexit_stats_cpu_ring_t::record_count;
+    Tail = Head - hvpp::vmexit_stats_cpu_ring_t::record_count;
+  }
+
+  for (; Tail < Head; ++Tail)
+  {
+    auto& Record = CpuRing.record[Tail % hvpp::vmexit_stats_cpu_ring_t::record_count];
+
+    if (Record.sequence != Tail + 1)
+    {
+      Lost += 1;
+      continue;
+    }
+
+    UINT64 RecordVmexit[65];
+    for (int i = 0; i < 65; ++i)
+    {
+      RecordVmexit[i] = Record.vmexit[i];
+    }
+
+    const UINT64 RecordTscDelta = Record.tsc_delta;
+
+    //
+    // Check again - the record could have been overwritten
+    // while we were reading it.
+    //
+    if (Record.sequence != Tail + 1)
+    {
+      Lost += 1;
+      continue;
+    }
+
+    for (int i = 0; i < 65; ++i)
+    {
+      VmexitDelta[i] += RecordVmexit[i];
+    }
+
+    TscDelta += RecordTscDelta;
+  }
+
+  return Lost;
+}
+
+void TestStatsStream()
+{
+  HANDLE DeviceHandle;
+
+  DeviceHandle = CreateFile(TEXT("\\\\.\\hvpp"),
+                            GENERIC_READ | GENERIC_WRITE,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE,
+                            NULL,
+                            OPEN_EXISTING,
+                            0,
+                            NULL);
+
+  if (DeviceHandle == INVALID_HANDLE_VALUE)
+  {
+    printf("Error while opening 'hvpp' device!\n");
+    return;
+  }
+
+  //
+  // Map the ring with VM-exit statistics into our address space.
+  // See hvpp/vmexit/vmexit_stats_ring.h.
+  //
+
+  UINT64 RingAddress = 0;
+  DWORD BytesReturned;
+  if (!DeviceIoControl(DeviceHandle,
+                       ioctl_map_stats_ring_t::code,
+                       &RingAddress,
+                       sizeof(RingAddress),
+                       &RingAddress,
+                       sizeof(RingAddress),
+                       &BytesReturned,
+                       NULL) || !RingAddress)
+  {
+    printf("Error while mapping the statistics ring!\n");
+    CloseHandle(DeviceHandle);
+    return;
+  }
+
+  auto Ring = (const volatile hvpp::vmexit_stats_ring_t*)RingAddress;
+
+  if (Ring->signature != hvpp::vmexit_stats_ring_t::ring_signature)
+  {
+    printf("Invalid statistics ring signature!\n");
+    CloseHandle(DeviceHandle);
+    return;
+  }
+
+  //
+  // Start reading from the current head of each per-CPU ring.
+  //
+  UINT64 Tail[256] = {};
+  const UINT32 CpuCount = min(Ring->cpu_count, UINT32(256));
+
+  for (UINT32 CpuIndex = 0; CpuIndex < CpuCount; ++CpuIndex)
+  {
+    Tail[CpuIndex] = Ring->cpu[CpuIndex].head;
+  }
+
+  for (int Iteration = 0; Iteration < 10; ++Iteration)
+  {
+    Sleep(500);
+
+    for (UINT32 CpuIndex = 0; CpuIndex < CpuCount; ++CpuIndex)
+    {
+      UINT64 VmexitDelta[65] = {};
+      UINT64 TscDelta = 0;
+      const UINT64 Lost = StatsRingRead(Ring->cpu[CpuIndex], Tail[CpuIndex], VmexitDelta, TscDelta);
+
+      printf("CPU %u (%llu Mticks, %llu lost):", CpuIndex, TscDelta / 1000000, Lost);
+      for (int i = 0; i < 65; ++i)
+      {
+        if (VmexitDelta[i])
+        {
+          printf(" [%i]=%llu", i, VmexitDelta[i]);
+        }
+      }
+      printf("\n");
+    }
+
+    printf("\n");
+  }
+
+  DeviceIoControl(DeviceHandle,
+                  ioctl_unmap_stats_ring_t::code,
+                  NULL,
+                  0,
+                  NULL,
+                  0,
+                  &BytesReturned,
+                  NULL);
+
+  CloseHandle(DeviceHandle);
+}
+
+void TestEventChannel()
 {
+  HANDLE DeviceHandle;
+
+  DeviceHandle = CreateFile(TEXT("\\\\.\\hvpp"),
+                            GENERIC_READ | GENERIC_WRITE,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE,
+                            NULL,
+                            OPEN_EXISTING,
+                            0,
+                            NULL);
+
+  if (DeviceHandle == INVALID_HANDLE_VALUE)
+  {
+    printf("Error while opening 'hvpp' device!\n");
+    return;
+  }
+
+  //
+  // Map the event channel into our address space. The driver signals
+  // EventHandle when new events arrive while we're waiting.
+  // See hvpp/lib/event_ring.h.
+  //
+
+  HANDLE EventHandle = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+  UINT64 ChannelAddress = (UINT64)EventHandle;
+  DWORD BytesReturned;
+  if (!DeviceIoControl(DeviceHandle,
+                       ioctl_map_event_channel_t::code,
+                       &ChannelAddress,
+                       sizeof(ChannelAddress),
+                       &ChannelAddress,
+                       sizeof(ChannelAddress),
+                       &BytesReturned,
+                       NULL) || !ChannelAddress)
+  {
+    printf("Error while mapping the event channel!\n");
+    CloseHandle(EventHandle);
+    CloseHandle(DeviceHandle);
+    return;
+  }
+
+  auto Channel = (volatile event_channel::ring_t*)ChannelAddress;
+
+  if (Channel->signature != event_channel::ring_t::ring_signature)
+  {
+    printf("Invalid event channel signature!\n");
+    CloseHandle(EventHandle);
+    CloseHandle(DeviceHandle);
+    return;
+  }
+
+  const UINT32 CpuCount = Channel->cpu_count;
+  UINT64 EventCount = 0;
+
+  const ULONGLONG EndTime = GetTickCount64() + 5000;
+
+  while (GetTickCount64() < EndTime)
+  {
+    bool Received = false;
+
+    for (UINT32 CpuIndex = 0; CpuIndex < CpuCount; ++CpuIndex)
+    {
+      auto& CpuRing = Channel->cpu[CpuIndex];
+      const UINT64 Head = CpuRing.head;
+      UINT64 Tail = CpuRing.tail;
+
+      for (; Tail < Head; ++Tail)
+      {
+        auto& Record = CpuRing.record[Tail % event_channel::cpu_ring_t::record_count];
+
+        switch (Record.type)
+        {
+          case event_channel::event_type::vmexit_trace:
+            printf("CPU %u: VM-exit %llu (qualification: 0x%llx, rip: 0x%llx)\n",
+                   CpuIndex, Record.data[0], Record.data[1], Record.data[2]);
+            break;
+
+          case event_channel::event_type::ept_violation:
+            printf("CPU %u: EPT violation 0x%llx (va: 0x%llx, rip: 0x%llx)\n",
+                   CpuIndex, Record.data[0], Record.data[1], Record.data[3]);
+            break;
+
+          case event_channel::event_type::sample:
+            printf("CPU %u: sample (rip: 0x%llx, cr3: 0x%llx, cpl: %llu)\n",
+                   CpuIndex, Record.data[0], Record.data[1], Record.data[2]);
+            break;
+
+          case event_channel::event_type::governor:
+            printf("CPU %u: VM-exit %llu degraded to %s (%llu exits, budget: %llu)\n",
+                   CpuIndex, Record.data[0], Record.data[1] == 1 ? "sampling" : "intercept_off",
+                   Record.data[2], Record.data[3]);
+            break;
+        }
+
+        EventCount += 1;
+      }
+
+      if (Tail != CpuRing.tail)
+      {
+        //
+        // Release the records back to the producer.
+        //
+        CpuRing.tail = Tail;
+        Received = true;
+      }
+    }
+
+    if (!Received)
+    {
+      //
+      // Nothing to read - announce that we're going to wait, check
+      // the rings once more (the next iteration) and wait.
+      //
+      Channel->waiting = 1;
+
+      bool Pending = false;
+      for (UINT32 CpuIndex = 0; CpuIndex < CpuCount; ++CpuIndex)
+      {
+        Pending |= Channel->cpu[CpuIndex].head != Channel->cpu[CpuIndex].tail;
+      }
+
+      if (!Pending)
+      {
+        WaitForSingleObject(EventHandle, 100);
+      }
+    }
+  }
+
+  for (UINT32 CpuIndex = 0; CpuIndex < CpuCount; ++CpuIndex)
+  {
+    if (Channel->cpu[CpuIndex].dropped)
+    {
+      printf("CPU %u: %llu events dropped\n", CpuIndex, Channel->cpu[CpuIndex].dropped);
+    }
+  }
+
+  printf("Received %llu events\n", EventCount);
+
+  DeviceIoControl(DeviceHandle,
+                  ioctl_unmap_event_channel_t::code,
+                  NULL,
+                  0,
+                  NULL,
+                  0,
+                  &BytesReturned,
+                  NULL);
+
+  CloseHandle(EventHandle);
+  CloseHandle(DeviceHandle);
+}
+
+void TestEventChannelAsync()
+{
+  HANDLE DeviceHandle;
+
+  //
+  // Instead of the event and the "waiting" flag, keep few overlapped
+  // ioctl_wait_event_channel requests in flight.  The driver keeps them
+  // pending until events arrive and completes them from a DPC.
+  //
+  DeviceHandle = CreateFile(TEXT("\\\\.\\hvpp"),
+                            GENERIC_READ | GENERIC_WRITE,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE,
+                            NULL,
+                            OPEN_EXISTING,
+                            FILE_FLAG_OVERLAPPED,
+                            NULL);
+
+  if (DeviceHandle == INVALID_HANDLE_VALUE)
+  {
+    printf("Error while opening 'hvpp' device!\n");
+    return;
+  }
+
+  //
+  // The map IOCTL still requires an event handle - the event is just
+  // never waited for.  IOCTLs of the overlapped handle need their own
+  // OVERLAPPED structure.
+  //
+  HANDLE EventHandle = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+  OVERLAPPED MapOverlapped = {};
+  MapOverlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+  UINT64 ChannelAddress = (UINT64)EventHandle;
+  DWORD BytesReturned;
+  if ((!DeviceIoControl(DeviceHandle,
+                        ioctl_map_event_channel_t::code,
+                        &ChannelAddress,
+                        sizeof(ChannelAddress),
+                        &ChannelAddress,
+                        sizeof(ChannelAddress),
+                        &BytesReturned,
+                        &MapOverlapped) &&
+       !GetOverlappedResult(DeviceHandle, &MapOverlapped, &BytesReturned, TRUE)) || !ChannelAddress)
+  {
+    printf("Error while mapping the event channel!\n");
+    CloseHandle(MapOverlapped.hEvent);
+    CloseHandle(EventHandle);
+    CloseHandle(DeviceHandle);
+    return;
+  }
+
+  auto Channel = (volatile event_channel::ring_t*)ChannelAddress;
+  const UINT32 CpuCount = Channel->cpu_count;
+
+  static constexpr int RequestCount = 4;
+
+  OVERLAPPED Overlapped[RequestCount] = {};
+  HANDLE Events[RequestCount];
+  UINT64 UnreadCount[RequestCount];
+
+  auto Submit = [&](int Index) {
+    ResetEvent(Overlapped[Index].hEvent);
+    DeviceIoControl(DeviceHandle,
+                    ioctl_wait_event_channel_t::code,
+                    &UnreadCount[Index],
+                    sizeof(UnreadCount[Index]),
+                    &UnreadCount[Index],
+                    sizeof(UnreadCount[Index]),
+                    NULL,
+                    &Overlapped[Index]);
+  };
+
+  for (int Index = 0; Index < RequestCount; ++Index)
+  {
+    Overlapped[Index].hEvent = Events[Index] = CreateEvent(NULL, TRUE, FALSE, NULL);
+    Submit(Index);
+  }
+
+  UINT64 EventCount = 0;
+  UINT64 CompletionCount = 0;
+
+  const ULONGLONG EndTime = GetTickCount64() + 5000;
+
+  while (GetTickCount64() < EndTime)
+  {
+    const DWORD WaitResult = WaitForMultipleObjects(RequestCount, Events, FALSE, 100);
+
+    if (WaitResult >= WAIT_OBJECT_0 + RequestCount)
+    {
+      continue;
+    }
+
+    const int Index = int(WaitResult - WAIT_OBJECT_0);
+
+    if (GetOverlappedResult(DeviceHandle, &Overlapped[Index], &BytesReturned, FALSE))
+    {
+      CompletionCount += 1;
+
+      //
+      // Consume everything there is - the request only tells us that
+      // the rings aren't empty.
+      //
+      for (UINT32 CpuIndex = 0; CpuIndex < CpuCount; ++CpuIndex)
+      {
+        auto& CpuRing = Channel->cpu[CpuIndex];
+        const UINT64 Head = CpuRing.head;
+
+        EventCount += Head - CpuRing.tail;
+        CpuRing.tail = Head;
+      }
+    }
+
+    Submit(Index);
+  }
+
+  printf("Received %llu events in %llu completions\n", EventCount, CompletionCount);
+
+  //
+  // Unmapping the channel completes the requests which are still
+  // pending.
+  //
+  ResetEvent(MapOverlapped.hEvent);
+  if (!DeviceIoControl(DeviceHandle,
+                       ioctl_unmap_event_channel_t::code,
+                       NULL,
+                       0,
+                       NULL,
+                       0,
+                       &BytesReturned,
+                       &MapOverlapped))
+  {
+    GetOverlappedResult(DeviceHandle, &MapOverlapped, &BytesReturned, TRUE);
+  }
+
+  WaitForMultipleObjects(RequestCount, Events, TRUE, INFINITE);
+
+  for (int Index = 0; Index < RequestCount; ++Index)
+  {
+    CloseHandle(Events[Index]);
+  }
+
+  CloseHandle(MapOverlapped.hEvent);
+  CloseHandle(EventHandle);
+  CloseHandle(DeviceHandle);
+}
+
+struct StatsEntry
+{
+  UINT32 Key;
+  UINT32 Count;
+};
+
+//
+// Insert the counter into the (descending) list of the top "TopCount"
+// counters.
+//
+void StatsTopInsert(StatsEntry* Top, int TopCount, UINT32 Key, UINT32 Count)
+{
+  if (Count == 0 || Count <= Top[TopCount - 1].Count)
+  {
+    return;
+  }
+
+  int Index = TopCount - 1;
+  for (; Index > 0 && Top[Index - 1].Count < Count; --Index)
+  {
+    Top[Index] = Top[Index - 1];
+  }
+
+  Top[Index] = StatsEntry{ Key, Count };
+}
+
+void TestExitStats(int TopCount, bool Reset)
+{
+  static constexpr int MaxTopCount = 64;
+
+  if (TopCount < 1 || TopCount > MaxTopCount)
+  {
+    TopCount = 10;
+  }
+
+  HANDLE DeviceHandle;
+
+  DeviceHandle = CreateFile(TEXT("\\\\.\\hvpp"),
+                            GENERIC_READ | GENERIC_WRITE,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE,
+                            NULL,
+                            OPEN_EXISTING,
+                            0,
+                            NULL);
+
+  if (DeviceHandle == INVALID_HANDLE_VALUE)
+  {
+    printf("Error while opening 'hvpp' device!\n");
+    return;
+  }
+
+  //
+  // The snapshot is large (~640kb) - it's written directly into our
+  // buffer (METHOD_OUT_DIRECT).  Attribution of VM-exits follows it.
+  //
+  const SIZE_T SnapshotSize = sizeof(hvpp::vmexit_stats_snapshot_t) + sizeof(hvpp::vmexit_stats_attribution_t);
+
+  auto Snapshot = (hvpp::vmexit_stats_snapshot_t*)VirtualAlloc(NULL,
+                                                                SnapshotSize,
+                                                                MEM_COMMIT | MEM_RESERVE,
+                                                                PAGE_READWRITE);
+
+  auto Attribution = (hvpp::vmexit_stats_attribution_t*)(Snapshot + 1);
+
+  if (!Snapshot)
+  {
+    CloseHandle(DeviceHandle);
+    return;
+  }
+
+  hvpp::vmexit_stats_snapshot_request_t Request;
+  Request.cpu_index = hvpp::vmexit_stats_snapshot_request_t::all_cpus;
+  Request.flags     = Reset ? hvpp::vmexit_stats_snapshot_request_t::flag_reset : 0;
+
+  DWORD BytesReturned;
+  if (!DeviceIoControl(DeviceHandle,
+                       ioctl_query_exit_stats_t::code,
+                       &Request,
+                       sizeof(Request),
+                       Snapshot,
+                       (DWORD)SnapshotSize,
+                       &BytesReturned,
+                       NULL))
+  {
+    printf("Error while querying VM-exit statistics!\n");
+    VirtualFree(Snapshot, 0, MEM_RELEASE);
+    CloseHandle(DeviceHandle);
+    return;
+  }
+
+  StatsEntry Top[MaxTopCount];
+
+  //
+  // Exit reasons.
+  //
+  UINT64 Total = 0;
+  memset(Top, 0, sizeof(Top));
+  for (UINT32 Index = 0; Index < ARRAYSIZE(Snapshot->vmexit); ++Index)
+  {
+    Total += Snapshot->vmexit[Index];
+    StatsTopInsert(Top, TopCount, Index, Snapshot->vmexit[Index]);
+  }
+
+  printf("Top %i exit reasons (total: %llu):\n", TopCount, Total);
+  for (int Index = 0; Index < TopCount && Top[Index].Count; ++Index)
+  {
+    printf("  %-30s %10u (%5.1f%%)\n",
+           ia32::vmx::exit_reason_to_string(static_cast<ia32::vmx::exit_reason>(Top[Index].Key)),
+           Top[Index].Count,
+           100.0 * Top[Index].Count / Total);
+  }
+
+  //
+  // I/O ports (bit 16 of the key = OUT).
+  //
+  memset(Top, 0, sizeof(Top));
+  for (UINT32 Port = 0; Port < ARRAYSIZE(Snapshot->io_in); ++Port)
+  {
+    StatsTopInsert(Top, TopCount, Port,           Snapshot->io_in[Port]);
+    StatsTopInsert(Top, TopCount, Port | 0x10000, Snapshot->io_out[Port]);
+  }
+
+  printf("Top %i I/O ports:\n", TopCount);
+  for (int Index = 0; Index < TopCount && Top[Index].Count; ++Index)
+  {
+    printf("  %-3s 0x%04x %10u\n",
+           (Top[Index].Key & 0x10000) ? "out" : "in",
+           Top[Index].Key & 0xffff,
+           Top[Index].Count);
+  }
+
+  //
+  // MSRs (bit 0 of the key = WRMSR, bit 31 = range 0xc000'0000,
+  // the index of the MSR within the range is shifted by 1).
+  //
+  memset(Top, 0, sizeof(Top));
+  for (UINT32 Msr = 0; Msr < ARRAYSIZE(Snapshot->rdmsr_0); ++Msr)
+  {
+    StatsTopInsert(Top, TopCount, (Msr << 1),                    Snapshot->rdmsr_0[Msr]);
+    StatsTopInsert(Top, TopCount, (Msr << 1) | 1,                Snapshot->wrmsr_0[Msr]);
+    StatsTopInsert(Top, TopCount, (Msr << 1) | 0x8000'0000,      Snapshot->rdmsr_c[Msr]);
+    StatsTopInsert(Top, TopCount, (Msr << 1) | 0x8000'0001,      Snapshot->wrmsr_c[Msr]);
+  }
+
+  printf("Top %i MSRs (other: rdmsr %u, wrmsr %u):\n",
+         TopCount, Snapshot->rdmsr_other, Snapshot->wrmsr_other);
+  for (int Index = 0; Index < TopCount && Top[Index].Count; ++Index)
+  {
+    printf("  %-5s 0x%08x %10u\n",
+           (Top[Index].Key & 1) ? "wrmsr" : "rdmsr",
+           ((Top[Index].Key & 0x7fff'ffff) >> 1) | (Top[Index].Key & 0x8000'0000 ? 0xc000'0000 : 0),
+           Top[Index].Count);
+  }
+
+  if (Attribution->enabled)
+  {
+    //
+    // Guest processes (CR3) - keys are 64-bit, sort the sketch entries
+    // by their index.
+    //
+    memset(Top, 0, sizeof(Top));
+    for (UINT32 Index = 0; Index < ARRAYSIZE(Attribution->cr3); ++Index)
+    {
+      StatsTopInsert(Top, TopCount, Index, Attribution->cr3[Index].count);
+    }
+
+    printf("Top %i guest CR3s:\n", TopCount);
+    for (int Index = 0; Index < TopCount && Top[Index].Count; ++Index)
+    {
+      const auto& Entry = Attribution->cr3[Top[Index].Key];
+      printf("  0x%016llx %10u (+/- %u)\n", Entry.key, Entry.count, Entry.error);
+    }
+
+    //
+    // Guest RIPs of the top exit reasons.
+    //
+    memset(Top, 0, sizeof(Top));
+    for (UINT32 Index = 0; Index < ARRAYSIZE(Snapshot->vmexit); ++Index)
+    {
+      StatsTopInsert(Top, TopCount, Index, Snapshot->vmexit[Index]);
+    }
+
+    printf("Top guest RIPs:\n");
+    for (int Index = 0; Index < TopCount && Top[Index].Count; ++Index)
+    {
+      const auto ExitReason = Top[Index].Key;
+
+      StatsEntry TopRip[hvpp::vmexit_stats_attribution_t::rip_count] = {};
+      for (UINT32 RipIndex = 0; RipIndex < ARRAYSIZE(TopRip); ++RipIndex)
+      {
+        StatsTopInsert(TopRip, (int)ARRAYSIZE(TopRip), RipIndex, Attribution->rip[ExitReason][RipIndex].count);
+      }
+
+      printf("  %s:\n", ia32::vmx::exit_reason_to_string(static_cast<ia32::vmx::exit_reason>(ExitReason)));
+      for (int RipIndex = 0; RipIndex < (int)ARRAYSIZE(TopRip) && TopRip[RipIndex].Count; ++RipIndex)
+      {
+        const auto& Entry = Attribution->rip[ExitReason][TopRip[RipIndex].Key];
+        printf("    0x%016llx %10u (+/- %u)\n", Entry.key, Entry.count, Entry.error);
+      }
+    }
+  }
+
+  VirtualFree(Snapshot, 0, MEM_RELEASE);
+  CloseHandle(DeviceHandle);
+}
+
+//
+// Live monitor of the hypervisor overhead, refreshed once per second
+// until a key is pressed (or for Seconds seconds):
+//   - VM-exit rate and estimated share of the CPU time spent in the
+//     VMX-root mode, per CPU
+//   - top exit reasons, I/O ports and MSRs (in the last interval)
+//   - top guest RIPs (since attribution was enabled)
+//   - usage of the memory pool of the hypervisor
+//
+// Exit rates come from the statistics ring (see TestStatsStream()),
+// ports and MSRs from the difference of two consecutive snapshots (see
+// TestExitStats()).  Time in the VMX-root mode is estimated from the
+// VM-exit latency histograms (each VM-exit is counted as the middle of
+// its bucket) - it's available only if the driver collects them (see
+// HVPP_ENABLE_EXIT_TIMING).
+//
+void TestTop(int TopCount, DWORD Seconds)
+{
+  static constexpr int    MaxTopCount = 64;
+  static constexpr UINT32 MaxCpuCount = 256;
+
+  if (TopCount < 1 || TopCount > MaxTopCount)
+  {
+    TopCount = 10;
+  }
+
+  HANDLE DeviceHandle;
+
+  DeviceHandle = CreateFile(TEXT("\\\\.\\hvpp"),
+                            GENERIC_READ | GENERIC_WRITE,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE,
+                            NULL,
+                            OPEN_EXISTING,
+                            0,
+                            NULL);
+
+  if (DeviceHandle == INVALID_HANDLE_VALUE)
+  {
+    printf("Error while opening 'hvpp' device!\n");
+    return;
+  }
+
+  UINT64 RingAddress = 0;
+  DWORD BytesReturned;
+  if (!DeviceIoControl(DeviceHandle,
+                       ioctl_map_stats_ring_t::code,
+                       &RingAddress,
+                       sizeof(RingAddress),
+                       &RingAddress,
+                       sizeof(RingAddress),
+                       &BytesReturned,
+                       NULL) || !RingAddress)
+  {
+    printf("Error while mapping the statistics ring!\n");
+    CloseHandle(DeviceHandle);
+    return;
+  }
+
+  auto Ring = (const volatile hvpp::vmexit_stats_ring_t*)RingAddress;
+
+  //
+  // Two snapshots (previous and current), each followed by the
+  // attribution.
+  //
+  const SIZE_T SnapshotSize = sizeof(hvpp::vmexit_stats_snapshot_t) + sizeof(hvpp::vmexit_stats_attribution_t);
+
+  auto SnapshotBuffer = (UINT8*)VirtualAlloc(NULL,
+                                             2 * SnapshotSize,
+                                             MEM_COMMIT | MEM_RESERVE,
+                                             PAGE_READWRITE);
+
+  auto Timing = (vcpu_exit_timing_t*)malloc(sizeof(vcpu_exit_timing_t));
+
+  if (Ring->signature != hvpp::vmexit_stats_ring_t::ring_signature)
+  {
+    printf("Invalid statistics ring signature!\n");
+  }
+  else if (SnapshotBuffer && Timing)
+  {
+    const UINT32 CpuCount = min(Ring->cpu_count, MaxCpuCount);
+
+    UINT64 Tail[MaxCpuCount] = {};
+    UINT64 RootTicks[MaxCpuCount] = {};
+
+    auto QuerySnapshot = [&](hvpp::vmexit_stats_snapshot_t* Snapshot) {
+      hvpp::vmexit_stats_snapshot_request_t Request;
+      Request.cpu_index = hvpp::vmexit_stats_snapshot_request_t::all_cpus;
+      Request.flags     = 0;
+
+      return !!DeviceIoControl(DeviceHandle,
+                               ioctl_query_exit_stats_t::code,
+                               &Request,
+                               sizeof(Request),
+                               Snapshot,
+                               (DWORD)SnapshotSize,
+                               &BytesReturned,
+                               NULL);
+    };
+
+    //
+    // Estimated TSC ticks spent in the VMX-root mode by the CPU (since
+    // the histograms were reset).  Returns false if the driver doesn't
+    // collect the histograms.
+    //
+    auto QueryRootTicks = [&](UINT32 CpuIndex, UINT64& Ticks) {
+      *(UINT32*)Timing = CpuIndex;
+
+      if (!DeviceIoControl(DeviceHandle,
+                           ioctl_query_exit_timing_t::code,
+                           Timing,
+                           sizeof(*Timing),
+                           Timing,
+                           sizeof(*Timing),
+                           &BytesReturned,
+                           NULL))
+      {
+        return false;
+      }
+
+      Ticks = 0;
+      for (int Reason = 0; Reason < vcpu_exit_timing_t::exit_reason_count; ++Reason)
+      {
+        for (int Bucket = 0; Bucket < vcpu_exit_timing_t::bucket_count; ++Bucket)
+        {
+          Ticks += Timing->total[Reason][Bucket] * (Bucket ? (3ull << Bucket) / 2 : 1);
+        }
+      }
+
+      return true;
+    };
+
+    auto Previous = (hvpp::vmexit_stats_snapshot_t*)SnapshotBuffer;
+    auto Current  = (hvpp::vmexit_stats_snapshot_t*)(SnapshotBuffer + SnapshotSize);
+
+    bool HasSnapshot = QuerySnapshot(Previous);
+    bool HasTiming   = true;
+
+    for (UINT32 CpuIndex = 0; CpuIndex < CpuCount; ++CpuIndex)
+    {
+      Tail[CpuIndex] = Ring->cpu[CpuIndex].head;
+      HasTiming = HasTiming && QueryRootTicks(CpuIndex, RootTicks[CpuIndex]);
+    }
+
+    //
+    // Enable escape sequences, so that the screen can be redrawn in place.
+    //
+    const HANDLE ConsoleHandle = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD ConsoleMode = 0;
+    GetConsoleMode(ConsoleHandle, &ConsoleMode);
+    SetConsoleMode(ConsoleHandle, ConsoleMode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+
+    const ULONGLONG StartTime = GetTickCount64();
+    ULONGLONG LastTime = StartTime;
+    UINT64 LastTsc = ia32_asm_read_tsc();
+
+    while (!_kbhit() && (!Seconds || GetTickCount64() - StartTime < Seconds * 1000ull))
+    {
+      Sleep(1000);
+
+      const ULONGLONG Now = GetTickCount64();
+      const UINT64 NowTsc = ia32_asm_read_tsc();
+      const double Interval = max(Now - LastTime, 1ull) / 1000.0;
+      const UINT64 IntervalTsc = max(NowTsc - LastTsc, 1ull);
+
+      LastTime = Now;
+      LastTsc = NowTsc;
+
+      printf("\x1b[H\x1b[2J");
+      printf("hvpp - %u CPUs, %.0f s (press any key to quit)\n\n",
+             CpuCount, (Now - StartTime) / 1000.0);
+
+      //
+      // Per-CPU exit rates and the time share of the hypervisor.
+      //
+      UINT64 ReasonDelta[65] = {};
+      UINT64 TotalDelta = 0;
+
+      printf("  CPU     exits/s   root%%\n");
+      for (UINT32 CpuIndex = 0; CpuIndex < CpuCount; ++CpuIndex)
+      {
+        UINT64 VmexitDelta[65] = {};
+        UINT64 TscDelta = 0;
+        StatsRingRead(Ring->cpu[CpuIndex], Tail[CpuIndex], VmexitDelta, TscDelta);
+
+        UINT64 CpuDelta = 0;
+        for (int i = 0; i < 65; ++i)
+        {
+          ReasonDelta[i] += VmexitDelta[i];
+          CpuDelta += VmexitDelta[i];
+        }
+
+        TotalDelta += CpuDelta;
+
+        UINT64 Ticks = 0;
+        if (HasTiming && QueryRootTicks(CpuIndex, Ticks))
+        {
+          printf("  %3u %11.0f %6.2f\n",
+                 CpuIndex, CpuDelta / Interval,
+                 100.0 * (Ticks - RootTicks[CpuIndex]) / IntervalTsc);
+
+          RootTicks[CpuIndex] = Ticks;
+        }
+        else
+        {
+          printf("  %3u %11.0f    n/a\n", CpuIndex, CpuDelta / Interval);
+        }
+      }
+
+      //
+      // Exit reasons.
+      //
+      StatsEntry Top[MaxTopCount];
+
+      memset(Top, 0, sizeof(Top));
+      for (UINT32 Index = 0; Index < ARRAYSIZE(ReasonDelta); ++Index)
+      {
+        StatsTopInsert(Top, TopCount, Index, (UINT32)ReasonDelta[Index]);
+      }
+
+      printf("\nTop exit reasons (%.0f exits/s):\n", TotalDelta / Interval);
+      for (int Index = 0; Index < TopCount && Top[Index].Count; ++Index)
+      {
+        printf("  %-30s %11.0f/s (%5.1f%%)\n",
+               ia32::vmx::exit_reason_to_string(static_cast<ia32::vmx::exit_reason>(Top[Index].Key)),
+               Top[Index].Count / Interval,
+               100.0 * Top[Index].Count / TotalDelta);
+      }
+
+      if (HasSnapshot && QuerySnapshot(Current))
+      {
+        //
+        // I/O ports (bit 16 of the key = OUT) and MSRs (see
+        // TestExitStats() for the encoding of the key).
+        //
+        memset(Top, 0, sizeof(Top));
+        for (UINT32 Port = 0; Port < ARRAYSIZE(Current->io_in); ++Port)
+        {
+          StatsTopInsert(Top, TopCount, Port,           Current->io_in[Port]  - Previous->io_in[Port]);
+          StatsTopInsert(Top, TopCount, Port | 0x10000, Current->io_out[Port] - Previous->io_out[Port]);
+        }
+
+        printf("\nTop I/O ports:\n");
+        for (int Index = 0; Index < TopCount && Top[Index].Count; ++Index)
+        {
+          printf("  %-5s 0x%04x     %11.0f/s\n",
+                 (Top[Index].Key & 0x10000) ? "out" : "in",
+                 Top[Index].Key & 0xffff,
+                 Top[Index].Count / Interval);
+        }
+
+        memset(Top, 0, sizeof(Top));
+        for (UINT32 Msr = 0; Msr < ARRAYSIZE(Current->rdmsr_0); ++Msr)
+        {
+          StatsTopInsert(Top, TopCount, (Msr << 1),               Current->rdmsr_0[Msr] - Previous->rdmsr_0[Msr]);
+          StatsTopInsert(Top, TopCount, (Msr << 1) | 1,           Current->wrmsr_0[Msr] - Previous->wrmsr_0[Msr]);
+          StatsTopInsert(Top, TopCount, (Msr << 1) | 0x8000'0000, Current->rdmsr_c[Msr] - Previous->rdmsr_c[Msr]);
+          StatsTopInsert(Top, TopCount, (Msr << 1) | 0x8000'0001, Current->wrmsr_c[Msr] - Previous->wrmsr_c[Msr]);
+        }
+
+        printf("\nTop MSRs:\n");
+        for (int Index = 0; Index < TopCount && Top[Index].Count; ++Index)
+        {
+          printf("  %-5s 0x%08x %11.0f/s\n",
+                 (Top[Index].Key & 1) ? "wrmsr" : "rdmsr",
+                 ((Top[Index].Key & 0x7fff'ffff) >> 1) | (Top[Index].Key & 0x8000'0000 ? 0xc000'0000 : 0),
+                 Top[Index].Count / Interval);
+        }
+
+        //
+        // Guest RIPs of all exit reasons (key = reason * rip_count + index
+        // of the sketch entry).
+        //
+        auto Attribution = (const hvpp::vmexit_stats_attribution_t*)(Current + 1);
+
+        if (Attribution->enabled)
+        {
+          constexpr UINT32 RipCount = hvpp::vmexit_stats_attribution_t::rip_count;
+
+          memset(Top, 0, sizeof(Top));
+          for (UINT32 Reason = 0; Reason < hvpp::vmexit_stats_attribution_t::exit_reason_count; ++Reason)
+          {
+            for (UINT32 RipIndex = 0; RipIndex < RipCount; ++RipIndex)
+            {
+              StatsTopInsert(Top, TopCount, Reason * RipCount + RipIndex, Attribution->rip[Reason][RipIndex].count);
+            }
+          }
+
+          printf("\nTop guest RIPs (total):\n");
+          for (int Index = 0; Index < TopCount && Top[Index].Count; ++Index)
+          {
+            const auto& Entry = Attribution->rip[Top[Index].Key / RipCount][Top[Index].Key % RipCount];
+            printf("  0x%016llx %-30s %10u\n",
+                   Entry.key,
+                   ia32::vmx::exit_reason_to_string(static_cast<ia32::vmx::exit_reason>(Top[Index].Key / RipCount)),
+                   Entry.count);
+          }
+        }
+
+        std::swap(Previous, Current);
+      }
+
+      //
+      // Memory pool of the hypervisor.
+      //
+      mm_statistics_t MmStatistics = {};
+      *(INT32*)&MmStatistics = -1;
+
+      if (DeviceIoControl(DeviceHandle,
+                          ioctl_query_mm_statistics_t::code,
+                          &MmStatistics,
+                          sizeof(MmStatistics),
+                          &MmStatistics,
+                          sizeof(MmStatistics),
+                          &BytesReturned,
+                          NULL))
+      {
+        const UINT64 PoolSize = MmStatistics.allocated_bytes + MmStatistics.free_bytes;
+
+        printf("\nMemory: %llu kb allocated (%.1f%% of %llu kb, peak %llu kb), %llu failures\n",
+               MmStatistics.allocated_bytes / 1024,
+               PoolSize ? 100.0 * MmStatistics.allocated_bytes / PoolSize : 0.0,
+               PoolSize / 1024,
+               MmStatistics.peak_allocated_bytes / 1024,
+               MmStatistics.failure_count);
+
+        printf("Host stack: %llu of %llu bytes used (highest of all CPUs)\n",
+               MmStatistics.host_stack_used,
+               MmStatistics.host_stack_size);
+
+        //
+        // Who uses the pool - memory in use per tag.
+        //
+        for (int Tag = 0; Tag < mm_statistics_t::tag_count; ++Tag)
+        {
+          if (MmStatistics.tag_allocation_count[Tag] == 0)
+          {
+            continue;
+          }
+
+          printf("  %-10s %10lld kb %10lld allocations (%.1f%%)\n",
+                 MmTagName[Tag],
+                 MmStatistics.tag_bytes[Tag] / 1024,
+                 MmStatistics.tag_allocation_count[Tag],
+                 MmStatistics.allocated_bytes ? 100.0 * MmStatistics.tag_bytes[Tag] / MmStatistics.allocated_bytes : 0.0);
+        }
+      }
+    }
+
+    while (_kbhit())
+    {
+      _getch();
+    }
+
+    SetConsoleMode(ConsoleHandle, ConsoleMode);
+  }
+
+  free(Timing);
+
+  if (SnapshotBuffer)
+  {
+    VirtualFree(SnapshotBuffer, 0, MEM_RELEASE);
+  }
+
+  DeviceIoControl(DeviceHandle,
+                  ioctl_unmap_stats_ring_t::code,
+                  NULL,
+                  0,
+                  NULL,
+                  0,
+                  &BytesReturned,
+                  NULL);
+
+  CloseHandle(DeviceHandle);
+}
+
+void TestPipelineMask(UINT32 StageIndex, bool Set, UINT64 MaskLow, UINT64 MaskHigh)
+{
+  HANDLE DeviceHandle;
+
+  DeviceHandle = CreateFile(TEXT("\\\\.\\hvpp"),
+                            GENERIC_READ | GENERIC_WRITE,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE,
+                            NULL,
+                            OPEN_EXISTING,
+                            0,
+                            NULL);
+
+  if (DeviceHandle == INVALID_HANDLE_VALUE)
+  {
+    printf("Error while opening 'hvpp' device!\n");
+    return;
+  }
+
+  pipeline_mask_request_t Request;
+  Request.stage_index = StageIndex;
+  Request.flags       = Set ? 1 : 0;
+  Request.mask[0]     = MaskLow;
+  Request.mask[1]     = MaskHigh;
+
+  DWORD BytesReturned;
+  if (!DeviceIoControl(DeviceHandle,
+                       ioctl_pipeline_mask_t::code,
+                       &Request,
+                       sizeof(Request),
+                       &Request,
+                       sizeof(Request),
+                       &BytesReturned,
+                       NULL))
+  {
+    printf("Error while setting the pipeline mask!\n");
+  }
+  else
+  {
+    printf("Stage %u: 0x%016llx'%016llx%s\n",
+           StageIndex, Request.mask[1], Request.mask[0], Set ? " (previous)" : "");
+  }
+
+  CloseHandle(DeviceHandle);
+}
+
+//
+// VM-exit microbenchmark.
+//
+// Each measured operation is executed SampleCount times on each logical
+// core (the thread is pinned by ForEachLogicalCore) and the TSC cycles
+// of each round trip are sorted into min/median/p99.  The "rdtscp" row
+// is the cost of the measurement itself.  IN/OUT and RDMSR can't be
+// executed at CPL 3 (#GP is raised before any VM-exit), therefore they
+// are measured by the driver (ioctl_measure_exit_t) on the same core.
+//
+// Output is one CSV line per core and operation:
+//   bench,<cpu>,<name>,<samples>,<min>,<median>,<p99>
+//
+
+struct BENCH_CONTEXT
+{
+  HANDLE  DeviceHandle;
+  UINT32  SampleCount;
+  UINT32* Samples;
+
+  //
+  // Page hidden by the EPT hook - reading it causes EPT violation
+  // (and MTF VM-exit after the read).
+  //
+  volatile UINT8* HiddenPage;
+};
+
+void BenchReport(BENCH_CONTEXT* Context, const char* Name, UINT32 SampleCount)
+{
+  if (SampleCount == 0)
+  {
+    printf("bench,%u,%s,0,,,\n", GetCurrentProcessorNumber(), Name);
+    return;
+  }
+
+  std::sort(Context->Samples, Context->Samples + SampleCount);
+
+  printf("bench,%u,%s,%u,%u,%u,%u\n",
+         GetCurrentProcessorNumber(),
+         Name,
+         SampleCount,
+         Context->Samples[0],
+         Context->Samples[SampleCount / 2],
+         Context->Samples[(UINT64)SampleCount * 99 / 100]);
+}
+
+template <typename FN>
+void BenchMeasure(BENCH_CONTEXT* Context, const char* Name, FN Function)
+{
+  static constexpr UINT32 WarmupCount = 16;
+
+  for (UINT32 Index = 0; Index < WarmupCount; ++Index)
+  {
+    Function();
+  }
+
+  for (UINT32 Index = 0; Index < Context->SampleCount; ++Index)
+  {
+    UINT32 Aux;
+    UINT64 Begin = ia32_asm_read_tscp(&Aux);
+    Function();
+    UINT64 End = ia32_asm_read_tscp(&Aux);
+
+    Context->Samples[Index] = (UINT32)(End - Begin);
+  }
+
+  BenchReport(Context, Name, Context->SampleCount);
+}
+
+void BenchMeasureKernel(BENCH_CONTEXT* Context, const char* Name, UINT32 Instruction, UINT32 Argument)
+{
+  measure_exit_request_t Request;
+  Request.instruction  = Instruction;
+  Request.argument     = Argument;
+  Request.sample_count = Context->SampleCount < measure_exit_request_t::max_sample_count
+    ? Context->SampleCount
+    : measure_exit_request_t::max_sample_count;
+  Request.reserved     = 0;
+
+  DWORD BytesReturned;
+  if (!DeviceIoControl(Context->DeviceHandle,
+                       ioctl_measure_exit_t::code,
+                       &Request,
+                       sizeof(Request),
+                       Context->Samples,
+                       Request.sample_count * sizeof(UINT32),
+                       &BytesReturned,
+                       NULL))
+  {
+    Request.sample_count = 0;
+  }
+
+  BenchReport(Context, Name, Request.sample_count);
+}
+
+void TestBenchmark(UINT32 SampleCount)
+{
+  if (SampleCount == 0)
+  {
+    SampleCount = 10000;
+  }
+
+  BENCH_CONTEXT Context;
+  Context.SampleCount = SampleCount;
+  Context.Samples     = (UINT32*)malloc(SampleCount * sizeof(UINT32));
+  Context.HiddenPage  = NULL;
+
+  Context.DeviceHandle = CreateFile(TEXT("\\\\.\\hvpp"),
+                                    GENERIC_READ | GENERIC_WRITE,
+                                    FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                    NULL,
+                                    OPEN_EXISTING,
+                                    0,
+                                    NULL);
+
+  if (Context.DeviceHandle == INVALID_HANDLE_VALUE)
+  {
+    printf("Error while opening 'hvpp' device!\n");
+    free(Context.Samples);
+    return;
+  }
+
+  //
+  // Two pages: the first one is hidden (execute-only), reads of it are
+  // redirected to the second one.  See TestHook().
+  //
+  PVOID Pages = VirtualAlloc(NULL, PAGE_SIZE * 2, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+  if (Pages && VirtualLock(Pages, PAGE_SIZE * 2))
+  {
+    memset(Pages, 0xcc, PAGE_SIZE * 2);
+
+    struct REQUEST
+    {
+      hypercall::header_t Header;
+      hypercall::operation_t Operation[1];
+    } Request{};
+
+    Request.Header.signature = hypercall::batch_signature;
+    Request.Header.operation_count = 1;
+
+    Request.Operation[0].type = hypercall::operation_type::hook;
+    Request.Operation[0].argument[0] = (uint64_t)Pages;
+    Request.Operation[0].argument[1] = (uint64_t)Pages + PAGE_SIZE;
+
+    ForEachLogicalCore([](void* ContextPtr) {
+      ia32_asm_vmx_vmcall(hypercall::batch_id, (uint64_t)ContextPtr, sizeof(REQUEST), 0);
+    }, &Request);
+
+    if (Request.Operation[0].status == hypercall::status_code::success)
+    {
+      Context.HiddenPage = (volatile UINT8*)Pages;
+    }
+  }
+
+  printf("bench,cpu,name,samples,min,median,p99\n");
+
+  ForEachLogicalCore([](void* ContextPtr) {
+    auto Context = (BENCH_CONTEXT*)ContextPtr;
+
+    BenchMeasure(Context, "rdtscp", []() {});
+
+    BenchMeasure(Context, "cpuid_ppvh", []() {
+      uint32_t CpuInfo[4];
+      ia32_asm_cpuid(CpuInfo, 'ppvh');
+    });
+
+    //
+    // Leaf 0xD is never served from the CPUID cache (see cpuid_policy),
+    // leaf 0 usually is.
+    //
+    BenchMeasure(Context, "cpuid_passthrough", []() {
+      uint32_t CpuInfo[4];
+      ia32_asm_cpuid_ex(CpuInfo, 0xd, 0);
+    });
+
+    BenchMeasure(Context, "cpuid_cached", []() {
+      uint32_t CpuInfo[4];
+      ia32_asm_cpuid(CpuInfo, 0);
+    });
+
+    BenchMeasure(Context, "vmcall", []() {
+      ia32_asm_vmx_vmcall(0xc4, 0, 0, 0);
+    });
+
+    BenchMeasure(Context, "vmcall_batch", []() {
+      struct REQUEST
+      {
+        hypercall::header_t Header;
+        hypercall::operation_t Operation[1];
+      } Request{};
+
+      Request.Header.signature = hypercall::batch_signature;
+      Request.Header.operation_count = 1;
+      Request.Operation[0].type = hypercall::operation_type::stats_query;
+      Request.Operation[0].argument[0] = (uint64_t)hypercall::stats_id::hook_count;
+
+      ia32_asm_vmx_vmcall(hypercall::batch_id, (uint64_t)&Request, sizeof(Request), 0);
+    });
+
+    if (Context->HiddenPage)
+    {
+      BenchMeasure(Context, "ept_hook_read", [Context]() {
+        (void)Context->HiddenPage[0];
+      });
+    }
+
+    //
+    // Cheapest IOCTL - query of the pipeline mask (no logging).
+    //
+    BenchMeasure(Context, "ioctl", [Context]() {
+      pipeline_mask_request_t Request{};
+      DWORD BytesReturned;
+      DeviceIoControl(Context->DeviceHandle,
+                      ioctl_pipeline_mask_t::code,
+                      &Request,
+                      sizeof(Request),
+                      &Request,
+                      sizeof(Request),
+                      &BytesReturned,
+                      NULL);
+    });
+
+    BenchMeasureKernel(Context, "io_in_0x64",   measure_exit_request_t::instruction_in,    0x64);
+    BenchMeasureKernel(Context, "io_out_0x80",  measure_exit_request_t::instruction_out,   0x80);
+    BenchMeasureKernel(Context, "rdmsr_0x1b",   measure_exit_request_t::instruction_rdmsr, 0x1b);
+  }, &Context);
+
+  if (Context.HiddenPage)
+  {
+    ForEachLogicalCore([](void*) { ia32_asm_vmx_vmcall(0xc2, 0, 0, 0); }, nullptr);
+  }
+
+  if (Pages)
+  {
+    VirtualUnlock(Pages, PAGE_SIZE * 2);
+    VirtualFree(Pages, 0, MEM_RELEASE);
+  }
+
+  CloseHandle(Context.DeviceHandle);
+  free(Context.Samples);
+}
+
+//
+// VM-exit storm - scalability benchmark.
+//
+// ThreadCount threads (each pinned to its own logical core) execute
+// the mix of VM-exit causing instructions at once for DurationMs
+// milliseconds.  Latencies are collected into the same log2 histograms
+// as the driver uses (see vcpu_exit_timing_t - bucket N counts round
+// trips which took [2^N, 2^(N+1)) TSC ticks), so that they can be
+// compared with the driver-side histograms of the same run (available
+// when the driver is built with HVPP_ENABLE_EXIT_TIMING).  Contention
+// in the hypervisor (e.g. on the mm lock or shared handler state) shows
+// as the throughput not scaling with ThreadCount and as the tail moving
+// to higher buckets.
+//
+// Mix is a string of operations executed in round-robin:
+//   c - CPUID 'ppvh'
+//   p - CPUID passthrough (leaf 0xD)
+//   v - VMCALL (hook sync)
+//   b - VMCALL batch (single stats query)
+//
+// Output (CSV):
+//   storm,<threads>,<duration-ms>,<mix>
+//   op,<name>,<count>,<ops-per-sec>,<p50>,<p99>,<p999>
+//   cpu,<core>,<count>,<ops-per-sec>
+//   hist,user,<name>,<bucket>,<count>
+//   hist,driver,<exit-reason>,<bucket>,<count>
+//
+
+static constexpr int StormBucketCount = vcpu_exit_timing_t::bucket_count;
+static constexpr int StormMaxMixLength = 32;
+
+struct STORM_OPERATION
+{
+  char        Letter;
+  const char* Name;
+  ia32::vmx::exit_reason ExitReason;
+  void      (*Function)();
+};
+
+static const STORM_OPERATION StormOperation[] = {
+  { 'c', "cpuid_ppvh",        ia32::vmx::exit_reason::execute_cpuid,
+    []() { uint32_t CpuInfo[4]; ia32_asm_cpuid(CpuInfo, 'ppvh'); } },
+
+  { 'p', "cpuid_passthrough", ia32::vmx::exit_reason::execute_cpuid,
+    []() { uint32_t CpuInfo[4]; ia32_asm_cpuid_ex(CpuInfo, 0xd, 0); } },
+
+  { 'v', "vmcall",            ia32::vmx::exit_reason::execute_vmcall,
+    []() { ia32_asm_vmx_vmcall(0xc4, 0, 0, 0); } },
+
+  { 'b', "vmcall_batch",      ia32::vmx::exit_reason::execute_vmcall,
+    []() {
+      struct REQUEST
+      {
+        hypercall::header_t Header;
+        hypercall::operation_t Operation[1];
+      } Request{};
+
+      Request.Header.signature = hypercall::batch_signature;
+      Request.Header.operation_count = 1;
+      Request.Operation[0].type = hypercall::operation_type::stats_query;
+      Request.Operation[0].argument[0] = (uint64_t)hypercall::stats_id::hook_count;
+
+      ia32_asm_vmx_vmcall(hypercall::batch_id, (uint64_t)&Request, sizeof(Request), 0);
+    } },
+};
+
+static constexpr int StormOperationCount = ARRAYSIZE(StormOperation);
+
+struct STORM_CONTEXT
+{
+  int           Mix[StormMaxMixLength];
+  int           MixLength;
+
+  volatile LONG ReadyCount;
+  volatile LONG Start;
+  volatile LONG Stop;
+};
+
+struct STORM_THREAD
+{
+  STORM_CONTEXT* Storm;
+  DWORD          CoreIndex;
+  HANDLE         ThreadHandle;
+
+  UINT64         Count[StormOperationCount];
+  UINT32         Histogram[StormOperationCount][StormBucketCount];
+};
+
+int StormBucket(UINT64 Ticks)
+{
+  DWORD Index;
+  if (!_BitScanReverse64(&Index, Ticks))
+  {
+    return 0;
+  }
+
+  return Index < StormBucketCount
+    ? (int)Index
+    : StormBucketCount - 1;
+}
+
+//
+// Upper bound of the bucket in which the percentile (0.0 - 1.0) falls.
+//
+UINT64 StormPercentile(const UINT64* Histogram, UINT64 Count, double Percentile)
+{
+  UINT64 Threshold = (UINT64)(Count * Percentile);
+  UINT64 Sum = 0;
+
+  for (int Bucket = 0; Bucket < StormBucketCount; ++Bucket)
+  {
+    Sum += Histogram[Bucket];
+    if (Sum > Threshold)
+    {
+      return 1ull << (Bucket + 1);
+    }
+  }
+
+  return 1ull << StormBucketCount;
+}
+
+DWORD WINAPI StormThreadRoutine(LPVOID Parameter)
+{
+  auto Thread = (STORM_THREAD*)Parameter;
+  auto Storm  = Thread->Storm;
+
+  SetThreadLogicalCore(GetCurrentThread(), Thread->CoreIndex);
+
+  InterlockedIncrement(&Storm->ReadyCount);
+
+  while (!Storm->Start)
+  {
+    YieldProcessor();
+  }
+
+  while (!Storm->Stop)
+  {
+    for (int MixIndex = 0; MixIndex < Storm->MixLength; ++MixIndex)
+    {
+      const int Operation = Storm->Mix[MixIndex];
+
+      UINT32 Aux;
+      UINT64 Begin = ia32_asm_read_tscp(&Aux);
+      StormOperation[Operation].Function();
+      UINT64 End = ia32_asm_read_tscp(&Aux);
+
+      Thread->Count[Operation] += 1;
+      Thread->Histogram[Operation][StormBucket(End - Begin)] += 1;
+    }
+  }
+
+  return 0;
+}
+
+//
+// Sum of the driver-side histograms (whole VM-exit) of all cores.
+// Returns false if the driver doesn't collect them.
+//
+bool StormQueryExitTiming(HANDLE DeviceHandle, DWORD CoreCount, vcpu_exit_timing_t* Result)
+{
+  auto Timing = (vcpu_exit_timing_t*)malloc(sizeof(vcpu_exit_timing_t));
+  memset(Result, 0, sizeof(*Result));
+
+  bool Success = Timing != NULL;
+
+  for (DWORD CoreIndex = 0; Success && CoreIndex < CoreCount; ++CoreIndex)
+  {
+    *(UINT32*)Timing = CoreIndex;
+
+    DWORD BytesReturned;
+    if (!DeviceIoControl(DeviceHandle,
+                         ioctl_query_exit_timing_t::code,
+                         Timing,
+                         sizeof(*Timing),
+                         Timing,
+                         sizeof(*Timing),
+                         &BytesReturned,
+                         NULL))
+    {
+      Success = false;
+      break;
+    }
+
+    for (int Reason = 0; Reason < vcpu_exit_timing_t::exit_reason_count; ++Reason)
+    {
+      for (int Bucket = 0; Bucket < StormBucketCount; ++Bucket)
+      {
+        Result->total[Reason][Bucket] += Timing->total[Reason][Bucket];
+      }
+    }
+  }
+
+  free(Timing);
+  return Success;
+}
+
+void TestStorm(DWORD ThreadCount, DWORD DurationMs, const char* Mix)
+{
+  STORM_CONTEXT Storm = {};
+
+  for (const char* Letter = Mix; *Letter && Storm.MixLength < StormMaxMixLength; ++Letter)
+  {
+    for (int Operation = 0; Operation < StormOperationCount; ++Operation)
+    {
+      if (StormOperation[Operation].Letter == *Letter)
+      {
+        Storm.Mix[Storm.MixLength++] = Operation;
+        break;
+      }
+    }
+  }
+
+  if (Storm.MixLength == 0)
+  {
+    printf("Invalid mix '%s'!\n", Mix);
+    return;
+  }
+
+  const DWORD CoreCount = GetLogicalCoreCount();
+
+  if (ThreadCount == 0 || ThreadCount > CoreCount)
+  {
+    ThreadCount = CoreCount;
+  }
+
+  HANDLE DeviceHandle = CreateFile(TEXT("\\\\.\\hvpp"),
+                                   GENERIC_READ | GENERIC_WRITE,
+                                   FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                   NULL,
+                                   OPEN_EXISTING,
+                                   0,
+                                   NULL);
+
+  auto TimingBefore = (vcpu_exit_timing_t*)malloc(sizeof(vcpu_exit_timing_t));
+  auto TimingAfter  = (vcpu_exit_timing_t*)malloc(sizeof(vcpu_exit_timing_t));
+  auto Thread       = (STORM_THREAD*)calloc(ThreadCount, sizeof(STORM_THREAD));
+
+  bool HasTiming = DeviceHandle != INVALID_HANDLE_VALUE && TimingBefore && TimingAfter &&
+                   StormQueryExitTiming(DeviceHandle, CoreCount, TimingBefore);
+
+  DWORD CreatedCount = 0;
+  for (; Thread && CreatedCount < ThreadCount; ++CreatedCount)
+  {
+    Thread[CreatedCount].Storm = &Storm;
+    Thread[CreatedCount].CoreIndex = CreatedCount;
+    Thread[CreatedCount].ThreadHandle = CreateThread(NULL, 0, &StormThreadRoutine, &Thread[CreatedCount], 0, NULL);
+
+    if (!Thread[CreatedCount].ThreadHandle)
+    {
+      break;
+    }
+  }
+
+  //
+  // Start all threads at once, after they've been pinned.
+  //
+  while (Storm.ReadyCount != (LONG)CreatedCount)
+  {
+    Sleep(1);
+  }
+
+  LARGE_INTEGER Frequency, StartTime, StopTime;
+  QueryPerformanceFrequency(&Frequency);
+  QueryPerformanceCounter(&StartTime);
+
+  InterlockedExchange(&Storm.Start, 1);
+  Sleep(DurationMs);
+  InterlockedExchange(&Storm.Stop, 1);
+
+  for (DWORD Index = 0; Index < CreatedCount; ++Index)
+  {
+    WaitForSingleObject(Thread[Index].ThreadHandle, INFINITE);
+    CloseHandle(Thread[Index].ThreadHandle);
+  }
+
+  QueryPerformanceCounter(&StopTime);
+
+  HasTiming = HasTiming && StormQueryExitTiming(DeviceHandle, CoreCount, TimingAfter);
+
+  const double Seconds = (double)(StopTime.QuadPart - StartTime.QuadPart) / Frequency.QuadPart;
+
+  printf("storm,%u,%u,%s\n", CreatedCount, DurationMs, Mix);
+
+  //
+  // Aggregate per operation.
+  //
+  for (int Operation = 0; Operation < StormOperationCount; ++Operation)
+  {
+    UINT64 Histogram[StormBucketCount] = {};
+    UINT64 Count = 0;
+
+    for (DWORD Index = 0; Index < CreatedCount; ++Index)
+    {
+      Count += Thread[Index].Count[Operation];
+
+      for (int Bucket = 0; Bucket < StormBucketCount; ++Bucket)
+      {
+        Histogram[Bucket] += Thread[Index].Histogram[Operation][Bucket];
+      }
+    }
+
+    if (Count == 0)
+    {
+      continue;
+    }
+
+    printf("op,%s,%llu,%.0f,%llu,%llu,%llu\n",
+           StormOperation[Operation].Name,
+           Count,
+           Count / Seconds,
+           StormPercentile(Histogram, Count, 0.50),
+           StormPercentile(Histogram, Count, 0.99),
+           StormPercentile(Histogram, Count, 0.999));
+
+    for (int Bucket = 0; Bucket < StormBucketCount; ++Bucket)
+    {
+      if (Histogram[Bucket])
+      {
+        printf("hist,user,%s,%i,%llu\n", StormOperation[Operation].Name, Bucket, Histogram[Bucket]);
+      }
+    }
+  }
+
+  for (DWORD Index = 0; Index < CreatedCount; ++Index)
+  {
+    UINT64 Count = 0;
+    for (int Operation = 0; Operation < StormOperationCount; ++Operation)
+    {
+      Count += Thread[Index].Count[Operation];
+    }
+
+    printf("cpu,%u,%llu,%.0f\n", Thread[Index].CoreIndex, Count, Count / Seconds);
+  }
+
+  //
+  // Driver-side histograms of the exit reasons used by the mix (delta
+  // over the run - includes VM-exits of other processes).
+  //
+  if (HasTiming)
+  {
+    for (int Reason = 0; Reason < vcpu_exit_timing_t::exit_reason_count; ++Reason)
+    {
+      bool IsUsed = false;
+      for (int MixIndex = 0; MixIndex < Storm.MixLength; ++MixIndex)
+      {
+        IsUsed |= (int)StormOperation[Storm.Mix[MixIndex]].ExitReason == Reason;
+      }
+
+      for (int Bucket = 0; IsUsed && Bucket < StormBucketCount; ++Bucket)
+      {
+        const UINT32 Delta = TimingAfter->total[Reason][Bucket] - TimingBefore->total[Reason][Bucket];
+
+        if (Delta)
+        {
+          printf("hist,driver,%s,%i,%u\n",
+                 ia32::vmx::exit_reason_to_string(static_cast<ia32::vmx::exit_reason>(Reason)),
+                 Bucket,
+                 Delta);
+        }
+      }
+    }
+  }
+
+  free(Thread);
+  free(TimingAfter);
+  free(TimingBefore);
+
+  if (DeviceHandle != INVALID_HANDLE_VALUE)
+  {
+    CloseHandle(DeviceHandle);
+  }
+}
+
+//
+// Self-benchmark of the hypervisor primitives (only in the driver
+// built with HVPP_ENABLE_SELF_BENCHMARK).
+//
+// Output (CSV):
+//   selfbench,<cpu>,<primitive>,<iterations>,<min>,<avg>,<max>
+//
+void TestSelfBenchmark(UINT32 IterationCount)
+{
+  static const char* PrimitiveName[self_benchmark_t::primitive_count] = {
+    "mm_allocate",
+    "mm_allocate_page",
+    "ept_map_identity",
+    "ept_split_2mb_to_4kb",
+    "bitmap_find_first_clear",
+    "bitmap_find_first_clear_16",
+    "mtrr_type",
+  };
+
+  HANDLE DeviceHandle;
+
+  DeviceHandle = CreateFile(TEXT("\\\\.\\hvpp"),
+                            GENERIC_READ | GENERIC_WRITE,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE,
+                            NULL,
+                            OPEN_EXISTING,
+                            0,
+                            NULL);
+
+  if (DeviceHandle == INVALID_HANDLE_VALUE)
+  {
+    printf("Error while opening 'hvpp' device!\n");
+    return;
+  }
+
+  self_benchmark_t Benchmark = {};
+  Benchmark.iteration_count = IterationCount ? IterationCount : 1000;
+
+  DWORD BytesReturned;
+  if (!DeviceIoControl(DeviceHandle,
+                       ioctl_self_benchmark_t::code,
+                       &Benchmark,
+                       sizeof(Benchmark),
+                       &Benchmark,
+                       sizeof(Benchmark),
+                       &BytesReturned,
+                       NULL))
+  {
+    printf("Error while running the self-benchmark (is HVPP_ENABLE_SELF_BENCHMARK defined?)\n");
+    CloseHandle(DeviceHandle);
+    return;
+  }
+
+  printf("selfbench,cpu,primitive,iterations,min,avg,max\n");
+
+  for (UINT32 Index = 0; Index < self_benchmark_t::primitive_count; ++Index)
+  {
+    const auto& Result = Benchmark.result[Index];
+
+    printf("selfbench,%u,%s,%u,%llu,%llu,%llu\n",
+           Benchmark.cpu_index,
+           PrimitiveName[Index],
+           Result.iteration_count,
+           Result.min_ticks,
+           Result.iteration_count ? Result.total_ticks / Result.iteration_count : 0,
+           Result.max_ticks);
+  }
+
+  CloseHandle(DeviceHandle);
+}
+
+//
+// Samples the working set of the guest - pages accessed since the
+// previous pass (EPT accessed flags, see hvpp::hypervisor::access_bitmap_collect()).
+// Sampling causes no VM-exits; the driver clears the flags on each pass.
+//
+// Output (CSV):
+//   access,<pass>,<accessed-pages>,<runs>,<working-set-pages>
+//
+// "runs" is the number of contiguous ranges of accessed pages (i.e. size
+// of the run-length encoded bitmap), "working-set-pages" is the number
+// of pages accessed in any of the passes so far.
+//
+void TestAccessTrace(DWORD IntervalMs, DWORD PassCount)
+{
+  HANDLE DeviceHandle;
+
+  DeviceHandle = CreateFile(TEXT("\\\\.\\hvpp"),
+                            GENERIC_READ | GENERIC_WRITE,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE,
+                            NULL,
+                            OPEN_EXISTING,
+                            0,
+                            NULL);
+
+  if (DeviceHandle == INVALID_HANDLE_VALUE)
+  {
+    printf("Error while opening 'hvpp' device!\n");
+    return;
+  }
+
+  //
+  // One bit per 4kb page.  Physical addresses go above the installed
+  // memory (PCI hole), therefore reserve 4GB more.
+  //
+  ULONGLONG InstalledMemoryKb = 0;
+  GetPhysicallyInstalledSystemMemory(&InstalledMemoryKb);
+
+  const SIZE_T PageCount = (SIZE_T)((InstalledMemoryKb * 1024 + (4ull << 30)) / PAGE_SIZE);
+  const SIZE_T BitmapSize = (PageCount / 8 + sizeof(UINT64) - 1) & ~(sizeof(UINT64) - 1);
+
+  auto Bitmap     = (UINT64*)VirtualAlloc(NULL, BitmapSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  auto WorkingSet = (UINT64*)VirtualAlloc(NULL, BitmapSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+  if (!Bitmap || !WorkingSet)
+  {
+    if (Bitmap)     VirtualFree(Bitmap, 0, MEM_RELEASE);
+    if (WorkingSet) VirtualFree(WorkingSet, 0, MEM_RELEASE);
+    CloseHandle(DeviceHandle);
+    return;
+  }
+
+  if (!IntervalMs) IntervalMs = 1000;
+  if (!PassCount)  PassCount = 10;
+
+  printf("access,pass,accessed_pages,runs,working_set_pages\n");
+
+  //
+  // Pass 0 only clears the accessed flags set before the first interval.
+  //
+  for (DWORD Pass = 0; Pass <= PassCount; ++Pass)
+  {
+    if (Pass)
+    {
+      Sleep(IntervalMs);
+    }
+
+    DWORD BytesReturned;
+    if (!DeviceIoControl(DeviceHandle,
+                         ioctl_collect_access_bitmap_t::code,
+                         NULL,
+                         0,
+                         Bitmap,
+                         (DWORD)BitmapSize,
+                         &BytesReturned,
+                         NULL))
+    {
+      printf("Error while collecting the access bitmap (is access tracking supported?)\n");
+      break;
+    }
+
+    if (!Pass)
+    {
+      continue;
+    }
+
+    UINT64 AccessedCount = 0;
+    UINT64 RunCount = 0;
+    UINT64 WorkingSetCount = 0;
+    UINT64 PreviousBit = 0;
+
+    for (SIZE_T Index = 0; Index < BitmapSize / sizeof(UINT64); ++Index)
+    {
+      const UINT64 Value = Bitmap[Index];
+
+      //
+      // Run begins on each 0 -> 1 transition (including the one between
+      // two words).
+      //
+      const UINT64 Begins = Value & ~((Value << 1) | PreviousBit);
+      PreviousBit = Value >> 63;
+
+      AccessedCount += __popcnt64(Value);
+      RunCount      += __popcnt64(Begins);
+
+      WorkingSet[Index] |= Value;
+      WorkingSetCount += __popcnt64(WorkingSet[Index]);
+    }
+
+    printf("access,%u,%llu,%llu,%llu\n",
+           Pass,
+           AccessedCount,
+           RunCount,
+           WorkingSetCount);
+  }
+
+  VirtualFree(Bitmap, 0, MEM_RELEASE);
+  VirtualFree(WorkingSet, 0, MEM_RELEASE);
+  CloseHandle(DeviceHandle);
+}
+
+//
+// Streams a snapshot of the guest physical memory into the file - the
+// full snapshot first, followed by "IncrementalCount" incremental ones
+// (pages written since the previous snapshot, requires dirty tracking)
+// taken each "IntervalMs".  Pages are copied by the driver into the
+// mapped chunk (see snapshot_chunk.h), 4MB per IOCTL.
+//
+// File format - sequence of records:
+//   uint64_t pfn;
+//   uint8_t  page[4096];
+// Records of the snapshot N+1 follow the records of the snapshot N -
+// replaying the file in order restores the memory of the last one.
+//
+// Output (CSV):
+//   snapshot,<sequence>,<pages>,<milliseconds>
+//
+void TestSnapshot(const char* FileName, DWORD IncrementalCount, DWORD IntervalMs)
+{
+  HANDLE DeviceHandle;
+
+  DeviceHandle = CreateFile(TEXT("\\\\.\\hvpp"),
+                            GENERIC_READ | GENERIC_WRITE,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE,
+                            NULL,
+                            OPEN_EXISTING,
+                            0,
+                            NULL);
+
+  if (DeviceHandle == INVALID_HANDLE_VALUE)
+  {
+    printf("Error while opening 'hvpp' device!\n");
+    return;
+  }
+
+  HANDLE FileHandle = CreateFileA(FileName,
+                                  GENERIC_WRITE,
+                                  0,
+                                  NULL,
+                                  CREATE_ALWAYS,
+                                  FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                                  NULL);
+
+  if (FileHandle == INVALID_HANDLE_VALUE)
+  {
+    printf("Error while creating '%s'!\n", FileName);
+    CloseHandle(DeviceHandle);
+    return;
+  }
+
+  UINT64 ChunkAddress = 0;
+  DWORD BytesReturned;
+
+  if (!DeviceIoControl(DeviceHandle,
+                       ioctl_map_snapshot_t::code,
+                       &ChunkAddress,
+                       sizeof(ChunkAddress),
+                       &ChunkAddress,
+                       sizeof(ChunkAddress),
+                       &BytesReturned,
+                       NULL))
+  {
+    printf("Error while mapping the snapshot chunk!\n");
+    CloseHandle(FileHandle);
+    CloseHandle(DeviceHandle);
+    return;
+  }
+
+  auto Chunk = (const snapshot::chunk_t*)ChunkAddress;
+  bool Valid = Chunk->signature == snapshot::chunk_t::chunk_signature;
+
+  if (!Valid)
+  {
+    printf("Invalid signature of the snapshot chunk!\n");
+  }
+  else
+  {
+    printf("snapshot,sequence,pages,ms\n");
+  }
+
+  for (DWORD Pass = 0; Valid && Pass <= IncrementalCount; ++Pass)
+  {
+    if (Pass)
+    {
+      Sleep(IntervalMs ? IntervalMs : 1000);
+    }
+
+    const ULONGLONG StartTime = GetTickCount64();
+
+    snapshot::request_t Request = {};
+    Request.command = Pass
+      ? snapshot::request_t::command_begin_incremental
+      : snapshot::request_t::command_begin_full;
+
+    if (!DeviceIoControl(DeviceHandle,
+                         ioctl_snapshot_t::code,
+                         &Request,
+                         sizeof(Request),
+                         &Request,
+                         sizeof(Request),
+                         &BytesReturned,
+                         NULL))
+    {
+      printf("Error while beginning the snapshot (is dirty tracking enabled?)\n");
+      break;
+    }
+
+    UINT64 PageCount = 0;
+
+    for (;;)
+    {
+      Request.command = snapshot::request_t::command_next;
+
+      if (!DeviceIoControl(DeviceHandle,
+                           ioctl_snapshot_t::code,
+                           &Request,
+                           sizeof(Request),
+                           &Request,
+                           sizeof(Request),
+                           &BytesReturned,
+                           NULL) || !Request.page_count)
+      {
+        break;
+      }
+
+      for (UINT32 Index = 0; Index < Request.page_count; ++Index)
+      {
+        DWORD BytesWritten;
+        WriteFile(FileHandle, &Chunk->pfn[Index], sizeof(Chunk->pfn[Index]), &BytesWritten, NULL);
+        WriteFile(FileHandle, Chunk->page[Index], sizeof(Chunk->page[Index]), &BytesWritten, NULL);
+      }
+
+      PageCount += Request.page_count;
+    }
+
+    printf("snapshot,%llu,%llu,%llu\n",
+           Chunk->sequence,
+           PageCount,
+           GetTickCount64() - StartTime);
+  }
+
+  DeviceIoControl(DeviceHandle,
+                  ioctl_unmap_snapshot_t::code,
+                  NULL,
+                  0,
+                  NULL,
+                  0,
+                  &BytesReturned,
+                  NULL);
+
+  CloseHandle(FileHandle);
+  CloseHandle(DeviceHandle);
+}
+
+//
+// Record VM-exits into the replay file (see hvpp/lib/exit_record.h and
+// vmexit_recorder_handler) for Seconds seconds.
+//
+// The recorder stage of the pipeline is enabled for all VM-exit reasons
+// while recording and disabled again afterwards.  Records are streamed
+// through the event channel - each VM-exit arrives as part_count
+// consecutive event records, which are reassembled here.
+//
+// The file can be replayed by "hvppbench replay <file>".
+//
+void TestRecord(const char* FileName, UINT32 Seconds)
+{
+  using namespace exit_record;
+
+  //
+  // See hvppdrv/main.cpp (index of vmexit_recorder_handler in the
+  // pipeline).
+  //
+  static constexpr UINT32 RecorderStageIndex = 3;
+
+  HANDLE DeviceHandle;
+
+  DeviceHandle = CreateFile(TEXT("\\\\.\\hvpp"),
+                            GENERIC_READ | GENERIC_WRITE,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE,
+                            NULL,
+                            OPEN_EXISTING,
+                            0,
+                            NULL);
+
+  if (DeviceHandle == INVALID_HANDLE_VALUE)
+  {
+    printf("Error while opening 'hvpp' device!\n");
+    return;
+  }
+
+  HANDLE FileHandle = CreateFileA(FileName,
+                                  GENERIC_WRITE,
+                                  0,
+                                  NULL,
+                                  CREATE_ALWAYS,
+                                  FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                                  NULL);
+
+  if (FileHandle == INVALID_HANDLE_VALUE)
+  {
+    printf("Error while creating '%s'!\n", FileName);
+    CloseHandle(DeviceHandle);
+    return;
+  }
+
+  //
+  // Map the event channel first - the recorder posts nothing while
+  // nobody is attached.
+  //
+
+  HANDLE EventHandle = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+  UINT64 ChannelAddress = (UINT64)EventHandle;
+  DWORD BytesReturned;
+  if (!DeviceIoControl(DeviceHandle,
+                       ioctl_map_event_channel_t::code,
+                       &ChannelAddress,
+                       sizeof(ChannelAddress),
+                       &ChannelAddress,
+                       sizeof(ChannelAddress),
+                       &BytesReturned,
+                       NULL) || !ChannelAddress)
+  {
+    printf("Error while mapping the event channel!\n");
+    CloseHandle(EventHandle);
+    CloseHandle(FileHandle);
+    CloseHandle(DeviceHandle);
+    return;
+  }
+
+  auto Channel = (volatile event_channel::ring_t*)ChannelAddress;
+
+  auto SetRecorderMask = [&](UINT64 Mask) {
+    pipeline_mask_request_t Request;
+    Request.stage_index = RecorderStageIndex;
+    Request.flags       = 1;
+    Request.mask[0]     = Mask;
+    Request.mask[1]     = Mask;
+
+    return !!DeviceIoControl(DeviceHandle,
+                             ioctl_pipeline_mask_t::code,
+                             &Request,
+                             sizeof(Request),
+                             &Request,
+                             sizeof(Request),
+                             &BytesReturned,
+                             NULL);
+  };
+
+  if (Channel->signature != event_channel::ring_t::ring_signature)
+  {
+    printf("Invalid event channel signature!\n");
+  }
+  else if (!SetRecorderMask(~0ull))
+  {
+    printf("Error while enabling the recorder stage!\n");
+  }
+  else
+  {
+    //
+    // Placeholder of the header - it's rewritten when the recording is
+    // finished.
+    //
+    file_header_t Header = {};
+    Header.signature     = file_header_t::file_signature;
+    Header.version       = file_header_t::file_version;
+    Header.record_size   = sizeof(record_t);
+    Header.cpu_count     = Channel->cpu_count;
+    Header.record_offset = sizeof(file_header_t);
+
+    DWORD BytesWritten;
+    WriteFile(FileHandle, &Header, sizeof(Header), &BytesWritten, NULL);
+
+    std::vector<index_entry_t> Index;
+
+    const UINT32 CpuCount = Channel->cpu_count;
+    const ULONGLONG EndTime = GetTickCount64() + UINT64(Seconds ? Seconds : 5) * 1000;
+
+    printf("Recording into '%s'...\n", FileName);
+
+    while (GetTickCount64() < EndTime)
+    {
+      bool Received = false;
+
+      for (UINT32 CpuIndex = 0; CpuIndex < CpuCount; ++CpuIndex)
+      {
+        auto& CpuRing = Channel->cpu[CpuIndex];
+        const UINT64 Head = CpuRing.head;
+        UINT64 Tail = CpuRing.tail;
+
+        while (Tail < Head)
+        {
+          auto& First = CpuRing.record[Tail % event_channel::cpu_ring_t::record_count];
+
+          if (First.type != event_channel::event_type::exit_record || First.part != 0)
+          {
+            //
+            // Other events (or a record the previous consumer left
+            // unfinished) - skip.
+            //
+            Tail += 1;
+            continue;
+          }
+
+          //
+          // All parts of the record are published at once (see
+          // event_channel::post_multi()).
+          //
+          record_t Record;
+          auto RecordBytes = (uint8_t*)&Record;
+
+          for (UINT32 Part = 0; Part < part_count; ++Part)
+          {
+            auto& EventRecord = CpuRing.record[(Tail + Part) % event_channel::cpu_ring_t::record_count];
+            memcpy(RecordBytes + Part * part_size, (const void*)EventRecord.data, part_size);
+          }
+
+          Tail += part_count;
+
+          if (Header.record_count % file_header_t::index_interval == 0)
+          {
+            Index.push_back(index_entry_t{ Record.timestamp, Header.record_count });
+          }
+
+          if (!Header.record_count)
+          {
+            Header.first_timestamp = Record.timestamp;
+          }
+
+          Header.first_timestamp = std::min(Header.first_timestamp, Record.timestamp);
+          Header.last_timestamp  = std::max(Header.last_timestamp,  Record.timestamp);
+          Header.record_count   += 1;
+
+          if (Record.exit_reason < file_header_t::exit_reason_count)
+          {
+            Header.exit_reason_record_count[Record.exit_reason] += 1;
+          }
+
+          WriteFile(FileHandle, &Record, sizeof(Record), &BytesWritten, NULL);
+        }
+
+        if (Tail != CpuRing.tail)
+        {
+          //
+          // Release the records back to the producer.
+          //
+          CpuRing.tail = Tail;
+          Received = true;
+        }
+      }
+
+      if (!Received)
+      {
+        Channel->waiting = 1;
+
+        bool Pending = false;
+        for (UINT32 CpuIndex = 0; CpuIndex < CpuCount; ++CpuIndex)
+        {
+          Pending |= Channel->cpu[CpuIndex].head != Channel->cpu[CpuIndex].tail;
+        }
+
+        if (!Pending)
+        {
+          WaitForSingleObject(EventHandle, 100);
+        }
+      }
+    }
+
+    SetRecorderMask(0);
+
+    for (UINT32 CpuIndex = 0; CpuIndex < CpuCount; ++CpuIndex)
+    {
+      Header.dropped_count += Channel->cpu[CpuIndex].dropped;
+    }
+
+    //
+    // Append the index and rewrite the header.
+    //
+    Header.index_offset = Header.record_offset + Header.record_count * sizeof(record_t);
+    Header.index_count  = Index.size();
+
+    if (!Index.empty())
+    {
+      WriteFile(FileHandle, Index.data(), DWORD(Index.size() * sizeof(index_entry_t)), &BytesWritten, NULL);
+    }
+
+    SetFilePointer(FileHandle, 0, NULL, FILE_BEGIN);
+    WriteFile(FileHandle, &Header, sizeof(Header), &BytesWritten, NULL);
+
+    printf("Recorded %llu VM-exits (%llu dropped)\n",
+           Header.record_count, Header.dropped_count);
+
+    for (UINT32 ExitReason = 0; ExitReason < file_header_t::exit_reason_count; ++ExitReason)
+    {
+      if (Header.exit_reason_record_count[ExitReason])
+      {
+        printf("  %-32s %llu\n",
+               ia32::vmx::exit_reason_to_string(static_cast<ia32::vmx::exit_reason>(ExitReason)),
+               Header.exit_reason_record_count[ExitReason]);
+      }
+    }
+  }
+
+  DeviceIoControl(DeviceHandle,
+                  ioctl_unmap_event_channel_t::code,
+                  NULL,
+                  0,
+                  NULL,
+                  0,
+                  &BytesReturned,
+                  NULL);
+
+  CloseHandle(EventHandle);
+  CloseHandle(FileHandle);
+  CloseHandle(DeviceHandle);
+}
+
+int main(int argc, char* argv[])
+{
+  //
+  // hvppctrl snapshot <file> [incremental-count] [interval-ms]
+  //
+  if (argc >= 3 && !strcmp(argv[1], "snapshot"))
+  {
+    TestSnapshot(argv[2],
+                 argc >= 4 ? strtoul(argv[3], nullptr, 0) : 0,
+                 argc >= 5 ? strtoul(argv[4], nullptr, 0) : 0);
+    return 0;
+  }
+
+  //
+  // hvppctrl access [interval-ms] [pass-count]
+  //
+  if (argc >= 2 && !strcmp(argv[1], "access"))
+  {
+    TestAccessTrace(argc >= 3 ? strtoul(argv[2], nullptr, 0) : 0,
+                    argc >= 4 ? strtoul(argv[3], nullptr, 0) : 0);
+    return 0;
+  }
+
+  //
+  // hvppctrl selfbench [iteration-count]
+  //
+  if (argc >= 2 && !strcmp(argv[1], "selfbench"))
+  {
+    TestSelfBenchmark(argc >= 3 ? strtoul(argv[2], nullptr, 0) : 0);
+    return 0;
+  }
+
+  //
+  // hvppctrl storm [thread-count] [duration-ms] [mix]
+  //   e.g. "hvppctrl storm 8 5000 ccv"
+  //
+  if (argc >= 2 && !strcmp(argv[1], "storm"))
+  {
+    TestStorm(argc >= 3 ? strtoul(argv[2], nullptr, 0) : 0,
+              argc >= 4 ? strtoul(argv[3], nullptr, 0) : 1000,
+              argc >= 5 ? argv[4] : "cv");
+    return 0;
+  }
+
+  //
+  // hvppctrl bench [sample-count]
+  //
+  if (argc >= 2 && !strcmp(argv[1], "bench"))
+  {
+    TestBenchmark(argc >= 3 ? strtoul(argv[2], nullptr, 0) : 0);
+    return 0;
+  }
+
+  //
+  // hvppctrl pipeline <stage> [<mask-high> <mask-low>]
+  //   e.g. "hvppctrl pipeline 0 0 0" disables the first stage
+  //
+  if (argc >= 3 && !strcmp(argv[1], "pipeline"))
+  {
+    TestPipelineMask(strtoul(argv[2], nullptr, 0),
+                     argc >= 5,
+                     argc >= 5 ? strtoull(argv[4], nullptr, 16) : 0,
+                     argc >= 5 ? strtoull(argv[3], nullptr, 16) : 0);
+    return 0;
+  }
+
+  //
+  // hvppctrl record <file> [seconds]
+  //
+  if (argc >= 3 && !strcmp(argv[1], "record"))
+  {
+    TestRecord(argv[2], argc >= 4 ? strtoul(argv[3], nullptr, 0) : 0);
+    return 0;
+  }
+
+  //
+  // hvppctrl top [top-count] [seconds]
+  //
+  if (argc >= 2 && !strcmp(argv[1], "top"))
+  {
+    TestTop(argc >= 3 ? atoi(argv[2]) : 10,
+            argc >= 4 ? strtoul(argv[3], nullptr, 0) : 0);
+    return 0;
+  }
+
+  //
+  // hvppctrl hookbatch [function-count]
+  //
+  if (argc >= 2 && !strcmp(argv[1], "hookbatch"))
+  {
+    TestHookBatch(argc >= 3 ? strtoul(argv[2], nullptr, 0) : 0);
+    return 0;
+  }
+
+  //
+  // hvppctrl stats [top-count] [reset]
+  //
+  if (argc >= 2 && !strcmp(argv[1], "stats"))
+  {
+    TestExitStats(argc >= 3 ? atoi(argv[2]) : 10,
+                  argc >= 4 && !strcmp(argv[3], "reset"));
+    return 0;
+  }
+
   TestCpuid();
   TestHook();
   TestIoControl();
+  TestStatsStream();
+  TestEventChannel();
+  TestEventChannelAsync();
 
   return 0;
 }
@@ -1,8 +1,15 @@
+#define HVPP_LOG_MODULE user
+
 #include "device_custom.h"
 
+#include <hvpp/hypervisor.h>
+#include <hvpp/ia32/asm.h>
 #include <hvpp/lib/assert.h>
 #include <hvpp/lib/debugger.h>
 #include <hvpp/lib/log.h>
+#include <hvpp/lib/mp.h>
+
+#include <cinttypes>
 
 auto device_custom::handler() noexcept -> hvpp::vmexit_dbgbreak_handler&
 {
@@ -14,6 +21,47 @@ void device_custom::handler(hvpp::vmexit_dbgbreak_handler& handler_instance) noe
   handler_ = &handler_instance;
 }
 
+void device_custom::stats_handler(hvpp::vmexit_stats_handler& handler_instance) noexcept
+{
+  stats_handler_ = &handler_instance;
+}
+
+void device_custom::pipeline(hvpp::vmexit_pipeline_mask& pipeline_masks) noexcept
+{
+  pipeline_masks_ = &pipeline_masks;
+}
+
+error_code_t device_custom::on_cleanup() noexcept
+{
+  //
+  // The process is closing the device - remove the mappings of the
+  // statistics ring, the event channel and the snapshot chunk while
+  // we're still in its context.  Mappings owned by other processes
+  // are kept (they can't be removed from here).
+  //
+  ioctl_unmap_snapshot();
+  ioctl_unmap_event_channel();
+  ioctl_unmap_stats_ring();
+
+  return error_code_t{};
+}
+
+int device_custom::on_ioctl_queue(uint32_t code) noexcept
+{
+  //
+  // Wait for the event channel is completed right away if there are
+  // unread events (or if the channel isn't mapped).
+  //
+  if (code == ioctl_wait_event_channel_t::code &&
+      event_channel_mapping_.address &&
+      event_channel::unread_count() == 0)
+  {
+    return event_channel_queue;
+  }
+
+  return -1;
+}
+
 error_code_t device_custom::on_ioctl(void* buffer, size_t buffer_size, uint32_t code) noexcept
 {
   switch (code)
@@ -21,6 +69,73 @@ error_code_t device_custom::on_ioctl(void* buffer, size_t buffer_size, uint32_t
     case ioctl_enable_io_debugbreak_t::code:
       return ioctl_enable_io_debugbreak(buffer, buffer_size);
 
+    case ioctl_query_mm_statistics_t::code:
+      return ioctl_query_mm_statistics(buffer, buffer_size);
+
+    case ioctl_map_stats_ring_t::code:
+      return ioctl_map_stats_ring(buffer, buffer_size);
+
+    case ioctl_unmap_stats_ring_t::code:
+      return ioctl_unmap_stats_ring();
+
+    case ioctl_query_exit_timing_t::code:
+      return ioctl_query_exit_timing(buffer, buffer_size);
+
+    case ioctl_query_exit_profile_t::code:
+      return ioctl_query_exit_profile(buffer, buffer_size);
+
+    case ioctl_map_event_channel_t::code:
+      return ioctl_map_event_channel(buffer, buffer_size);
+
+    case ioctl_unmap_event_channel_t::code:
+      return ioctl_unmap_event_channel();
+
+    case ioctl_wait_event_channel_t::code:
+      return ioctl_wait_event_channel(buffer, buffer_size);
+
+    case ioctl_pipeline_mask_t::code:
+      return ioctl_pipeline_mask(buffer, buffer_size);
+
+    case ioctl_self_benchmark_t::code:
+      return ioctl_self_benchmark(buffer, buffer_size);
+
+    case ioctl_map_snapshot_t::code:
+      return ioctl_map_snapshot(buffer, buffer_size);
+
+    case ioctl_unmap_snapshot_t::code:
+      return ioctl_unmap_snapshot();
+
+    case ioctl_snapshot_t::code:
+      return ioctl_snapshot(buffer, buffer_size);
+
+    default:
+      hvpp_assert(0);
+      return make_error_code_t(std::errc::invalid_argument);
+  }
+}
+
+error_code_t device_custom::on_ioctl_direct(void* buffer, size_t buffer_size,
+                                            void* direct_buffer, size_t direct_buffer_size,
+                                            uint32_t code) noexcept
+{
+  switch (code)
+  {
+    case ioctl_collect_dirty_bitmap_t::code:
+      //
+      // The bitmap is written directly into the (locked) buffer of the
+      // caller - it can be several MBs large.
+      //
+      return ioctl_collect_dirty_bitmap(direct_buffer, direct_buffer_size);
+
+    case ioctl_collect_access_bitmap_t::code:
+      return ioctl_collect_access_bitmap(direct_buffer, direct_buffer_size);
+
+    case ioctl_query_exit_stats_t::code:
+      return ioctl_query_exit_stats(buffer, buffer_size, direct_buffer, direct_buffer_size);
+
+    case ioctl_measure_exit_t::code:
+      return ioctl_measure_exit(buffer, buffer_size, direct_buffer, direct_buffer_size);
+
     default:
       hvpp_assert(0);
       return make_error_code_t(std::errc::invalid_argument);
@@ -55,8 +170,21 @@ error_code_t device_custom::ioctl_enable_io_debugbreak(void* buffer, size_t buff
     return error_code_t{};
   }
 
-  handler_->storage().io_in[io_port] = true;
-  handler_->storage().io_out[io_port] = true;
+  //
+  // Breakpoints on I/O ports need the I/O category of the storage
+  // (see HVPP_VMEXIT_DBGBREAK_CATEGORIES).
+  //
+  if constexpr (!hvpp::vmexit_dbgbreak_storage_t::has_category<hvpp::vmexit_storage_category::io>)
+  {
+    return make_error_code_t(std::errc::not_supported);
+  }
+
+  hvpp::vmexit_storage_if<hvpp::vmexit_storage_category::io>([&](auto& storage) {
+    handler_->breakpoint(hvpp::vmx::exit_reason::execute_io_instruction,
+                         storage.io_in[io_port]);
+    handler_->breakpoint(hvpp::vmx::exit_reason::execute_io_instruction,
+                         storage.io_out[io_port]);
+  }, handler_->storage());
 
   hvpp_info("ioctl_enable_io_debugbreak: 0x%04x", io_port);
 
@@ -67,3 +195,633 @@ error_code_t device_custom::ioctl_enable_io_debugbreak(void* buffer, size_t buff
 
   return error_code_t{};
 }
+
+error_code_t device_custom::ioctl_collect_dirty_bitmap(void* buffer, size_t buffer_size)
+{
+  hvpp_assert(buffer);
+  hvpp_assert(buffer_size >= ioctl_collect_dirty_bitmap_t::size);
+
+  if (!buffer || buffer_size < ioctl_collect_dirty_bitmap_t::size)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  if (!hvpp::hypervisor::dirty_tracking_enabled())
+  {
+    return make_error_code_t(std::errc::not_supported);
+  }
+
+  //
+  // Fill the output buffer with the bitmap of pages written since
+  // the last call (bit N represents physical page N).
+  //
+  auto size = hvpp::hypervisor::dirty_bitmap_collect(buffer, buffer_size);
+
+  hvpp_info("ioctl_collect_dirty_bitmap: %u bytes", uint32_t(size));
+
+  return error_code_t{};
+}
+
+error_code_t device_custom::ioctl_collect_access_bitmap(void* buffer, size_t buffer_size)
+{
+  hvpp_assert(buffer);
+  hvpp_assert(buffer_size >= ioctl_collect_access_bitmap_t::size);
+
+  if (!buffer || buffer_size < ioctl_collect_access_bitmap_t::size)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  if (!hvpp::hypervisor::access_tracking_enabled())
+  {
+    return make_error_code_t(std::errc::not_supported);
+  }
+
+  //
+  // Fill the output buffer with the bitmap of pages accessed (read,
+  // written or executed) since the last call (bit N represents physical
+  // page N).  Calling this periodically samples the working set of the
+  // guest - without any VM-exit.
+  //
+  auto size = hvpp::hypervisor::access_bitmap_collect(buffer, buffer_size);
+
+  hvpp_info("ioctl_collect_access_bitmap: %u bytes", uint32_t(size));
+
+  return error_code_t{};
+}
+
+error_code_t device_custom::ioctl_query_exit_stats(void* buffer, size_t buffer_size,
+                                                   void* direct_buffer, size_t direct_buffer_size)
+{
+  hvpp_assert(buffer);
+  hvpp_assert(buffer_size >= ioctl_query_exit_stats_t::size);
+
+  if (!buffer || buffer_size < ioctl_query_exit_stats_t::size ||
+      !direct_buffer || direct_buffer_size < sizeof(hvpp::vmexit_stats_snapshot_t))
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  if (!stats_handler_)
+  {
+    return make_error_code_t(std::errc::not_supported);
+  }
+
+  //
+  // The input buffer contains the request (CPU index and flags), the
+  // snapshot (~640kb) is written directly into the output buffer.
+  // Attribution follows the snapshot, if the output buffer has room
+  // for it.
+  //
+  const auto request = *((hvpp::vmexit_stats_snapshot_request_t*)buffer);
+
+  const auto attribution = direct_buffer_size >= sizeof(hvpp::vmexit_stats_snapshot_t) +
+                                                 sizeof(hvpp::vmexit_stats_attribution_t)
+    ? reinterpret_cast<hvpp::vmexit_stats_attribution_t*>((uint8_t*)direct_buffer + sizeof(hvpp::vmexit_stats_snapshot_t))
+    : nullptr;
+
+  return stats_handler_->snapshot(*reinterpret_cast<hvpp::vmexit_stats_storage_t*>(direct_buffer),
+                                  request.cpu_index,
+                                  !!(request.flags & hvpp::vmexit_stats_snapshot_request_t::flag_reset),
+                                  attribution);
+}
+
+error_code_t device_custom::ioctl_query_mm_statistics(void* buffer, size_t buffer_size)
+{
+  hvpp_assert(buffer);
+  hvpp_assert(buffer_size >= ioctl_query_mm_statistics_t::size);
+
+  if (!buffer || buffer_size < ioctl_query_mm_statistics_t::size)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  //
+  // The first 4 bytes of the input buffer contain index of the CPU
+  // whose statistics should be returned, or -1 for all CPUs.
+  //
+  int cpu_index = *((int32_t*)buffer);
+
+  if (cpu_index < -1 || cpu_index >= int(mp::cpu_count()))
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  auto& statistics = *((mm::statistics_t*)buffer);
+
+  statistics = cpu_index == -1
+    ? mm::statistics()
+    : mm::statistics(cpu_index);
+
+  hvpp_info("ioctl_query_mm_statistics: cpu %i, %" PRIu64 " bytes allocated (peak %" PRIu64 "), "
+            "%" PRIu64 " of %" PRIu64 " bytes of the host stack used",
+            cpu_index, statistics.allocated_bytes, statistics.peak_allocated_bytes,
+            statistics.host_stack_used, statistics.host_stack_size);
+
+  return error_code_t{};
+}
+
+error_code_t device_custom::ioctl_map_stats_ring(void* buffer, size_t buffer_size)
+{
+  hvpp_assert(stats_handler_);
+  hvpp_assert(buffer);
+  hvpp_assert(buffer_size >= ioctl_map_stats_ring_t::size);
+
+  if (!buffer || buffer_size < ioctl_map_stats_ring_t::size)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  if (!stats_handler_ || !stats_handler_->stream_ring())
+  {
+    return make_error_code_t(std::errc::not_supported);
+  }
+
+  std::lock_guard _{ mapping_lock_ };
+
+  //
+  // Only one process can have the ring mapped at the time.
+  //
+  if (stats_ring_mapping_.address)
+  {
+    return make_error_code_t(std::errc::device_or_resource_busy);
+  }
+
+  //
+  // The ring is only read by the process.
+  //
+  if (auto err = mm::user_map(stats_handler_->stream_ring(),
+                              stats_handler_->stream_ring_size(),
+                              stats_ring_mapping_,
+                              true))
+  {
+    return err;
+  }
+
+  //
+  // Return the user-mode address of the ring.
+  //
+  *((uint64_t*)buffer) = (uint64_t)stats_ring_mapping_.address;
+
+  hvpp_info("ioctl_map_stats_ring: 0x%p", stats_ring_mapping_.address);
+
+  return error_code_t{};
+}
+
+error_code_t device_custom::ioctl_unmap_stats_ring()
+{
+  std::lock_guard _{ mapping_lock_ };
+
+  if (!stats_ring_mapping_.address)
+  {
+    return error_code_t{};
+  }
+
+  if (!mm::user_mapping_owned(stats_ring_mapping_))
+  {
+    return make_error_code_t(std::errc::operation_not_permitted);
+  }
+
+  mm::user_unmap(stats_ring_mapping_);
+
+  return error_code_t{};
+}
+
+error_code_t device_custom::ioctl_query_exit_timing(void* buffer, size_t buffer_size)
+{
+  hvpp_assert(buffer);
+  hvpp_assert(buffer_size >= ioctl_query_exit_timing_t::size);
+
+  if (!buffer || buffer_size < ioctl_query_exit_timing_t::size)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  //
+  // The first 4 bytes of the input buffer contain index of the CPU
+  // whose histograms should be returned.
+  //
+  uint32_t cpu_index = *((uint32_t*)buffer);
+
+  if (!hvpp::hypervisor::is_started() || !hvpp::hypervisor::is_virtualized(cpu_index))
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  auto exit_timing = hvpp::hypervisor::vcpu(cpu_index).exit_timing();
+
+  if (!exit_timing)
+  {
+    //
+    // HVPP_ENABLE_EXIT_TIMING isn't defined.
+    //
+    return make_error_code_t(std::errc::not_supported);
+  }
+
+  memcpy(buffer, exit_timing, sizeof(*exit_timing));
+
+  return error_code_t{};
+}
+
+error_code_t device_custom::ioctl_query_exit_profile(void* buffer, size_t buffer_size)
+{
+  hvpp_assert(buffer);
+  hvpp_assert(buffer_size >= ioctl_query_exit_profile_t::size);
+
+  if (!buffer || buffer_size < ioctl_query_exit_profile_t::size)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  //
+  // The first 4 bytes of the input buffer contain index of the CPU
+  // whose samples of slow VM-exits should be returned.
+  //
+  uint32_t cpu_index = *((uint32_t*)buffer);
+
+  if (!hvpp::hypervisor::is_started() || !hvpp::hypervisor::is_virtualized(cpu_index))
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  auto exit_profile = hvpp::hypervisor::vcpu(cpu_index).exit_profile();
+
+  if (!exit_profile)
+  {
+    return make_error_code_t(std::errc::not_supported);
+  }
+
+  //
+  // Samples might be overwritten while they're copied - consumer
+  // should check the sequence of each sample (see vcpu_exit_sample_t).
+  //
+  memcpy(buffer, exit_profile, sizeof(*exit_profile));
+
+  return error_code_t{};
+}
+
+error_code_t device_custom::ioctl_map_event_channel(void* buffer, size_t buffer_size)
+{
+  hvpp_assert(buffer);
+  hvpp_assert(buffer_size >= ioctl_map_event_channel_t::size);
+
+  if (!buffer || buffer_size < ioctl_map_event_channel_t::size)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  if (!event_channel::ring())
+  {
+    return make_error_code_t(std::errc::not_supported);
+  }
+
+  std::lock_guard _{ mapping_lock_ };
+
+  //
+  // Only one process can have the channel mapped at the time.
+  //
+  if (event_channel_mapping_.address)
+  {
+    return make_error_code_t(std::errc::device_or_resource_busy);
+  }
+
+  //
+  // The input buffer contains handle of the event which should be
+  // signaled when new events arrive.
+  //
+  const auto event_handle = *((uint64_t*)buffer);
+
+  //
+  // The mapping stays writable - the process advances the tail of
+  // each per-CPU ring.
+  //
+  if (auto err = mm::user_map(event_channel::ring(),
+                              event_channel::ring_size(),
+                              event_channel_mapping_))
+  {
+    return err;
+  }
+
+  if (auto err = event_channel::notify_enable(event_handle))
+  {
+    mm::user_unmap(event_channel_mapping_);
+    return err;
+  }
+
+  event_channel::notify_callback(&device_custom::event_channel_notify, this);
+
+  //
+  // Return the user-mode address of the channel.
+  //
+  *((uint64_t*)buffer) = (uint64_t)event_channel_mapping_.address;
+
+  hvpp_info("ioctl_map_event_channel: 0x%p", event_channel_mapping_.address);
+
+  return error_code_t{};
+}
+
+error_code_t device_custom::ioctl_unmap_event_channel()
+{
+  std::lock_guard _{ mapping_lock_ };
+
+  if (!event_channel_mapping_.address)
+  {
+    return error_code_t{};
+  }
+
+  if (!mm::user_mapping_owned(event_channel_mapping_))
+  {
+    return make_error_code_t(std::errc::operation_not_permitted);
+  }
+
+  event_channel::notify_callback(nullptr, nullptr);
+  event_channel::notify_disable();
+  mm::user_unmap(event_channel_mapping_);
+
+  //
+  // Don't leave waiters pending - they receive 0 unread events.
+  //
+  complete(event_channel_queue);
+
+  return error_code_t{};
+}
+
+error_code_t device_custom::ioctl_wait_event_channel(void* buffer, size_t buffer_size)
+{
+  hvpp_assert(buffer);
+  hvpp_assert(buffer_size >= ioctl_wait_event_channel_t::size);
+
+  if (!buffer || buffer_size < ioctl_wait_event_channel_t::size)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  //
+  // Called either directly (events are already there) or when the
+  // pending request is completed (see event_channel_notify()).
+  //
+  *((uint64_t*)buffer) = event_channel_mapping_.address
+    ? event_channel::unread_count()
+    : 0;
+
+  return error_code_t{};
+}
+
+void device_custom::event_channel_notify(void* context) noexcept
+{
+  //
+  // Called from the DPC - complete the pending requests right away.
+  //
+  auto device_instance = reinterpret_cast<device_custom*>(context);
+
+  if (device_instance->pending_count(event_channel_queue))
+  {
+    device_instance->complete(event_channel_queue);
+  }
+}
+
+error_code_t device_custom::ioctl_pipeline_mask(void* buffer, size_t buffer_size)
+{
+  hvpp_assert(buffer);
+  hvpp_assert(buffer_size >= ioctl_pipeline_mask_t::size);
+
+  if (!buffer || buffer_size < ioctl_pipeline_mask_t::size)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  if (!pipeline_masks_)
+  {
+    return make_error_code_t(std::errc::not_supported);
+  }
+
+  auto& request = *((pipeline_mask_request_t*)buffer);
+
+  if (request.stage_index >= pipeline_masks_->stage_count())
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  const auto previous_mask = pipeline_masks_->mask(request.stage_index);
+
+  if (request.flags & 1)
+  {
+    if (auto err = pipeline_masks_->mask(request.stage_index, { request.mask[0], request.mask[1] }))
+    {
+      return err;
+    }
+
+    hvpp_info("ioctl_pipeline_mask: stage %u = 0x%016" PRIx64 "'%016" PRIx64,
+              request.stage_index, request.mask[1], request.mask[0]);
+  }
+
+  //
+  // Return the previous mask.
+  //
+  request.mask[0] = previous_mask[0];
+  request.mask[1] = previous_mask[1];
+
+  return error_code_t{};
+}
+
+error_code_t device_custom::ioctl_self_benchmark(void* buffer, size_t buffer_size)
+{
+  hvpp_assert(buffer);
+  hvpp_assert(buffer_size >= ioctl_self_benchmark_t::size);
+
+  if (!buffer || buffer_size < ioctl_self_benchmark_t::size)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  auto& benchmark = *((self_benchmark_t*)buffer);
+
+  if (auto err = self_benchmark(benchmark))
+  {
+    return err;
+  }
+
+  hvpp_info("ioctl_self_benchmark: cpu %u, %u iterations",
+            benchmark.cpu_index, benchmark.iteration_count);
+
+  return error_code_t{};
+}
+
+error_code_t device_custom::ioctl_measure_exit(void* buffer, size_t buffer_size,
+                                               void* direct_buffer, size_t direct_buffer_size)
+{
+  hvpp_assert(buffer);
+  hvpp_assert(buffer_size >= ioctl_measure_exit_t::size);
+
+  if (!buffer || buffer_size < ioctl_measure_exit_t::size || !direct_buffer)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  const auto request = *((measure_exit_request_t*)buffer);
+
+  if (!request.is_allowed() ||
+      request.sample_count == 0 ||
+      request.sample_count > measure_exit_request_t::max_sample_count ||
+      direct_buffer_size < request.sample_count * sizeof(uint32_t))
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  const auto port = uint16_t(request.argument);
+  auto samples = reinterpret_cast<uint32_t*>(direct_buffer);
+
+  for (uint32_t index = 0; index < request.sample_count; ++index)
+  {
+    //
+    // Interrupts are disabled only for the duration of the single
+    // sample, so that the tail latency isn't polluted by interrupt
+    // handlers (and the system isn't stalled for the whole loop).
+    //
+    uint32_t aux;
+
+    ia32_asm_disable_interrupts();
+    const auto begin = ia32_asm_read_tscp(&aux);
+
+    switch (request.instruction)
+    {
+      case measure_exit_request_t::instruction_in:
+        (void)(ia32_asm_in_byte(port));
+        break;
+
+      case measure_exit_request_t::instruction_out:
+        ia32_asm_out_byte(port, 0);
+        break;
+
+      case measure_exit_request_t::instruction_rdmsr:
+        (void)(ia32_asm_read_msr(request.argument));
+        break;
+    }
+
+    const auto end = ia32_asm_read_tscp(&aux);
+    ia32_asm_enable_interrupts();
+
+    samples[index] = uint32_t(end - begin);
+  }
+
+  return error_code_t{};
+}
+
+error_code_t device_custom::ioctl_map_snapshot(void* buffer, size_t buffer_size)
+{
+  hvpp_assert(buffer);
+  hvpp_assert(buffer_size >= ioctl_map_snapshot_t::size);
+
+  if (!buffer || buffer_size < ioctl_map_snapshot_t::size)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  std::lock_guard _{ mapping_lock_ };
+
+  //
+  // Only one process can have the chunk mapped at the time.
+  //
+  if (snapshot_mapping_.address)
+  {
+    return make_error_code_t(std::errc::device_or_resource_busy);
+  }
+
+  //
+  // The chunk (and the bitmap of the incremental snapshot) is allocated
+  // only while it's mapped.
+  //
+  if (auto err = snapshot::initialize())
+  {
+    return err;
+  }
+
+  //
+  // The chunk is only read by the process.
+  //
+  if (auto err = mm::user_map(snapshot::chunk(),
+                              snapshot::chunk_size(),
+                              snapshot_mapping_,
+                              true))
+  {
+    snapshot::destroy();
+    return err;
+  }
+
+  //
+  // Return the user-mode address of the chunk.
+  //
+  *((uint64_t*)buffer) = (uint64_t)snapshot_mapping_.address;
+
+  hvpp_info("ioctl_map_snapshot: 0x%p", snapshot_mapping_.address);
+
+  return error_code_t{};
+}
+
+error_code_t device_custom::ioctl_unmap_snapshot()
+{
+  std::lock_guard _{ mapping_lock_ };
+
+  if (!snapshot_mapping_.address)
+  {
+    return error_code_t{};
+  }
+
+  //
+  // The chunk is destroyed only together with its mapping, i.e. in
+  // the context of the process which has mapped it.
+  //
+  if (!mm::user_mapping_owned(snapshot_mapping_))
+  {
+    return make_error_code_t(std::errc::operation_not_permitted);
+  }
+
+  mm::user_unmap(snapshot_mapping_);
+  snapshot::destroy();
+
+  return error_code_t{};
+}
+
+error_code_t device_custom::ioctl_snapshot(void* buffer, size_t buffer_size)
+{
+  hvpp_assert(buffer);
+  hvpp_assert(buffer_size >= ioctl_snapshot_t::size);
+
+  if (!buffer || buffer_size < ioctl_snapshot_t::size)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  //
+  // Don't let the owner destroy the chunk meanwhile.
+  //
+  std::lock_guard _{ mapping_lock_ };
+
+  if (!snapshot_mapping_.address)
+  {
+    return make_error_code_t(std::errc::not_supported);
+  }
+
+  auto& request = *reinterpret_cast<snapshot::request_t*>(buffer);
+
+  switch (request.command)
+  {
+    case snapshot::request_t::command_begin_full:
+    case snapshot::request_t::command_begin_incremental:
+      if (auto err = snapshot::begin(request.command == snapshot::request_t::command_begin_incremental))
+      {
+        return err;
+      }
+      request.page_count = 0;
+      break;
+
+    case snapshot::request_t::command_next:
+      request.page_count = snapshot::next();
+      break;
+
+    default:
+      return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  return error_code_t{};
+}
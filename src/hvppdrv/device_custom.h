@@ -1,10 +1,93 @@
 #pragma once
+#include "self_benchmark.h"
+
+#include <hvpp/vmexit_pipeline.h>
 #include <hvpp/lib/device.h>
+#include <hvpp/lib/event_channel.h>
+#include <hvpp/lib/mm.h>
+#include <hvpp/lib/snapshot.h>
+#include <hvpp/lib/spinlock.h>
 #include <hvpp/vmexit/vmexit_dbgbreak.h>
+#include <hvpp/vmexit/vmexit_stats.h>
 
 #include <cstdint>
 
+//
+// Input (and output) of ioctl_pipeline_mask_t.  Bit 0 of "flags" set
+// means that the mask of the stage should be replaced, the previous
+// mask is returned in either case.
+//
+struct pipeline_mask_request_t
+{
+  uint32_t stage_index;
+  uint32_t flags;
+  uint64_t mask[2];
+};
+
+//
+// Input of ioctl_measure_exit_t.  The instruction is executed
+// "sample_count" times on the current CPU (the caller should pin its
+// thread) and TSC cycles of each execution are written into the output
+// buffer (array of uint32_t).  This is meant for the benchmark of
+// VM-exits which can't be caused from the user-mode (IN/OUT and RDMSR
+// raise #GP at CPL 3).
+//
+// Note that the instruction is really executed - therefore only a fixed
+// set of operations is accepted (see is_allowed()), anything else fails
+// with invalid_argument.
+//
+struct measure_exit_request_t
+{
+  static constexpr uint32_t instruction_in    = 0;      // IN AL, DX  (argument = port)
+  static constexpr uint32_t instruction_out   = 1;      // OUT DX, AL (argument = port)
+  static constexpr uint32_t instruction_rdmsr = 2;      // RDMSR      (argument = MSR)
+
+  static constexpr uint32_t max_sample_count  = 4096;
+
+  //
+  // Port 0x64 (keyboard status) is intercepted by vmexit_custom_handler,
+  // port 0x80 (POST diagnostics) has no side effects and IA32_APIC_BASE
+  // exists on every CPU which supports VMX.
+  //
+  static constexpr uint32_t allowed_in_port   = 0x64;
+  static constexpr uint32_t allowed_out_port  = 0x80;
+  static constexpr uint32_t allowed_msr       = 0x1b;
+
+  constexpr bool is_allowed() const noexcept
+  {
+    switch (instruction)
+    {
+      case instruction_in:    return argument == allowed_in_port;
+      case instruction_out:   return argument == allowed_out_port;
+      case instruction_rdmsr: return argument == allowed_msr;
+      default:                return false;
+    }
+  }
+
+  uint32_t instruction;
+  uint32_t argument;
+  uint32_t sample_count;
+  uint32_t reserved;
+};
+
 using ioctl_enable_io_debugbreak_t = ioctl_read_write_t<1, sizeof(uint16_t)>;
+using ioctl_collect_dirty_bitmap_t = ioctl_out_direct_t<2, sizeof(uint64_t)>;
+using ioctl_query_mm_statistics_t  = ioctl_read_write_t<3, sizeof(mm::statistics_t)>;
+using ioctl_map_stats_ring_t       = ioctl_read_write_t<4, sizeof(uint64_t)>;
+using ioctl_unmap_stats_ring_t     = ioctl_none_t<5>;
+using ioctl_query_exit_timing_t    = ioctl_read_write_t<6, sizeof(hvpp::vcpu_exit_timing_t)>;
+using ioctl_query_exit_profile_t   = ioctl_read_write_t<7, sizeof(hvpp::vcpu_exit_profile_t)>;
+using ioctl_map_event_channel_t    = ioctl_read_write_t<8, sizeof(uint64_t)>;
+using ioctl_unmap_event_channel_t  = ioctl_none_t<9>;
+using ioctl_wait_event_channel_t   = ioctl_read_write_t<10, sizeof(uint64_t)>;
+using ioctl_query_exit_stats_t     = ioctl_out_direct_t<11, sizeof(hvpp::vmexit_stats_snapshot_request_t)>;
+using ioctl_pipeline_mask_t        = ioctl_read_write_t<12, sizeof(pipeline_mask_request_t)>;
+using ioctl_measure_exit_t         = ioctl_out_direct_t<13, sizeof(measure_exit_request_t)>;
+using ioctl_self_benchmark_t       = ioctl_read_write_t<14, sizeof(self_benchmark_t)>;
+using ioctl_collect_access_bitmap_t = ioctl_out_direct_t<15, sizeof(uint64_t)>;
+using ioctl_map_snapshot_t         = ioctl_read_write_t<16, sizeof(uint64_t)>;
+using ioctl_unmap_snapshot_t       = ioctl_none_t<17>;
+using ioctl_snapshot_t             = ioctl_read_write_t<18, sizeof(snapshot::request_t)>;
 
 class device_custom
   : public device
@@ -15,10 +98,71 @@ class device_custom
     auto handler() noexcept -> hvpp::vmexit_dbgbreak_handler&;
     void handler(hvpp::vmexit_dbgbreak_handler& handler_instance) noexcept;
 
+    void stats_handler(hvpp::vmexit_stats_handler& handler_instance) noexcept;
+
+    void pipeline(hvpp::vmexit_pipeline_mask& pipeline_masks) noexcept;
+
+    error_code_t on_cleanup() noexcept override;
+    int on_ioctl_queue(uint32_t code) noexcept override;
     error_code_t on_ioctl(void* buffer, size_t buffer_size, uint32_t code) noexcept override;
+    error_code_t on_ioctl_direct(void* buffer, size_t buffer_size,
+                                 void* direct_buffer, size_t direct_buffer_size,
+                                 uint32_t code) noexcept override;
 
   private:
     error_code_t ioctl_enable_io_debugbreak(void* buffer, size_t buffer_size);
+    error_code_t ioctl_collect_dirty_bitmap(void* buffer, size_t buffer_size);
+    error_code_t ioctl_collect_access_bitmap(void* buffer, size_t buffer_size);
+    error_code_t ioctl_query_exit_stats(void* buffer, size_t buffer_size,
+                                        void* direct_buffer, size_t direct_buffer_size);
+    error_code_t ioctl_query_mm_statistics(void* buffer, size_t buffer_size);
+    error_code_t ioctl_map_stats_ring(void* buffer, size_t buffer_size);
+    error_code_t ioctl_unmap_stats_ring();
+    error_code_t ioctl_query_exit_timing(void* buffer, size_t buffer_size);
+    error_code_t ioctl_query_exit_profile(void* buffer, size_t buffer_size);
+    error_code_t ioctl_map_event_channel(void* buffer, size_t buffer_size);
+    error_code_t ioctl_unmap_event_channel();
+    error_code_t ioctl_wait_event_channel(void* buffer, size_t buffer_size);
+    error_code_t ioctl_pipeline_mask(void* buffer, size_t buffer_size);
+    error_code_t ioctl_self_benchmark(void* buffer, size_t buffer_size);
+    error_code_t ioctl_map_snapshot(void* buffer, size_t buffer_size);
+    error_code_t ioctl_unmap_snapshot();
+    error_code_t ioctl_snapshot(void* buffer, size_t buffer_size);
+    error_code_t ioctl_measure_exit(void* buffer, size_t buffer_size,
+                                    void* direct_buffer, size_t direct_buffer_size);
+
+    //
+    // Completes pending ioctl_wait_event_channel requests (called by
+    // the event channel).
+    //
+    static void event_channel_notify(void* context) noexcept;
+
+    static constexpr int event_channel_queue = 0;
 
     hvpp::vmexit_dbgbreak_handler* handler_ = nullptr;
+    hvpp::vmexit_stats_handler* stats_handler_ = nullptr;
+    hvpp::vmexit_pipeline_mask* pipeline_masks_ = nullptr;
+
+    //
+    // Serializes mapping and unmapping of the mappings below.  Each
+    // mapping can be removed only by the process which owns it (see
+    // mm::user_map()).
+    //
+    spinlock mapping_lock_;
+
+    //
+    // Mapping of the VM-exit statistics ring into the process
+    // which requested it.
+    //
+    mm::user_mapping_t stats_ring_mapping_ = {};
+
+    //
+    // Mapping of the event channel into the process which requested it.
+    //
+    mm::user_mapping_t event_channel_mapping_ = {};
+
+    //
+    // Mapping of the snapshot chunk into the process which requested it.
+    //
+    mm::user_mapping_t snapshot_mapping_ = {};
 };
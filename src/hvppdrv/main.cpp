@@ -1,8 +1,11 @@
+#define HVPP_LOG_MODULE user
+
 #include <hvpp/hypervisor.h>
-#include <hvpp/vmexit_compositor.h>
+#include <hvpp/vmexit_pipeline.h>
 
 #include <hvpp/lib/driver.h>
 #include <hvpp/lib/assert.h>
+#include <hvpp/lib/event_channel.h>
 #include <hvpp/lib/log.h>
 #include <hvpp/lib/mm.h>
 #include <hvpp/lib/mp.h>
@@ -18,11 +21,17 @@ using namespace hvpp;
 namespace driver
 {
   //
-  // Create combined handler from these VM-exit handlers.
+  // Create combined handler from these VM-exit handlers.  Stages of
+  // the pipeline (except the last one) can be enabled/disabled per
+  // VM-exit reason at runtime (see ioctl_pipeline_mask_t).  The
+  // governor comes first, so that it can skip the observers of
+  // degraded VM-exits.
   //
-  using vmexit_handler_t = vmexit_compositor_handler<
+  using vmexit_handler_t = vmexit_pipeline_handler<
+    vmexit_governor_handler,
     vmexit_stats_handler,
     vmexit_dbgbreak_handler,
+    vmexit_recorder_handler,
     vmexit_custom_handler
     >;
 
@@ -64,16 +73,111 @@ namespace driver
       return make_error_code_t(std::errc::not_enough_memory);
     }
 
+    if (auto err = std::get<vmexit_custom_handler>(vmexit_handler_->handlers).initialize())
+    {
+      destroy();
+      return err;
+    }
+
     //
     // Assign the vmexit_dbgbreak_handler instance to the device.
     //
     device_->handler(std::get<vmexit_dbgbreak_handler>(vmexit_handler_->handlers));
+    device_->stats_handler(std::get<vmexit_stats_handler>(vmexit_handler_->handlers));
+    device_->pipeline(vmexit_handler_->masks);
+
+    //
+    // Example: Uncomment this to collect statistics only when enabled
+    // by the user-mode (hvppctrl pipeline 0 ...).
+    //
+    // vmexit_handler_->masks.mask(vmexit_handler_t::stage_index<vmexit_stats_handler>,
+    //                             vmexit_pipeline_mask::mask_none);
+
+    //
+    // Record VM-exits only while enabled by the user-mode
+    // (hvppctrl record, see vmexit_recorder_handler).
+    //
+    vmexit_handler_->masks.mask(vmexit_handler_t::stage_index<vmexit_recorder_handler>,
+                                vmexit_pipeline_mask::mask_none);
+
+    //
+    // Example: Uncomment this to degrade interception of MSRs, I/O and
+    // DR accesses which cause more than 100k VM-exits per ~1s (1G TSC
+    // ticks) on single VCPU - first to sampling of the observers, then
+    // by turning the interception off (see vmexit_governor_handler).
+    //
+    // auto& governor = std::get<vmexit_governor_handler>(vmexit_handler_->handlers);
+    // governor.window(1'000'000'000);
+    // governor.budget(vmx::exit_reason::execute_rdmsr, 100'000);
+    // governor.budget(vmx::exit_reason::execute_wrmsr, 100'000);
+    // governor.budget(vmx::exit_reason::execute_io_instruction, 100'000);
+    // governor.budget(vmx::exit_reason::mov_dr, 100'000);
+
+    //
+    // Example: Enable tracing of I/O instructions - only every 64th
+    // of them is traced, so that the trace stays usable on busy machines.
+    // The filter can also restrict the ports, the guest CPL or the
+    // guest CR3 (see vmexit_trace_filter_t).
+    //
+    auto& stats = std::get<vmexit_stats_handler>(vmexit_handler_->handlers);
+    stats.trace_bitmap().set(int(vmx::exit_reason::execute_io_instruction));
+    stats.trace_filter(vmx::exit_reason::execute_io_instruction, { 64 });
+
+    //
+    // Example: Uncomment this to emit typed "VmExit" TraceLogging events
+    // (exit reason, qualification, guest RIP and CR3, handler latency)
+    // for WPA/xperf.  Events are buffered per CPU and written by the
+    // logger drainer thread, never in VMX-root mode.
+    //
+    // logger::set_options(logger::get_options() | logger::options_t::trace_exit_events);
+
+    //
+    // Example: Stream VM-exit statistics into the shared ring
+    // (~every 100M TSC ticks, see hvppctrl).
+    //
+    if (auto err = std::get<vmexit_stats_handler>(vmexit_handler_->handlers).stream_enable(100'000'000))
+    {
+      destroy();
+      return err;
+    }
+
+    //
+    // Example: Attribute VM-exits to the guest CR3 and RIP which caused
+    // them (see "hvppctrl stats").
+    //
+    if (auto err = std::get<vmexit_stats_handler>(vmexit_handler_->handlers).attribution_enable())
+    {
+      destroy();
+      return err;
+    }
 
     //
-    // Example: Enable tracing of I/O instructions.
+    // Example: Deliver traced VM-exits and EPT violations to the
+    // user-mode through the shared event channel (see hvppctrl).
     //
-    std::get<vmexit_stats_handler>(vmexit_handler_->handlers)
-      .trace_bitmap().set(int(vmx::exit_reason::execute_io_instruction));
+    if (auto err = event_channel::initialize())
+    {
+      destroy();
+      return err;
+    }
+
+    //
+    // Example: Enable dirty page tracking (PML).
+    //
+    if (auto err = hvpp::hypervisor::dirty_tracking_enable())
+    {
+      destroy();
+      return err;
+    }
+
+    //
+    // Example: Enable tracking of accessed pages (EPT accessed flags).
+    // Not supported by all CPUs - the rest of the example works without it.
+    //
+    if (auto err = hvpp::hypervisor::access_tracking_enable())
+    {
+      hvpp_warn("Access tracking is not supported (error %i)", err.value());
+    }
 
     //
     // Start the hypervisor.
@@ -121,6 +225,12 @@ namespace driver
       delete device_;
     }
 
+    //
+    // Destroy event channel (after the device, which might still
+    // have it mapped).
+    //
+    event_channel::destroy();
+
     hvpp_info("Hypervisor stopped");
   }
 }
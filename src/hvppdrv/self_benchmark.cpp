@@ -0,0 +1,187 @@
+#include "self_benchmark.h"
+
+#include <hvpp/config.h>
+
+#ifdef HVPP_ENABLE_SELF_BENCHMARK
+
+#include <hvpp/ept.h>
+#include <hvpp/ia32/asm.h>
+#include <hvpp/ia32/mtrr.h>
+#include <hvpp/lib/bitmap.h>
+#include <hvpp/lib/mm.h>
+#include <hvpp/lib/mp.h>
+
+#include <cstring>
+
+namespace detail
+{
+  //
+  // Execute "function" (receiving the iteration index) and accumulate
+  // its TSC ticks.  "prepare" is executed before each iteration and
+  // "cleanup" after it, both outside of the measurement.
+  //
+  template <
+    typename PREPARE,
+    typename F,
+    typename CLEANUP
+  >
+  void measure(self_benchmark_t::result_t& result, uint32_t iteration_count,
+               PREPARE&& prepare, F&& function, CLEANUP&& cleanup) noexcept
+  {
+    result.iteration_count = iteration_count;
+    result.min_ticks = ~0ull;
+    result.max_ticks = 0;
+    result.total_ticks = 0;
+
+    for (uint32_t index = 0; index < iteration_count; ++index)
+    {
+      prepare(index);
+
+      uint32_t aux;
+      const auto begin = ia32_asm_read_tscp(&aux);
+      function(index);
+      const auto end = ia32_asm_read_tscp(&aux);
+
+      cleanup(index);
+
+      const auto ticks = end - begin;
+      result.min_ticks = ticks < result.min_ticks ? ticks : result.min_ticks;
+      result.max_ticks = ticks > result.max_ticks ? ticks : result.max_ticks;
+      result.total_ticks += ticks;
+    }
+
+    if (!iteration_count)
+    {
+      result.min_ticks = 0;
+    }
+  }
+
+  template <
+    typename F
+  >
+  void measure(self_benchmark_t::result_t& result, uint32_t iteration_count,
+               F&& function) noexcept
+  {
+    measure(result, iteration_count, [](uint32_t) {}, function, [](uint32_t) {});
+  }
+}
+
+auto self_benchmark(self_benchmark_t& benchmark) noexcept -> error_code_t
+{
+  using namespace hvpp;
+
+  //
+  // Identity map allocates page tables for the whole physical memory.
+  //
+  static constexpr uint32_t max_map_identity_count = 16;
+
+  static constexpr int bitmap_size_in_bits = 64 * 1024;
+
+  const auto iteration_count = benchmark.iteration_count;
+
+  if (!iteration_count)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  memset(benchmark.result, 0, sizeof(benchmark.result));
+  benchmark.cpu_index = mp::cpu_index();
+
+  //
+  // Memory manager.
+  //
+  detail::measure(benchmark.result[self_benchmark_t::mm_allocate], iteration_count,
+    [](uint32_t) { mm::free(mm::allocate(64)); });
+
+  detail::measure(benchmark.result[self_benchmark_t::mm_allocate_page], iteration_count,
+    [](uint32_t) { mm::free(mm::allocate(page_size)); });
+
+  //
+  // EPT.
+  //
+  {
+    ept_t* ept = nullptr;
+
+    detail::measure(benchmark.result[self_benchmark_t::ept_map_identity],
+      iteration_count < max_map_identity_count ? iteration_count : max_map_identity_count,
+      [&](uint32_t) { ept = new ept_t(); },
+      [&](uint32_t) { ept->map_identity(); },
+      [&](uint32_t) { delete ept; });
+  }
+
+  {
+    //
+    // Split and join the same 2MB page of a private EPT, so that page
+    // tables don't accumulate (only the split is measured).
+    //
+    auto ept = new ept_t();
+    const auto guest_pa = pa_t{ 2 * 1024 * 1024 };
+
+    ept->map_2mb(guest_pa, guest_pa);
+
+    detail::measure(benchmark.result[self_benchmark_t::ept_split_2mb_to_4kb], iteration_count,
+      [&](uint32_t) { },
+      [&](uint32_t) { ept->split_2mb_to_4kb(guest_pa, guest_pa); },
+      [&](uint32_t) { ept->join_4kb_to_2mb(guest_pa, guest_pa); });
+
+    delete ept;
+  }
+
+  //
+  // Bitmap.
+  //
+  if (auto buffer = mm::allocate(bitmap_size_in_bits / 8))
+  {
+    bitmap b{ buffer, bitmap_size_in_bits };
+    volatile int result;
+
+    b.set();
+    b.clear(bitmap_size_in_bits - 1);
+
+    detail::measure(benchmark.result[self_benchmark_t::bitmap_find_first_clear], iteration_count,
+      [&](uint32_t) { result = b.find_first_clear(); });
+
+    //
+    // No run of 16 clear bits except the last one.
+    //
+    b.clear();
+    for (int bit = 0; bit < bitmap_size_in_bits - 16; bit += 8)
+    {
+      b.set(bit);
+    }
+
+    detail::measure(benchmark.result[self_benchmark_t::bitmap_find_first_clear_16], iteration_count,
+      [&](uint32_t) { result = b.find_first_clear(16); });
+
+    (void)(result);
+    mm::free(buffer);
+  }
+
+  //
+  // MTRR.
+  //
+  {
+    const auto& mtrr = mm::mtrr();
+    volatile memory_type result;
+    uint64_t seed = 0x9e37'79b9'7f4a'7c15;
+
+    detail::measure(benchmark.result[self_benchmark_t::mtrr_type], iteration_count,
+      [&](uint32_t) { seed = seed * 6364136223846793005ull + 1442695040888963407ull; },
+      [&](uint32_t) { result = mtrr.type(pa_t{ (seed >> 32) & ~(page_size - 1ull) }); },
+      [&](uint32_t) { });
+
+    (void)(result);
+  }
+
+  return error_code_t{};
+}
+
+#else
+
+auto self_benchmark(self_benchmark_t& benchmark) noexcept -> error_code_t
+{
+  (void)(benchmark);
+  return make_error_code_t(std::errc::not_supported);
+}
+
+#endif
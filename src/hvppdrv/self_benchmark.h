@@ -0,0 +1,47 @@
+#pragma once
+#include <hvpp/lib/error.h>
+
+#include <cstdint>
+
+//
+// Input (and output) of ioctl_self_benchmark_t.
+//
+// Primitives of the hypervisor are executed "iteration_count" times on
+// the current CPU and TSC ticks of each iteration are accumulated into
+// the result of the primitive.  Iteration count of the expensive
+// primitives (map_identity) is capped (see self_benchmark()).
+//
+// The benchmark is compiled in only if HVPP_ENABLE_SELF_BENCHMARK is
+// defined (see hvpp/config.h), the IOCTL fails otherwise.
+//
+struct self_benchmark_t
+{
+  enum primitive : uint32_t
+  {
+    mm_allocate,                // mm::allocate() + mm::free() (64 bytes)
+    mm_allocate_page,           // mm::allocate() + mm::free() (4kb)
+    ept_map_identity,           // ept_t::map_identity() of new EPT
+    ept_split_2mb_to_4kb,       // ept_t::split_2mb_to_4kb()
+    bitmap_find_first_clear,    // bitmap::find_first_clear() (64k bits, last bit clear)
+    bitmap_find_first_clear_16, // bitmap::find_first_clear(16) (64k bits, every 8th bit set)
+    mtrr_type,                  // ia32::mtrr::type(pa) of pseudo-random PA below 4GB
+
+    primitive_count
+  };
+
+  struct result_t
+  {
+    uint32_t iteration_count;
+    uint32_t reserved;
+    uint64_t min_ticks;
+    uint64_t max_ticks;
+    uint64_t total_ticks;
+  };
+
+  uint32_t iteration_count;     // in
+  uint32_t cpu_index;           // out - CPU on which the benchmark ran
+
+  result_t result[primitive_count];
+};
+
+auto self_benchmark(self_benchmark_t& benchmark) noexcept -> error_code_t;
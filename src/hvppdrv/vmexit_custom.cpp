@@ -1,31 +1,149 @@
+#define HVPP_LOG_MODULE user
+
 #include "vmexit_custom.h"
 
-#include <hvpp/lib/cr3_guard.h>
+#include <hvpp/hypervisor.h>
+#include <hvpp/lib/assert.h>
 #include <hvpp/lib/mp.h>
 #include <hvpp/lib/log.h>
+#include <hvpp/lib/mm.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+
+vmexit_custom_handler::vmexit_custom_handler() noexcept
+  : hook_manager_{}
+  , ept_dispatcher_{}
+  , cpuid_policy_{}
+  , io_policy_{}
+  , msr_policy_{}
+  , mtrr_tracker_{}
+  , per_vcpu_{}
+{
+  const auto err = per_vcpu_.initialize();
+  hvpp_assert(!err);
+  (void)(err);
+
+  //
+  // Windows have to be allocated here - the ring is registered in the
+  // VMX-root mode.
+  //
+  for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+  {
+    per_vcpu_[i].ring_window = new mapping_t();
+    hvpp_assert(per_vcpu_[i].ring_window && per_vcpu_[i].ring_window->capacity());
+  }
+
+  //
+  // Uncomment this to serve reads of IA32_APIC_BASE from the shadow
+  // instead of the hardware (see msr_policy).
+  //
+  // msr_policy_.add(msr::apic_base_t::msr_id, { nullptr, nullptr, nullptr, true });
+
+  //
+  // Keep EPT memory types in sync with the MTRRs - writes of the MTRRs
+  // exit and only the affected EPT entries are updated.
+  //
+  const auto mtrr_err = mtrr_tracker_.attach(msr_policy_);
+  hvpp_assert(!mtrr_err);
+  (void)(mtrr_err);
 
-void vmexit_custom_handler::setup(vcpu_t& vp) noexcept
+  //
+  // Uncomment this to hide the "hypervisor present" bit
+  // (CPUID.01H:ECX[bit 31]) from the guest.  All cached leaves are
+  // served without executing CPUID (see cpuid_policy).
+  //
+  // cpuid_policy_.mask(1, cpuid_policy::any_subleaf, { 0, 0, 1u << 31, 0 }, { 0, 0, 0, 0 });
+}
+
+auto vmexit_custom_handler::initialize() noexcept -> error_code_t
 {
-  base_type::setup(vp);
+  //
+  // Exit on 0x64 I/O port (keyboard) - see attach().  There is no
+  // callback, the I/O instruction is emulated by the passthrough
+  // handler.
+  //
+  static constexpr io_policy::range_t ranges[] = {
+    { 0x64, 0x64, io_policy::action_t::intercept, nullptr, nullptr },
+  };
+
+  return io_policy_.update(ranges, std::size(ranges));
+}
+
+vmexit_custom_handler::~vmexit_custom_handler() noexcept
+{
+  for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+  {
+    delete per_vcpu_[i].ring_window;
+  }
+}
+
+void vmexit_custom_handler::attach(vcpu_t& vp) noexcept
+{
+  base_type::attach(vp);
 
   //
   // Enable EPT and mirror current physical memory.
+  // The identity map is built only once and shared between all
+  // VCPUs - paging structures are copied only when this VCPU
+  // modifies them (e.g. by hooking the page).
+  //
+  vp.ept_enable(hypervisor::shared_ept());
+
+  //
+  // Track pages written by the guest (see ioctl_collect_dirty_bitmap).
   //
-  vp.ept_enable();
-  vp.ept().map_identity();
+  if (hypervisor::dirty_tracking_enabled())
+  {
+    vp.pml_enable(hypervisor::dirty_bitmap(vp.cpu_index()));
+  }
+
+  //
+  // Track pages accessed by the guest (see ioctl_collect_access_bitmap).
+  //
+  if (hypervisor::access_tracking_enabled())
+  {
+    vp.ept_access_dirty_enable();
+  }
+
+#ifdef HVPP_ENABLE_EXIT_TIMING
+  //
+  // Sample VM-exits whose handler took more than ~1M TSC ticks
+  // (see ioctl_query_exit_profile).
+  //
+  vp.exit_profiling_enable(1'000'000);
+#endif
+
+  //
+  // Uncomment this to handle WBINVD and standard CPUID leaves 0-7
+  // directly in vcpu.asm (see vcpu_fast_path_t).  Such VM-exits are
+  // never seen by VM-exit handlers.
+  //
+  // vp.fast_path().enable(vmx::exit_reason::execute_wbinvd);
+  // vp.fast_path().enable(vmx::exit_reason::execute_cpuid);
+  // for (uint32_t leaf = 0; leaf < 8; ++leaf)
+  // {
+  //   vp.fast_path().enable_cpuid(leaf);
+  // }
+
+  //
+  // Capture the CPUID table of this CPU.
+  //
+  cpuid_policy_.setup(vp);
 
 #if 1
   //
   // Enable exitting on 0x64 I/O port (keyboard).
+  // The I/O bitmaps of the policy are the same for all VCPUs - they're
+  // referenced instead of copied into each VCPU.
   //
   auto procbased_ctls = vp.processor_based_controls();
   procbased_ctls.use_io_bitmaps = true;
   vp.processor_based_controls(procbased_ctls);
 
-  vmx::io_bitmap_t io_bitmap{};
-  bitmap(io_bitmap.a).set(0x64);
-
-  vp.io_bitmap(io_bitmap);
+  io_policy_.setup(vp);
+  msr_policy_.setup(vp);
 #else
   //
   // Turn on VM-exit on everything we support.
@@ -39,6 +157,12 @@ void vmexit_custom_handler::setup(vcpu_t& vp) noexcept
   // this in VMWare makes the guest OS completely bananas.
   //
   // procbased_ctls.rdtsc_exiting = true;
+  //
+  // TSC offsetting doesn't need any VM-exit at all - uncomment this
+  // to hide the time spent in the hypervisor from the guest.  Note that
+  // TSCs of different CPUs then drift apart (see vcpu_t::tsc_offset()).
+  //
+  // vp.tsc_hide_root_time(true);
 
   //
   // Use either "use_io_bitmaps" or "unconditional_io_exiting",
@@ -59,6 +183,12 @@ void vmexit_custom_handler::setup(vcpu_t& vp) noexcept
   procbased_ctls.invlpg_exiting = true;
   vp.processor_based_controls(procbased_ctls);
 
+  //
+  // Only the first MOV DR is intercepted - debuggers access debug
+  // registers way too often.
+  //
+  vp.dr_lazy(true);
+
   auto procbased_ctls2 = vp.processor_based_controls2();
   procbased_ctls2.descriptor_table_exiting = true;
   vp.processor_based_controls2(procbased_ctls2);
@@ -127,12 +257,64 @@ void vmexit_custom_handler::setup(vcpu_t& vp) noexcept
   // register value.  Only read from that register will return the
   // fake (aka "shadow") value.
   //
+  // Only bits which change the paging mode or caching are intercepted
+  // (see vcpu_t::cr0_intercept()) - frequent CR4 toggles (e.g. PGE flips
+  // which flush global translations) run natively.
+  //
 
-  vp.cr0_guest_host_mask(cr0_t{ ~0ull });
-  vp.cr4_guest_host_mask(cr4_t{ ~0ull });
+  cr0_t cr0{};
+  cr0.protection_enable = true;
+  cr0.paging_enable     = true;
+  cr0.cache_disable     = true;
+  cr0.not_write_through = true;
+  vp.cr0_intercept(cr0);
+
+  cr4_t cr4{};
+  cr4.physical_address_extension = true;
+  cr4.pcid_enable                = true;
+  cr4.smep_enable                = true;
+  vp.cr4_intercept(cr4);
 #endif
 }
 
+void vmexit_custom_handler::detach(vcpu_t& vp) noexcept
+{
+  //
+  // Drain the dirty log into the bitmap of this handler and forget the
+  // command ring registered by the guest - the next handler doesn't
+  // know about either of them.
+  //
+  vp.pml_disable();
+
+#ifdef HVPP_ENABLE_EXIT_TIMING
+  vp.exit_profiling_disable();
+#endif
+
+  auto& data = per_vcpu_[vp.cpu_index()];
+
+  if (data.ring)
+  {
+    data.ring_window->unmap();
+    data.ring = nullptr;
+  }
+
+  data.drained = 0;
+
+  base_type::detach(vp);
+}
+
+void vmexit_custom_handler::handle(vcpu_t& vp) noexcept
+{
+  //
+  // Drain the command ring first - this is what makes it exit-less for
+  // the guest (see hypercall::ring_t).
+  //
+  auto& data = per_vcpu_[vp.cpu_index()];
+  data.drained = data.ring ? ring_drain(vp) : 0;
+
+  vmexit_static_handler::handle(vp);
+}
+
 void vmexit_custom_handler::handle_execute_cpuid(vcpu_t& vp) noexcept
 {
   if (vp.exit_context().eax == 'ppvh')
@@ -145,60 +327,285 @@ void vmexit_custom_handler::handle_execute_cpuid(vcpu_t& vp) noexcept
     vp.exit_context().rcx = 'h mo';
     vp.exit_context().rdx = 'ppv';
   }
-  else
+  else if (!cpuid_policy_.dispatch(vp))
   {
     base_type::handle_execute_cpuid(vp);
   }
 }
 
+void vmexit_custom_handler::handle_execute_io_instruction(vcpu_t& vp) noexcept
+{
+  if (!io_policy_.dispatch(vp))
+  {
+    base_type::handle_execute_io_instruction(vp);
+  }
+}
+
+void vmexit_custom_handler::handle_execute_rdmsr(vcpu_t& vp) noexcept
+{
+  if (!msr_policy_.rdmsr(vp))
+  {
+    base_type::handle_execute_rdmsr(vp);
+  }
+}
+
+void vmexit_custom_handler::handle_execute_wrmsr(vcpu_t& vp) noexcept
+{
+  if (!msr_policy_.wrmsr(vp))
+  {
+    base_type::handle_execute_wrmsr(vp);
+  }
+}
+
 void vmexit_custom_handler::handle_execute_vmcall(vcpu_t& vp) noexcept
 {
-  auto& data = data_[mp::cpu_index()];
+  //
+  // Hooks can be installed and removed only by the guest kernel - the
+  // VMCALLs below behave as unknown ones at CPL > 0.
+  //
+  if (vp.exit_context().rcx >= 0xc1 &&
+      vp.exit_context().rcx <= 0xc4 &&
+      !guest_cpl0(vp))
+  {
+    base_type::handle_execute_vmcall(vp);
+    return;
+  }
 
   switch (vp.exit_context().rcx)
   {
     case 0xc1:
       {
-        cr3_guard _(vp.guest_cr3());
-
-        data.page_read = pa_t::from_va(vp.exit_context().rdx_as_pointer);
-        data.page_exec = pa_t::from_va(vp.exit_context().r8_as_pointer);
+        hook_manager::hook_t hook{
+          vp.gva_to_gpa(vp.exit_context().r8_as_pointer),
+          vp.gva_to_gpa(vp.exit_context().rdx_as_pointer)
+        };
+
+        hvpp_trace_exit(vmx::exit_reason::execute_vmcall, "vmcall (hook) EXEC: 0x%p READ: 0x%p",
+                        hook.exec_pa.value(), hook.read_pa.value());
+
+        //
+        // Either page isn't mapped - there's nothing to hook (same as
+        // hypercall::operation_type::hook).
+        //
+        if (!hook.exec_pa || !hook.read_pa)
+        {
+          break;
+        }
+
+        //
+        // Installing the same hook again (by the VMCALL executed on the
+        // other CPUs) just updates it.
+        //
+        hook_manager_.install(&hook, 1);
+        hook_manager_.sync(vp);
       }
+      break;
 
-      hvpp_trace("vmcall (hook) EXEC: 0x%p READ: 0x%p", data.page_exec.value(), data.page_read.value());
+    case 0xc2:
+      hvpp_trace_exit(vmx::exit_reason::execute_vmcall, "vmcall (unhook)");
 
       //
-      // Split the 2MB page where the code we want to hook resides.
+      // Hooked pages get read_write_execute access back.
       //
-      vp.ept().split_2mb_to_4kb(data.page_exec & ept_pd_t::mask, data.page_exec & ept_pd_t::mask);
+      hook_manager_.remove_all();
+      hook_manager_.sync(vp);
+      break;
 
-      //
-      // Set execute-only access on the page we want to hook.
-      //
-      vp.ept().map_4kb(data.page_exec, data.page_exec, epte_t::access_type::execute);
+    case 0xc3:
+      {
+        //
+        // Bulk install - RDX points to an array of (exec VA, read VA)
+        // pairs, R8 holds their count.  RAX receives the number of
+        // installed hooks.  The VMCALL 0xc4 then has to be executed on
+        // the other CPUs.  Installation stops at the first pair whose
+        // page isn't mapped.
+        //
+        struct hook_va_t
+        {
+          uint64_t exec_va;
+          uint64_t read_va;
+        };
+
+        constexpr size_t batch_size = 32;
+
+        hook_va_t hook_va[batch_size];
+        hook_manager::hook_t hook[batch_size];
+
+        const auto count = vp.exit_context().r8;
+        size_t installed = 0;
+
+        hvpp_trace_exit(vmx::exit_reason::execute_vmcall, "vmcall (hook bulk) count: %u", uint32_t(count));
+
+        for (size_t offset = 0; offset < count; offset += batch_size)
+        {
+          const auto batch_count = std::min<size_t>(count - offset, batch_size);
+          const auto batch_bytes = batch_count * sizeof(hook_va_t);
+          const auto array_va = va_t{ vp.exit_context().rdx + offset * sizeof(hook_va_t) };
+
+          if (vp.guest_read(array_va, hook_va, batch_bytes) != batch_bytes)
+          {
+            break;
+          }
+
+          size_t valid_count = 0;
+
+          while (valid_count < batch_count)
+          {
+            hook[valid_count].exec_pa = vp.gva_to_gpa(va_t{ hook_va[valid_count].exec_va });
+            hook[valid_count].read_pa = vp.gva_to_gpa(va_t{ hook_va[valid_count].read_va });
+
+            if (!hook[valid_count].exec_pa || !hook[valid_count].read_pa)
+            {
+              break;
+            }
+
+            valid_count += 1;
+          }
+
+          const auto batch_installed = valid_count
+            ? hook_manager_.install(hook, valid_count)
+            : 0;
+
+          installed += batch_installed;
+
+          if (batch_installed != batch_count)
+          {
+            break;
+          }
+        }
+
+        hook_manager_.sync(vp);
+        vp.exit_context().rax = installed;
+      }
+      break;
 
+    case 0xc4:
       //
-      // We've changed EPT structure - mappings derived from EPT need to be
-      // invalidated.
+      // Apply hooks installed on other CPUs to this VCPU.
       //
-      vmx::invept_single_context(vp.ept().ept_pointer());
-    break;
+      hook_manager_.sync(vp);
+      break;
 
-    case 0xc2:
-      hvpp_trace("vmcall (unhook)");
+    case hypercall::batch_id:
+      vp.exit_context().rax = hypercall_batch(vp);
+      break;
 
+    case hypercall::ring_register_id:
       //
-      // Merge the 4kb pages back to the original 2MB large page.
-      // Note that this will also automatically set the access
-      // rights to read_write_execute.
+      // Register (or unregister) the command ring of this CPU.
       //
-      vp.ept().join_4kb_to_2mb(data.page_exec & ept_pd_t::mask, data.page_exec & ept_pd_t::mask);
+      {
+        auto& data = per_vcpu_[vp.cpu_index()];
+
+        //
+        // Operations of the ring are privileged (see hypercall_execute())
+        // - only the guest kernel can register it.
+        //
+        if (!guest_cpl0(vp) || !data.ring_window->capacity())
+        {
+          vp.exit_context().rax = ~0ull;
+          break;
+        }
+
+        if (data.ring)
+        {
+          data.ring_window->unmap();
+          data.ring = nullptr;
+        }
+
+        if (vp.exit_context().rdx == 0)
+        {
+          vp.exit_context().rax = 0;
+          break;
+        }
+
+        const auto ring_va = va_t{ vp.exit_context().rdx };
+        const auto ring_pa = vp.gva_to_gpa(ring_va);
+
+        hvpp_trace_exit(vmx::exit_reason::execute_vmcall, "vmcall (ring) VA: 0x%p PA: 0x%p",
+                        ring_va.value(), ring_pa.value());
+
+        //
+        // The guest-physical address is the host-physical address as
+        // well (identity EPT, see attach()).  The page must be RAM which
+        // doesn't belong to the hypervisor.
+        //
+        // The guest must keep the page locked until it unregisters the
+        // ring (the hypervisor can't pin guest memory) - the page is
+        // accessed by its physical address, so if the guest frees it
+        // anyway, only the guest memory gets corrupted.
+        //
+        physical_memory_range range;
+        if ((ring_va.value() & page_mask) || !ring_pa ||
+            !mm::physical_memory_descriptor().find(ring_pa, range) ||
+            mm::va_from_pa(ring_pa.value()))
+        {
+          vp.exit_context().rax = ~0ull;
+          break;
+        }
+
+        const auto ring = reinterpret_cast<hypercall::ring_t*>(data.ring_window->map(ring_pa));
+
+        if (ring->signature != hypercall::ring_signature)
+        {
+          data.ring_window->unmap();
+          vp.exit_context().rax = ~0ull;
+          break;
+        }
+
+        data.ring = ring;
+        vp.exit_context().rax = 0;
+      }
+      break;
+
+    case hypercall::ring_doorbell_id:
+      {
+        auto& data = per_vcpu_[vp.cpu_index()];
 
+        vp.exit_context().rax = data.ring
+          ? data.drained + ring_drain(vp)
+          : ~0ull;
+      }
+      break;
+
+    case steal_time::register_id:
       //
-      // We've changed EPT structure - mappings derived from EPT
-      // need to be invalidated.
+      // Register (or unregister) the steal-time record of this CPU.
+      // The hypervisor writes into the record, therefore only the guest
+      // kernel can register it.
       //
-      vmx::invept_single_context(vp.ept().ept_pointer());
+      if (!guest_cpl0(vp))
+      {
+        vp.exit_context().rax = ~0ull;
+      }
+      else if (vp.exit_context().rdx == 0)
+      {
+        vp.steal_time_disable();
+        vp.exit_context().rax = 0;
+      }
+      else
+      {
+        const auto record_va = va_t{ vp.exit_context().rdx };
+        const auto record_pa = vp.gva_to_gpa(record_va);
+
+        hvpp_trace_exit(vmx::exit_reason::execute_vmcall, "vmcall (steal time) VA: 0x%p PA: 0x%p",
+                        record_va.value(), record_pa.value());
+
+        //
+        // The record is written through the guest memory window of the
+        // VCPU (by its physical address), so it must be RAM outside the
+        // hypervisor pool.  The hypervisor can't lock the page - the
+        // guest must keep it locked until it unregisters the record.
+        //
+        physical_memory_range range;
+        const bool success = (record_va.value() % alignof(steal_time::record_t)) == 0 &&
+                             record_pa &&
+                             mm::physical_memory_descriptor().find(record_pa, range) &&
+                             !mm::va_from_pa(record_pa.value()) &&
+                             !vp.steal_time_enable(record_pa);
+
+        vp.exit_context().rax = success ? 0 : ~0ull;
+      }
       break;
 
     default:
@@ -209,37 +616,12 @@ void vmexit_custom_handler::handle_execute_vmcall(vcpu_t& vp) noexcept
 
 void vmexit_custom_handler::handle_ept_violation(vcpu_t& vp) noexcept
 {
-  auto exit_qualification = vp.exit_qualification().ept_violation;
-  auto guest_pa = vp.exit_guest_physical_address();
-  auto guest_va = vp.exit_guest_linear_address();
-
-  auto& data = data_[mp::cpu_index()];
-
-  if (exit_qualification.data_read || exit_qualification.data_write)
-  {
-    //
-    // Someone requested read or write access to the guest_pa,
-    // but the page has execute-only access.  Map the page with
-    // the "data.page_read" we've saved before in the VMCALL
-    // handler and set the access to RW.
-    //
-    hvpp_trace("data_read LA: 0x%p PA: 0x%p", guest_va.value(), guest_pa.value());
-
-    vp.ept().map_4kb(data.page_exec, data.page_read, epte_t::access_type::read_write);
-  }
-  else if (exit_qualification.data_execute)
-  {
-    //
-    // Someone requested execute access to the guest_pa, but
-    // the page has only read-write access.  Map the page with
-    // the "data.page_execute" we've saved before in the VMCALL
-    // handler and set the access to execute-only.
-    //
-    hvpp_trace("data_execute LA: 0x%p PA: 0x%p", guest_va.value(), guest_pa.value());
-
-    vp.ept().map_4kb(data.page_exec, data.page_exec, epte_t::access_type::execute);
-  }
-
+  //
+  // Someone requested read or write access to the hooked page, which
+  // has execute-only access.  The hook manager maps the page with the
+  // "read" page we've received in the VMCALL handler and RW access - for
+  // this instruction only, the execute-only access is restored on the
+  // MTF VM-exit.
   //
   // An EPT violation invalidates any guest-physical mappings
   // (associated with the current EP4TA) that would be used to
@@ -266,10 +648,301 @@ void vmexit_custom_handler::handle_ept_violation(vcpu_t& vp) noexcept
   //     If we would change any other EPT structure, INVEPT or
   //     INVVPID might be needed.
   //
+  //   Note3:
+  //     Pages monitored by ept_dispatcher_ are checked first - their
+  //     callbacks are responsible for the EPT modifications.
+  //
+  if (!ept_dispatcher_.ept_violation(vp) &&
+      !hook_manager_.ept_violation(vp))
+  {
+    base_type::handle_ept_violation(vp);
+  }
+}
+
+void vmexit_custom_handler::handle_ept_misconfiguration(vcpu_t& vp) noexcept
+{
+  if (!ept_dispatcher_.ept_misconfiguration(vp))
+  {
+    base_type::handle_ept_misconfiguration(vp);
+  }
+}
+
+void vmexit_custom_handler::handle_monitor_trap_flag(vcpu_t& vp) noexcept
+{
+  if (!hook_manager_.monitor_trap_flag(vp))
+  {
+    base_type::handle_monitor_trap_flag(vp);
+  }
+}
+
+bool vmexit_custom_handler::guest_cpl0(vcpu_t& vp) noexcept
+{
+  //
+  // CPL is the DPL of SS (CS.RPL doesn't have to match the CPL, e.g.
+  // with conforming code segments).
+  // (ref: Vol3C[24.4.1(Guest Register State)])
+  //
+  return vp.guest_ss().access.descriptor_privilege_level == 0;
+}
+
+auto vmexit_custom_handler::hypercall_batch(vcpu_t& vp) noexcept -> uint64_t
+{
+  using namespace hypercall;
+
+  constexpr uint64_t rejected = ~0ull;
+  constexpr uint32_t batch_size = 16;
+
+  const auto buffer_va   = vp.exit_context().rdx;
+  const auto buffer_size = vp.exit_context().r8;
+
+  //
+  // Validate the header (and the size of the whole buffer) only once.
+  //
+  header_t header;
+
+  if (buffer_size < sizeof(header) ||
+      vp.guest_read(va_t{ buffer_va }, &header, sizeof(header)) != sizeof(header) ||
+      header.signature != batch_signature ||
+      header.operation_count > max_operation_count ||
+      buffer_size < sizeof(header) + uint64_t(header.operation_count) * sizeof(operation_t))
+  {
+    hvpp_trace_exit(vmx::exit_reason::execute_vmcall, "vmcall (batch) rejected");
+    return rejected;
+  }
+
+  hvpp_trace_exit(vmx::exit_reason::execute_vmcall, "vmcall (batch) count: %u", header.operation_count);
+
+  operation_t operation[batch_size];
+  uint32_t processed = 0;
+
+  bool hooks_modified = false;
 
   //
-  // Make the instruction which fetched the memory to be executed
-  // again (this time without EPT violation).
+  // Privileged operations are allowed only from the guest kernel.
   //
-  vp.suppress_rip_adjust();
+  const bool privileged = guest_cpl0(vp);
+
+  while (processed < header.operation_count)
+  {
+    const auto batch_count = std::min(header.operation_count - processed, batch_size);
+    const auto batch_bytes = batch_count * sizeof(operation_t);
+    const auto batch_va = va_t{ buffer_va + sizeof(header) + processed * sizeof(operation_t) };
+
+    if (vp.guest_read(batch_va, operation, batch_bytes) != batch_bytes)
+    {
+      break;
+    }
+
+    for (uint32_t i = 0; i < batch_count; ++i)
+    {
+      operation[i].result = 0;
+      operation[i].status = hypercall_execute(vp, operation[i], privileged, hooks_modified);
+    }
+
+    if (vp.guest_write(batch_va, operation, batch_bytes) != batch_bytes)
+    {
+      break;
+    }
+
+    processed += batch_count;
+  }
+
+  //
+  // EPT changes of the batch are covered by single INVEPT at the end
+  // of the VM-exit (see ept_t::flush_if_needed()).
+  //
+
+  if (hooks_modified)
+  {
+    hook_manager_.sync(vp);
+  }
+
+  return processed;
+}
+
+auto vmexit_custom_handler::ring_drain(vcpu_t& vp) noexcept -> uint32_t
+{
+  using namespace hypercall;
+
+  auto ring = per_vcpu_[vp.cpu_index()].ring;
+
+  uint32_t tail = ring->tail;
+  const uint32_t head = ring->head;
+
+  if (head == tail)
+  {
+    return 0;
+  }
+
+  //
+  // Guest which moved the head too far is served only up to the capacity
+  // of the ring - stale entries are executed again at worst.
+  //
+  const auto count = std::min(head - tail, ring_t::entry_count);
+
+  bool hooks_modified = false;
+
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  for (uint32_t i = 0; i < count; ++i, ++tail)
+  {
+    //
+    // Execute a copy - the guest may rewrite the entry meanwhile.
+    //
+    auto& entry = ring->entry[tail % ring_t::entry_count];
+    operation_t operation = entry;
+
+    //
+    // Only the guest kernel can register the ring (see
+    // handle_execute_vmcall()).
+    //
+    operation.result = 0;
+    operation.status = hypercall_execute(vp, operation, true, hooks_modified);
+
+    entry.status = operation.status;
+    entry.result = operation.result;
+  }
+
+  if (hooks_modified)
+  {
+    hook_manager_.sync(vp);
+  }
+
+  //
+  // Publish the statuses before the slots are handed back to the guest.
+  //
+  std::atomic_thread_fence(std::memory_order_release);
+  ring->drained = ring->drained + count;
+  ring->tail = tail;
+
+  return count;
+}
+
+auto vmexit_custom_handler::hypercall_execute(vcpu_t& vp, hypercall::operation_t& operation,
+                                              bool privileged, bool& hooks_modified) noexcept -> hypercall::status_code
+{
+  using namespace hypercall;
+
+  if (!privileged &&
+      (operation.type == operation_type::map     ||
+       operation.type == operation_type::protect ||
+       operation.type == operation_type::hook    ||
+       operation.type == operation_type::unhook))
+  {
+    return status_code::access_denied;
+  }
+
+  //
+  // Access rights are passed as R/W/X bits.  Write access without read
+  // access would cause EPT misconfiguration.
+  //
+  const auto access_valid = [](uint64_t access) {
+    return access <= 7 && !((access & 2) && !(access & 1));
+  };
+
+  auto& ept = vp.ept(vp.ept_index());
+
+  switch (operation.type)
+  {
+    case operation_type::none:
+      return status_code::success;
+
+    case operation_type::map:
+      {
+        const auto guest_pa = pa_t{ operation.argument[0] };
+        const auto host_pa  = pa_t{ operation.argument[1] };
+
+        if ((guest_pa.value() & page_mask) ||
+            (host_pa.value() & page_mask) ||
+            !access_valid(operation.argument[2]))
+        {
+          return status_code::invalid_argument;
+        }
+
+        //
+        // The host page must be RAM (not MMIO) and it must not belong to
+        // the hypervisor (its pool holds the VMCS, the EPT tables...).
+        //
+        physical_memory_range range;
+        if (!mm::physical_memory_descriptor().find(host_pa, range) ||
+            mm::va_from_pa(host_pa.value()))
+        {
+          return status_code::invalid_address;
+        }
+
+        ept.split_1gb_to_2mb(guest_pa & ept_pdpt_t::mask, guest_pa & ept_pdpt_t::mask);
+        ept.split_2mb_to_4kb(guest_pa & ept_pd_t::mask, guest_pa & ept_pd_t::mask);
+
+        if (!ept.map_4kb(guest_pa, host_pa, epte_t::access_type(operation.argument[2])))
+        {
+          return status_code::no_resources;
+        }
+      }
+      return status_code::success;
+
+    case operation_type::protect:
+      {
+        const auto guest_pa = pa_t{ operation.argument[0] };
+        const auto size     = operation.argument[1];
+
+        if ((guest_pa.value() & page_mask) ||
+            (size & page_mask) ||
+            !access_valid(operation.argument[2]))
+        {
+          return status_code::invalid_argument;
+        }
+
+        operation.result = ept.protect_range(guest_pa, size, epte_t::access_type(operation.argument[2]));
+      }
+      return status_code::success;
+
+    case operation_type::hook:
+      {
+        const hook_manager::hook_t hook{
+          vp.gva_to_gpa(va_t{ operation.argument[0] }),
+          vp.gva_to_gpa(va_t{ operation.argument[1] })
+        };
+
+        if (!hook.exec_pa || !hook.read_pa)
+        {
+          return status_code::invalid_address;
+        }
+
+        if (hook_manager_.install(&hook, 1) != 1)
+        {
+          return status_code::no_resources;
+        }
+
+        hooks_modified = true;
+      }
+      return status_code::success;
+
+    case operation_type::unhook:
+      {
+        const auto exec_pa = vp.gva_to_gpa(va_t{ operation.argument[0] });
+
+        if (!exec_pa)
+        {
+          return status_code::invalid_address;
+        }
+
+        operation.result = hook_manager_.remove(&exec_pa, 1);
+        hooks_modified |= operation.result != 0;
+      }
+      return status_code::success;
+
+    case operation_type::stats_query:
+      switch (stats_id(operation.argument[0]))
+      {
+        case stats_id::hook_count:      operation.result = hook_manager_.hook_count(); break;
+        case stats_id::allocated_bytes: operation.result = mm::allocated_bytes();      break;
+        case stats_id::free_bytes:      operation.result = mm::free_bytes();           break;
+        default:
+          return status_code::invalid_argument;
+      }
+      return status_code::success;
+
+    default:
+      return status_code::invalid_operation;
+  }
 }
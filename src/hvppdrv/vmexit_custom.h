@@ -1,32 +1,129 @@
 #pragma once
 #include <hvpp/config.h>
+#include <hvpp/cpuid_policy.h>
+#include <hvpp/ept_dispatcher.h>
+#include <hvpp/hook_manager.h>
+#include <hvpp/io_policy.h>
+#include <hvpp/msr_policy.h>
+#include <hvpp/mtrr_tracker.h>
 #include <hvpp/vcpu.h>
 #include <hvpp/vmexit.h>
 #include <hvpp/vmexit/vmexit_stats.h>
 #include <hvpp/vmexit/vmexit_dbgbreak.h>
+#include <hvpp/vmexit/vmexit_governor.h>
 #include <hvpp/vmexit/vmexit_passthrough.h>
+#include <hvpp/vmexit/vmexit_recorder.h>
+#include <hvpp/vmexit/vmexit_static.h>
+#include <hvpp/lib/hypercall.h>
+#include <hvpp/lib/per_cpu.h>
+#include <hvpp/lib/steal_time.h>
 
 using namespace ia32;
 using namespace hvpp;
 
+//
+// Hot VM-exits (CPUID, RDMSR, I/O, ...) are dispatched statically
+// (see vmexit_static_handler).
+//
+
 class vmexit_custom_handler
-  : public vmexit_passthrough_handler
+  : public vmexit_static_handler<vmexit_custom_handler, vmexit_passthrough_handler>
 {
   public:
     using base_type = vmexit_passthrough_handler;
 
-    void setup(vcpu_t& vp) noexcept override;
+    vmexit_custom_handler() noexcept;
+    ~vmexit_custom_handler() noexcept override;
+
+    //
+    // Compile the I/O policy - must be called (at PASSIVE_LEVEL) before
+    // the hypervisor is started.
+    //
+    auto initialize() noexcept -> error_code_t;
+
+    void attach(vcpu_t& vp) noexcept override;
+    void detach(vcpu_t& vp) noexcept override;
+    void handle(vcpu_t& vp) noexcept override;
 
     void handle_execute_cpuid(vcpu_t& vp) noexcept override;
+    void handle_execute_io_instruction(vcpu_t& vp) noexcept override;
+    void handle_execute_rdmsr(vcpu_t& vp) noexcept override;
+    void handle_execute_wrmsr(vcpu_t& vp) noexcept override;
     void handle_execute_vmcall(vcpu_t& vp) noexcept override;
     void handle_ept_violation(vcpu_t& vp) noexcept override;
+    void handle_ept_misconfiguration(vcpu_t& vp) noexcept override;
+    void handle_monitor_trap_flag(vcpu_t& vp) noexcept override;
 
   private:
-    struct per_vcpu_data
+    //
+    // Process the batched hypercall (see hypercall.h).  Returns number
+    // of processed operations, or ~0 if the batch has been rejected.
+    //
+    auto hypercall_batch(vcpu_t& vp) noexcept -> uint64_t;
+    auto hypercall_execute(vcpu_t& vp, hypercall::operation_t& operation,
+                           bool privileged, bool& hooks_modified) noexcept -> hypercall::status_code;
+
+    //
+    // Returns true if the guest runs at CPL 0.
+    //
+    static bool guest_cpl0(vcpu_t& vp) noexcept;
+
+    //
+    // Execute operations queued in the command ring of this VCPU (see
+    // hypercall::ring_t).  Returns number of executed operations.
+    //
+    auto ring_drain(vcpu_t& vp) noexcept -> uint32_t;
+
+    struct per_vcpu_t
     {
-      pa_t page_read;
-      pa_t page_exec;
+      //
+      // Command ring registered by the guest (mapped through
+      // ring_window), or nullptr.
+      //
+      hypercall::ring_t* ring;
+
+      //
+      // Window through which the ring page is accessed - the page is
+      // referenced by its physical address, so it doesn't depend on
+      // any guest mapping.
+      //
+      mapping_t*         ring_window;
+
+      //
+      // Operations drained at the beginning of the current VM-exit.
+      //
+      uint32_t           drained;
     };
 
-    per_vcpu_data data_[32];
+    per_cpu<per_vcpu_t> per_vcpu_;
+
+    //
+    // Invisible EPT hooks shared by all VCPUs (see hook_manager).
+    //
+    hook_manager hook_manager_;
+
+    //
+    // Per-page EPT fault callbacks (see ept_dispatcher).
+    //
+    ept_dispatcher ept_dispatcher_;
+
+    //
+    // CPUID leaves served from the per-VCPU table (see cpuid_policy).
+    //
+    cpuid_policy cpuid_policy_;
+
+    //
+    // I/O ports intercepted by all VCPUs (see io_policy).
+    //
+    io_policy io_policy_;
+
+    //
+    // MSRs intercepted by all VCPUs (see msr_policy).
+    //
+    msr_policy msr_policy_;
+
+    //
+    // Re-stamps EPT memory types on MTRR writes (see mtrr_tracker).
+    //
+    mtrr_tracker mtrr_tracker_;
 };
@@ -102,19 +102,23 @@ HvppHandleEptViolation(
   _In_ PVOID Passthrough
   )
 {
-  UNREFERENCED_PARAMETER(Passthrough);
+  //
+  // Exit qualification, guest addresses and the current EPT have been
+  // already read by hvpp (see VMEXIT_SNAPSHOT).
+  //
+  PVMEXIT_SNAPSHOT Snapshot = HvppVmExitSnapshot(Passthrough);
 
   VMX_EXIT_QUALIFICATION_EPT_VIOLATION EptViolation;
   PHYSICAL_ADDRESS GuestPhysicalAddress;
   PVOID GuestLinearAddress;
 
-  EptViolation.Flags            =           HvppVmRead(VMCS_VMEXIT_QUALIFICATION);
-  GuestPhysicalAddress.QuadPart = (LONGLONG)HvppVmRead(VMCS_VMEXIT_GUEST_PHYSICAL_ADDRESS);
-  GuestLinearAddress            = (PVOID)   HvppVmRead(VMCS_VMEXIT_GUEST_LINEAR_ADDRESS);
+  EptViolation.Flags   = Snapshot->Qualification;
+  GuestPhysicalAddress = Snapshot->GuestPhysicalAddress;
+  GuestLinearAddress   = Snapshot->GuestLinearAddress;
 
-  PEPT Ept = HvppVcpuGetCurrentEpt(Vcpu);
+  PEPT Ept = Snapshot->Ept;
 
-  PPER_VCPU_DATA Data = &PerVcpuData[KeGetCurrentProcessorNumberEx(NULL)];
+  PPER_VCPU_DATA Data = &PerVcpuData[Snapshot->ProcessorIndex];
 
   if (EptViolation.DataRead || EptViolation.DataWrite)
   {